@@ -20,6 +20,7 @@
 #include "drivers/llgpio.h"
 #include "gpio.h"
 
+#include "drivers/trace.h"
 #include "drivers/spi.h"
 #include "drivers/usb.h"
 //#include "drivers/uart.h"
@@ -30,6 +31,8 @@
 #include "drivers/can.h"
 #endif
 
+#include "drivers/crc.h"
+
 int puts(const char *a) { return 0; }
 void puth(unsigned int i) {}
 
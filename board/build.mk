@@ -1,9 +1,16 @@
 CFLAGS += -I inc -I ../ -nostdlib -fno-builtin -std=gnu11 -O2
 CFLAGS += -Tstm32_flash.ld
 
+# PERF=1 links with LTO and drops the unused functions and data
+ifeq ($(PERF),1)
+  CFLAGS += -flto -ffunction-sections -fdata-sections -Wl,--gc-sections
+endif
+
 CC = arm-none-eabi-gcc
 OBJCOPY = arm-none-eabi-objcopy
 OBJDUMP = arm-none-eabi-objdump
+SIZE = arm-none-eabi-size
+NM = arm-none-eabi-nm
 
 ifeq ($(RELEASE),1)
   CERT = ../../pandaextra/certs/release
@@ -24,6 +31,11 @@ ota: obj/$(PROJ_NAME).bin
 
 bin: obj/$(PROJ_NAME).bin
 
+# flash and RAM by section, then what RAMFUNC put in RAM
+size: obj/$(PROJ_NAME).bin
+	$(SIZE) -A obj/$(PROJ_NAME).elf
+	$(NM) -S --size-sort obj/$(PROJ_NAME).elf | grep -i " t " | awk '$$1 ~ /^2/'
+
 # this flashes everything
 recover: obj/bootstub.$(PROJ_NAME).bin obj/$(PROJ_NAME).bin
 	-PYTHONPATH=../ python -c "from python import Panda; Panda().reset(enter_bootloader=True)"
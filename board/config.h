@@ -4,6 +4,8 @@
 //#define DEBUG
 //#define DEBUG_USB
 //#define DEBUG_SPI
+// cycle counts of the IRQ handlers, read with 0xf7
+//#define PROFILE
 
 #ifdef STM32F4
   #define PANDA
@@ -8,20 +8,64 @@
 #define ADCCHAN_VOLTAGE 12
 #define ADCCHAN_CURRENT 13
 
+// The scanned channels convert continuously, DMA2 stream 0 keeps the last
+// ADC_OVERSAMPLE rounds of them in adc_samples and adc_get averages those, so
+// it never waits on the ADC. Other channels still take a blocking injected
+// conversion.
+
+#ifdef PEDAL
+  const uint8_t adc_scan[] = {ADCCHAN_ACCEL0, ADCCHAN_ACCEL1, ADCCHAN_VOLTAGE, ADCCHAN_CURRENT};
+#else
+  const uint8_t adc_scan[] = {ADCCHAN_VOLTAGE, ADCCHAN_CURRENT};
+#endif
+#define ADC_SCAN_LEN (sizeof(adc_scan) / sizeof(adc_scan[0]))
+
+// samples averaged per reading, a power of two. 1 is the latest sample.
+#define ADC_OVERSAMPLE 8
+
+volatile uint16_t adc_samples[ADC_OVERSAMPLE][ADC_SCAN_LEN];
+
 void adc_init() {
   // global setup
   ADC->CCR = ADC_CCR_TSVREFE | ADC_CCR_VBATE;
   //ADC1->CR2 = ADC_CR2_ADON | ADC_CR2_EOCS | ADC_CR2_DDS;
   ADC1->CR2 = ADC_CR2_ADON;
 
-  // long
-  //ADC1->SMPR1 = ADC_SMPR1_SMP10 | ADC_SMPR1_SMP11 | ADC_SMPR1_SMP12 | ADC_SMPR1_SMP13;
-  ADC1->SMPR1 = ADC_SMPR1_SMP12 | ADC_SMPR1_SMP13;
+  // long, less noise on the sense lines and the pedal
+  ADC1->SMPR1 = ADC_SMPR1_SMP10 | ADC_SMPR1_SMP11 | ADC_SMPR1_SMP12 | ADC_SMPR1_SMP13;
+
+  // regular sequence of the scanned channels, 5 bits each
+  ADC1->SQR1 = (ADC_SCAN_LEN - 1) << 20;
+  ADC1->SQR2 = 0;
+  ADC1->SQR3 = 0;
+  for (int i = 0; i < ADC_SCAN_LEN; i++) ADC1->SQR3 |= adc_scan[i] << (i * 5);
+
+  // DMA2 stream 0 channel 0 is ADC1, halfwords round and round the array
+  DMA2_Stream0->CR &= ~DMA_SxCR_EN;
+  while (DMA2_Stream0->CR & DMA_SxCR_EN);
+  DMA2_Stream0->PAR = (uint32_t)&ADC1->DR;
+  DMA2_Stream0->M0AR = (uint32_t)adc_samples;
+  DMA2_Stream0->NDTR = ADC_OVERSAMPLE * ADC_SCAN_LEN;
+  DMA2_Stream0->CR = DMA_SxCR_MSIZE_0 | DMA_SxCR_PSIZE_0 | DMA_SxCR_MINC | DMA_SxCR_CIRC | DMA_SxCR_EN;
+
+  ADC1->SR &= ~ADC_SR_OVR;
+  ADC1->CR1 = ADC_CR1_SCAN;
+  ADC1->CR2 = ADC_CR2_ADON | ADC_CR2_CONT | ADC_CR2_DMA | ADC_CR2_DDS;
+  // the ADC needs a few us after ADON before it converts
+  delay(1000);
+  ADC1->CR2 |= ADC_CR2_SWSTART;
 }
 
 uint32_t adc_get(int channel) {
-  // includes length
-  //ADC1->SQR1 = 0;
+  // an overrun stops the DMA requests until the scan is set up again
+  if (ADC1->SR & ADC_SR_OVR) adc_init();
+
+  for (int i = 0; i < ADC_SCAN_LEN; i++) {
+    if (adc_scan[i] != channel) continue;
+    uint32_t sum = 0;
+    for (int j = 0; j < ADC_OVERSAMPLE; j++) sum += adc_samples[j][i];
+    return sum / ADC_OVERSAMPLE;
+  }
 
   // select channel
   ADC1->JSQR = channel << 15;
@@ -35,4 +79,3 @@ uint32_t adc_get(int channel) {
 
   return ADC1->JDR1;
 }
-
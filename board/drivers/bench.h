@@ -0,0 +1,133 @@
+// microbenchmarks of the firmware's primitives, built by make bench and run
+// with 0xc5
+//
+// Each one calls a primitive on made up data with interrupts off and keeps
+// the cycles of every call from DWT->CYCCNT, like a profile probe:
+// count, min, max and sum with profile_read's layout. BENCH_EMPTY times
+// nothing, its min is the cost of the timing itself. Everything runs on
+// scratch copies, the live queues and the safety mode are left alone.
+// USB_WritePacket and process_can touch the hardware, they're timed on real
+// traffic by their PROFILE probes instead, which the bench build has on.
+
+#ifndef PROFILE
+  #error "the bench build needs PROFILE, for DWT->CYCCNT and profile_stat"
+#endif
+
+#include "crypto/sha.h"
+
+#define BENCH_EMPTY 0
+#define BENCH_CAN_PUSH 1
+#define BENCH_CAN_POP 2
+#define BENCH_MEMCPY_16 3  // a mailbox
+#define BENCH_MEMCPY_64 4  // a USB packet
+#define BENCH_MEMCPY_256 5
+#define BENCH_SHA_64 6     // one SHA-1 block, with its padding block
+#define BENCH_SHA_1024 7
+// then rx and tx of each mode in safety_hook_registry, in its order
+#define BENCH_SAFETY 8
+#define BENCH_LEN (BENCH_SAFETY + (2 * HOOK_CONFIG_COUNT))
+
+#define BENCH_RUNS 100
+#define BENCH_RUNS_MAX 1000
+
+profile_stat bench_stat;
+CAN_FIFOMailBox_TypeDef bench_elems[4];
+can_ring bench_ring = { .w_ptr = 0, .r_ptr = 0, .fifo_size = 4, .elems = bench_elems, .timestamps = NULL };
+uint32_t bench_buf[2][1024 / 4];
+safety_state bench_safety;
+
+// PRIMASK directly like profile_add, nothing can preempt a timed call
+#define BENCH_TIME(x) do { \
+    uint32_t bench_primask = __get_PRIMASK(); \
+    __disable_irq(); \
+    uint32_t bench_start = DWT->CYCCNT; \
+    x; \
+    uint32_t bench_cycles = DWT->CYCCNT - bench_start; \
+    __set_PRIMASK(bench_primask); \
+    bench_add(bench_cycles); \
+  } while (0)
+
+void bench_add(uint32_t cycles) {
+  bench_stat.count += 1;
+  bench_stat.sum += cycles;
+  if (cycles < bench_stat.min) bench_stat.min = cycles;
+  if (cycles > bench_stat.max) bench_stat.max = cycles;
+}
+
+// a frame on the first id the hooks look at, 0x100 if they take every id
+void bench_safety_frame(CAN_FIFOMailBox_TypeDef *f, const uint16_t *ids) {
+  uint32_t addr = ids ? ids[0] : 0x100;
+  f->RIR = addr << 21;
+  f->RDTR = 8;
+  f->RDLR = 0;
+  f->RDHR = 0;
+}
+
+// runs benchmark n and returns its stats with profile_read's layout, called
+// from the USB IRQ so the bus waits while it runs
+int bench_run(int n, int runs, uint8_t *out) {
+  if (n < 0 || n >= BENCH_LEN) return 0;
+  if (runs <= 0) runs = BENCH_RUNS;
+  if (runs > BENCH_RUNS_MAX) runs = BENCH_RUNS_MAX;
+
+  bench_stat.count = 0;
+  bench_stat.min = 0xFFFFFFFF;
+  bench_stat.max = 0;
+  bench_stat.sum = 0;
+
+  CAN_FIFOMailBox_TypeDef f = {.RIR = 0x123 << 21, .RDTR = 8, .RDLR = 0x03020100, .RDHR = 0x07060504};
+  uint8_t *src = (uint8_t *)bench_buf[0];
+  uint8_t *dst = (uint8_t *)bench_buf[1];
+  uint8_t digest[SHA_DIGEST_SIZE];
+  const safety_hooks *hooks = NULL;
+  if (n >= BENCH_SAFETY) {
+    const safety_hook_config *c = &safety_hook_registry[(n - BENCH_SAFETY) / 2];
+    safety_state_set_mode(&bench_safety, c->id, 0);
+    hooks = bench_safety.hooks;
+    bench_safety_frame(&f, ((n - BENCH_SAFETY) & 1) ? hooks->tx_ids : hooks->rx_ids);
+  }
+  can_clear(&bench_ring);
+
+  for (int i = 0; i < runs; i++) {
+    switch (n) {
+      case BENCH_EMPTY:
+        BENCH_TIME();
+        break;
+      case BENCH_CAN_PUSH:
+        BENCH_TIME(can_push(&bench_ring, &f));
+        can_pop(&bench_ring, &f);
+        break;
+      case BENCH_CAN_POP:
+        can_push(&bench_ring, &f);
+        BENCH_TIME(can_pop(&bench_ring, &f));
+        break;
+      case BENCH_MEMCPY_16:
+        BENCH_TIME(memcpy(dst, src, 16));
+        break;
+      case BENCH_MEMCPY_64:
+        BENCH_TIME(memcpy(dst, src, 64));
+        break;
+      case BENCH_MEMCPY_256:
+        BENCH_TIME(memcpy(dst, src, 256));
+        break;
+      case BENCH_SHA_64:
+        BENCH_TIME(SHA_hash(src, 64, digest));
+        break;
+      case BENCH_SHA_1024:
+        BENCH_TIME(SHA_hash(src, 1024, digest));
+        break;
+      default:
+        if ((n - BENCH_SAFETY) & 1) {
+          if (hooks->tx) BENCH_TIME(hooks->tx(&bench_safety, &f));
+        } else {
+          if (hooks->rx) BENCH_TIME(hooks->rx(&bench_safety, &f));
+        }
+        break;
+    }
+  }
+
+  uint32_t res[5] = {bench_stat.count, bench_stat.count ? bench_stat.min : 0, bench_stat.max,
+                     bench_stat.sum & 0xFFFFFFFF, bench_stat.sum >> 32};
+  memcpy(out, res, sizeof(res));
+  return sizeof(res);
+}
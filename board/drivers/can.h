@@ -5,63 +5,323 @@
 
 int can_live = 0, pending_can_live = 0, can_loopback = 0, can_silent = ALL_CAN_SILENT;
 
+// by default bxCAN sends the pending mailbox with the lowest identifier first,
+// set this to send the mailboxes in the order they were requested (TXFP)
+int can_tx_in_order = 0;
+
 // ********************* instantiate queues *********************
 
-#define can_buffer(x, size) \
-  CAN_FIFOMailBox_TypeDef elems_##x[size]; \
-  can_ring can_##x = { .w_ptr = 0, .r_ptr = 0, .fifo_size = size, .elems = (CAN_FIFOMailBox_TypeDef *)&elems_##x };
+// each bus has an RX queue and a TX queue, all carved out of one pool and
+// re-split by 0xff. By default RX gets 0x1000 shared evenly and each TX
+// queue 0x100.
+#define CAN_RX_DEFAULT_LEN (0x1000 / BUS_MAX)
+#define CAN_TX_DEFAULT_LEN 0x100
+#define CAN_POOL_LEN (BUS_MAX * (CAN_RX_DEFAULT_LEN + CAN_TX_DEFAULT_LEN))
+
+HIGH_RAM CAN_FIFOMailBox_TypeDef can_pool[CAN_POOL_LEN];
+// alongside the pool, only the RX queues use theirs
+uint32_t can_pool_timestamps[CAN_POOL_LEN];
+
+#define CAN_POOL_RX(bus) \
+  { .w_ptr = 0, .r_ptr = 0, .fifo_size = CAN_RX_DEFAULT_LEN, .elems = &can_pool[(bus) * CAN_RX_DEFAULT_LEN], \
+    .timestamps = &can_pool_timestamps[(bus) * CAN_RX_DEFAULT_LEN] }
+#define can_pool_tx(x, bus) \
+  can_ring can_##x = { .w_ptr = 0, .r_ptr = 0, .fifo_size = CAN_TX_DEFAULT_LEN, \
+    .elems = &can_pool[(BUS_MAX * CAN_RX_DEFAULT_LEN) + ((bus) * CAN_TX_DEFAULT_LEN)], .timestamps = NULL };
 
-can_buffer(rx_q, 0x1000)
-can_buffer(tx1_q, 0x100)
-can_buffer(tx2_q, 0x100)
+can_pool_tx(tx1_q, 0)
+can_pool_tx(tx2_q, 1)
 
 #ifdef PANDA
-  can_buffer(tx3_q, 0x100)
-  can_buffer(txgmlan_q, 0x100)
+  can_ring can_rx_qs[BUS_MAX] = {CAN_POOL_RX(0), CAN_POOL_RX(1), CAN_POOL_RX(2), CAN_POOL_RX(3)};
+  can_pool_tx(tx3_q, 2)
+  can_pool_tx(txgmlan_q, 3)
   can_ring *can_queues[] = {&can_tx1_q, &can_tx2_q, &can_tx3_q, &can_txgmlan_q};
 #else
+  can_ring can_rx_qs[BUS_MAX] = {CAN_POOL_RX(0), CAN_POOL_RX(1)};
   can_ring *can_queues[] = {&can_tx1_q, &can_tx2_q};
 #endif
 
-// ********************* interrupt safe queue *********************
+// ********************* lock-free queue *********************
+
+// Every ring has exactly one producer and one consumer context. All the CAN
+// and USB IRQs run at the same NVIC priority and never preempt each other,
+// so the producers of an RX queue (CAN RX/TX IRQs) act as a single producer.
+// The element is written before w_ptr is published, and read before r_ptr
+// is released, with a barrier in between, so no critical section is needed.
+
+// the sizes come from 0xff and needn't be powers of two
+RAMFUNC uint32_t can_ring_used(can_ring *q) {
+  uint32_t w_ptr = q->w_ptr;
+  uint32_t r_ptr = q->r_ptr;
+  return (w_ptr >= r_ptr) ? (w_ptr - r_ptr) : (w_ptr + q->fifo_size - r_ptr);
+}
 
-int can_pop(can_ring *q, CAN_FIFOMailBox_TypeDef *elem) {
-  int ret = 0;
+// ********************* priority TX queue *********************
+
+// A TX queue set to priority by 0xc3 keeps its frames in a binary heap in
+// the same elements, w_ptr being the count, and gives out the frame the bus
+// would send first: host frames with CAN_TX_URGENT in RDTR, then the id that
+// wins arbitration, then the oldest. The heap isn't lock-free, it's only
+// touched with interrupts off. The order of a push goes in the top half of
+// RDTR, which is cleared before a mailbox is loaded.
+#define CAN_TX_URGENT (1U << 15)
+#define CAN_TX_SEQ_SHIFT 16
+// a frame from ep3 has its completion token in bits 4-13 of RDTR, valid with
+// CAN_TX_TOKEN, from can_send_token on. See can_echo_mode.
+#define CAN_TX_TOKEN (1U << 14)
+#define CAN_TX_TOKEN_SHIFT 4
+#define CAN_TX_TOKEN_MASK 0x3FFU
+
+// standard ids beat extended ones with the same 11 bits, data beats remote
+RAMFUNC uint32_t can_arb_key(uint32_t rir) {
+  return (rir & 4) ? (rir & ~1U) : (rir & 0xFFE00002U);
+}
 
+RAMFUNC int can_tx_before(CAN_FIFOMailBox_TypeDef *a, CAN_FIFOMailBox_TypeDef *b) {
+  uint32_t ua = a->RDTR & CAN_TX_URGENT;
+  uint32_t ub = b->RDTR & CAN_TX_URGENT;
+  if (ua != ub) return ua > ub;
+  uint32_t ka = can_arb_key(a->RIR);
+  uint32_t kb = can_arb_key(b->RIR);
+  if (ka != kb) return ka < kb;
+  return (int16_t)((a->RDTR >> CAN_TX_SEQ_SHIFT) - (b->RDTR >> CAN_TX_SEQ_SHIFT)) < 0;
+}
+
+// keeps the order already in RDTR, for frames taken back out of a mailbox
+RAMFUNC int can_heap_insert(can_ring *q, CAN_FIFOMailBox_TypeDef *elem) {
   enter_critical_section();
-  if (q->w_ptr != q->r_ptr) {
-    *elem = q->elems[q->r_ptr];
-    if ((q->r_ptr + 1) == q->fifo_size) q->r_ptr = 0;
-    else q->r_ptr += 1;
-    ret = 1;
+  uint32_t n = q->w_ptr;
+  if (n + 1 >= q->fifo_size) {
+    exit_critical_section();
+    return 0;
+  }
+  while (n > 0) {
+    uint32_t parent = (n - 1) / 2;
+    if (!can_tx_before(elem, &q->elems[parent])) break;
+    q->elems[n] = q->elems[parent];
+    n = parent;
   }
+  q->elems[n] = *elem;
+  q->w_ptr += 1;
+  if (q->w_ptr > q->hwm) q->hwm = q->w_ptr;
   exit_critical_section();
-
-  return ret;
+  return 1;
 }
 
-int can_push(can_ring *q, CAN_FIFOMailBox_TypeDef *elem) {
-  int ret = 0;
-  uint32_t next_w_ptr;
-
+RAMFUNC int can_heap_pop(can_ring *q, CAN_FIFOMailBox_TypeDef *elem) {
   enter_critical_section();
-  if ((q->w_ptr + 1) == q->fifo_size) next_w_ptr = 0;
-  else next_w_ptr = q->w_ptr + 1;
-  if (next_w_ptr != q->r_ptr) {
-    q->elems[q->w_ptr] = *elem;
-    q->w_ptr = next_w_ptr;
-    ret = 1;
+  uint32_t len = q->w_ptr;
+  if (len == 0) {
+    exit_critical_section();
+    return 0;
+  }
+  *elem = q->elems[0];
+  len -= 1;
+  CAN_FIFOMailBox_TypeDef last = q->elems[len];
+  uint32_t n = 0;
+  while (1) {
+    uint32_t child = (2 * n) + 1;
+    if (child >= len) break;
+    if (child + 1 < len && can_tx_before(&q->elems[child + 1], &q->elems[child])) child += 1;
+    if (!can_tx_before(&q->elems[child], &last)) break;
+    q->elems[n] = q->elems[child];
+    n = child;
   }
+  q->elems[n] = last;
+  q->w_ptr = len;
   exit_critical_section();
-  if (ret == 0) puts("can_push failed!\n");
-  return ret;
+  return 1;
+}
+
+RAMFUNC int can_pop_ts(can_ring *q, CAN_FIFOMailBox_TypeDef *elem, uint32_t *ts) {
+  if (q->prio) {
+    if (ts != NULL) *ts = 0;
+    return can_heap_pop(q, elem);
+  }
+
+  uint32_t r_ptr = q->r_ptr;
+  if (r_ptr == q->w_ptr) return 0;
+
+  // make sure the element is read after w_ptr
+  __DMB();
+  *elem = q->elems[r_ptr];
+  if (ts != NULL) *ts = (q->timestamps != NULL) ? q->timestamps[r_ptr] : 0;
+  __DMB();
+  r_ptr += 1;
+  q->r_ptr = (r_ptr == q->fifo_size) ? 0 : r_ptr;
+  return 1;
+}
+
+RAMFUNC int can_pop(can_ring *q, CAN_FIFOMailBox_TypeDef *elem) {
+  return can_pop_ts(q, elem, NULL);
 }
 
+RAMFUNC int can_push_ts(can_ring *q, CAN_FIFOMailBox_TypeDef *elem, uint32_t ts) {
+  int ok;
+  uint32_t w_ptr = q->w_ptr;
+  uint32_t next_w_ptr = (w_ptr + 1 == q->fifo_size) ? 0 : (w_ptr + 1);
+  if (q->prio) {
+    CAN_FIFOMailBox_TypeDef to_insert = *elem;
+    to_insert.RDTR = (to_insert.RDTR & 0xFFFF) | ((uint32_t)q->seq << CAN_TX_SEQ_SHIFT);
+    q->seq += 1;
+    ok = can_heap_insert(q, &to_insert);
+  } else {
+    ok = next_w_ptr != q->r_ptr;
+  }
+  if (!ok) {
+    uint16_t bus = 0xFFFF;
+    for (int i = 0; i < BUS_MAX; i++) {
+      if (q == can_queues[i]) bus = i;
+    }
+    trace(TRACE_WARN, TRACE_CAN_PUSH_FAILED, bus, elem->RIR);
+    return 0;
+  }
+  if (q->prio) return 1;
+
+  q->elems[w_ptr] = *elem;
+  if (q->timestamps != NULL) q->timestamps[w_ptr] = ts;
+  // make sure the element is visible before the new w_ptr
+  __DMB();
+  q->w_ptr = next_w_ptr;
+
+  uint32_t used = can_ring_used(q);
+  if (used > q->hwm) q->hwm = used;
+  return 1;
+}
+
+RAMFUNC int can_push(can_ring *q, CAN_FIFOMailBox_TypeDef *elem) {
+  return can_push_ts(q, elem, 0);
+}
+
+// called from the consumer side, drops everything that has been pushed so far
 void can_clear(can_ring *q) {
-  enter_critical_section();
+  if (q->prio) {
+    q->w_ptr = 0;
+  } else {
+    q->r_ptr = q->w_ptr;
+  }
+}
+
+// the frames each queue can hold, set by 0xff and laid out back to back
+// in can_pool. A ring of n elements holds n - 1.
+typedef struct {
+  uint16_t rx_len[BUS_MAX];
+  uint16_t tx_len[BUS_MAX];
+} can_pool_split;
+
+can_pool_split can_pool_lens = {
+#ifdef PANDA
+  .rx_len = {CAN_RX_DEFAULT_LEN - 1, CAN_RX_DEFAULT_LEN - 1, CAN_RX_DEFAULT_LEN - 1, CAN_RX_DEFAULT_LEN - 1},
+  .tx_len = {CAN_TX_DEFAULT_LEN - 1, CAN_TX_DEFAULT_LEN - 1, CAN_TX_DEFAULT_LEN - 1, CAN_TX_DEFAULT_LEN - 1},
+#else
+  .rx_len = {CAN_RX_DEFAULT_LEN - 1, CAN_RX_DEFAULT_LEN - 1},
+  .tx_len = {CAN_TX_DEFAULT_LEN - 1, CAN_TX_DEFAULT_LEN - 1},
+#endif
+};
+
+void can_pool_assign(can_ring *q, uint32_t *offset, uint16_t len) {
+  q->elems = &can_pool[*offset];
+  if (q->timestamps != NULL) q->timestamps = &can_pool_timestamps[*offset];
+  q->fifo_size = len + 1;
   q->w_ptr = 0;
   q->r_ptr = 0;
+  q->hwm = 0;
+  *offset += len + 1;
+}
+
+// frames left over, or negative if the split doesn't fit
+int can_pool_free(can_pool_split *split) {
+  int used = 0;
+  for (int i = 0; i < BUS_MAX; i++) used += split->rx_len[i] + 1 + split->tx_len[i] + 1;
+  return CAN_POOL_LEN - used;
+}
+
+// queue is a bus for its TX queue, or CAN_POOL_RX_QUEUE with the bus for
+// its RX queue. Everything queued anywhere in the pool is dropped. The old
+// split stays if the new one doesn't fit.
+#define CAN_POOL_RX_QUEUE 0xFF00
+int can_pool_resize(uint16_t queue, uint16_t len) {
+  can_pool_split split = can_pool_lens;
+  uint16_t bus = queue & 0xFF;
+  if (bus >= BUS_MAX) return -1;
+
+  if ((queue & 0xFF00) == CAN_POOL_RX_QUEUE) {
+    split.rx_len[bus] = len;
+  } else if (queue == bus) {
+    split.tx_len[bus] = len;
+  } else {
+    return -1;
+  }
+  if (can_pool_free(&split) < 0) return -1;
+
+  enter_critical_section();
+  can_pool_lens = split;
+  uint32_t offset = 0;
+  for (int i = 0; i < BUS_MAX; i++) can_pool_assign(&can_rx_qs[i], &offset, split.rx_len[i]);
+  for (int i = 0; i < BUS_MAX; i++) can_pool_assign(can_queues[i], &offset, split.tx_len[i]);
   exit_critical_section();
+  return 0;
+}
+
+// the RX queues, the TX queues and what's unused, as halfwords
+int can_pool_layout(uint8_t *out) {
+  uint16_t free = can_pool_free(&can_pool_lens);
+  memcpy(out, &can_pool_lens, sizeof(can_pool_lens));
+  memcpy(out + sizeof(can_pool_lens), &free, sizeof(free));
+  return sizeof(can_pool_lens) + sizeof(free);
+}
+
+// ********************* RX merge *********************
+
+// the host reads the RX queues merged, taking up to a bus's weight of
+// frames from it before moving on. Order is kept within a bus, not across.
+// frames past the first a bus gets per turn, so zeroed is plain round robin
+uint16_t can_rx_weight_extra[BUS_MAX];
+int can_rx_bus = 0;
+int can_rx_credit = 0;
+
+// the records of events.h while they're on, a turn after the buses' with
+// a weight of 1
+can_ring *can_event_q = NULL;
+#define CAN_RX_TURNS (BUS_MAX + 1)
+
+void can_rx_set_weight(int bus, uint16_t weight) {
+  if (bus < 0 || bus >= BUS_MAX) return;
+  can_rx_weight_extra[bus] = (weight > 0) ? (weight - 1) : 0;
+}
+
+RAMFUNC can_ring *can_rx_turn_q(int turn) {
+  return (turn < BUS_MAX) ? &can_rx_qs[turn] : can_event_q;
+}
+
+RAMFUNC int can_rx_pop_ts(CAN_FIFOMailBox_TypeDef *elem, uint32_t *ts) {
+  // around every queue, and back to the first for its fresh credit
+  for (int i = 0; i <= CAN_RX_TURNS; i++) {
+    can_ring *q = can_rx_turn_q(can_rx_bus);
+    if (can_rx_credit > 0 && q != NULL && can_pop_ts(q, elem, ts)) {
+      can_rx_credit -= 1;
+      return 1;
+    }
+    can_rx_bus = (can_rx_bus + 1 == CAN_RX_TURNS) ? 0 : (can_rx_bus + 1);
+    can_rx_credit = ((can_rx_bus < BUS_MAX) ? can_rx_weight_extra[can_rx_bus] : 0) + 1;
+  }
+  return 0;
+}
+
+int can_rx_pending() {
+  for (int i = 0; i < CAN_RX_TURNS; i++) {
+    can_ring *q = can_rx_turn_q(i);
+    if (q != NULL && q->r_ptr != q->w_ptr) return 1;
+  }
+  return 0;
+}
+
+void can_rx_clear() {
+  for (int i = 0; i < CAN_RX_TURNS; i++) {
+    can_ring *q = can_rx_turn_q(i);
+    if (q != NULL) can_clear(q);
+  }
 }
 
 // assign CAN numbering
@@ -73,10 +333,29 @@ void can_clear(can_ring *q) {
 // can_num_lookup: Translates from 'bus number' to 'can number'.
 // can_forwarding: Given a bus num, lookup bus num to forward to. -1 means no forward.
 
-int can_rx_cnt = 0;
-int can_tx_cnt = 0;
-int can_txd_cnt = 0;
-int can_err_cnt = 0;
+// per bus number, read by the host with 0xc0
+typedef struct {
+  uint32_t rx_cnt;
+  uint32_t tx_cnt;      // loaded into a TX mailbox
+  uint32_t txd_cnt;     // sent and echoed
+  uint32_t rx_drop_cnt; // the bus's RX queue was full
+  uint32_t rx_suppressed_cnt; // held back by the report rules
+  uint32_t tx_drop_cnt; // the TX queue was full
+  uint32_t tx_fail_cnt; // one-shot, tried once and not sent
+  uint32_t tx_arb_lost_cnt; // ALST of a completed mailbox
+  uint32_t tx_err_cnt;  // TERR of a completed mailbox
+  uint32_t err_cnt;     // SCE interrupts
+  uint32_t esr;         // ESR at the last SCE interrupt
+  // estimated bits on the wire, no stuffing, for the bus load
+  uint32_t bits;
+  uint32_t load_bits;
+  uint32_t load_ts;
+} can_bus_stats;
+
+can_bus_stats can_stats[BUS_MAX];
+
+// SOF to IFS without stuffing
+#define CAN_FRAME_BITS(RIR, RDTR) ((((RIR) & 4) ? 67 : 47) + (8 * ((RDTR) & 0xF)))
 
 // NEO:         Bus 1=CAN1   Bus 2=CAN2
 // Panda:       Bus 0=CAN1   Bus 1=CAN2   Bus 2=CAN3
@@ -96,6 +375,47 @@ int can_err_cnt = 0;
   #define CAN_MAX 2
 #endif
 
+// CANs can_autobaud.h holds listen-only on a bitrate it's trying, and the
+// errors each saw there, which can_sce counts for it instead of the bus's
+uint8_t can_autobaud_cans = 0;
+volatile uint32_t can_autobaud_errors[CAN_MAX];
+// as many as tell a rate is wrong, after them the LEC IRQ is off
+#define CAN_AUTOBAUD_ERRORS_ENOUGH 32U
+
+#define CAN_TX_MAILBOXES 3
+#define CAN_TSR_MAILBOX_SHIFT(mailbox) ((mailbox) * 8)
+
+// the whole RDTR of what each TX mailbox was loaded with, and the mailboxes
+// being aborted for a frame that goes first
+uint32_t can_tx_mailbox_rdtr[CAN_MAX][CAN_TX_MAILBOXES];
+uint8_t can_tx_aborting[CAN_MAX];
+
+// What a frame sent on the bus leaves in its RX queue, set with 0xcf:
+//   CAN_ECHO_FULL  a copy with CAN_BUS_RET_FLAG, as always
+//   CAN_ECHO_TOKEN for a frame with a token, a completion: the id with TXRQ
+//                  set, which no received frame has, DLC 0 and the token in
+//                  RDLR. It's a compact record of its own, see can_compact.h.
+//                  Frames without one, periodic, ISO-TP or forwarded, still
+//                  get the copy.
+//   CAN_ECHO_NONE  nothing
+// Either way the frame is counted, captured and seen by ISO-TP as before.
+#define CAN_ECHO_FULL 0
+#define CAN_ECHO_TOKEN 1
+#define CAN_ECHO_NONE 2
+#define CAN_ECHO_MAX CAN_ECHO_NONE
+
+uint8_t can_echo_mode[BUS_MAX];
+
+// A bus set to one-shot by 0xd4 has NART, a frame that loses arbitration or
+// hits an error gives its mailbox back at once instead of going again, and
+// the next queued frame goes in. One with a token leaves a completion in
+// FULL and TOKEN modes: CAN_DONE_FAILED in RDLR with the token, and
+// CAN_DONE_ARB_LOST if that's why.
+#define CAN_DONE_FAILED (1U << 15)
+#define CAN_DONE_ARB_LOST (1U << 14)
+
+uint8_t can_one_shot[BUS_MAX];
+
 #define CANIF_FROM_CAN_NUM(num) (cans[num])
 #define BUS_NUM_FROM_CAN_NUM(num) (bus_lookup[num])
 #define CAN_NUM_FROM_BUS_NUM(num) (can_num_lookup[num])
@@ -117,87 +437,446 @@ int can_err_cnt = 0;
 
 void process_can(uint8_t can_number);
 
-void can_init(uint8_t can_number) {
-  if (can_number == 0xff) return;
+// ********************* hardware filters *********************
+
+// host filters are in the RIR layout, a frame is received if
+// (RIR & mask) == (id & mask). A bus without filters accepts everything.
+typedef struct {
+  uint32_t id;
+  uint32_t mask;
+} can_filter;
+
+#define CAN_FILTER_MAX 16
+#define CAN_FILTER_BANKS 14
+// everything but TXRQ, these go in ID list banks two at a time
+#define CAN_FILTER_EXACT 0xFFFFFFFEU
+
+can_filter can_filters[BUS_MAX][CAN_FILTER_MAX];
+int can_filters_len[BUS_MAX] = {0};
+// bumped when what a CAN would get in a mode that's off changes, see
+// can_switch_mode
+uint32_t can_mode_gen = 1;
+// the host sends a filter one 32 bit word at a time
+can_filter can_filter_staged = {.id = 0, .mask = 0};
+
+// safety ids get FIFO 1 to themselves so they never queue behind bulk
+// traffic. Custom interrupt handlers only drain FIFO 0.
+#ifdef CUSTOM_CAN_INTERRUPTS
+  #define CAN_SAFETY_FIFO 0
+#else
+  #define CAN_SAFETY_FIFO 1
+#endif
+
+void can_set_filter_bank(CAN_TypeDef *FCAN, int bank, int list, int fifo, uint32_t fr1, uint32_t fr2) {
+  uint32_t bit = 1U << bank;
+  FCAN->sFilterRegister[bank].FR1 = fr1;
+  FCAN->sFilterRegister[bank].FR2 = fr2;
+  // 32 bit scale
+  FCAN->FS1R |= bit;
+  if (fifo) {
+    FCAN->FFA1R |= bit;
+  } else {
+    FCAN->FFA1R &= ~bit;
+  }
+  if (list) {
+    FCAN->FM1R |= bit;
+  } else {
+    FCAN->FM1R &= ~bit;
+  }
+  FCAN->FA1R |= bit;
+}
+
+// exact ids are paired up in list banks, the rest take a mask bank each.
+// returns the next free bank
+int can_set_filter_banks(CAN_TypeDef *FCAN, int bank, int fifo, const can_filter *filters, int len) {
+  uint32_t pending_id = 0;
+  int pending = 0;
+  for (int i = 0; i < len; i++) {
+    uint32_t id = filters[i].id & filters[i].mask;
+    if (filters[i].mask != CAN_FILTER_EXACT) {
+      can_set_filter_bank(FCAN, bank++, 0, fifo, id, filters[i].mask);
+    } else if (pending) {
+      can_set_filter_bank(FCAN, bank++, 1, fifo, pending_id, id);
+      pending = 0;
+    } else {
+      pending_id = id;
+      pending = 1;
+    }
+  }
+  if (pending) {
+    can_set_filter_bank(FCAN, bank++, 1, fifo, pending_id, pending_id);
+  }
+  return bank;
+}
+
+int can_filter_banks_needed(const can_filter *filters, int len) {
+  int exact_len = 0;
+  int masked_len = 0;
+  for (int i = 0; i < len; i++) {
+    if (filters[i].mask == CAN_FILTER_EXACT) {
+      exact_len += 1;
+    } else {
+      masked_len += 1;
+    }
+  }
+  return (exact_len + 1) / 2 + masked_len;
+}
+
+// the CAN with a CAN's filter banks, and the first of them
+CAN_TypeDef *can_filter_can(CAN_TypeDef *CAN, int *first_bank) {
+  // CAN2 has no filters of its own, it uses banks 14-27 of CAN1
+  if (CAN == CAN2) {
+    *first_bank = CAN_FILTER_BANKS;
+    return CAN1;
+  }
+  *first_bank = 0;
+  return CAN;
+}
+
+// program the filter banks of a CAN from the host filters of its bus.
+// The ids the safety rx hook needs always come first, ID list banks win
+// over the mask banks they overlap. Buses that are forwarded, or that need
+// more banks than there are, accept everything else.
+void can_init_filters(uint8_t can_number) {
+  // a bus without a CAN, its other mode's filters change
+  if (can_number == 0xff) {
+    can_mode_gen += 1;
+    return;
+  }
 
   CAN_TypeDef *CAN = CANIF_FROM_CAN_NUM(can_number);
-  set_can_enable(CAN, 1);
+  uint8_t bus_number = BUS_NUM_FROM_CAN_NUM(can_number);
 
-  CAN->MCR = CAN_MCR_TTCM | CAN_MCR_INRQ;
-  while((CAN->MSR & CAN_MSR_INAK) != CAN_MSR_INAK);
+  int first_bank;
+  CAN_TypeDef *FCAN = can_filter_can(CAN, &first_bank);
+
+  can_filter safety_filters[CAN_FILTER_MAX] = {0};
+  int safety_len = min(safety.hooks->rx_ids_len, CAN_FILTER_MAX);
+  for (int i = 0; i < safety_len; i++) {
+    safety_filters[i].id = safety.hooks->rx_ids[i] << 21;
+    safety_filters[i].mask = CAN_FILTER_EXACT;
+  }
 
+  int filters_len = can_filters_len[bus_number];
+  int filtered = filters_len > 0 && can_forwarding[bus_number] == -1 &&
+                 !(safety.hooks->fwd_buses & (1 << bus_number));
+  int banks = can_filter_banks_needed(safety_filters, safety_len) +
+              (filtered ? can_filter_banks_needed(can_filters[bus_number], filters_len) : 1);
+  if (banks > CAN_FILTER_BANKS) {
+    filtered = 0;
+  }
+
+  FCAN->FMR |= CAN_FMR_FINIT;
+  FCAN->FA1R &= ~(((1U << CAN_FILTER_BANKS) - 1) << first_bank);
+
+  int bank = can_set_filter_banks(FCAN, first_bank, CAN_SAFETY_FIFO, safety_filters, safety_len);
+  if (filtered) {
+    can_set_filter_banks(FCAN, bank, 0, can_filters[bus_number], filters_len);
+  } else {
+    // accept all, no mask
+    can_set_filter_bank(FCAN, bank, 0, 0, 0, 0);
+  }
+
+  FCAN->FMR &= ~(CAN_FMR_FINIT);
+}
+
+#define CAN_TIMEOUT 1000000
+
+// CANs can_init set up, that can_reconfigure can take as they are
+uint32_t can_setup_mask = 0;
+
+// read with 0xce
+typedef struct {
+  uint32_t inits;     // can_init
+  uint32_t reconfigs; // BTR and MCR loaded by can_reconfigure
+  uint32_t unchanged; // can_reconfigure found it as configured
+  uint32_t timeouts;  // INAK didn't follow INRQ within CAN_TIMEOUT
+} can_reconfig_stats;
+
+can_reconfig_stats can_reconfig_st;
+
+// what the bitrate, loopback and silent settings give the CAN
+uint32_t can_config_btr(uint8_t can_number) {
   // set time quanta from defines
-  CAN->BTR = (CAN_BTR_TS1_0 * (CAN_SEQ1-1)) |
-             (CAN_BTR_TS2_0 * (CAN_SEQ2-1)) |
-             (can_speed_to_prescaler(can_speed[BUS_NUM_FROM_CAN_NUM(can_number)]) - 1);
+  uint32_t btr = (CAN_BTR_TS1_0 * (CAN_SEQ1-1)) |
+                 (CAN_BTR_TS2_0 * (CAN_SEQ2-1)) |
+                 (can_speed_to_prescaler(can_speed[BUS_NUM_FROM_CAN_NUM(can_number)]) - 1);
 
   // silent loopback mode for debugging
   if (can_loopback) {
-    CAN->BTR |= CAN_BTR_SILM | CAN_BTR_LBKM;
+    btr |= CAN_BTR_SILM | CAN_BTR_LBKM;
   }
 
-  if (can_silent & (1 << can_number)) {
-    CAN->BTR |= CAN_BTR_SILM;
+  if ((can_silent | can_autobaud_cans) & (1 << can_number)) {
+    btr |= CAN_BTR_SILM;
   }
+  return btr;
+}
 
-  // reset
-  CAN->MCR = CAN_MCR_TTCM | CAN_MCR_ABOM;
+// out of init mode, with the TX order and one-shot
+uint32_t can_config_mcr(uint8_t can_number) {
+  uint8_t bus_number = BUS_NUM_FROM_CAN_NUM(can_number);
+  int txfp = can_tx_in_order || can_queues[bus_number]->prio;
+  return CAN_MCR_TTCM | CAN_MCR_ABOM | (txfp ? CAN_MCR_TXFP : 0) | (can_one_shot[bus_number] ? CAN_MCR_NART : 0);
+}
 
-  #define CAN_TIMEOUT 1000000
+// 0 if it didn't get there within CAN_TIMEOUT
+int can_wait_inak(CAN_TypeDef *CAN, int init) {
+  uint32_t want = init ? CAN_MSR_INAK : 0U;
   int tmp = 0;
-  while((CAN->MSR & CAN_MSR_INAK) == CAN_MSR_INAK && tmp < CAN_TIMEOUT) tmp++;
+  while ((CAN->MSR & CAN_MSR_INAK) != want && tmp < CAN_TIMEOUT) tmp++;
+  return tmp != CAN_TIMEOUT;
+}
 
-  if (tmp == CAN_TIMEOUT) {
+void can_init(uint8_t can_number) {
+  if (can_number == 0xff) {
+    can_mode_gen += 1;
+    return;
+  }
+
+  CAN_TypeDef *CAN = CANIF_FROM_CAN_NUM(can_number);
+  set_can_enable(CAN, 1);
+
+  CAN->MCR = CAN_MCR_TTCM | CAN_MCR_INRQ;
+  if (!can_wait_inak(CAN, 1)) can_reconfig_st.timeouts += 1;
+
+  CAN->BTR = can_config_btr(can_number);
+
+  // reset
+  can_tx_aborting[can_number] = 0;
+  CAN->MCR = can_config_mcr(can_number);
+
+  if (!can_wait_inak(CAN, 0)) {
+    can_reconfig_st.timeouts += 1;
+    trace(TRACE_ERROR, TRACE_CAN_INIT_FAILED, can_number, CAN->MSR);
     puts("CAN init FAILED!!!!!\n");
     puth(can_number); puts(" ");
     puth(BUS_NUM_FROM_CAN_NUM(can_number)); puts("\n");
   }
 
-  // accept all filter
-  CAN->FMR |= CAN_FMR_FINIT;
-
-  // no mask
-  CAN->sFilterRegister[0].FR1 = 0;
-  CAN->sFilterRegister[0].FR2 = 0;
-  CAN->sFilterRegister[14].FR1 = 0;
-  CAN->sFilterRegister[14].FR2 = 0;
-  CAN->FA1R |= 1 | (1 << 14);
-
-  CAN->FMR &= ~(CAN_FMR_FINIT);
+  can_init_filters(can_number);
 
   // enable certain CAN interrupts
   CAN->IER = CAN_IER_TMEIE | CAN_IER_FMPIE0;
+  #ifndef CUSTOM_CAN_INTERRUPTS
+    CAN->IER |= CAN_IER_FMPIE1;
+  #endif
 
   switch (can_number) {
     case 0:
       NVIC_EnableIRQ(CAN1_TX_IRQn);
       NVIC_EnableIRQ(CAN1_RX0_IRQn);
+      #ifndef CUSTOM_CAN_INTERRUPTS
+        NVIC_EnableIRQ(CAN1_RX1_IRQn);
+      #endif
       NVIC_EnableIRQ(CAN1_SCE_IRQn);
       break;
     case 1:
       NVIC_EnableIRQ(CAN2_TX_IRQn);
       NVIC_EnableIRQ(CAN2_RX0_IRQn);
+      #ifndef CUSTOM_CAN_INTERRUPTS
+        NVIC_EnableIRQ(CAN2_RX1_IRQn);
+      #endif
       NVIC_EnableIRQ(CAN2_SCE_IRQn);
       break;
 #ifdef CAN3
     case 2:
       NVIC_EnableIRQ(CAN3_TX_IRQn);
       NVIC_EnableIRQ(CAN3_RX0_IRQn);
+      #ifndef CUSTOM_CAN_INTERRUPTS
+        NVIC_EnableIRQ(CAN3_RX1_IRQn);
+      #endif
       NVIC_EnableIRQ(CAN3_SCE_IRQn);
       break;
 #endif
   }
 
+  can_setup_mask |= 1U << can_number;
+  can_reconfig_st.inits += 1;
+
   // in case there are queued up messages
   process_can(can_number);
 }
 
 void can_init_all() {
+  can_mode_gen += 1;
   for (int i=0; i < CAN_MAX; i++) {
     can_init(i);
   }
 }
 
+// Brings a CAN can_init set up to the bitrate, silent, loopback and TX order
+// configured now, holding only it in init mode for the BTR and MCR. Its
+// filter banks, IRQs and mailboxes and the frames queued for it stay, and the
+// other CANs, CAN2's banks going through CAN1 too, are never touched. Does
+// nothing when it's already as configured.
+void can_reconfigure(uint8_t can_number) {
+  if (can_number >= CAN_MAX || (can_setup_mask & (1U << can_number)) == 0U) {
+    can_init(can_number);
+    return;
+  }
+
+  CAN_TypeDef *CAN = CANIF_FROM_CAN_NUM(can_number);
+  uint32_t btr = can_config_btr(can_number);
+  uint32_t mcr = can_config_mcr(can_number);
+  if (CAN->BTR == btr && (CAN->MCR & ~(CAN_MCR_INRQ | CAN_MCR_SLEEP)) == mcr) {
+    can_reconfig_st.unchanged += 1;
+    return;
+  }
+
+  // waits for the frame on the bus, the mailboxes keep their requests
+  CAN->MCR |= CAN_MCR_INRQ;
+  if (!can_wait_inak(CAN, 1)) {
+    can_reconfig_st.timeouts += 1;
+    trace(TRACE_ERROR, TRACE_CAN_INIT_FAILED, can_number, CAN->MSR);
+  }
+  CAN->BTR = btr;
+  CAN->MCR = mcr;
+  if (!can_wait_inak(CAN, 0)) {
+    can_reconfig_st.timeouts += 1;
+    trace(TRACE_ERROR, TRACE_CAN_INIT_FAILED, can_number, CAN->MSR);
+  }
+  can_reconfig_st.reconfigs += 1;
+
+  // in case there are queued up messages
+  process_can(can_number);
+}
+
+// ********************* GMLAN switching *********************
+
+// What can_init set a CAN up with in each mode is kept when it leaves the
+// mode. Coming back then only holds the controller in init mode to load BTR
+// and its filter banks, without the reset, the IRQ setup and working out the
+// filters again. A can_init or can_init_filters of a bus without a CAN, or a
+// can_init_all, can change what a mode that's off would get, and bumps
+// can_mode_gen, making them all stale.
+#ifdef PANDA
+
+typedef struct {
+  uint32_t gen;  // good while it's can_mode_gen, 0 never is
+  uint32_t MCR;
+  uint32_t BTR;
+  uint32_t FM1R; // the CAN's banks' bits
+  uint32_t FS1R;
+  uint32_t FFA1R;
+  uint32_t FA1R;
+  uint32_t FR1[CAN_FILTER_BANKS];
+  uint32_t FR2[CAN_FILTER_BANKS];
+} can_mode_regs;
+
+// per CAN number, CAN then GMLAN
+can_mode_regs can_modes[CAN_MAX][2];
+
+// read by the host with 0xcc
+typedef struct {
+  uint32_t switches;
+  uint32_t fast;    // from the kept registers
+  uint32_t last_us; // from leaving the old mode to being on the new one
+  uint32_t max_us;
+} can_mode_stats;
+
+can_mode_stats can_mode_st;
+
+void can_mode_save(uint8_t can_number, int gmlan) {
+  CAN_TypeDef *CAN = CANIF_FROM_CAN_NUM(can_number);
+  int first_bank;
+  CAN_TypeDef *FCAN = can_filter_can(CAN, &first_bank);
+  uint32_t banks = ((1U << CAN_FILTER_BANKS) - 1) << first_bank;
+
+  can_mode_regs *m = &can_modes[can_number][gmlan];
+  m->MCR = CAN->MCR & ~(CAN_MCR_INRQ | CAN_MCR_SLEEP);
+  m->BTR = CAN->BTR;
+  m->FM1R = FCAN->FM1R & banks;
+  m->FS1R = FCAN->FS1R & banks;
+  m->FFA1R = FCAN->FFA1R & banks;
+  m->FA1R = FCAN->FA1R & banks;
+  for (int i = 0; i < CAN_FILTER_BANKS; i++) {
+    m->FR1[i] = FCAN->sFilterRegister[first_bank + i].FR1;
+    m->FR2[i] = FCAN->sFilterRegister[first_bank + i].FR2;
+  }
+  m->gen = can_mode_gen;
+}
+
+// holds the CAN in init mode for can_mode_load, 0 if the mode has to be set
+// up with can_init
+int can_mode_stop(uint8_t can_number, int gmlan) {
+  if (can_modes[can_number][gmlan].gen != can_mode_gen) return 0;
+  CAN_TypeDef *CAN = CANIF_FROM_CAN_NUM(can_number);
+  CAN->MCR |= CAN_MCR_INRQ;
+  int tmp = 0;
+  while ((CAN->MSR & CAN_MSR_INAK) != CAN_MSR_INAK && tmp < CAN_TIMEOUT) tmp++;
+  return tmp != CAN_TIMEOUT;
+}
+
+void can_mode_load(uint8_t can_number, int gmlan) {
+  CAN_TypeDef *CAN = CANIF_FROM_CAN_NUM(can_number);
+  int first_bank;
+  CAN_TypeDef *FCAN = can_filter_can(CAN, &first_bank);
+  uint32_t banks = ((1U << CAN_FILTER_BANKS) - 1) << first_bank;
+  can_mode_regs *m = &can_modes[can_number][gmlan];
+
+  CAN->BTR = m->BTR;
+
+  FCAN->FMR |= CAN_FMR_FINIT;
+  FCAN->FA1R &= ~banks;
+  for (int i = 0; i < CAN_FILTER_BANKS; i++) {
+    FCAN->sFilterRegister[first_bank + i].FR1 = m->FR1[i];
+    FCAN->sFilterRegister[first_bank + i].FR2 = m->FR2[i];
+  }
+  FCAN->FM1R = (FCAN->FM1R & ~banks) | m->FM1R;
+  FCAN->FS1R = (FCAN->FS1R & ~banks) | m->FS1R;
+  FCAN->FFA1R = (FCAN->FFA1R & ~banks) | m->FFA1R;
+  FCAN->FA1R |= m->FA1R;
+  FCAN->FMR &= ~(CAN_FMR_FINIT);
+
+  can_tx_aborting[can_number] = 0;
+  CAN->MCR = m->MCR;
+  int tmp = 0;
+  while ((CAN->MSR & CAN_MSR_INAK) == CAN_MSR_INAK && tmp < CAN_TIMEOUT) tmp++;
+  if (tmp == CAN_TIMEOUT) {
+    trace(TRACE_ERROR, TRACE_CAN_INIT_FAILED, can_number, CAN->MSR);
+  }
+
+  // in case there are queued up messages
+  process_can(can_number);
+}
+
+// moves a CAN to the other transceiver, its bus number already changed
+void can_switch_mode(uint8_t can_number, int gmlan) {
+  uint32_t start = TIM2->CNT;
+  can_mode_save(can_number, !gmlan);
+  // off the bus before the pins move
+  int fast = can_mode_stop(can_number, gmlan);
+  set_can_mode(can_number, gmlan);
+  if (fast) {
+    can_mode_load(can_number, gmlan);
+  } else {
+    can_init(can_number);
+  }
+
+  can_mode_stats *st = &can_mode_st;
+  st->switches += 1;
+  st->fast += fast;
+  st->last_us = TIM2->CNT - start;
+  st->max_us = max(st->max_us, st->last_us);
+}
+
+int can_gmlan_status(uint8_t *out) {
+  struct __attribute__((packed)) {
+    uint8_t can;      // number of the CAN on GMLAN, 0xFF for none
+    uint8_t reserved[3];
+    can_mode_stats st;
+  } *st = (void *)out;
+  enter_critical_section();
+  st->can = can_num_lookup[3];
+  memset(st->reserved, 0, sizeof(st->reserved));
+  st->st = can_mode_st;
+  exit_critical_section();
+  return sizeof(*st);
+}
+
+#endif
+
 void can_set_gmlan(int bus) {
   #ifdef PANDA
   if (bus == -1 || bus != can_num_lookup[3]) {
@@ -205,19 +884,17 @@ void can_set_gmlan(int bus) {
     switch (can_num_lookup[3]) {
       case 1:
         puts("disable GMLAN on CAN2\n");
-        set_can_mode(1, 0);
         bus_lookup[1] = 1;
         can_num_lookup[1] = 1;
         can_num_lookup[3] = -1;
-        can_init(1);
+        can_switch_mode(1, 0);
         break;
       case 2:
         puts("disable GMLAN on CAN3\n");
-        set_can_mode(2, 0);
         bus_lookup[2] = 2;
         can_num_lookup[2] = 2;
         can_num_lookup[3] = -1;
-        can_init(2);
+        can_switch_mode(2, 0);
         break;
     }
   }
@@ -225,26 +902,192 @@ void can_set_gmlan(int bus) {
   if (bus == 1) {
     puts("GMLAN on CAN2\n");
     // GMLAN on CAN2
-    set_can_mode(1, 1);
     bus_lookup[1] = 3;
     can_num_lookup[1] = -1;
     can_num_lookup[3] = 1;
-    can_init(1);
+    can_switch_mode(1, 1);
   } else if (bus == 2 && revision == PANDA_REV_C) {
     puts("GMLAN on CAN3\n");
     // GMLAN on CAN3
-    set_can_mode(2, 1);
     bus_lookup[2] = 3;
     can_num_lookup[2] = -1;
     can_num_lookup[3] = 2;
-    can_init(2);
+    can_switch_mode(2, 1);
   }
   #endif
 }
 
+// ********************* trigger capture *********************
+
+// Every frame received or sent goes in a ring of its own once armed, so the
+// frames around a fault are kept whatever the host reads. On the trigger the
+// ring takes post more frames and freezes, keeping the ones before it.
+// Panda only, the ring is in HIGH_RAM.
+#define CAN_CAPTURE_LEN 0x1000 // power of two
+
+#define CAN_CAPTURE_OFF 0
+#define CAN_CAPTURE_ARMED 1
+#define CAN_CAPTURE_TRIGGERED 2 // taking the frames after
+#define CAN_CAPTURE_DONE 3
+
+// trigger sources, the host can always trigger
+#define CAN_CAPTURE_ON_FRAME 1 // the filter staged with 0xe8/0xe9 and the data staged with 0xf9
+#define CAN_CAPTURE_ON_ERROR 2 // an SCE interrupt
+#define CAN_CAPTURE_ON_HOST 4
+#define CAN_CAPTURE_ANY_BUS 0xFF
+
+#ifdef PANDA
+
+typedef struct {
+  int state;
+  uint8_t sources;
+  uint8_t bus;
+  uint8_t source;     // what triggered it
+  can_filter filter;
+  uint32_t data[2];   // RDLR, RDHR
+  uint32_t data_mask[2];
+  uint32_t post;
+  uint32_t w;         // frames written since armed
+  uint32_t trigger_w; // frames written before the trigger
+  uint32_t trigger_ts;
+} can_capture_state;
+
+HIGH_RAM can_ts_record can_capture_buf[CAN_CAPTURE_LEN];
+can_capture_state can_capture_st = {.state = CAN_CAPTURE_OFF};
+// data, then mask, the host sends one halfword at a time
+uint32_t can_capture_staged[4] = {0};
+
+void can_capture_stage(int halfword, uint16_t value) {
+  if (halfword < 0 || halfword >= 8) return;
+  int shift = (halfword & 1) * 16;
+  can_capture_staged[halfword >> 1] = (can_capture_staged[halfword >> 1] & ~(0xFFFFU << shift)) | ((uint32_t)value << shift);
+}
+
+// the frame trigger is the staged filter and data at the time of arming
+void can_capture_arm(uint8_t sources, uint8_t bus, uint32_t post, const can_filter *filter) {
+  enter_critical_section();
+  can_capture_state *c = &can_capture_st;
+  c->sources = sources | CAN_CAPTURE_ON_HOST;
+  c->bus = bus;
+  c->source = 0;
+  c->filter.mask = filter->mask;
+  c->filter.id = filter->id & filter->mask;
+  for (int i = 0; i < 2; i++) {
+    c->data_mask[i] = can_capture_staged[i + 2];
+    c->data[i] = can_capture_staged[i] & c->data_mask[i];
+  }
+  c->post = min(post, CAN_CAPTURE_LEN - 1);
+  c->w = 0;
+  c->trigger_w = 0;
+  c->trigger_ts = 0;
+  c->state = CAN_CAPTURE_ARMED;
+  exit_critical_section();
+}
+
+void can_capture_stop() {
+  can_capture_st.state = CAN_CAPTURE_OFF;
+}
+
+// bus is CAN_CAPTURE_ANY_BUS from the host
+RAMFUNC void can_capture_trigger(uint8_t source, uint8_t bus, uint32_t ts) {
+  can_capture_state *c = &can_capture_st;
+  if (c->state != CAN_CAPTURE_ARMED || !(c->sources & source)) return;
+  if (bus != CAN_CAPTURE_ANY_BUS && c->bus != CAN_CAPTURE_ANY_BUS && c->bus != bus) return;
+  c->source = source;
+  c->trigger_w = c->w;
+  c->trigger_ts = ts;
+  c->state = (c->post == 0) ? CAN_CAPTURE_DONE : CAN_CAPTURE_TRIGGERED;
+}
+
+// every frame, in the layout and with the bus of the RX queues
+RAMFUNC void can_capture(CAN_FIFOMailBox_TypeDef *f, uint32_t ts) {
+  can_capture_state *c = &can_capture_st;
+  if (c->state != CAN_CAPTURE_ARMED && c->state != CAN_CAPTURE_TRIGGERED) return;
+
+  can_ts_record *r = &can_capture_buf[c->w & (CAN_CAPTURE_LEN - 1)];
+  r->RIR = f->RIR;
+  r->RDTR = f->RDTR;
+  r->RDLR = f->RDLR;
+  r->RDHR = f->RDHR;
+  r->timestamp = ts;
+  c->w += 1;
+
+  if (c->state == CAN_CAPTURE_ARMED) {
+    if ((f->RIR & c->filter.mask) == c->filter.id &&
+        (f->RDLR & c->data_mask[0]) == c->data[0] &&
+        (f->RDHR & c->data_mask[1]) == c->data[1]) {
+      // the trigger frame is the last one before
+      can_capture_trigger(CAN_CAPTURE_ON_FRAME, (f->RDTR >> 4) & 0xFF, ts);
+    }
+  } else if (c->w - c->trigger_w >= c->post) {
+    c->state = CAN_CAPTURE_DONE;
+  }
+}
+
+// frames kept, oldest first
+uint32_t can_capture_len() {
+  return min(can_capture_st.w, CAN_CAPTURE_LEN);
+}
+
+int can_capture_status(uint8_t *out) {
+  struct __attribute__((packed)) {
+    uint8_t state;
+    uint8_t source;
+    uint16_t reserved;
+    uint32_t len;
+    uint32_t pre; // frames before the trigger, the trigger frame is the last of them
+    uint32_t trigger_ts;
+  } *st = (void *)out;
+  enter_critical_section();
+  can_capture_state *c = &can_capture_st;
+  st->state = c->state;
+  st->source = c->source;
+  st->reserved = 0;
+  st->len = can_capture_len();
+  st->pre = (c->state == CAN_CAPTURE_TRIGGERED || c->state == CAN_CAPTURE_DONE) ?
+            (c->trigger_w - (c->w - st->len)) : st->len;
+  st->trigger_ts = c->trigger_ts;
+  exit_critical_section();
+  return sizeof(*st);
+}
+
+// the records from index from on that fit in len bytes, only once it's frozen
+int can_capture_read(uint32_t from, uint8_t *out, int len) {
+  can_capture_state *c = &can_capture_st;
+  if (c->state != CAN_CAPTURE_DONE && c->state != CAN_CAPTURE_OFF) return 0;
+  uint32_t kept = can_capture_len();
+  uint32_t first = c->w - kept;
+  int pos = 0;
+  for (uint32_t i = from; i < kept && pos + (int)sizeof(can_ts_record) <= len; i++) {
+    memcpy(out + pos, &can_capture_buf[(first + i) & (CAN_CAPTURE_LEN - 1)], sizeof(can_ts_record));
+    pos += sizeof(can_ts_record);
+  }
+  return pos;
+}
+
+#endif
+
 // CAN error
 void can_sce(CAN_TypeDef *CAN) {
-  can_err_cnt += 1;
+  for (int i = 0; i < CAN_MAX; i++) {
+    if (CAN == CANIF_FROM_CAN_NUM(i) && (can_autobaud_cans & (1U << i))) {
+      can_autobaud_errors[i] += 1;
+      if (can_autobaud_errors[i] >= CAN_AUTOBAUD_ERRORS_ENOUGH) CAN->IER &= ~CAN_IER_LECIE;
+      CAN->MSR = CAN->MSR;
+      return;
+    }
+  }
+  for (int i = 0; i < CAN_MAX; i++) {
+    uint8_t bus_number = BUS_NUM_FROM_CAN_NUM(i);
+    if (CAN == CANIF_FROM_CAN_NUM(i) && bus_number < BUS_MAX) {
+      can_stats[bus_number].err_cnt += 1;
+      can_stats[bus_number].esr = CAN->ESR;
+      trace(TRACE_WARN, TRACE_CAN_SCE, bus_number, CAN->ESR);
+      #ifdef PANDA
+        can_capture_trigger(CAN_CAPTURE_ON_ERROR, bus_number, TIM2->CNT);
+      #endif
+    }
+  }
   #ifdef DEBUG
     if (CAN==CAN1) puts("CAN1:  ");
     if (CAN==CAN2) puts("CAN2:  ");
@@ -264,16 +1107,112 @@ void can_sce(CAN_TypeDef *CAN) {
     puts("\n");
   #endif
 
-  // clear current send
-  CAN->TSR |= CAN_TSR_ABRQ0;
+  // clear current sends. Only the abort bits are written, the rest of TSR
+  // is write 1 to clear and process_can still needs the mailboxes that are done
+  CAN->TSR = CAN_TSR_ABRQ0 | CAN_TSR_ABRQ1 | CAN_TSR_ABRQ2;
   CAN->MSR = CAN->MSR;
 }
 
 // ***************************** CAN *****************************
 
-void process_can(uint8_t can_number) {
+// mailbox n status bits in TSR are the mailbox 0 bits shifted by 8*n
+
+// frames queued on the bus are dropped. The CAN is reconfigured with TXFP, so
+// the mailboxes go in the order the heap gave them.
+void can_tx_set_priority(int bus_number, int enabled) {
+  if (bus_number < 0 || bus_number >= BUS_MAX) return;
+  can_ring *q = can_queues[bus_number];
+  enter_critical_section();
+  q->prio = enabled;
+  q->w_ptr = 0;
+  q->r_ptr = 0;
+  exit_critical_section();
+  can_reconfigure(CAN_NUM_FROM_BUS_NUM(bus_number));
+}
+
+#ifndef CUSTOM_CAN_INTERRUPTS
+// ***************************** USB tx lanes *****************************
+
+// usb.h's alt 2 sends bus 0 on ep1 and the other buses on ep3. A lane is
+// full while a queue of its buses that isn't empty can't take a packet, 21
+// frames of 3 byte compact records.
+#define CAN_LANE_ROOM (0x40 / 3)
+int can_lane_held[2];
+
+RAMFUNC int can_lane_full(int lane) {
+  for (int bus = lane; bus < (lane ? BUS_MAX : 1); bus++) {
+    can_ring *q = can_queues[bus];
+    uint32_t used = q->prio ? q->w_ptr : can_ring_used(q);
+    if (used > 0 && (q->fifo_size - 1 - used) < CAN_LANE_ROOM) return 1;
+  }
+  return 0;
+}
+
+// after a USB packet of the lane, its endpoint NAKs until it drains
+void can_lane_check(int lane) {
+  if (current_int0_alt_setting != USB_ALT_CAN_LANES || !can_lane_full(lane)) return;
+  enter_critical_section();
+  can_lane_held[lane] = 1;
+  if (lane == 0) {
+    usb_ep1_out_pause();
+  } else {
+    usb_ep3_pause();
+  }
+  exit_critical_section();
+}
+
+// from process_can, the bus's mailboxes took what they could
+RAMFUNC void can_lane_drained(uint8_t bus_number) {
+  int lane = (bus_number == 0) ? 0 : 1;
+  if (!can_lane_held[lane] || can_lane_full(lane)) return;
+  can_lane_held[lane] = 0;
+  // the packet it held back is still staged, and a full ring keeps it NAKing
+  can_tx_defer_kick();
+  if (can_tx_defer_full(lane)) return;
+  if (lane == 0) {
+    usb_ep1_out_resume();
+  } else {
+    usb_ep3_resume();
+  }
+}
+
+// 0xf1, 0xc3 and 0xff empty TX queues from the host's side. A bus whose
+// mailboxes don't go out never gets to process_can to let its lane go.
+void can_lanes_drained(void) {
+  enter_critical_section();
+  can_lane_drained(0);
+  can_lane_drained(1);
+  exit_critical_section();
+}
+#endif
+
+// Without TXFP the bxCAN sends equal ids from the lowest mailbox first, so a
+// frame loaded into the empty one CODE gives would pass a frame of its id
+// still pending in a mailbox above it. It waits for that one's TX IRQ. With
+// TXFP they go in the order they were loaded.
+RAMFUNC int can_tx_would_pass(CAN_TypeDef *CAN, uint32_t rir) {
+  if ((CAN->MCR & CAN_MCR_TXFP) != 0) return 0;
+  uint32_t tsr = CAN->TSR;
+  for (int mailbox = ((tsr & CAN_TSR_CODE) >> 24) + 1; mailbox < CAN_TX_MAILBOXES; mailbox++) {
+    // the id and IDE, without TXRQ and RTR
+    if ((tsr & (CAN_TSR_TME0 << mailbox)) == 0 && ((CAN->sTxMailBox[mailbox].TIR ^ rir) & ~3U) == 0) return 1;
+  }
+  return 0;
+}
+
+// the next frame of a FIFO TX queue would pass one in a mailbox
+RAMFUNC int can_tx_held(CAN_TypeDef *CAN, can_ring *q) {
+  uint32_t r_ptr = q->r_ptr;
+  if (q->prio || r_ptr == q->w_ptr) return 0;
+  // make sure the element is read after w_ptr
+  __DMB();
+  return can_tx_would_pass(CAN, q->elems[r_ptr].RIR);
+}
+
+RAMFUNC void process_can(uint8_t can_number) {
   if (can_number == 0xff) return;
 
+  PROFILE_BEGIN();
   enter_critical_section();
 
   CAN_TypeDef *CAN = CANIF_FROM_CAN_NUM(can_number);
@@ -282,80 +1221,332 @@ void process_can(uint8_t can_number) {
     puts("process CAN TX\n");
   #endif
 
-  // check for empty mailbox
-  CAN_FIFOMailBox_TypeDef to_send;
-  if ((CAN->TSR & CAN_TSR_TME0) == CAN_TSR_TME0) {
-    // add successfully transmitted message to my fifo
-    if ((CAN->TSR & CAN_TSR_RQCP0) == CAN_TSR_RQCP0) {
-      can_txd_cnt += 1;
-
-      if ((CAN->TSR & CAN_TSR_TXOK0) == CAN_TSR_TXOK0) {
+  // add successfully transmitted messages to my fifo
+  uint32_t ts = TIM2->CNT;
+  int pushed = 0;
+  for (int mailbox = 0; mailbox < CAN_TX_MAILBOXES; mailbox++) {
+    int shift = CAN_TSR_MAILBOX_SHIFT(mailbox);
+    uint32_t tsr = CAN->TSR;
+    if ((tsr & (CAN_TSR_RQCP0 << shift)) == 0) continue;
+
+    int aborted = (can_tx_aborting[can_number] & (1 << mailbox)) != 0;
+    can_tx_aborting[can_number] &= ~(1 << mailbox);
+
+    if ((tsr & (CAN_TSR_TXOK0 << shift)) != 0) {
+      uint32_t rdtr = can_tx_mailbox_rdtr[can_number][mailbox];
+      CAN_FIFOMailBox_TypeDef to_push;
+      to_push.RIR = CAN->sTxMailBox[mailbox].TIR;
+      to_push.RDTR = (CAN->sTxMailBox[mailbox].TDTR & 0xFFFF000F) | ((CAN_BUS_RET_FLAG | bus_number) << 4);
+      to_push.RDLR = CAN->sTxMailBox[mailbox].TDLR;
+      to_push.RDHR = CAN->sTxMailBox[mailbox].TDHR;
+      can_stats[bus_number].txd_cnt += 1;
+      can_stats[bus_number].bits += CAN_FRAME_BITS(to_push.RIR, to_push.RDTR);
+      #ifdef PANDA
+        can_capture(&to_push, ts);
+      #endif
+      #ifndef CUSTOM_CAN_INTERRUPTS
+        isotp_tx_done(bus_number, &to_push, ts);
+      #endif
+      int echo = can_echo_mode[bus_number];
+      if (echo == CAN_ECHO_TOKEN && (rdtr & CAN_TX_TOKEN)) {
+        to_push.RIR |= 1;
+        to_push.RDTR &= ~0xFU;
+        to_push.RDLR = (rdtr >> CAN_TX_TOKEN_SHIFT) & CAN_TX_TOKEN_MASK;
+        to_push.RDHR = 0;
+      }
+      if (echo == CAN_ECHO_NONE) {
+        // nothing for the host
+      } else if (can_push_ts(&can_rx_qs[bus_number], &to_push, ts)) {
+        pushed = 1;
+      } else {
+        can_stats[bus_number].rx_drop_cnt += 1;
+      }
+    } else if (aborted) {
+      // let a frame that goes first past, this one goes back in order
+      CAN_FIFOMailBox_TypeDef to_requeue;
+      to_requeue.RIR = CAN->sTxMailBox[mailbox].TIR | 1; // TXRQ
+      to_requeue.RDTR = can_tx_mailbox_rdtr[can_number][mailbox];
+      to_requeue.RDLR = CAN->sTxMailBox[mailbox].TDLR;
+      to_requeue.RDHR = CAN->sTxMailBox[mailbox].TDHR;
+      can_stats[bus_number].tx_cnt -= 1;
+      if (!can_heap_insert(can_queues[bus_number], &to_requeue)) can_stats[bus_number].tx_drop_cnt += 1;
+    } else {
+      // not sent, a one-shot frame had its one try or can_sce aborted it
+      uint32_t rdtr = can_tx_mailbox_rdtr[can_number][mailbox];
+      can_stats[bus_number].tx_fail_cnt += 1;
+      if ((rdtr & CAN_TX_TOKEN) && can_echo_mode[bus_number] != CAN_ECHO_NONE) {
         CAN_FIFOMailBox_TypeDef to_push;
-        to_push.RIR = CAN->sTxMailBox[0].TIR;
-        to_push.RDTR = (CAN->sTxMailBox[0].TDTR & 0xFFFF000F) | ((CAN_BUS_RET_FLAG | bus_number) << 4);
-        to_push.RDLR = CAN->sTxMailBox[0].TDLR;
-        to_push.RDHR = CAN->sTxMailBox[0].TDHR;
-        can_push(&can_rx_q, &to_push);
+        to_push.RIR = CAN->sTxMailBox[mailbox].TIR | 1;
+        to_push.RDTR = (CAN->sTxMailBox[mailbox].TDTR & 0xFFFF0000) | ((CAN_BUS_RET_FLAG | bus_number) << 4);
+        to_push.RDLR = ((rdtr >> CAN_TX_TOKEN_SHIFT) & CAN_TX_TOKEN_MASK) | CAN_DONE_FAILED |
+                       (((tsr & (CAN_TSR_ALST0 << shift)) != 0) ? CAN_DONE_ARB_LOST : 0);
+        to_push.RDHR = 0;
+        if (can_push_ts(&can_rx_qs[bus_number], &to_push, ts)) {
+          pushed = 1;
+        } else {
+          can_stats[bus_number].rx_drop_cnt += 1;
+        }
       }
+    }
 
-      if ((CAN->TSR & CAN_TSR_TERR0) == CAN_TSR_TERR0) {
-        #ifdef DEBUG
-          puts("CAN TX ERROR!\n");
-        #endif
-      }
+    if ((tsr & (CAN_TSR_TERR0 << shift)) != 0) {
+      can_stats[bus_number].tx_err_cnt += 1;
+      trace(TRACE_WARN, TRACE_CAN_TX_ERROR, bus_number, tsr);
+      #ifdef DEBUG
+        puts("CAN TX ERROR!\n");
+      #endif
+    }
 
-      if ((CAN->TSR & CAN_TSR_ALST0) == CAN_TSR_ALST0) {
-        #ifdef DEBUG
-          puts("CAN TX ARBITRATION LOST!\n");
-        #endif
+    if ((tsr & (CAN_TSR_ALST0 << shift)) != 0) {
+      can_stats[bus_number].tx_arb_lost_cnt += 1;
+      trace(TRACE_DEBUG, TRACE_CAN_ARB_LOST, bus_number, tsr);
+      #ifdef DEBUG
+        puts("CAN TX ARBITRATION LOST!\n");
+      #endif
+    }
+
+    // clear interrupt, RQCP is write 1 to clear so only touch this mailbox
+    // careful, this can also be cleared by requesting a transmission
+    CAN->TSR = CAN_TSR_RQCP0 << shift;
+  }
+
+  // keep every empty mailbox filled, CODE is the number of the next empty one
+  can_ring *q = can_queues[bus_number];
+  CAN_FIFOMailBox_TypeDef to_send;
+  while ((CAN->TSR & CAN_TSR_TME) != 0 && !can_tx_held(CAN, q) && can_pop(q, &to_send)) {
+    int mailbox = (CAN->TSR & CAN_TSR_CODE) >> 24;
+    can_stats[bus_number].tx_cnt += 1;
+    can_tx_mailbox_rdtr[can_number][mailbox] = to_send.RDTR;
+    CAN->sTxMailBox[mailbox].TDLR = to_send.RDLR;
+    CAN->sTxMailBox[mailbox].TDHR = to_send.RDHR;
+    CAN->sTxMailBox[mailbox].TDTR = to_send.RDTR & 0xF;
+    CAN->sTxMailBox[mailbox].TIR = to_send.RIR;
+  }
+
+  // all mailboxes taken and a frame waiting that goes before some of them.
+  // Aborting the one on the wire does nothing, so the best frame waits for
+  // at most one.
+  if (q->prio && (CAN->TSR & CAN_TSR_TME) == 0 && q->w_ptr > 0) {
+    for (int mailbox = 0; mailbox < CAN_TX_MAILBOXES; mailbox++) {
+      if (can_tx_aborting[can_number] & (1 << mailbox)) continue;
+      CAN_FIFOMailBox_TypeDef loaded;
+      loaded.RIR = CAN->sTxMailBox[mailbox].TIR;
+      loaded.RDTR = can_tx_mailbox_rdtr[can_number][mailbox];
+      if (can_tx_before(&q->elems[0], &loaded)) {
+        can_tx_aborting[can_number] |= 1 << mailbox;
+        CAN->TSR = CAN_TSR_ABRQ0 << CAN_TSR_MAILBOX_SHIFT(mailbox);
       }
+    }
+  }
 
-      // clear interrupt
-      // careful, this can also be cleared by requesting a transmission
-      CAN->TSR |= CAN_TSR_RQCP0;
+  #ifndef CUSTOM_CAN_INTERRUPTS
+    if (pushed) usb_ep1_in_kick();
+    can_lane_drained(bus_number);
+  #else
+    (void)pushed;
+  #endif
+  exit_critical_section();
+  PROFILE_END(PROFILE_PROCESS_CAN);
+}
+
+// ***************************** forwarding *****************************
+
+typedef struct {
+  uint32_t fwd_cnt;      // loaded straight into a TX mailbox
+  uint32_t queued_cnt;   // mailboxes busy, went through the TX queue
+  uint32_t drop_cnt;     // blocked by safety or the TX queue was full
+  uint32_t latency_last; // us from RX to TX mailbox, fast path only
+  uint32_t latency_max;
+} can_fwd_route;
+
+can_fwd_route can_fwd_routes[BUS_MAX][BUS_MAX];
+
+// called from the RX IRQ. The frame goes straight into a free mailbox of
+// the destination CAN, the TX queue is only used if frames are already
+// waiting there so ordering is kept. to_fwd isn't modified. 0 if it was
+// dropped.
+int can_forward(CAN_FIFOMailBox_TypeDef *to_fwd, uint8_t from_bus, int to_bus, uint32_t ts) {
+  if (to_bus < 0 || to_bus >= BUS_MAX) return 0;
+  can_fwd_route *route = &can_fwd_routes[from_bus][to_bus];
+
+  if (!safety_tx_hook(to_fwd)) {
+    route->drop_cnt += 1;
+    return 0;
+  }
+
+  uint8_t can_number = CAN_NUM_FROM_BUS_NUM(to_bus);
+  can_ring *q = can_queues[to_bus];
+  if (can_number != 0xff && q->r_ptr == q->w_ptr) {
+    CAN_TypeDef *CAN = CANIF_FROM_CAN_NUM(can_number);
+    if ((CAN->TSR & CAN_TSR_TME) != 0 && !can_tx_would_pass(CAN, to_fwd->RIR)) {
+      int mailbox = (CAN->TSR & CAN_TSR_CODE) >> 24;
+      can_stats[to_bus].tx_cnt += 1;
+      CAN->sTxMailBox[mailbox].TDLR = to_fwd->RDLR;
+      CAN->sTxMailBox[mailbox].TDHR = to_fwd->RDHR;
+      CAN->sTxMailBox[mailbox].TDTR = to_fwd->RDTR & 0xF;
+      can_tx_mailbox_rdtr[can_number][mailbox] = (to_fwd->RDTR & 0xF) | ((uint32_t)q->seq << CAN_TX_SEQ_SHIFT);
+      q->seq += 1;
+      CAN->sTxMailBox[mailbox].TIR = to_fwd->RIR | 1; // TXRQ
+
+      route->fwd_cnt += 1;
+      route->latency_last = TIM2->CNT - ts;
+      route->latency_max = max(route->latency_max, route->latency_last);
+      return 1;
     }
+  }
 
-    if (can_pop(can_queues[bus_number], &to_send)) {
-      can_tx_cnt += 1;
-      // only send if we have received a packet
-      CAN->sTxMailBox[0].TDLR = to_send.RDLR;
-      CAN->sTxMailBox[0].TDHR = to_send.RDHR;
-      CAN->sTxMailBox[0].TDTR = to_send.RDTR;
-      CAN->sTxMailBox[0].TIR = to_send.RIR;
+  CAN_FIFOMailBox_TypeDef to_send;
+  to_send.RIR = to_fwd->RIR | 1; // TXRQ
+  to_send.RDTR = to_fwd->RDTR & 0xF;
+  to_send.RDLR = to_fwd->RDLR;
+  to_send.RDHR = to_fwd->RDHR;
+  if (can_push(q, &to_send)) {
+    route->queued_cnt += 1;
+    process_can(can_number);
+    return 1;
+  }
+  route->drop_cnt += 1;
+  can_stats[to_bus].tx_drop_cnt += 1;
+  return 0;
+}
+
+// ********************* rx reporting *********************
+
+// host rules that thin out periodic frames on their way to the RX queues, matched
+// like the host filters. A matching frame goes on when its data changed since
+// the last one that did (CAN_REPORT_CHANGED), or when interval_us passed since
+// then, whichever the rule has. Forwarding and safety see every frame.
+#define CAN_REPORT_CHANGED 0x8000U
+#define CAN_REPORT_RULE_MAX 8
+// ids tracked, power of two. An id that finds no slot within
+// CAN_REPORT_PROBES of its hash isn't thinned out.
+#define CAN_REPORT_SLOTS 0x100
+#define CAN_REPORT_PROBES 8
+
+typedef struct {
+  uint32_t id;
+  uint32_t mask;
+  uint32_t interval_us;
+  uint8_t bus;
+  uint8_t changed;
+} can_report_rule;
+
+typedef struct {
+  uint32_t key; // RIR with the TXRQ bit set, 0 is free
+  uint8_t bus;
+  uint8_t len;
+  uint32_t RDLR;
+  uint32_t RDHR;
+  uint32_t ts;  // TIM2 of the last one sent on
+} can_report_slot;
+
+can_report_rule can_report_rules[CAN_REPORT_RULE_MAX];
+int can_report_rules_len = 0;
+can_report_slot can_report_slots[CAN_REPORT_SLOTS];
+
+void can_clear_report_rules() {
+  can_report_rules_len = 0;
+  memset(can_report_slots, 0, sizeof(can_report_slots));
+}
+
+int can_add_report_rule(int bus_number, uint32_t id, uint32_t mask, uint16_t flags) {
+  uint32_t interval_ms = flags & ~CAN_REPORT_CHANGED;
+  if (bus_number >= BUS_MAX || can_report_rules_len >= CAN_REPORT_RULE_MAX) return 0;
+  // a rule with neither would hold back everything after the first
+  if (!(flags & CAN_REPORT_CHANGED) && interval_ms == 0) return 0;
+  can_report_rule *r = &can_report_rules[can_report_rules_len++];
+  r->id = id & mask;
+  r->mask = mask;
+  r->interval_us = interval_ms * 1000;
+  r->bus = bus_number;
+  r->changed = (flags & CAN_REPORT_CHANGED) != 0;
+  return 1;
+}
+
+// the byte bits of the first len bytes of a data register pair
+#define CAN_DATA_MASK(len) (((len) >= 4) ? 0xFFFFFFFFU : ((1U << ((len) * 8)) - 1))
+
+// 1 if the frame goes to the host. Only the CAN RX IRQs call it, which don't
+// preempt each other.
+RAMFUNC int can_report(uint8_t bus_number, CAN_FIFOMailBox_TypeDef *f, uint32_t ts) {
+  if (can_report_rules_len == 0) return 1;
+
+  can_report_rule *rule = NULL;
+  for (int i = 0; i < can_report_rules_len; i++) {
+    can_report_rule *r = &can_report_rules[i];
+    if (r->bus == bus_number && (f->RIR & r->mask) == r->id) {
+      rule = r;
+      break;
     }
   }
+  if (rule == NULL) return 1;
+
+  uint32_t key = f->RIR | 1;
+  uint32_t hash = ((key >> 3) * 2654435761U) >> 24;
+  can_report_slot *slot = NULL;
+  for (int i = 0; i < CAN_REPORT_PROBES; i++) {
+    can_report_slot *s = &can_report_slots[(hash + bus_number + i) & (CAN_REPORT_SLOTS - 1)];
+    if ((s->key == key && s->bus == bus_number) || s->key == 0) {
+      slot = s;
+      break;
+    }
+  }
+  if (slot == NULL) return 1;
+
+  uint8_t len = f->RDTR & 0xF;
+  uint32_t RDLR = f->RDLR & CAN_DATA_MASK(min(len, 4));
+  uint32_t RDHR = f->RDHR & CAN_DATA_MASK(max(len, 4) - 4);
+  if (slot->key != 0) {
+    int changed = rule->changed && (slot->len != len || slot->RDLR != RDLR || slot->RDHR != RDHR);
+    int due = rule->interval_us != 0 && (ts - slot->ts) >= rule->interval_us;
+    if (!changed && !due) return 0;
+  }
 
-  exit_critical_section();
+  slot->key = key;
+  slot->bus = bus_number;
+  slot->len = len;
+  slot->RDLR = RDLR;
+  slot->RDHR = RDHR;
+  slot->ts = ts;
+  return 1;
 }
 
 // CAN receive handlers
-// blink blue when we are receiving CAN messages
-void can_rx(uint8_t can_number) {
+// takes what is in a FIFO, returns how many frames. *pushed is set if any
+// went in an rx queue
+RAMFUNC int can_rx_fifo(uint8_t can_number, int fifo, int *pushed) {
   CAN_TypeDef *CAN = CANIF_FROM_CAN_NUM(can_number);
   uint8_t bus_number = BUS_NUM_FROM_CAN_NUM(can_number);
-  while (CAN->RF0R & CAN_RF0R_FMP0) {
-    can_rx_cnt += 1;
+  // RF1R has the same layout as RF0R
+  volatile uint32_t *RFR = fifo ? &CAN->RF1R : &CAN->RF0R;
+  int received = 0;
+  while (*RFR & CAN_RF0R_FMP0) {
+    uint32_t ts = TIM2->CNT;
 
     // can is live
     pending_can_live = 1;
 
     // add to my fifo
     CAN_FIFOMailBox_TypeDef to_push;
-    to_push.RIR = CAN->sFIFOMailBox[0].RIR;
-    to_push.RDTR = CAN->sFIFOMailBox[0].RDTR;
-    to_push.RDLR = CAN->sFIFOMailBox[0].RDLR;
-    to_push.RDHR = CAN->sFIFOMailBox[0].RDHR;
-
-    // forwarding (panda only)
+    to_push.RIR = CAN->sFIFOMailBox[fifo].RIR;
+    to_push.RDTR = CAN->sFIFOMailBox[fifo].RDTR;
+    to_push.RDLR = CAN->sFIFOMailBox[fifo].RDLR;
+    to_push.RDHR = CAN->sFIFOMailBox[fifo].RDHR;
+    can_stats[bus_number].rx_cnt += 1;
+    can_stats[bus_number].bits += CAN_FRAME_BITS(to_push.RIR, to_push.RDTR);
+
+    // forwarding (panda only), a gateway rule for the id first
     #ifdef PANDA
-      int bus_fwd_num = can_forwarding[bus_number] != -1 ? can_forwarding[bus_number] : safety_fwd_hook(bus_number, &to_push);
-      if (bus_fwd_num != -1) {
-        CAN_FIFOMailBox_TypeDef to_send;
-        to_send.RIR = to_push.RIR | 1; // TXRQ
-        to_send.RDTR = to_push.RDTR;
-        to_send.RDLR = to_push.RDLR;
-        to_send.RDHR = to_push.RDHR;
-        can_send(&to_send, bus_fwd_num);
+      #ifndef CUSTOM_CAN_INTERRUPTS
+        int gatewayed = can_gateway_rx(bus_number, &to_push, ts);
+      #else
+        int gatewayed = 0;
+      #endif
+      if (!gatewayed) {
+        int bus_fwd_num = can_forwarding[bus_number] != -1 ? can_forwarding[bus_number] : safety_fwd_hook(bus_number, &to_push);
+        if (bus_fwd_num != -1) {
+          can_forward(&to_push, bus_number, bus_fwd_num, ts);
+        }
       }
     #endif
 
@@ -364,45 +1555,118 @@ void can_rx(uint8_t can_number) {
     safety_rx_hook(&to_push);
 
     #ifdef PANDA
-      set_led(LED_BLUE, 1);
+      can_capture(&to_push, ts);
     #endif
-    can_push(&can_rx_q, &to_push);
+    // the ISO-TP engine is the main firmware's, its channels' frames stay there
+    #ifndef CUSTOM_CAN_INTERRUPTS
+      can_census(bus_number, &to_push, ts);
+      can_responder_rx(bus_number, &to_push, ts);
+      int isotp = isotp_rx(bus_number, &to_push, ts);
+    #else
+      int isotp = 0;
+    #endif
+    if (isotp) {
+      // taken
+    } else if (!can_report(bus_number, &to_push, ts)) {
+      can_stats[bus_number].rx_suppressed_cnt += 1;
+    } else if (can_push_ts(&can_rx_qs[bus_number], &to_push, ts)) {
+      *pushed = 1;
+    } else {
+      can_stats[bus_number].rx_drop_cnt += 1;
+    }
 
     // next
-    CAN->RF0R |= CAN_RF0R_RFOM0;
+    *RFR |= CAN_RF0R_RFOM0;
+    received += 1;
   }
+  return received;
+}
+
+// once for all the frames can_rx_fifo took
+// blink blue when we are receiving CAN messages
+RAMFUNC void can_rx_done(int received, int pushed) {
+  if (received == 0) return;
+  #ifdef PANDA
+    set_led(LED_BLUE, 1);
+    // tell the ESP there is CAN to poll
+    spi_data_ready();
+  #endif
+  // and have it waiting in the EP1 FIFO for the host's next IN
+  #ifndef CUSTOM_CAN_INTERRUPTS
+    if (pushed) usb_ep1_in_kick();
+  #else
+    (void)pushed;
+  #endif
+}
+
+RAMFUNC void can_rx(uint8_t can_number, int fifo) {
+  PROFILE_BEGIN();
+  int pushed = 0;
+  int received = can_rx_fifo(can_number, fifo, &pushed);
+  can_rx_done(received, pushed);
+  // under load the FIFOs are drained on a timer instead
+  #ifndef CUSTOM_CAN_INTERRUPTS
+    can_coalesce_note(received);
+  #endif
+  PROFILE_END(PROFILE_CAN_RX);
 }
 
 #ifndef CUSTOM_CAN_INTERRUPTS
 
-void CAN1_TX_IRQHandler() { process_can(0); }
-void CAN1_RX0_IRQHandler() { can_rx(0); }
+RAMFUNC void CAN1_TX_IRQHandler() { process_can(0); }
+RAMFUNC void CAN1_RX0_IRQHandler() { can_rx(0, 0); }
+RAMFUNC void CAN1_RX1_IRQHandler() { can_rx(0, 1); }
 void CAN1_SCE_IRQHandler() { can_sce(CAN1); }
 
-void CAN2_TX_IRQHandler() { process_can(1); }
-void CAN2_RX0_IRQHandler() { can_rx(1); }
+RAMFUNC void CAN2_TX_IRQHandler() { process_can(1); }
+RAMFUNC void CAN2_RX0_IRQHandler() { can_rx(1, 0); }
+RAMFUNC void CAN2_RX1_IRQHandler() { can_rx(1, 1); }
 void CAN2_SCE_IRQHandler() { can_sce(CAN2); }
 
 #ifdef CAN3
-void CAN3_TX_IRQHandler() { process_can(2); }
-void CAN3_RX0_IRQHandler() { can_rx(2); }
+RAMFUNC void CAN3_TX_IRQHandler() { process_can(2); }
+RAMFUNC void CAN3_RX0_IRQHandler() { can_rx(2, 0); }
+RAMFUNC void CAN3_RX1_IRQHandler() { can_rx(2, 1); }
 void CAN3_SCE_IRQHandler() { can_sce(CAN3); }
 #endif
 
 #endif
 
-void can_send(CAN_FIFOMailBox_TypeDef *to_push, uint8_t bus_number) {
+// token is CAN_TX_TOKEN and the token, or 0 for none
+void can_send_token(CAN_FIFOMailBox_TypeDef *to_push, uint8_t bus_number, uint32_t token) {
   if (safety_tx_hook(to_push)) {
     if (bus_number < BUS_MAX) {
       // add CAN packet to send queue
-      // bus number isn't passed through
-      to_push->RDTR &= 0xF;
-      can_push(can_queues[bus_number], to_push);
+      // bus number isn't passed through, it's where the token goes
+      to_push->RDTR = (to_push->RDTR & (0xF | CAN_TX_URGENT)) | token;
+      if (!can_push(can_queues[bus_number], to_push)) can_stats[bus_number].tx_drop_cnt += 1;
       process_can(CAN_NUM_FROM_BUS_NUM(bus_number));
     }
   }
 }
 
+void can_send(CAN_FIFOMailBox_TypeDef *to_push, uint8_t bus_number) {
+  can_send_token(to_push, bus_number, 0);
+}
+
 void can_set_forwarding(int from, int to) {
   can_forwarding[from] = to;
+  // forwarded buses can't drop frames in hardware
+  can_init_filters(CAN_NUM_FROM_BUS_NUM(from));
+}
+
+// filters are collected by can_add_filter and applied by can_init_filters
+void can_clear_filters(int bus_number) {
+  can_filters_len[bus_number] = 0;
+}
+
+int can_add_filter(int bus_number, uint32_t id, uint32_t mask) {
+  if (can_filters_len[bus_number] >= CAN_FILTER_MAX) {
+    puts("can_add_filter failed!\n");
+    return 0;
+  }
+  can_filter *f = &can_filters[bus_number][can_filters_len[bus_number]++];
+  f->id = id;
+  f->mask = mask;
+  return 1;
 }
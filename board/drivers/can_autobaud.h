@@ -0,0 +1,159 @@
+// IRQs: CAN1_SCE, CAN2_SCE, CAN3_SCE, and the main loop runs it
+// Bitrate detection, started by 0xa2, on every CAN at once. Each is held
+// listen-only (SILM) and tried at the rates of can_autobaud_rates in turn,
+// a dwell at each, counting the frames it receives and, with the LEC IRQ on,
+// the errors it sees. A rate with frames and more of them than errors is
+// the bus's and the CAN stops there, one that gets nothing but
+// CAN_AUTOBAUD_ERRORS_ENOUGH errors or CAN_AUTOBAUD_FRAMES_ENOUGH frames is
+// decided before its dwell is up. A bus that finds its rate keeps it in
+// can_speed, the others go back to what they had, and all go back to the
+// silent setting of the safety mode.
+//
+// Switching a CAN's rate waits on INAK, so like the deferred control
+// requests it's done by the main loop, whose ticks the dwell is rounded up
+// to. Frames still go up to the host as they're received. A bitrate set with
+// 0xde while it runs is lost.
+
+#define CAN_AUTOBAUD_RATES 6
+#define CAN_AUTOBAUD_FRAMES_ENOUGH 8U
+#define CAN_AUTOBAUD_DWELL_MS 50U
+
+// in can_speed's units, the usual ones first
+const uint16_t can_autobaud_rates[CAN_AUTOBAUD_RATES] = {5000, 2500, 1250, 10000, 833, 333};
+
+#define CAN_AUTOBAUD_IDLE 0
+#define CAN_AUTOBAUD_TRYING 1
+#define CAN_AUTOBAUD_FOUND 2
+#define CAN_AUTOBAUD_NONE 3 // quiet, or nothing made sense
+
+typedef struct {
+  uint8_t state;
+  uint8_t rate;          // being tried, or found
+  uint16_t speed_before;
+  uint32_t rx_start;     // the bus's rx_cnt when the rate went on
+  uint32_t due_ts;
+  uint8_t frames[CAN_AUTOBAUD_RATES]; // each at most 0xFF
+  uint8_t errors[CAN_AUTOBAUD_RATES];
+} can_autobaud_can;
+
+can_autobaud_can can_autobaud[CAN_MAX];
+uint32_t can_autobaud_dwell_us = CAN_AUTOBAUD_DWELL_MS * 1000U;
+// what 0xa2 left for the main loop
+#define CAN_AUTOBAUD_REQ_START 1
+#define CAN_AUTOBAUD_REQ_STOP 2
+volatile int can_autobaud_req = 0;
+
+void can_autobaud_try(uint8_t can_number) {
+  can_autobaud_can *a = &can_autobaud[can_number];
+  can_speed[BUS_NUM_FROM_CAN_NUM(can_number)] = can_autobaud_rates[a->rate];
+  can_reconfigure(can_number);
+  enter_critical_section();
+  a->rx_start = can_stats[BUS_NUM_FROM_CAN_NUM(can_number)].rx_cnt;
+  can_autobaud_errors[can_number] = 0;
+  CANIF_FROM_CAN_NUM(can_number)->IER |= CAN_IER_ERRIE | CAN_IER_LECIE;
+  exit_critical_section();
+  a->due_ts = TIM2->CNT + can_autobaud_dwell_us;
+}
+
+// rate is -1 when nothing was found
+void can_autobaud_finish(uint8_t can_number, int rate) {
+  can_autobaud_can *a = &can_autobaud[can_number];
+  enter_critical_section();
+  can_autobaud_cans &= ~(1U << can_number);
+  CANIF_FROM_CAN_NUM(can_number)->IER &= ~(CAN_IER_ERRIE | CAN_IER_LECIE);
+  exit_critical_section();
+  a->state = (rate == -1) ? CAN_AUTOBAUD_NONE : CAN_AUTOBAUD_FOUND;
+  if (rate != -1) a->rate = rate;
+  can_speed[BUS_NUM_FROM_CAN_NUM(can_number)] = (rate == -1) ? a->speed_before : can_autobaud_rates[rate];
+  can_reconfigure(can_number);
+}
+
+// again from the first rate if it's already going
+void can_autobaud_start(uint16_t dwell_ms) {
+  can_autobaud_dwell_us = (dwell_ms ? dwell_ms : CAN_AUTOBAUD_DWELL_MS) * 1000U;
+  can_autobaud_req = CAN_AUTOBAUD_REQ_START;
+}
+
+// every CAN still trying goes back to what it had
+void can_autobaud_stop() {
+  can_autobaud_req = CAN_AUTOBAUD_REQ_STOP;
+}
+
+// from the main loop, every time it wakes
+void can_autobaud_service() {
+  enter_critical_section();
+  int req = can_autobaud_req;
+  can_autobaud_req = 0;
+  exit_critical_section();
+  if (req == 0 && can_autobaud_cans == 0) return;
+  ctrl_defer_hold(1);
+  if (req == CAN_AUTOBAUD_REQ_STOP) {
+    for (int i = 0; i < CAN_MAX; i++) {
+      if (can_autobaud_cans & (1U << i)) can_autobaud_finish(i, -1);
+    }
+  } else if (req == CAN_AUTOBAUD_REQ_START) {
+    for (int i = 0; i < CAN_MAX; i++) {
+      can_autobaud_can *a = &can_autobaud[i];
+      // a bus without a CAN, GMLAN's while it's off
+      if (BUS_NUM_FROM_CAN_NUM(i) >= BUS_MAX) continue;
+      if ((can_autobaud_cans & (1U << i)) == 0) a->speed_before = can_speed[BUS_NUM_FROM_CAN_NUM(i)];
+      memset(a->frames, 0, sizeof(a->frames));
+      memset(a->errors, 0, sizeof(a->errors));
+      a->state = CAN_AUTOBAUD_TRYING;
+      a->rate = 0;
+      can_autobaud_cans |= 1U << i;
+      can_autobaud_try(i);
+    }
+  }
+
+  uint32_t now = TIM2->CNT;
+  for (int i = 0; i < CAN_MAX; i++) {
+    if ((can_autobaud_cans & (1U << i)) == 0) continue;
+    can_autobaud_can *a = &can_autobaud[i];
+    uint32_t frames = can_stats[BUS_NUM_FROM_CAN_NUM(i)].rx_cnt - a->rx_start;
+    uint32_t errors = can_autobaud_errors[i];
+    int decided = (frames == 0 && errors >= CAN_AUTOBAUD_ERRORS_ENOUGH) ||
+                  (frames >= CAN_AUTOBAUD_FRAMES_ENOUGH && errors == 0);
+    if (!decided && (int32_t)(now - a->due_ts) < 0) continue;
+
+    a->frames[a->rate] = min(frames, 0xFFU);
+    a->errors[a->rate] = min(errors, 0xFFU);
+    if (frames > 0 && frames > errors) {
+      can_autobaud_finish(i, a->rate);
+    } else if (a->rate + 1 == CAN_AUTOBAUD_RATES) {
+      can_autobaud_finish(i, -1);
+    } else {
+      a->rate += 1;
+      can_autobaud_try(i);
+    }
+  }
+  ctrl_defer_hold(0);
+}
+
+int can_autobaud_status(uint8_t *out) {
+  struct __attribute__((packed)) {
+    uint8_t trying;    // CAN bits
+    uint8_t cans;
+    uint16_t dwell_ms;
+    struct __attribute__((packed)) {
+      uint8_t bus;
+      uint8_t state;   // CAN_AUTOBAUD_*
+      uint16_t speed;  // found, 0 for none yet
+      uint8_t frames[CAN_AUTOBAUD_RATES];
+      uint8_t errors[CAN_AUTOBAUD_RATES];
+    } can[CAN_MAX];
+  } *st = (void *)out;
+  COMPILE_TIME_ASSERT(sizeof(*st) <= MAX_RESP_LEN)
+  st->trying = can_autobaud_cans | ((can_autobaud_req == CAN_AUTOBAUD_REQ_START) ? ((1U << CAN_MAX) - 1U) : 0U);
+  st->cans = CAN_MAX;
+  st->dwell_ms = can_autobaud_dwell_us / 1000U;
+  for (int i = 0; i < CAN_MAX; i++) {
+    can_autobaud_can *a = &can_autobaud[i];
+    st->can[i].bus = BUS_NUM_FROM_CAN_NUM(i);
+    st->can[i].state = a->state;
+    st->can[i].speed = (a->state == CAN_AUTOBAUD_FOUND) ? can_autobaud_rates[a->rate] : 0;
+    memcpy(st->can[i].frames, a->frames, sizeof(a->frames));
+    memcpy(st->can[i].errors, a->errors, sizeof(a->errors));
+  }
+  return sizeof(*st);
+}
@@ -0,0 +1,128 @@
+// IRQs: CAN1_RX0, CAN1_RX1, CAN2_RX0, CAN2_RX1, CAN3_RX0, CAN3_RX1
+// Per (bus, id) table of what was received since 0xca started it, so a
+// census of the buses is a read of 0xcb instead of a capture of everything.
+//
+// An entry has the count, the min, max and 64 bit sum of the periods from
+// the TIM2 timestamps, the DLCs seen and the last data. The entries are in
+// the order the ids first came, found by an open addressed index twice their
+// size so a probe always ends at an empty slot. Ids past CAN_CENSUS_LEN are
+// only counted as missed.
+
+#define CAN_CENSUS_LEN 0x100
+#define CAN_CENSUS_INDEX_LEN (2 * CAN_CENSUS_LEN) // power of two
+
+typedef struct {
+  uint32_t RIR;        // the id and IDE, RTR and TXRQ cleared
+  uint8_t bus;
+  uint8_t dlc;         // of the last frame
+  uint16_t dlcs;       // bit n for a frame with DLC n
+  uint32_t count;
+  uint32_t last_ts;
+  uint32_t min_period; // us, 0xFFFFFFFF until there are two frames
+  uint32_t max_period;
+  uint64_t period_sum; // the host divides, there's no 64 bit division without libgcc
+  uint32_t RDLR;       // of the last frame
+  uint32_t RDHR;
+} can_census_entry;
+
+can_census_entry can_census_entries[CAN_CENSUS_LEN];
+// entry + 1, 0 is empty
+uint16_t can_census_index[CAN_CENSUS_INDEX_LEN];
+int can_census_on = 0;
+uint32_t can_census_len = 0;
+uint32_t can_census_missed = 0;
+
+uint32_t can_census_hash(uint32_t RIR, uint8_t bus) {
+  uint32_t h = (RIR >> 3) ^ (RIR >> 14) ^ (bus * 0x9E3779B1U);
+  return (h ^ (h >> 16)) & (CAN_CENSUS_INDEX_LEN - 1);
+}
+
+// every frame received, in the layout of the RX queues
+RAMFUNC void can_census(uint8_t bus, CAN_FIFOMailBox_TypeDef *f, uint32_t ts) {
+  if (!can_census_on) return;
+  uint32_t RIR = f->RIR & ~3U;
+
+  can_census_entry *e = NULL;
+  uint32_t h = can_census_hash(RIR, bus);
+  while (can_census_index[h] != 0) {
+    can_census_entry *c = &can_census_entries[can_census_index[h] - 1];
+    if (c->RIR == RIR && c->bus == bus) {
+      e = c;
+      break;
+    }
+    h = (h + 1) & (CAN_CENSUS_INDEX_LEN - 1);
+  }
+
+  if (e == NULL) {
+    if (can_census_len == CAN_CENSUS_LEN) {
+      can_census_missed += 1;
+      return;
+    }
+    e = &can_census_entries[can_census_len];
+    can_census_len += 1;
+    can_census_index[h] = can_census_len;
+    e->RIR = RIR;
+    e->bus = bus;
+    e->dlcs = 0;
+    e->count = 0;
+    e->min_period = 0xFFFFFFFF;
+    e->max_period = 0;
+    e->period_sum = 0;
+  } else {
+    uint32_t period = ts - e->last_ts;
+    e->min_period = min(e->min_period, period);
+    e->max_period = max(e->max_period, period);
+    e->period_sum += period;
+  }
+
+  e->dlc = f->RDTR & 0xF;
+  e->dlcs |= 1U << min(e->dlc, 8);
+  e->count += 1;
+  e->last_ts = ts;
+  e->RDLR = f->RDLR;
+  e->RDHR = f->RDHR;
+}
+
+// empties the table, then keeps it if on
+void can_census_start(int on) {
+  enter_critical_section();
+  can_census_on = 0;
+  memset(can_census_index, 0, sizeof(can_census_index));
+  can_census_len = 0;
+  can_census_missed = 0;
+  can_census_on = on;
+  exit_critical_section();
+}
+
+void can_census_stop() {
+  can_census_on = 0;
+}
+
+int can_census_status(uint8_t *out) {
+  struct __attribute__((packed)) {
+    uint32_t on;
+    uint32_t len;
+    uint32_t missed;
+    uint32_t now; // TIM2, for the age of the last frames
+  } *st = (void *)out;
+  enter_critical_section();
+  st->on = can_census_on;
+  st->len = can_census_len;
+  st->missed = can_census_missed;
+  st->now = TIM2->CNT;
+  exit_critical_section();
+  return sizeof(*st);
+}
+
+// the entries from index from on that fit in len bytes
+int can_census_read(uint32_t from, uint8_t *out, int len) {
+  int pos = 0;
+  for (uint32_t i = from; i < can_census_len && pos + (int)sizeof(can_census_entry) <= len; i++) {
+    // a frame can come in halfway through the copy
+    enter_critical_section();
+    memcpy(out + pos, &can_census_entries[i], sizeof(can_census_entry));
+    exit_critical_section();
+    pos += sizeof(can_census_entry);
+  }
+  return pos;
+}
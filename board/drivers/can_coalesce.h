@@ -0,0 +1,178 @@
+// IRQs: CAN1_RX0, CAN1_RX1, CAN2_RX0, CAN2_RX1, CAN3_RX0, CAN3_RX1, TIM2
+// Coalescing of the CAN RX IRQs. Under load the FMP interrupts are masked and
+// TIM2 compare 4 drains every FIFO of every CAN at once, so the LED and the
+// kicks of the ESP and EP1 are done once a drain instead of once a frame and
+// the IRQ entries of all the buses become one.
+//
+// The drains are period_us apart: the host's bound on the extra latency of a
+// frame, and never more than two of the shortest frames at the fastest
+// bitrate, so a 3 deep FIFO doesn't fill in between and the safety hooks see
+// every frame about as soon as they would. Load is frames a window of
+// CAN_COALESCE_WINDOW_US: two a drain start it, CAN_COALESCE_EXIT_WINDOWS
+// windows of less than one a drain go back to an IRQ a frame. A FIFO that
+// overran between drains goes back too, held off for CAN_COALESCE_HOLDOFF_US.
+
+#define CAN_COALESCE_WINDOW_US 1000U
+#define CAN_COALESCE_EXIT_WINDOWS 4
+#define CAN_COALESCE_HOLDOFF_US 100000U
+
+typedef struct {
+  uint32_t max_latency_us; // 0 is off
+  uint32_t period_us;
+  int active;
+  uint32_t next_ts;        // of the next drain
+  uint32_t window_ts;
+  uint32_t window_frames;
+  int quiet_windows;
+  int overran;             // stopped by an overrun at stopped_ts
+  uint32_t stopped_ts;
+  uint32_t entered;
+  uint32_t drains;
+  uint32_t frames;         // taken by drains
+  uint32_t overruns;       // FIFOs a drain found overrun
+  uint32_t late_max;       // most us a drain went after its time
+} can_coalesce_state;
+
+can_coalesce_state can_coalesce;
+
+// the host's bound, cut to two DLC 0 frames at the fastest bitrate
+uint32_t can_coalesce_period() {
+  uint32_t speed = 1;
+  for (int i = 0; i < CAN_MAX; i++) speed = max(speed, can_speed[BUS_NUM_FROM_CAN_NUM(i)]);
+  // can_speed is in 100 bps
+  uint32_t bound = 2U * CAN_FRAME_BITS(0, 0) * 10000U / speed;
+  return max(min(can_coalesce.max_latency_us, bound), 1U);
+}
+
+void can_coalesce_mask(int masked) {
+  for (int i = 0; i < CAN_MAX; i++) {
+    CAN_TypeDef *CAN = CANIF_FROM_CAN_NUM(i);
+    if (masked) {
+      CAN->IER &= ~(CAN_IER_FMPIE0 | CAN_IER_FMPIE1);
+    } else {
+      CAN->IER |= CAN_IER_FMPIE0 | CAN_IER_FMPIE1;
+    }
+  }
+}
+
+// frames received, 1 when the window closed with fewer than per_drain a drain
+int can_coalesce_window(uint32_t now, int received, uint32_t per_drain, int *low) {
+  can_coalesce_state *c = &can_coalesce;
+  c->window_frames += received;
+  uint32_t elapsed = now - c->window_ts;
+  if (elapsed < CAN_COALESCE_WINDOW_US) return 0;
+  *low = c->window_frames < per_drain * (elapsed / c->period_us);
+  c->window_ts = now;
+  c->window_frames = 0;
+  return 1;
+}
+
+void can_coalesce_stop(uint32_t now, int overran) {
+  can_coalesce_state *c = &can_coalesce;
+  c->active = 0;
+  c->overran = overran;
+  c->stopped_ts = now;
+  c->window_ts = now;
+  c->window_frames = 0;
+  can_coalesce_mask(0);
+}
+
+// after an IRQ's frames, starts coalescing if they come fast enough
+void can_coalesce_note(int received) {
+  can_coalesce_state *c = &can_coalesce;
+  if (c->max_latency_us == 0 || c->active) return;
+  uint32_t now = TIM2->CNT;
+  if (c->overran && (now - c->stopped_ts) < CAN_COALESCE_HOLDOFF_US) return;
+  c->overran = 0;
+
+  c->period_us = can_coalesce_period();
+  int low = 1;
+  if (!can_coalesce_window(now, received, 2, &low) || low) return;
+
+  c->active = 1;
+  c->next_ts = now + c->period_us;
+  c->quiet_windows = 0;
+  c->entered += 1;
+  can_coalesce_mask(1);
+  // can_timed_service arms CC4 for the first drain, from an event now
+  TIM2->DIER |= TIM_DIER_CC4IE;
+  TIM2->EGR = TIM_EGR_CC4G;
+}
+
+// drains the FIFOs if it's time, 0 if not coalescing or *due is the next drain
+int can_coalesce_service(uint32_t now, uint32_t *due) {
+  can_coalesce_state *c = &can_coalesce;
+  if (!c->active) return 0;
+
+  if (CAN_PERIODIC_DUE(c->next_ts, now)) {
+    c->late_max = max(c->late_max, now - c->next_ts);
+    int received = 0;
+    int pushed = 0;
+    int overrun = 0;
+    for (int i = 0; i < CAN_MAX; i++) {
+      CAN_TypeDef *CAN = CANIF_FROM_CAN_NUM(i);
+      // releasing a mailbox clears FOVR, look first
+      if ((CAN->RF0R & CAN_RF0R_FOVR0) || (CAN->RF1R & CAN_RF1R_FOVR1)) overrun += 1;
+      received += can_rx_fifo(i, 0, &pushed);
+      received += can_rx_fifo(i, 1, &pushed);
+    }
+    can_rx_done(received, pushed);
+    c->drains += 1;
+    c->frames += received;
+    c->overruns += overrun;
+
+    int low = 0;
+    if (can_coalesce_window(now, received, 1, &low)) c->quiet_windows = low ? (c->quiet_windows + 1) : 0;
+    if (overrun || c->max_latency_us == 0 || c->quiet_windows >= CAN_COALESCE_EXIT_WINDOWS) {
+      can_coalesce_stop(now, overrun);
+      return 0;
+    }
+
+    // can_init puts them back on a CAN it sets up again
+    can_coalesce_mask(1);
+    c->period_us = can_coalesce_period();
+    c->next_ts += c->period_us;
+    // don't drain in a burst to catch up
+    if (CAN_PERIODIC_DUE(c->next_ts, now)) c->next_ts = now + c->period_us;
+  }
+  *due = c->next_ts;
+  return 1;
+}
+
+// 0 turns it off, the FIFOs go back to an IRQ a frame
+void can_coalesce_set(uint32_t max_latency_us) {
+  enter_critical_section();
+  can_coalesce_state *c = &can_coalesce;
+  uint32_t now = TIM2->CNT;
+  c->max_latency_us = max_latency_us;
+  c->overran = 0;
+  c->window_ts = now;
+  c->window_frames = 0;
+  if (max_latency_us == 0 && c->active) can_coalesce_stop(now, 0);
+  exit_critical_section();
+}
+
+int can_coalesce_status(uint8_t *out) {
+  struct __attribute__((packed)) {
+    uint32_t max_latency_us;
+    uint32_t period_us;
+    uint32_t active;
+    uint32_t entered;
+    uint32_t drains;
+    uint32_t frames;
+    uint32_t overruns;
+    uint32_t late_max;
+  } *st = (void *)out;
+  enter_critical_section();
+  can_coalesce_state *c = &can_coalesce;
+  st->max_latency_us = c->max_latency_us;
+  st->period_us = c->active ? c->period_us : 0;
+  st->active = c->active;
+  st->entered = c->entered;
+  st->drains = c->drains;
+  st->frames = c->frames;
+  st->overruns = c->overruns;
+  st->late_max = c->late_max;
+  exit_critical_section();
+  return sizeof(*st);
+}
@@ -0,0 +1,120 @@
+// compact CAN records on ep1 IN and ep3 OUT, set with 0xc4, USB only
+//
+// Records have only the bytes the frame needs and never span a packet:
+//   byte 0  bits 0-3 len, up to 8
+//           bits 4-5 bus
+//           bit 6    RX: sent by the panda (CAN_BUS_RET_FLAG), TX: CAN_TX_URGENT
+//           bit 7    29 bit id
+//   id      2 bytes, or 4 for a 29 bit id, little endian
+//   time    RX only, int16 us from the packet's first record, or 0x8000 and
+//           then the whole TIM2 time. The first record always has the whole time.
+//   data    len bytes
+// A len of 0xF pads out the rest of the packet. On TX a len of 0xE is a
+// control record, its kind in bits 4-7 and then 4 bytes of TIM2 time, as
+// with classic records with TXRQ clear: kind 0 has the next frame sent at the
+// time, the others are transmit groups, see can_group.h. On RX a len of 0xD is a completion, see
+// can_echo_mode and can_one_shot, bit 6 set, then the 2 byte token with its
+// CAN_DONE_ flags and the time, without the id or data. On RX a len of 0xC
+// is an event, see events.h, its kind in bits 4-7, then a byte of its
+// channel in bits 4-7 and its len, the time and the data. RTR frames aren't
+// carried.
+
+#define CAN_FORMAT_CLASSIC 0
+#define CAN_FORMAT_COMPACT 1
+#define CAN_FORMAT_MAX CAN_FORMAT_COMPACT
+
+#define CAN_COMPACT_LEN_MASK 0xF
+#define CAN_COMPACT_BUS_SHIFT 4
+#define CAN_COMPACT_BUS_MASK 0x3
+#define CAN_COMPACT_FLAG 0x40
+#define CAN_COMPACT_EXT 0x80
+#define CAN_COMPACT_PAD 0xF
+#define CAN_COMPACT_TIME 0xE
+#define CAN_COMPACT_DONE 0xD
+#define CAN_COMPACT_EVENT 0xC
+#define CAN_COMPACT_TS_WIDE 0x8000
+
+// the length of msg's RX record, 0 for buses past 3, which have no room in
+// the header and aren't sent
+int can_compact_rx_len(CAN_FIFOMailBox_TypeDef *msg, int wide) {
+  if (((msg->RDTR >> 4) & 0xFF) == EVENT_BUS) return 2 + (wide ? 6 : 2) + min(msg->RDTR & 0xF, 4);
+  if (((msg->RDTR >> 4) & CAN_BUS_NUM_MASK) > CAN_COMPACT_BUS_MASK) return 0;
+  // TXRQ only on completions
+  if (msg->RIR & 1) return 1 + 2 + (wide ? 6 : 2);
+  return 1 + ((msg->RIR & 4) ? 4 : 2) + (wide ? 6 : 2) + min(msg->RDTR & 0xF, 8);
+}
+
+// whether ts needs the whole time after ts_base
+int can_compact_wide(uint32_t ts, uint32_t ts_base) {
+  int32_t delta = (int32_t)(ts - ts_base);
+  return delta < -0x7FFF || delta > 0x7FFF;
+}
+
+// writes msg's RX record at out, with room checked by can_compact_rx_len,
+// returns its length
+int can_compact_rx_put(uint8_t *out, CAN_FIFOMailBox_TypeDef *msg, uint32_t ts, uint32_t ts_base, int wide) {
+  int bus = (msg->RDTR >> 4) & 0xFF;
+  int len = min(msg->RDTR & 0xF, 8);
+  int pos = 0;
+  if (bus == EVENT_BUS) {
+    uint32_t id = msg->RIR >> 21;
+    len = min(len, 4);
+    out[pos++] = CAN_COMPACT_EVENT | (((id >> 4) & 0xF) << 4);
+    out[pos++] = ((id & 0xF) << 4) | len;
+  } else if (msg->RIR & 1) {
+    out[pos++] = CAN_COMPACT_DONE | ((bus & CAN_COMPACT_BUS_MASK) << CAN_COMPACT_BUS_SHIFT) | CAN_COMPACT_FLAG;
+    uint16_t token = msg->RDLR;
+    memcpy(&out[pos], &token, 2);
+    pos += 2;
+    len = 0;
+  } else {
+    out[pos++] = len | ((bus & CAN_COMPACT_BUS_MASK) << CAN_COMPACT_BUS_SHIFT) |
+                 ((bus & CAN_BUS_RET_FLAG) ? CAN_COMPACT_FLAG : 0) | ((msg->RIR & 4) ? CAN_COMPACT_EXT : 0);
+    uint32_t id = (msg->RIR & 4) ? (msg->RIR >> 3) : (msg->RIR >> 21);
+    memcpy(&out[pos], &id, (msg->RIR & 4) ? 4 : 2);
+    pos += (msg->RIR & 4) ? 4 : 2;
+  }
+  uint16_t rel = wide ? CAN_COMPACT_TS_WIDE : (uint16_t)(ts - ts_base);
+  memcpy(&out[pos], &rel, 2);
+  pos += 2;
+  if (wide) {
+    memcpy(&out[pos], &ts, 4);
+    pos += 4;
+  }
+  uint32_t dat[2] = {msg->RDLR, msg->RDHR};
+  memcpy(&out[pos], dat, len);
+  return pos + len;
+}
+
+// reads one TX record of the len bytes at in into msg, returns its length,
+// 0 at padding or a record cut short. A control record sets *ts and returns
+// its length with *ctrl set to its CAN_TX_CTRL_, 0 for a frame.
+int can_compact_tx_get(uint8_t *in, int len, CAN_FIFOMailBox_TypeDef *msg, uint32_t *ts, int *ctrl) {
+  *ctrl = 0;
+  if (len < 1) return 0;
+  int dlc = in[0] & CAN_COMPACT_LEN_MASK;
+  if (dlc == CAN_COMPACT_PAD) return 0;
+  if (dlc == CAN_COMPACT_TIME) {
+    if (len < 5) return 0;
+    memcpy(ts, &in[1], 4);
+    *ctrl = CAN_TX_CTRL_TIME + (in[0] >> 4);
+    return 5;
+  }
+
+  int ext = (in[0] & CAN_COMPACT_EXT) != 0;
+  int idl = ext ? 4 : 2;
+  dlc = min(dlc, 8);
+  if (len < 1 + idl + dlc) return 0;
+
+  uint32_t id = 0;
+  memcpy(&id, &in[1], idl);
+  uint32_t dat[2] = {0, 0};
+  memcpy(dat, &in[1 + idl], dlc);
+
+  msg->RIR = (ext ? (((id & 0x1FFFFFFF) << 3) | 4) : ((id & 0x7FF) << 21)) | 1;
+  msg->RDTR = dlc | (((in[0] >> CAN_COMPACT_BUS_SHIFT) & CAN_COMPACT_BUS_MASK) << 4) |
+              ((in[0] & CAN_COMPACT_FLAG) ? CAN_TX_URGENT : 0);
+  msg->RDLR = dat[0];
+  msg->RDHR = dat[1];
+  return 1 + idl + dlc;
+}
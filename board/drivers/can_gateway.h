@@ -0,0 +1,277 @@
+// IRQs: CAN1_RX0, CAN1_RX1, CAN2_RX0, CAN2_RX1, CAN3_RX0, CAN3_RX1
+// Gateway rules, a table of what to do with each (bus, id) received, built
+// with 0xa0 and looked up from the CAN RX IRQ before the forwarding of
+// can_forwarding and safety_fwd_hook, which a frame without a rule still gets.
+//
+// A rule forwards its frames to a bus or drops them. A forwarded frame can
+// have its id replaced, the data bytes under its mask replaced, and be held
+// to one every interval ms, the ones in between dropped. It then goes through
+// can_forward like any other, so safety_tx_hook has the last word. Either way
+// the frame still goes to the RX queues as it came.
+//
+// 0xa0 edits a staged copy of the table, kept sorted by bus and id, and
+// loading it swaps it in at once, so the IRQ only ever sees a whole table
+// and finds a frame's rule in log2(CAN_GATEWAY_RULES) compares.
+
+#ifdef PANDA
+  #define CAN_GATEWAY_RULES 32
+#else
+  #define CAN_GATEWAY_RULES 2
+#endif
+
+#define CAN_GATEWAY_DROP 0xFF
+
+#define CAN_GATEWAY_REWRITE_ID 1
+#define CAN_GATEWAY_REWRITE_DATA 2
+
+// 0xa0 parameters of the staged rule
+#define CAN_GATEWAY_PARAM_BUS 0
+#define CAN_GATEWAY_PARAM_ID_LO 1     // the id in the RIR layout
+#define CAN_GATEWAY_PARAM_ID_HI 2
+#define CAN_GATEWAY_PARAM_TO_BUS 3    // or CAN_GATEWAY_DROP
+#define CAN_GATEWAY_PARAM_FLAGS 4     // CAN_GATEWAY_REWRITE_*
+#define CAN_GATEWAY_PARAM_NEW_ID_LO 5 // RIR layout, IDE and RTR too
+#define CAN_GATEWAY_PARAM_NEW_ID_HI 6
+#define CAN_GATEWAY_PARAM_INTERVAL 7  // ms between forwarded frames, 0 for all of them
+#define CAN_GATEWAY_PARAM_DATA 8      // to 15, the new byte | its mask << 8 for each data byte
+// the staged rule into the staged table, over one with its bus and id
+#define CAN_GATEWAY_PARAM_ADD 0x80
+// the staged table's rule with the staged rule's bus and id out of it
+#define CAN_GATEWAY_PARAM_REMOVE 0x81
+#define CAN_GATEWAY_PARAM_CLEAR 0x82
+// the staged table in use, its counts from 0 and its intervals where they were
+#define CAN_GATEWAY_PARAM_LOAD 0x83
+
+typedef struct {
+  uint32_t id;         // RIR, TXRQ cleared
+  uint8_t bus;
+  uint8_t to_bus;
+  uint8_t flags;
+  uint32_t new_id;
+  uint32_t interval_us;
+  uint32_t data[2];    // RDLR, RDHR
+  uint32_t mask[2];
+
+  uint32_t hits;
+  uint32_t forwarded;  // handed to can_forward and not refused
+  uint32_t limited;    // dropped for the interval
+  uint32_t blocked;    // refused by safety or a full TX queue
+  int sent_one;        // last_ts is set, kept over loads
+  uint32_t last_ts;    // of the last one forwarded
+  uint32_t latency_last; // us from RX to can_forward done
+  uint32_t latency_max;
+} can_gateway_rule;
+
+typedef struct {
+  int len;
+  can_gateway_rule rules[CAN_GATEWAY_RULES];
+} can_gateway_table;
+
+can_gateway_table can_gateway_tables[2];
+can_gateway_table *can_gateway_live = &can_gateway_tables[0];
+can_gateway_table *can_gateway_staged = &can_gateway_tables[1];
+can_gateway_rule can_gateway_rule_staged;
+uint32_t can_gateway_loads = 0;
+
+RAMFUNC int can_gateway_before(uint8_t bus_a, uint32_t id_a, uint8_t bus_b, uint32_t id_b) {
+  return (bus_a < bus_b) || ((bus_a == bus_b) && (id_a < id_b));
+}
+
+// index of the first rule not before (bus, id), len if there's none
+RAMFUNC int can_gateway_find(can_gateway_table *t, uint8_t bus, uint32_t id) {
+  int lo = 0;
+  int hi = t->len;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (can_gateway_before(t->rules[mid].bus, t->rules[mid].id, bus, id)) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// every frame received, as it came from the FIFO. 1 if a rule took it, the
+// frame isn't forwarded any other way then.
+RAMFUNC int can_gateway_rx(uint8_t bus_number, CAN_FIFOMailBox_TypeDef *f, uint32_t ts) {
+  can_gateway_table *t = can_gateway_live;
+  if (t->len == 0) return 0;
+  uint32_t id = f->RIR & ~1U;
+  int i = can_gateway_find(t, bus_number, id);
+  if (i == t->len || t->rules[i].bus != bus_number || t->rules[i].id != id) return 0;
+
+  can_gateway_rule *r = &t->rules[i];
+  r->hits += 1;
+  if (r->to_bus == CAN_GATEWAY_DROP) return 1;
+  if (r->interval_us != 0 && r->sent_one && (ts - r->last_ts) < r->interval_us) {
+    r->limited += 1;
+    return 1;
+  }
+
+  CAN_FIFOMailBox_TypeDef to_fwd = *f;
+  if (r->flags & CAN_GATEWAY_REWRITE_ID) {
+    to_fwd.RIR = r->new_id;
+  }
+  if (r->flags & CAN_GATEWAY_REWRITE_DATA) {
+    to_fwd.RDLR = (to_fwd.RDLR & ~r->mask[0]) | r->data[0];
+    to_fwd.RDHR = (to_fwd.RDHR & ~r->mask[1]) | r->data[1];
+  }
+  if (can_forward(&to_fwd, bus_number, r->to_bus, ts)) {
+    r->forwarded += 1;
+    r->sent_one = 1;
+    r->last_ts = ts;
+    r->latency_last = TIM2->CNT - ts;
+    r->latency_max = max(r->latency_max, r->latency_last);
+  } else {
+    r->blocked += 1;
+  }
+  return 1;
+}
+
+void can_gateway_add(can_gateway_table *t, can_gateway_rule *r) {
+  int i = can_gateway_find(t, r->bus, r->id);
+  if (i == t->len || t->rules[i].bus != r->bus || t->rules[i].id != r->id) {
+    if (t->len == CAN_GATEWAY_RULES) {
+      puts("gateway table full\n");
+      return;
+    }
+    for (int j = t->len; j > i; j--) {
+      t->rules[j] = t->rules[j - 1];
+    }
+    t->len += 1;
+  }
+  t->rules[i] = *r;
+}
+
+void can_gateway_remove(can_gateway_table *t, can_gateway_rule *r) {
+  int i = can_gateway_find(t, r->bus, r->id);
+  if (i == t->len || t->rules[i].bus != r->bus || t->rules[i].id != r->id) return;
+  t->len -= 1;
+  for (int j = i; j < t->len; j++) {
+    t->rules[j] = t->rules[j + 1];
+  }
+}
+
+void can_gateway_load() {
+  can_gateway_table *t = can_gateway_staged;
+  for (int i = 0; i < t->len; i++) {
+    can_gateway_rule *r = &t->rules[i];
+    r->hits = 0;
+    r->forwarded = 0;
+    r->limited = 0;
+    r->blocked = 0;
+    r->latency_last = 0;
+    r->latency_max = 0;
+  }
+  enter_critical_section();
+  // an id's interval goes on from the rule it had
+  can_gateway_table *old = can_gateway_live;
+  for (int i = 0; i < t->len; i++) {
+    can_gateway_rule *r = &t->rules[i];
+    int j = can_gateway_find(old, r->bus, r->id);
+    int had = j != old->len && old->rules[j].bus == r->bus && old->rules[j].id == r->id;
+    r->sent_one = had ? old->rules[j].sent_one : 0;
+    r->last_ts = had ? old->rules[j].last_ts : 0;
+  }
+  can_gateway_staged = can_gateway_live;
+  can_gateway_live = t;
+  can_gateway_loads += 1;
+  exit_critical_section();
+  // the IRQs don't preempt each other, none is still in the old one. The
+  // next edits start from what's loaded.
+  can_gateway_staged->len = t->len;
+  memcpy(can_gateway_staged->rules, t->rules, t->len * sizeof(can_gateway_rule));
+}
+
+int can_gateway_set_param(int param, uint16_t value) {
+  can_gateway_rule *r = &can_gateway_rule_staged;
+  if (param >= CAN_GATEWAY_PARAM_DATA && param < CAN_GATEWAY_PARAM_DATA + 8) {
+    int byte = param - CAN_GATEWAY_PARAM_DATA;
+    int shift = (byte & 3) * 8;
+    r->mask[byte >> 2] = (r->mask[byte >> 2] & ~(0xFFU << shift)) | ((uint32_t)(value >> 8) << shift);
+    r->data[byte >> 2] = (r->data[byte >> 2] & ~(0xFFU << shift)) | ((uint32_t)(value & (value >> 8) & 0xFF) << shift);
+    return 1;
+  }
+  switch (param) {
+    case CAN_GATEWAY_PARAM_BUS:
+      r->bus = value;
+      break;
+    case CAN_GATEWAY_PARAM_ID_LO:
+      r->id = (r->id & 0xFFFF0000U) | (value & ~1U);
+      break;
+    case CAN_GATEWAY_PARAM_ID_HI:
+      r->id = (r->id & 0xFFFFU) | ((uint32_t)value << 16);
+      break;
+    case CAN_GATEWAY_PARAM_TO_BUS:
+      r->to_bus = value;
+      break;
+    case CAN_GATEWAY_PARAM_FLAGS:
+      r->flags = value;
+      break;
+    case CAN_GATEWAY_PARAM_NEW_ID_LO:
+      r->new_id = (r->new_id & 0xFFFF0000U) | (value & ~1U);
+      break;
+    case CAN_GATEWAY_PARAM_NEW_ID_HI:
+      r->new_id = (r->new_id & 0xFFFFU) | ((uint32_t)value << 16);
+      break;
+    case CAN_GATEWAY_PARAM_INTERVAL:
+      r->interval_us = value * 1000U;
+      break;
+    case CAN_GATEWAY_PARAM_ADD:
+      if (r->bus >= BUS_MAX || (r->to_bus >= BUS_MAX && r->to_bus != CAN_GATEWAY_DROP) || r->to_bus == r->bus) return 0;
+      can_gateway_add(can_gateway_staged, r);
+      break;
+    case CAN_GATEWAY_PARAM_REMOVE:
+      can_gateway_remove(can_gateway_staged, r);
+      break;
+    case CAN_GATEWAY_PARAM_CLEAR:
+      can_gateway_staged->len = 0;
+      break;
+    case CAN_GATEWAY_PARAM_LOAD:
+      can_gateway_load();
+      break;
+    default:
+      return 0;
+  }
+  return 1;
+}
+
+// the loaded table's rule index, or with 0xFFFF how many rules are loaded
+// and staged and the loads
+int can_gateway_status(int index, uint8_t *out) {
+  if (index == 0xFFFF) {
+    uint32_t *st = (uint32_t *)out;
+    st[0] = can_gateway_live->len;
+    st[1] = can_gateway_staged->len;
+    st[2] = can_gateway_loads;
+    return 3 * sizeof(uint32_t);
+  }
+  if (index < 0 || index >= can_gateway_live->len) return 0;
+  struct __attribute__((packed)) {
+    uint8_t bus;
+    uint8_t to_bus;
+    uint16_t flags;
+    uint32_t id;
+    uint32_t hits;
+    uint32_t forwarded;
+    uint32_t limited;
+    uint32_t blocked;
+    uint32_t latency_last;
+    uint32_t latency_max;
+  } *st = (void *)out;
+  enter_critical_section();
+  can_gateway_rule *r = &can_gateway_live->rules[index];
+  st->bus = r->bus;
+  st->to_bus = r->to_bus;
+  st->flags = r->flags;
+  st->id = r->id;
+  st->hits = r->hits;
+  st->forwarded = r->forwarded;
+  st->limited = r->limited;
+  st->blocked = r->blocked;
+  st->latency_last = r->latency_last;
+  st->latency_max = r->latency_max;
+  exit_critical_section();
+  return sizeof(*st);
+}
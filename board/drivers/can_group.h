@@ -0,0 +1,177 @@
+// IRQs: OTG_FS, DMA2_Stream2, DMA2_Stream3, TIM2
+// Transmit groups on ep3, for frames on different buses that have to start
+// together. The frames after a group record are held here instead of going
+// to their queues as they're parsed, however the USB packets split them, and
+// the release record puts them all in their TX queues and then fills the
+// empty mailboxes of their CANs in one critical section, now or at the TIM2
+// time it has. A frame only starts with the others if its CAN has an empty
+// mailbox and nothing queued before it. The safety hook runs for each frame
+// at the release and the frames it refuses are left out.
+//
+// Classic records with TXRQ clear carry the kind in RDTR and the time in
+// RDLR, compact time records (len 0xE) the kind in bits 4-7 and then the
+// time. Kind 0 is the time record the next frame is sent at, as before:
+//   0 time, 1 group, 2 release now, 3 release at the time
+// A group to be released at a time waits for it while the next is staged,
+// the next is dropped if it's also to be released at a time before then. A
+// group record with one open drops the open one, time records in a group are
+// ignored.
+
+#define CAN_GROUP_MAX 12 // the mailboxes of three CANs, and a frame more
+
+// what can_compact_tx_get and the classic records give ep3, 0 is a frame
+#define CAN_TX_CTRL_TIME 1
+#define CAN_TX_CTRL_GROUP 2
+#define CAN_TX_CTRL_RELEASE 3
+#define CAN_TX_CTRL_RELEASE_AT 4
+#define CAN_TX_CTRL_MAX CAN_TX_CTRL_RELEASE_AT
+
+typedef struct {
+  CAN_FIFOMailBox_TypeDef msg;
+  uint8_t bus_number;
+  uint32_t token; // for can_send_token
+} can_group_frame;
+
+typedef struct {
+  int open;
+  int len;
+  can_group_frame frames[CAN_GROUP_MAX];
+  int armed_len;     // 0 if none is waiting for its time
+  uint32_t armed_ts;
+  can_group_frame armed[CAN_GROUP_MAX];
+  uint32_t released;
+  uint32_t frames_sent; // queued at a release
+  uint32_t dropped;
+  uint32_t skew_max;    // most us from the first CAN's mailboxes filled to the last's
+  uint32_t late_max;    // most us a timed release went after its time
+} can_group_state;
+
+can_group_state can_group;
+
+void can_group_drop(can_group_frame *frames, int len) {
+  for (int i = 0; i < len; i++) {
+    if (frames[i].bus_number < BUS_MAX) can_stats[frames[i].bus_number].tx_drop_cnt += 1;
+  }
+  can_group.dropped += len;
+}
+
+// in a critical section. The queues first, so no CAN starts before the
+// frames of the others are in theirs.
+void can_group_send(can_group_frame *frames, int len) {
+  uint32_t cans = 0;
+  for (int i = 0; i < len; i++) {
+    can_group_frame *f = &frames[i];
+    if (f->bus_number >= BUS_MAX || !safety_tx_hook(&f->msg)) continue;
+    f->msg.RDTR = (f->msg.RDTR & (0xF | CAN_TX_URGENT)) | f->token;
+    if (!can_push(can_queues[f->bus_number], &f->msg)) {
+      can_stats[f->bus_number].tx_drop_cnt += 1;
+      continue;
+    }
+    uint8_t can_number = CAN_NUM_FROM_BUS_NUM(f->bus_number);
+    if (can_number < CAN_MAX) cans |= 1U << can_number;
+    can_group.frames_sent += 1;
+  }
+  uint32_t start = TIM2->CNT;
+  for (int i = 0; i < CAN_MAX; i++) {
+    if (cans & (1U << i)) process_can(i);
+  }
+  can_group.skew_max = max(can_group.skew_max, TIM2->CNT - start);
+  can_group.released += 1;
+}
+
+void can_group_begin() {
+  if (can_group.open) can_group_drop(can_group.frames, can_group.len);
+  can_group.open = 1;
+  can_group.len = 0;
+}
+
+// 0 if there's no group open, and the frame goes as it would
+int can_group_add(CAN_FIFOMailBox_TypeDef *msg, uint8_t bus_number, uint32_t token) {
+  if (!can_group.open) return 0;
+  can_group_frame f = {.msg = *msg, .bus_number = bus_number, .token = token};
+  if (can_group.len < CAN_GROUP_MAX) {
+    can_group.frames[can_group.len++] = f;
+  } else {
+    can_group_drop(&f, 1);
+  }
+  return 1;
+}
+
+void can_group_release(int at, uint32_t ts) {
+  if (!can_group.open) return;
+  can_group.open = 0;
+  enter_critical_section();
+  if (!at) {
+    can_group_send(can_group.frames, can_group.len);
+  } else if (can_group.armed_len > 0) {
+    can_group_drop(can_group.frames, can_group.len);
+  } else if (can_group.len > 0) {
+    for (int i = 0; i < can_group.len; i++) can_group.armed[i] = can_group.frames[i];
+    can_group.armed_len = can_group.len;
+    can_group.armed_ts = ts;
+    can_timed_service();
+  }
+  exit_critical_section();
+}
+
+// a control record of ep3, the classic ones and can_compact_tx_get's
+void can_tx_ctrl(int ctrl, uint32_t ts, uint32_t *send_at, int *send_at_pending) {
+  switch (ctrl) {
+    case CAN_TX_CTRL_TIME:
+      if (!can_group.open) {
+        *send_at = ts;
+        *send_at_pending = 1;
+      }
+      break;
+    case CAN_TX_CTRL_GROUP:
+      can_group_begin();
+      break;
+    case CAN_TX_CTRL_RELEASE:
+    case CAN_TX_CTRL_RELEASE_AT:
+      can_group_release(ctrl == CAN_TX_CTRL_RELEASE_AT, ts);
+      break;
+    default:
+      break;
+  }
+}
+
+// from can_timed_service, returns 1 with the time of the group waiting in *due
+int can_group_service(uint32_t now, uint32_t *due) {
+  if (can_group.armed_len == 0) return 0;
+  if (CAN_PERIODIC_DUE(can_group.armed_ts, now)) {
+    can_group.late_max = max(can_group.late_max, now - can_group.armed_ts);
+    can_group_send(can_group.armed, can_group.armed_len);
+    can_group.armed_len = 0;
+    return 0;
+  }
+  *due = can_group.armed_ts;
+  return 1;
+}
+
+int can_group_status(uint8_t *out, int reset) {
+  struct __attribute__((packed)) {
+    uint32_t released;
+    uint32_t frames;
+    uint32_t dropped;
+    uint32_t armed;    // frames waiting for their time
+    uint32_t skew_max;
+    uint32_t late_max;
+  } *st = (void *)out;
+  enter_critical_section();
+  can_group_state *g = &can_group;
+  st->released = g->released;
+  st->frames = g->frames_sent;
+  st->dropped = g->dropped;
+  st->armed = g->armed_len;
+  st->skew_max = g->skew_max;
+  st->late_max = g->late_max;
+  if (reset) {
+    g->released = 0;
+    g->frames_sent = 0;
+    g->dropped = 0;
+    g->skew_max = 0;
+    g->late_max = 0;
+  }
+  exit_critical_section();
+  return sizeof(*st);
+}
@@ -0,0 +1,121 @@
+// IRQs: TIM2
+// periodic CAN messages sent by the panda itself, timed by TIM2 compare 1
+
+#define CAN_PERIODIC_SLOTS 16
+
+typedef struct {
+  int active;
+  uint8_t bus_number;
+  uint32_t period_us;
+  uint32_t next_ts;
+  CAN_FIFOMailBox_TypeDef msg;
+} can_periodic_slot;
+
+can_periodic_slot can_periodic[CAN_PERIODIC_SLOTS];
+
+// message assembled halfword by halfword by 0xeb
+CAN_FIFOMailBox_TypeDef can_periodic_staged;
+
+// TIM2 is free running, compare timestamps across the wrap
+#define CAN_PERIODIC_DUE(ts, now) ((int32_t)((now) - (ts)) >= 0)
+
+// sends everything that is due and arms CC1 for the next slot
+void can_periodic_service() {
+  while (1) {
+    uint32_t now = TIM2->CNT;
+    int armed = 0;
+    uint32_t next_ts = 0;
+
+    for (int i = 0; i < CAN_PERIODIC_SLOTS; i++) {
+      can_periodic_slot *slot = &can_periodic[i];
+      if (!slot->active) continue;
+
+      if (CAN_PERIODIC_DUE(slot->next_ts, now)) {
+        // can_send runs the safety hook and clobbers RDTR, send a copy
+        CAN_FIFOMailBox_TypeDef to_send = slot->msg;
+        can_send(&to_send, slot->bus_number);
+
+        slot->next_ts += slot->period_us;
+        // don't send a burst to catch up if we fell far behind
+        if (CAN_PERIODIC_DUE(slot->next_ts, now)) slot->next_ts = now + slot->period_us;
+      }
+
+      if (!armed || (int32_t)(slot->next_ts - next_ts) < 0) {
+        next_ts = slot->next_ts;
+        armed = 1;
+      }
+    }
+
+    if (!armed) {
+      TIM2->DIER &= ~TIM_DIER_CC1IE;
+      return;
+    }
+
+    TIM2->CCR1 = next_ts;
+    TIM2->DIER |= TIM_DIER_CC1IE;
+
+    // the compare only fires on a match, so go around again if it was missed
+    if (!CAN_PERIODIC_DUE(next_ts, TIM2->CNT)) return;
+  }
+}
+
+void TIM2_IRQHandler() {
+  if (TIM2->SR & TIM_SR_CC1IF) {
+    TIM2->SR = ~TIM_SR_CC1IF;
+    can_periodic_service();
+  }
+  // compare 2 is the K-line engine's
+  if (TIM2->SR & TIM_SR_CC2IF) {
+    TIM2->SR = ~TIM_SR_CC2IF;
+    kline_service();
+  }
+  // compare 3 is the main loop's housekeeping tick
+  if (TIM2->SR & TIM_SR_CC3IF) {
+    TIM2->SR = ~TIM_SR_CC3IF;
+    tick_service();
+  }
+  // compare 4 is the CAN replay's, the scheduled frames', the ISO-TP engine's
+  // and the coalesced RX drains
+  if (TIM2->SR & TIM_SR_CC4IF) {
+    TIM2->SR = ~TIM_SR_CC4IF;
+    can_timed_service();
+  }
+}
+
+void can_periodic_init() {
+  TIM2->SR = ~TIM_SR_CC1IF;
+  NVIC_EnableIRQ(TIM2_IRQn);
+}
+
+// halfword 0-7 of RIR, RDTR, RDLR, RDHR
+void can_periodic_stage(int halfword, uint16_t value) {
+  if (halfword < 0 || halfword >= 8) return;
+  uint32_t *words = (uint32_t *)&can_periodic_staged;
+  int shift = (halfword & 1) * 16;
+  words[halfword >> 1] = (words[halfword >> 1] & ~(0xFFFFU << shift)) | ((uint32_t)value << shift);
+}
+
+// the first send is immediate
+int can_periodic_start(int slot_number, uint8_t bus_number, uint32_t period_us) {
+  if (slot_number < 0 || slot_number >= CAN_PERIODIC_SLOTS) return 0;
+  if (bus_number >= BUS_MAX || period_us == 0) return 0;
+
+  can_periodic_slot *slot = &can_periodic[slot_number];
+  slot->msg = can_periodic_staged;
+  slot->msg.RIR |= 1;
+  slot->msg.RDTR &= 0xF;
+  slot->bus_number = bus_number;
+  slot->period_us = period_us;
+  slot->next_ts = TIM2->CNT;
+  slot->active = 1;
+  can_periodic_service();
+  return 1;
+}
+
+// slot_number -1 stops all of them
+void can_periodic_stop(int slot_number) {
+  for (int i = 0; i < CAN_PERIODIC_SLOTS; i++) {
+    if (slot_number == -1 || slot_number == i) can_periodic[i].active = 0;
+  }
+  can_periodic_service();
+}
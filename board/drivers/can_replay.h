@@ -0,0 +1,215 @@
+// IRQs: TIM2
+// CAN frames sent at set times by TIM2 compare 4: replays of traces uploaded
+// on ep3, and single frames scheduled on ep3. The ISO-TP engine's timeouts
+// and STmin waits share it, and the drains of the coalesced CAN RX.
+//
+// While loading, an ep3 OUT packet is three can_ts_records padded to 0x40,
+// with the time as the us since the record before, or since the start for the
+// first. The ring keeps loading while it plays and ep3 NAKs while it's full,
+// so a trace longer than the ring streams from the host as fast as it's sent.
+
+#ifdef PANDA
+  #define CAN_REPLAY_LEN 0x400 // power of two
+#else
+  #define CAN_REPLAY_LEN 0x40
+#endif
+#define CAN_REPLAY_PACKET (0x40 / sizeof(can_ts_record))
+
+#define CAN_REPLAY_OFF 0
+#define CAN_REPLAY_LOADING 1
+#define CAN_REPLAY_PLAYING 2
+
+typedef struct {
+  int state;
+  uint32_t w_ptr;   // free running, the ring has w_ptr - r_ptr records
+  uint32_t r_ptr;
+  uint32_t last_ts; // when the last one sent was due
+  uint32_t sent;
+  uint32_t late_max; // most us a frame went after its time
+  uint32_t dropped;  // didn't fit, only from a host that ignores the NAKs
+} can_replay_state;
+
+HIGH_RAM can_ts_record can_replay_buf[CAN_REPLAY_LEN];
+can_replay_state can_replay = {.state = CAN_REPLAY_OFF};
+
+// A frame on ep3 goes at a TIM2 time if the record before it has TXRQ clear,
+// which a frame never has, with the time in RDLR. Times more than 2^31 us
+// ahead are taken for past ones and sent now.
+#define CAN_SCHEDULED_LEN 32
+
+typedef struct {
+  uint32_t ts;
+  uint8_t bus_number;
+  uint32_t token; // for can_send_token
+  CAN_FIFOMailBox_TypeDef msg;
+} can_scheduled_frame;
+
+// earliest first
+can_scheduled_frame can_scheduled[CAN_SCHEDULED_LEN];
+int can_scheduled_len = 0;
+
+int can_replay_loading() {
+  return can_replay.state != CAN_REPLAY_OFF;
+}
+
+// sends everything that is due and arms CC4 for the next one
+void can_timed_service() {
+  can_replay_state *r = &can_replay;
+  int armed = 0;
+  while (1) {
+    uint32_t now = TIM2->CNT;
+
+    if (can_scheduled_len > 0 && CAN_PERIODIC_DUE(can_scheduled[0].ts, now)) {
+      can_scheduled_frame f = can_scheduled[0];
+      can_scheduled_len -= 1;
+      for (int i = 0; i < can_scheduled_len; i++) can_scheduled[i] = can_scheduled[i + 1];
+      can_send_token(&f.msg, f.bus_number, f.token);
+      continue;
+    }
+
+    int replaying = r->state == CAN_REPLAY_PLAYING && r->w_ptr != r->r_ptr;
+    can_ts_record *rec = &can_replay_buf[r->r_ptr & (CAN_REPLAY_LEN - 1)];
+    uint32_t due = r->last_ts + rec->timestamp;
+
+    if (replaying && CAN_PERIODIC_DUE(due, now)) {
+      CAN_FIFOMailBox_TypeDef to_send;
+      to_send.RIR = rec->RIR | 1;
+      to_send.RDTR = rec->RDTR;
+      to_send.RDLR = rec->RDLR;
+      to_send.RDHR = rec->RDHR;
+      r->last_ts = due;
+      r->late_max = max(r->late_max, now - due);
+      r->r_ptr += 1;
+      r->sent += 1;
+      // the record's time is kept to, not when it was sent, so lateness doesn't add up
+      can_send(&to_send, (to_send.RDTR >> 4) & CAN_BUS_NUM_MASK);
+      continue;
+    }
+
+    // the earliest of them, the RX drains and the ISO-TP engine do what's
+    // due on the way
+    int waiting = replaying;
+    if (can_scheduled_len > 0 && (!waiting || (int32_t)(can_scheduled[0].ts - due) < 0)) {
+      due = can_scheduled[0].ts;
+      waiting = 1;
+    }
+    uint32_t coalesce_due;
+    if (can_coalesce_service(now, &coalesce_due) && (!waiting || (int32_t)(coalesce_due - due) < 0)) {
+      due = coalesce_due;
+      waiting = 1;
+    }
+    uint32_t isotp_due;
+    if (isotp_service(now, &isotp_due) && (!waiting || (int32_t)(isotp_due - due) < 0)) {
+      due = isotp_due;
+      waiting = 1;
+    }
+    uint32_t group_due;
+    if (can_group_service(now, &group_due) && (!waiting || (int32_t)(group_due - due) < 0)) {
+      due = group_due;
+      waiting = 1;
+    }
+    if (!waiting) break;
+
+    TIM2->CCR4 = due;
+    TIM2->DIER |= TIM_DIER_CC4IE;
+    // the compare only fires on a match, so go around again if it was missed
+    if (!CAN_PERIODIC_DUE(due, TIM2->CNT)) {
+      armed = 1;
+      break;
+    }
+  }
+  if (!armed) TIM2->DIER &= ~TIM_DIER_CC4IE;
+
+  // take the next packet once there's room for it
+  if (r->state != CAN_REPLAY_OFF && (CAN_REPLAY_LEN - (r->w_ptr - r->r_ptr)) >= CAN_REPLAY_PACKET) {
+    usb_ep3_resume();
+  }
+}
+
+// an ep3 packet while loading
+void can_replay_load(uint8_t *usbdata, int len) {
+  can_replay_state *r = &can_replay;
+  for (int pos = 0; pos + (int)sizeof(can_ts_record) <= len; pos += sizeof(can_ts_record)) {
+    if ((r->w_ptr - r->r_ptr) >= CAN_REPLAY_LEN) {
+      r->dropped += 1;
+      continue;
+    }
+    memcpy(&can_replay_buf[r->w_ptr & (CAN_REPLAY_LEN - 1)], usbdata + pos, sizeof(can_ts_record));
+    r->w_ptr += 1;
+  }
+  if ((CAN_REPLAY_LEN - (r->w_ptr - r->r_ptr)) < CAN_REPLAY_PACKET) usb_ep3_pause();
+  // it may have run dry while playing
+  can_timed_service();
+}
+
+// empties the ring and takes ep3 records until stopped
+void can_replay_start_loading() {
+  enter_critical_section();
+  can_replay.state = CAN_REPLAY_LOADING;
+  can_replay.w_ptr = 0;
+  can_replay.r_ptr = 0;
+  can_replay.sent = 0;
+  can_replay.late_max = 0;
+  can_replay.dropped = 0;
+  can_timed_service();
+  exit_critical_section();
+}
+
+// the first record's time is from now
+void can_replay_play() {
+  enter_critical_section();
+  if (can_replay.state == CAN_REPLAY_LOADING) {
+    can_replay.state = CAN_REPLAY_PLAYING;
+    can_replay.last_ts = TIM2->CNT;
+    can_timed_service();
+  }
+  exit_critical_section();
+}
+
+// drops what's left, ep3 sends again
+void can_replay_stop() {
+  enter_critical_section();
+  can_replay.state = CAN_REPLAY_OFF;
+  can_replay.r_ptr = can_replay.w_ptr;
+  can_timed_service();
+  usb_ep3_resume();
+  exit_critical_section();
+}
+
+// returns 0 if the queue is full
+int can_schedule(CAN_FIFOMailBox_TypeDef *msg, uint8_t bus_number, uint32_t token, uint32_t ts) {
+  enter_critical_section();
+  int ok = can_scheduled_len < CAN_SCHEDULED_LEN;
+  if (ok) {
+    // after the ones at the same time, so those keep their order
+    int i = can_scheduled_len;
+    while (i > 0 && (int32_t)(ts - can_scheduled[i - 1].ts) < 0) i--;
+    for (int j = can_scheduled_len; j > i; j--) can_scheduled[j] = can_scheduled[j - 1];
+    can_scheduled[i].ts = ts;
+    can_scheduled[i].bus_number = bus_number;
+    can_scheduled[i].token = token;
+    can_scheduled[i].msg = *msg;
+    can_scheduled_len += 1;
+    can_timed_service();
+  }
+  exit_critical_section();
+  return ok;
+}
+
+int can_replay_status(uint8_t *out) {
+  struct __attribute__((packed)) {
+    uint32_t state;
+    uint32_t queued;
+    uint32_t sent;
+    uint32_t late_max;
+    uint32_t dropped;
+  } *st = (void *)out;
+  enter_critical_section();
+  st->state = can_replay.state;
+  st->queued = can_replay.w_ptr - can_replay.r_ptr;
+  st->sent = can_replay.sent;
+  st->late_max = can_replay.late_max;
+  st->dropped = can_replay.dropped;
+  exit_critical_section();
+  return sizeof(*st);
+}
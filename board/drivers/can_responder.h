@@ -0,0 +1,160 @@
+// IRQs: CAN1_RX0, CAN1_RX1, CAN2_RX0, CAN2_RX1, CAN3_RX0, CAN3_RX1, TIM2
+// ECU emulation, a table set up with 0xee that answers requests on the buses
+// from the CAN RX IRQ, so an answer's timing has no USB or host in it.
+//
+// An entry is a request and its answer. A frame on the entry's bus is its
+// request if it has its id, at least its length and its pattern in the data
+// bytes its mask has bits of. The first entry that's on and matches has
+// its frames scheduled on TIM2 like ep3's timed ones, the first
+// delay us after the request was received and each next gap us after the
+// one before, so they go from compare 4 and through the safety tx hook as
+// they're sent. The answer is the same sequence every time, a multi frame
+// one doesn't wait for a flow control, its gap has to be the STmin. The
+// request still goes to the RX queues.
+
+#ifdef PANDA
+  #define CAN_RESPONDER_ENTRIES 8
+#else
+  #define CAN_RESPONDER_ENTRIES 2
+#endif
+#define CAN_RESPONDER_FRAMES 4
+
+// 0xee parameters, set them while the entry is off
+#define CAN_RESPONDER_PARAM_ON 0     // 1 turns the entry on, clearing its counts, 0 off
+#define CAN_RESPONDER_PARAM_BUS 1
+#define CAN_RESPONDER_PARAM_ID_LO 2  // the request's id in the RIR layout
+#define CAN_RESPONDER_PARAM_ID_HI 3
+#define CAN_RESPONDER_PARAM_LEN 4    // the request's least length
+#define CAN_RESPONDER_PARAM_DELAY 5  // us from the request to the first frame
+#define CAN_RESPONDER_PARAM_GAP 6    // us between the frames
+#define CAN_RESPONDER_PARAM_FRAMES 7 // how many of the frames are the answer
+#define CAN_RESPONDER_PARAM_DATA 8   // to 15, the pattern byte | its mask << 8 for each byte of the request
+#define CAN_RESPONDER_PARAM_FRAME 16 // + frame * 8 + halfword of its RIR, RDTR, RDLR, RDHR
+
+typedef struct {
+  int on;
+  uint8_t bus_number;
+  uint32_t id;
+  uint8_t len;
+  uint16_t delay_us;
+  uint16_t gap_us;
+  uint8_t nframes;
+  uint32_t pattern[2]; // RDLR, RDHR
+  uint32_t mask[2];
+  CAN_FIFOMailBox_TypeDef frames[CAN_RESPONDER_FRAMES];
+
+  uint32_t requests;
+  uint32_t scheduled;  // frames
+  uint32_t dropped;    // frames the scheduled queue was full for
+} can_responder_entry;
+
+can_responder_entry can_responder_entries[CAN_RESPONDER_ENTRIES];
+// entries on, so a bus without any costs one test
+int can_responder_on = 0;
+
+// every frame received, in the layout of the RX queues
+RAMFUNC void can_responder_rx(uint8_t bus_number, CAN_FIFOMailBox_TypeDef *f, uint32_t ts) {
+  if (can_responder_on == 0) return;
+  for (int i = 0; i < CAN_RESPONDER_ENTRIES; i++) {
+    can_responder_entry *e = &can_responder_entries[i];
+    if (!e->on || e->bus_number != bus_number || (f->RIR & ~1U) != e->id) continue;
+    if ((int)(f->RDTR & 0xF) < e->len) continue;
+    if (((f->RDLR ^ e->pattern[0]) & e->mask[0]) != 0 || ((f->RDHR ^ e->pattern[1]) & e->mask[1]) != 0) continue;
+
+    e->requests += 1;
+    uint32_t due = ts + e->delay_us;
+    for (int j = 0; j < e->nframes; j++) {
+      // can_send_token leaves the length of RDTR
+      CAN_FIFOMailBox_TypeDef to_send = e->frames[j];
+      if (can_schedule(&to_send, bus_number, 0, due)) {
+        e->scheduled += 1;
+      } else {
+        e->dropped += 1;
+      }
+      due += e->gap_us;
+    }
+    return;
+  }
+}
+
+int can_responder_set_param(int entry, int param, uint16_t value) {
+  if (entry < 0 || entry >= CAN_RESPONDER_ENTRIES) return 0;
+  can_responder_entry *e = &can_responder_entries[entry];
+  if (param >= CAN_RESPONDER_PARAM_FRAME) {
+    int frame = (param - CAN_RESPONDER_PARAM_FRAME) >> 3;
+    int halfword = (param - CAN_RESPONDER_PARAM_FRAME) & 7;
+    if (frame >= CAN_RESPONDER_FRAMES) return 0;
+    uint32_t *words = (uint32_t *)&e->frames[frame];
+    int shift = (halfword & 1) * 16;
+    words[halfword >> 1] = (words[halfword >> 1] & ~(0xFFFFU << shift)) | ((uint32_t)value << shift);
+    return 1;
+  }
+  if (param >= CAN_RESPONDER_PARAM_DATA) {
+    int byte = param - CAN_RESPONDER_PARAM_DATA;
+    int shift = (byte & 3) * 8;
+    e->pattern[byte >> 2] = (e->pattern[byte >> 2] & ~(0xFFU << shift)) | ((uint32_t)(value & 0xFF) << shift);
+    e->mask[byte >> 2] = (e->mask[byte >> 2] & ~(0xFFU << shift)) | ((uint32_t)(value >> 8) << shift);
+    return 1;
+  }
+  switch (param) {
+    case CAN_RESPONDER_PARAM_ON:
+      enter_critical_section();
+      can_responder_on -= e->on;
+      e->on = 0;
+      if (value != 0 && e->bus_number < BUS_MAX && e->nframes <= CAN_RESPONDER_FRAMES) {
+        for (int j = 0; j < e->nframes; j++) {
+          e->frames[j].RIR |= 1;
+          e->frames[j].RDTR &= 0xF;
+        }
+        e->requests = 0;
+        e->scheduled = 0;
+        e->dropped = 0;
+        e->on = 1;
+        can_responder_on += 1;
+      }
+      exit_critical_section();
+      break;
+    case CAN_RESPONDER_PARAM_BUS:
+      e->bus_number = value;
+      break;
+    case CAN_RESPONDER_PARAM_ID_LO:
+      e->id = (e->id & 0xFFFF0000U) | (value & ~1U);
+      break;
+    case CAN_RESPONDER_PARAM_ID_HI:
+      e->id = (e->id & 0xFFFFU) | ((uint32_t)value << 16);
+      break;
+    case CAN_RESPONDER_PARAM_LEN:
+      e->len = value;
+      break;
+    case CAN_RESPONDER_PARAM_DELAY:
+      e->delay_us = value;
+      break;
+    case CAN_RESPONDER_PARAM_GAP:
+      e->gap_us = value;
+      break;
+    case CAN_RESPONDER_PARAM_FRAMES:
+      e->nframes = value;
+      break;
+    default:
+      return 0;
+  }
+  return 1;
+}
+
+int can_responder_status(int entry, uint8_t *out) {
+  if (entry < 0 || entry >= CAN_RESPONDER_ENTRIES) return 0;
+  can_responder_entry *e = &can_responder_entries[entry];
+  struct __attribute__((packed)) {
+    uint32_t on;
+    uint32_t requests;
+    uint32_t scheduled;
+    uint32_t dropped;
+  } *st = (void *)out;
+  enter_critical_section();
+  st->on = e->on;
+  st->requests = e->requests;
+  st->scheduled = e->scheduled;
+  st->dropped = e->dropped;
+  exit_critical_section();
+  return sizeof(*st);
+}
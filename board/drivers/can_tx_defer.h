@@ -0,0 +1,158 @@
+// IRQs: OTG_FS, PendSV
+// The host's CAN tx packets, ep3's and alt 2's ep1, are done after the USB
+// IRQ instead of in it. The IRQ copies a packet into its lane's staging ring
+// and pends PendSV, which has the lowest priority there is, so the USB and
+// CAN IRQs go ahead of it and preempt it. PendSV gives the packets to
+// usb_can_tx in order, one at a time in a critical section, as the safety
+// hooks and the TX queues expect no other IRQ to run in the middle of a frame.
+// The lanes take turns a packet each.
+//
+// A lane's endpoint NAKs while its ring is full, and PendSV lets it go once
+// there's room. In alt 2 a packet stays staged while its lane is held, see
+// can_lane_check, and can_lane_drained pends PendSV again. The CAN replay
+// ring is still loaded by the USB IRQ, and the ESP's packets are still done
+// where they come.
+
+#define CAN_TX_DEFER_PACKETS 8U
+
+typedef struct {
+  uint32_t ts;          // when the IRQ staged it
+  uint8_t len;
+  uint8_t data[0x40];
+} can_tx_defer_packet;
+
+typedef struct {
+  uint32_t w_ptr;
+  uint32_t r_ptr;
+  int held;             // its endpoint NAKs for the full ring
+  can_tx_defer_packet packets[CAN_TX_DEFER_PACKETS];
+} can_tx_defer_ring;
+
+can_tx_defer_ring can_tx_defer_rings[2];
+
+typedef struct {
+  uint32_t packets;
+  uint32_t overruns;    // came with the ring full, done in the USB IRQ
+  uint32_t held;        // times an endpoint NAKed for a full ring
+  uint32_t depth_max;
+  uint32_t delay_max;   // us a packet was staged
+} can_tx_defer_stats;
+
+can_tx_defer_stats can_tx_defer;
+
+void can_tx_defer_init(void) {
+  NVIC_SetPriority(PendSV_IRQn, (1U << __NVIC_PRIO_BITS) - 1U);
+}
+
+RAMFUNC void can_tx_defer_kick(void) {
+  SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+}
+
+RAMFUNC int can_tx_defer_full(int lane) {
+  can_tx_defer_ring *r = &can_tx_defer_rings[lane];
+  return (r->w_ptr - r->r_ptr) >= CAN_TX_DEFER_PACKETS;
+}
+
+void can_tx_defer_ep(int lane, int pause) {
+  if (lane == 0) {
+    if (pause) {
+      usb_ep1_out_pause();
+    } else {
+      usb_ep1_out_resume();
+    }
+  } else {
+    if (pause) {
+      usb_ep3_pause();
+    } else {
+      usb_ep3_resume();
+    }
+  }
+}
+
+// one packet off the ring, 0 if there was none or its lane is held
+int can_tx_defer_one(int lane) {
+  can_tx_defer_ring *r = &can_tx_defer_rings[lane];
+  int done = 0;
+  enter_critical_section();
+  if ((r->w_ptr != r->r_ptr) && !(current_int0_alt_setting == USB_ALT_CAN_LANES && can_lane_held[lane])) {
+    can_tx_defer_packet *p = &r->packets[r->r_ptr % CAN_TX_DEFER_PACKETS];
+    usb_can_tx(p->data, p->len, 1);
+    can_tx_defer.delay_max = max(can_tx_defer.delay_max, TIM2->CNT - p->ts);
+    r->r_ptr += 1;
+    can_lane_check(lane);
+    done = 1;
+  }
+  if (r->held && !can_tx_defer_full(lane) && !can_lane_held[lane]) {
+    r->held = 0;
+    can_tx_defer_ep(lane, 0);
+  }
+  exit_critical_section();
+  return done;
+}
+
+void PendSV_Handler(void) {
+  int done;
+  do {
+    done = can_tx_defer_one(0);
+    done |= can_tx_defer_one(1);
+  } while (done);
+}
+
+// from the USB IRQ, an OUT packet of the lane
+RAMFUNC void can_tx_defer_stage(int lane, uint8_t *usbdata, int len) {
+  can_tx_defer_ring *r = &can_tx_defer_rings[lane];
+  enter_critical_section();
+  if (can_tx_defer_full(lane)) {
+    // the endpoint was let go under it, by a reset. What's staged goes first.
+    can_tx_defer.overruns += 1;
+    while (r->w_ptr != r->r_ptr) {
+      can_tx_defer_packet *p = &r->packets[r->r_ptr % CAN_TX_DEFER_PACKETS];
+      usb_can_tx(p->data, p->len, 1);
+      r->r_ptr += 1;
+    }
+    usb_can_tx(usbdata, len, 1);
+    can_lane_check(lane);
+    exit_critical_section();
+    return;
+  }
+  can_tx_defer_packet *p = &r->packets[r->w_ptr % CAN_TX_DEFER_PACKETS];
+  p->ts = TIM2->CNT;
+  p->len = min(len, (int)sizeof(p->data));
+  memcpy(p->data, usbdata, p->len);
+  r->w_ptr += 1;
+  can_tx_defer.packets += 1;
+  can_tx_defer.depth_max = max(can_tx_defer.depth_max, r->w_ptr - r->r_ptr);
+  if (can_tx_defer_full(lane)) {
+    can_tx_defer.held += 1;
+    r->held = 1;
+    can_tx_defer_ep(lane, 1);
+  }
+  exit_critical_section();
+  can_tx_defer_kick();
+}
+
+int can_tx_defer_status(uint8_t *out) {
+  struct __attribute__((packed)) {
+    uint32_t packets;
+    uint32_t overruns;
+    uint32_t held;
+    uint32_t depth_max;
+    uint32_t delay_max_us;
+    uint8_t staged[2];  // now, ep1's and ep3's
+    uint8_t ring_len;
+    uint8_t reserved;
+  } *st = (void *)out;
+  enter_critical_section();
+  st->packets = can_tx_defer.packets;
+  st->overruns = can_tx_defer.overruns;
+  st->held = can_tx_defer.held;
+  st->depth_max = can_tx_defer.depth_max;
+  st->delay_max_us = can_tx_defer.delay_max;
+  for (int i = 0; i < 2; i++) {
+    st->staged[i] = can_tx_defer_rings[i].w_ptr - can_tx_defer_rings[i].r_ptr;
+  }
+  st->ring_len = CAN_TX_DEFER_PACKETS;
+  st->reserved = 0;
+  exit_critical_section();
+  return sizeof(*st);
+}
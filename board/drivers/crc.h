@@ -0,0 +1,67 @@
+// IRQs: none
+// The CRC unit. It does one CRC only, CRC-32/MPEG-2: 0x04C11DB7 msb first a
+// word at a time, from 0xFFFFFFFF and not inverted, crc32_hw. Big buffers go
+// to it by DMA2 stream 1, memory to memory, and the CPU only waits. zlib's
+// CRC-32 is the same with the bits reversed both ways, so crc32 feeds the unit
+// each word bit reversed and reverses and inverts what it gives, a few cycles
+// a word where the nibble table takes tens. The unit doesn't do the CRC-16 of
+// spi.h or the honda nibble sums, those stay in software.
+// python/__init__.py's crc32_stm32 is crc32_hw on the host, zlib is crc32's.
+
+#define CRC_DMA_MIN_WORDS 64
+
+void crc_init() {
+  RCC->AHB1ENR |= RCC_AHB1ENR_CRCEN | RCC_AHB1ENR_DMA2EN;
+}
+
+// zlib's, a nibble at a time, from crc as it is before the final inversion
+uint32_t crc32_sw(uint32_t crc, const uint8_t *dat, int len) {
+  static const uint32_t table[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+  };
+  for (int i = 0; i < len; i++) {
+    crc ^= dat[i];
+    crc = (crc >> 4) ^ table[crc & 0xF];
+    crc = (crc >> 4) ^ table[crc & 0xF];
+  }
+  return crc;
+}
+
+// the unit's own over len words
+uint32_t crc32_hw(const uint32_t *dat, int len) {
+  CRC->CR = CRC_CR_RESET;
+  while (len >= CRC_DMA_MIN_WORDS) {
+    int n = min(len, 0xFFFF);
+    DMA2_Stream1->CR &= ~DMA_SxCR_EN;
+    while (DMA2_Stream1->CR & DMA_SxCR_EN);
+    DMA2->LIFCR = DMA_LIFCR_CTCIF1 | DMA_LIFCR_CHTIF1 | DMA_LIFCR_CTEIF1 | DMA_LIFCR_CDMEIF1 | DMA_LIFCR_CFEIF1;
+    // memory to memory reads PAR and writes M0AR, through the FIFO
+    DMA2_Stream1->PAR = (uint32_t)dat;
+    DMA2_Stream1->M0AR = (uint32_t)&CRC->DR;
+    DMA2_Stream1->NDTR = n;
+    DMA2_Stream1->FCR = DMA_SxFCR_DMDIS | DMA_SxFCR_FTH;
+    DMA2_Stream1->CR = DMA_SxCR_DIR_1 | DMA_SxCR_PINC | DMA_SxCR_MSIZE_1 | DMA_SxCR_PSIZE_1 | DMA_SxCR_EN;
+    while (!(DMA2->LISR & (DMA_LISR_TCIF1 | DMA_LISR_TEIF1)));
+    DMA2_Stream1->CR &= ~DMA_SxCR_EN;
+    dat += n;
+    len -= n;
+  }
+  for (int i = 0; i < len; i++) CRC->DR = dat[i];
+  return CRC->DR;
+}
+
+// zlib's, the whole words by the unit
+uint32_t crc32(const uint8_t *dat, int len) {
+  uint32_t crc = 0xFFFFFFFF;
+  if (((uint32_t)dat & 3) == 0 && len >= 4) {
+    const uint32_t *w = (const uint32_t *)dat;
+    int words = len / 4;
+    CRC->CR = CRC_CR_RESET;
+    for (int i = 0; i < words; i++) CRC->DR = __RBIT(w[i]);
+    crc = __RBIT(CRC->DR);
+    dat += words * 4;
+    len -= words * 4;
+  }
+  return ~crc32_sw(crc, dat, len);
+}
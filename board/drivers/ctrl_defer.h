@@ -0,0 +1,181 @@
+// IRQs: OTG_FS, DMA2_Stream2, DMA2_Stream3, EXTI4, and the main loop runs it
+// Control requests that hold the CPU, a CAN waiting on INAK or the steps of
+// an ESP reset, are acked by the USB IRQ and done by the main loop after it.
+// The CAN and timer IRQs then keep running through them, instead of waiting
+// behind the IRQ that got the request. A request only marks what it needs
+// doing, what's done is set up from the config when the main loop gets there,
+// so requests that come before then are all covered by one run.
+//
+// A CAN is only reconfigured, see can_reconfigure, so a bitrate change or a
+// safety mode that changes what's silent leaves the other CANs running and
+// its own filters and queued frames alone. A can_init_all marks every CAN but
+// those already as configured are left as they are. A new safety mode has
+// other rx_ids and fwd_buses, and marks every CAN's filter banks to be built
+// again too.
+//
+// queued counts the requests, done is queued as of the last run that left
+// nothing pending. A host that needs one finished reads 0xce until done has
+// caught up with queued as it was after the request.
+
+// about delay(1000000), the step of a reset before it was deferred
+#define CTRL_DEFER_ESP_STEP_US 60000U
+
+typedef struct {
+  uint32_t cans;       // bit n to reconfigure CAN n
+  uint32_t filters;    // bit n to build CAN n's filter banks again
+  int esp_step;        // of the ESP reset, 0 is none
+  int esp_boot;
+  uint32_t esp_due_ts;
+  uint32_t queued;
+  uint32_t done;
+  uint32_t runs;
+  uint32_t max_us;     // longest a run held off USB
+} ctrl_defer_state;
+
+ctrl_defer_state ctrl_defer;
+
+const IRQn_Type ctrl_defer_can_irqs[CAN_MAX][4] = {
+  {CAN1_TX_IRQn, CAN1_RX0_IRQn, CAN1_RX1_IRQn, CAN1_SCE_IRQn},
+  {CAN2_TX_IRQn, CAN2_RX0_IRQn, CAN2_RX1_IRQn, CAN2_SCE_IRQn},
+#ifdef PANDA
+  {CAN3_TX_IRQn, CAN3_RX0_IRQn, CAN3_RX1_IRQn, CAN3_SCE_IRQn},
+#endif
+};
+
+// 0xff, a bus without a CAN, has nothing to wait on and is done here
+void ctrl_defer_can_init(uint8_t can_number) {
+  if (can_number >= CAN_MAX) {
+    can_init(can_number);
+    return;
+  }
+  enter_critical_section();
+  ctrl_defer.cans |= 1U << can_number;
+  ctrl_defer.queued += 1;
+  exit_critical_section();
+}
+
+void ctrl_defer_can_init_all(void) {
+  enter_critical_section();
+  can_mode_gen += 1;
+  ctrl_defer.cans |= (1U << CAN_MAX) - 1U;
+  ctrl_defer.queued += 1;
+  exit_critical_section();
+}
+
+void ctrl_defer_can_filters_all(void) {
+  enter_critical_section();
+  can_mode_gen += 1;
+  ctrl_defer.cans |= (1U << CAN_MAX) - 1U;
+  ctrl_defer.filters |= (1U << CAN_MAX) - 1U;
+  ctrl_defer.queued += 1;
+  exit_critical_section();
+}
+
+// a reset that's in its steps starts over
+void ctrl_defer_esp_reset(int boot) {
+  enter_critical_section();
+  ctrl_defer.esp_step = 1;
+  ctrl_defer.esp_boot = boot;
+  ctrl_defer.esp_due_ts = TIM2->CNT;
+  ctrl_defer.queued += 1;
+  exit_critical_section();
+}
+
+// the main loop doesn't sleep on it
+int ctrl_defer_ready(void) {
+  return ctrl_defer.cans != 0;
+}
+
+// The requests that would touch what a run is setting up, from USB or the
+// ESP's SPI, wait for it.
+void ctrl_defer_hold(int hold) {
+  if (hold) {
+    NVIC_DisableIRQ(OTG_FS_IRQn);
+    #ifdef PANDA
+      NVIC_DisableIRQ(DMA2_Stream2_IRQn);
+      NVIC_DisableIRQ(DMA2_Stream3_IRQn);
+      NVIC_DisableIRQ(EXTI4_IRQn);
+    #endif
+  } else {
+    NVIC_EnableIRQ(OTG_FS_IRQn);
+    #ifdef PANDA
+      NVIC_EnableIRQ(DMA2_Stream2_IRQn);
+      NVIC_EnableIRQ(DMA2_Stream3_IRQn);
+      NVIC_EnableIRQ(EXTI4_IRQn);
+    #endif
+  }
+}
+
+void ctrl_defer_esp(void) {
+  if (ctrl_defer.esp_step == 0) return;
+  if ((int32_t)(TIM2->CNT - ctrl_defer.esp_due_ts) < 0) return;
+  switch (ctrl_defer.esp_step) {
+    case 1:
+      set_esp_mode(ESP_DISABLED);
+      break;
+    case 2:
+      set_esp_mode(ctrl_defer.esp_boot ? ESP_BOOTMODE : ESP_ENABLED);
+      break;
+    default:
+      set_esp_mode(ESP_ENABLED);
+      break;
+  }
+  ctrl_defer.esp_due_ts = TIM2->CNT + CTRL_DEFER_ESP_STEP_US;
+  ctrl_defer.esp_step = (ctrl_defer.esp_step < 3) ? (ctrl_defer.esp_step + 1) : 0;
+}
+
+// from the main loop, every time it wakes
+void ctrl_defer_service(void) {
+  enter_critical_section();
+  uint32_t queued = ctrl_defer.queued;
+  uint32_t cans = ctrl_defer.cans;
+  uint32_t filters = ctrl_defer.filters;
+  ctrl_defer.cans = 0;
+  ctrl_defer.filters = 0;
+  exit_critical_section();
+
+  if (cans != 0) {
+    uint32_t start = TIM2->CNT;
+    ctrl_defer_hold(1);
+    for (int i = 0; i < CAN_MAX; i++) {
+      if ((cans & (1U << i)) == 0U) continue;
+      // a CAN that has to be set up from scratch is off until can_init turns
+      // its IRQs back on, one that's reconfigured keeps them
+      if ((can_setup_mask & (1U << i)) == 0U) {
+        for (int n = 0; n < 4; n++) NVIC_DisableIRQ(ctrl_defer_can_irqs[i][n]);
+      }
+      can_reconfigure(i);
+      if (filters & (1U << i)) can_init_filters(i);
+    }
+    ctrl_defer_hold(0);
+    uint32_t took = TIM2->CNT - start;
+    if (took > ctrl_defer.max_us) ctrl_defer.max_us = took;
+    ctrl_defer.runs += 1;
+  }
+
+  // the ESP steps have the USB IRQ back in between
+  ctrl_defer_esp();
+
+  // what came in after the snapshot is still pending, and counted after it
+  if (ctrl_defer.esp_step == 0) ctrl_defer.done = queued;
+}
+
+int ctrl_defer_status(uint8_t *out) {
+  struct __attribute__((packed)) {
+    uint32_t queued;
+    uint32_t done;
+    uint32_t pending; // CAN bits, and 0x100 for an ESP reset
+    uint32_t runs;
+    uint32_t max_us;
+    can_reconfig_stats can;
+  } *st = (void *)out;
+  enter_critical_section();
+  st->queued = ctrl_defer.queued;
+  st->done = ctrl_defer.done;
+  st->pending = ctrl_defer.cans | ((ctrl_defer.esp_step != 0) ? 0x100U : 0U);
+  st->runs = ctrl_defer.runs;
+  st->max_us = ctrl_defer.max_us;
+  st->can = can_reconfig_st;
+  exit_critical_section();
+  return sizeof(*st);
+}
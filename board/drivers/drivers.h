@@ -47,17 +47,30 @@ typedef union _USB_Setup {
 USB_Setup_TypeDef;
 
 void usb_init();
+// loads EP1 IN with queued CAN rx if it is idle
+void usb_ep1_in_kick();
 int usb_cb_control_msg(USB_Setup_TypeDef *setup, uint8_t *resp, int hardwired);
 int usb_cb_ep1_in(uint8_t *usbdata, int len, int hardwired);
+int usb_cb_ep2_in(uint8_t *usbdata, int len, int hardwired);
 void usb_cb_ep2_out(uint8_t *usbdata, int len, int hardwired);
 void usb_cb_ep3_out(uint8_t *usbdata, int len, int hardwired);
+// alt 2's lane for bus 0's CAN tx
+void usb_cb_ep1_out(uint8_t *usbdata, int len, int hardwired);
 void usb_cb_enumeration_complete();
+// the SOF IRQ, only while something has it on
+void usb_cb_sof();
+// main.c's CAN tx of an ep1 or ep3 OUT packet, which can_tx_defer.h calls from PendSV
+void usb_can_tx(uint8_t *usbdata, int len, int hardwired);
+void can_tx_defer_kick(void);
+int can_tx_defer_full(int lane);
 
 
 // ********************* UART *********************
-// IRQs: USART1, USART2, USART3, UART5
+// IRQs: USART1, USART2, USART3, UART5, DMA1_Stream0, DMA1_Stream1, DMA1_Stream3,
+//       DMA1_Stream5, DMA1_Stream6, DMA1_Stream7, DMA2_Stream5, DMA2_Stream7
 
 #define FIFO_SIZE 0x400
+#define UART_DMA_RX_LEN 0x40
 typedef struct uart_ring {
   uint16_t w_ptr_tx;
   uint16_t r_ptr_tx;
@@ -67,18 +80,47 @@ typedef struct uart_ring {
   uint8_t elems_rx[FIFO_SIZE];
   USART_TypeDef *uart;
   void (*callback)(struct uart_ring*);
+  // called when the DMA has taken bytes off elems_tx
+  void (*tx_callback)(struct uart_ring*);
+  // called with each byte the DMA brought in, before kline_rx
+  void (*rx_hook)(struct uart_ring*, uint8_t);
+
+  DMA_Stream_TypeDef *dma_tx;
+  uint16_t dma_tx_len; // bytes from r_ptr_tx the DMA is sending
+  DMA_Stream_TypeDef *dma_rx;
+  uint16_t r_ptr_dma_rx;
+  uint8_t elems_dma_rx[UART_DMA_RX_LEN];
 } uart_ring;
 
 void uart_init(USART_TypeDef *u, int baud);
 
 int getc(uart_ring *q, char *elem);
 int putc(uart_ring *q, char elem);
+int putn(uart_ring *q, const uint8_t *dat, int len);
 
 int puts(const char *a);
 void puth(unsigned int i);
 void hexdump(const void *a, int l);
 
 
+// ********************* TRACE *********************
+
+void trace(int level, int event, uint16_t arg0, uint32_t arg1);
+int trace_read(uint32_t *from, uint8_t *out, int len);
+
+
+// ********************* K-LINE *********************
+// IRQs: TIM2
+
+// on the ring number of an ep2 packet, send a KWP2000 message rather than raw bytes
+#define KLINE_MSG_FLAG 0x80
+// more ep2 packets of the same message follow
+#define KLINE_MSG_MORE 0x40
+
+void kline_service();
+int kline_rx(uart_ring *q, uint8_t c);
+
+
 // ********************* ADC *********************
 
 void adc_init();
@@ -95,12 +137,21 @@ void dac_set(int channel, uint32_t value);
 
 void timer_init(TIM_TypeDef *TIM, int psc);
 
+// IRQs: TIM2
+#define TICK_US 10000
+#define TICKS_PER_CLICK 100
+void tick_service();
+
 
 // ********************* SPI *********************
 // IRQs: DMA2_Stream2, DMA2_Stream3, EXTI4
 
 void spi_init();
-int spi_cb_rx(uint8_t *data, int len, uint8_t *data_out);
+void spi_data_ready();
+// dat is the control request for endpoint 0, the payload of len bytes otherwise
+int spi_cb_rx(uint8_t endpoint, uint8_t *dat, int len, uint8_t *data_out, int max_out);
+// nonzero while there is data for the ESP to poll
+int spi_cb_data_ready();
 
 
 // ********************* CAN *********************
@@ -108,13 +159,31 @@ int spi_cb_rx(uint8_t *data, int len, uint8_t *data_out);
 //       CAN2_TX, CAN2_RX0, CAN2_SCE
 //       CAN3_TX, CAN3_RX0, CAN3_SCE
 
+// single producer, single consumer ring
+// w_ptr is only written by the producer, r_ptr only by the consumer
 typedef struct {
-  uint32_t w_ptr;
-  uint32_t r_ptr;
+  volatile uint32_t w_ptr;
+  volatile uint32_t r_ptr;
   uint32_t fifo_size;
   CAN_FIFOMailBox_TypeDef *elems;
+  // optional, TIM2 microseconds for each element
+  uint32_t *timestamps;
+  // most elements ever queued, written by the producer
+  uint32_t hwm;
+  // TX queues only, a heap by bus priority instead of a ring (0xc3)
+  int prio;
+  uint16_t seq;
 } can_ring;
 
+// USB CAN record with a TIM2 timestamp, three fill a 0x40 packet
+typedef struct {
+  uint32_t RIR;
+  uint32_t RDTR;
+  uint32_t RDLR;
+  uint32_t RDHR;
+  uint32_t timestamp;
+} can_ts_record;
+
 #define CAN_BUS_RET_FLAG 0x80
 #define CAN_BUS_NUM_MASK 0x7F
 
@@ -136,6 +205,33 @@ void can_init(uint8_t can_number);
 void can_init_all();
 void can_send(CAN_FIFOMailBox_TypeDef *to_push, uint8_t bus_number);
 int can_pop(can_ring *q, CAN_FIFOMailBox_TypeDef *elem);
+int can_pop_ts(can_ring *q, CAN_FIFOMailBox_TypeDef *elem, uint32_t *ts);
+
+// IRQs: TIM2
+void can_timed_service();
+// coalesced RX, can_coalesce.h
+void can_coalesce_note(int received);
+int can_coalesce_service(uint32_t now, uint32_t *due);
+// transmit groups, can_group.h
+int can_group_service(uint32_t now, uint32_t *due);
+// per id stats, can_census.h
+void can_census(uint8_t bus, CAN_FIFOMailBox_TypeDef *f, uint32_t ts);
+// ECU emulation, can_responder.h
+void can_responder_rx(uint8_t bus_number, CAN_FIFOMailBox_TypeDef *f, uint32_t ts);
+// gateway rules, can_gateway.h
+int can_gateway_rx(uint8_t bus_number, CAN_FIFOMailBox_TypeDef *f, uint32_t ts);
+
+
+// ********************* ISO-TP *********************
+// IRQs: CAN1_TX, CAN1_RX0, CAN2_TX, CAN2_RX0, CAN3_TX, CAN3_RX0, TIM2
+
+// with KLINE_MSG_FLAG on the ring number of an ep2 packet, a PDU for the ISO-TP
+// channel in the low bits instead of a K-line message
+#define ISOTP_MSG_FLAG 0x20
+
+int isotp_rx(uint8_t bus_number, CAN_FIFOMailBox_TypeDef *f, uint32_t ts);
+void isotp_tx_done(uint8_t bus_number, CAN_FIFOMailBox_TypeDef *f, uint32_t ts);
+int isotp_service(uint32_t now, uint32_t *due);
 
 #endif
 
@@ -0,0 +1,134 @@
+// IRQs: EXTI1 (EXTI15_10 on the legacy board), and the LIN rings' UARTs
+// The event stream, set with 0xe3, USB only. Ignition edges, ADC samples and
+// LIN bytes go in an RX queue of their own that the host reads merged with
+// the buses', so they come out on ep1 with CAN, each with the TIM2 time it
+// happened at:
+//   ignition  the started line, from its EXTI on both edges, and its level
+//             when the stream is turned on
+//   adc       the scanned channels, every period ticks of the main loop
+//   lin       each byte of the LIN rings, at the time it was taken off their
+//             DMA. The line is idle for a byte after the last.
+// The pedal's position comes from the interceptor's frames, which are CAN.
+//
+// A record is a CAN record with TXRQ set and bus EVENT_BUS, no frame has
+// the bus and completions have TXRQ on a real one. The id is the kind in
+// bits 4-10 and the channel in 0-3, the ring number for lin and the ADC
+// channel for adc. The data, len bytes of RDLR, is the level, the 12 bit
+// sample or the byte, and RDHR is the time whatever the format. Compact
+// records are len 0xC, see can_compact.h.
+
+#define EVENT_BUS 0x7F
+
+#define EVENT_IGNITION 1
+#define EVENT_ADC 2
+#define EVENT_LIN 3
+
+// 0xe3's wValue
+#define EVENT_MASK_IGNITION (1U << EVENT_IGNITION)
+#define EVENT_MASK_ADC (1U << EVENT_ADC)
+#define EVENT_MASK_LIN (1U << EVENT_LIN)
+#define EVENT_MASK_ALL (EVENT_MASK_IGNITION | EVENT_MASK_ADC | EVENT_MASK_LIN)
+
+#define EVENT_Q_LEN 0x100
+
+CAN_FIFOMailBox_TypeDef event_elems[EVENT_Q_LEN];
+uint32_t event_timestamps[EVENT_Q_LEN];
+can_ring event_q = { .w_ptr = 0, .r_ptr = 0, .fifo_size = EVENT_Q_LEN, .elems = event_elems,
+                     .timestamps = event_timestamps };
+
+uint32_t event_mask = 0;
+int event_adc_period = 1;
+int event_adc_ticks = 0;
+
+#ifdef PANDA
+  #define EVENT_IGNITION_LINE 1
+  #define EVENT_IGNITION_IRQ EXTI1_IRQn
+#else
+  #define EVENT_IGNITION_LINE 13
+  #define EVENT_IGNITION_IRQ EXTI15_10_IRQn
+#endif
+
+int event_ignition() {
+  #ifdef PANDA
+    return (GPIOA->IDR & (1 << 1)) == 0;
+  #else
+    return (GPIOC->IDR & (1 << 13)) != 0;
+  #endif
+}
+
+// from any context, the IRQs and the main loop all produce
+void event_push(int kind, int channel, uint32_t dat, int len, uint32_t ts) {
+  CAN_FIFOMailBox_TypeDef rec;
+  rec.RIR = (((uint32_t)(kind << 4) | (channel & 0xF)) << 21) | 1;
+  rec.RDTR = len | (EVENT_BUS << 4);
+  rec.RDLR = dat;
+  rec.RDHR = ts;
+  // a full queue is traced by can_push_ts
+  enter_critical_section();
+  if (can_push_ts(&event_q, &rec, ts)) {
+    #ifdef PANDA
+      spi_data_ready();
+    #endif
+    usb_ep1_in_kick();
+  }
+  exit_critical_section();
+}
+
+void event_ignition_edge() {
+  uint32_t ts = TIM2->CNT;
+  EXTI->PR = 1U << EVENT_IGNITION_LINE;
+  if (event_mask & EVENT_MASK_IGNITION) event_push(EVENT_IGNITION, 0, event_ignition(), 1, ts);
+}
+
+#ifdef PANDA
+  void EXTI1_IRQHandler(void) { event_ignition_edge(); }
+#else
+  void EXTI15_10_IRQHandler(void) { event_ignition_edge(); }
+#endif
+
+// rx_hook of the LIN rings
+void event_lin_rx(uart_ring *q, uint8_t c) {
+  event_push(EVENT_LIN, (q == &lin1_ring) ? 2 : 3, c, 1, TIM2->CNT);
+}
+
+// every tick of the main loop
+void event_tick() {
+  if (!(event_mask & EVENT_MASK_ADC) || ++event_adc_ticks < event_adc_period) return;
+  event_adc_ticks = 0;
+  for (unsigned int i = 0; i < ADC_SCAN_LEN; i++) {
+    event_push(EVENT_ADC, adc_scan[i], adc_get(adc_scan[i]), 2, TIM2->CNT);
+  }
+}
+
+// mask of EVENT_MASK_, the ADC sampled every adc_period ticks, 0 for 1
+void event_set(uint32_t mask, int adc_period) {
+  enter_critical_section();
+  uint32_t was = event_mask;
+  event_mask = mask & EVENT_MASK_ALL;
+  event_adc_period = max(adc_period, 1);
+  event_adc_ticks = 0;
+  can_event_q = (event_mask != 0) ? &event_q : NULL;
+  if (event_mask == 0) can_clear(&event_q);
+
+  uart_ring *lins[] = {&lin1_ring, &lin2_ring};
+  for (int i = 0; i < 2; i++) lins[i]->rx_hook = (event_mask & EVENT_MASK_LIN) ? event_lin_rx : NULL;
+
+  if (event_mask & EVENT_MASK_IGNITION) {
+    #ifdef PANDA
+      SYSCFG->EXTICR[0] = (SYSCFG->EXTICR[0] & ~SYSCFG_EXTICR1_EXTI1) | SYSCFG_EXTICR1_EXTI1_PA;
+    #else
+      SYSCFG->EXTICR[3] = (SYSCFG->EXTICR[3] & ~SYSCFG_EXTICR4_EXTI13) | SYSCFG_EXTICR4_EXTI13_PC;
+    #endif
+    EXTI->RTSR |= 1U << EVENT_IGNITION_LINE;
+    EXTI->FTSR |= 1U << EVENT_IGNITION_LINE;
+    EXTI->PR = 1U << EVENT_IGNITION_LINE;
+    EXTI->IMR |= 1U << EVENT_IGNITION_LINE;
+    NVIC_EnableIRQ(EVENT_IGNITION_IRQ);
+    // where it starts from
+    if (!(was & EVENT_MASK_IGNITION)) event_push(EVENT_IGNITION, 0, event_ignition(), 1, TIM2->CNT);
+  } else {
+    EXTI->IMR &= ~(1U << EVENT_IGNITION_LINE);
+    NVIC_DisableIRQ(EVENT_IGNITION_IRQ);
+  }
+  exit_critical_section();
+}
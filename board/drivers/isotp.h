@@ -0,0 +1,566 @@
+// IRQs: CAN1_TX, CAN1_RX0, CAN2_TX, CAN2_RX0, CAN3_TX, CAN3_RX0, TIM2
+// ISO-TP (ISO 15765-2) engine, the panda segments, paces and reassembles the
+// PDUs of its channels so no single or flow control frame waits on the host
+//
+// A channel is a tx and an rx id on a bus, set up with 0xc6. The host sends
+// a PDU of up to 4095 bytes in ep2 packets with ISOTP_MSG_FLAG, like K-line
+// messages. The flow control for a first frame goes out from the CAN RX IRQ,
+// the consecutive frames from the TX IRQ as the ones before them are acked,
+// or from TIM2 compare 4 when the peer asked for an STmin. Frames of a
+// channel's rx id don't go to the RX queues, and its own frames still go
+// through the safety tx hook. A bus with host filters has to let the rx id through.
+//
+// Received PDUs and what became of the host's are queued as records of
+//   status, length low, length high, PDU
+// and stream on ep2 IN, a channel's packets being KLINE_MSG_FLAG |
+// ISOTP_MSG_FLAG | channel then up to 0x3F bytes of its records. A TX
+// record that comes while a PDU is coming in waits for it to be done.
+
+#ifdef PANDA
+  #define ISOTP_CHANNELS 4
+#else
+  #define ISOTP_CHANNELS 1
+#endif
+#define ISOTP_PDU_MAX 4095
+#define ISOTP_RING_LEN 0x2000 // power of two, two whole PDUs
+#define ISOTP_RECORD_HEADER 3
+
+// 0xc6 parameters, set them while the channel is closed
+#define ISOTP_PARAM_OPEN 0     // 1 opens the channel, emptying it, 0 closes it
+#define ISOTP_PARAM_BUS 1
+#define ISOTP_PARAM_TX_ID_LO 2 // the ids are in the RIR layout
+#define ISOTP_PARAM_TX_ID_HI 3
+#define ISOTP_PARAM_RX_ID_LO 4
+#define ISOTP_PARAM_RX_ID_HI 5
+#define ISOTP_PARAM_PAD 6      // ISOTP_PAD | byte pads frames to 8 bytes with byte, 0 sends them short
+#define ISOTP_PARAM_BS 7       // block size of the flow control the panda sends
+#define ISOTP_PARAM_STMIN 8    // STmin of the flow control the panda sends, as sent
+#define ISOTP_PAD 0x100
+
+#define ISOTP_STATUS_RX 0          // a PDU received
+#define ISOTP_STATUS_TX_DONE 1     // the host's PDU went out, the records from here on have no PDU
+#define ISOTP_STATUS_TX_BUSY 2     // a PDU came from the host while one was going, it was dropped
+#define ISOTP_STATUS_TX_TIMEOUT 3  // no flow control or ack for 1 s, N_Bs or N_As
+#define ISOTP_STATUS_TX_OVERFLOW 4 // the peer can't take a PDU that long
+#define ISOTP_STATUS_TX_BLOCKED 5  // the safety mode or a full TX queue dropped a frame
+#define ISOTP_STATUS_RX_TIMEOUT 6  // no consecutive frame for 1 s, N_Cr
+#define ISOTP_STATUS_RX_SEQUENCE 7 // a consecutive frame out of order
+#define ISOTP_STATUS_RX_OVERFLOW 8 // no room in the ring for a PDU, the peer got an overflow
+
+#define ISOTP_TIMEOUT_US 1000000U
+
+#define ISOTP_TX_IDLE 0
+#define ISOTP_TX_WAIT_FC 1 // for the flow control after a first frame or a block
+#define ISOTP_TX_SENDING 2 // and after the last frame, waiting for the acks
+
+// the high nibble of the first byte
+#define ISOTP_SF 0x00
+#define ISOTP_FF 0x10
+#define ISOTP_CF 0x20
+#define ISOTP_FC 0x30
+#define ISOTP_FC_CTS 0
+#define ISOTP_FC_WAIT 1
+#define ISOTP_FC_OVERFLOW 2
+
+typedef struct {
+  int open;
+  uint8_t bus_number;
+  uint32_t tx_id;
+  uint32_t rx_id;
+  uint16_t pad;
+  uint8_t bs;
+  uint8_t stmin;
+
+  int tx_state;
+  uint8_t tx_buf[ISOTP_PDU_MAX];
+  int tx_len;
+  int tx_pos;         // next byte to go
+  int tx_staging;     // more ep2 packets of the PDU are coming
+  int tx_rejected;    // the PDU being staged is dropped
+  uint8_t tx_seq;
+  int tx_in_flight;   // frames queued and not acked yet
+  int tx_block_left;  // consecutive frames before the next flow control, -1 for all of them
+  uint32_t tx_stmin_us;
+  uint32_t tx_due;    // of the next consecutive frame, after an STmin
+  uint32_t tx_deadline;
+  int tx_report;      // a TX record waiting for the PDU coming in, -1 for none
+
+  int rx_active;
+  int rx_len;
+  int rx_pos;
+  uint8_t rx_seq;
+  int rx_block_left;
+  uint32_t rx_deadline;
+
+  // a PDU coming in is written past ring_w and published when it's whole
+  uint8_t ring[ISOTP_RING_LEN];
+  volatile uint32_t ring_w;
+  volatile uint32_t ring_r;
+
+  // for 0xc7
+  uint32_t tx_pdus;
+  uint32_t rx_pdus;
+  uint32_t tx_errors;
+  uint32_t rx_errors;
+  uint32_t records_lost;
+} isotp_channel;
+
+isotp_channel isotp_channels[ISOTP_CHANNELS];
+int isotp_ep2_in_next = 0;
+
+#define ISOTP_DUE(ts, now) ((int32_t)((now) - (ts)) >= 0)
+
+// ***************************** records *****************************
+
+int isotp_ring_free(isotp_channel *c) {
+  return ISOTP_RING_LEN - (c->ring_w - c->ring_r);
+}
+
+// unpublished, pos bytes past ring_w
+void isotp_ring_put(isotp_channel *c, uint32_t pos, const uint8_t *dat, int len) {
+  for (int i = 0; i < len; i++) {
+    c->ring[(c->ring_w + pos + i) & (ISOTP_RING_LEN - 1)] = dat[i];
+  }
+}
+
+// the header in front of the len bytes already put, 0 if there was no room
+int isotp_ring_publish(isotp_channel *c, uint8_t status, int len) {
+  if (isotp_ring_free(c) < ISOTP_RECORD_HEADER + len) {
+    c->records_lost += 1;
+    return 0;
+  }
+  uint8_t header[ISOTP_RECORD_HEADER] = {status, len & 0xFF, len >> 8};
+  isotp_ring_put(c, 0, header, sizeof(header));
+  // the record is visible before the new ring_w
+  __DMB();
+  c->ring_w += ISOTP_RECORD_HEADER + len;
+  usb_ep2_in_kick();
+  return 1;
+}
+
+// a TX record goes in between PDUs coming in
+void isotp_report_tx(isotp_channel *c, int status) {
+  if (status == ISOTP_STATUS_TX_DONE) {
+    c->tx_pdus += 1;
+  } else {
+    c->tx_errors += 1;
+  }
+  if (c->rx_active) {
+    c->tx_report = status;
+  } else {
+    isotp_ring_publish(c, status, 0);
+  }
+}
+
+void isotp_rx_finish(isotp_channel *c, int status, int len) {
+  if (status == ISOTP_STATUS_RX) {
+    c->rx_pdus += 1;
+  } else {
+    c->rx_errors += 1;
+  }
+  c->rx_active = 0;
+  isotp_ring_publish(c, status, len);
+  if (c->tx_report != -1) {
+    isotp_ring_publish(c, c->tx_report, 0);
+    c->tx_report = -1;
+  }
+}
+
+// ***************************** frames *****************************
+
+// CC4 is can_timed_service's, it takes the new deadline when its IRQ runs
+void isotp_kick() {
+  TIM2->DIER |= TIM_DIER_CC4IE;
+  TIM2->EGR = TIM_EGR_CC4G;
+}
+
+// the frame into the TX queue, safety permitting, for process_can to load.
+// In the TX IRQ it's the refill after isotp_tx_done that does.
+int isotp_push(isotp_channel *c, const uint8_t *dat, int len) {
+  uint32_t frame[2];
+  memset(frame, c->pad & 0xFF, sizeof(frame));
+  memcpy(frame, dat, len);
+  if (c->pad & ISOTP_PAD) len = 8;
+
+  CAN_FIFOMailBox_TypeDef f;
+  f.RIR = c->tx_id | 1;
+  f.RDTR = len;
+  f.RDLR = frame[0];
+  f.RDHR = frame[1];
+  if (!safety_tx_hook(&f)) return 0;
+  f.RDTR &= 0xF;
+  if (!can_push(can_queues[c->bus_number], &f)) {
+    can_stats[c->bus_number].tx_drop_cnt += 1;
+    return 0;
+  }
+  return 1;
+}
+
+void isotp_flush(isotp_channel *c) {
+  process_can(CAN_NUM_FROM_BUS_NUM(c->bus_number));
+}
+
+void isotp_send_fc(isotp_channel *c, int status) {
+  uint8_t fc[3] = {ISOTP_FC | status, c->bs, c->stmin};
+  isotp_push(c, fc, sizeof(fc));
+  isotp_flush(c);
+}
+
+// STmin 0xF1-0xF9 are 100-900 us, the reserved values are taken as the most
+uint32_t isotp_stmin_us(uint8_t stmin) {
+  if (stmin <= 0x7F) return stmin * 1000U;
+  if (stmin >= 0xF1 && stmin <= 0xF9) return (stmin - 0xF0) * 100U;
+  return 0x7F * 1000U;
+}
+
+// The consecutive frames go out in the order they were queued with TXFP or
+// without, see can_tx_would_pass, so a mailbox each can be in flight. One at
+// a time with an STmin, it's from the ack of the last.
+int isotp_tx_window(isotp_channel *c) {
+  if (c->tx_stmin_us != 0) return 1;
+  if (CAN_NUM_FROM_BUS_NUM(c->bus_number) == 0xff) return 1;
+  return CAN_TX_MAILBOXES;
+}
+
+void isotp_tx_fail(isotp_channel *c, int status) {
+  c->tx_state = ISOTP_TX_IDLE;
+  isotp_report_tx(c, status);
+}
+
+// queues the consecutive frames that can go now, returns how many
+int isotp_tx_run(isotp_channel *c, uint32_t now) {
+  int pushed = 0;
+  while (c->tx_state == ISOTP_TX_SENDING && c->tx_pos < c->tx_len && c->tx_block_left != 0 &&
+         c->tx_in_flight < isotp_tx_window(c) && (c->tx_stmin_us == 0 || ISOTP_DUE(c->tx_due, now))) {
+    uint8_t cf[8];
+    int len = min(c->tx_len - c->tx_pos, 7);
+    cf[0] = ISOTP_CF | c->tx_seq;
+    memcpy(cf + 1, c->tx_buf + c->tx_pos, len);
+    if (!isotp_push(c, cf, len + 1)) {
+      isotp_tx_fail(c, ISOTP_STATUS_TX_BLOCKED);
+      break;
+    }
+    c->tx_pos += len;
+    c->tx_seq = (c->tx_seq + 1) & 0xF;
+    c->tx_in_flight += 1;
+    c->tx_deadline = now + ISOTP_TIMEOUT_US;
+    pushed += 1;
+    if (c->tx_block_left > 0) {
+      c->tx_block_left -= 1;
+      if (c->tx_block_left == 0 && c->tx_pos < c->tx_len) c->tx_state = ISOTP_TX_WAIT_FC;
+    }
+  }
+  return pushed;
+}
+
+// the whole PDU is staged, its single or first frame goes
+void isotp_tx_start(isotp_channel *c) {
+  uint32_t now = TIM2->CNT;
+  uint8_t frame[8];
+  int len;
+  if (c->tx_len <= 7) {
+    frame[0] = ISOTP_SF | c->tx_len;
+    memcpy(frame + 1, c->tx_buf, c->tx_len);
+    len = c->tx_len + 1;
+    c->tx_pos = c->tx_len;
+    c->tx_state = ISOTP_TX_SENDING;
+  } else {
+    frame[0] = ISOTP_FF | (c->tx_len >> 8);
+    frame[1] = c->tx_len & 0xFF;
+    memcpy(frame + 2, c->tx_buf, 6);
+    len = 8;
+    c->tx_pos = 6;
+    c->tx_seq = 1;
+    c->tx_state = ISOTP_TX_WAIT_FC;
+  }
+  c->tx_in_flight = 0;
+  if (!isotp_push(c, frame, len)) {
+    isotp_tx_fail(c, ISOTP_STATUS_TX_BLOCKED);
+    return;
+  }
+  c->tx_in_flight = 1;
+  c->tx_deadline = now + ISOTP_TIMEOUT_US;
+  isotp_flush(c);
+  isotp_kick();
+}
+
+// a flow control from the peer
+void isotp_rx_fc(isotp_channel *c, const uint8_t *dat, uint32_t ts) {
+  if (c->tx_state != ISOTP_TX_WAIT_FC) return;
+  switch (dat[0] & 0xF) {
+    case ISOTP_FC_CTS:
+      c->tx_state = ISOTP_TX_SENDING;
+      c->tx_block_left = (dat[1] == 0) ? -1 : dat[1];
+      c->tx_stmin_us = isotp_stmin_us(dat[2]);
+      c->tx_due = ts;
+      c->tx_deadline = ts + ISOTP_TIMEOUT_US;
+      if (isotp_tx_run(c, ts) > 0) isotp_flush(c);
+      break;
+    case ISOTP_FC_WAIT:
+      c->tx_deadline = ts + ISOTP_TIMEOUT_US;
+      break;
+    default:
+      isotp_tx_fail(c, ISOTP_STATUS_TX_OVERFLOW);
+      break;
+  }
+}
+
+// a frame of the peer, 1 if it was a channel's
+int isotp_rx(uint8_t bus_number, CAN_FIFOMailBox_TypeDef *f, uint32_t ts) {
+  isotp_channel *c = NULL;
+  for (int i = 0; i < ISOTP_CHANNELS; i++) {
+    isotp_channel *ch = &isotp_channels[i];
+    if (ch->open && ch->bus_number == bus_number && (f->RIR & ~1U) == ch->rx_id) {
+      c = ch;
+      break;
+    }
+  }
+  if (c == NULL) return 0;
+
+  uint32_t words[2] = {f->RDLR, f->RDHR};
+  uint8_t *dat = (uint8_t *)words;
+  int dlc = min(f->RDTR & 0xF, 8);
+  if (dlc == 0) return 1;
+
+  switch (dat[0] & 0xF0) {
+    case ISOTP_SF:
+      {
+        int len = dat[0] & 0xF;
+        if (len == 0 || len > dlc - 1) break;
+        // a single frame ends a PDU coming in
+        if (c->rx_active) isotp_rx_finish(c, ISOTP_STATUS_RX_SEQUENCE, 0);
+        if (isotp_ring_free(c) >= ISOTP_RECORD_HEADER + len) {
+          isotp_ring_put(c, ISOTP_RECORD_HEADER, dat + 1, len);
+        }
+        isotp_rx_finish(c, ISOTP_STATUS_RX, len);
+        break;
+      }
+    case ISOTP_FF:
+      {
+        int len = ((dat[0] & 0xF) << 8) | dat[1];
+        if (dlc < 8 || len < 8) break;
+        if (c->rx_active) isotp_rx_finish(c, ISOTP_STATUS_RX_SEQUENCE, 0);
+        if (isotp_ring_free(c) < ISOTP_RECORD_HEADER + len) {
+          c->rx_errors += 1;
+          isotp_send_fc(c, ISOTP_FC_OVERFLOW);
+          isotp_ring_publish(c, ISOTP_STATUS_RX_OVERFLOW, 0);
+          break;
+        }
+        isotp_ring_put(c, ISOTP_RECORD_HEADER, dat + 2, 6);
+        c->rx_active = 1;
+        c->rx_len = len;
+        c->rx_pos = 6;
+        c->rx_seq = 1;
+        c->rx_block_left = c->bs;
+        c->rx_deadline = ts + ISOTP_TIMEOUT_US;
+        isotp_send_fc(c, ISOTP_FC_CTS);
+        isotp_kick();
+        break;
+      }
+    case ISOTP_CF:
+      {
+        if (!c->rx_active) break;
+        if ((dat[0] & 0xF) != c->rx_seq) {
+          isotp_rx_finish(c, ISOTP_STATUS_RX_SEQUENCE, 0);
+          break;
+        }
+        int len = min(c->rx_len - c->rx_pos, dlc - 1);
+        isotp_ring_put(c, ISOTP_RECORD_HEADER + c->rx_pos, dat + 1, len);
+        c->rx_pos += len;
+        c->rx_seq = (c->rx_seq + 1) & 0xF;
+        c->rx_deadline = ts + ISOTP_TIMEOUT_US;
+        if (c->rx_pos == c->rx_len) {
+          isotp_rx_finish(c, ISOTP_STATUS_RX, c->rx_len);
+        } else if (c->bs != 0 && --c->rx_block_left == 0) {
+          c->rx_block_left = c->bs;
+          isotp_send_fc(c, ISOTP_FC_CTS);
+        }
+        break;
+      }
+    case ISOTP_FC:
+      isotp_rx_fc(c, dat, ts);
+      break;
+    default:
+      break;
+  }
+  return 1;
+}
+
+// a frame of the bus was acked, called from process_can
+void isotp_tx_done(uint8_t bus_number, CAN_FIFOMailBox_TypeDef *f, uint32_t ts) {
+  for (int i = 0; i < ISOTP_CHANNELS; i++) {
+    isotp_channel *c = &isotp_channels[i];
+    if (!c->open || c->bus_number != bus_number || (f->RIR & ~1U) != c->tx_id) continue;
+    if (c->tx_state == ISOTP_TX_IDLE || c->tx_in_flight == 0) continue;
+
+    c->tx_in_flight -= 1;
+    c->tx_deadline = ts + ISOTP_TIMEOUT_US;
+    if (c->tx_state == ISOTP_TX_SENDING) {
+      if (c->tx_pos == c->tx_len) {
+        if (c->tx_in_flight == 0) {
+          c->tx_state = ISOTP_TX_IDLE;
+          isotp_report_tx(c, ISOTP_STATUS_TX_DONE);
+        }
+      } else {
+        c->tx_due = ts + c->tx_stmin_us;
+        isotp_tx_run(c, ts);
+        // deadlines only move later, CC4 just goes around again for those
+        if (c->tx_stmin_us != 0) isotp_kick();
+      }
+    }
+  }
+}
+
+// the timeouts and STmin waits, from can_timed_service. Returns 1 with the
+// next of them in due if there's one.
+int isotp_service(uint32_t now, uint32_t *due) {
+  int waiting = 0;
+  for (int i = 0; i < ISOTP_CHANNELS; i++) {
+    isotp_channel *c = &isotp_channels[i];
+    if (!c->open) continue;
+
+    if (c->tx_state != ISOTP_TX_IDLE && ISOTP_DUE(c->tx_deadline, now)) {
+      isotp_tx_fail(c, ISOTP_STATUS_TX_TIMEOUT);
+    }
+    if (c->rx_active && ISOTP_DUE(c->rx_deadline, now)) {
+      isotp_rx_finish(c, ISOTP_STATUS_RX_TIMEOUT, 0);
+    }
+    if (isotp_tx_run(c, now) > 0) isotp_flush(c);
+
+    uint32_t next[3];
+    int n = 0;
+    if (c->tx_state != ISOTP_TX_IDLE) next[n++] = c->tx_deadline;
+    if (c->tx_state == ISOTP_TX_SENDING && c->tx_pos < c->tx_len && c->tx_in_flight == 0) next[n++] = c->tx_due;
+    if (c->rx_active) next[n++] = c->rx_deadline;
+    for (int j = 0; j < n; j++) {
+      if (!waiting || (int32_t)(next[j] - *due) < 0) *due = next[j];
+      waiting = 1;
+    }
+  }
+  return waiting;
+}
+
+// ***************************** host *****************************
+
+int isotp_set_param(int channel, int param, uint16_t value) {
+  if (channel < 0 || channel >= ISOTP_CHANNELS) return 0;
+  isotp_channel *c = &isotp_channels[channel];
+  switch (param) {
+    case ISOTP_PARAM_OPEN:
+      enter_critical_section();
+      c->open = 0;
+      if (value != 0 && c->bus_number < BUS_MAX) {
+        c->tx_state = ISOTP_TX_IDLE;
+        c->tx_staging = 0;
+        c->tx_rejected = 0;
+        c->tx_in_flight = 0;
+        c->tx_report = -1;
+        c->rx_active = 0;
+        c->ring_r = c->ring_w;
+        c->tx_pdus = 0;
+        c->rx_pdus = 0;
+        c->tx_errors = 0;
+        c->rx_errors = 0;
+        c->records_lost = 0;
+        c->open = 1;
+      }
+      exit_critical_section();
+      break;
+    case ISOTP_PARAM_BUS:
+      c->bus_number = value;
+      break;
+    case ISOTP_PARAM_TX_ID_LO:
+      c->tx_id = (c->tx_id & 0xFFFF0000U) | (value & ~1U);
+      break;
+    case ISOTP_PARAM_TX_ID_HI:
+      c->tx_id = (c->tx_id & 0xFFFFU) | ((uint32_t)value << 16);
+      break;
+    case ISOTP_PARAM_RX_ID_LO:
+      c->rx_id = (c->rx_id & 0xFFFF0000U) | (value & ~1U);
+      break;
+    case ISOTP_PARAM_RX_ID_HI:
+      c->rx_id = (c->rx_id & 0xFFFFU) | ((uint32_t)value << 16);
+      break;
+    case ISOTP_PARAM_PAD:
+      c->pad = value;
+      break;
+    case ISOTP_PARAM_BS:
+      c->bs = value;
+      break;
+    case ISOTP_PARAM_STMIN:
+      c->stmin = value;
+      break;
+    default:
+      return 0;
+  }
+  return 1;
+}
+
+// an ep2 packet of a PDU
+void isotp_send(int channel, const uint8_t *dat, int len, int more) {
+  if (channel < 0 || channel >= ISOTP_CHANNELS) return;
+  isotp_channel *c = &isotp_channels[channel];
+  enter_critical_section();
+  if (c->open) {
+    if (!c->tx_staging) {
+      c->tx_len = 0;
+      c->tx_rejected = c->tx_state != ISOTP_TX_IDLE;
+      if (c->tx_rejected) isotp_report_tx(c, ISOTP_STATUS_TX_BUSY);
+    }
+    if (!c->tx_rejected) {
+      int n = min(len, ISOTP_PDU_MAX - c->tx_len);
+      memcpy(c->tx_buf + c->tx_len, dat, n);
+      c->tx_len += n;
+    }
+    c->tx_staging = more;
+    if (!more && !c->tx_rejected && c->tx_len > 0) isotp_tx_start(c);
+  }
+  exit_critical_section();
+}
+
+// the next channel's records for ep2 IN, returns the packet's length
+int isotp_ep2_in(uint8_t *usbdata, int len) {
+  for (int i = 0; i < ISOTP_CHANNELS; i++) {
+    int channel = (isotp_ep2_in_next + i) % ISOTP_CHANNELS;
+    isotp_channel *c = &isotp_channels[channel];
+    uint32_t ring_w = c->ring_w;
+    if (ring_w == c->ring_r) continue;
+    // the records are read before ring_r lets them go
+    __DMB();
+    int pos = 1;
+    while (pos < len && c->ring_r != ring_w) {
+      usbdata[pos++] = c->ring[c->ring_r & (ISOTP_RING_LEN - 1)];
+      c->ring_r += 1;
+    }
+    usbdata[0] = KLINE_MSG_FLAG | ISOTP_MSG_FLAG | channel;
+    isotp_ep2_in_next = (channel + 1) % ISOTP_CHANNELS;
+    return pos;
+  }
+  return 0;
+}
+
+int isotp_status(int channel, uint8_t *out) {
+  if (channel < 0 || channel >= ISOTP_CHANNELS) return 0;
+  isotp_channel *c = &isotp_channels[channel];
+  struct __attribute__((packed)) {
+    uint32_t open;
+    uint32_t tx_state;
+    uint32_t tx_pdus;
+    uint32_t rx_pdus;
+    uint32_t tx_errors;
+    uint32_t rx_errors;
+    uint32_t records_lost;
+    uint32_t queued; // bytes of records ep2 IN hasn't taken
+  } *st = (void *)out;
+  enter_critical_section();
+  st->open = c->open;
+  st->tx_state = c->tx_state;
+  st->tx_pdus = c->tx_pdus;
+  st->rx_pdus = c->rx_pdus;
+  st->tx_errors = c->tx_errors;
+  st->rx_errors = c->rx_errors;
+  st->records_lost = c->records_lost;
+  st->queued = c->ring_w - c->ring_r;
+  exit_critical_section();
+  return sizeof(*st);
+}
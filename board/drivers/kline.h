@@ -0,0 +1,262 @@
+// IRQs: TIM2
+// KWP2000 (ISO 14230) message engine for the K and L lines, timed by TIM2 compare 2
+//
+// In message mode the host sends whole requests on ep2 and reads whole
+// responses from the ring. The ST adds the checksum, does the fast init
+// wakeup, paces bytes by P4, drops the echo of what it sent and frames the
+// ECU's answers by their length byte and P1/P2, so none of the timing depends
+// on how fast the host or the ESP polls.
+//
+// Responses are queued on the ring's rx side as records of
+//   status, length low, length high, message without the checksum
+
+#define KLINE_MSG_MAX 0x104 // 4 header bytes, 255 data bytes, checksum
+
+// 0xf3 mode bits
+#define KLINE_MODE_MESSAGE 1
+// 25 ms low, 25 ms high before the next request
+#define KLINE_MODE_FAST_INIT 2
+// checksum is the negated sum of the bytes, as Honda does
+#define KLINE_MODE_NEG_CHECKSUM 4
+
+#define KLINE_STATUS_OK 0
+#define KLINE_STATUS_CHECKSUM 1   // response failed its checksum
+#define KLINE_STATUS_TIMEOUT 2    // nothing within P2 of the request
+#define KLINE_STATUS_ECHO 3       // our own bytes didn't come back, bus fault or collision
+#define KLINE_STATUS_INCOMPLETE 4 // P1 ran out inside a response
+
+// in microseconds
+#define KLINE_WAKEUP_US 25000U
+#define KLINE_P1_MAX_US 20000U // ECU inter byte
+#define KLINE_P2_MAX_US 50000U // request to response, and between responses
+#define KLINE_P2_EXT_US 5000000U // after a 7F xx 78, response pending
+#define KLINE_P3_MIN_US 55000U // response to the next request
+#define KLINE_P4_US 5000U // tester inter byte
+// a byte at 10400 baud takes under 1 ms, and the rx DMA hands it over a byte time later
+#define KLINE_ECHO_US 4000U
+
+#define KLINE_IDLE 0
+#define KLINE_WAKE_LOW 1
+#define KLINE_WAKE_HIGH 2
+#define KLINE_TX_GAP 3  // waiting to send tx[tx_pos]
+#define KLINE_TX_ECHO 4 // tx[tx_pos] is out, waiting for it to come back
+#define KLINE_RX 5
+
+typedef struct {
+  uart_ring *ring; // NULL when the lines are raw serial
+  int mode;
+  int state;
+  uint32_t deadline;
+  uint32_t last_rx;
+
+  uint8_t tx[KLINE_MSG_MAX];
+  int tx_len;
+  int tx_pos;
+  int tx_staging; // more ep2 packets of the request are coming
+
+  uint8_t rx[KLINE_MSG_MAX];
+  int rx_len;
+  int responses;
+} kline_engine;
+
+kline_engine kline = { .ring = NULL };
+
+#define KLINE_DUE(ts, now) ((int32_t)((now) - (ts)) >= 0)
+
+// the TX pins, for driving the wakeup pattern
+void kline_tx_pin(uart_ring *q, int level) {
+  int pin = (q == &lin1_ring) ? 12 : 10;
+  if (level < 0) {
+    set_gpio_alternate(GPIOC, pin, (q == &lin1_ring) ? GPIO_AF8_UART5 : GPIO_AF7_USART3);
+  } else {
+    set_gpio_output(GPIOC, pin, level);
+  }
+}
+
+void kline_push_record(int status, const uint8_t *dat, int len) {
+  uart_ring *q = kline.ring;
+  int space = (q->r_ptr_rx - q->w_ptr_rx - 1 + FIFO_SIZE) % FIFO_SIZE;
+  // a record is never split
+  if (space < len + 3) return;
+
+  uint8_t hdr[3] = {status, len & 0xFF, len >> 8};
+  for (int i = 0; i < len + 3; i++) {
+    q->elems_rx[q->w_ptr_rx] = (i < 3) ? hdr[i] : dat[i - 3];
+    q->w_ptr_rx = (q->w_ptr_rx + 1) % FIFO_SIZE;
+  }
+  if (q->callback) q->callback(q);
+}
+
+uint8_t kline_checksum(const uint8_t *dat, int len) {
+  uint8_t sum = 0;
+  for (int i = 0; i < len; i++) sum += dat[i];
+  return (kline.mode & KLINE_MODE_NEG_CHECKSUM) ? -sum : sum;
+}
+
+// format byte, the addresses if there are any, the length byte if it's separate
+int kline_hdr_len(const uint8_t *dat) {
+  return ((dat[0] & 0x80) ? 3 : 1) + ((dat[0] & 0x3F) ? 0 : 1);
+}
+
+// full length of a message from its header, 0 until enough of it is in
+int kline_msg_len(const uint8_t *dat, int len) {
+  if (len < 1) return 0;
+  int hdr_len = kline_hdr_len(dat);
+  if (len < hdr_len) return 0;
+  int data_len = (dat[0] & 0x3F) ? (dat[0] & 0x3F) : dat[hdr_len - 1];
+  return hdr_len + data_len + 1;
+}
+
+void kline_arm() {
+  TIM2->CCR2 = kline.deadline;
+  TIM2->DIER |= TIM_DIER_CC2IE;
+}
+
+void kline_done(int status) {
+  if (status != KLINE_STATUS_OK) kline_push_record(status, kline.rx, kline.rx_len);
+  kline.state = KLINE_IDLE;
+  kline.rx_len = 0;
+  TIM2->DIER &= ~TIM_DIER_CC2IE;
+}
+
+// runs the state that timed out, until the next deadline is in the future
+void kline_service() {
+  enter_critical_section();
+  while (kline.ring != NULL && kline.state != KLINE_IDLE) {
+    if (!KLINE_DUE(kline.deadline, TIM2->CNT)) {
+      kline_arm();
+      // the compare only fires on a match, so go around again if it was missed
+      if (!KLINE_DUE(kline.deadline, TIM2->CNT)) break;
+    }
+    uint32_t now = TIM2->CNT;
+    switch (kline.state) {
+      case KLINE_WAKE_LOW:
+        kline_tx_pin(kline.ring, 1);
+        kline.state = KLINE_WAKE_HIGH;
+        kline.deadline = now + KLINE_WAKEUP_US;
+        break;
+      case KLINE_WAKE_HIGH:
+        kline_tx_pin(kline.ring, -1);
+        kline.state = KLINE_TX_GAP;
+        kline.deadline = now;
+        break;
+      case KLINE_TX_GAP:
+        putc(kline.ring, kline.tx[kline.tx_pos]);
+        kline.state = KLINE_TX_ECHO;
+        kline.deadline = now + KLINE_ECHO_US;
+        break;
+      case KLINE_TX_ECHO:
+        kline_done(KLINE_STATUS_ECHO);
+        break;
+      case KLINE_RX:
+        if (kline.rx_len > 0) {
+          kline_done(KLINE_STATUS_INCOMPLETE);
+        } else {
+          kline_done((kline.responses == 0) ? KLINE_STATUS_TIMEOUT : KLINE_STATUS_OK);
+        }
+        break;
+    }
+  }
+  exit_critical_section();
+}
+
+// from the UART IRQ
+int kline_rx(uart_ring *q, uint8_t c) {
+  if (kline.ring == NULL || q != kline.ring) return 0;
+
+  uint32_t now = TIM2->CNT;
+  kline.last_rx = now;
+  switch (kline.state) {
+    case KLINE_TX_ECHO:
+      if (c != kline.tx[kline.tx_pos]) {
+        kline_done(KLINE_STATUS_ECHO);
+        break;
+      }
+      kline.tx_pos++;
+      if (kline.tx_pos < kline.tx_len) {
+        kline.state = KLINE_TX_GAP;
+        kline.deadline = now + KLINE_P4_US;
+      } else {
+        kline.state = KLINE_RX;
+        kline.rx_len = 0;
+        kline.responses = 0;
+        kline.deadline = now + KLINE_P2_MAX_US;
+      }
+      kline_arm();
+      break;
+    case KLINE_RX: {
+      if (kline.rx_len < KLINE_MSG_MAX) kline.rx[kline.rx_len++] = c;
+      kline.deadline = now + KLINE_P1_MAX_US;
+
+      int len = kline_msg_len(kline.rx, kline.rx_len);
+      if (len > 0 && kline.rx_len >= len) {
+        int ok = kline_checksum(kline.rx, len - 1) == kline.rx[len - 1];
+        kline_push_record(ok ? KLINE_STATUS_OK : KLINE_STATUS_CHECKSUM, kline.rx, len - 1);
+        kline.responses++;
+
+        // a negative response with 0x78 means the real one is still coming
+        int hdr_len = kline_hdr_len(kline.rx);
+        int pending = ok && (len - 1 - hdr_len) == 3 && kline.rx[hdr_len] == 0x7F && kline.rx[hdr_len + 2] == 0x78;
+        kline.rx_len = 0;
+        kline.deadline = now + (pending ? KLINE_P2_EXT_US : KLINE_P2_MAX_US);
+      }
+      kline_arm();
+      break;
+    }
+    default:
+      // the wakeup pattern reads back as a break, nothing else is expected
+      break;
+  }
+  return 1;
+}
+
+// a request without the checksum, in ep2 packets. The first one waits out P3.
+void kline_send(uart_ring *q, const uint8_t *dat, int len, int more) {
+  enter_critical_section();
+  if (kline.ring != q || (kline.state != KLINE_IDLE && kline.state != KLINE_RX)) {
+    // not in message mode, or mid request
+    exit_critical_section();
+    return;
+  }
+
+  if (!kline.tx_staging) kline.tx_len = 0;
+  for (int i = 0; i < len && kline.tx_len < KLINE_MSG_MAX - 1; i++) kline.tx[kline.tx_len++] = dat[i];
+  kline.tx_staging = more;
+
+  if (!more && kline.tx_len > 0) {
+    kline.tx[kline.tx_len] = kline_checksum(kline.tx, kline.tx_len);
+    kline.tx_len++;
+    kline.tx_pos = 0;
+    kline.rx_len = 0;
+
+    uint32_t now = TIM2->CNT;
+    if (kline.mode & KLINE_MODE_FAST_INIT) {
+      kline.mode &= ~KLINE_MODE_FAST_INIT;
+      kline_tx_pin(q, 0);
+      kline.state = KLINE_WAKE_LOW;
+      kline.deadline = now + KLINE_WAKEUP_US;
+    } else {
+      kline.state = KLINE_TX_GAP;
+      kline.deadline = KLINE_DUE(kline.last_rx + KLINE_P3_MIN_US, now) ? now : kline.last_rx + KLINE_P3_MIN_US;
+    }
+    kline_arm();
+  }
+  exit_critical_section();
+  kline_service();
+}
+
+// mode 0 gives the line back to raw serial
+void kline_set_mode(uart_ring *q, int mode) {
+  enter_critical_section();
+  if (kline.ring != NULL) {
+    kline_tx_pin(kline.ring, -1);
+    TIM2->DIER &= ~TIM_DIER_CC2IE;
+  }
+  kline.ring = (mode & KLINE_MODE_MESSAGE) ? q : NULL;
+  kline.mode = mode;
+  kline.state = KLINE_IDLE;
+  kline.tx_staging = 0;
+  kline.rx_len = 0;
+  kline.last_rx = TIM2->CNT - KLINE_P3_MIN_US;
+  exit_critical_section();
+}
@@ -0,0 +1,117 @@
+// IRQs: none
+// What the last boot was doing when it ended, to look at after the reset. The
+// record is in the RAM the linker script keeps above the stack, postmortem_ram,
+// which the startup doesn't touch, so it lives through the resets that keep
+// the RAM powered: the firmware's own, the watchdog's and the reset pin's. A
+// power loss leaves it failing its checksum. The main loop updates it every
+// click and the health read before it clears the maxes, in a critical
+// section, so a reset from an IRQ never finds it half written. postmortem_init
+// takes what the last boot left and the reset flags that ended it, and starts
+// this boot's record, 0xd5 reads either.
+
+#define POSTMORTEM_MAGIC 0x504D0001U // version in the low byte
+#define POSTMORTEM_RAM_LEN 0x44      // see stm32_flash.ld
+
+typedef struct {
+  uint32_t magic;
+  uint32_t boot;         // since the RAM was last powered up, 1 for the first
+  uint32_t reset_flags;  // RCC->CSR, the reset that started the boot
+  uint32_t updates;
+  uint32_t uptime_lo;    // us, at the last update
+  uint32_t uptime_hi;
+  uint32_t rx_drop_cnt;  // all buses
+  uint32_t tx_drop_cnt;
+  uint32_t usb_pause_cnt;
+  uint32_t usb_nak_cnt;
+  uint32_t rx_q_hwm;     // the fullest queue's
+  uint32_t tx_q_hwm;
+  uint32_t irq_latency_max;   // us, over the whole boot
+  uint32_t main_loop_lag_max;
+  uint32_t cksum;
+} postmortem_record;
+
+extern postmortem_record postmortem_ram;
+
+// this boot's reset flags, and the copy of the last boot's record
+uint32_t postmortem_reset_flags = 0;
+int postmortem_last_valid = 0;
+postmortem_record postmortem_last;
+
+uint32_t postmortem_cksum(const postmortem_record *r) {
+  const uint32_t *w = (const uint32_t *)r;
+  uint32_t sum = 0;
+  for (unsigned int i = 0; i < (sizeof(*r) / 4) - 1; i++) sum = ((sum << 5) | (sum >> 27)) ^ w[i];
+  return ~sum;
+}
+
+int postmortem_valid(const postmortem_record *r) {
+  return (r->magic == POSTMORTEM_MAGIC) && (r->cksum == postmortem_cksum(r));
+}
+
+// at boot, before anything else reads RCC->CSR's flags
+void postmortem_init() {
+  COMPILE_TIME_ASSERT(sizeof(postmortem_record) <= POSTMORTEM_RAM_LEN)
+  postmortem_reset_flags = RCC->CSR & ~(RCC_CSR_LSION | RCC_CSR_LSIRDY | RCC_CSR_RMVF);
+  // cleared, or the next boot would see these too
+  RCC->CSR |= RCC_CSR_RMVF;
+
+  postmortem_record *r = &postmortem_ram;
+  postmortem_last_valid = postmortem_valid(r);
+  uint32_t boot = 1;
+  if (postmortem_last_valid) {
+    postmortem_last = *r;
+    boot = r->boot + 1;
+  }
+  memset(r, 0, sizeof(*r));
+  r->magic = POSTMORTEM_MAGIC;
+  r->boot = boot;
+  r->reset_flags = postmortem_reset_flags;
+  r->cksum = postmortem_cksum(r);
+}
+
+// lag is the main loop's worst since it was last cleared, the IRQ latency
+// is read here
+void postmortem_update(uint32_t lag) {
+  enter_critical_section();
+  postmortem_record *r = &postmortem_ram;
+  uint64_t uptime = timer_uptime_us();
+  r->updates += 1;
+  r->uptime_lo = uptime & 0xFFFFFFFF;
+  r->uptime_hi = uptime >> 32;
+
+  r->rx_drop_cnt = 0;
+  r->tx_drop_cnt = 0;
+  for (int i = 0; i < BUS_MAX; i++) {
+    r->rx_drop_cnt += can_stats[i].rx_drop_cnt;
+    r->tx_drop_cnt += can_stats[i].tx_drop_cnt;
+    r->rx_q_hwm = max(r->rx_q_hwm, can_rx_qs[i].hwm);
+    if (can_queues[i] != NULL) r->tx_q_hwm = max(r->tx_q_hwm, can_queues[i]->hwm);
+  }
+  r->usb_pause_cnt = usb_pause_cnt;
+  r->usb_nak_cnt = usb_nak_cnt;
+  r->irq_latency_max = max(r->irq_latency_max, tick_irq_latency_max);
+  r->main_loop_lag_max = max(r->main_loop_lag_max, lag);
+  r->cksum = postmortem_cksum(r);
+  exit_critical_section();
+}
+
+// the last boot's record if last, else this one's so far, without the magic
+// and checksum. It starts with whether there is one and this boot's reset
+// flags, what ended the last.
+int postmortem_get(uint8_t *out, int last) {
+  struct __attribute__((packed)) {
+    uint8_t valid;
+    uint8_t pad[3];
+    uint32_t reset_flags;
+    uint32_t rec[(sizeof(postmortem_record) / 4) - 2];
+  } *st = (void *)out;
+  COMPILE_TIME_ASSERT(sizeof(*st) <= MAX_RESP_LEN)
+  memset(st, 0, sizeof(*st));
+  const postmortem_record *r = last ? &postmortem_last : &postmortem_ram;
+  enter_critical_section();
+  st->valid = last ? postmortem_last_valid : postmortem_valid(r);
+  st->reset_flags = postmortem_reset_flags;
+  if (st->valid) memcpy(st->rec, &r->boot, sizeof(st->rec));
+  exit_critical_section();
+  return sizeof(*st);
+}
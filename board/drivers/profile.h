@@ -0,0 +1,83 @@
+// cycle counts of the IRQ handlers, the safety hooks and the critical
+// sections, from DWT->CYCCNT, read out with 0xf7
+//
+// Only built with PROFILE in config.h, otherwise the probes are empty. A
+// handler's count includes the time higher priority IRQs took from it, which
+// is what it costs the code it interrupted.
+
+#define PROFILE_CAN_RX 0
+#define PROFILE_PROCESS_CAN 1
+#define PROFILE_USB 2
+#define PROFILE_SAFETY_RX 3
+#define PROFILE_SAFETY_TX 4
+#define PROFILE_CRITICAL 5 // interrupts off, from the outermost enter to its exit
+#define PROFILE_USB_WRITE 6 // USB_WritePacket loading an IN FIFO
+#define PROFILE_LEN 7
+
+#ifdef PROFILE
+
+typedef struct {
+  uint32_t count;
+  uint32_t min;
+  uint32_t max;
+  uint64_t sum;
+} profile_stat;
+
+profile_stat profile_stats[PROFILE_LEN];
+uint32_t profile_critical_start = 0;
+
+void profile_clear() {
+  for (int i = 0; i < PROFILE_LEN; i++) {
+    profile_stats[i].count = 0;
+    profile_stats[i].min = 0xFFFFFFFF;
+    profile_stats[i].max = 0;
+    profile_stats[i].sum = 0;
+  }
+}
+
+void profile_init() {
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CYCCNT = 0;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+  profile_clear();
+}
+
+void profile_add(int n, uint32_t cycles) {
+  // PRIMASK directly, enter_critical_section would profile itself
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  profile_stat *s = &profile_stats[n];
+  s->count += 1;
+  s->sum += cycles;
+  if (cycles < s->min) s->min = cycles;
+  if (cycles > s->max) s->max = cycles;
+  __set_PRIMASK(primask);
+}
+
+// count, min, max and the 64 bit sum of one probe, as 5 words. The host
+// divides, there's no 64 bit division without libgcc.
+int profile_read(int n, uint8_t *out) {
+  if (n < 0 || n >= PROFILE_LEN) return 0;
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  profile_stat s = profile_stats[n];
+  __set_PRIMASK(primask);
+
+  uint32_t res[5] = {s.count, s.count ? s.min : 0, s.max, s.sum & 0xFFFFFFFF, s.sum >> 32};
+  memcpy(out, res, sizeof(res));
+  return sizeof(res);
+}
+
+#define PROFILE_BEGIN() uint32_t profile_start = DWT->CYCCNT
+#define PROFILE_END(n) profile_add(n, DWT->CYCCNT - profile_start)
+#define PROFILE_CRITICAL_BEGIN() profile_critical_start = DWT->CYCCNT
+#define PROFILE_CRITICAL_END() profile_add(PROFILE_CRITICAL, DWT->CYCCNT - profile_critical_start)
+
+#else
+
+#define PROFILE_BEGIN()
+#define PROFILE_END(n)
+#define PROFILE_CRITICAL_BEGIN()
+#define PROFILE_CRITICAL_END()
+
+#endif
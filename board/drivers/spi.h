@@ -1,6 +1,34 @@
 // IRQs: DMA2_Stream2, DMA2_Stream3, EXTI4
 
-#define SPI_BUF_SIZE 256
+// Every transfer starts with a 0x14 byte request header.
+// v1: {endpoint, 0, len, 0, data[0x10]}, the data is the control request for
+//     endpoint 0. The response is a u32 length and up to 0x40 bytes.
+// v2: spi_v2_header, then len payload bytes and their CRC-16. The response is
+//     {u16 len, SPI_VERSION_2, status}, len bytes and a CRC-16 of both. The
+//     master waits 50us after the header before clocking the payload.
+// Old firmware answers v2 requests in v1, so version tells the master which
+// one it is talking to.
+
+#define SPI_HEADER_LEN 0x14
+#define SPI_V1_MAX_RESP 0x40
+#define SPI_VERSION_2 2
+#define SPI_V2_MAX_LEN 0x400
+
+#define SPI_V2_OK 0
+#define SPI_V2_BAD_HEADER 1
+#define SPI_V2_BAD_CRC 2
+
+typedef struct __attribute__((packed)) {
+  uint8_t endpoint;
+  uint8_t version;   // SPI_VERSION_2, 0 in v1
+  uint16_t len;      // payload bytes after the header, without the CRC
+  uint8_t setup[8];  // control request for endpoint 0, where v1 has it
+  uint16_t max_resp; // most response bytes the master reads
+  uint16_t reserved[2];
+  uint16_t crc;      // CRC-16 of the header before it
+} spi_v2_header;
+
+#define SPI_BUF_SIZE (SPI_HEADER_LEN + SPI_V2_MAX_LEN + 2)
 uint8_t spi_buf[SPI_BUF_SIZE];
 int spi_buf_count = 0;
 int spi_total_count = 0;
@@ -21,13 +49,26 @@ void spi_init() {
   set_gpio_mode(GPIOB, 0, MODE_INPUT);
   set_gpio_pullup(GPIOB, 0, PULL_UP);
 
-  // setup interrupt on falling edge of SPI enable (on PA4)
+  // setup interrupt on both edges of SPI enable (on PA4)
   SYSCFG->EXTICR[2] = SYSCFG_EXTICR2_EXTI4_PA;
   EXTI->IMR = (1 << 4);
   EXTI->FTSR = (1 << 4);
+  EXTI->RTSR = (1 << 4);
   NVIC_EnableIRQ(EXTI4_IRQn);
 }
 
+// Between transfers the handshake line doubles as "data ready": it is held
+// low while spi_cb_data_ready(), and the ESP polls on its falling edge.
+// Released when the next transfer starts.
+void spi_data_ready() {
+  enter_critical_section();
+  // CS high, no transfer is using the handshake
+  if ((GPIOA->IDR & (1 << 4)) && spi_cb_data_ready()) {
+    set_gpio_output(GPIOB, 0, 0);
+  }
+  exit_critical_section();
+}
+
 void spi_tx_dma(void *addr, int len) {
   // disable DMA
   SPI1->CR2 &= ~SPI_CR2_TXDMAEN;
@@ -70,25 +111,84 @@ void spi_rx_dma(void *addr, int len) {
   SPI1->CR2 |= SPI_CR2_RXDMAEN;
 }
 
+// CRC-16/CCITT-FALSE
+uint16_t spi_crc16(const uint8_t *dat, int len) {
+  uint16_t crc = 0xFFFF;
+  for (int i = 0; i < len; i++) {
+    crc ^= dat[i] << 8;
+    for (int j = 0; j < 8; j++) {
+      crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+    }
+  }
+  return crc;
+}
+
 // ***************************** SPI IRQs *****************************
 
 // can't go on the stack cause it's DMAed
-uint8_t spi_tx_buf[0x44];
+uint8_t spi_tx_buf[4 + SPI_V2_MAX_LEN + 2];
+
+// the RX DMA is for a v2 payload, not a header
+int spi_rx_payload = 0;
+
+void spi_v2_respond(uint8_t status, int len) {
+  spi_tx_buf[0] = len & 0xFF;
+  spi_tx_buf[1] = len >> 8;
+  spi_tx_buf[2] = SPI_VERSION_2;
+  spi_tx_buf[3] = status;
+  uint16_t crc = spi_crc16(spi_tx_buf, 4 + len);
+  spi_tx_buf[4 + len] = crc & 0xFF;
+  spi_tx_buf[5 + len] = crc >> 8;
+  spi_tx_dma(spi_tx_buf, 4 + len + 2);
+}
+
+void spi_v2_rx(spi_v2_header *hdr) {
+  uint8_t *payload = spi_buf + SPI_HEADER_LEN;
+  if (hdr->len > 0) {
+    uint16_t crc = payload[hdr->len] | (payload[hdr->len + 1] << 8);
+    if (crc != spi_crc16(payload, hdr->len)) {
+      spi_v2_respond(SPI_V2_BAD_CRC, 0);
+      return;
+    }
+  }
+
+  int max_resp = (hdr->max_resp < SPI_V2_MAX_LEN) ? hdr->max_resp : SPI_V2_MAX_LEN;
+  uint8_t *dat = (hdr->endpoint == 0) ? hdr->setup : payload;
+  int resp_len = spi_cb_rx(hdr->endpoint, dat, hdr->len, spi_tx_buf+4, max_resp);
+  spi_v2_respond(SPI_V2_OK, resp_len);
+}
 
 // SPI RX
 void DMA2_Stream2_IRQHandler(void) {
+  // ack first, the stream may be started again below
+  DMA2->LIFCR = DMA_LIFCR_CTCIF2;
+
+  spi_v2_header *hdr = (spi_v2_header *)spi_buf;
+  if (hdr->version == SPI_VERSION_2) {
+    if (spi_rx_payload) {
+      spi_rx_payload = 0;
+      spi_v2_rx(hdr);
+    } else if (hdr->crc != spi_crc16(spi_buf, sizeof(spi_v2_header) - 2) || hdr->len > SPI_V2_MAX_LEN) {
+      spi_v2_respond(SPI_V2_BAD_HEADER, 0);
+    } else if (hdr->len > 0) {
+      // the payload and its CRC follow
+      spi_rx_payload = 1;
+      spi_rx_dma(spi_buf + SPI_HEADER_LEN, hdr->len + 2);
+    } else {
+      spi_v2_rx(hdr);
+    }
+    return;
+  }
+
   int *resp_len = (int*)spi_tx_buf;
-  memset(spi_tx_buf, 0xaa, 0x44);
-  *resp_len = spi_cb_rx(spi_buf, 0x14, spi_tx_buf+4);
+  memset(spi_tx_buf, 0xaa, 4 + SPI_V1_MAX_RESP);
+  *resp_len = spi_cb_rx(spi_buf[0], spi_buf+4, spi_buf[2], spi_tx_buf+4, SPI_V1_MAX_RESP);
   #ifdef DEBUG_SPI
     puts("SPI write: ");
     puth(*resp_len);
     puts("\n");
   #endif
   spi_tx_dma(spi_tx_buf, *resp_len + 4);
-
-  // ack
-  DMA2->LIFCR = DMA_LIFCR_CTCIF2;
 }
 
 // SPI TX
@@ -110,10 +210,18 @@ void EXTI4_IRQHandler(void) {
   #ifdef DEBUG_SPI
     puts("exti4\n");
   #endif
-  // SPI CS falling
   if (pr & (1 << 4)) {
-    spi_total_count = 0;
-    spi_rx_dma(spi_buf, 0x14);
+    if ((GPIOA->IDR & (1 << 4)) == 0) {
+      // SPI CS falling, drop data ready until the response is queued
+      set_gpio_mode(GPIOB, 0, MODE_INPUT);
+      set_gpio_pullup(GPIOB, 0, PULL_UP);
+      spi_total_count = 0;
+      spi_rx_payload = 0;
+      spi_rx_dma(spi_buf, SPI_HEADER_LEN);
+    } else {
+      // SPI CS rising, transfer done
+      spi_data_ready();
+    }
   }
   EXTI->PR = pr;
 }
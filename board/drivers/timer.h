@@ -5,3 +5,42 @@ void timer_init(TIM_TypeDef *TIM, int psc) {
   TIM->SR = 0;
 }
 
+// housekeeping tick on TIM2 compare 3, the main loop sleeps until it's set
+volatile int tick_pending = 0;
+uint32_t tick_due_ts = 0;
+
+// the tick runs far more often than TIM2 wraps, so it counts the wraps
+uint32_t timer_wraps = 0;
+uint32_t timer_last = 0;
+
+// worst time from the tick's compare to its IRQ, cleared by the health read
+uint32_t tick_irq_latency_max = 0;
+
+void tick_service() {
+  uint32_t now = TIM2->CNT;
+  uint32_t latency = now - TIM2->CCR3;
+  if (latency > tick_irq_latency_max) tick_irq_latency_max = latency;
+  if (now < timer_last) timer_wraps += 1;
+  timer_last = now;
+
+  tick_due_ts = TIM2->CCR3;
+  TIM2->CCR3 += TICK_US;
+  // late by a whole tick, don't wait for the counter to wrap
+  if ((int32_t)(TIM2->CCR3 - TIM2->CNT) <= 0) TIM2->CCR3 = TIM2->CNT + TICK_US;
+  tick_pending = 1;
+}
+
+void tick_init() {
+  TIM2->CCR3 = TIM2->CNT + TICK_US;
+  TIM2->SR = ~TIM_SR_CC3IF;
+  TIM2->DIER |= TIM_DIER_CC3IE;
+}
+
+uint64_t timer_uptime_us() {
+  enter_critical_section();
+  uint32_t now = TIM2->CNT;
+  // wrapped since the tick last looked
+  uint32_t wraps = timer_wraps + ((now < timer_last) ? 1 : 0);
+  exit_critical_section();
+  return ((uint64_t)wraps << 32) | now;
+}
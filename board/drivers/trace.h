@@ -0,0 +1,79 @@
+// binary trace log, fixed size records in a RAM ring, read out with 0xf5
+//
+// Unlike puts, a trace point never blocks, doesn't touch the debug ring and
+// costs a few stores, so it's left on in release builds and is safe from any
+// IRQ. Slots are claimed with LDREX/STREX, and a record's index is written
+// last, so the reader can tell a slot that's still being filled.
+
+// records kept, the oldest are overwritten. Power of two.
+#define TRACE_LEN 0x100
+
+// levels, lower is more important
+#define TRACE_ERROR 0
+#define TRACE_WARN 1
+#define TRACE_INFO 2
+#define TRACE_DEBUG 3
+
+// events, python/__init__.py has the names
+#define TRACE_BOOT 1             // arg1 = RCC->CSR, the reset flags
+#define TRACE_CAN_PUSH_FAILED 2  // arg0 = bus of the tx queue, 0xFFFF for rx, arg1 = RIR
+#define TRACE_CAN_SCE 3          // arg0 = bus, arg1 = ESR
+#define TRACE_CAN_TX_ERROR 4     // arg0 = bus, arg1 = TSR
+#define TRACE_CAN_ARB_LOST 5     // arg0 = bus, arg1 = TSR
+#define TRACE_CAN_INIT_FAILED 6  // arg0 = CAN number, arg1 = MSR
+#define TRACE_USB_RESET 7
+#define TRACE_USB_NO_HANDLER 8   // arg0 = bRequest
+#define TRACE_UART_OVERRUN 9     // arg0 = ring number
+
+typedef struct {
+  uint32_t idx; // records written before this one
+  uint32_t ts;  // TIM2
+  uint8_t event;
+  uint8_t level;
+  uint16_t arg0;
+  uint32_t arg1;
+} trace_record;
+
+volatile trace_record trace_buf[TRACE_LEN];
+volatile uint32_t trace_head = 0;
+int trace_level = TRACE_INFO;
+
+void trace(int level, int event, uint16_t arg0, uint32_t arg1) {
+  if (level > trace_level) return;
+
+  uint32_t idx;
+  do {
+    idx = __LDREXW(&trace_head);
+  } while (__STREXW(idx + 1, &trace_head));
+
+  volatile trace_record *r = &trace_buf[idx & (TRACE_LEN - 1)];
+  r->idx = ~idx;
+  r->ts = TIM2->CNT;
+  r->event = event;
+  r->level = level;
+  r->arg0 = arg0;
+  r->arg1 = arg1;
+  __DMB();
+  r->idx = idx;
+}
+
+// copies the records from index *from on that fit in len bytes, and moves
+// *from past them. Returns the bytes used.
+int trace_read(uint32_t *from, uint8_t *out, int len) {
+  uint32_t head = trace_head;
+  // the ones before head - TRACE_LEN are gone
+  if (head - *from > TRACE_LEN) *from = head - TRACE_LEN;
+
+  int pos = 0;
+  while (*from != head && pos + (int)sizeof(trace_record) <= len) {
+    volatile trace_record *r = &trace_buf[*from & (TRACE_LEN - 1)];
+    trace_record rec = *(trace_record *)r;
+    __DMB();
+    // still being written, or overwritten while copying
+    if (rec.idx != *from || r->idx != *from) break;
+    memcpy(out + pos, &rec, sizeof(rec));
+    pos += sizeof(rec);
+    *from += 1;
+  }
+  return pos;
+}
@@ -1,4 +1,5 @@
-// IRQs: USART1, USART2, USART3, UART5
+// IRQs: USART1, USART2, USART3, UART5, DMA1_Stream0, DMA1_Stream1, DMA1_Stream3,
+//       DMA1_Stream5, DMA1_Stream6, DMA1_Stream7, DMA2_Stream5, DMA2_Stream7
 
 // ***************************** serial port queues *****************************
 
@@ -6,25 +7,29 @@
 uart_ring esp_ring = { .w_ptr_tx = 0, .r_ptr_tx = 0,
                        .w_ptr_rx = 0, .r_ptr_rx = 0,
                        .uart = USART1,
-                       .callback = NULL};
+                       .callback = NULL,
+                       .dma_tx = DMA2_Stream7, .dma_rx = DMA2_Stream5};
 
 // lin1, K-LINE = UART5
 // lin2, L-LINE = USART3
 uart_ring lin1_ring = { .w_ptr_tx = 0, .r_ptr_tx = 0,
                         .w_ptr_rx = 0, .r_ptr_rx = 0,
                         .uart = UART5,
-                        .callback = NULL};
+                        .callback = NULL,
+                        .dma_tx = DMA1_Stream7, .dma_rx = DMA1_Stream0};
 uart_ring lin2_ring = { .w_ptr_tx = 0, .r_ptr_tx = 0,
                         .w_ptr_rx = 0, .r_ptr_rx = 0,
                         .uart = USART3,
-                        .callback = NULL};
+                        .callback = NULL,
+                        .dma_tx = DMA1_Stream3, .dma_rx = DMA1_Stream1};
 
 // debug = USART2
 void debug_ring_callback(uart_ring *ring);
 uart_ring debug_ring = { .w_ptr_tx = 0, .r_ptr_tx = 0,
                          .w_ptr_rx = 0, .r_ptr_rx = 0,
                          .uart = USART2,
-                         .callback = debug_ring_callback};
+                         .callback = debug_ring_callback,
+                         .dma_tx = DMA1_Stream6, .dma_rx = DMA1_Stream5};
 
 
 uart_ring *get_ring_by_number(int a) {
@@ -44,40 +49,83 @@ uart_ring *get_ring_by_number(int a) {
 
 // ***************************** serial port *****************************
 
+// the DMA streams of the rings are all on channel 4
+#define UART_DMA_CHANNEL DMA_SxCR_CHSEL_2
+
+// clears every flag of a stream, they're spread over LIFCR and HIFCR
+void uart_dma_clear(DMA_Stream_TypeDef *s) {
+  int n = (((uint32_t)s & 0xFF) - 0x10) / 0x18;
+  DMA_TypeDef *dma = (DMA_TypeDef *)((uint32_t)s & ~0xFFU);
+  uint32_t flags = 0x3DU << (((n & 1) * 6) + ((n & 2) * 8));
+  if (n < 4) {
+    dma->LIFCR = flags;
+  } else {
+    dma->HIFCR = flags;
+  }
+}
+
+void uart_rx_byte(uart_ring *q, uint8_t c) {
+  if (q->rx_hook) q->rx_hook(q, c);
+  if (kline_rx(q, c)) return;
+  uint16_t next_w_ptr = (q->w_ptr_rx + 1) % FIFO_SIZE;
+  if (next_w_ptr != q->r_ptr_rx) {
+    q->elems_rx[q->w_ptr_rx] = c;
+    q->w_ptr_rx = next_w_ptr;
+  }
+}
+
+// safe to poll with interrupts off, the DMA keeps going and this catches up with it
 void uart_ring_process(uart_ring *q) {
   enter_critical_section();
   // TODO: check if external serial is connected
+  if (!(q->uart->CR3 & USART_CR3_DMAT)) {
+    // not started, nowhere for the bytes to go
+    q->r_ptr_tx = q->w_ptr_tx;
+    exit_critical_section();
+    return;
+  }
   int sr = q->uart->SR;
 
-  if (q->w_ptr_tx != q->r_ptr_tx) {
-    if (sr & USART_SR_TXE) {
-      q->uart->DR = q->elems_tx[q->r_ptr_tx];
-      q->r_ptr_tx = (q->r_ptr_tx + 1) % FIFO_SIZE;
-    } else {
-      // push on interrupt later
-      q->uart->CR1 |= USART_CR1_TXEIE;
-    }
-  } else {
-    // nothing to send
-    q->uart->CR1 &= ~USART_CR1_TXEIE;
+  // the stream turns itself off at the end of a chunk
+  int sent = 0;
+  if (q->dma_tx_len != 0 && !(q->dma_tx->CR & DMA_SxCR_EN)) {
+    q->r_ptr_tx = (q->r_ptr_tx + q->dma_tx_len) % FIFO_SIZE;
+    q->dma_tx_len = 0;
+    sent = 1;
   }
 
-  if (sr & USART_SR_RXNE || sr & USART_SR_ORE) {
-    uint8_t c = q->uart->DR;  // TODO: can drop packets
-    if (q != &esp_ring) {
-      uint16_t next_w_ptr = (q->w_ptr_rx + 1) % FIFO_SIZE;
-      if (next_w_ptr != q->r_ptr_rx) {
-        q->elems_rx[q->w_ptr_rx] = c;
-        q->w_ptr_rx = next_w_ptr;
-        if (q->callback) q->callback(q);
-      }
-    }
+  if (q->dma_tx_len == 0 && q->w_ptr_tx != q->r_ptr_tx) {
+    // up to the write pointer or the end of the buffer, whichever is first
+    int len = ((q->w_ptr_tx > q->r_ptr_tx) ? q->w_ptr_tx : FIFO_SIZE) - q->r_ptr_tx;
+    uart_dma_clear(q->dma_tx);
+    q->dma_tx->M0AR = (uint32_t)&q->elems_tx[q->r_ptr_tx];
+    q->dma_tx->NDTR = len;
+    q->dma_tx_len = len;
+    q->dma_tx->CR |= DMA_SxCR_EN;
   }
 
+  // circular, so NDTR counts down to where the DMA will write next
+  uint16_t dma_w_ptr = (UART_DMA_RX_LEN - q->dma_rx->NDTR) % UART_DMA_RX_LEN;
+  uint16_t w_ptr_rx = q->w_ptr_rx;
+  while (q->r_ptr_dma_rx != dma_w_ptr) {
+    uart_rx_byte(q, q->elems_dma_rx[q->r_ptr_dma_rx]);
+    q->r_ptr_dma_rx = (q->r_ptr_dma_rx + 1) % UART_DMA_RX_LEN;
+  }
+  // once for everything the DMA had
+  if (q->w_ptr_rx != w_ptr_rx && q->callback) q->callback(q);
+
   if (sr & USART_SR_ORE) {
-    // set dropped packet flag?
+    int num = 0;
+    while (num < 4 && get_ring_by_number(num) != q) num++;
+    trace(TRACE_WARN, TRACE_UART_OVERRUN, num, 0);
+  }
+  if (sr & (USART_SR_IDLE | USART_SR_ORE)) {
+    // reading DR after SR clears them
+    (void)q->uart->DR;
   }
 
+  if (sent && q->tx_callback) q->tx_callback(q);
+
   exit_critical_section();
 }
 
@@ -88,6 +136,15 @@ void USART2_IRQHandler(void) { uart_ring_process(&debug_ring); }
 void USART3_IRQHandler(void) { uart_ring_process(&lin2_ring); }
 void UART5_IRQHandler(void) { uart_ring_process(&lin1_ring); }
 
+void DMA2_Stream5_IRQHandler(void) { uart_dma_clear(DMA2_Stream5); uart_ring_process(&esp_ring); }
+void DMA2_Stream7_IRQHandler(void) { uart_dma_clear(DMA2_Stream7); uart_ring_process(&esp_ring); }
+void DMA1_Stream5_IRQHandler(void) { uart_dma_clear(DMA1_Stream5); uart_ring_process(&debug_ring); }
+void DMA1_Stream6_IRQHandler(void) { uart_dma_clear(DMA1_Stream6); uart_ring_process(&debug_ring); }
+void DMA1_Stream1_IRQHandler(void) { uart_dma_clear(DMA1_Stream1); uart_ring_process(&lin2_ring); }
+void DMA1_Stream3_IRQHandler(void) { uart_dma_clear(DMA1_Stream3); uart_ring_process(&lin2_ring); }
+void DMA1_Stream0_IRQHandler(void) { uart_dma_clear(DMA1_Stream0); uart_ring_process(&lin1_ring); }
+void DMA1_Stream7_IRQHandler(void) { uart_dma_clear(DMA1_Stream7); uart_ring_process(&lin1_ring); }
+
 int getc(uart_ring *q, char *elem) {
   int ret = 0;
 
@@ -136,12 +193,37 @@ int putc(uart_ring *q, char elem) {
   return ret;
 }
 
+int uart_tx_space(uart_ring *q) {
+  return (q->r_ptr_tx - q->w_ptr_tx - 1 + FIFO_SIZE) % FIFO_SIZE;
+}
+
+// queues as much of dat as fits and returns how much that was
+int putn(uart_ring *q, const uint8_t *dat, int len) {
+  enter_critical_section();
+  int space = uart_tx_space(q);
+  if (len > space) len = space;
+  for (int i = 0; i < len; i++) {
+    q->elems_tx[q->w_ptr_tx] = dat[i];
+    q->w_ptr_tx = (q->w_ptr_tx + 1) % FIFO_SIZE;
+  }
+  exit_critical_section();
+
+  uart_ring_process(q);
+
+  return len;
+}
+
 void clear_uart_buff(uart_ring *q) {
   enter_critical_section();
+  // stop the chunk in flight, it points into elems_tx
+  q->dma_tx->CR &= ~DMA_SxCR_EN;
+  while (q->dma_tx->CR & DMA_SxCR_EN);
+  q->dma_tx_len = 0;
   q->w_ptr_tx = 0;
   q->r_ptr_tx = 0;
   q->w_ptr_rx = 0;
   q->r_ptr_rx = 0;
+  q->r_ptr_dma_rx = (UART_DMA_RX_LEN - q->dma_rx->NDTR) % UART_DMA_RX_LEN;
   exit_critical_section();
 }
 
@@ -161,52 +243,16 @@ void uart_set_baud(USART_TypeDef *u, int baud) {
   }
 }
 
-#define USART1_DMA_LEN 0x20
-char usart1_dma[USART1_DMA_LEN];
-
-void uart_dma_drain() {
-  uart_ring *q = &esp_ring;
-
-  enter_critical_section();
-
-  if (DMA2->HISR & DMA_HISR_TCIF5 || DMA2->HISR & DMA_HISR_HTIF5 || DMA2_Stream5->NDTR != USART1_DMA_LEN) {
-    // disable DMA
-    q->uart->CR3 &= ~USART_CR3_DMAR;
-    DMA2_Stream5->CR &= ~DMA_SxCR_EN;
-    while (DMA2_Stream5->CR & DMA_SxCR_EN);
-
-    int i;
-    for (i = 0; i < USART1_DMA_LEN - DMA2_Stream5->NDTR; i++) {
-      char c = usart1_dma[i];
-      uint16_t next_w_ptr = (q->w_ptr_rx + 1) % FIFO_SIZE;
-      if (next_w_ptr != q->r_ptr_rx) {
-        q->elems_rx[q->w_ptr_rx] = c;
-        q->w_ptr_rx = next_w_ptr;
-      }
-    }
-
-    // reset DMA len
-    DMA2_Stream5->NDTR = USART1_DMA_LEN;
-
-    // clear interrupts
-    DMA2->HIFCR = DMA_HIFCR_CTCIF5 | DMA_HIFCR_CHTIF5;
-    //DMA2->HIFCR = DMA_HIFCR_CTEIF5 | DMA_HIFCR_CDMEIF5 | DMA_HIFCR_CFEIF5;
-
-    // enable DMA
-    DMA2_Stream5->CR |= DMA_SxCR_EN;
-    q->uart->CR3 |= USART_CR3_DMAR;
+void uart_init(USART_TypeDef *u, int baud) {
+  uart_ring *q = &lin1_ring;
+  if (u == USART1) {
+    q = &esp_ring;
+  } else if (u == USART2) {
+    q = &debug_ring;
+  } else if (u == USART3) {
+    q = &lin2_ring;
   }
 
-  exit_critical_section();
-}
-
-void DMA2_Stream5_IRQHandler(void) {
-  //set_led(LED_BLUE, 1);
-  uart_dma_drain();
-  //set_led(LED_BLUE, 0);
-}
-
-void uart_init(USART_TypeDef *u, int baud) {
   // enable uart and tx+rx mode
   u->CR1 = USART_CR1_UE;
   uart_set_baud(u, baud);
@@ -216,30 +262,44 @@ void uart_init(USART_TypeDef *u, int baud) {
   //u->CR2 = USART_CR2_STOP_0;
   // ** UART is ready to work **
 
+  // rx, circular into elems_dma_rx, drained at half, full and when the line goes idle
+  q->dma_rx->CR = 0;
+  while (q->dma_rx->CR & DMA_SxCR_EN);
+  uart_dma_clear(q->dma_rx);
+  q->dma_rx->M0AR = (uint32_t)q->elems_dma_rx;
+  q->dma_rx->NDTR = UART_DMA_RX_LEN;
+  q->dma_rx->PAR = (uint32_t)&(u->DR);
+  q->r_ptr_dma_rx = 0;
+  q->dma_rx->CR = UART_DMA_CHANNEL | DMA_SxCR_MINC | DMA_SxCR_CIRC | DMA_SxCR_HTIE | DMA_SxCR_TCIE | DMA_SxCR_EN;
+
+  // tx, memory -> periph, started by uart_ring_process one chunk at a time
+  q->dma_tx->CR = 0;
+  while (q->dma_tx->CR & DMA_SxCR_EN);
+  uart_dma_clear(q->dma_tx);
+  q->dma_tx->PAR = (uint32_t)&(u->DR);
+  q->dma_tx_len = 0;
+  q->dma_tx->CR = UART_DMA_CHANNEL | DMA_SxCR_MINC | DMA_SxCR_DIR_0 | DMA_SxCR_TCIE;
+
+  u->CR3 = USART_CR3_DMAR | USART_CR3_DMAT;
+
   // enable interrupts
-  if (u != USART1) {
-    u->CR1 |= USART_CR1_RXNEIE;
-  }
+  u->CR1 |= USART_CR1_IDLEIE;
 
   if (u == USART1) {
-    // DMA2, stream 2, channel 3
-    DMA2_Stream5->M0AR = (uint32_t)usart1_dma;
-    DMA2_Stream5->NDTR = USART1_DMA_LEN;
-    DMA2_Stream5->PAR = (uint32_t)&(USART1->DR);
-
-    // channel4, increment memory, periph -> memory, enable
-    DMA2_Stream5->CR = DMA_SxCR_CHSEL_2 | DMA_SxCR_MINC | DMA_SxCR_HTIE | DMA_SxCR_TCIE | DMA_SxCR_EN;
-
-    // this one uses DMA receiver
-    u->CR3 = USART_CR3_DMAR;
-
     NVIC_EnableIRQ(DMA2_Stream5_IRQn);
+    NVIC_EnableIRQ(DMA2_Stream7_IRQn);
     NVIC_EnableIRQ(USART1_IRQn);
   } else if (u == USART2) {
+    NVIC_EnableIRQ(DMA1_Stream5_IRQn);
+    NVIC_EnableIRQ(DMA1_Stream6_IRQn);
     NVIC_EnableIRQ(USART2_IRQn);
   } else if (u == USART3) {
+    NVIC_EnableIRQ(DMA1_Stream1_IRQn);
+    NVIC_EnableIRQ(DMA1_Stream3_IRQn);
     NVIC_EnableIRQ(USART3_IRQn);
   } else if (u == UART5) {
+    NVIC_EnableIRQ(DMA1_Stream0_IRQn);
+    NVIC_EnableIRQ(DMA1_Stream7_IRQn);
     NVIC_EnableIRQ(UART5_IRQn);
   }
 }
@@ -97,12 +97,12 @@ uint8_t device_desc[] = {
 
 uint8_t configuration_desc[] = {
   DSCR_CONFIG_LEN, DSCR_CONFIG_TYPE, // Length, Type,
-  TOUSBORDER(0x0045), // Total Len (uint16)
+  TOUSBORDER(0x007F), // Total Len (uint16)
   0x01, 0x01, 0x00, // Num Interface, Config Value, Configuration
   0xc0, 0x32, // Attributes, Max Power
   // interface 0 ALT 0
   DSCR_INTERFACE_LEN, DSCR_INTERFACE_TYPE, // Length, Type
-  0x00, 0x00, 0x03, // Index, Alt Index idx, Endpoint count
+  0x00, 0x00, 0x04, // Index, Alt Index idx, Endpoint count
   0XFF, 0xFF, 0xFF, // Class, Subclass, Protocol
   0x00, // Interface
     // endpoint 1, read CAN
@@ -120,9 +120,14 @@ uint8_t configuration_desc[] = {
     ENDPOINT_SND | 3, ENDPOINT_TYPE_BULK, // Endpoint Num/Direction, Type
     TOUSBORDER(0x0040), // Max Packet (0x0040)
     0x00, // Polling Interval
+    // endpoint 2, read serial
+    DSCR_ENDPOINT_LEN, DSCR_ENDPOINT_TYPE, // Length, Type
+    ENDPOINT_RCV | 2, ENDPOINT_TYPE_BULK, // Endpoint Num/Direction, Type
+    TOUSBORDER(0x0040), // Max Packet (0x0040)
+    0x00, // Polling Interval
   // interface 0 ALT 1
   DSCR_INTERFACE_LEN, DSCR_INTERFACE_TYPE, // Length, Type
-  0x00, 0x01, 0x03, // Index, Alt Index idx, Endpoint count
+  0x00, 0x01, 0x04, // Index, Alt Index idx, Endpoint count
   0XFF, 0xFF, 0xFF, // Class, Subclass, Protocol
   0x00, // Interface
     // endpoint 1, read CAN
@@ -140,6 +145,41 @@ uint8_t configuration_desc[] = {
     ENDPOINT_SND | 3, ENDPOINT_TYPE_BULK, // Endpoint Num/Direction, Type
     TOUSBORDER(0x0040), // Max Packet (0x0040)
     0x00, // Polling Interval
+    // endpoint 2, read serial
+    DSCR_ENDPOINT_LEN, DSCR_ENDPOINT_TYPE, // Length, Type
+    ENDPOINT_RCV | 2, ENDPOINT_TYPE_BULK, // Endpoint Num/Direction, Type
+    TOUSBORDER(0x0040), // Max Packet (0x0040)
+    0x00, // Polling Interval
+  // interface 0 ALT 2, ALT 0 with bus 0's CAN tx on an endpoint of its own
+  DSCR_INTERFACE_LEN, DSCR_INTERFACE_TYPE, // Length, Type
+  0x00, 0x02, 0x05, // Index, Alt Index idx, Endpoint count
+  0XFF, 0xFF, 0xFF, // Class, Subclass, Protocol
+  0x00, // Interface
+    // endpoint 1, read CAN
+    DSCR_ENDPOINT_LEN, DSCR_ENDPOINT_TYPE, // Length, Type
+    ENDPOINT_RCV | 1, ENDPOINT_TYPE_BULK, // Endpoint Num/Direction, Type
+    TOUSBORDER(0x0040), // Max Packet (0x0040)
+    0x00, // Polling Interval (NA)
+    // endpoint 1, send CAN on bus 0
+    DSCR_ENDPOINT_LEN, DSCR_ENDPOINT_TYPE, // Length, Type
+    ENDPOINT_SND | 1, ENDPOINT_TYPE_BULK, // Endpoint Num/Direction, Type
+    TOUSBORDER(0x0040), // Max Packet (0x0040)
+    0x00, // Polling Interval
+    // endpoint 2, send serial
+    DSCR_ENDPOINT_LEN, DSCR_ENDPOINT_TYPE, // Length, Type
+    ENDPOINT_SND | 2, ENDPOINT_TYPE_BULK, // Endpoint Num/Direction, Type
+    TOUSBORDER(0x0040), // Max Packet (0x0040)
+    0x00, // Polling Interval
+    // endpoint 3, send CAN on the other buses
+    DSCR_ENDPOINT_LEN, DSCR_ENDPOINT_TYPE, // Length, Type
+    ENDPOINT_SND | 3, ENDPOINT_TYPE_BULK, // Endpoint Num/Direction, Type
+    TOUSBORDER(0x0040), // Max Packet (0x0040)
+    0x00, // Polling Interval
+    // endpoint 2, read serial
+    DSCR_ENDPOINT_LEN, DSCR_ENDPOINT_TYPE, // Length, Type
+    ENDPOINT_RCV | 2, ENDPOINT_TYPE_BULK, // Endpoint Num/Direction, Type
+    TOUSBORDER(0x0040), // Max Packet (0x0040)
+    0x00, // Polling Interval
 };
 
 uint8_t string_0_desc[] = {
@@ -207,6 +247,9 @@ uint8_t winusb_ext_prop_os_desc[] = {
 // current packet
 USB_Setup_TypeDef setup;
 uint8_t usbdata[0x100];
+// bulk EP1 is loaded a whole transfer at a time, as big as its TX FIFO
+#define USB_EP1_IN_LEN 0x2C0
+uint8_t ep1_indata[USB_EP1_IN_LEN];
 uint8_t* ep0_txdata = NULL;
 uint16_t ep0_txlen = 0;
 
@@ -232,6 +275,7 @@ void USB_WritePacket(const uint8_t *src, uint16_t len, uint32_t ep) {
   hexdump(src, len);
   #endif
 
+  PROFILE_BEGIN();
   uint8_t numpacket = (len+(MAX_RESP_LEN-1))/MAX_RESP_LEN;
   uint32_t count32b = 0, i = 0;
   count32b = (len + 3) / 4;
@@ -245,6 +289,7 @@ void USB_WritePacket(const uint8_t *src, uint16_t len, uint32_t ep) {
   for (i = 0; i < count32b; i++, src += 4) {
     USBx_DFIFO(ep) = *((__attribute__((__packed__)) uint32_t *)src);
   }
+  PROFILE_END(PROFILE_USB_WRITE);
 }
 
 // IN EP 0 TX FIFO has a max size of 127 bytes (much smaller than the rest)
@@ -267,10 +312,133 @@ void USB_WritePacket_EP0(uint8_t *src, uint16_t len) {
   }
 }
 
+// for the health packet: times ep2 or ep3 was held off, and OUT tokens ep3 NAKed
+uint32_t usb_pause_cnt = 0;
+uint32_t usb_nak_cnt = 0;
+
+// ep2 OUT is left NAKing after a packet while paused, so serial writes can't outrun the rings
+int ep2_paused = 0;
+
+void usb_ep2_pause() {
+  if (!ep2_paused) usb_pause_cnt += 1;
+  ep2_paused = 1;
+}
+
+void usb_ep2_resume() {
+  enter_critical_section();
+  if (ep2_paused) {
+    ep2_paused = 0;
+    USBx_OUTEP(2)->DOEPTSIZ = (1 << 19) | 0x40;
+    USBx_OUTEP(2)->DOEPCTL |= USB_OTG_DOEPCTL_EPENA | USB_OTG_DOEPCTL_CNAK;
+  }
+  exit_critical_section();
+}
+
+// ep3 OUT, the same while the CAN replay ring is full
+int ep3_paused = 0;
+
+void usb_ep3_pause() {
+  if (!ep3_paused) usb_pause_cnt += 1;
+  ep3_paused = 1;
+}
+
+void usb_ep3_resume() {
+  enter_critical_section();
+  if (ep3_paused) {
+    ep3_paused = 0;
+    USBx_OUTEP(3)->DOEPTSIZ = (1 << 19) | 0x40;
+    USBx_OUTEP(3)->DOEPCTL |= USB_OTG_DOEPCTL_EPENA | USB_OTG_DOEPCTL_CNAK;
+  }
+  exit_critical_section();
+}
+
+// Alt 2 gives bus 0's CAN tx an endpoint of its own, EP1 OUT, and leaves
+// EP3 OUT to the other buses. It's OUT only, all four endpoint numbers are
+// taken and the FIFO RAM is too. Instead of dropping what a full tx queue
+// can't take, the lane's endpoint NAKs after a packet while one of its
+// queues couldn't take another, and is let go as they drain, see
+// can_lane_check. A bus backed up then holds off its own lane only.
+#define USB_ALT_CAN_LANES 2
+
+// ep1 OUT, alt 2 only
+int ep1_out_paused = 0;
+
+void usb_ep1_out_pause() {
+  if (!ep1_out_paused) usb_pause_cnt += 1;
+  ep1_out_paused = 1;
+}
+
+void usb_ep1_out_resume() {
+  enter_critical_section();
+  if (ep1_out_paused) {
+    ep1_out_paused = 0;
+    USBx_OUTEP(1)->DOEPTSIZ = (1 << 19) | 0x40;
+    USBx_OUTEP(1)->DOEPCTL |= USB_OTG_DOEPCTL_EPENA | USB_OTG_DOEPCTL_CNAK;
+  }
+  exit_critical_section();
+}
+
+// SET_INTERFACE, EP1 OUT is only there in alt 2
+void usb_set_interface(int alt) {
+  current_int0_alt_setting = alt;
+  ep1_out_paused = 0;
+  if (alt == USB_ALT_CAN_LANES) {
+    USBx_OUTEP(1)->DOEPTSIZ = (1 << 19) | 0x40;
+    USBx_OUTEP(1)->DOEPCTL = (0x40 & USB_OTG_DOEPCTL_MPSIZ) | (2 << 18) |
+                             USB_OTG_DOEPCTL_SD0PID_SEVNFRM | USB_OTG_DOEPCTL_USBAEP;
+    USBx_OUTEP(1)->DOEPINT = 0xFF;
+    USBx_OUTEP(1)->DOEPCTL |= USB_OTG_DOEPCTL_EPENA | USB_OTG_DOEPCTL_CNAK;
+  } else {
+    USBx_OUTEP(1)->DOEPCTL = 0;
+  }
+}
+
+// Bulk EP1 IN is loaded when CAN rx is queued and the endpoint is idle, so
+// the host's next IN gets it straight from the FIFO. An IN that finds the
+// FIFO empty is still answered from the queues, with a ZLP if there's
+// nothing, hosts read EP1 without a timeout.
+int ep1_in_push = 0;
+
+void usb_ep1_in_kick() {
+  enter_critical_section();
+  if (ep1_in_push && current_int0_alt_setting != 1 && !(USBx_INEP(1)->DIEPCTL & USB_OTG_DIEPCTL_EPENA)) {
+    int len = usb_cb_ep1_in(ep1_indata, USB_EP1_IN_LEN, 1);
+    if (len > 0) USB_WritePacket(ep1_indata, len, 1);
+  }
+  exit_critical_section();
+}
+
+// bulk EP2 IN streams serial rx, a packet at a time as the rings fill
+int ep2_in_active = 0;
+int ep2_in_busy = 0;
+uint8_t ep2_indata[0x40];
+
+void usb_ep2_in_kick() {
+  enter_critical_section();
+  if (ep2_in_active && !ep2_in_busy) {
+    int len = usb_cb_ep2_in(ep2_indata, sizeof(ep2_indata), 1);
+    if (len > 0) {
+      ep2_in_busy = 1;
+      USBx_INEP(2)->DIEPINT = 0xFF;
+      USB_WritePacket(ep2_indata, len, 2);
+      // only unmasked while a packet is out, ITTXFE would fire on every NAKed IN otherwise
+      USBx_DEVICE->DAINTMSK |= 1 << 2;
+    }
+  }
+  exit_critical_section();
+}
+
 void usb_reset() {
+  trace(TRACE_INFO, TRACE_USB_RESET, 0, 0);
+  ep2_paused = 0;
+  ep3_paused = 0;
+  ep1_out_paused = 0;
+  ep1_in_push = 0;
+  ep2_in_active = 0;
+  ep2_in_busy = 0;
   // unmask endpoint interrupts, so many sets
   USBx_DEVICE->DAINT = 0xFFFFFFFF;
-  USBx_DEVICE->DAINTMSK = 0xFFFFFFFF;
+  USBx_DEVICE->DAINTMSK = 0xFFFFFFFF & ~(1 << 2);
   //USBx_DEVICE->DOEPMSK = (USB_OTG_DOEPMSK_STUPM | USB_OTG_DOEPMSK_XFRCM | USB_OTG_DOEPMSK_EPDM);
   //USBx_DEVICE->DIEPMSK = (USB_OTG_DIEPMSK_TOM | USB_OTG_DIEPMSK_XFRCM | USB_OTG_DIEPMSK_EPDM | USB_OTG_DIEPMSK_ITTXFEMSK);
   //USBx_DEVICE->DIEPMSK = (USB_OTG_DIEPMSK_TOM | USB_OTG_DIEPMSK_XFRCM | USB_OTG_DIEPMSK_EPDM);
@@ -294,7 +462,10 @@ void usb_reset() {
   USBx->DIEPTXF0_HNPTXFSIZ = (0x40 << 16) | 0x40;
 
   // EP1, massive
-  USBx->DIEPTXF[0] = (0x40 << 16) | 0x80;
+  USBx->DIEPTXF[0] = (0xB0 << 16) | 0x80;
+
+  // EP2, one packet, the rest of the 0x140 words
+  USBx->DIEPTXF[1] = (0x10 << 16) | 0x130;
 
   // flush TX fifo
   USBx->GRSTCTL = USB_OTG_GRSTCTL_TXFFLSH | USB_OTG_GRSTCTL_TXFNUM_4;
@@ -328,6 +499,13 @@ void usb_setup() {
                               USB_OTG_DIEPCTL_SD0PID_SEVNFRM | USB_OTG_DIEPCTL_USBAEP;
       USBx_INEP(1)->DIEPINT = 0xFF;
 
+      USBx_INEP(2)->DIEPCTL = (0x40 & USB_OTG_DIEPCTL_MPSIZ) | (2 << 18) | (2 << 22) |
+                              USB_OTG_DIEPCTL_SD0PID_SEVNFRM | USB_OTG_DIEPCTL_USBAEP;
+      USBx_INEP(2)->DIEPINT = 0xFF;
+      ep1_in_push = 1;
+      ep2_in_active = 1;
+      ep2_in_busy = 0;
+
       USBx_OUTEP(2)->DOEPTSIZ = (1 << 19) | 0x40;
       USBx_OUTEP(2)->DOEPCTL = (0x40 & USB_OTG_DOEPCTL_MPSIZ) | (2 << 18) |
                                USB_OTG_DOEPCTL_SD0PID_SEVNFRM | USB_OTG_DOEPCTL_USBAEP;
@@ -373,8 +551,8 @@ void usb_setup() {
           //puts("D");
           break;
         case USB_DESC_TYPE_CONFIGURATION:
-          USB_WritePacket(configuration_desc, min(sizeof(configuration_desc), setup.b.wLength.w), 0);
-          USBx_OUTEP(0)->DOEPCTL |= USB_OTG_DOEPCTL_CNAK;
+          // three alt settings are more than EP0's FIFO takes at once
+          USB_WritePacket_EP0(configuration_desc, min(sizeof(configuration_desc), setup.b.wLength.w));
           break;
         case USB_DESC_TYPE_STRING:
           switch (setup.b.wValue.bw.msb) {
@@ -434,7 +612,7 @@ void usb_setup() {
       break;
     case USB_REQ_SET_INTERFACE:
       // Store the alt setting number for IN EP behavior.
-      current_int0_alt_setting = setup.b.wValue.w;
+      usb_set_interface(setup.b.wValue.w);
       USB_WritePacket(0, 0, 0);
       USBx_OUTEP(0)->DOEPCTL |= USB_OTG_DOEPCTL_CNAK;
       break;
@@ -535,7 +713,7 @@ void usb_init() {
 
 // ***************************** USB port *****************************
 
-void usb_irqhandler(void) {
+RAMFUNC void usb_irqhandler(void) {
   //USBx->GINTMSK = 0;
 
   unsigned int gintsts = USBx->GINTSTS;
@@ -574,6 +752,10 @@ void usb_irqhandler(void) {
     puts("\n");
   }
 
+  if (gintsts & USB_OTG_GINTSTS_SOF) {
+    usb_cb_sof();
+  }
+
   if (gintsts & USB_OTG_GINTSTS_OTGINT) {
     puts("OTG int:");
     puth(USBx->GOTGINT);
@@ -609,6 +791,10 @@ void usb_irqhandler(void) {
         hexdump(&usbdata, len);
       #endif
 
+      if (endpoint == 1) {
+        usb_cb_ep1_out(usbdata, len, 1);
+      }
+
       if (endpoint == 2) {
         usb_cb_ep2_out(usbdata, len, 1);
       }
@@ -672,27 +858,41 @@ void usb_irqhandler(void) {
       puts(" OUT ENDPOINT\n");
     #endif
 
+    if (USBx_OUTEP(1)->DOEPINT & USB_OTG_DOEPINT_XFRC) {
+      if (!ep1_out_paused) {
+        USBx_OUTEP(1)->DOEPTSIZ = (1 << 19) | 0x40;
+        USBx_OUTEP(1)->DOEPCTL |= USB_OTG_DOEPCTL_EPENA | USB_OTG_DOEPCTL_CNAK;
+      }
+    }
+
     if (USBx_OUTEP(2)->DOEPINT & USB_OTG_DOEPINT_XFRC) {
       #ifdef DEBUG_USB
         puts("  OUT2 PACKET XFRC\n");
       #endif
-      USBx_OUTEP(2)->DOEPTSIZ = (1 << 19) | 0x40;
-      USBx_OUTEP(2)->DOEPCTL |= USB_OTG_DOEPCTL_EPENA | USB_OTG_DOEPCTL_CNAK;
+      if (!ep2_paused) {
+        USBx_OUTEP(2)->DOEPTSIZ = (1 << 19) | 0x40;
+        USBx_OUTEP(2)->DOEPCTL |= USB_OTG_DOEPCTL_EPENA | USB_OTG_DOEPCTL_CNAK;
+      }
     }
 
     if (USBx_OUTEP(3)->DOEPINT & USB_OTG_DOEPINT_XFRC) {
       #ifdef DEBUG_USB
         puts("  OUT3 PACKET XFRC\n");
       #endif
-      USBx_OUTEP(3)->DOEPTSIZ = (1 << 19) | 0x40;
-      USBx_OUTEP(3)->DOEPCTL |= USB_OTG_DOEPCTL_EPENA | USB_OTG_DOEPCTL_CNAK;
+      if (!ep3_paused) {
+        USBx_OUTEP(3)->DOEPTSIZ = (1 << 19) | 0x40;
+        USBx_OUTEP(3)->DOEPCTL |= USB_OTG_DOEPCTL_EPENA | USB_OTG_DOEPCTL_CNAK;
+      }
     } else if (USBx_OUTEP(3)->DOEPINT & 0x2000) {
       #ifdef DEBUG_USB
         puts("  OUT3 PACKET WTF\n");
       #endif
       // if NAK was set trigger this, unknown interrupt
-      USBx_OUTEP(3)->DOEPTSIZ = (1 << 19) | 0x40;
-      USBx_OUTEP(3)->DOEPCTL |= USB_OTG_DOEPCTL_CNAK;
+      usb_nak_cnt += 1;
+      if (!ep3_paused) {
+        USBx_OUTEP(3)->DOEPTSIZ = (1 << 19) | 0x40;
+        USBx_OUTEP(3)->DOEPCTL |= USB_OTG_DOEPCTL_CNAK;
+      }
     } else if (USBx_OUTEP(3)->DOEPINT) {
       puts("OUTEP3 error ");
       puth(USBx_OUTEP(3)->DOEPINT);
@@ -710,6 +910,7 @@ void usb_irqhandler(void) {
     }
 
     USBx_OUTEP(0)->DOEPINT = USBx_OUTEP(0)->DOEPINT;
+    USBx_OUTEP(1)->DOEPINT = USBx_OUTEP(1)->DOEPINT;
     USBx_OUTEP(2)->DOEPINT = USBx_OUTEP(2)->DOEPINT;
     USBx_OUTEP(3)->DOEPINT = USBx_OUTEP(3)->DOEPINT;
   }
@@ -731,7 +932,8 @@ void usb_irqhandler(void) {
     // Appears USB core automatically sets NAK. WritePacket clears it.
 
     // Handle the two interface alternate settings. Setting 0 is has
-    // EP1 as bulk. Setting 1 has EP1 as interrupt. The code to handle
+    // EP1 as bulk. Setting 1 has EP1 as interrupt. Setting 2's EP1 IN
+    // is setting 0's. The code to handle
     // these two EP variations are very similar and can be
     // restructured for smaller code footprint. Keeping split out for
     // now for clarity.
@@ -739,13 +941,16 @@ void usb_irqhandler(void) {
     //TODO add default case. Should it NAK?
     switch (current_int0_alt_setting) {
       case 0: ////// Bulk config
-        // *** IN token received when TxFIFO is empty
-        if (USBx_INEP(1)->DIEPINT & USB_OTG_DIEPMSK_ITTXFEMSK) {
+      case USB_ALT_CAN_LANES:
+        // *** IN token received when TxFIFO is empty, and usb_ep1_in_kick
+        // didn't load it since
+        if ((USBx_INEP(1)->DIEPINT & USB_OTG_DIEPMSK_ITTXFEMSK) &&
+            !(USBx_INEP(1)->DIEPCTL & USB_OTG_DIEPCTL_EPENA)) {
           #ifdef DEBUG_USB
           puts("  IN PACKET QUEUE\n");
           #endif
-          // TODO: always assuming max len, can we get the length?
-          USB_WritePacket((void *)resp, usb_cb_ep1_in(resp, 0x40, 1), 1);
+          // queue up to 11 packets, the host keeps reading until a short one
+          USB_WritePacket((void *)ep1_indata, usb_cb_ep1_in(ep1_indata, USB_EP1_IN_LEN, 1), 1);
         }
         break;
 
@@ -782,9 +987,18 @@ void usb_irqhandler(void) {
       }
     }
 
+    if (USBx_INEP(2)->DIEPINT & USB_OTG_DIEPINT_XFRC) {
+      USBx_INEP(2)->DIEPINT = 0xFF;
+      USBx_DEVICE->DAINTMSK &= ~(1 << 2);
+      ep2_in_busy = 0;
+      usb_ep2_in_kick();
+    }
+
     // clear interrupts
     USBx_INEP(0)->DIEPINT = USBx_INEP(0)->DIEPINT; // Why ep0?
     USBx_INEP(1)->DIEPINT = USBx_INEP(1)->DIEPINT;
+    // not XFRC, that's the packet usb_ep2_in_kick just queued
+    USBx_INEP(2)->DIEPINT = USBx_INEP(2)->DIEPINT & ~USB_OTG_DIEPINT_XFRC;
   }
 
   // clear all interrupts we handled
@@ -795,10 +1009,12 @@ void usb_irqhandler(void) {
   //USBx->GINTMSK = 0xFFFFFFFF & ~(USB_OTG_GINTMSK_NPTXFEM | USB_OTG_GINTMSK_PTXFEM | USB_OTG_GINTSTS_SOF | USB_OTG_GINTSTS_EOPF);
 }
 
-void OTG_FS_IRQHandler(void) {
+RAMFUNC void OTG_FS_IRQHandler(void) {
   NVIC_DisableIRQ(OTG_FS_IRQn);
   //__disable_irq();
+  PROFILE_BEGIN();
   usb_irqhandler();
+  PROFILE_END(PROFILE_USB);
   //__enable_irq();
   NVIC_EnableIRQ(OTG_FS_IRQn);
 }
@@ -0,0 +1,133 @@
+// IRQs: OTG_FS, and the ones that queue CAN rx
+// When EP1 IN hands the host the RX queues, set by 0xa3 for the USB session
+// and back to immediate at every enumeration. Immediate gives what's queued
+// at each IN, the lowest latency and mostly short packets. A fill holds the
+// frames until that many are queued and a deadline until the oldest has
+// waited that long, whichever comes first. A fill without a deadline holds
+// them at most USB_FLUSH_DEADLINE_MAX_US. SOF aligned gives at most one
+// transfer a frame, to the first IN after a SOF that finds it due, so the
+// host has one completion a ms.
+//
+// A held IN is answered with a ZLP, as an empty one is. While frames are
+// held the SOF IRQ is on and kicks EP1 every ms, so a deadline is up to a ms
+// late and pushed packets don't wait for the host's next IN. An RX queue
+// half full is always due, holding never drops frames.
+
+#define USB_FLUSH_DEADLINE_MAX_US 100000U
+
+// 0xa3's wValue, with the fill in the rest
+#define USB_FLUSH_SOF 0x8000U
+#define USB_FLUSH_FILL_MASK 0x7FFFU
+
+typedef struct {
+  uint16_t fill;        // frames, 0 for none
+  uint32_t deadline_us; // 0 for none
+  int sof;
+  int sof_open;         // a SOF came since the last transfer
+  int holding;          // the SOF IRQ is on
+  uint32_t transfers;   // with frames
+  uint32_t bytes;
+  uint32_t held;        // INs answered empty with frames queued
+  uint32_t age_max;     // most us the oldest frame waited for its transfer
+} usb_flush_state;
+
+usb_flush_state usb_flush;
+
+RAMFUNC void usb_flush_hold(int on) {
+  if (on == usb_flush.holding) return;
+  usb_flush.holding = on;
+  if (on) {
+    USBx->GINTMSK |= USB_OTG_GINTMSK_SOFM;
+  } else {
+    USBx->GINTMSK &= ~USB_OTG_GINTMSK_SOFM;
+  }
+}
+
+// frames queued for the host, the oldest one's us waiting and whether a
+// queue is half full
+RAMFUNC uint32_t usb_flush_pending(uint32_t now, uint32_t *age, int *urgent) {
+  uint32_t pending = 0;
+  for (int i = 0; i < CAN_RX_TURNS; i++) {
+    can_ring *q = can_rx_turn_q(i);
+    if (q == NULL) continue;
+    uint32_t used = can_ring_used(q);
+    if (used == 0) continue;
+    pending += used;
+    if (q->timestamps != NULL) *age = max(*age, now - q->timestamps[q->r_ptr]);
+    if (used * 2U >= q->fifo_size - 1U) *urgent = 1;
+  }
+  return pending;
+}
+
+// at each IN and kick, held is a frame popped and not yet given. 0 to answer
+// with nothing.
+RAMFUNC int usb_flush_due(int held) {
+  usb_flush_state *f = &usb_flush;
+  if (f->fill == 0 && f->deadline_us == 0 && !f->sof) return 1;
+  uint32_t age = 0;
+  int urgent = 0;
+  uint32_t pending = usb_flush_pending(TIM2->CNT, &age, &urgent) + held;
+  if (pending == 0) {
+    usb_flush_hold(0);
+    return 1;
+  }
+  uint32_t deadline = f->deadline_us;
+  if (deadline == 0 && f->fill != 0) deadline = USB_FLUSH_DEADLINE_MAX_US;
+  int due = urgent || (f->fill != 0 && pending >= f->fill) || (age >= deadline);
+  if (due && f->sof && !f->sof_open) due = 0;
+  if (!due) {
+    f->held += 1;
+    usb_flush_hold(1);
+    return 0;
+  }
+  f->sof_open = 0;
+  f->age_max = max(f->age_max, age);
+  usb_flush_hold(0);
+  return 1;
+}
+
+// the length of every transfer usb_flush_due let go
+RAMFUNC void usb_flush_sent(int len) {
+  if (len == 0) return;
+  usb_flush.transfers += 1;
+  usb_flush.bytes += len;
+}
+
+void usb_flush_sof() {
+  usb_flush.sof_open = 1;
+  usb_ep1_in_kick();
+}
+
+void usb_flush_set(uint16_t fill, int sof, uint32_t deadline_us) {
+  enter_critical_section();
+  usb_flush_hold(0);
+  memset(&usb_flush, 0, sizeof(usb_flush));
+  usb_flush.fill = fill;
+  usb_flush.sof = sof;
+  usb_flush.deadline_us = deadline_us;
+  exit_critical_section();
+  // what the old policy held
+  usb_ep1_in_kick();
+}
+
+int usb_flush_status(uint8_t *out) {
+  struct __attribute__((packed)) {
+    uint16_t fill;       // | USB_FLUSH_SOF
+    uint16_t reserved;
+    uint32_t deadline_us;
+    uint32_t transfers;
+    uint32_t bytes;
+    uint32_t held;
+    uint32_t age_max;
+  } *st = (void *)out;
+  enter_critical_section();
+  st->fill = usb_flush.fill | (usb_flush.sof ? USB_FLUSH_SOF : 0U);
+  st->reserved = 0;
+  st->deadline_us = usb_flush.deadline_us;
+  st->transfers = usb_flush.transfers;
+  st->bytes = usb_flush.bytes;
+  st->held = usb_flush.held;
+  st->age_max = usb_flush.age_max;
+  exit_critical_section();
+  return sizeof(*st);
+}
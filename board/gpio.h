@@ -105,6 +105,7 @@ void periph_init() {
   RCC->AHB1ENR |= RCC_AHB1ENR_GPIOCEN;
   RCC->AHB1ENR |= RCC_AHB1ENR_GPIODEN;
 
+  RCC->AHB1ENR |= RCC_AHB1ENR_DMA1EN;
   RCC->AHB1ENR |= RCC_AHB1ENR_DMA2EN;
   RCC->APB1ENR |= RCC_APB1ENR_USART2EN;
   RCC->APB1ENR |= RCC_APB1ENR_USART3EN;
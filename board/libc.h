@@ -5,39 +5,104 @@ void delay(int a) {
   for (i=0;i<a;i++);
 }
 
-void *memset(void *str, int c, unsigned int n) {
-  int i;
-  for (i = 0; i < n; i++) {
-    *((uint8_t*)str) = c;
-    ++str;
+// Hot IRQ code goes to RAM with .data, the startup copies it there, so it
+// doesn't take the flash wait states when the ART cache misses.
+#define RAMFUNC __attribute__((section(".ramfunc")))
+
+// Big buffers go in the F413's SRAM past the F205's 128K, which the startup
+// doesn't zero. On the F205 they stay in .bss.
+#ifdef STM32F4
+  #define HIGH_RAM __attribute__((section(".high_ram")))
+#else
+  #define HIGH_RAM
+#endif
+
+// These do a word at a time, four to a loop so gcc makes LDM/STM of them, when
+// the pointers allow it. The M3 and M4 do unaligned LDR/STR but not LDM/STM,
+// so pointers that are misaligned to each other go a byte at a time.
+// gcc would turn the loops back into calls to these, so that's off here.
+#define LIBC_FN __attribute__((optimize("no-tree-loop-distribute-patterns")))
+#define WORD_ALIGNED(p) (((uint32_t)(p) & 3) == 0)
+// whatever the bytes were stored as
+typedef uint32_t __attribute__((may_alias)) libc_word;
+
+LIBC_FN void *memset(void *str, int c, unsigned int n) {
+  uint8_t *d = str;
+  while (n > 0 && !WORD_ALIGNED(d)) {
+    *d++ = c;
+    n--;
+  }
+
+  uint32_t w = (uint8_t)c * 0x01010101U;
+  libc_word *dw = (libc_word *)d;
+  for (; n >= 16; n -= 16) {
+    dw[0] = w; dw[1] = w; dw[2] = w; dw[3] = w;
+    dw += 4;
+  }
+  for (; n >= 4; n -= 4) *dw++ = w;
+
+  d = (uint8_t *)dw;
+  while (n > 0) {
+    *d++ = c;
+    n--;
   }
   return str;
 }
 
-void *memcpy(void *dest, const void *src, unsigned int n) {
-  int i;
-  // TODO: make not slow
-  for (i = 0; i < n; i++) {
-    ((uint8_t*)dest)[i] = *(uint8_t*)src;
-    ++src;
+LIBC_FN void *memcpy(void *dest, const void *src, unsigned int n) {
+  uint8_t *d = dest;
+  const uint8_t *s = src;
+  if (((uint32_t)d & 3) == ((uint32_t)s & 3)) {
+    while (n > 0 && !WORD_ALIGNED(d)) {
+      *d++ = *s++;
+      n--;
+    }
+
+    libc_word *dw = (libc_word *)d;
+    const libc_word *sw = (const libc_word *)s;
+    for (; n >= 16; n -= 16) {
+      uint32_t a = sw[0], b = sw[1], e = sw[2], f = sw[3];
+      dw[0] = a; dw[1] = b; dw[2] = e; dw[3] = f;
+      dw += 4;
+      sw += 4;
+    }
+    for (; n >= 4; n -= 4) *dw++ = *sw++;
+    d = (uint8_t *)dw;
+    s = (const uint8_t *)sw;
+  }
+
+  while (n > 0) {
+    *d++ = *s++;
+    n--;
   }
   return dest;
 }
 
-int memcmp(const void * ptr1, const void * ptr2, unsigned int num) {
-  int i;
-  for (i = 0; i < num; i++) {
-    if ( ((uint8_t*)ptr1)[i] != ((uint8_t*)ptr2)[i] ) return -1;
+LIBC_FN int memcmp(const void * ptr1, const void * ptr2, unsigned int num) {
+  const uint8_t *a = ptr1;
+  const uint8_t *b = ptr2;
+  if (WORD_ALIGNED(a) && WORD_ALIGNED(b)) {
+    // words until one differs, the bytes sort out the rest
+    for (; num >= 4 && *(const libc_word *)a == *(const libc_word *)b; num -= 4) {
+      a += 4;
+      b += 4;
+    }
+  }
+  for (; num > 0; num--) {
+    if (*a++ != *b++) return -1;
   }
   return 0;
 }
 
 // ********************* IRQ helpers *********************
 
+#include "drivers/profile.h"
+
 int critical_depth = 0;
 void enter_critical_section() {
   __disable_irq();
   // this is safe because interrupts are disabled
+  if (critical_depth == 0) PROFILE_CRITICAL_BEGIN();
   critical_depth += 1;
 }
 
@@ -45,6 +110,7 @@ void exit_critical_section() {
   // this is safe because interrupts are disabled
   critical_depth -= 1;
   if (critical_depth == 0) {
+    PROFILE_CRITICAL_END();
     __enable_irq();
   }
 }
@@ -12,12 +12,33 @@
 #include "drivers/llgpio.h"
 #include "gpio.h"
 
+#include "drivers/trace.h"
 #include "drivers/uart.h"
 #include "drivers/adc.h"
 #include "drivers/usb.h"
 #include "drivers/can.h"
+#include "drivers/events.h"
+#include "drivers/can_periodic.h"
+#include "drivers/can_replay.h"
+#include "drivers/can_group.h"
+#include "drivers/can_compact.h"
+#include "drivers/can_coalesce.h"
+#include "drivers/usb_flush.h"
+#include "drivers/can_tx_defer.h"
+#include "drivers/can_census.h"
+#include "drivers/can_responder.h"
+#include "drivers/can_gateway.h"
+#include "drivers/ctrl_defer.h"
+#include "drivers/can_autobaud.h"
+#include "drivers/kline.h"
+#include "drivers/isotp.h"
 #include "drivers/spi.h"
 #include "drivers/timer.h"
+#include "drivers/postmortem.h"
+
+#ifdef BENCH
+  #include "drivers/bench.h"
+#endif
 
 
 // ***************************** fan *****************************
@@ -33,6 +54,40 @@ void fan_set_speed(int fan_speed) {
   TIM3->CCR3 = fan_speed;
 }
 
+// ***************************** red LED *****************************
+
+// on the panda it fades on TIM8 channel 4, 1 kHz PWM counted in us
+#define RED_LED_PERIOD 1000
+
+void red_led_init() {
+#ifdef PANDA
+  RCC->APB2ENR |= RCC_APB2ENR_TIM8EN;
+  // PWM mode 2, C9 is low (the LED on) for CCR4 us of every period
+  TIM8->PSC = 96-1;
+  TIM8->ARR = RED_LED_PERIOD-1;
+  TIM8->CCR4 = 0;
+  TIM8->CCMR2 = TIM_CCMR2_OC4M_2 | TIM_CCMR2_OC4M_1 | TIM_CCMR2_OC4M_0 | TIM_CCMR2_OC4PE;
+  TIM8->CCER = TIM_CCER_CC4E;
+  TIM8->BDTR = TIM_BDTR_MOE;
+  TIM8->EGR = TIM_EGR_UG;
+  TIM8->CR1 = TIM_CR1_ARPE | TIM_CR1_CEN;
+  set_gpio_alternate(GPIOC, 9, GPIO_AF3_TIM8);
+#endif
+}
+
+// called every tick, up and back down speed times a click
+int red_led_phase = 0;
+void red_led_fade(int speed) {
+  red_led_phase = (red_led_phase + (speed * 2 * RED_LED_PERIOD / TICKS_PER_CLICK)) % (2 * RED_LED_PERIOD);
+  int duty = (red_led_phase < RED_LED_PERIOD) ? red_led_phase : ((2 * RED_LED_PERIOD) - red_led_phase);
+#ifdef PANDA
+  TIM8->CCR4 = duty;
+#else
+  // B10 has no timer free to fade it, blink instead
+  set_led(LED_RED, duty >= (RED_LED_PERIOD / 2));
+#endif
+}
+
 // ********************* serial debugging *********************
 
 void debug_ring_callback(uart_ring *ring) {
@@ -69,7 +124,39 @@ void debug_ring_callback(uart_ring *ring) {
 
 // ***************************** USB port *****************************
 
-int get_health_pkt(void *dat) {
+// bumped when fields are added to the end of the health packet, the first 13
+// bytes are what old hosts read and never change
+#define HEALTH_VERSION 1
+
+// bit of the 0xd2 wValue that restarts the window below, plain reads leave it
+// alone so several readers don't steal each other's maxes
+#define HEALTH_RESET 1
+
+// time the main loop spent in WFI, and where the window it's counted over
+// started. Both restart on a HEALTH_RESET read, like the maxes.
+uint32_t idle_us = 0;
+uint32_t health_window_ts = 0;
+uint32_t main_loop_lag_max = 0;
+
+// with no resets the window keeps growing, past this it's halved along with
+// the idle time to stay clear of the 32 bit wrap
+#define HEALTH_WINDOW_MAX_US (30U * 60U * 1000000U)
+
+void health_window_age(void) {
+  enter_critical_section();
+  uint32_t len = TIM2->CNT - health_window_ts;
+  if (len > HEALTH_WINDOW_MAX_US) {
+    health_window_ts += len / 2U;
+    idle_us /= 2U;
+  }
+  exit_critical_section();
+}
+
+uint16_t health_sat16(uint32_t x) {
+  return min(x, 0xFFFF);
+}
+
+int get_health_pkt(void *dat, int reset) {
   struct __attribute__((packed)) {
     uint32_t voltage;
     uint32_t current;
@@ -78,7 +165,24 @@ int get_health_pkt(void *dat) {
     uint8_t gas_interceptor_detected;
     uint8_t started_signal_detected;
     uint8_t started_alt;
+    // HEALTH_VERSION 1
+    uint8_t version;
+    uint32_t uptime_lo; // us
+    uint32_t uptime_hi;
+    uint16_t rx_q_depth; // all RX queues
+    uint16_t rx_q_hwm;   // the fullest one's
+    uint16_t tx_q_depth[4];
+    uint16_t tx_q_hwm[4];
+    uint32_t rx_drop_cnt; // all buses
+    uint32_t tx_drop_cnt;
+    uint32_t usb_pause_cnt;
+    uint32_t usb_nak_cnt;
+    // since the last HEALTH_RESET read, in us and saturating
+    uint16_t main_loop_lag_max;
+    uint16_t irq_latency_max;
+    uint16_t idle; // per mille
   } *health = dat;
+  COMPILE_TIME_ASSERT(sizeof(*health) <= MAX_RESP_LEN)
 
   //Voltage will be measured in mv. 5000 = 5V
   uint32_t voltage = adc_get(ADCCHAN_VOLTAGE);
@@ -110,56 +214,403 @@ int get_health_pkt(void *dat) {
   health->started = (GPIOC->IDR & (1 << 13)) != 0;
 #endif
 
-  health->controls_allowed = controls_allowed;
-  health->gas_interceptor_detected = gas_interceptor_detected;
+  health->controls_allowed = safety.controls_allowed;
+  health->gas_interceptor_detected = safety.honda.gas_interceptor_detected;
 
   // DEPRECATED
   health->started_alt = 0;
   health->started_signal_detected = 0;
 
+  health->version = HEALTH_VERSION;
+  uint64_t uptime = timer_uptime_us();
+  health->uptime_lo = uptime & 0xFFFFFFFF;
+  health->uptime_hi = uptime >> 32;
+
+  health->rx_q_depth = 0;
+  health->rx_q_hwm = 0;
+  for (int i = 0; i < BUS_MAX; i++) {
+    health->rx_q_depth += can_ring_used(&can_rx_qs[i]);
+    health->rx_q_hwm = max(health->rx_q_hwm, can_rx_qs[i].hwm);
+  }
+  for (int i = 0; i < 4; i++) {
+    can_ring *q = (i < BUS_MAX) ? can_queues[i] : NULL;
+    health->tx_q_depth[i] = (q != NULL) ? can_ring_used(q) : 0;
+    health->tx_q_hwm[i] = (q != NULL) ? q->hwm : 0;
+  }
+
+  health->rx_drop_cnt = 0;
+  health->tx_drop_cnt = 0;
+  for (int i = 0; i < BUS_MAX; i++) {
+    health->rx_drop_cnt += can_stats[i].rx_drop_cnt;
+    health->tx_drop_cnt += can_stats[i].tx_drop_cnt;
+  }
+  health->usb_pause_cnt = usb_pause_cnt;
+  health->usb_nak_cnt = usb_nak_cnt;
+
+  // idle per mille without 64 bit math
+  enter_critical_section();
+  uint32_t ts = TIM2->CNT;
+  uint32_t window_ms = (ts - health_window_ts) / 1000;
+  health->idle = (window_ms > 0) ? min(idle_us / window_ms, 1000) : 0;
+  health->main_loop_lag_max = health_sat16(main_loop_lag_max);
+  health->irq_latency_max = health_sat16(tick_irq_latency_max);
+  postmortem_update(main_loop_lag_max);
+  if (reset) {
+    idle_us = 0;
+    main_loop_lag_max = 0;
+    tick_irq_latency_max = 0;
+    health_window_ts = ts;
+  }
+  exit_critical_section();
+
   return sizeof(*health);
 }
 
-int usb_cb_ep1_in(uint8_t *usbdata, int len, int hardwired) {
-  CAN_FIFOMailBox_TypeDef *reply = (CAN_FIFOMailBox_TypeDef *)usbdata;
+// set by the host, only over USB
+int can_usb_timestamps = 0;
+int can_usb_rx_format = CAN_FORMAT_CLASSIC;
+int can_usb_tx_format = CAN_FORMAT_CLASSIC;
+
+int get_can_stats_pkt(int bus_number, void *dat) {
+  struct __attribute__((packed)) {
+    uint32_t rx_cnt;
+    uint32_t tx_cnt;
+    uint32_t txd_cnt;
+    uint32_t rx_drop_cnt;
+    uint32_t tx_drop_cnt;
+    uint32_t err_cnt;
+    uint32_t rx_q_hwm;
+    uint32_t tx_q_hwm;
+    uint16_t load; // per mille since the last read
+    uint8_t tec;
+    uint8_t rec;
+    uint8_t lec;
+    uint8_t bus_off;
+    uint32_t rx_suppressed_cnt;
+    uint32_t tx_fail_cnt;
+    uint32_t tx_arb_lost_cnt;
+    uint32_t tx_err_cnt;
+  } *stats = dat;
+  can_bus_stats *s = &can_stats[bus_number];
+
+  stats->rx_cnt = s->rx_cnt;
+  stats->tx_cnt = s->tx_cnt;
+  stats->txd_cnt = s->txd_cnt;
+  stats->rx_drop_cnt = s->rx_drop_cnt;
+  stats->tx_drop_cnt = s->tx_drop_cnt;
+  stats->err_cnt = s->err_cnt;
+  stats->rx_q_hwm = can_rx_qs[bus_number].hwm;
+  stats->tx_q_hwm = can_queues[bus_number]->hwm;
+
+  // bits seen against what the bus could carry, in ms * kbps, no 64 bit math
+  uint32_t ts = TIM2->CNT;
+  uint32_t capacity = ((ts - s->load_ts) / 1000) * (can_speed[bus_number] / 10);
+  uint32_t bits = s->bits - s->load_bits;
+  stats->load = (capacity >= 1000) ? min(bits / (capacity / 1000), 1000) : 0;
+  s->load_ts = ts;
+  s->load_bits = s->bits;
+
+  // live error counters, or the last ones seen if the bus isn't mapped
+  uint8_t can_number = CAN_NUM_FROM_BUS_NUM(bus_number);
+  uint32_t esr = (can_number != 0xff) ? CANIF_FROM_CAN_NUM(can_number)->ESR : s->esr;
+  stats->tec = (esr & CAN_ESR_TEC) >> 16;
+  stats->rec = (esr & CAN_ESR_REC) >> 24;
+  stats->lec = (esr & CAN_ESR_LEC) >> 4;
+  stats->bus_off = (esr & CAN_ESR_BOFF) != 0;
+  stats->rx_suppressed_cnt = s->rx_suppressed_cnt;
+  stats->tx_fail_cnt = s->tx_fail_cnt;
+  stats->tx_arb_lost_cnt = s->tx_arb_lost_cnt;
+  stats->tx_err_cnt = s->tx_err_cnt;
+
+  return sizeof(*stats);
+}
+
+// fill one 0x40 packet from the RX queues, returns its length
+int can_fill_packet(uint8_t *pkt, int timestamps) {
   int ilen = 0;
-  while (ilen < min(len/0x10, 4) && can_pop(&can_rx_q, &reply[ilen])) ilen++;
+  if (timestamps) {
+    // a short packet ends the host transfer, so pad full packets to 0x40
+    can_ts_record *reply = (can_ts_record *)pkt;
+    CAN_FIFOMailBox_TypeDef msg;
+    uint32_t ts;
+    while (ilen < 0x40/sizeof(can_ts_record) && can_rx_pop_ts(&msg, &ts)) {
+      reply[ilen].RIR = msg.RIR;
+      reply[ilen].RDTR = msg.RDTR;
+      reply[ilen].RDLR = msg.RDLR;
+      reply[ilen].RDHR = msg.RDHR;
+      reply[ilen].timestamp = ts;
+      ilen++;
+    }
+    if (ilen == 0x40/sizeof(can_ts_record)) {
+      memset(&reply[ilen], 0, 0x40 - ilen*sizeof(can_ts_record));
+      return 0x40;
+    }
+    return ilen*sizeof(can_ts_record);
+  }
+
+  CAN_FIFOMailBox_TypeDef *reply = (CAN_FIFOMailBox_TypeDef *)pkt;
+  while (ilen < 4 && can_rx_pop_ts(&reply[ilen], NULL)) ilen++;
   return ilen*0x10;
 }
 
+// a frame popped for a compact packet it didn't fit in, it starts the next one
+int can_compact_held = 0;
+CAN_FIFOMailBox_TypeDef can_compact_msg;
+uint32_t can_compact_ts;
+
+// fill one 0x40 packet with compact records, returns its length
+int can_fill_packet_compact(uint8_t *pkt) {
+  int pos = 0;
+  uint32_t ts_base = 0;
+  while (pos < 0x40) {
+    if (!can_compact_held) {
+      if (!can_rx_pop_ts(&can_compact_msg, &can_compact_ts)) return pos;
+      can_compact_held = 1;
+    }
+    int wide = (pos == 0) || can_compact_wide(can_compact_ts, ts_base);
+    int rec_len = can_compact_rx_len(&can_compact_msg, wide);
+    if (rec_len == 0) {
+      can_compact_held = 0;
+      continue;
+    }
+    if (pos + rec_len > 0x40) {
+      // a short packet would end the host transfer
+      memset(pkt + pos, 0xFF, 0x40 - pos);
+      return 0x40;
+    }
+    if (pos == 0) ts_base = can_compact_ts;
+    pos += can_compact_rx_put(pkt + pos, &can_compact_msg, can_compact_ts, ts_base, wide);
+    can_compact_held = 0;
+  }
+  return pos;
+}
+
+// len can span many packets, filling stops at the first short one
+int usb_cb_ep1_in(uint8_t *usbdata, int len, int hardwired) {
+  int timestamps = hardwired && can_usb_timestamps;
+  int compact = hardwired && (can_usb_rx_format == CAN_FORMAT_COMPACT);
+  if (hardwired && !usb_flush_due(compact && can_compact_held)) return 0;
+  int pos = 0;
+  while (pos + 0x40 <= len) {
+    int pkt_len = compact ? can_fill_packet_compact(usbdata + pos) : can_fill_packet(usbdata + pos, timestamps);
+    pos += pkt_len;
+    if (pkt_len < 0x40) break;
+  }
+  if (hardwired) usb_flush_sent(pos);
+  return pos;
+}
+
+// rx of the rings set by 0xf4 goes out on ep2 IN instead of waiting for 0xe0
+int serial_stream_mask = 0;
+int serial_stream_next = 1;
+
+// a ring number then up to 0x3F bytes of its rx, taking the rings in turn
+int serial_stream_in(uint8_t *usbdata, int len) {
+  for (int i = 0; i < 3; i++) {
+    int num = serial_stream_next;
+    serial_stream_next = (num == 3) ? 1 : (num + 1);
+    if (!(serial_stream_mask & (1 << num))) continue;
+
+    uart_ring *ur = get_ring_by_number(num);
+    int pos = 1;
+    while ((pos < len) && getc(ur, (char*)&usbdata[pos])) ++pos;
+    if (pos > 1) {
+      usbdata[0] = num;
+      return pos;
+    }
+  }
+  return 0;
+}
+
+// the streamed rings and the ISO-TP channels take turns
+int ep2_in_isotp_turn = 0;
+
+int usb_cb_ep2_in(uint8_t *usbdata, int len, int hardwired) {
+  ep2_in_isotp_turn = !ep2_in_isotp_turn;
+  int pos = ep2_in_isotp_turn ? isotp_ep2_in(usbdata, len) : serial_stream_in(usbdata, len);
+  if (pos == 0) pos = ep2_in_isotp_turn ? serial_stream_in(usbdata, len) : isotp_ep2_in(usbdata, len);
+  return pos;
+}
+
+// callback of the streamed rings
+void serial_stream_ready(uart_ring *ring) {
+  usb_ep2_in_kick();
+}
+
+// the rest of an ep2 packet that didn't fit in its ring, the host is NAKed until it does
+uint8_t ep2_pending[0x40];
+int ep2_pending_pos = 0;
+int ep2_pending_len = 0;
+
+// tx_callback of the ring ep2 is waiting on
+void ep2_retry(uart_ring *q) {
+  ep2_pending_pos += putn(q, ep2_pending + ep2_pending_pos, ep2_pending_len - ep2_pending_pos);
+  if (ep2_pending_pos == ep2_pending_len) {
+    ep2_pending_len = 0;
+    q->tx_callback = NULL;
+    usb_ep2_resume();
+  }
+}
+
 // send on serial, first byte to select the ring
 void usb_cb_ep2_out(uint8_t *usbdata, int len, int hardwired) {
   if (len == 0) return;
+  if ((usbdata[0] & (KLINE_MSG_FLAG | ISOTP_MSG_FLAG)) == (KLINE_MSG_FLAG | ISOTP_MSG_FLAG)) {
+    isotp_send(usbdata[0] & 0x1F, usbdata+1, len-1, usbdata[0] & KLINE_MSG_MORE);
+    return;
+  }
+  if (usbdata[0] & KLINE_MSG_FLAG) {
+    int num = usbdata[0] & 0x3F;
+    uart_ring *ur = get_ring_by_number(num);
+    if ((ur == &lin1_ring || ur == &lin2_ring) && safety_tx_lin_hook(num-2, usbdata+1, len-1)) {
+      kline_send(ur, usbdata+1, len-1, usbdata[0] & KLINE_MSG_MORE);
+    }
+    return;
+  }
   uart_ring *ur = get_ring_by_number(usbdata[0]);
   if (!ur) return;
   if ((usbdata[0] < 2) || safety_tx_lin_hook(usbdata[0]-2, usbdata+1, len-1)) {
-    for (int i = 1; i < len; i++) while (!putc(ur, usbdata[i]));
+    enter_critical_section();
+    int sent = putn(ur, usbdata+1, len-1);
+    // the SPI can't be held off, so what doesn't fit from the ESP is dropped
+    if (sent < len-1 && hardwired) {
+      memcpy(ep2_pending, usbdata+1+sent, len-1-sent);
+      ep2_pending_pos = 0;
+      ep2_pending_len = len-1-sent;
+      ur->tx_callback = ep2_retry;
+      usb_ep2_pause();
+    }
+    exit_critical_section();
+  }
+}
+
+// the TIM2 time of a time record, for the frame after it, which can be in the next packet
+uint32_t ep3_send_at = 0;
+int ep3_send_at_pending = 0;
+
+// the token of the next frame ep3 takes for each bus, counting those dropped
+// too, so the host numbers its frames the same way. Read with 0xcf.
+uint16_t ep3_token_next[BUS_MAX];
+
+void ep3_send(CAN_FIFOMailBox_TypeDef *to_push) {
+  uint8_t bus_number = (to_push->RDTR >> 4) & CAN_BUS_NUM_MASK;
+  uint32_t token = 0;
+  if (bus_number < BUS_MAX) {
+    token = CAN_TX_TOKEN | ((ep3_token_next[bus_number] & CAN_TX_TOKEN_MASK) << CAN_TX_TOKEN_SHIFT);
+    ep3_token_next[bus_number] += 1;
+  }
+  if (can_group_add(to_push, bus_number, token)) return;
+  if (ep3_send_at_pending) {
+    ep3_send_at_pending = 0;
+    // the safety hook runs when it's sent
+    if (bus_number >= BUS_MAX || !can_schedule(to_push, bus_number, token, ep3_send_at)) {
+      if (bus_number < BUS_MAX) can_stats[bus_number].tx_drop_cnt += 1;
+    }
+  } else {
+    can_send_token(to_push, bus_number, token);
   }
 }
 
 // send on CAN
-void usb_cb_ep3_out(uint8_t *usbdata, int len, int hardwired) {
+void usb_can_tx(uint8_t *usbdata, int len, int hardwired) {
+  CAN_FIFOMailBox_TypeDef to_push;
+  if (hardwired && (can_usb_tx_format == CAN_FORMAT_COMPACT)) {
+    int pos = 0;
+    while (pos < len) {
+      int ctrl;
+      uint32_t ts;
+      int rec_len = can_compact_tx_get(usbdata + pos, len - pos, &to_push, &ts, &ctrl);
+      if (rec_len == 0) break;
+      pos += rec_len;
+      if (ctrl) {
+        can_tx_ctrl(ctrl, ts, &ep3_send_at, &ep3_send_at_pending);
+      } else {
+        ep3_send(&to_push);
+      }
+    }
+    return;
+  }
+
   int dpkt = 0;
   for (dpkt = 0; dpkt < len; dpkt += 0x10) {
     uint32_t *tf = (uint32_t*)(&usbdata[dpkt]);
 
+    // TXRQ clear, a control record of the kind in RDTR, see can_group.h.
+    // 0 has the next frame go at the time in RDLR.
+    if ((tf[0] & 1) == 0) {
+      if (tf[1] < CAN_TX_CTRL_MAX) can_tx_ctrl(CAN_TX_CTRL_TIME + tf[1], tf[2], &ep3_send_at, &ep3_send_at_pending);
+      continue;
+    }
+
     // make a copy
-    CAN_FIFOMailBox_TypeDef to_push;
     to_push.RDHR = tf[3];
     to_push.RDLR = tf[2];
     to_push.RDTR = tf[1];
     to_push.RIR = tf[0];
+    ep3_send(&to_push);
+  }
+}
+
+// the same records, alt 2 has bus 0's on ep1 and the others' on ep3. USB's
+// are sent from PendSV, see can_tx_defer.h, and only USB can be held off
+// while the replay ring is full.
+void usb_cb_ep1_out(uint8_t *usbdata, int len, int hardwired) {
+  if (hardwired && can_replay_loading()) {
+    can_replay_load(usbdata, len);
+  } else if (hardwired) {
+    can_tx_defer_stage(0, usbdata, len);
+  } else {
+    usb_can_tx(usbdata, len, hardwired);
+  }
+}
+
+void usb_cb_ep3_out(uint8_t *usbdata, int len, int hardwired) {
+  if (hardwired && can_replay_loading()) {
+    can_replay_load(usbdata, len);
+  } else if (hardwired) {
+    can_tx_defer_stage(1, usbdata, len);
+  } else {
+    usb_can_tx(usbdata, len, hardwired);
+  }
+}
 
-    uint8_t bus_number = (to_push.RDTR >> 4) & CAN_BUS_NUM_MASK;
-    can_send(&to_push, bus_number);
+// 0xdc and 0xd7, what's silent and the filters follow the mode
+void usb_set_safety_mode(uint16_t mode, int16_t param) {
+  safety_set_mode(mode, param);
+  switch (mode) {
+    case SAFETY_NOOUTPUT:
+      can_silent = ALL_CAN_SILENT;
+      break;
+    case SAFETY_ELM327:
+      can_silent = ALL_CAN_BUT_MAIN_SILENT;
+      break;
+    default:
+      can_silent = ALL_CAN_LIVE;
+      break;
   }
+  ctrl_defer_can_filters_all();
 }
 
+// 0xd7 sets what a host sets up after it opens the panda in one request,
+// wValue is the safety mode and wIndex these
+#define USB_CONFIG_ESP_POWER 1
+#define USB_CONFIG_LOOPBACK 2
+#define USB_CONFIG_TX_IN_ORDER 4
+#define USB_CONFIG_TIMESTAMPS 8
+#define USB_CONFIG_CLEAR_PERIODIC 0x10 // stops them all
+#define USB_CONFIG_CLEAR_RX 0x20       // drops what's in the rx queue
+#define USB_CONFIG_ALL 0x3F
+
 int is_enumerated = 0;
 
 void usb_cb_enumeration_complete() {
   puts("USB enumeration complete\n");
   is_enumerated = 1;
+  usb_flush_set(0, 0, 0);
+}
+
+void usb_cb_sof() {
+  usb_flush_sof();
 }
 
 int usb_cb_control_msg(USB_Setup_TypeDef *setup, uint8_t *resp, int hardwired) {
@@ -167,19 +618,132 @@ int usb_cb_control_msg(USB_Setup_TypeDef *setup, uint8_t *resp, int hardwired) {
   uart_ring *ur = NULL;
   int i;
   switch (setup->b.bRequest) {
-    // **** 0xc0: get CAN debug info
+    // 0xb0-0xb6 are the bootstub flasher's, see spi_flasher.h. A host that
+    // sends them to the app mustn't get anything done.
+    // **** 0xa0: set the staged gateway rule's CAN_GATEWAY_PARAM_* wValue to wIndex, or add it, load the table...
+    case 0xa0:
+      can_gateway_set_param(setup->b.wValue.w, setup->b.wIndex.w);
+      break;
+    // **** 0xa1: loaded gateway rule wValue's hits, forwarded, limited, blocked and latency, 0xFFFF for the table
+    case 0xa1:
+      resp_len = can_gateway_status(setup->b.wValue.w, resp);
+      break;
+    // **** 0xa2: bitrate detection on every CAN, wValue = 1: start with wIndex ms at each rate (0 = CAN_AUTOBAUD_DWELL_MS),
+    //            2: stop, first. Returns what each found, see can_autobaud_status
+    case 0xa2:
+      if (setup->b.wValue.w == 1) {
+        can_autobaud_start(setup->b.wIndex.w);
+      } else if (setup->b.wValue.w == 2) {
+        can_autobaud_stop();
+      }
+      resp_len = can_autobaud_status(resp);
+      break;
+    // **** 0xa3: when EP1 IN gives the host its CAN rx, wValue = frames to fill | USB_FLUSH_SOF,
+    //            wIndex = us the oldest frame waits at most, both 0 for immediate. wValue = 0xFFFF only reads.
+    //            Returns the policy and how it went, see usb_flush_status
+    case 0xa3:
+      if (hardwired && setup->b.wValue.w != 0xFFFF) {
+        usb_flush_set(setup->b.wValue.w & USB_FLUSH_FILL_MASK, (setup->b.wValue.w & USB_FLUSH_SOF) != 0,
+                      setup->b.wIndex.w);
+      }
+      resp_len = usb_flush_status(resp);
+      break;
+    // **** 0xa4: how the CAN tx USB packets staged for PendSV went, see can_tx_defer_status
+    case 0xa4:
+      resp_len = can_tx_defer_status(resp);
+      break;
+    // **** 0xc0: get CAN stats
     case 0xc0:
-      puts("can tx: "); puth(can_tx_cnt);
-      puts(" txd: "); puth(can_txd_cnt);
-      puts(" rx: "); puth(can_rx_cnt);
-      puts(" err: "); puth(can_err_cnt);
-      puts("\n");
+      // wValue = Can Bus Num
+      if (setup->b.wValue.w < BUS_MAX) {
+        resp_len = get_can_stats_pkt(setup->b.wValue.w, resp);
+      }
       break;
     // **** 0xc1: is grey panda
     case 0xc1:
       resp[0] = is_grey_panda;
       resp_len = 1;
       break;
+    // **** 0xc2: set how many frames in a row the host reads from a bus's RX queue
+    case 0xc2:
+      can_rx_set_weight(setup->b.wValue.w, setup->b.wIndex.w);
+      break;
+    // **** 0xc3: order a bus's TX queue by priority instead of as sent, wValue = bus, wIndex = 1 on
+    case 0xc3:
+      can_tx_set_priority(setup->b.wValue.w, setup->b.wIndex.w > 0);
+      can_lanes_drained();
+      break;
+    // **** 0xc4: set the CAN record formats on EP1 and EP3, wValue = RX, wIndex = TX, USB only
+    case 0xc4:
+      if (hardwired) {
+        can_usb_rx_format = min(setup->b.wValue.w, CAN_FORMAT_MAX);
+        can_usb_tx_format = min(setup->b.wIndex.w, CAN_FORMAT_MAX);
+        can_compact_held = 0;
+        resp[0] = can_usb_rx_format;
+        resp[1] = can_usb_tx_format;
+        resp_len = 2;
+      }
+      break;
+    // **** 0xc5: run microbenchmark wValue wIndex times (0 = BENCH_RUNS), stats like 0xf7
+    // empty unless built with make bench
+    case 0xc5:
+      #ifdef BENCH
+        resp_len = bench_run(setup->b.wValue.w, setup->b.wIndex.w, resp);
+      #endif
+      break;
+    // **** 0xc6: set an ISO-TP channel's ISOTP_PARAM_*, wValue = channel | (param << 8), wIndex = value
+    case 0xc6:
+      isotp_set_param(setup->b.wValue.w & 0xFF, setup->b.wValue.w >> 8, setup->b.wIndex.w);
+      break;
+    // **** 0xc7: ISO-TP channel wValue's state and counts
+    case 0xc7:
+      resp_len = isotp_status(setup->b.wValue.w, resp);
+      break;
+    // **** 0xc8: coalesce CAN RX under load, wValue = most us a frame waits for it, 0 = off
+    case 0xc8:
+      can_coalesce_set(setup->b.wValue.w);
+      break;
+    // **** 0xc9: CAN RX coalescing state and counts
+    case 0xc9:
+      resp_len = can_coalesce_status(resp);
+      break;
+    // **** 0xca: per id CAN stats status, wValue = 1: start again empty, 2: stop, first
+    case 0xca:
+      if (setup->b.wValue.w == 1) {
+        can_census_start(1);
+      } else if (setup->b.wValue.w == 2) {
+        can_census_stop();
+      }
+      resp_len = can_census_status(resp);
+      break;
+    // **** 0xcb: read per id CAN stats, wValue | (wIndex << 16) = index of the first entry
+    case 0xcb:
+      resp_len = can_census_read(setup->b.wValue.w | (setup->b.wIndex.w << 16), resp, min(setup->b.wLength.w, MAX_RESP_LEN));
+      break;
+    // **** 0xcc: GMLAN switch status, the CAN on it and how long the switches took
+    case 0xcc:
+      #ifdef PANDA
+        resp_len = can_gmlan_status(resp);
+      #endif
+      break;
+    // **** 0xcd: transmit group stats, released, frames, dropped, armed, the most skew and lateness, wValue = 1 resets them after
+    case 0xcd:
+      resp_len = can_group_status(resp, setup->b.wValue.w == 1);
+      break;
+    // **** 0xce: deferred control requests, queued, done, pending, runs, the longest run and the CAN reconfigs
+    case 0xce:
+      resp_len = ctrl_defer_status(resp);
+      break;
+    // **** 0xcf: TX echo mode of bus wValue, wIndex a CAN_ECHO_ mode or 0xFFFF to keep it. Returns it and the next ep3 token
+    case 0xcf:
+      if (setup->b.wValue.w < BUS_MAX) {
+        if (setup->b.wIndex.w <= CAN_ECHO_MAX) can_echo_mode[setup->b.wValue.w] = setup->b.wIndex.w;
+        resp[0] = can_echo_mode[setup->b.wValue.w];
+        uint16_t token = ep3_token_next[setup->b.wValue.w] & CAN_TX_TOKEN_MASK;
+        memcpy(&resp[1], &token, sizeof(token));
+        resp_len = 3;
+      }
+      break;
     // **** 0xd0: fetch serial number
     case 0xd0:
       #ifdef PANDA
@@ -212,20 +776,51 @@ int usb_cb_control_msg(USB_Setup_TypeDef *setup, uint8_t *resp, int hardwired) {
           break;
       }
       break;
-    // **** 0xd2: get health packet
+    // **** 0xd2: get health packet, wValue HEALTH_RESET starts a new window
     case 0xd2:
-      resp_len = get_health_pkt(resp);
+      resp_len = get_health_pkt(resp, (setup->b.wValue.w & HEALTH_RESET) != 0);
       break;
     // **** 0xd3: set fan speed
     case 0xd3:
       fan_set_speed(setup->b.wValue.w);
       break;
+    // **** 0xd4: one-shot TX on bus wValue, wIndex = 1 on, see can_one_shot
+    case 0xd4:
+      if (setup->b.wValue.w < BUS_MAX) {
+        can_one_shot[setup->b.wValue.w] = setup->b.wIndex.w > 0;
+        ctrl_defer_can_init(CAN_NUM_FROM_BUS_NUM(setup->b.wValue.w));
+      }
+      break;
+    // **** 0xd5: the last boot's postmortem record, wValue = 1 for this boot's so far, see postmortem_get
+    case 0xd5:
+      resp_len = postmortem_get(resp, setup->b.wValue.w != 1);
+      break;
     // **** 0xd6: get version
     case 0xd6:
       COMPILE_TIME_ASSERT(sizeof(gitversion) <= MAX_RESP_LEN)
       memcpy(resp, gitversion, sizeof(gitversion));
       resp_len = sizeof(gitversion)-1;
       break;
+    // **** 0xd7: apply a configuration, see USB_CONFIG_ESP_POWER, USB only
+    // answers with wIndex and wValue as taken, the CANs are reconfigured once after
+    case 0xd7:
+      if (hardwired) {
+        uint16_t config = setup->b.wIndex.w & USB_CONFIG_ALL;
+        set_esp_mode((config & USB_CONFIG_ESP_POWER) ? ESP_ENABLED : ESP_DISABLED);
+        usb_set_safety_mode(setup->b.wValue.w, 0);
+        can_loopback = (config & USB_CONFIG_LOOPBACK) != 0;
+        can_tx_in_order = (config & USB_CONFIG_TX_IN_ORDER) != 0;
+        can_usb_timestamps = (config & USB_CONFIG_TIMESTAMPS) != 0;
+        if (config & USB_CONFIG_CLEAR_PERIODIC) can_periodic_stop(-1);
+        if (config & USB_CONFIG_CLEAR_RX) {
+          can_rx_clear();
+          can_compact_held = 0;
+        }
+        memcpy(resp, &config, 2);
+        memcpy(resp + 2, &setup->b.wValue.w, 2);
+        resp_len = 4;
+      }
+      break;
     // **** 0xd8: reset ST
     case 0xd8:
       NVIC_SystemReset();
@@ -242,15 +837,7 @@ int usb_cb_control_msg(USB_Setup_TypeDef *setup, uint8_t *resp, int hardwired) {
       break;
     // **** 0xda: reset ESP, with optional boot mode
     case 0xda:
-      set_esp_mode(ESP_DISABLED);
-      delay(1000000);
-      if (setup->b.wValue.w == 1) {
-        set_esp_mode(ESP_BOOTMODE);
-      } else {
-        set_esp_mode(ESP_ENABLED);
-      }
-      delay(1000000);
-      set_esp_mode(ESP_ENABLED);
+      ctrl_defer_esp_reset(setup->b.wValue.w == 1);
       break;
     // **** 0xdb: set GMLAN multiplexing mode
     case 0xdb:
@@ -274,19 +861,7 @@ int usb_cb_control_msg(USB_Setup_TypeDef *setup, uint8_t *resp, int hardwired) {
       // and it's blocked over WiFi
       // Allow ELM security mode to be set over wifi.
       if (hardwired || setup->b.wValue.w == SAFETY_NOOUTPUT || setup->b.wValue.w == SAFETY_ELM327) {
-        safety_set_mode(setup->b.wValue.w, (int16_t)setup->b.wIndex.w);
-        switch (setup->b.wValue.w) {
-          case SAFETY_NOOUTPUT:
-            can_silent = ALL_CAN_SILENT;
-            break;
-          case SAFETY_ELM327:
-            can_silent = ALL_CAN_BUT_MAIN_SILENT;
-            break;
-          default:
-            can_silent = ALL_CAN_LIVE;
-            break;
-        }
-        can_init_all();
+        usb_set_safety_mode(setup->b.wValue.w, (int16_t)setup->b.wIndex.w);
       }
       break;
     // **** 0xdd: enable can forwarding
@@ -304,14 +879,34 @@ int usb_cb_control_msg(USB_Setup_TypeDef *setup, uint8_t *resp, int hardwired) {
     case 0xde:
       if (setup->b.wValue.w < BUS_MAX) {
         can_speed[setup->b.wValue.w] = setup->b.wIndex.w;
-        can_init(CAN_NUM_FROM_BUS_NUM(setup->b.wValue.w));
+        ctrl_defer_can_init(CAN_NUM_FROM_BUS_NUM(setup->b.wValue.w));
+      }
+      break;
+    // **** 0xdf: set can hardware filters
+    case 0xdf:
+      // wValue = Can Bus Num
+      // wIndex = 0: clear filters, 1: add filter staged by 0xe8/0xe9, 2: apply
+      if (setup->b.wValue.w < BUS_MAX) {
+        switch (setup->b.wIndex.w) {
+          case 0:
+            can_clear_filters(setup->b.wValue.w);
+            can_init_filters(CAN_NUM_FROM_BUS_NUM(setup->b.wValue.w));
+            break;
+          case 1:
+            can_add_filter(setup->b.wValue.w, can_filter_staged.id, can_filter_staged.mask);
+            break;
+          case 2:
+            can_init_filters(CAN_NUM_FROM_BUS_NUM(setup->b.wValue.w));
+            break;
+        }
       }
       break;
     // **** 0xe0: uart read
     case 0xe0:
       ur = get_ring_by_number(setup->b.wValue.w);
       if (!ur) break;
-      if (ur == &esp_ring) uart_dma_drain();
+      // pick up what the rx DMA has since the last interrupt
+      uart_ring_process(ur);
       // read
       while ((resp_len < min(setup->b.wLength.w, MAX_RESP_LEN)) &&
                          getc(ur, (char*)&resp[resp_len])) {
@@ -347,6 +942,12 @@ int usb_cb_control_msg(USB_Setup_TypeDef *setup, uint8_t *resp, int hardwired) {
           break;
       }
       break;
+    // **** 0xe3: event stream, wValue = mask of EVENT_MASK_, wIndex = ticks between ADC samples, USB only, see events.h
+    case 0xe3:
+      if (hardwired) {
+        event_set(setup->b.wValue.w, setup->b.wIndex.w);
+      }
+      break;
     // **** 0xe4: uart set baud rate extended
     case 0xe4:
       ur = get_ring_by_number(setup->b.wValue.w);
@@ -356,7 +957,7 @@ int usb_cb_control_msg(USB_Setup_TypeDef *setup, uint8_t *resp, int hardwired) {
     // **** 0xe5: set CAN loopback (for testing)
     case 0xe5:
       can_loopback = (setup->b.wValue.w > 0);
-      can_init_all();
+      ctrl_defer_can_init_all();
       break;
     // **** 0xe6: set USB power
     case 0xe6:
@@ -373,6 +974,45 @@ int usb_cb_control_msg(USB_Setup_TypeDef *setup, uint8_t *resp, int hardwired) {
         }
       }
       break;
+    // **** 0xe7: set CAN TX order, 1 sends in request order, 0 by identifier priority
+    case 0xe7:
+      can_tx_in_order = (setup->b.wValue.w > 0);
+      ctrl_defer_can_init_all();
+      break;
+    // **** 0xe8: stage can filter id, RIR layout, wValue is the low half
+    case 0xe8:
+      can_filter_staged.id = setup->b.wValue.w | ((uint32_t)setup->b.wIndex.w << 16);
+      break;
+    // **** 0xe9: stage can filter mask, RIR layout, wValue is the low half
+    case 0xe9:
+      can_filter_staged.mask = setup->b.wValue.w | ((uint32_t)setup->b.wIndex.w << 16);
+      break;
+    // **** 0xea: set timestamped CAN records on EP1, USB only
+    case 0xea:
+      if (hardwired) {
+        can_usb_timestamps = (setup->b.wValue.w > 0);
+      }
+      break;
+    // **** 0xeb: stage periodic CAN message, wValue is the halfword of RIR, RDTR, RDLR, RDHR
+    case 0xeb:
+      can_periodic_stage(setup->b.wValue.w, setup->b.wIndex.w);
+      break;
+    // **** 0xec: start periodic CAN message, wValue is slot | (bus << 8), wIndex is the period in ms
+    case 0xec:
+      can_periodic_start(setup->b.wValue.w & 0xFF, setup->b.wValue.w >> 8, setup->b.wIndex.w * 1000U);
+      break;
+    // **** 0xed: stop periodic CAN message in slot wValue, 0xFFFF for all
+    case 0xed:
+      can_periodic_stop((setup->b.wValue.w == 0xFFFF) ? -1 : setup->b.wValue.w);
+      break;
+    // **** 0xee: set an ECU emulation entry's CAN_RESPONDER_PARAM_*, wValue = entry | (param << 8), wIndex = value
+    case 0xee:
+      can_responder_set_param(setup->b.wValue.w & 0xFF, setup->b.wValue.w >> 8, setup->b.wIndex.w);
+      break;
+    // **** 0xef: ECU emulation entry wValue's state, requests answered, frames scheduled and dropped
+    case 0xef:
+      resp_len = can_responder_status(setup->b.wValue.w, resp);
+      break;
     // **** 0xf0: do k-line wValue pulse on uart2 for Acura
     case 0xf0:
       if (setup->b.wValue.w == 1) {
@@ -410,10 +1050,12 @@ int usb_cb_control_msg(USB_Setup_TypeDef *setup, uint8_t *resp, int hardwired) {
     case 0xf1:
       if (setup->b.wValue.w == 0xFFFF) {
         puts("Clearing CAN Rx queue\n");
-        can_clear(&can_rx_q);
+        can_rx_clear();
+        can_compact_held = 0;
       } else if (setup->b.wValue.w < BUS_MAX) {
         puts("Clearing CAN Tx queue\n");
         can_clear(can_queues[setup->b.wValue.w]);
+        can_lanes_drained();
       }
       break;
     // **** 0xf2: Clear UART ring buffer.
@@ -426,7 +1068,109 @@ int usb_cb_control_msg(USB_Setup_TypeDef *setup, uint8_t *resp, int hardwired) {
         }
         break;
       }
+    // **** 0xf3: set K-line mode, wValue = ring (2 or 3), wIndex = KLINE_MODE_* bits
+    case 0xf3:
+      {
+        uart_ring * rb = get_ring_by_number(setup->b.wValue.w);
+        if (rb == &lin1_ring || rb == &lin2_ring) {
+          kline_set_mode(rb, setup->b.wIndex.w);
+        }
+        break;
+      }
+    // **** 0xf4: stream serial on ep2 IN, wValue = mask of the rings, ESP and LIN only
+    case 0xf4:
+      serial_stream_mask = setup->b.wValue.w & 0xE;
+      for (int i = 1; i <= 3; i++) {
+        get_ring_by_number(i)->callback = (serial_stream_mask & (1 << i)) ? serial_stream_ready : NULL;
+      }
+      usb_ep2_in_kick();
+      break;
+    // **** 0xf5: read trace log, wValue | (wIndex << 16) = index of the first record wanted
+    case 0xf5:
+      {
+        uint32_t from = setup->b.wValue.w | (setup->b.wIndex.w << 16);
+        resp_len = trace_read(&from, resp, min(setup->b.wLength.w, MAX_RESP_LEN));
+        break;
+      }
+    // **** 0xf6: set trace log level, records above it aren't kept
+    case 0xf6:
+      trace_level = setup->b.wValue.w;
+      break;
+    // **** 0xf7: read the cycle counts of probe wValue, wIndex = 1 clears them all after
+    // empty unless built with PROFILE
+    case 0xf7:
+      #ifdef PROFILE
+        resp_len = profile_read(setup->b.wValue.w, resp);
+        if (setup->b.wIndex.w == 1) profile_clear();
+      #endif
+      break;
+    // **** 0xf8: add CAN rx report rule for the filter staged by 0xe8/0xe9
+    case 0xf8:
+      // wValue = bus, 0xFFFF clears every rule
+      // wIndex = interval in ms, | 0x8000 to also send on when the data changed
+      if (setup->b.wValue.w == 0xFFFF) {
+        can_clear_report_rules();
+      } else if (!can_add_report_rule(setup->b.wValue.w, can_filter_staged.id, can_filter_staged.mask, setup->b.wIndex.w)) {
+        puts("can_add_report_rule failed!\n");
+      }
+      break;
+    #ifdef PANDA
+    // **** 0xf9: stage CAN capture trigger data, wValue is the halfword of RDLR, RDHR, then their mask
+    case 0xf9:
+      can_capture_stage(setup->b.wValue.w, setup->b.wIndex.w);
+      break;
+    // **** 0xfa: arm CAN capture, wValue = frames kept after the trigger
+    case 0xfa:
+      // wIndex = trigger sources | (bus << 8), bus 0xFF is any
+      // the frame trigger is the filter staged by 0xe8/0xe9 and the data staged by 0xf9
+      can_capture_arm(setup->b.wIndex.w & 0xFF, setup->b.wIndex.w >> 8, setup->b.wValue.w, &can_filter_staged);
+      break;
+    // **** 0xfb: CAN capture status, wValue = 1: trigger now, 2: stop, first
+    case 0xfb:
+      if (setup->b.wValue.w == 1) {
+        can_capture_trigger(CAN_CAPTURE_ON_HOST, CAN_CAPTURE_ANY_BUS, TIM2->CNT);
+      } else if (setup->b.wValue.w == 2) {
+        can_capture_stop();
+      }
+      resp_len = can_capture_status(resp);
+      break;
+    // **** 0xfc: read CAN capture, wValue | (wIndex << 16) = index of the first record, once done or stopped
+    case 0xfc:
+      resp_len = can_capture_read(setup->b.wValue.w | (setup->b.wIndex.w << 16), resp, min(setup->b.wLength.w, MAX_RESP_LEN));
+      break;
+    #endif
+    // **** 0xfd: CAN replay status, wValue = 1: load from ep3, 2: play, 3: stop, first. USB only
+    case 0xfd:
+      if (hardwired) {
+        if (setup->b.wValue.w == 1) {
+          can_replay_start_loading();
+        } else if (setup->b.wValue.w == 2) {
+          can_replay_play();
+        } else if (setup->b.wValue.w == 3) {
+          can_replay_stop();
+        }
+      }
+      resp_len = can_replay_status(resp);
+      break;
+    // **** 0xfe: read TIM2, the time of the CAN timestamps and scheduled frames
+    case 0xfe:
+      {
+        uint32_t now = TIM2->CNT;
+        memcpy(resp, &now, sizeof(now));
+        resp_len = sizeof(now);
+        break;
+      }
+    // **** 0xff: split the CAN frame pool, wValue = bus of a TX queue or 0xFF00 | bus for
+    //            its RX queue, wIndex = frames it holds. 0xFFFF only reads the split back.
+    case 0xff:
+      if (setup->b.wValue.w != 0xFFFF && can_pool_resize(setup->b.wValue.w, setup->b.wIndex.w) != 0) {
+        puts("CAN pool split doesn't fit\n");
+      }
+      can_lanes_drained();
+      resp_len = can_pool_layout(resp);
+      break;
     default:
+      trace(TRACE_WARN, TRACE_USB_NO_HANDLER, setup->b.bRequest, 0);
       puts("NO HANDLER ");
       puth(setup->b.bRequest);
       puts("\n");
@@ -436,36 +1180,37 @@ int usb_cb_control_msg(USB_Setup_TypeDef *setup, uint8_t *resp, int hardwired) {
 }
 
 #ifdef PANDA
-int spi_cb_rx(uint8_t *data, int len, uint8_t *data_out) {
-  // data[0]  = endpoint
-  // data[2]  = length
-  // data[4:] = data
-
+int spi_cb_rx(uint8_t endpoint, uint8_t *dat, int len, uint8_t *data_out, int max_out) {
   int resp_len = 0;
-  switch (data[0]) {
+  switch (endpoint) {
     case 0:
       // control transfer
-      resp_len = usb_cb_control_msg((USB_Setup_TypeDef *)(data+4), data_out, 0);
+      resp_len = usb_cb_control_msg((USB_Setup_TypeDef *)dat, data_out, 0);
       break;
     case 1:
-      // ep 1, read
-      resp_len = usb_cb_ep1_in(data_out, 0x40, 0);
+      // ep 1, read as much CAN as fits
+      resp_len = usb_cb_ep1_in(data_out, max_out, 0);
       break;
     case 2:
       // ep 2, send serial
-      usb_cb_ep2_out(data+4, data[2], 0);
+      usb_cb_ep2_out(dat, len, 0);
       break;
     case 3:
       // ep 3, send CAN
-      usb_cb_ep3_out(data+4, data[2], 0);
+      usb_cb_ep3_out(dat, len, 0);
       break;
   }
   return resp_len;
 }
 
+int spi_cb_data_ready() {
+  return can_rx_pending();
+}
+
 #else
 
-int spi_cb_rx(uint8_t *data, int len, uint8_t *data_out) { return 0; };
+int spi_cb_rx(uint8_t endpoint, uint8_t *dat, int len, uint8_t *data_out, int max_out) { return 0; };
+int spi_cb_data_ready() { return 0; };
 
 #endif
 
@@ -484,8 +1229,13 @@ int main() {
   clock_init();
   periph_init();
   detect();
+  #ifdef PROFILE
+    profile_init();
+  #endif
 
   // print hello
+  trace(TRACE_INFO, TRACE_BOOT, 0, RCC->CSR);
+  postmortem_init();
   puts("\n\n\n************************ MAIN START ************************\n");
 
   // detect the revision and init the GPIOs
@@ -529,8 +1279,10 @@ int main() {
   TIM2->CR1 = TIM_CR1_CEN;
   TIM2->EGR = TIM_EGR_UG;
   // use TIM2->CNT to read
+  can_periodic_init();
 
-  // enable USB
+  // enable USB, its CAN tx is done at the lowest priority
+  can_tx_defer_init();
   usb_init();
 
   // default to silent mode to prevent issues with Ford
@@ -547,13 +1299,18 @@ int main() {
   // set PWM
   fan_init();
   fan_set_speed(0);
+  red_led_init();
+
+  // wakes the main loop, everything it does is timed in ticks
+  tick_init();
 
   puts("**** INTERRUPTS ON ****\n");
 
   __enable_irq();
 
-  // LED should keep on blinking all the time
+  // clicks, a second each
   uint64_t cnt = 0;
+  int ticks = 0;
 
   #ifdef PANDA
     uint64_t marker = 0;
@@ -561,10 +1318,38 @@ int main() {
     #define CLICKS 8
   #endif
 
-  for (cnt=0;;cnt++) {
+  for (cnt=0;;) {
+    // sleep until the tick or deferred requests. With interrupts off an IRQ
+    // between the check and the WFI stays pending and still wakes it.
+    __disable_irq();
+    if (!tick_pending && !ctrl_defer_ready()) {
+      uint32_t idle_start = TIM2->CNT;
+      __WFI();
+      idle_us += TIM2->CNT - idle_start;
+    }
+    __enable_irq();
+    // what the IRQ that woke it left for after
+    ctrl_defer_service();
+    can_autobaud_service();
+    if (!tick_pending) continue;
+    tick_pending = 0;
+
+    uint32_t lag = TIM2->CNT - tick_due_ts;
+    if (lag > main_loop_lag_max) main_loop_lag_max = lag;
+
+    event_tick();
+
+    // LED should keep on fading all the time, faster in DCP
+    red_led_fade((usb_power_mode == USB_POWER_DCP) ? 4 : 1);
+
+    if (++ticks < TICKS_PER_CLICK) continue;
+    ticks = 0;
+
     can_live = pending_can_live;
+    postmortem_update(main_loop_lag_max);
+    health_window_age();
 
-    //puth(usart1_dma); puts(" "); puth(DMA2_Stream5->M0AR); puts(" "); puth(DMA2_Stream5->NDTR); puts("\n");
+    //puth(esp_ring.r_ptr_dma_rx); puts(" "); puth(DMA2_Stream5->M0AR); puts(" "); puth(DMA2_Stream5->NDTR); puts("\n");
 
     #ifdef PANDA
       int current = adc_get(ADCCHAN_CURRENT);
@@ -621,37 +1406,25 @@ int main() {
       puts("\n");*/
     #endif
 
-    // reset this every 16th pass
+    // reset this every 16th click
     if ((cnt&0xF) == 0) pending_can_live = 0;
 
     #ifdef DEBUG
       puts("** blink ");
-      puth(can_rx_q.r_ptr); puts(" "); puth(can_rx_q.w_ptr); puts("  ");
+      puth(can_rx_qs[0].r_ptr); puts(" "); puth(can_rx_qs[0].w_ptr); puts("  ");
       puth(can_tx1_q.r_ptr); puts(" "); puth(can_tx1_q.w_ptr); puts("  ");
       puth(can_tx2_q.r_ptr); puts(" "); puth(can_tx2_q.w_ptr); puts("\n");
     #endif
 
     // set green LED to be controls allowed
-    set_led(LED_GREEN, controls_allowed);
-
-    // blink the red LED
-    int div_mode = ((usb_power_mode == USB_POWER_DCP) ? 4 : 1);
-
-    for (int div_mode_loop = 0; div_mode_loop < div_mode; div_mode_loop++) {
-      for (int fade = 0; fade < 1024; fade += 8) {
-        for (int i = 0; i < 128/div_mode; i++) {
-          set_led(LED_RED, 0);
-          if (fade < 512) { delay(512-fade); } else { delay(fade-512); }
-          set_led(LED_RED, 1);
-          if (fade < 512) { delay(fade); } else { delay(1024-fade); }
-        }
-      }
-    }
+    set_led(LED_GREEN, safety.controls_allowed);
 
     // turn off the blue LED, turned on by CAN
     #ifdef PANDA
       set_led(LED_BLUE, 0);
     #endif
+
+    cnt++;
   }
 
   return 0;
@@ -12,8 +12,10 @@
 
 #include "libc.h"
 #include "safety.h"
+#include "drivers/trace.h"
 #include "drivers/adc.h"
 #include "drivers/uart.h"
+#include "drivers/kline.h"
 #include "drivers/dac.h"
 #include "drivers/can.h"
 #include "drivers/timer.h"
@@ -44,20 +46,32 @@ void debug_ring_callback(uart_ring *ring) {
 
 #ifdef PEDAL_USB
 
+int pedal_timing_read(uint8_t *out);
+void pedal_timing_clear();
+
 int usb_cb_ep1_in(uint8_t *usbdata, int len, int hardwired) { return 0; }
+int usb_cb_ep2_in(uint8_t *usbdata, int len, int hardwired) { return 0; }
 void usb_cb_ep2_out(uint8_t *usbdata, int len, int hardwired) {}
 void usb_cb_ep3_out(uint8_t *usbdata, int len, int hardwired) {}
+void usb_cb_ep1_out(uint8_t *usbdata, int len, int hardwired) {}
 void usb_cb_enumeration_complete() {}
+void usb_cb_sof() {}
 
 int usb_cb_control_msg(USB_Setup_TypeDef *setup, uint8_t *resp, int hardwired) {
   int resp_len = 0;
   uart_ring *ur = NULL;
   switch (setup->b.bRequest) {
+    // **** 0xcd: pedal frame timing, wIndex = 1 clears it after
+    case 0xcd:
+      resp_len = pedal_timing_read(resp);
+      if (setup->b.wIndex.w == 1) pedal_timing_clear();
+      break;
     // **** 0xe0: uart read
     case 0xe0:
       ur = get_ring_by_number(setup->b.wValue.w);
       if (!ur) break;
-      if (ur == &esp_ring) uart_dma_drain();
+      // pick up what the rx DMA has since the last interrupt
+      uart_ring_process(ur);
       // read
       while ((resp_len < min(setup->b.wLength.w, MAX_RESP_LEN)) &&
                          getc(ur, (char*)&resp[resp_len])) {
@@ -72,17 +86,16 @@ int usb_cb_control_msg(USB_Setup_TypeDef *setup, uint8_t *resp, int hardwired) {
 
 // ***************************** honda can checksum *****************************
 
+// the nibble sum of each byte, so a frame's checksum is a lookup a byte
+uint8_t cksum_nibbles[0x100];
+
+void can_cksum_init() {
+  for (int i = 0; i < 0x100; i++) cksum_nibbles[i] = (i >> 4) + (i & 0xF);
+}
+
 int can_cksum(uint8_t *dat, int len, int addr, int idx) {
-  int i;
-  int s = 0;
-  for (i = 0; i < len; i++) {
-    s += (dat[i] >> 4); 
-    s += dat[i] & 0xF;
-  }
-  s += (addr>>0)&0xF;
-  s += (addr>>4)&0xF;
-  s += (addr>>8)&0xF;
-  s += idx;
+  int s = cksum_nibbles[addr & 0xFF] + ((addr >> 8) & 0xF) + idx;
+  for (int i = 0; i < len; i++) s += cksum_nibbles[dat[i]];
   s = 8-s;
   return s&0xF;
 }
@@ -93,7 +106,62 @@ int can_cksum(uint8_t *dat, int len, int addr, int idx) {
 #define CAN_GAS_INPUT  0x200
 #define CAN_GAS_OUTPUT 0x201
 
+// ***************************** frame timing *****************************
+
+// The frame is put in mailbox 0 by TIM3 compare 1, TX_LEAD_TICKS before the
+// update, with the pedal as last read, and the update only sets TXRQ, so it
+// goes at the same point of the period whatever making it took.
+// TIM3 counts at 3.2 MHz and wraps at 0x10000, about 49 Hz.
+#define TX_LEAD_TICKS 320 // 100 us
+
+// read with 0xcd, the host divides the sums
+typedef struct __attribute__((packed)) {
+  uint32_t sent;      // TXRQ set
+  uint32_t missed;    // nothing loaded, the last frame was still in the mailbox
+  uint32_t phase_min; // TIM3 ticks from the update to TXRQ
+  uint32_t phase_max;
+  uint32_t age_min;   // us from reading the pedal to TXRQ
+  uint32_t age_max;
+  uint32_t tx_min;    // us from TXRQ to the frame being sent
+  uint32_t tx_max;
+  uint32_t tx_cnt;
+  uint64_t age_sum;
+  uint64_t tx_sum;
+} pedal_timing;
+
+pedal_timing timing = {.phase_min = 0xFFFFFFFF, .age_min = 0xFFFFFFFF, .tx_min = 0xFFFFFFFF};
+
+void pedal_timing_clear() {
+  enter_critical_section();
+  memset(&timing, 0, sizeof(timing));
+  timing.phase_min = 0xFFFFFFFF;
+  timing.age_min = 0xFFFFFFFF;
+  timing.tx_min = 0xFFFFFFFF;
+  exit_critical_section();
+}
+
+int pedal_timing_read(uint8_t *out) {
+  enter_critical_section();
+  pedal_timing t = timing;
+  exit_critical_section();
+  // the mins are 0 until there's one
+  if (t.sent == 0) t.phase_min = t.age_min = 0;
+  if (t.tx_cnt == 0) t.tx_min = 0;
+  memcpy(out, &t, sizeof(t));
+  return sizeof(t);
+}
+
+// TIM2 when TXRQ was set
+uint32_t txrq_ts = 0;
+
 void CAN1_TX_IRQHandler() {
+  if (CAN->TSR & CAN_TSR_TXOK0) {
+    uint32_t tx = TIM2->CNT - txrq_ts;
+    timing.tx_cnt += 1;
+    timing.tx_sum += tx;
+    timing.tx_min = min(timing.tx_min, tx);
+    timing.tx_max = max(timing.tx_max, tx);
+  }
   // clear interrupt
   CAN->TSR |= CAN_TSR_RQCP0;
 }
@@ -179,49 +247,86 @@ void CAN1_SCE_IRQHandler() {
 }
 
 int pdl0 = 0, pdl1 = 0;
+// TIM2 when they were read
+uint32_t pdl_ts = 0;
 int pkt_idx = 0;
+// mailbox 0 has the frame for the next update
+int tx_loaded = 0;
+uint32_t tx_pdl_ts = 0;
 
 int led_value = 0;
 
+void pedal_tx_load() {
+  uint8_t dat[8];
+  dat[0] = (pdl0>>8)&0xFF;
+  dat[1] = (pdl0>>0)&0xFF;
+  dat[2] = (pdl1>>8)&0xFF;
+  dat[3] = (pdl1>>0)&0xFF;
+  dat[4] = state;
+  dat[5] = can_cksum(dat, 5, CAN_GAS_OUTPUT, pkt_idx) | (pkt_idx<<4);
+  CAN->sTxMailBox[0].TDLR = dat[0] | (dat[1]<<8) | (dat[2]<<16) | (dat[3]<<24);
+  CAN->sTxMailBox[0].TDHR = dat[4] | (dat[5]<<8);
+  CAN->sTxMailBox[0].TDTR = 6;  // len of packet is 5
+  // without TXRQ, the update sends it
+  CAN->sTxMailBox[0].TIR = CAN_GAS_OUTPUT << 21;
+  tx_pdl_ts = pdl_ts;
+  tx_loaded = 1;
+}
+
+void pedal_tx_send() {
+  CAN->sTxMailBox[0].TIR |= CAN_TI0R_TXRQ;
+  txrq_ts = TIM2->CNT;
+  uint32_t phase = TIM3->CNT;
+  uint32_t age = txrq_ts - tx_pdl_ts;
+  tx_loaded = 0;
+  ++pkt_idx;
+  pkt_idx &= 3;
+
+  timing.sent += 1;
+  timing.phase_min = min(timing.phase_min, phase);
+  timing.phase_max = max(timing.phase_max, phase);
+  timing.age_sum += age;
+  timing.age_min = min(timing.age_min, age);
+  timing.age_max = max(timing.age_max, age);
+}
+
 void TIM3_IRQHandler() {
-  #ifdef DEBUG
-    puth(TIM3->CNT);
-    puts(" ");
-    puth(pdl0);
-    puts(" ");
-    puth(pdl1);
-    puts("\n");
-  #endif
+  // compare 1, the frame for the update
+  if (TIM3->SR & TIM_SR_CC1IF) {
+    TIM3->SR = ~TIM_SR_CC1IF;
+    // check timer for sending the user pedal and clearing the CAN
+    if ((CAN->TSR & CAN_TSR_TME0) == CAN_TSR_TME0) {
+      pedal_tx_load();
+    }
+  }
+
+  if (!(TIM3->SR & TIM_SR_UIF)) return;
+  TIM3->SR = ~TIM_SR_UIF;
 
-  // check timer for sending the user pedal and clearing the CAN
-  if ((CAN->TSR & CAN_TSR_TME0) == CAN_TSR_TME0) {
-    uint8_t dat[8];
-    dat[0] = (pdl0>>8)&0xFF;
-    dat[1] = (pdl0>>0)&0xFF;
-    dat[2] = (pdl1>>8)&0xFF;
-    dat[3] = (pdl1>>0)&0xFF;
-    dat[4] = state;
-    dat[5] = can_cksum(dat, 5, CAN_GAS_OUTPUT, pkt_idx) | (pkt_idx<<4);
-    CAN->sTxMailBox[0].TDLR = dat[0] | (dat[1]<<8) | (dat[2]<<16) | (dat[3]<<24);
-    CAN->sTxMailBox[0].TDHR = dat[4] | (dat[5]<<8);
-    CAN->sTxMailBox[0].TDTR = 6;  // len of packet is 5
-    CAN->sTxMailBox[0].TIR = (CAN_GAS_OUTPUT << 21) | 1;
-    ++pkt_idx;
-    pkt_idx &= 3;
+  if (tx_loaded) {
+    pedal_tx_send();
   } else {
     // old can packet hasn't sent!
     state = FAULT_SEND;
+    timing.missed += 1;
     #ifdef DEBUG
       puts("CAN MISS\n");
     #endif
   }
 
+  #ifdef DEBUG
+    puth(TIM3->CNT);
+    puts(" ");
+    puth(pdl0);
+    puts(" ");
+    puth(pdl1);
+    puts("\n");
+  #endif
+
   // blink the LED
   set_led(LED_GREEN, led_value);
   led_value = !led_value;
 
-  TIM3->SR = 0;
-
   // up timeout for gas set
   if (timeout == MAX_TIMEOUT) {
     state = FAULT_TIMEOUT;
@@ -234,8 +339,10 @@ void TIM3_IRQHandler() {
 
 void pedal() {
   // read/write
+  // the DMA keeps the samples, these don't wait on the ADC
   pdl0 = adc_get(ADCCHAN_ACCEL0);
   pdl1 = adc_get(ADCCHAN_ACCEL1);
+  pdl_ts = TIM2->CNT;
 
   // write the pedal to the DAC
   if (state == NO_FAULT) {
@@ -267,12 +374,20 @@ int main() {
   dac_init();
   adc_init();
 
+  can_cksum_init();
+
   // init can
   can_silent = ALL_CAN_LIVE;
   can_init(0);
 
-  // 48mhz / 65536 ~= 732
+  // us of the frame timing, as on the panda
+  TIM2->PSC = 48-1;
+  TIM2->CR1 = TIM_CR1_CEN;
+
+  // 48mhz / 15 / 65536 ~= 49
   timer_init(TIM3, 15);
+  TIM3->CCR1 = 0x10000 - TX_LEAD_TICKS;
+  TIM3->DIER |= TIM_DIER_CC1IE;
   NVIC_EnableIRQ(TIM3_IRQn);
 
   // setup watchdog
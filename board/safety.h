@@ -1,12 +1,14 @@
+typedef struct safety_state safety_state;
+
 void safety_rx_hook(CAN_FIFOMailBox_TypeDef *to_push);
 int safety_tx_hook(CAN_FIFOMailBox_TypeDef *to_send);
 int safety_tx_lin_hook(int lin_num, uint8_t *data, int len);
 
-typedef void (*safety_hook_init)(int16_t param);
-typedef void (*rx_hook)(CAN_FIFOMailBox_TypeDef *to_push);
-typedef int (*tx_hook)(CAN_FIFOMailBox_TypeDef *to_send);
-typedef int (*tx_lin_hook)(int lin_num, uint8_t *data, int len);
-typedef int (*fwd_hook)(int bus_num, CAN_FIFOMailBox_TypeDef *to_fwd);
+typedef void (*safety_hook_init)(safety_state *s, int16_t param);
+typedef void (*rx_hook)(safety_state *s, CAN_FIFOMailBox_TypeDef *to_push);
+typedef int (*tx_hook)(safety_state *s, CAN_FIFOMailBox_TypeDef *to_send);
+typedef int (*tx_lin_hook)(safety_state *s, int lin_num, uint8_t *data, int len);
+typedef int (*fwd_hook)(safety_state *s, int bus_num, CAN_FIFOMailBox_TypeDef *to_fwd);
 
 typedef struct {
   safety_hook_init init;
@@ -14,10 +16,63 @@ typedef struct {
   tx_hook tx;
   tx_lin_hook tx_lin;
   fwd_hook fwd;
+  // standard ids the rx hook reads, these pass the host CAN filters.
+  // Other standard frames skip the hook, NULL gives it everything
+  const uint16_t *rx_ids;
+  int rx_ids_len;
+  // standard ids the tx hook checks, other standard frames are let through
+  // without calling it. NULL if it has a say on every frame.
+  const uint16_t *tx_ids;
+  int tx_ids_len;
+  // buses the fwd hook forwards from, these are never filtered
+  uint8_t fwd_buses;
 } safety_hooks;
 
-// This can be set by the safety hooks.
-int controls_allowed = 0;
+// bit per standard id of the current mode's rx_ids and tx_ids, built by
+// safety_set_mode. Extended frames always go to the hooks.
+#define SAFETY_ID_WORDS (0x800 / 32)
+
+// Everything one safety instance knows, the hooks only touch this. The
+// firmware has one, safety, and the host tests can run as many as they like,
+// each needs safety_state_set_mode before its first frame.
+struct safety_state {
+  const safety_hooks *hooks;
+
+  // This can be set by the safety hooks.
+  int controls_allowed;
+
+  struct {
+    int gas_interceptor_detected;
+    int brake_prev;
+    int gas_prev;
+    int gas_interceptor_prev;
+    int ego_speed;
+    // TODO: auto-detect bosch hardware based on CAN messages?
+    bool bosch_hardware;
+  } honda;
+
+  struct {
+    int16_t torque_meas[3];      // last 3 motor torques produced by the eps
+    int16_t torque_meas_min, torque_meas_max;
+    int actuation_limits;        // by default steer limits are imposed
+    int16_t dbc_eps_torque_factor; // conversion factor for STEER_TORQUE_EPS in %: see dbc file
+    int16_t desired_torque_last; // last desired steer torque
+    int16_t rt_torque_last;      // last desired torque for real time check
+    uint32_t ts_last;
+  } toyota;
+
+  // gm_: poor man's namespacing
+  struct {
+    int brake_prev;
+    int gas_prev;
+    int speed;
+    // silence everything if stock ECUs are still online
+    int ascm_detected;
+  } gm;
+
+  uint32_t rx_map[SAFETY_ID_WORDS];
+  uint32_t tx_map[SAFETY_ID_WORDS];
+};
 
 // Include the actual safety policies.
 #include "safety/safety_defaults.h"
@@ -26,22 +81,57 @@ int controls_allowed = 0;
 #include "safety/safety_gm.h"
 #include "safety/safety_elm327.h"
 
-const safety_hooks *current_hooks = &nooutput_hooks;
+// everything goes to the hooks until a mode is set
+safety_state safety = {
+  .hooks = &nooutput_hooks,
+  .rx_map = {[0 ... SAFETY_ID_WORDS - 1] = 0xFFFFFFFF},
+  .tx_map = {[0 ... SAFETY_ID_WORDS - 1] = 0xFFFFFFFF},
+};
+
+void safety_build_map(uint32_t *map, const uint16_t *ids, int ids_len) {
+  for (int i = 0; i < SAFETY_ID_WORDS; i++) map[i] = ids ? 0 : 0xFFFFFFFF;
+  for (int i = 0; ids && i < ids_len; i++) map[(ids[i] >> 5) & (SAFETY_ID_WORDS - 1)] |= 1U << (ids[i] & 0x1F);
+}
+
+// RIR >> 26 is the top 6 bits of the standard id, the word in the map
+#define SAFETY_ID_LISTED(map, rir) (((rir) & 4) || ((map)[(rir) >> 26] & (1U << (((rir) >> 21) & 0x1F))))
 
-void safety_rx_hook(CAN_FIFOMailBox_TypeDef *to_push){
-  current_hooks->rx(to_push);
+RAMFUNC void safety_state_rx_hook(safety_state *s, CAN_FIFOMailBox_TypeDef *to_push) {
+  PROFILE_BEGIN();
+  if (SAFETY_ID_LISTED(s->rx_map, to_push->RIR)) s->hooks->rx(s, to_push);
+  PROFILE_END(PROFILE_SAFETY_RX);
 }
 
-int safety_tx_hook(CAN_FIFOMailBox_TypeDef *to_send) {
-  return current_hooks->tx(to_send);
+RAMFUNC int safety_state_tx_hook(safety_state *s, CAN_FIFOMailBox_TypeDef *to_send) {
+  PROFILE_BEGIN();
+  int ret = !SAFETY_ID_LISTED(s->tx_map, to_send->RIR) || s->hooks->tx(s, to_send);
+  PROFILE_END(PROFILE_SAFETY_TX);
+  return ret;
 }
 
-int safety_tx_lin_hook(int lin_num, uint8_t *data, int len){
-  return current_hooks->tx_lin(lin_num, data, len);
+int safety_state_tx_lin_hook(safety_state *s, int lin_num, uint8_t *data, int len) {
+  return s->hooks->tx_lin(s, lin_num, data, len);
 }
 
-int safety_fwd_hook(int bus_num, CAN_FIFOMailBox_TypeDef *to_fwd) {
-  return current_hooks->fwd(bus_num, to_fwd);
+RAMFUNC int safety_state_fwd_hook(safety_state *s, int bus_num, CAN_FIFOMailBox_TypeDef *to_fwd) {
+  return s->hooks->fwd(s, bus_num, to_fwd);
+}
+
+// the firmware's instance
+RAMFUNC void safety_rx_hook(CAN_FIFOMailBox_TypeDef *to_push) {
+  safety_state_rx_hook(&safety, to_push);
+}
+
+RAMFUNC int safety_tx_hook(CAN_FIFOMailBox_TypeDef *to_send) {
+  return safety_state_tx_hook(&safety, to_send);
+}
+
+int safety_tx_lin_hook(int lin_num, uint8_t *data, int len) {
+  return safety_state_tx_lin_hook(&safety, lin_num, data, len);
+}
+
+RAMFUNC int safety_fwd_hook(int bus_num, CAN_FIFOMailBox_TypeDef *to_fwd) {
+  return safety_state_fwd_hook(&safety, bus_num, to_fwd);
 }
 
 typedef struct {
@@ -71,14 +161,21 @@ const safety_hook_config safety_hook_registry[] = {
 
 #define HOOK_CONFIG_COUNT (sizeof(safety_hook_registry)/sizeof(safety_hook_config))
 
-int safety_set_mode(uint16_t mode, int16_t param) {
+// an unknown mode leaves the instance as it was
+int safety_state_set_mode(safety_state *s, uint16_t mode, int16_t param) {
   for (int i = 0; i < HOOK_CONFIG_COUNT; i++) {
     if (safety_hook_registry[i].id == mode) {
-      current_hooks = safety_hook_registry[i].hooks;
-      if (current_hooks->init) current_hooks->init(param);
+      s->hooks = safety_hook_registry[i].hooks;
+      safety_build_map(s->rx_map, s->hooks->rx_ids, s->hooks->rx_ids_len);
+      safety_build_map(s->tx_map, s->hooks->tx_ids, s->hooks->tx_ids_len);
+      if (s->hooks->init) s->hooks->init(s, param);
       return 0;
     }
   }
   return -1;
 }
 
+int safety_set_mode(uint16_t mode, int16_t param) {
+  return safety_state_set_mode(&safety, mode, param);
+}
+
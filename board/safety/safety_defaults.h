@@ -1,20 +1,20 @@
-void default_rx_hook(CAN_FIFOMailBox_TypeDef *to_push) {}
+void default_rx_hook(safety_state *s, CAN_FIFOMailBox_TypeDef *to_push) {}
 
 // *** no output safety mode ***
 
-static void nooutput_init(int16_t param) {
-  controls_allowed = 0;
+static void nooutput_init(safety_state *s, int16_t param) {
+  s->controls_allowed = 0;
 }
 
-static int nooutput_tx_hook(CAN_FIFOMailBox_TypeDef *to_send) {
+static int nooutput_tx_hook(safety_state *s, CAN_FIFOMailBox_TypeDef *to_send) {
   return false;
 }
 
-static int nooutput_tx_lin_hook(int lin_num, uint8_t *data, int len) {
+static int nooutput_tx_lin_hook(safety_state *s, int lin_num, uint8_t *data, int len) {
   return false;
 }
 
-static int nooutput_fwd_hook(int bus_num, CAN_FIFOMailBox_TypeDef *to_fwd) {
+static int nooutput_fwd_hook(safety_state *s, int bus_num, CAN_FIFOMailBox_TypeDef *to_fwd) {
   return -1;
 }
 
@@ -28,19 +28,19 @@ const safety_hooks nooutput_hooks = {
 
 // *** all output safety mode ***
 
-static void alloutput_init(int16_t param) {
-  controls_allowed = 1;
+static void alloutput_init(safety_state *s, int16_t param) {
+  s->controls_allowed = 1;
 }
 
-static int alloutput_tx_hook(CAN_FIFOMailBox_TypeDef *to_send) {
+static int alloutput_tx_hook(safety_state *s, CAN_FIFOMailBox_TypeDef *to_send) {
   return true;
 }
 
-static int alloutput_tx_lin_hook(int lin_num, uint8_t *data, int len) {
+static int alloutput_tx_lin_hook(safety_state *s, int lin_num, uint8_t *data, int len) {
   return true;
 }
 
-static int alloutput_fwd_hook(int bus_num, CAN_FIFOMailBox_TypeDef *to_fwd) {
+static int alloutput_fwd_hook(safety_state *s, int bus_num, CAN_FIFOMailBox_TypeDef *to_fwd) {
   return -1;
 }
 
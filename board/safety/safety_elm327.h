@@ -1,6 +1,6 @@
-static void elm327_rx_hook(CAN_FIFOMailBox_TypeDef *to_push) {}
+static void elm327_rx_hook(safety_state *s, CAN_FIFOMailBox_TypeDef *to_push) {}
 
-static int elm327_tx_hook(CAN_FIFOMailBox_TypeDef *to_send) {
+static int elm327_tx_hook(safety_state *s, CAN_FIFOMailBox_TypeDef *to_send) {
   //All ELM traffic must appear on CAN0
   if(((to_send->RDTR >> 4) & 0xf) != 0) return 0;
   //All ISO 15765-4 messages must be 8 bytes long
@@ -19,7 +19,7 @@ static int elm327_tx_hook(CAN_FIFOMailBox_TypeDef *to_send) {
   return true;
 }
 
-static int elm327_tx_lin_hook(int lin_num, uint8_t *data, int len) {
+static int elm327_tx_lin_hook(safety_state *s, int lin_num, uint8_t *data, int len) {
   if(lin_num != 0) return false; //Only operate on LIN 0, aka serial 2
   if(len < 5 || len > 11) return false; //Valid KWP size
   if(!((data[0] & 0xF8) == 0xC0 && (data[0] & 0x07) > 0 &&
@@ -27,11 +27,11 @@ static int elm327_tx_lin_hook(int lin_num, uint8_t *data, int len) {
   return true;
 }
 
-static void elm327_init(int16_t param) {
-  controls_allowed = 1;
+static void elm327_init(safety_state *s, int16_t param) {
+  s->controls_allowed = 1;
 }
 
-static int elm327_fwd_hook(int bus_num, CAN_FIFOMailBox_TypeDef *to_fwd) {
+static int elm327_fwd_hook(safety_state *s, int bus_num, CAN_FIFOMailBox_TypeDef *to_fwd) {
   return -1;
 }
 
@@ -8,15 +8,11 @@
 //      brake rising edge
 //      brake > 0mph
 
-// gm_: poor man's namespacing
-int gm_brake_prev = 0;
-int gm_gas_prev = 0;
-int gm_speed = 0;
+// the state is in safety_state.gm
 
-// silence everything if stock ECUs are still online
-int gm_ascm_detected = 0;
+const uint16_t gm_rx_ids[] = {842, 715, 481, 241, 417, 189};
 
-static void gm_rx_hook(CAN_FIFOMailBox_TypeDef *to_push) {
+RAMFUNC static void gm_rx_hook(safety_state *s, CAN_FIFOMailBox_TypeDef *to_push) {
 
   uint32_t addr;
   if (to_push->RIR & 4) {
@@ -32,14 +28,14 @@ static void gm_rx_hook(CAN_FIFOMailBox_TypeDef *to_push) {
   // sample speed, really only care if car is moving or not
   // rear left wheel speed
   if (addr == 842) {
-    gm_speed = to_push->RDLR & 0xFFFF;
+    s->gm.speed = to_push->RDLR & 0xFFFF;
   }
 
   // check if stock ASCM ECU is still online
   int bus_number = (to_push->RDTR >> 4) & 0xFF;
   if (bus_number == 0 && addr == 715) {
-    gm_ascm_detected = 1;
-    controls_allowed = 0;
+    s->gm.ascm_detected = 1;
+    s->controls_allowed = 0;
   }
 
   // ACC steering wheel buttons
@@ -47,9 +43,9 @@ static void gm_rx_hook(CAN_FIFOMailBox_TypeDef *to_push) {
     int buttons = (to_push->RDHR >> 12) & 0x7;
     // res/set - enable, cancel button - disable
     if (buttons == 2 || buttons == 3) {
-      controls_allowed = 1;
+      s->controls_allowed = 1;
     } else if (buttons == 6) {
-      controls_allowed = 0;
+      s->controls_allowed = 0;
     }
   }
 
@@ -62,26 +58,26 @@ static void gm_rx_hook(CAN_FIFOMailBox_TypeDef *to_push) {
     if (brake < 10) {
       brake = 0;
     }
-    if (brake && (!gm_brake_prev || gm_speed)) {
-       controls_allowed = 0;
+    if (brake && (!s->gm.brake_prev || s->gm.speed)) {
+       s->controls_allowed = 0;
     }
-    gm_brake_prev = brake;
+    s->gm.brake_prev = brake;
   }
 
   // exit controls on rising edge of gas press
   if (addr == 417) {
     int gas = to_push->RDHR & 0xFF0000;
-    if (gas && !gm_gas_prev) {
-      controls_allowed = 0;
+    if (gas && !s->gm.gas_prev) {
+      s->controls_allowed = 0;
     }
-    gm_gas_prev = gas;
+    s->gm.gas_prev = gas;
   }
 
   // exit controls on regen paddle
   if (addr == 189) {
     int regen = to_push->RDLR & 0x20;
     if (regen) {
-      controls_allowed = 0;
+      s->controls_allowed = 0;
     }
   }
 }
@@ -92,17 +88,17 @@ static void gm_rx_hook(CAN_FIFOMailBox_TypeDef *to_push) {
 // else
 //     block all commands that produce actuation
 
-static int gm_tx_hook(CAN_FIFOMailBox_TypeDef *to_send) {
+RAMFUNC static int gm_tx_hook(safety_state *s, CAN_FIFOMailBox_TypeDef *to_send) {
 
   // There can be only one! (ASCM)
-  if (gm_ascm_detected) {
+  if (s->gm.ascm_detected) {
     return 0;
   }
 
   // disallow actuator commands if gas or brake (with vehicle moving) are pressed
   // and the the latching controls_allowed flag is True
-  int pedal_pressed = gm_gas_prev || (gm_brake_prev && gm_speed);
-  int current_controls_allowed = controls_allowed && !pedal_pressed;
+  int pedal_pressed = s->gm.gas_prev || (s->gm.brake_prev && s->gm.speed);
+  int current_controls_allowed = s->controls_allowed && !pedal_pressed;
 
   uint32_t addr;
   if (to_send->RIR & 4) {
@@ -163,16 +159,16 @@ static int gm_tx_hook(CAN_FIFOMailBox_TypeDef *to_send) {
   return true;
 }
 
-static int gm_tx_lin_hook(int lin_num, uint8_t *data, int len) {
+static int gm_tx_lin_hook(safety_state *s, int lin_num, uint8_t *data, int len) {
   // LIN is not used in Volt
   return false;
 }
 
-static void gm_init(int16_t param) {
-  controls_allowed = 0;
+static void gm_init(safety_state *s, int16_t param) {
+  s->controls_allowed = 0;
 }
 
-static int gm_fwd_hook(int bus_num, CAN_FIFOMailBox_TypeDef *to_fwd) {
+RAMFUNC static int gm_fwd_hook(safety_state *s, int bus_num, CAN_FIFOMailBox_TypeDef *to_fwd) {
   return -1;
 }
 
@@ -182,5 +178,7 @@ const safety_hooks gm_hooks = {
   .tx = gm_tx_hook,
   .tx_lin = gm_tx_lin_hook,
   .fwd = gm_fwd_hook,
+  .rx_ids = gm_rx_ids,
+  .rx_ids_len = sizeof(gm_rx_ids) / sizeof(gm_rx_ids[0]),
 };
 
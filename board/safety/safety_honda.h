@@ -7,22 +7,18 @@
 //      brake rising edge
 //      brake > 0mph
 
-// these are set in the Honda safety hooks...this is the wrong place
+// the state is in safety_state.honda
 const int gas_interceptor_threshold = 328;
-int gas_interceptor_detected = 0;
-int brake_prev = 0;
-int gas_prev = 0;
-int gas_interceptor_prev = 0;
-int ego_speed = 0;
-// TODO: auto-detect bosch hardware based on CAN messages?
-bool bosch_hardware = false;
 
-static void honda_rx_hook(CAN_FIFOMailBox_TypeDef *to_push) {
+const uint16_t honda_rx_ids[] = {0x158, 0x1A6, 0x296, 0x17C, 0x1BE, 0x201};
+const uint16_t honda_tx_ids[] = {0x1FA, 0xE4, 0x194, 0x200};
+
+RAMFUNC static void honda_rx_hook(safety_state *s, CAN_FIFOMailBox_TypeDef *to_push) {
 
   // sample speed
   if ((to_push->RIR>>21) == 0x158) {
     // first 2 bytes
-    ego_speed = to_push->RDLR & 0xFFFF;
+    s->honda.ego_speed = to_push->RDLR & 0xFFFF;
   }
 
   // state machine to enter and exit controls
@@ -30,47 +26,47 @@ static void honda_rx_hook(CAN_FIFOMailBox_TypeDef *to_push) {
   if ((to_push->RIR>>21) == 0x1A6 || (to_push->RIR>>21) == 0x296) {
     int buttons = (to_push->RDLR & 0xE0) >> 5;
     if (buttons == 4 || buttons == 3) {
-      controls_allowed = 1;
+      s->controls_allowed = 1;
     } else if (buttons == 2) {
-      controls_allowed = 0;
+      s->controls_allowed = 0;
     }
   }
 
   // user brake signal is different for nidec vs bosch hardware
   // nidec hardware: 0x17C bit 53
   // bosch hardware: 0x1BE bit 4
-  #define IS_USER_BRAKE_MSG(to_push) (!bosch_hardware ? to_push->RIR>>21 == 0x17C : to_push->RIR>>21 == 0x1BE)
-  #define USER_BRAKE_VALUE(to_push)  (!bosch_hardware ? to_push->RDHR & 0x200000  : to_push->RDLR & 0x10)
+  #define IS_USER_BRAKE_MSG(to_push) (!s->honda.bosch_hardware ? to_push->RIR>>21 == 0x17C : to_push->RIR>>21 == 0x1BE)
+  #define USER_BRAKE_VALUE(to_push)  (!s->honda.bosch_hardware ? to_push->RDHR & 0x200000  : to_push->RDLR & 0x10)
   // exit controls on rising edge of brake press or on brake press when
   // speed > 0
   if (IS_USER_BRAKE_MSG(to_push)) {
     int brake = USER_BRAKE_VALUE(to_push);
-    if (brake && (!(brake_prev) || ego_speed)) {
-      controls_allowed = 0;
+    if (brake && (!(s->honda.brake_prev) || s->honda.ego_speed)) {
+      s->controls_allowed = 0;
     }
-    brake_prev = brake;
+    s->honda.brake_prev = brake;
   }
 
   // exit controls on rising edge of gas press if interceptor (0x201 w/ len = 6)
   // length check because bosch hardware also uses this id (0x201 w/ len = 8)
   if ((to_push->RIR>>21) == 0x201 && (to_push->RDTR & 0xf) == 6) {
-    gas_interceptor_detected = 1;
+    s->honda.gas_interceptor_detected = 1;
     int gas_interceptor = ((to_push->RDLR & 0xFF) << 8) | ((to_push->RDLR & 0xFF00) >> 8);
     if ((gas_interceptor > gas_interceptor_threshold) &&
-        (gas_interceptor_prev <= gas_interceptor_threshold)) {
-      controls_allowed = 0;
+        (s->honda.gas_interceptor_prev <= gas_interceptor_threshold)) {
+      s->controls_allowed = 0;
     }
-    gas_interceptor_prev = gas_interceptor;
+    s->honda.gas_interceptor_prev = gas_interceptor;
   }
 
   // exit controls on rising edge of gas press if no interceptor
-  if (!gas_interceptor_detected) {
+  if (!s->honda.gas_interceptor_detected) {
     if ((to_push->RIR>>21) == 0x17C) {
       int gas = to_push->RDLR & 0xFF;
-      if (gas && !(gas_prev)) {
-        controls_allowed = 0;
+      if (gas && !(s->honda.gas_prev)) {
+        s->controls_allowed = 0;
       }
-      gas_prev = gas;
+      s->honda.gas_prev = gas;
     }
   }
 }
@@ -81,13 +77,13 @@ static void honda_rx_hook(CAN_FIFOMailBox_TypeDef *to_push) {
 // else
 //     block all commands that produce actuation
 
-static int honda_tx_hook(CAN_FIFOMailBox_TypeDef *to_send) {
+RAMFUNC static int honda_tx_hook(safety_state *s, CAN_FIFOMailBox_TypeDef *to_send) {
 
   // disallow actuator commands if gas or brake (with vehicle moving) are pressed
   // and the the latching controls_allowed flag is True
-  int pedal_pressed = gas_prev || (gas_interceptor_prev > gas_interceptor_threshold) ||
-                      (brake_prev && ego_speed);
-  int current_controls_allowed = controls_allowed && !(pedal_pressed);
+  int pedal_pressed = s->honda.gas_prev || (s->honda.gas_interceptor_prev > gas_interceptor_threshold) ||
+                      (s->honda.brake_prev && s->honda.ego_speed);
+  int current_controls_allowed = s->controls_allowed && !(pedal_pressed);
 
   // BRAKE: safety check
   if ((to_send->RIR>>21) == 0x1FA) {
@@ -120,17 +116,17 @@ static int honda_tx_hook(CAN_FIFOMailBox_TypeDef *to_send) {
   return true;
 }
 
-static int honda_tx_lin_hook(int lin_num, uint8_t *data, int len) {
+static int honda_tx_lin_hook(safety_state *s, int lin_num, uint8_t *data, int len) {
   // TODO: add safety if using LIN
   return true;
 }
 
-static void honda_init(int16_t param) {
-  controls_allowed = 0;
-  bosch_hardware = false;
+static void honda_init(safety_state *s, int16_t param) {
+  s->controls_allowed = 0;
+  s->honda.bosch_hardware = false;
 }
 
-static int honda_fwd_hook(int bus_num, CAN_FIFOMailBox_TypeDef *to_fwd) {
+RAMFUNC static int honda_fwd_hook(safety_state *s, int bus_num, CAN_FIFOMailBox_TypeDef *to_fwd) {
   return -1;
 }
 
@@ -140,14 +136,18 @@ const safety_hooks honda_hooks = {
   .tx = honda_tx_hook,
   .tx_lin = honda_tx_lin_hook,
   .fwd = honda_fwd_hook,
+  .rx_ids = honda_rx_ids,
+  .rx_ids_len = sizeof(honda_rx_ids) / sizeof(honda_rx_ids[0]),
+  .tx_ids = honda_tx_ids,
+  .tx_ids_len = sizeof(honda_tx_ids) / sizeof(honda_tx_ids[0]),
 };
 
-static void honda_bosch_init(int16_t param) {
-  controls_allowed = 0;
-  bosch_hardware = true;
+static void honda_bosch_init(safety_state *s, int16_t param) {
+  s->controls_allowed = 0;
+  s->honda.bosch_hardware = true;
 }
 
-static int honda_bosch_fwd_hook(int bus_num, CAN_FIFOMailBox_TypeDef *to_fwd) {
+RAMFUNC static int honda_bosch_fwd_hook(safety_state *s, int bus_num, CAN_FIFOMailBox_TypeDef *to_fwd) {
   if (bus_num == 1 || bus_num == 2) {
     int addr = to_fwd->RIR>>21;
     return addr != 0xE4 && addr != 0x33D ? (uint8_t)(~bus_num & 0x3) : -1;
@@ -161,4 +161,9 @@ const safety_hooks honda_bosch_hooks = {
   .tx = honda_tx_hook,
   .tx_lin = honda_tx_lin_hook,
   .fwd = honda_bosch_fwd_hook,
+  .rx_ids = honda_rx_ids,
+  .rx_ids_len = sizeof(honda_rx_ids) / sizeof(honda_rx_ids[0]),
+  .tx_ids = honda_tx_ids,
+  .tx_ids_len = sizeof(honda_tx_ids) / sizeof(honda_tx_ids[0]),
+  .fwd_buses = (1 << 1) | (1 << 2),
 };
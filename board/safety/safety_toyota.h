@@ -1,6 +1,4 @@
-// track the torque measured for limiting
-int16_t torque_meas[3] = {0, 0, 0};    // last 3 motor torques produced by the eps
-int16_t torque_meas_min = 0, torque_meas_max = 0;
+// the state is in safety_state.toyota, which tracks the torque measured for limiting
 
 // global torque limit
 const int32_t MAX_TORQUE = 1500;       // max torque cmd allowed ever
@@ -20,34 +18,28 @@ const int32_t RT_INTERVAL = 250000;    // 250ms between real time checks
 const int16_t MAX_ACCEL = 1500;        // 1.5 m/s2
 const int16_t MIN_ACCEL = -3000;       // 3.0 m/s2
 
-// global actuation limit state
-int actuation_limits = 1;              // by default steer limits are imposed
-int16_t dbc_eps_torque_factor = 100;   // conversion factor for STEER_TORQUE_EPS in %: see dbc file
+const uint16_t toyota_rx_ids[] = {0x260, 0x1D2};
+const uint16_t toyota_tx_ids[] = {0x343, 0x2E4};
 
-// state of torque limits
-int16_t desired_torque_last = 0;       // last desired steer torque
-int16_t rt_torque_last = 0;            // last desired torque for real time check
-uint32_t ts_last = 0;
-
-static void toyota_rx_hook(CAN_FIFOMailBox_TypeDef *to_push) {
+RAMFUNC static void toyota_rx_hook(safety_state *s, CAN_FIFOMailBox_TypeDef *to_push) {
   // get eps motor torque (0.66 factor in dbc)
   if ((to_push->RIR>>21) == 0x260) {
     int16_t torque_meas_new_16 = (((to_push->RDHR) & 0xFF00) | ((to_push->RDHR >> 16) & 0xFF));
 
     // increase torque_meas by 1 to be conservative on rounding
-    int torque_meas_new = ((int)(torque_meas_new_16) * dbc_eps_torque_factor / 100) + (torque_meas_new_16 > 0 ? 1 : -1);
+    int torque_meas_new = ((int)(torque_meas_new_16) * s->toyota.dbc_eps_torque_factor / 100) + (torque_meas_new_16 > 0 ? 1 : -1);
 
     // shift the array
-    for (int i = sizeof(torque_meas)/sizeof(torque_meas[0]) - 1; i > 0; i--) {
-      torque_meas[i] = torque_meas[i-1];
+    for (int i = sizeof(s->toyota.torque_meas)/sizeof(s->toyota.torque_meas[0]) - 1; i > 0; i--) {
+      s->toyota.torque_meas[i] = s->toyota.torque_meas[i-1];
     }
-    torque_meas[0] = torque_meas_new;
+    s->toyota.torque_meas[0] = torque_meas_new;
 
     // get the minimum and maximum measured torque over the last 3 frames
-    torque_meas_min = torque_meas_max = torque_meas[0];
-    for (int i = 1; i < sizeof(torque_meas)/sizeof(torque_meas[0]); i++) {
-      if (torque_meas[i] < torque_meas_min) torque_meas_min = torque_meas[i];
-      if (torque_meas[i] > torque_meas_max) torque_meas_max = torque_meas[i];
+    s->toyota.torque_meas_min = s->toyota.torque_meas_max = s->toyota.torque_meas[0];
+    for (int i = 1; i < sizeof(s->toyota.torque_meas)/sizeof(s->toyota.torque_meas[0]); i++) {
+      if (s->toyota.torque_meas[i] < s->toyota.torque_meas_min) s->toyota.torque_meas_min = s->toyota.torque_meas[i];
+      if (s->toyota.torque_meas[i] > s->toyota.torque_meas_max) s->toyota.torque_meas_max = s->toyota.torque_meas[i];
     }
   }
 
@@ -55,14 +47,14 @@ static void toyota_rx_hook(CAN_FIFOMailBox_TypeDef *to_push) {
   if ((to_push->RIR>>21) == 0x1D2) {
     // 4 bits: 55-52
     if (to_push->RDHR & 0xF00000) {
-      controls_allowed = 1;
+      s->controls_allowed = 1;
     } else {
-      controls_allowed = 0;
+      s->controls_allowed = 0;
     }
   }
 }
 
-static int toyota_tx_hook(CAN_FIFOMailBox_TypeDef *to_send) {
+RAMFUNC static int toyota_tx_hook(safety_state *s, CAN_FIFOMailBox_TypeDef *to_send) {
 
   // Check if msg is sent on BUS 0
   if (((to_send->RDTR >> 4) & 0xF) == 0) {
@@ -70,11 +62,11 @@ static int toyota_tx_hook(CAN_FIFOMailBox_TypeDef *to_send) {
     // ACCEL: safety check on byte 1-2
     if ((to_send->RIR>>21) == 0x343) {
       int16_t desired_accel = ((to_send->RDLR & 0xFF) << 8) | ((to_send->RDLR >> 8) & 0xFF);
-      if (controls_allowed && actuation_limits) {
+      if (s->controls_allowed && s->toyota.actuation_limits) {
         if ((desired_accel > MAX_ACCEL) || (desired_accel < MIN_ACCEL)) {
           return 0;
         }
-      } else if (!controls_allowed && (desired_accel != 0)) {
+      } else if (!s->controls_allowed && (desired_accel != 0)) {
         return 0;
       }
     }
@@ -87,7 +79,7 @@ static int toyota_tx_hook(CAN_FIFOMailBox_TypeDef *to_send) {
       uint32_t ts = TIM2->CNT;
 
       // only check if controls are allowed and actuation_limits are imposed
-      if (controls_allowed && actuation_limits) {
+      if (s->controls_allowed && s->toyota.actuation_limits) {
 
         // *** global torque limit check ***
         if (desired_torque < -MAX_TORQUE) violation = 1;
@@ -95,12 +87,12 @@ static int toyota_tx_hook(CAN_FIFOMailBox_TypeDef *to_send) {
 
 
         // *** torque rate limit check ***
-        int16_t highest_allowed_torque = max(desired_torque_last, 0) + MAX_RATE_UP;
-        int16_t lowest_allowed_torque = min(desired_torque_last, 0) - MAX_RATE_UP;
+        int16_t highest_allowed_torque = max(s->toyota.desired_torque_last, 0) + MAX_RATE_UP;
+        int16_t lowest_allowed_torque = min(s->toyota.desired_torque_last, 0) - MAX_RATE_UP;
 
         // if we've exceeded the applied torque, we must start moving toward 0
-        highest_allowed_torque = min(highest_allowed_torque, max(desired_torque_last - MAX_RATE_DOWN, max(torque_meas_max, 0) + MAX_TORQUE_ERROR));
-        lowest_allowed_torque = max(lowest_allowed_torque, min(desired_torque_last + MAX_RATE_DOWN, min(torque_meas_min, 0) - MAX_TORQUE_ERROR));
+        highest_allowed_torque = min(highest_allowed_torque, max(s->toyota.desired_torque_last - MAX_RATE_DOWN, max(s->toyota.torque_meas_max, 0) + MAX_TORQUE_ERROR));
+        lowest_allowed_torque = max(lowest_allowed_torque, min(s->toyota.desired_torque_last + MAX_RATE_DOWN, min(s->toyota.torque_meas_min, 0) - MAX_TORQUE_ERROR));
 
         // check for violation
         if ((desired_torque < lowest_allowed_torque) || (desired_torque > highest_allowed_torque)) {
@@ -108,12 +100,12 @@ static int toyota_tx_hook(CAN_FIFOMailBox_TypeDef *to_send) {
         }
 
         // used next time
-        desired_torque_last = desired_torque;
+        s->toyota.desired_torque_last = desired_torque;
 
 
         // *** torque real time rate limit check ***
-        int16_t highest_rt_torque = max(rt_torque_last, 0) + MAX_RT_DELTA;
-        int16_t lowest_rt_torque = min(rt_torque_last, 0) - MAX_RT_DELTA;
+        int16_t highest_rt_torque = max(s->toyota.rt_torque_last, 0) + MAX_RT_DELTA;
+        int16_t lowest_rt_torque = min(s->toyota.rt_torque_last, 0) - MAX_RT_DELTA;
 
         // check for violation
         if ((desired_torque < lowest_rt_torque) || (desired_torque > highest_rt_torque)) {
@@ -121,23 +113,23 @@ static int toyota_tx_hook(CAN_FIFOMailBox_TypeDef *to_send) {
         }
 
         // every RT_INTERVAL set the new limits
-        uint32_t ts_elapsed = ts > ts_last ? ts - ts_last : (0xFFFFFFFF - ts_last) + 1 + ts;
+        uint32_t ts_elapsed = ts > s->toyota.ts_last ? ts - s->toyota.ts_last : (0xFFFFFFFF - s->toyota.ts_last) + 1 + ts;
         if (ts_elapsed > RT_INTERVAL) {
-          rt_torque_last = desired_torque;
-          ts_last = ts;
+          s->toyota.rt_torque_last = desired_torque;
+          s->toyota.ts_last = ts;
         }
       }
       
       // no torque if controls is not allowed
-      if (!controls_allowed && (desired_torque != 0)) {
+      if (!s->controls_allowed && (desired_torque != 0)) {
         violation = 1;
       }
 
       // reset to 0 if either controls is not allowed or there's a violation
-      if (violation || !controls_allowed) {
-        desired_torque_last = 0;
-        rt_torque_last = 0;
-        ts_last = ts;
+      if (violation || !s->controls_allowed) {
+        s->toyota.desired_torque_last = 0;
+        s->toyota.rt_torque_last = 0;
+        s->toyota.ts_last = ts;
       }
 
       if (violation) {
@@ -150,18 +142,18 @@ static int toyota_tx_hook(CAN_FIFOMailBox_TypeDef *to_send) {
   return true;
 }
 
-static int toyota_tx_lin_hook(int lin_num, uint8_t *data, int len) {
+static int toyota_tx_lin_hook(safety_state *s, int lin_num, uint8_t *data, int len) {
   // TODO: add safety if using LIN
   return true;
 }
 
-static void toyota_init(int16_t param) {
-  controls_allowed = 0;
-  actuation_limits = 1;
-  dbc_eps_torque_factor = param;
+static void toyota_init(safety_state *s, int16_t param) {
+  s->controls_allowed = 0;
+  s->toyota.actuation_limits = 1;
+  s->toyota.dbc_eps_torque_factor = param;
 }
 
-static int toyota_fwd_hook(int bus_num, CAN_FIFOMailBox_TypeDef *to_fwd) {
+RAMFUNC static int toyota_fwd_hook(safety_state *s, int bus_num, CAN_FIFOMailBox_TypeDef *to_fwd) {
   return -1;
 }
 
@@ -171,12 +163,16 @@ const safety_hooks toyota_hooks = {
   .tx = toyota_tx_hook,
   .tx_lin = toyota_tx_lin_hook,
   .fwd = toyota_fwd_hook,
+  .rx_ids = toyota_rx_ids,
+  .rx_ids_len = sizeof(toyota_rx_ids) / sizeof(toyota_rx_ids[0]),
+  .tx_ids = toyota_tx_ids,
+  .tx_ids_len = sizeof(toyota_tx_ids) / sizeof(toyota_tx_ids[0]),
 };
 
-static void toyota_nolimits_init(int16_t param) {
-  controls_allowed = 0;
-  actuation_limits = 0;
-  dbc_eps_torque_factor = param;
+static void toyota_nolimits_init(safety_state *s, int16_t param) {
+  s->controls_allowed = 0;
+  s->toyota.actuation_limits = 0;
+  s->toyota.dbc_eps_torque_factor = param;
 }
 
 const safety_hooks toyota_nolimits_hooks = {
@@ -185,4 +181,8 @@ const safety_hooks toyota_nolimits_hooks = {
   .tx = toyota_tx_hook,
   .tx_lin = toyota_tx_lin_hook,
   .fwd = toyota_fwd_hook,
+  .rx_ids = toyota_rx_ids,
+  .rx_ids_len = sizeof(toyota_rx_ids) / sizeof(toyota_rx_ids[0]),
+  .tx_ids = toyota_tx_ids,
+  .tx_ids_len = sizeof(toyota_tx_ids) / sizeof(toyota_tx_ids[0]),
 };
@@ -2,6 +2,101 @@
 uint32_t *prog_ptr = NULL;
 int unlocked = 0;
 
+// what the flasher does beyond the 16 byte chunks, in the 0xb0 echo
+#define FLASHER_PIPELINED 1 // USB packets are queued, so the next arrives while one programs
+#define FLASHER_CRC 2       // 0xb3
+#define FLASHER_CAN_BLOCK 4 // the canloader takes ISO-TP requests of 0x400 byte ep2 writes
+#define FLASHER_DIFF 8      // 0xb4-0xb6, see below
+#define FLASHER_CRC_HW 16   // 0xb3 with wIndex 1 gives the CRC unit's own CRC, see drivers/crc.h
+
+// USB packets wait here for the main loop to program them a word at a time,
+// while the OTG core takes the next one. ep2 NAKs while they're all taken.
+#define FLASH_SLOTS 4
+uint32_t flash_slots[FLASH_SLOTS][0x40/4];
+int flash_slot_len[FLASH_SLOTS]; // in words
+volatile uint32_t flash_slot_w = 0;
+volatile uint32_t flash_slot_r = 0;
+int flash_slot_pos = 0;
+
+// Differential updates: 0xb4 has the CRC-32s of the app's FLASH_DIFF_BLOCK
+// byte blocks, and the host sends only those that differ. A sector is only
+// erased whole, so 0xb5 loads the block's sector into diff_buf and ep2 data
+// goes there from the block on, until 0xb6, or a block of another sector,
+// erases it and programs it back. Sectors that aren't written to are left
+// alone. Only the 16K sectors after the bootstub, 1-3.
+#define FLASH_DIFF_BLOCK 0x400
+#define FLASH_DIFF_SECTOR 0x4000
+#define FLASH_DIFF_SECTOR_MAX 3
+#define FLASH_DIFF_BLOCKS ((((FLASH_DIFF_SECTOR_MAX + 1) * FLASH_DIFF_SECTOR) - 0x4000) / FLASH_DIFF_BLOCK)
+// what fits a response after the 0xc bytes
+#define FLASH_DIFF_CRCS ((MAX_RESP_LEN - 0xc) / 4)
+
+uint32_t diff_buf[FLASH_DIFF_SECTOR/4];
+int diff_sector = 0; // loaded in diff_buf, 0 for none
+uint32_t *diff_ptr = NULL; // where ep2 words go while one is
+
+void flash_program(uint32_t word) {
+  if (diff_ptr != NULL) {
+    // past the sector is dropped, the host checks the CRCs after
+    if (diff_ptr < &diff_buf[FLASH_DIFF_SECTOR/4]) {
+      *diff_ptr = word;
+      diff_ptr++;
+    }
+    return;
+  }
+  // x32 parallelism, one word a write
+  FLASH->CR = FLASH_CR_PSIZE_1 | FLASH_CR_PG;
+  *prog_ptr = word;
+  while (FLASH->SR & FLASH_SR_BSY);
+  prog_ptr++;
+}
+
+// programs the next queued word, 0 if there is none
+int flash_program_queued() {
+  int ret = 0;
+  enter_critical_section();
+  if (flash_slot_r != flash_slot_w) {
+    int slot = flash_slot_r % FLASH_SLOTS;
+    flash_program(flash_slots[slot][flash_slot_pos]);
+    flash_slot_pos += 1;
+    if (flash_slot_pos >= flash_slot_len[slot]) {
+      flash_slot_pos = 0;
+      flash_slot_r += 1;
+      usb_ep2_resume();
+    }
+    ret = 1;
+  }
+  exit_critical_section();
+  return ret;
+}
+
+// 0 for the bootstub's and those past the flash
+int flash_erase(int sec) {
+  if (sec == 0 || sec >= 12 || !unlocked) return 0;
+  FLASH->CR = (sec << 3) | FLASH_CR_SER;
+  FLASH->CR |= FLASH_CR_STRT;
+  while (FLASH->SR & FLASH_SR_BSY);
+  return 1;
+}
+
+// erases the sector in diff_buf and programs it back, 0 if it doesn't read back
+int flash_diff_commit() {
+  if (diff_sector == 0) return 1;
+  while (flash_program_queued());
+  diff_ptr = NULL;
+  int sec = diff_sector;
+  uint32_t *sec_start = (uint32_t *)(0x8000000 + (sec * FLASH_DIFF_SECTOR));
+  diff_sector = 0;
+  if (!flash_erase(sec)) return 0;
+  uint32_t *save = prog_ptr;
+  prog_ptr = sec_start;
+  for (int i = 0; i < FLASH_DIFF_SECTOR/4; i++) {
+    flash_program(diff_buf[i]);
+  }
+  prog_ptr = save;
+  return memcmp(sec_start, diff_buf, FLASH_DIFF_SECTOR) == 0;
+}
+
 void debug_ring_callback(uart_ring *ring) {}
 
 int usb_cb_control_msg(USB_Setup_TypeDef *setup, uint8_t *resp, int hardwired) {
@@ -18,9 +113,14 @@ int usb_cb_control_msg(USB_Setup_TypeDef *setup, uint8_t *resp, int hardwired) {
 
   int sec;
   switch (setup->b.bRequest) {
-    // **** 0xb0: flasher echo
+    // **** 0xb0: flasher echo, with what it can do after the 0xc bytes
     case 0xb0:
       resp[1] = 0xff;
+      *((uint32_t *)&resp[0xc]) = FLASHER_PIPELINED | FLASHER_CRC | FLASHER_DIFF | FLASHER_CRC_HW;
+      #ifdef PEDAL
+        *((uint32_t *)&resp[0xc]) |= FLASHER_CAN_BLOCK;
+      #endif
+      resp_len = 0x10;
       break;
     // **** 0xb1: unlock flash
     case 0xb1:
@@ -32,15 +132,64 @@ int usb_cb_control_msg(USB_Setup_TypeDef *setup, uint8_t *resp, int hardwired) {
       set_led(LED_GREEN, 1);
       unlocked = 1;
       prog_ptr = (uint32_t *)0x8004000;
+      diff_sector = 0;
+      diff_ptr = NULL;
       break;
     // **** 0xb2: erase sector
     case 0xb2:
       sec = setup->b.wValue.w;
       // don't erase the bootloader
-      if (sec != 0 && sec < 12 && unlocked) {
-        FLASH->CR = (sec << 3) | FLASH_CR_SER;
-        FLASH->CR |= FLASH_CR_STRT;
-        while (FLASH->SR & FLASH_SR_BSY);
+      if (flash_erase(sec)) {
+        resp[1] = 0xff;
+      }
+      break;
+    // **** 0xb3: CRC-32 of what was programmed since the unlock, after the 0xc bytes
+    // wIndex 1 for the CRC unit's CRC-32/MPEG-2, fed by DMA
+    case 0xb3:
+      if (unlocked) {
+        while (flash_program_queued());
+        uint32_t crc;
+        if (setup->b.wIndex.w == 1) {
+          crc = crc32_hw((uint32_t *)0x8004000, prog_ptr - (uint32_t *)0x8004000);
+        } else {
+          crc = crc32((uint8_t *)0x8004000, (uint8_t *)prog_ptr - (uint8_t *)0x8004000);
+        }
+        memcpy(resp+0xc, &crc, 4);
+        resp[1] = 0xff;
+        resp_len = 0x10;
+      }
+      break;
+    // **** 0xb4: CRC-32s of the FLASH_DIFF_BLOCKs from wValue, wIndex of them up to FLASH_DIFF_CRCS, after the 0xc bytes
+    case 0xb4:
+      if (setup->b.wValue.w < FLASH_DIFF_BLOCKS) {
+        int n = min(min(setup->b.wIndex.w, FLASH_DIFF_CRCS), FLASH_DIFF_BLOCKS - setup->b.wValue.w);
+        for (int i = 0; i < n; i++) {
+          uint32_t crc = crc32((uint8_t *)0x8004000 + ((setup->b.wValue.w + i) * FLASH_DIFF_BLOCK), FLASH_DIFF_BLOCK);
+          memcpy(resp + 0xc + (i * 4), &crc, 4);
+        }
+        resp[1] = 0xff;
+        resp_len = 0xc + (n * 4);
+      }
+      break;
+    // **** 0xb5: ep2 writes go to block wValue, of the sector then loaded in diff_buf
+    case 0xb5:
+      if (unlocked && setup->b.wValue.w < FLASH_DIFF_BLOCKS) {
+        while (flash_program_queued());
+        uint32_t offset = 0x4000 + (setup->b.wValue.w * FLASH_DIFF_BLOCK);
+        sec = offset / FLASH_DIFF_SECTOR;
+        if ((sec != diff_sector) && flash_diff_commit()) {
+          memcpy(diff_buf, (void *)(0x8000000 + (sec * FLASH_DIFF_SECTOR)), FLASH_DIFF_SECTOR);
+          diff_sector = sec;
+        }
+        if (sec == diff_sector) {
+          diff_ptr = &diff_buf[(offset % FLASH_DIFF_SECTOR) / 4];
+          resp[1] = 0xff;
+        }
+      }
+      break;
+    // **** 0xb6: program the sector in diff_buf back
+    case 0xb6:
+      if (unlocked && flash_diff_commit()) {
         resp[1] = 0xff;
       }
       break;
@@ -84,6 +233,8 @@ int usb_cb_control_msg(USB_Setup_TypeDef *setup, uint8_t *resp, int hardwired) {
       break;
     // **** 0xd8: reset ST
     case 0xd8:
+      while (flash_program_queued());
+      flash_diff_commit();
       NVIC_SystemReset();
       break;
   }
@@ -91,7 +242,10 @@ int usb_cb_control_msg(USB_Setup_TypeDef *setup, uint8_t *resp, int hardwired) {
 }
 
 int usb_cb_ep1_in(uint8_t *usbdata, int len, int hardwired) { return 0; }
+int usb_cb_ep2_in(uint8_t *usbdata, int len, int hardwired) { return 0; }
 void usb_cb_ep3_out(uint8_t *usbdata, int len, int hardwired) { }
+void usb_cb_ep1_out(uint8_t *usbdata, int len, int hardwired) { }
+void usb_cb_sof() { }
 
 int is_enumerated = 0;
 void usb_cb_enumeration_complete() {
@@ -99,37 +253,45 @@ void usb_cb_enumeration_complete() {
   is_enumerated = 1;
 }
 
+// USB queues its packets, SPI can't be held off so it programs right away
 void usb_cb_ep2_out(uint8_t *usbdata, int len, int hardwired) {
   set_led(LED_RED, 0);
-  for (int i = 0; i < len/4; i++) {
-    // program byte 1
-    FLASH->CR = FLASH_CR_PSIZE_1 | FLASH_CR_PG;
-
-    *prog_ptr = *(uint32_t*)(usbdata+(i*4));
-    while (FLASH->SR & FLASH_SR_BSY);
-
-    //*(uint64_t*)(&spi_tx_buf[0x30+(i*4)]) = *prog_ptr;
-    prog_ptr++;
+  if (hardwired && len <= 0x40) {
+    int slot = flash_slot_w % FLASH_SLOTS;
+    memcpy(flash_slots[slot], usbdata, len);
+    flash_slot_len[slot] = len/4;
+    flash_slot_w += 1;
+    if (flash_slot_w - flash_slot_r == FLASH_SLOTS) usb_ep2_pause();
+  } else {
+    while (flash_program_queued());
+    for (int i = 0; i < len/4; i++) {
+      flash_program(*(uint32_t*)(usbdata+(i*4)));
+    }
   }
   set_led(LED_RED, 1);
 }
 
 
-int spi_cb_rx(uint8_t *data, int len, uint8_t *data_out) {
+int spi_cb_rx(uint8_t endpoint, uint8_t *dat, int len, uint8_t *data_out, int max_out) {
   int resp_len = 0;
-  switch (data[0]) {
+  switch (endpoint) {
     case 0:
       // control transfer
-      resp_len = usb_cb_control_msg((USB_Setup_TypeDef *)(data+4), data_out, 0);
+      resp_len = usb_cb_control_msg((USB_Setup_TypeDef *)dat, data_out, 0);
       break;
     case 2:
       // ep 2, flash!
-      usb_cb_ep2_out(data+4, data[2], 0);
+      usb_cb_ep2_out(dat, len, 0);
       break;
   }
   return resp_len;
 }
 
+// the flasher has no CAN data for the ESP
+int spi_cb_data_ready() {
+  return 0;
+}
+
 #ifdef PEDAL
 
 #define CAN CAN1
@@ -137,31 +299,39 @@ int spi_cb_rx(uint8_t *data, int len, uint8_t *data_out) {
 #define CAN_BL_INPUT 0x1
 #define CAN_BL_OUTPUT 0x2
 
+// The flow control the canloader answers a first frame with. The whole
+// request fits the buffer and each consecutive frame is only a copy, so the
+// host can send them all back to back.
+#define CAN_BL_BLOCK_SIZE 0
+#define CAN_BL_STMIN 0
+
 void CAN1_TX_IRQHandler() {
-  // clear interrupt
-  CAN->TSR |= CAN_TSR_RQCP0;
+  // clear interrupt, of all three mailboxes
+  CAN->TSR = CAN_TSR_RQCP0 | CAN_TSR_RQCP1 | CAN_TSR_RQCP2;
 }
 
-#define ISOTP_BUF_SIZE 0x110
+// a v1 SPI request header and a 0x400 byte ep2 write
+#define ISOTP_BUF_SIZE 0x410
+#define ISOTP_BUF_OUT_SIZE 0x110
 
 uint8_t isotp_buf[ISOTP_BUF_SIZE];
 uint8_t *isotp_buf_ptr = NULL;
 int isotp_buf_remain = 0;
 
-uint8_t isotp_buf_out[ISOTP_BUF_SIZE];
+uint8_t isotp_buf_out[ISOTP_BUF_OUT_SIZE];
 uint8_t *isotp_buf_out_ptr = NULL;
 int isotp_buf_out_remain = 0;
 int isotp_buf_out_idx = 0;
 
 void bl_can_send(uint8_t *odat) {
-  // wait for send
-  while (!(CAN->TSR & CAN_TSR_TME0));
-
-  // send continue
-  CAN->sTxMailBox[0].TDLR = ((uint32_t*)odat)[0];
-  CAN->sTxMailBox[0].TDHR = ((uint32_t*)odat)[1];
-  CAN->sTxMailBox[0].TDTR = 8;
-  CAN->sTxMailBox[0].TIR = (CAN_BL_OUTPUT << 21) | 1;
+  // wait for a free mailbox, with TXFP they go in the order they're filled
+  while (!(CAN->TSR & CAN_TSR_TME));
+  int mailbox = (CAN->TSR & CAN_TSR_CODE) >> 24;
+
+  CAN->sTxMailBox[mailbox].TDLR = ((uint32_t*)odat)[0];
+  CAN->sTxMailBox[mailbox].TDHR = ((uint32_t*)odat)[1];
+  CAN->sTxMailBox[mailbox].TDTR = 8;
+  CAN->sTxMailBox[mailbox].TIR = (CAN_BL_OUTPUT << 21) | 1;
 }
 
 void CAN1_RX0_IRQHandler() {
@@ -173,12 +343,10 @@ void CAN1_RX0_IRQHandler() {
       uint8_t odat[8];
       uint8_t type = dat[0] & 0xF0;
       if (type == 0x30) {
-        // continue
-        while (isotp_buf_out_remain > 0) {
-          // wait for send
-          while (!(CAN->TSR & CAN_TSR_TME0));
-
-          odat[0] = 0x20 | isotp_buf_out_idx;
+        // continue, a block of the host's block size, 0 is all of it
+        int block_size = dat[1];
+        for (int i = 0; (isotp_buf_out_remain > 0) && ((block_size == 0) || (i < block_size)); i++) {
+          odat[0] = 0x20 | (isotp_buf_out_idx & 0xF);
           memcpy(odat+1, isotp_buf_out_ptr, 7);
           isotp_buf_out_remain -= 7;
           isotp_buf_out_ptr += 7;
@@ -193,11 +361,11 @@ void CAN1_RX0_IRQHandler() {
           isotp_buf_remain -= 7;
         }
         if (isotp_buf_remain <= 0) {
-          int len = isotp_buf_ptr - isotp_buf + isotp_buf_remain;
-
           // call the function
-          memset(isotp_buf_out, 0, ISOTP_BUF_SIZE);
-          isotp_buf_out_remain = spi_cb_rx(isotp_buf, len, isotp_buf_out);
+          memset(isotp_buf_out, 0, ISOTP_BUF_OUT_SIZE);
+          // same layout as a v1 SPI request
+          int len = isotp_buf[2] | (isotp_buf[3] << 8);
+          isotp_buf_out_remain = spi_cb_rx(isotp_buf[0], isotp_buf+4, len, isotp_buf_out, ISOTP_BUF_OUT_SIZE);
           isotp_buf_out_ptr = isotp_buf_out;
           isotp_buf_out_idx = 0;
 
@@ -230,6 +398,8 @@ void CAN1_RX0_IRQHandler() {
 
         memset(odat, 0, 8);
         odat[0] = 0x30;
+        odat[1] = CAN_BL_BLOCK_SIZE;
+        odat[2] = CAN_BL_STMIN;
         bl_can_send(odat);
       }
     }
@@ -244,6 +414,9 @@ void CAN1_SCE_IRQHandler() {
 
 #endif
 
+// the blink delays are cut up so queued packets don't wait long
+#define FLASHER_BLINK_SLICES 100
+
 void soft_flasher_start() {
   puts("\n\n\n************************ FLASHER START ************************\n");
 
@@ -253,6 +426,7 @@ void soft_flasher_start() {
   RCC->APB2ENR |= RCC_APB2ENR_SPI1EN;
   RCC->AHB2ENR |= RCC_AHB2ENR_OTGFSEN;
   RCC->APB1ENR |= RCC_APB1ENR_USART2EN;
+  crc_init();
 
 // pedal has the canloader
 #ifdef PEDAL
@@ -263,8 +437,9 @@ void soft_flasher_start() {
   set_gpio_alternate(GPIOB, 9, GPIO_AF9_CAN1);
   set_can_enable(CAN1, 1);
 
-  // init can
+  // init can, TXFP for the consecutive frames in all three mailboxes
   can_silent = ALL_CAN_LIVE;
+  can_tx_in_order = 1;
   can_init(0);
 #endif
 
@@ -304,11 +479,14 @@ void soft_flasher_start() {
       set_usb_power_mode(USB_POWER_CDP);
       set_led(LED_BLUE, 1);
     }
-    // blink the green LED fast
-    set_led(LED_GREEN, 0);
-    delay(500000);
-    set_led(LED_GREEN, 1);
-    delay(500000);
+    // blink the green LED fast, programming what USB queued in the delays
+    for (int i = 0; i < 2; i++) {
+      set_led(LED_GREEN, i);
+      for (int j = 0; j < FLASHER_BLINK_SLICES; j++) {
+        while (flash_program_queued());
+        delay(500000 / FLASHER_BLINK_SLICES);
+      }
+    }
   }
 }
 
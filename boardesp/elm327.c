@@ -28,6 +28,8 @@ int ICACHE_FLASH_ATTR spi_comm(char *dat, int len, uint32_t *recvData, int recvD
 
 const static char hex_lookup[] = {'0', '1', '2', '3', '4', '5', '6', '7',
                                   '8', '9', 'A', 'B', 'C', 'D', 'E', 'F'};
+//"00" to "FF", filled in from hex_lookup by elm327_init
+static char hex_pair_lookup[256][2];
 
 typedef struct __attribute__((packed)) {
   bool tx       : 1;
@@ -54,6 +56,7 @@ typedef struct __attribute__((packed)) {
 
 typedef struct _elm_tcp_conn {
   struct espconn *conn;
+  uint32_t tx_pos; //Bytes of elm_tx_ring handed to this connection so far
   struct _elm_tcp_conn *next;
 } elm_tcp_conn_t;
 
@@ -89,12 +92,29 @@ static uint16 stripped_msg_len = 0;
 static char in_msg[0x100];
 static uint16 in_msg_len = 0;
 
-static char rsp_buff[536]; //TCP min MTU
-static uint16 rsp_buff_len = 0;
+//Responses are formatted once into a ring shared by every connection. Bytes
+//between elm_tx_ready and elm_tx_head are still being accumulated, they go out
+//when a full segment is there, on a prompt, or ELM_TX_DEADLINE_MS after the
+//first of them. Each connection sends from its own tx_pos, so a slow one
+//doesn't hold the others up. Positions count up forever, the ring index is
+//the position masked.
+#define ELM_TCP_MSS 536 //TCP min MTU
+#define ELM_TX_RING_LEN 0x800 //Power of 2
+#define ELM_TX_DEADLINE_MS 10
+
+static char elm_tx_ring[ELM_TX_RING_LEN];
+static uint32_t elm_tx_head = 0;
+static uint32_t elm_tx_ready = 0;
+static volatile os_timer_t elm_tx_deadline;
 
 static uint8_t pandaSendData[0x14] = {0};
 static uint32_t pandaRecvData[0x40] = {0};
 static uint32_t pandaRecvDataDummy[0x40] = {0}; // Used for CAN write operations (no received data)
+static uint32_t pandaRecvDataBulk[0x400/4]; // SPI v2 CAN reads
+
+//See proxy.c
+extern int spi_version;
+int ICACHE_FLASH_ATTR spi_comm_v2(uint8_t endpoint, const char *dat, int len, char *resp, int max_resp);
 
 #define ELM_MODE_SELECTED_PROTOCOL_DEFAULT 6
 #define ELM_MODE_TIMEOUT_DEFAULT 20;
@@ -118,53 +138,107 @@ bool lin_bus_initialized = false;
  *** (for sending data back to the terminal) ***
  ***********************************************/
 
-// All ELM operations are global, so send data out to all connections
-void ICACHE_FLASH_ATTR elm_tcp_tx_flush() {
-  if(!rsp_buff_len) return; // Was causing small error messages
+static void ICACHE_FLASH_ATTR elm_tcp_conn_remove(elm_tcp_conn_t *conn) {
+  if(conn == connection_list) {
+    connection_list = conn->next;
+  } else {
+    for(elm_tcp_conn_t *iter = connection_list; iter != NULL; iter = iter->next)
+      if(iter->next == conn) {
+        iter->next = conn->next;
+        break;
+      }
+  }
+  os_free(conn);
+}
 
-  for(elm_tcp_conn_t *iter = connection_list; iter != NULL; iter = iter->next){
-    int8_t err = espconn_send(iter->conn, rsp_buff, rsp_buff_len);
-    if(err){
-      os_printf("  Wifi %p TX error code %d\n", iter->conn, err);
+//Hand every connection what it hasn't sent of the ready data, one segment per
+//send. espconn copies the data, so the ring can be written again right away.
+//A connection with a full send queue picks up from its cursor in elm_tcp_sent_cb.
+static void ICACHE_FLASH_ATTR elm_tcp_tx_kick() {
+  elm_tcp_conn_t *next;
+  for(elm_tcp_conn_t *iter = connection_list; iter != NULL; iter = next){
+    next = iter->next;
+    while(iter->tx_pos != elm_tx_ready) {
+      uint16_t off = iter->tx_pos & (ELM_TX_RING_LEN-1);
+      uint16_t len = min(min(elm_tx_ready - iter->tx_pos, ELM_TCP_MSS), ELM_TX_RING_LEN - off);
+      int8_t err = espconn_send(iter->conn, elm_tx_ring + off, len);
       if(err == ESPCONN_ARG) {
-        if(iter == connection_list) {
-          connection_list = iter->next;
-        } else {
-          for(elm_tcp_conn_t *iter2 = connection_list; iter2 != NULL; iter2 = iter2->next)
-            if(iter2->next == iter) {
-              iter2->next = iter->next;
-              break;
-            }
-        }
         os_printf("  deleting orphaned connection. iter: %p; conn: %p\n", iter, iter->conn);
-        os_free(iter);
+        elm_tcp_conn_remove(iter);
+        break;
+      }
+      if(err){
+        if(err != ESPCONN_MAXNUM) os_printf("  Wifi %p TX error code %d\n", iter->conn, err);
+        break;
       }
+      iter->tx_pos += len;
     }
   }
-  rsp_buff_len = 0;
 }
 
-static void ICACHE_FLASH_ATTR elm_append_rsp(const char *data, uint16_t len) {
-  uint16_t overflow_len = 0;
-  if(rsp_buff_len + len > sizeof(rsp_buff)) {
-    overflow_len = rsp_buff_len + len - sizeof(rsp_buff);
-    len = sizeof(rsp_buff) - rsp_buff_len;
+// All ELM operations are global, so send data out to all connections
+void ICACHE_FLASH_ATTR elm_tcp_tx_flush() {
+  os_timer_disarm(&elm_tx_deadline);
+  if(elm_tx_ready == elm_tx_head) return; // Was causing small error messages
+
+  elm_tx_ready = elm_tx_head;
+  elm_tcp_tx_kick();
+}
+
+static void ICACHE_FLASH_ATTR elm_tx_deadline_cb(void *arg) {
+  elm_tcp_tx_flush();
+}
+
+static void ICACHE_FLASH_ATTR elm_tcp_sent_cb(void *arg) {
+  elm_tcp_tx_kick();
+}
+
+//Copies into the ring a segment at most at a time, flushing full segments.
+static void ICACHE_FLASH_ATTR elm_tx_write(const char *data, uint16_t len) {
+  while(len) {
+    if(elm_tx_head == elm_tx_ready) {
+      os_timer_disarm(&elm_tx_deadline);
+      os_timer_setfn(&elm_tx_deadline, (os_timer_func_t *)elm_tx_deadline_cb, NULL);
+      os_timer_arm(&elm_tx_deadline, ELM_TX_DEADLINE_MS, 0);
+    }
+    uint16_t chunk = min(len, ELM_TCP_MSS - (elm_tx_head - elm_tx_ready));
+
+    //Don't overwrite what a connection hasn't sent yet. One that fell a whole
+    //ring behind skips to the newest ready data.
+    for(elm_tcp_conn_t *iter = connection_list; iter != NULL; iter = iter->next)
+      if(elm_tx_head + chunk - iter->tx_pos > ELM_TX_RING_LEN) {
+        os_printf("  Wifi %p too slow, dropping %d bytes\n", iter->conn, elm_tx_ready - iter->tx_pos);
+        iter->tx_pos = elm_tx_ready;
+      }
+
+    uint16_t off = elm_tx_head & (ELM_TX_RING_LEN-1);
+    uint16_t first = min(chunk, ELM_TX_RING_LEN - off);
+    memcpy(elm_tx_ring + off, data, first);
+    memcpy(elm_tx_ring, data + first, chunk - first);
+    elm_tx_head += chunk;
+    data += chunk;
+    len -= chunk;
+
+    if(elm_tx_head - elm_tx_ready >= ELM_TCP_MSS)
+      elm_tcp_tx_flush();
   }
+}
+
+static void ICACHE_FLASH_ATTR elm_append_rsp(const char *data, uint16_t len) {
   if(!elm_mode_linefeed) {
-    memcpy(rsp_buff + rsp_buff_len, data, len);
-    rsp_buff_len += len;
-  } else {
-    for(int i=0; i < len && rsp_buff_len < sizeof(rsp_buff); i++){
-      rsp_buff[rsp_buff_len++] = data[i];
-      if(data[i] == '\r' && rsp_buff_len < sizeof(rsp_buff))
-        rsp_buff[rsp_buff_len++] = '\n';
-    }
+    elm_tx_write(data, len);
+    return;
   }
-  if(overflow_len) {
-    os_printf("Packet full, sending\n");
-    elm_tcp_tx_flush();
-    elm_append_rsp(data + len, overflow_len);
+
+  uint16_t start = 0;
+  for(int i=0; i < len; i++){
+    if(data[i] == '\r') {
+      elm_tx_write(data + start, i + 1 - start);
+      elm_tx_write("\n", 1);
+      start = i + 1;
+    }
   }
+  elm_tx_write(data + start, len - start);
 }
 
 #define elm_append_rsp_const(str) elm_append_rsp(str, sizeof(str)-1)
@@ -217,6 +291,26 @@ static int ICACHE_FLASH_ATTR panda_usbemu_ctrl_write(uint8_t request_type, uint8
 #define panda_kline_wakeup_pulse() panda_usbemu_ctrl_write(0x40, 0xf0, 0, 0, 0)
 #define panda_clear_can_rx() panda_usbemu_ctrl_write(0x40, 0xf1, 0xFFFF, 0, 0)
 #define panda_clear_lin_txrx() panda_usbemu_ctrl_write(0x40, 0xf2, 2, 0, 0)
+#define panda_clear_can0_filters() panda_usbemu_ctrl_write(0x40, 0xdf, 0, 0, 0)
+
+//Only receive frames on bus 0 where (addr & mask) == (addr_filter & mask).
+//Frames the safety mode needs still come through, and so does everything else
+//if the panda runs out of filter banks.
+static void ICACHE_FLASH_ATTR panda_set_can0_filter(bool ext, uint32_t addr_filter, uint32_t mask) {
+  uint32_t rir, rmask;
+  if(ext){
+    rir = (addr_filter << 3) | PANDA_CAN_FLAG_EXTENDED;
+    rmask = (mask == 0x1FFFFFFF) ? 0xFFFFFFFE : ((mask << 3) | PANDA_CAN_FLAG_EXTENDED);
+  } else {
+    rir = addr_filter << 21;
+    rmask = (mask == 0x7FF) ? 0xFFFFFFFE : ((mask << 21) | PANDA_CAN_FLAG_EXTENDED);
+  }
+  panda_clear_can0_filters();
+  panda_usbemu_ctrl_write(0x40, 0xe8, rir & 0xFFFF, rir >> 16, 0);
+  panda_usbemu_ctrl_write(0x40, 0xe9, rmask & 0xFFFF, rmask >> 16, 0);
+  panda_usbemu_ctrl_write(0x40, 0xdf, 0, 1, 0);
+  panda_usbemu_ctrl_write(0x40, 0xdf, 0, 2, 0);
+}
 
 static int ICACHE_FLASH_ATTR panda_usbemu_can_read(panda_can_msg_t** can_msgs) {
   int returned_count = spi_comm((uint8_t *)((const uint16 []){1,0}), 4, pandaRecvData, 0x40);
@@ -228,6 +322,16 @@ static int ICACHE_FLASH_ATTR panda_usbemu_can_read(panda_can_msg_t** can_msgs) {
   return returned_count/sizeof(panda_can_msg_t);
 }
 
+//Everything the panda has queued with SPI v2, like panda_usbemu_can_read otherwise.
+static int ICACHE_FLASH_ATTR panda_usbemu_can_read_bulk(panda_can_msg_t** can_msgs) {
+  if(spi_version != 2) return panda_usbemu_can_read(can_msgs);
+
+  int returned_count = spi_comm_v2(1, NULL, 0, (char *)pandaRecvDataBulk, sizeof(pandaRecvDataBulk));
+  if(returned_count < 0) return -1;
+  *can_msgs = (panda_can_msg_t*)pandaRecvDataBulk;
+  return returned_count/sizeof(panda_can_msg_t);
+}
+
 static int ICACHE_FLASH_ATTR panda_usbemu_can_write(bool ext, uint32_t addr,
                                                     char *candata, uint8_t canlen) {
   uint32_t rir;
@@ -899,155 +1003,253 @@ static void ICACHE_FLASH_ATTR elm_process_obd_cmd_LINFast(const elm_protocol_t*
  ***  -> ISO 15765-4 implementation                ***
  *****************************************************/
 
+//The CAN bus is polled every ELM_ISO15765_POLL_MS while a request is out. It
+//ends at the deadline, or as soon as the number of responses given with the
+//request (a trailing digit, like "010C1") is in.
+#define ELM_ISO15765_POLL_MS 2
+#define elm_iso15765_full_window_us() (LOOPCOUNT_FULL * elm_mode_timeout * 1000)
+
+//Adaptive timing (ATAT1/ATAT2) keeps the response latency of every ECU seen,
+//and after ELM_ADAPTIVE_LEARN_REQS answered requests only waits a multiple of
+//the slowest one instead of the full ATST window.
+#define ELM_ADAPTIVE_ECUS 8
+#define ELM_ADAPTIVE_LEARN_REQS 4
+#define ELM_ADAPTIVE_MIN_US 10000
+
+typedef struct {
+  uint32_t addr;
+  uint32_t latency_us; //Moving average
+} elm_ecu_timing_t;
+
+static elm_ecu_timing_t elm_ecu_timing[ELM_ADAPTIVE_ECUS];
+static uint8_t elm_ecu_timing_len = 0;
+static uint8_t elm_adaptive_reqs = 0;
+
+#define ELM_MAX_PIDS 6
+static uint8_t elm_msg_pids[ELM_MAX_PIDS]; //Mode 01 takes several PIDs per request
+static uint8_t elm_msg_pid_count = 0;
+static uint8_t elm_rsp_expected = 0; //0 if not given
+static uint8_t elm_rsp_count = 0;
+static int16_t elm_multimsg_remaining = 0;
+static uint32_t elm_req_time;
+static uint32_t elm_rsp_deadline;
+
+static void ICACHE_FLASH_ATTR elm_adaptive_reset() {
+  elm_ecu_timing_len = 0;
+  elm_adaptive_reqs = 0;
+}
+
+static void ICACHE_FLASH_ATTR elm_adaptive_learn(uint32_t addr, uint32_t latency_us) {
+  for(int i = 0; i < elm_ecu_timing_len; i++)
+    if(elm_ecu_timing[i].addr == addr) {
+      elm_ecu_timing[i].latency_us = (elm_ecu_timing[i].latency_us * 3 + latency_us) / 4;
+      return;
+    }
+  //A full table drops the newest entry
+  int i = (elm_ecu_timing_len < ELM_ADAPTIVE_ECUS) ? elm_ecu_timing_len++ : ELM_ADAPTIVE_ECUS - 1;
+  elm_ecu_timing[i].addr = addr;
+  elm_ecu_timing[i].latency_us = latency_us;
+}
+
+//How long after the request responses are waited for
+static uint32_t ICACHE_FLASH_ATTR elm_adaptive_window_us() {
+  uint32_t full = elm_iso15765_full_window_us();
+  if(!elm_mode_adaptive_timing || elm_adaptive_reqs < ELM_ADAPTIVE_LEARN_REQS) return full;
+
+  uint32_t slowest = 0;
+  for(int i = 0; i < elm_ecu_timing_len; i++)
+    slowest = max(slowest, elm_ecu_timing[i].latency_us);
+  //AT2 is the aggressive one
+  uint32_t window = slowest * ((elm_mode_adaptive_timing == 2) ? 2 : 4);
+  return min(max(window, ELM_ADAPTIVE_MIN_US), full);
+}
+
+//After a frame of a response. Without adaptive timing every frame restarts
+//the full window, like the ELM does. Multi frame responses always get it.
+static void ICACHE_FLASH_ATTR elm_iso15765_extend_deadline(uint32_t now) {
+  uint32_t deadline;
+  if(!elm_mode_adaptive_timing || elm_multimsg_remaining > 0)
+    deadline = now + elm_iso15765_full_window_us();
+  else
+    deadline = elm_req_time + elm_adaptive_window_us();
+  if((int32_t)(deadline - elm_rsp_deadline) > 0) elm_rsp_deadline = deadline;
+}
+
+static bool ICACHE_FLASH_ATTR elm_iso15765_rsp_matches(uint8_t mode, uint8_t pid) {
+  if(mode != (0x40|elm_msg_mode_ret_filter)) return false;
+  if(!elm_msg_pid_count) return true;
+  for(int i = 0; i < elm_msg_pid_count; i++)
+    if(pid == elm_msg_pids[i]) return true;
+  return false;
+}
+
+static void ICACHE_FLASH_ATTR elm_iso15765_rsp_done() {
+  elm_rsp_count++;
+  if(elm_rsp_expected && elm_rsp_count >= elm_rsp_expected)
+    elm_rsp_deadline = system_get_time();
+}
+
 void ICACHE_FLASH_ATTR elm_ISO15765_timer_cb(void *arg){
   const elm_protocol_t* proto = (const elm_protocol_t*) arg;
-  loopcount--;
-  if(loopcount>0) {
-    for(int pass = 0; pass < 16 && loopcount; pass++){
-      panda_can_msg_t *can_msgs;
-      int num_can_msgs = panda_usbemu_can_read(&can_msgs);
+  if(!loopcount) return;
 
-      #ifdef ELM_DEBUG
-      if(num_can_msgs) os_printf("  Received %d can messages\n", num_can_msgs);
-      #endif
+  for(int pass = 0; pass < 16 && loopcount; pass++){
+    panda_can_msg_t *can_msgs;
+    int num_can_msgs = panda_usbemu_can_read_bulk(&can_msgs);
+    uint32_t now = system_get_time();
 
-      if(num_can_msgs < 0) continue;
-      if(!num_can_msgs) break;
+    #ifdef ELM_DEBUG
+    if(num_can_msgs) os_printf("  Received %d can messages\n", num_can_msgs);
+    #endif
 
-      for(int i = 0; i < num_can_msgs; i++){
+    if(num_can_msgs < 0) continue;
+    if(!num_can_msgs) break;
 
-        panda_can_msg_t *recv = &can_msgs[i];
+    for(int i = 0; i < num_can_msgs; i++){
 
-        #ifdef ELM_DEBUG
-        os_printf("    RECV: Bus: %d; Addr: %08x; ext: %d; tx: %d; Len: %d; ",
-                  recv->bus, panda_get_can_addr(recv), recv->ext, recv->tx, recv->len);
-        for(int j = 0; j < recv->len; j++) os_printf("%02x ", recv->data[j]);
-        os_printf("Ts: %d\n", recv->ts);
-        #endif
+      panda_can_msg_t *recv = &can_msgs[i];
 
-        if (recv->bus==0 && recv->len == 8 &&
-            (
-             (proto->type == CAN11 && !recv->ext && (panda_get_can_addr(recv) & 0x7F8) == 0x7E8) ||
-             (proto->type == CAN29 && recv->ext && (panda_get_can_addr(recv) & 0x1FFFFF00) == 0x18DAF100)
-            )
-           ) {
-          if(recv->data[0] <= 7 &&
-             recv->data[1] == (0x40|elm_msg_mode_ret_filter) &&
-             recv->data[2] == elm_msg_pid_ret_filter) {
-            got_msg_this_run = true;
-            loopcount = LOOPCOUNT_FULL;
+      #ifdef ELM_DEBUG
+      os_printf("    RECV: Bus: %d; Addr: %08x; ext: %d; tx: %d; Len: %d; ",
+                recv->bus, panda_get_can_addr(recv), recv->ext, recv->tx, recv->len);
+      for(int j = 0; j < recv->len; j++) os_printf("%02x ", recv->data[j]);
+      os_printf("Ts: %d\n", recv->ts);
+      #endif
 
-            #ifdef ELM_DEBUG
-            os_printf("      CAN msg response, index: %d\n", i);
-            #endif
+      if (recv->bus==0 && recv->len == 8 &&
+          (
+           (proto->type == CAN11 && !recv->ext && (panda_get_can_addr(recv) & 0x7F8) == 0x7E8) ||
+           (proto->type == CAN29 && recv->ext && (panda_get_can_addr(recv) & 0x1FFFFF00) == 0x18DAF100)
+          )
+         ) {
+        if(recv->data[0] <= 7 && elm_iso15765_rsp_matches(recv->data[1], recv->data[2])) {
+          got_msg_this_run = true;
+          elm_adaptive_learn(panda_get_can_addr(recv), now - elm_req_time);
+          elm_iso15765_extend_deadline(now);
 
-            if(!is_auto_detecting){
-              if(elm_mode_additional_headers){
-                elm_append_rsp_can_msg_addr(recv);
-                for(int j = 0; j < recv->data[0]+1; j++) elm_append_rsp_hex_byte(recv->data[j]);
-              } else {
-                for(int j = 1; j < recv->data[0]+1; j++) elm_append_rsp_hex_byte(recv->data[j]);
-              }
+          #ifdef ELM_DEBUG
+          os_printf("      CAN msg response, index: %d\n", i);
+          #endif
 
-              elm_append_rsp_const("\r");
-              elm_tcp_tx_flush();
+          if(!is_auto_detecting){
+            if(elm_mode_additional_headers){
+              elm_append_rsp_can_msg_addr(recv);
+              for(int j = 0; j < recv->data[0]+1; j++) elm_append_rsp_hex_byte(recv->data[j]);
+            } else {
+              for(int j = 1; j < recv->data[0]+1; j++) elm_append_rsp_hex_byte(recv->data[j]);
             }
 
-          } else if((recv->data[0] & 0xF0) == 0x10 &&
-                    recv->data[2] == (0x40|elm_msg_mode_ret_filter) &&
-                    recv->data[3] == elm_msg_pid_ret_filter) {
-            got_msg_this_run = true;
-            loopcount = LOOPCOUNT_FULL;
-            panda_usbemu_can_write(0,
-                                   (proto->type==CAN11) ?
-                                   0x7E0 | (panda_get_can_addr(recv)&0x7) :
-                                   (0x18DA00F1 | (((panda_get_can_addr(recv))&0xFF)<<8)),
-                                   "\x30\x00\x00", 3);
-
-            did_multimessage = true;
+            elm_append_rsp_const("\r");
+          }
+          elm_iso15765_rsp_done();
 
-            #ifdef ELM_DEBUG
-            os_printf("      CAN multimsg start response, index: %d, len %d\n", i,
-                      ((recv->data[0]&0xF)<<8) | recv->data[1]);
-            #endif
+        } else if((recv->data[0] & 0xF0) == 0x10 &&
+                  elm_iso15765_rsp_matches(recv->data[2], recv->data[3])) {
+          got_msg_this_run = true;
+          panda_usbemu_can_write(0,
+                                 (proto->type==CAN11) ?
+                                 0x7E0 | (panda_get_can_addr(recv)&0x7) :
+                                 (0x18DA00F1 | (((panda_get_can_addr(recv))&0xFF)<<8)),
+                                 "\x30\x00\x00", 3);
 
-            if(!is_auto_detecting){
-              if(!elm_mode_additional_headers) {
-                elm_append_rsp(&hex_lookup[recv->data[0]&0xF], 1);
-                elm_append_rsp_hex_byte(recv->data[1]);
-                elm_append_rsp_const("\r0:");
-                if(elm_mode_print_spaces) elm_append_rsp_const(" ");
-                for(int j = 2; j < 8; j++) elm_append_rsp_hex_byte(recv->data[j]);
-              } else {
-                elm_append_rsp_can_msg_addr(recv);
-                for(int j = 0; j < 8; j++) elm_append_rsp_hex_byte(recv->data[j]);
-              }
-
-              elm_append_rsp_const("\r");
-              elm_tcp_tx_flush();
-            }
+          did_multimessage = true;
+          elm_multimsg_remaining = (((recv->data[0]&0xF)<<8) | recv->data[1]) - 6;
+          elm_adaptive_learn(panda_get_can_addr(recv), now - elm_req_time);
+          elm_iso15765_extend_deadline(now);
 
-          } else if (did_multimessage && (recv->data[0] & 0xF0) == 0x20) {
-            got_msg_this_run = true;
-            loopcount = LOOPCOUNT_FULL;
-            #ifdef ELM_DEBUG
-            os_printf("      CAN multimsg data response, index: %d\n", i);
-            #endif
+          #ifdef ELM_DEBUG
+          os_printf("      CAN multimsg start response, index: %d, len %d\n", i,
+                    ((recv->data[0]&0xF)<<8) | recv->data[1]);
+          #endif
 
-            if(!is_auto_detecting){
-              if(!elm_mode_additional_headers) {
-                elm_append_rsp(&hex_lookup[recv->data[0] & 0xF], 1);
-                elm_append_rsp_const(":");
-                if(elm_mode_print_spaces) elm_append_rsp_const(" ");
-                for(int j = 1; j < 8; j++) elm_append_rsp_hex_byte(recv->data[j]);
-              } else {
-                elm_append_rsp_can_msg_addr(recv);
-                for(int j = 0; j < 8; j++) elm_append_rsp_hex_byte(recv->data[j]);
-              }
-              elm_append_rsp_const("\r");
+          if(!is_auto_detecting){
+            if(!elm_mode_additional_headers) {
+              elm_append_rsp(&hex_lookup[recv->data[0]&0xF], 1);
+              elm_append_rsp_hex_byte(recv->data[1]);
+              elm_append_rsp_const("\r0:");
+              if(elm_mode_print_spaces) elm_append_rsp_const(" ");
+              for(int j = 2; j < 8; j++) elm_append_rsp_hex_byte(recv->data[j]);
+            } else {
+              elm_append_rsp_can_msg_addr(recv);
+              for(int j = 0; j < 8; j++) elm_append_rsp_hex_byte(recv->data[j]);
             }
+
+            elm_append_rsp_const("\r");
           }
-        } else if (recv->bus == 0x80 && recv->len == 8 &&
-                   (panda_get_can_addr(recv) == ((proto->type==CAN11) ? 0x7DF : 0x18DB33F1))
-                  ) {
-          //Can send receipt
+
+        } else if (did_multimessage && (recv->data[0] & 0xF0) == 0x20) {
+          got_msg_this_run = true;
           #ifdef ELM_DEBUG
-          os_printf("      Got CAN tx receipt\n");
+          os_printf("      CAN multimsg data response, index: %d\n", i);
           #endif
-          can_tx_worked = true;
-        }
-      }
-    }
-    os_timer_arm(&elm_timeout, elm_mode_timeout, 0);
-  } else {
-    bool got_msg_this_run_backup = got_msg_this_run;
-    if(did_multimessage) {
-      os_printf("  End of multi message\n");
-    } else if(!got_msg_this_run) {
-      os_printf("  No data collected\n");
-      if(!is_auto_detecting) {
-        if(can_tx_worked) {
-          elm_append_rsp_const("NO DATA\r");
-        } else {
-          elm_append_rsp_const("CAN ERROR\r");
+
+          if(!is_auto_detecting){
+            if(!elm_mode_additional_headers) {
+              elm_append_rsp(&hex_lookup[recv->data[0] & 0xF], 1);
+              elm_append_rsp_const(":");
+              if(elm_mode_print_spaces) elm_append_rsp_const(" ");
+              for(int j = 1; j < 8; j++) elm_append_rsp_hex_byte(recv->data[j]);
+            } else {
+              elm_append_rsp_can_msg_addr(recv);
+              for(int j = 0; j < 8; j++) elm_append_rsp_hex_byte(recv->data[j]);
+            }
+            elm_append_rsp_const("\r");
+          }
+
+          if(elm_multimsg_remaining > 0) {
+            elm_multimsg_remaining -= 7;
+            elm_iso15765_extend_deadline(now);
+            if(elm_multimsg_remaining <= 0) elm_iso15765_rsp_done();
+          }
         }
+      } else if (recv->bus == 0x80 && recv->len == 8 &&
+                 (panda_get_can_addr(recv) == ((proto->type==CAN11) ? 0x7DF : 0x18DB33F1))
+                ) {
+        //Can send receipt
+        #ifdef ELM_DEBUG
+        os_printf("      Got CAN tx receipt\n");
+        #endif
+        can_tx_worked = true;
       }
     }
-    did_multimessage = false;
-    got_msg_this_run = false;
-    can_tx_worked = false;
+  }
 
+  if((int32_t)(system_get_time() - elm_rsp_deadline) < 0) {
+    os_timer_arm(&elm_timeout, ELM_ISO15765_POLL_MS, 0);
+    return;
+  }
+
+  loopcount = 0;
+  bool got_msg_this_run_backup = got_msg_this_run;
+  if(got_msg_this_run && elm_adaptive_reqs < ELM_ADAPTIVE_LEARN_REQS) elm_adaptive_reqs++;
+  if(did_multimessage) {
+    os_printf("  End of multi message\n");
+  } else if(!got_msg_this_run) {
+    os_printf("  No data collected\n");
     if(!is_auto_detecting) {
-      elm_append_rsp_const("\r>");
-      elm_tcp_tx_flush();
-    } else {
-      elm_autodetect_cb(got_msg_this_run_backup);
+      if(can_tx_worked) {
+        elm_append_rsp_const("NO DATA\r");
+      } else {
+        elm_append_rsp_const("CAN ERROR\r");
+      }
     }
   }
+  did_multimessage = false;
+  got_msg_this_run = false;
+  can_tx_worked = false;
+  elm_multimsg_remaining = 0;
+
+  if(!is_auto_detecting) {
+    elm_append_rsp_const("\r>");
+    elm_tcp_tx_flush();
+  } else {
+    elm_autodetect_cb(got_msg_this_run_backup);
+  }
 }
 
 static void ICACHE_FLASH_ATTR elm_init_ISO15765(const elm_protocol_t* proto){
   panda_set_can0_cbaud(proto->cbaud);
+  elm_adaptive_reset();
 }
 
 static void ICACHE_FLASH_ATTR elm_process_obd_cmd_ISO15765(const elm_protocol_t* proto,
@@ -1064,8 +1266,16 @@ static void ICACHE_FLASH_ATTR elm_process_obd_cmd_ISO15765(const elm_protocol_t*
   for(int i = 0; i < msg.len; i++)
     msg.dat[i] = elm_decode_hex_byte(&cmd[i*2]);
 
+  //An odd digit at the end is the number of responses to wait for
+  elm_rsp_expected = ((len-1) % 2) ? elm_decode_hex_char(cmd[len-2]) : 0;
+  elm_rsp_count = 0;
+
   elm_msg_mode_ret_filter = msg.dat[0];
   elm_msg_pid_ret_filter = msg.dat[1];
+  //Responses to mode 01 can start with any of its PIDs. Requests without a
+  //PID take any response to the mode.
+  elm_msg_pid_count = (msg.dat[0] == 0x01) ? min(msg.len - 1, ELM_MAX_PIDS) : min(msg.len - 1, 1);
+  memcpy(elm_msg_pids, &msg.dat[1], elm_msg_pid_count);
 
   #ifdef ELM_DEBUG
   os_printf("Sending CAN OBD: %02x; ", msg.len);
@@ -1078,6 +1288,8 @@ static void ICACHE_FLASH_ATTR elm_process_obd_cmd_ISO15765(const elm_protocol_t*
 
   panda_usbemu_can_write(0, (proto->type==CAN11) ? 0x7DF : 0x18DB33F1,
                          (uint8_t*)&msg, msg.len+1);
+  elm_req_time = system_get_time();
+  elm_rsp_deadline = elm_req_time + elm_adaptive_window_us();
 
   #ifdef ELM_DEBUG
   os_printf("Starting up timer\n");
@@ -1086,14 +1298,9 @@ static void ICACHE_FLASH_ATTR elm_process_obd_cmd_ISO15765(const elm_protocol_t*
   loopcount = LOOPCOUNT_FULL;
   os_timer_disarm(&elm_timeout);
   os_timer_setfn(&elm_timeout, (os_timer_func_t *)elm_ISO15765_timer_cb, proto);
-  os_timer_arm(&elm_timeout, elm_mode_timeout, 0);
+  os_timer_arm(&elm_timeout, ELM_ISO15765_POLL_MS, 0);
 }
 
-/*****************************************************
- *** ELM protocol specification and implementation ***
- ***  -> Stuf for unsupported CAN protocols        ***
- *****************************************************/
-
 static void ICACHE_FLASH_ATTR elm_process_obd_cmd_CANGen(const elm_protocol_t* proto,
                                                          const char *cmd, uint16_t len) {
   elm_append_rsp_const("NO DATA\r\r>");
@@ -1108,6 +1315,90 @@ static int elm_autodetect_proto_iter;
 static uint16_t elm_staged_auto_msg_len;
 static const char* elm_staged_auto_msg;
 
+//CAN goes first. Each rate is probed once, with 0100 on the 11 and 29 bit
+//functional addresses together, so the first ECU to answer picks the
+//protocol. Rates can't overlap on the one OBD bus. The K-line protocols are
+//tried after, one at a time.
+static const uint16_t elm_autodetect_cbauds[] = {5000, 2500};
+#define ELM_AUTODETECT_CBAUD_COUNT (sizeof(elm_autodetect_cbauds)/sizeof(elm_autodetect_cbauds[0]))
+static int elm_autodetect_cbaud_iter;
+
+static int ICACHE_FLASH_ATTR elm_autodetect_find_proto(elm_proto_type_t type, uint16_t cbaud) {
+  for(int i = 0; i < ELM_PROTOCOL_COUNT; i++)
+    if(elm_protocols[i].supported && elm_protocols[i].type == type && elm_protocols[i].cbaud == cbaud &&
+       elm_protocols[i].process_obd == elm_process_obd_cmd_ISO15765)
+      return i;
+  return -1;
+}
+
+static void ICACHE_FLASH_ATTR elm_autodetect_CAN_start();
+
+void ICACHE_FLASH_ATTR elm_autodetect_CAN_timer_cb(void *arg){
+  if(!loopcount) return;
+  uint16_t cbaud = elm_autodetect_cbauds[elm_autodetect_cbaud_iter];
+
+  for(int pass = 0; pass < 16; pass++){
+    panda_can_msg_t *can_msgs;
+    int num_can_msgs = panda_usbemu_can_read_bulk(&can_msgs);
+    if(num_can_msgs < 0) continue;
+    if(!num_can_msgs) break;
+
+    for(int i = 0; i < num_can_msgs; i++){
+      panda_can_msg_t *recv = &can_msgs[i];
+      uint32_t addr = panda_get_can_addr(recv);
+      if(recv->bus != 0 || recv->len != 8) continue;
+
+      elm_proto_type_t type = NA;
+      if(!recv->ext && (addr & 0x7F8) == 0x7E8) type = CAN11;
+      if(recv->ext && (addr & 0x1FFFFF00) == 0x18DAF100) type = CAN29;
+      if(type == NA) continue;
+
+      //Single frame or first frame of 41 00
+      if((recv->data[0] <= 7 && recv->data[1] == 0x41 && recv->data[2] == 0x00) ||
+         ((recv->data[0] & 0xF0) == 0x10 && recv->data[2] == 0x41 && recv->data[3] == 0x00)) {
+        int proto_index = elm_autodetect_find_proto(type, cbaud);
+        if(proto_index < 0) continue;
+        os_printf("*** AUTO got '%s' from %x\n", elm_protocols[proto_index].name, addr);
+        loopcount = 0;
+        elm_protocols[proto_index].init(&elm_protocols[proto_index]);
+        elm_autodetect_proto_iter = proto_index;
+        elm_autodetect_cb(true);
+        return;
+      }
+    }
+  }
+
+  if((int32_t)(system_get_time() - elm_rsp_deadline) < 0) {
+    os_timer_arm(&elm_timeout, ELM_ISO15765_POLL_MS, 0);
+    return;
+  }
+
+  loopcount = 0;
+  if(++elm_autodetect_cbaud_iter < ELM_AUTODETECT_CBAUD_COUNT) {
+    elm_autodetect_CAN_start();
+  } else {
+    //On to the K-line
+    elm_autodetect_proto_iter = 0;
+    elm_autodetect_cb(false);
+  }
+}
+
+static void ICACHE_FLASH_ATTR elm_autodetect_CAN_start() {
+  uint16_t cbaud = elm_autodetect_cbauds[elm_autodetect_cbaud_iter];
+  os_printf("*** AUTO trying CAN 11 and 29 bit at %d0 bps\n", cbaud);
+
+  panda_set_can0_cbaud(cbaud);
+  panda_clear_can_rx();
+  panda_usbemu_can_write(0, 0x7DF, "\x02\x01\x00", 3);
+  panda_usbemu_can_write(1, 0x18DB33F1, "\x02\x01\x00", 3);
+  elm_rsp_deadline = system_get_time() + elm_iso15765_full_window_us();
+
+  loopcount = LOOPCOUNT_FULL;
+  os_timer_disarm(&elm_timeout);
+  os_timer_setfn(&elm_timeout, (os_timer_func_t *)elm_autodetect_CAN_timer_cb, NULL);
+  os_timer_arm(&elm_timeout, ELM_ISO15765_POLL_MS, 0);
+}
+
 static void ICACHE_FLASH_ATTR elm_autodetect_cb(bool proto_worked){
   if(proto_worked) {
     os_printf("Autodetect proto success\n");
@@ -1119,7 +1410,8 @@ static void ICACHE_FLASH_ATTR elm_autodetect_cb(bool proto_worked){
     for(elm_autodetect_proto_iter++; elm_autodetect_proto_iter < ELM_PROTOCOL_COUNT;
         elm_autodetect_proto_iter++){
       const elm_protocol_t *proto = &elm_protocols[elm_autodetect_proto_iter];
-      if(proto->supported && proto->type != AUTO) {
+      //CAN was probed already, by elm_autodetect_CAN_start
+      if(proto->supported && proto->type != AUTO && proto->type != CAN11 && proto->type != CAN29) {
         os_printf("*** AUTO trying '%s'\n", proto->name);
         proto->init(proto);
         proto->process_obd(proto, "0100\r", 5); // Try sending on the bus
@@ -1142,8 +1434,8 @@ static void ICACHE_FLASH_ATTR elm_process_obd_cmd_AUTO(const elm_protocol_t* pro
   elm_staged_auto_msg = cmd;
   is_auto_detecting = true;
 
-  elm_autodetect_proto_iter = 0;
-  elm_autodetect_cb(false);
+  elm_autodetect_cbaud_iter = 0;
+  elm_autodetect_CAN_start();
 }
 
 /*****************************************************
@@ -1181,6 +1473,115 @@ void ICACHE_FLASH_ATTR elm_proto_reinit(const elm_protocol_t *proto) {
     if(proto->init) proto->init(proto);
 }
 
+/*****************************************************
+ *** ELM protocol specification and implementation ***
+ ***  -> Bus monitoring (ATMA)                     ***
+ *****************************************************/
+
+#define ELM_MONITOR_POLL_MS 2
+#define ELM_MONITOR_PASSES 8
+
+static bool elm_monitoring = false;
+static volatile os_timer_t elm_monitor_timer;
+
+//ATCRA/ATCF/ATCM receive filter for ATMA. A frame is shown if its address length
+//matches and (addr & mask) == (filter & mask). A mask of 0 shows everything.
+static uint32_t elm_monitor_filter = 0;
+static uint32_t elm_monitor_mask = 0;
+static bool elm_monitor_ext = false;
+
+static bool ICACHE_FLASH_ATTR elm_monitor_passes(const panda_can_msg_t *recv) {
+  if(!elm_monitor_mask) return true;
+  return recv->ext == elm_monitor_ext &&
+    (panda_get_can_addr(recv) & elm_monitor_mask) == (elm_monitor_filter & elm_monitor_mask);
+}
+
+//Formats a frame the way the OBD responses are, header only with ATH1.
+//Returns the length, at most 4*3 + 8*3 + 1.
+static uint16_t ICACHE_FLASH_ATTR elm_encode_can_line(const panda_can_msg_t *recv, char *out) {
+  char *p = out;
+  uint32_t addr = panda_get_can_addr(recv);
+  if(elm_mode_additional_headers){
+    if(recv->ext){
+      for(int shift = 24; shift >= 0; shift -= 8){
+        memcpy(p, hex_pair_lookup[(addr >> shift) & 0xFF], 2);
+        p += 2;
+        if(elm_mode_print_spaces) *p++ = ' ';
+      }
+    } else {
+      *p++ = hex_lookup[addr >> 8];
+      memcpy(p, hex_pair_lookup[addr & 0xFF], 2);
+      p += 2;
+      if(elm_mode_print_spaces) *p++ = ' ';
+    }
+  }
+  for(int i = 0; i < recv->len && i < 8; i++){
+    memcpy(p, hex_pair_lookup[recv->data[i]], 2);
+    p += 2;
+    if(elm_mode_print_spaces) *p++ = ' ';
+  }
+  *p++ = '\r';
+  return p - out;
+}
+
+//Lines go into the response ring, which sends them a full segment at a time.
+void ICACHE_FLASH_ATTR elm_monitor_timer_cb(void *arg){
+  char line[4*3 + 8*3 + 1];
+  for(int pass = 0; pass < ELM_MONITOR_PASSES && elm_monitoring; pass++){
+    panda_can_msg_t *can_msgs;
+    int num_can_msgs = panda_usbemu_can_read_bulk(&can_msgs);
+    if(num_can_msgs <= 0) break;
+
+    for(int i = 0; i < num_can_msgs; i++){
+      panda_can_msg_t *recv = &can_msgs[i];
+      //Skip tx receipts and the other buses
+      if(recv->bus != 0 || !elm_monitor_passes(recv)) continue;
+      elm_append_rsp(line, elm_encode_can_line(recv, line));
+    }
+  }
+}
+
+//Returns false if the current protocol isn't CAN.
+static bool ICACHE_FLASH_ATTR elm_monitor_start() {
+  const elm_protocol_t *proto = elm_current_proto();
+  if(proto->type != CAN11 && proto->type != CAN29) return false;
+
+  elm_proto_reinit(proto);
+  if(elm_monitor_mask)
+    panda_set_can0_filter(elm_monitor_ext, elm_monitor_filter, elm_monitor_mask);
+  panda_clear_can_rx();
+
+  elm_monitoring = true;
+  os_timer_disarm(&elm_monitor_timer);
+  os_timer_setfn(&elm_monitor_timer, (os_timer_func_t *)elm_monitor_timer_cb, NULL);
+  os_timer_arm(&elm_monitor_timer, ELM_MONITOR_POLL_MS, 1);
+  return true;
+}
+
+static void ICACHE_FLASH_ATTR elm_monitor_stop() {
+  if(!elm_monitoring) return;
+  os_timer_disarm(&elm_monitor_timer);
+  elm_monitoring = false;
+  if(elm_monitor_mask) panda_clear_can0_filters();
+}
+
+//Hex digits into a value. X digits are don't care, their mask nibble is 0.
+static bool ICACHE_FLASH_ATTR elm_decode_hex_pattern(const char *data, uint8_t len,
+                                                     uint32_t *val, uint32_t *mask) {
+  *val = 0;
+  *mask = 0;
+  for(int i = 0; i < len; i++){
+    *val <<= 4;
+    *mask <<= 4;
+    if(data[i] == 'X') continue;
+    int8_t nibble = elm_decode_hex_char(data[i]);
+    if(nibble < 0) return false;
+    *val |= nibble;
+    *mask |= 0xF;
+  }
+  return true;
+}
+
 /*******************************************
  *** ELM AT command parsing and handling ***
  *******************************************/
@@ -1198,6 +1599,7 @@ enum at_cmd_ids_t { // FULL ELM 1.0 list
   AT_CFC0, AT_CFC1,
   AT_CM_8, AT_CM_3,
   AT_CP,
+  AT_CRA, AT_CRA_3, AT_CRA_8,
   AT_CS,
   AT_CV,
   AT_D,
@@ -1239,6 +1641,13 @@ static const at_cmd_reg_t at_cmd_reg[] = {
   {"AT0", 3, 3, AT_AT0}, // Added ELM 1.2, expected by Torque
   {"AT1", 3, 3, AT_AT1}, // Added ELM 1.2, expected by Torque
   {"AT2", 3, 3, AT_AT2}, // Added ELM 1.2, expected by Torque
+  {"CF",  2, 5, AT_CF_3},
+  {"CF",  2, 10, AT_CF_8},
+  {"CM",  2, 5, AT_CM_3},
+  {"CM",  2, 10, AT_CM_8},
+  {"CRA", 3, 3, AT_CRA},
+  {"CRA", 3, 6, AT_CRA_3},
+  {"CRA", 3, 11, AT_CRA_8},
   {"DP",  2, 2, AT_DP},
   {"DPN", 3, 3, AT_DPN},
   {"E0",  2, 2, AT_E0},
@@ -1249,6 +1658,7 @@ static const at_cmd_reg_t at_cmd_reg[] = {
   {"L0",  2, 2, AT_L0},
   {"L1",  2, 2, AT_L1},
   {"M0",  2, 2, AT_M0},
+  {"MA",  2, 2, AT_MA},
   //{"M1",  2, 2, AT_M1},
   {"NL",  2, 2, AT_NL},
   {"PC",  2, 2, AT_PC},
@@ -1274,6 +1684,7 @@ static enum at_cmd_ids_t ICACHE_FLASH_ATTR elm_parse_at_cmd(char *cmd, uint16_t
 
 static void ICACHE_FLASH_ATTR elm_process_at_cmd(char *cmd, uint16_t len) {
   uint8_t tmp;
+  uint32_t val, mask;
 
   os_printf("AT COMMAND ");
   for(int i = 0; i < len; i++) os_printf("%c", cmd[i]);
@@ -1295,6 +1706,38 @@ static void ICACHE_FLASH_ATTR elm_process_at_cmd(char *cmd, uint16_t len) {
   case AT_AT2: //SET ADAPTIVE TIMING TO AUTO2
     elm_mode_adaptive_timing = 2;
     break;
+  case AT_CF_3: //SET CAN ID FILTER, 11 BIT
+  case AT_CF_8: //SET CAN ID FILTER, 29 BIT
+    if(!elm_decode_hex_pattern(&cmd[2], len-3, &val, &mask)) {
+      elm_append_rsp_const("?\r\r");
+      return;
+    }
+    elm_monitor_filter = val;
+    elm_monitor_ext = (len-3 == 8);
+    break;
+  case AT_CM_3: //SET CAN ID MASK, 11 BIT
+  case AT_CM_8: //SET CAN ID MASK, 29 BIT
+    if(!elm_decode_hex_pattern(&cmd[2], len-3, &val, &mask)) {
+      elm_append_rsp_const("?\r\r");
+      return;
+    }
+    elm_monitor_mask = val;
+    elm_monitor_ext = (len-3 == 8);
+    break;
+  case AT_CRA: //RESET CAN RECEIVE ADDRESS FILTERS
+    elm_monitor_filter = 0;
+    elm_monitor_mask = 0;
+    break;
+  case AT_CRA_3: //SET CAN RECEIVE ADDRESS, 11 BIT, X IS DON'T CARE
+  case AT_CRA_8: //SET CAN RECEIVE ADDRESS, 29 BIT, X IS DON'T CARE
+    if(!elm_decode_hex_pattern(&cmd[3], len-4, &val, &mask)) {
+      elm_append_rsp_const("?\r\r");
+      return;
+    }
+    elm_monitor_ext = (len-4 == 8);
+    elm_monitor_filter = val;
+    elm_monitor_mask = mask & (elm_monitor_ext ? 0x1FFFFFFF : 0x7FF);
+    break;
   case AT_DP: //DESCRIBE THE PROTOCOL BY NAME
     if(elm_mode_auto_protocol && elm_selected_protocol != 0)
       elm_append_rsp_const("AUTO, ");
@@ -1333,6 +1776,12 @@ static void ICACHE_FLASH_ATTR elm_process_at_cmd(char *cmd, uint16_t len) {
   case AT_M0: //DISABLE NONVOLATILE STORAGE
     //Memory storage is likely unnecessary
     break;
+  case AT_MA: //MONITOR ALL, UNTIL ANY INPUT
+    if(!elm_monitor_start()) {
+      elm_append_rsp_const("?\r\r");
+      return;
+    }
+    return; // No 'OK', the frames follow
   case AT_NL: //DISABLE LONG MESSAGE SUPPORT (>7 BYTES)
     elm_mode_allow_long = false;
     break;
@@ -1417,6 +1866,9 @@ static void ICACHE_FLASH_ATTR elm_process_at_cmd(char *cmd, uint16_t len) {
     elm_mode_allow_long = false;
     elm_mode_timeout = ELM_MODE_TIMEOUT_DEFAULT;
     elm_mode_keepalive_period = ELM_MODE_KEEPALIVE_PERIOD_DEFAULT;
+    elm_monitor_stop();
+    elm_monitor_filter = 0;
+    elm_monitor_mask = 0;
 
     elm_append_rsp_const("\r\r");
     elm_append_rsp_const(IDENT_MSG);
@@ -1452,12 +1904,13 @@ static void ICACHE_FLASH_ATTR elm_rx_cb(void *arg, char *data, uint16_t len) {
   //os_printf("\nGot ELM Data In: '%s'\n", data);
   #endif
 
-  rsp_buff_len = 0;
   len = elm_msg_find_cr_or_eos(data, len);
 
-  if(loopcount){
+  if(loopcount || elm_monitoring){
     os_timer_disarm(&elm_timeout);
+    elm_monitor_stop();
     loopcount = 0;
+    is_auto_detecting = false;
     got_msg_this_run = false;
     can_tx_worked = false;
     did_multimessage = false;
@@ -1487,7 +1940,7 @@ static void ICACHE_FLASH_ATTR elm_rx_cb(void *arg, char *data, uint16_t len) {
 
     if(elm_msg_is_at_cmd(stripped_msg, stripped_msg_len)) {
       elm_process_at_cmd(stripped_msg+2, stripped_msg_len-2);
-      elm_append_rsp_const(">");
+      if(!elm_monitoring) elm_append_rsp_const(">");
     } else if(elm_check_valid_hex_chars(stripped_msg, stripped_msg_len - 1)) {
       elm_current_proto()->process_obd(elm_current_proto(), stripped_msg, stripped_msg_len);
     } else {
@@ -1532,6 +1985,7 @@ void ICACHE_FLASH_ATTR elm_tcp_disconnect_cb(void *arg){
     //command is sent generating a response (ELM will try to responde
     //to the dead connection, and remove it upon error), and finally,
     //the new client disconnects. OFC a power cycle is also an option.
+    elm_monitor_stop();
     elm_proto_reinit(elm_current_proto());
   }
 }
@@ -1541,6 +1995,7 @@ void ICACHE_FLASH_ATTR elm_tcp_connect_cb(void *arg) {
   //SHOW_CONNECTION("New connection", pesp_conn);
   espconn_set_opt(&elm_conn, ESPCONN_NODELAY);
   espconn_regist_recvcb(pesp_conn, elm_rx_cb);
+  espconn_regist_sentcb(pesp_conn, elm_tcp_sent_cb);
   //Allow several sends to be queued at a time.
   espconn_tcp_set_buf_count(pesp_conn, 3);
 
@@ -1558,12 +2013,18 @@ void ICACHE_FLASH_ATTR elm_tcp_connect_cb(void *arg) {
     } else {
       newconn->next = connection_list;
       newconn->conn = pesp_conn;
+      newconn->tx_pos = elm_tx_ready;
       connection_list = newconn;
     }
   }
 }
 
 void ICACHE_FLASH_ATTR elm327_init() {
+  for(int i = 0; i < 256; i++){
+    hex_pair_lookup[i][0] = hex_lookup[i >> 4];
+    hex_pair_lookup[i][1] = hex_lookup[i & 0xF];
+  }
+
   // control listener
   elm_proto.local_port = ELM_PORT;
   elm_conn.type = ESPCONN_TCP;
@@ -37,6 +37,8 @@ esp_udp inter_proto;
 uint32_t sendData[0x14] = {0};
 uint32_t recvData[0x40] = {0};
 
+#define SPI_TIMEOUT 50000
+
 static int ICACHE_FLASH_ATTR __spi_comm(char *dat, int len, uint32_t *recvData, int recvDataLen) {
   unsigned int length = 0;
 
@@ -47,9 +49,6 @@ static int ICACHE_FLASH_ATTR __spi_comm(char *dat, int len, uint32_t *recvData,
   spiData.addr = NULL;
   spiData.addrLen = 0;
 
-  // float boot pin
-  gpio_output_set(0, 0, 0, (1 << 4));
-
   // manual CS pin
   gpio_output_set(0, (1 << 5), 0, 0);
   memset(sendData, 0xCC, 0x14);
@@ -63,7 +62,6 @@ static int ICACHE_FLASH_ATTR __spi_comm(char *dat, int len, uint32_t *recvData,
   spiData.dataLen = 0x14;
   SPIMasterSendData(SpiNum_HSPI, &spiData);
 
-  #define SPI_TIMEOUT 50000
   // give the ST time to be ready, up to 500ms
   int i;
   for (i = 0; (gpio_input_get() & (1 << 4)) && i < SPI_TIMEOUT; i++) {
@@ -110,14 +108,186 @@ fail:
   // clear CS
   gpio_output_set((1 << 5), 0, 0, 0);
 
-  // set boot pin back
-  gpio_output_set((1 << 4), 0, (1 << 4), 0);
-
   return length;
 }
 
-int ICACHE_FLASH_ATTR spi_comm(char *dat, int len, uint32_t *recvData, int recvDataLen) {
-  // blink the led during SPI comm
+// ***** v2 framing *****
+// Transfers of up to SPI_V2_MAX_LEN with a length header and CRCs, see
+// board/drivers/spi.h. Used when the ST answers in v2.
+
+#define SPI_HEADER_LEN 0x14
+#define SPI_CHUNK_LEN 0x40 // most the HSPI moves at once
+#define SPI_VERSION_2 2
+#define SPI_V2_MAX_LEN 0x400
+#define SPI_V2_NOT_SUPPORTED -2
+
+typedef struct __attribute__((packed)) {
+  uint8_t endpoint;
+  uint8_t version;
+  uint16_t len;
+  uint8_t setup[8];
+  uint16_t max_resp;
+  uint16_t reserved[2];
+  uint16_t crc;
+} spi_v2_header;
+
+int spi_version = 1;
+
+uint32_t v2SendData[(SPI_HEADER_LEN + SPI_V2_MAX_LEN + 4) / 4];
+uint32_t v2RecvData[(4 + SPI_V2_MAX_LEN + 4) / 4];
+
+// CRC-16/CCITT-FALSE
+static uint16_t ICACHE_FLASH_ATTR spi_crc16(const uint8_t *dat, int len) {
+  uint16_t crc = 0xFFFF;
+  for (int i = 0; i < len; i++) {
+    crc ^= dat[i] << 8;
+    for (int j = 0; j < 8; j++) {
+      crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+    }
+  }
+  return crc;
+}
+
+// CS stays low, so the ST sees one transfer
+static int ICACHE_FLASH_ATTR spi_send_chunks(SpiData *spiData, uint32_t *dat, int len) {
+  for (int i = 0; i < len; i += SPI_CHUNK_LEN) {
+    spiData->data = dat + i/4;
+    spiData->dataLen = min(len - i, SPI_CHUNK_LEN);
+    if (SPIMasterSendData(SpiNum_HSPI, spiData) == -1) return -1;
+  }
+  return 0;
+}
+
+static int ICACHE_FLASH_ATTR spi_recv_chunks(SpiData *spiData, uint32_t *dat, int len) {
+  for (int i = 0; i < len; i += SPI_CHUNK_LEN) {
+    spiData->data = dat + i/4;
+    spiData->dataLen = min(len - i, SPI_CHUNK_LEN);
+    if (SPIMasterRecvData(SpiNum_HSPI, spiData) == -1) return -1;
+  }
+  return 0;
+}
+
+// Returns the response length, SPI_V2_NOT_SUPPORTED if the ST answered in
+// v1 and -1 on errors. setup is the control request for endpoint 0.
+static int ICACHE_FLASH_ATTR __spi_comm_v2(uint8_t endpoint, const char *setup, const char *dat, int len,
+                                           char *resp, int max_resp) {
+  int ret = -1;
+  SpiData spiData;
+  spi_v2_header *hdr = (spi_v2_header *)v2SendData;
+  uint8_t *rhdr = (uint8_t *)v2RecvData;
+
+  if (len > SPI_V2_MAX_LEN || max_resp > SPI_V2_MAX_LEN) return -1;
+
+  spiData.cmd = 2;
+  spiData.cmdLen = 0;
+  spiData.addr = NULL;
+  spiData.addrLen = 0;
+
+  memset(hdr, 0, SPI_HEADER_LEN);
+  hdr->endpoint = endpoint;
+  hdr->version = SPI_VERSION_2;
+  hdr->len = len;
+  if (setup != NULL) memcpy(hdr->setup, setup, 8);
+  hdr->max_resp = max_resp;
+  hdr->crc = spi_crc16((uint8_t *)hdr, sizeof(spi_v2_header) - 2);
+  if (len > 0) {
+    uint8_t *payload = (uint8_t *)v2SendData + SPI_HEADER_LEN;
+    memcpy(payload, dat, len);
+    uint16_t crc = spi_crc16(payload, len);
+    payload[len] = crc & 0xFF;
+    payload[len + 1] = crc >> 8;
+  }
+
+  // manual CS pin
+  gpio_output_set(0, (1 << 5), 0, 0);
+
+  // wait for ST to respond to CS interrupt
+  os_delay_us(50);
+
+  if (spi_send_chunks(&spiData, v2SendData, SPI_HEADER_LEN) < 0) goto fail;
+  if (len > 0) {
+    // and to set up the payload DMA
+    os_delay_us(50);
+    if (spi_send_chunks(&spiData, v2SendData + SPI_HEADER_LEN/4, len + 2) < 0) goto fail;
+  }
+
+  // give the ST time to be ready, up to 500ms
+  int i;
+  for (i = 0; (gpio_input_get() & (1 << 4)) && i < SPI_TIMEOUT; i++) {
+    os_delay_us(10);
+    system_soft_wdt_feed();
+  }
+  if (i == SPI_TIMEOUT) {
+    os_printf("ERROR: SPI receive failed\n");
+    goto fail;
+  }
+
+  if (spi_recv_chunks(&spiData, v2RecvData, 4) < 0) goto fail;
+  if (rhdr[2] != SPI_VERSION_2) {
+    // a v1 length, read the rest so the ST's DMA completes
+    if (v2RecvData[0] <= 0x40) spi_recv_chunks(&spiData, v2RecvData + 1, (v2RecvData[0] + 3) & ~3);
+    ret = SPI_V2_NOT_SUPPORTED;
+    goto fail;
+  }
+
+  int rlen = rhdr[0] | (rhdr[1] << 8);
+  if (rhdr[3] != 0 || rlen > max_resp) {
+    os_printf("SPI: v2 error %d, length %x\n", rhdr[3], rlen);
+    goto fail;
+  }
+  if (spi_recv_chunks(&spiData, v2RecvData + 1, (rlen + 2 + 3) & ~3) < 0) goto fail;
+  if ((rhdr[4 + rlen] | (rhdr[5 + rlen] << 8)) != spi_crc16(rhdr, 4 + rlen)) {
+    os_printf("SPI: v2 bad CRC\n");
+    goto fail;
+  }
+
+  if (resp != NULL) memcpy(resp, rhdr + 4, rlen);
+  ret = rlen;
+
+fail:
+  // clear CS
+  gpio_output_set((1 << 5), 0, 0, 0);
+
+  return ret;
+}
+
+// ***** CAN data ready *****
+// Between transfers the ST holds the handshake line (GPIO4) low while it has
+// CAN queued, so the CAN task only runs when there is something to send.
+
+#define CAN_PRIO 1
+static os_event_t can_queue[1];
+static volatile int can_task_posted = 0;
+static volatile int spi_busy = 0;
+int udp_countdown = 0;
+
+// WebSocket subscribers, see webserver.c
+extern volatile int ws_subscribers;
+int ws_ready();
+void ws_add_rec(const uint8_t *rec);
+
+// someone is listening for CAN
+#define CAN_STREAM_ACTIVE (udp_countdown > 0 || ws_subscribers > 0)
+
+void ICACHE_FLASH_ATTR can_data_ready_check() {
+  if (CAN_STREAM_ACTIVE && !can_task_posted && !(gpio_input_get() & (1 << 4))) {
+    can_task_posted = 1;
+    system_os_post(CAN_PRIO, 0, 0);
+  }
+}
+
+// in IRAM, the falling edges during a transfer are the handshake itself
+static void can_data_ready_intr(void *arg) {
+  uint32_t status = GPIO_REG_READ(GPIO_STATUS_ADDRESS);
+  GPIO_REG_WRITE(GPIO_STATUS_W1TC_ADDRESS, status);
+  if ((status & (1 << 4)) && !spi_busy && CAN_STREAM_ACTIVE && !can_task_posted) {
+    can_task_posted = 1;
+    system_os_post(CAN_PRIO, 0, 0);
+  }
+}
+
+// blink the led during SPI comm
+static void ICACHE_FLASH_ATTR spi_blink() {
   if (GPIO_REG_READ(GPIO_OUT_ADDRESS) & (1 << pin)) {
     // set gpio low
     gpio_output_set(0, (1 << pin), 0, 0);
@@ -125,11 +295,178 @@ int ICACHE_FLASH_ATTR spi_comm(char *dat, int len, uint32_t *recvData, int recvD
     // set gpio high
     gpio_output_set((1 << pin), 0, 0, 0);
   }
+}
+
+int ICACHE_FLASH_ATTR spi_comm(char *dat, int len, uint32_t *recvData, int recvDataLen) {
+  spi_blink();
+
+  spi_busy = 1;
+  int ret = __spi_comm(dat, len, recvData, recvDataLen);
+  spi_busy = 0;
+
+  // an edge right after CS went high was masked by spi_busy
+  can_data_ready_check();
+  return ret;
+}
+
+int ICACHE_FLASH_ATTR spi_comm_v2(uint8_t endpoint, const char *dat, int len, char *resp, int max_resp) {
+  spi_blink();
+
+  spi_busy = 1;
+  int ret = __spi_comm_v2(endpoint, NULL, dat, len, resp, max_resp);
+  spi_busy = 0;
+
+  can_data_ready_check();
+  return ret;
+}
+
+// a control request, setup is its 8 bytes. SPI_V2_NOT_SUPPORTED if the ST
+// answered it in v1.
+int ICACHE_FLASH_ATTR spi_control_v2(const char *setup, char *resp, int max_resp) {
+  spi_blink();
+
+  spi_busy = 1;
+  int ret = __spi_comm_v2(0, setup, NULL, 0, resp, max_resp);
+  spi_busy = 0;
 
-  return __spi_comm(dat, len, recvData, recvDataLen);
+  can_data_ready_check();
+  return ret;
+}
+
+// ***** batched CAN TX *****
+// A request with endpoint TCP_TX_BATCH is a tcp_tx_batch header and count 0x10
+// byte CAN records, which can span segments. The records wait in tx_ring and
+// go to the ST as many per transfer as it takes, TX_BURST_RECS with v2 and one
+// with v1, once the segment is in. Nothing is sent back unless a header asks
+// with TX_BATCH_ACK, then one response covers every batch since the last.
+// The ST never sees the endpoint, an old ESP gives it ep 3 with no data.
+
+#define TCP_TX_BATCH 0x8003
+#define TX_BATCH_ACK 1
+#define TX_RING_LEN 0x100 // records
+#define TX_BURST_RECS (SPI_V2_MAX_LEN / 0x10)
+
+typedef struct __attribute__((packed)) {
+  uint16_t endpoint; // TCP_TX_BATCH
+  uint16_t count;    // records after the header
+  uint16_t flags;
+  uint16_t seq;      // the client's, echoed in the ack
+} tcp_tx_batch;
+
+typedef struct __attribute__((packed)) {
+  uint32_t len;      // of the rest, as in every response
+  uint16_t seq;      // of the batch that asked
+  uint16_t reserved;
+  uint32_t batches;  // since the last ack
+  uint32_t sent;     // records the ST took
+  uint32_t dropped;  // records lost to SPI errors
+} tcp_tx_ack;
+
+uint8_t tx_ring[TX_RING_LEN * 0x10];
+int tx_ring_r = 0;
+int tx_ring_count = 0;
+
+// the batch coming in, tx_hdr_have is 0 between batches
+tcp_tx_batch tx_hdr;
+int tx_hdr_have = 0;
+int tx_left = 0;         // record bytes of the batch still to come
+uint8_t tx_rec[0x10];    // a record split over segments
+int tx_rec_have = 0;
+tcp_tx_ack tx_ack;
+
+static void ICACHE_FLASH_ATTR tx_ring_drain() {
+  while (tx_ring_count > 0) {
+    // the ring doesn't wrap inside a transfer
+    int n = min(tx_ring_count, TX_RING_LEN - tx_ring_r);
+    uint8_t *recs = tx_ring + tx_ring_r * 0x10;
+    if (spi_version == SPI_VERSION_2) {
+      n = min(n, TX_BURST_RECS);
+      if (spi_comm_v2(3, (char *)recs, n * 0x10, NULL, 0) < 0) {
+        tx_ack.dropped += n;
+      } else {
+        tx_ack.sent += n;
+      }
+    } else {
+      char req[0x14] = {3, 0, 0x10, 0};
+      n = 1;
+      memcpy(req + 4, recs, 0x10);
+      spi_comm(req, sizeof(req), recvData, 0x40);
+      tx_ack.sent += 1;
+    }
+    tx_ring_r = (tx_ring_r + n) % TX_RING_LEN;
+    tx_ring_count -= n;
+  }
+}
+
+static void ICACHE_FLASH_ATTR tx_ring_put(const uint8_t *rec) {
+  if (tx_ring_count == TX_RING_LEN) tx_ring_drain();
+  memcpy(tx_ring + ((tx_ring_r + tx_ring_count) % TX_RING_LEN) * 0x10, rec, 0x10);
+  tx_ring_count++;
+}
+
+// takes what it can of the batch coming in, returns the bytes used
+static int ICACHE_FLASH_ATTR tx_batch_feed(const char *dat, int len, int *ack) {
+  int used = 0;
+  if (tx_hdr_have < sizeof(tcp_tx_batch)) {
+    used = min(len, (int)sizeof(tcp_tx_batch) - tx_hdr_have);
+    memcpy((uint8_t *)&tx_hdr + tx_hdr_have, dat, used);
+    tx_hdr_have += used;
+    if (tx_hdr_have < sizeof(tcp_tx_batch)) return used;
+    tx_left = tx_hdr.count * 0x10;
+    tx_ack.batches += 1;
+  }
+
+  while (used < len && tx_left > 0) {
+    int n = min(len - used, 0x10 - tx_rec_have);
+    memcpy(tx_rec + tx_rec_have, dat + used, n);
+    tx_rec_have += n;
+    if (tx_rec_have == 0x10) {
+      tx_ring_put(tx_rec);
+      tx_rec_have = 0;
+    }
+    tx_left -= n;
+    used += n;
+  }
+
+  if (tx_left == 0) {
+    if (tx_hdr.flags & TX_BATCH_ACK) {
+      *ack = 1;
+      tx_ack.seq = tx_hdr.seq;
+    }
+    tx_hdr_have = 0;
+  }
+  return used;
 }
 
 static void ICACHE_FLASH_ATTR tcp_rx_cb(void *arg, char *data, uint16_t len) {
+  // batches, and one that's still coming in, before any other request
+  int ack = 0;
+  while (len > 0 && (tx_hdr_have > 0 || (len >= 2 && data[0] == (TCP_TX_BATCH & 0xFF) && (uint8_t)data[1] == (TCP_TX_BATCH >> 8)))) {
+    int used = tx_batch_feed(data, len, &ack);
+    data += used;
+    len -= used;
+  }
+  tx_ring_drain();
+  if (ack) {
+    tx_ack.len = sizeof(tcp_tx_ack) - 4;
+    tx_ack.reserved = 0;
+    memcpy(recvData, &tx_ack, sizeof(tcp_tx_ack));
+    memset((uint8_t *)recvData + sizeof(tcp_tx_ack), 0, 0x44 - sizeof(tcp_tx_ack));
+    espconn_send(&tcp_conn, recvData, 0x44);
+    tx_ack.batches = 0;
+    tx_ack.sent = 0;
+    tx_ack.dropped = 0;
+  }
+  if (len == 0) return;
+
+  // CAN sends longer than v1 allows go to the ST in one transfer
+  if (spi_version == SPI_VERSION_2 && data[0] == 3 && len > 0x14 && len <= 4 + SPI_V2_MAX_LEN) {
+    spi_comm_v2(3, data + 4, len - 4, NULL, 0);
+    memset(recvData, 0, 4);
+    espconn_send(&tcp_conn, recvData, 0x44);
+    return;
+  }
+
   // nothing too big
   if (len > 0x14) return;
 
@@ -143,57 +480,286 @@ void ICACHE_FLASH_ATTR tcp_connect_cb(void *arg) {
   struct espconn *conn = (struct espconn *)arg;
   espconn_set_opt(&tcp_conn, ESPCONN_NODELAY);
   espconn_regist_recvcb(conn, tcp_rx_cb);
+
+  // half a batch of the last client is gone with it
+  tx_hdr_have = 0;
+  tx_rec_have = 0;
 }
 
-// must be 0x44, because we can fit 4 more
-uint8_t buf[0x44*0x10];
-int queue_send_len = -1;
+// ***** UDP CAN stream *****
+// Clients that kick with "hello\x02" get framed datagrams: a udp_header,
+// then count 0x10 byte CAN records. The header makes the length 4 mod 0x10,
+// so it can't be mistaken for the raw records "hello" clients still get.
+// Batches are sent when full or UDP_FLUSH_US after their first record, and
+// an empty datagram goes out every second of silence.
+//
+// "hello\x02" and an options byte with UDP_KICK_LZ asks for compression. A
+// datagram with UDP_FLAG_LZ has its count records packed on their own, lost
+// ones don't matter to the next: each record after the first of its address
+// XORed with the last one of it, the time subtracted, then the bytes taken a
+// column of the records at a time, and that in LZ4's block format. Batches
+// that don't get smaller go as they are.
+
+#define UDP_FRAMED_VERSION 2
+#define UDP_MAX_RECS 0x50   // 0x514 bytes, fits the MTU
+#define UDP_RING_LEN 4
+#define UDP_FLUSH_US 2000
+#define UDP_HEARTBEAT_TICKS 200
+
+#define UDP_FLAG_END 1      // the stream stops until the next kick
+#define UDP_FLAG_LZ 2       // the records are packed, see above
+
+#define UDP_KICK_LZ 1
+#define UDP_LZ_BACK 32      // records looked back for the last of an address
+#define UDP_LZ_HASH_BITS 8
+
+typedef struct __attribute__((packed)) {
+  uint16_t magic;    // "PW"
+  uint8_t version;   // UDP_FRAMED_VERSION
+  uint8_t flags;
+  uint16_t count;    // records after the header
+  uint16_t reserved;
+  uint32_t seq;      // counts datagrams, a gap is a lost one
+  uint32_t t_first;  // ESP microseconds when the first record was polled
+  uint32_t t_send;   // ESP microseconds when the batch was closed
+} udp_header;
+
+typedef struct {
+  udp_header hdr;
+  uint8_t recs[UDP_MAX_RECS*0x10];
+  int len; // bytes of recs sent
+} udp_dgram;
+
+// udp_queued datagrams from udp_ring_r wait for espconn, the one after them is being filled
+udp_dgram udp_ring[UDP_RING_LEN];
+int udp_ring_r = 0;
+int udp_queued = 0;
+int udp_framed = 0;
+int udp_lz = 0;
+uint32_t udp_seq = 0;
+int udp_idle_ticks = 0;
+
+static volatile os_timer_t udp_flush_timer;
+
+static udp_dgram * ICACHE_FLASH_ATTR udp_filling() {
+  return &udp_ring[(udp_ring_r + udp_queued) % UDP_RING_LEN];
+}
+
+static void ICACHE_FLASH_ATTR udp_send_queued() {
+  while (udp_queued > 0) {
+    udp_dgram *d = &udp_ring[udp_ring_r];
+    int ret;
+    if (udp_framed) {
+      ret = espconn_sendto(&inter_conn, (uint8_t *)d, sizeof(udp_header) + d->len);
+    } else {
+      ret = espconn_sendto(&inter_conn, d->recs, d->hdr.count*0x10);
+    }
+    // retried by udp_callback_func
+    if (ret != 0) break;
+    udp_ring_r = (udp_ring_r + 1) % UDP_RING_LEN;
+    udp_queued--;
+    udp_idle_ticks = 0;
+  }
+}
+
+// packing, the records go through udp_lz_in into udp_lz_out
+uint8_t udp_lz_in[UDP_MAX_RECS*0x10];
+uint8_t udp_lz_out[UDP_MAX_RECS*0x10];
+uint16_t udp_lz_hash[1 << UDP_LZ_HASH_BITS]; // positions in udp_lz_in + 1, 0 for none
+
+static uint32_t ICACHE_FLASH_ATTR udp_lz_get(const uint8_t *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint8_t * ICACHE_FLASH_ATTR udp_lz_put_len(uint8_t *op, int n) {
+  for (; n >= 255; n -= 255) *op++ = 255;
+  *op++ = n;
+  return op;
+}
+
+// a sequence's literals and their token, NULL if they don't fit before oend
+static uint8_t * ICACHE_FLASH_ATTR udp_lz_literals(uint8_t *op, uint8_t *oend, const uint8_t *lit, int n) {
+  if (op + 1 + n + (n / 255) + 1 + 2 + 1 > oend) return NULL;
+  *op++ = (n < 15 ? n : 15) << 4;
+  if (n >= 15) op = udp_lz_put_len(op, n - 15);
+  memcpy(op, lit, n);
+  return op + n;
+}
+
+// LZ4's block format, 0 if it's not shorter than max. The first match found
+// for a hash is taken, and the last five bytes are always literals.
+static int ICACHE_FLASH_ATTR udp_lz_compress(const uint8_t *src, int len, uint8_t *dst, int max) {
+  const uint8_t *ip = src, *anchor = src;
+  const uint8_t *mflimit = src + len - 12;
+  const uint8_t *matchlimit = src + len - 5;
+  uint8_t *op = dst, *oend = dst + max;
+  memset(udp_lz_hash, 0, sizeof(udp_lz_hash));
+  while (ip < mflimit) {
+    uint32_t seq = udp_lz_get(ip);
+    uint32_t h = (seq * 2654435761U) >> (32 - UDP_LZ_HASH_BITS);
+    const uint8_t *m = src + udp_lz_hash[h] - 1;
+    int hit = udp_lz_hash[h] != 0 && udp_lz_get(m) == seq;
+    udp_lz_hash[h] = ip - src + 1;
+    if (!hit) {
+      ip++;
+      continue;
+    }
+    const uint8_t *end = ip + 4;
+    while (end < matchlimit && *end == m[end - ip]) end++;
+    int mlen = end - ip - 4;
+    uint8_t *token = op;
+    op = udp_lz_literals(op, oend, anchor, ip - anchor);
+    if (op == NULL || op + 2 + (mlen / 255) + 1 > oend) return 0;
+    *op++ = (ip - m) & 0xFF;
+    *op++ = (ip - m) >> 8;
+    *token |= mlen < 15 ? mlen : 15;
+    if (mlen >= 15) op = udp_lz_put_len(op, mlen - 15);
+    ip = anchor = end;
+  }
+  op = udp_lz_literals(op, oend, anchor, src + len - anchor);
+  return op == NULL ? 0 : op - dst;
+}
+
+// the records of d packed into udp_lz_out, 0 if that's no shorter
+static int ICACHE_FLASH_ATTR udp_lz_pack(udp_dgram *d) {
+  int n = d->hdr.count, a, b, c;
+  for (a = 0; a < n; a++) {
+    const uint8_t *rec = d->recs + a*0x10;
+    const uint8_t *last = NULL;
+    for (b = a - 1; b >= 0 && b >= a - UDP_LZ_BACK; b--) {
+      if (memcmp(d->recs + b*0x10, rec, 4) == 0) {
+        last = d->recs + b*0x10;
+        break;
+      }
+    }
+    for (c = 0; c < 0x10; c++) {
+      uint8_t v = rec[c];
+      if (last != NULL && c >= 4) {
+        v ^= last[c];
+        if (c == 6 || c == 7) {
+          // the time, bits 16-31 of RDTR
+          uint16_t dt = (rec[6] | (rec[7] << 8)) - (last[6] | (last[7] << 8));
+          v = (c == 6) ? (dt & 0xFF) : (dt >> 8);
+        }
+      }
+      udp_lz_in[c*n + a] = v;
+    }
+  }
+  return udp_lz_compress(udp_lz_in, n*0x10, udp_lz_out, n*0x10 - 1);
+}
+
+// queues the batch being filled, empty ones only if forced and framed
+static void ICACHE_FLASH_ATTR udp_flush(int force, uint8_t flags) {
+  udp_dgram *d = udp_filling();
+  os_timer_disarm(&udp_flush_timer);
+  if (d->hdr.count == 0 && !(force && udp_framed)) return;
+
+  if (udp_queued == UDP_RING_LEN - 1) {
+    // espconn is backed up, the seq gap tells the client
+    os_printf("UDP drop\n");
+    udp_ring_r = (udp_ring_r + 1) % UDP_RING_LEN;
+    udp_queued--;
+  }
+
+  d->hdr.magic = 'P' | ('W' << 8);
+  d->hdr.version = UDP_FRAMED_VERSION;
+  d->hdr.flags = flags;
+  d->hdr.reserved = 0;
+  d->hdr.seq = udp_seq++;
+  d->hdr.t_send = system_get_time();
+  if (d->hdr.count == 0) d->hdr.t_first = d->hdr.t_send;
+  d->len = d->hdr.count*0x10;
+  if (udp_lz && d->hdr.count > 0) {
+    int len = udp_lz_pack(d);
+    if (len > 0) {
+      memcpy(d->recs, udp_lz_out, len);
+      d->len = len;
+      d->hdr.flags |= UDP_FLAG_LZ;
+    }
+  }
+  udp_queued++;
+
+  udp_filling()->hdr.count = 0;
+  udp_send_queued();
+}
+
+static void ICACHE_FLASH_ATTR udp_flush_timer_func(void *arg) {
+  udp_flush(0, 0);
+}
+
+static void ICACHE_FLASH_ATTR udp_add_rec(const uint8_t *rec) {
+  udp_dgram *d = udp_filling();
+  if (d->hdr.count == 0) {
+    d->hdr.t_first = system_get_time();
+    os_timer_disarm(&udp_flush_timer);
+    os_timer_setfn(&udp_flush_timer, (os_timer_func_t *)udp_flush_timer_func, NULL);
+    os_timer_arm_us(&udp_flush_timer, UDP_FLUSH_US, 0);
+  }
+  memcpy(d->recs + d->hdr.count*0x10, rec, 0x10);
+  if (++d->hdr.count == UDP_MAX_RECS) udp_flush(0, 0);
+}
+
+// to every stream that is listening
+static void ICACHE_FLASH_ATTR can_rec_out(const uint8_t *rec) {
+  if (udp_countdown > 0) udp_add_rec(rec);
+  if (ws_subscribers > 0) ws_add_rec(rec);
+}
+
+// staging for one v2 read, DMAed in words
+uint32_t pollRecvData[(0x40*0x10 + 4) / 4];
 
 void ICACHE_FLASH_ATTR poll_can(void *arg) {
-  uint8_t timerRecvData[0x44] = {0};
-  int i = 0;
-  int j;
+  int len, j;
+
+  if (spi_version == SPI_VERSION_2) {
+    // all that fits in one transfer
+    len = spi_comm_v2(1, NULL, 0, (char *)pollRecvData, 0x40*0x10);
+    for (j = 0; j + 0x10 <= len; j += 0x10) {
+      can_rec_out((uint8_t *)pollRecvData + j);
+    }
+    return;
+  }
 
+  int i = 0;
   while (i < 0x40) {
-    int len = spi_comm("\x01\x00\x00\x00", 4, timerRecvData, 0x40);
+    len = spi_comm("\x01\x00\x00\x00", 4, pollRecvData, 0x40);
     if (len == 0) break;
     if (len > 0x40) { os_printf("SPI LENGTH ERROR!"); break; }
 
     // if it sends it, assume it's valid CAN
     for (j = 0; j < len; j += 0x10) {
-      memcpy(buf + i*0x10, (timerRecvData+4)+j, 0x10);
+      can_rec_out((uint8_t *)(pollRecvData+1) + j);
       i++;
     }
   }
-
-  if (i != 0) {
-    int ret = espconn_sendto(&inter_conn, buf, i*0x10);
-    if (ret != 0) {
-			os_printf("send failed: %d\n", ret);
-      queue_send_len = i*0x10;
-    } else {
-      queue_send_len = -1;
-    }
-  }
 }
 
-int udp_countdown = 0;
+void ICACHE_FLASH_ATTR can_task(os_event_t *events) {
+  // with every stream backed up, leave the CAN in the ST until a send frees a
+  // slot. A slow WebSocket client skips batches instead of stalling UDP.
+  int udp_ready = udp_countdown > 0 && udp_queued < UDP_RING_LEN - 1;
+  if (udp_ready || ws_ready()) poll_can(NULL);
+  can_task_posted = 0;
+  can_data_ready_check();
+}
 
+// retries sends, heartbeats and counts down, the CAN task does the polling
 static volatile os_timer_t udp_callback;
 void ICACHE_FLASH_ATTR udp_callback_func(void *arg) {
-  if (queue_send_len == -1) {
-    poll_can(NULL);
-  } else {
-    int ret = espconn_sendto(&inter_conn, buf, queue_send_len);
-    if (ret == 0) {
-      queue_send_len = -1;
-    }
+  if (udp_queued > 0) {
+    udp_send_queued();
+    can_data_ready_check();
+  }
+  if (++udp_idle_ticks >= UDP_HEARTBEAT_TICKS) {
+    udp_flush(1, 0);
+    udp_idle_ticks = 0;
   }
   if (udp_countdown > 0) {
     os_timer_arm(&udp_callback, 5, 0);
     udp_countdown--;
   } else {
     os_printf("UDP timeout\n");
+    udp_flush(1, UDP_FLAG_END);
   }
 }
 
@@ -207,6 +773,9 @@ void ICACHE_FLASH_ATTR inter_recv_cb(void *arg, char *pusrdata, unsigned short l
 		inter_conn.proto.udp->remote_ip[3] = premot->remote_ip[3];
 
 
+    udp_framed = (length >= 6 && memcmp(pusrdata, "hello\x02", 6) == 0);
+    udp_lz = udp_framed && length >= 7 && (pusrdata[6] & UDP_KICK_LZ);
+
     if (udp_countdown == 0) {
       os_printf("UDP recv\n");
       udp_countdown = 200*5;
@@ -215,6 +784,9 @@ void ICACHE_FLASH_ATTR inter_recv_cb(void *arg, char *pusrdata, unsigned short l
       os_timer_disarm(&udp_callback);
       os_timer_setfn(&udp_callback, (os_timer_func_t *)udp_callback_func, NULL);
       os_timer_arm(&udp_callback, 5, 0);
+
+      // the ST may have been holding data ready already
+      can_data_ready_check();
     } else {
       udp_countdown = 200*5;
     }
@@ -271,8 +843,15 @@ void ICACHE_FLASH_ATTR wifi_init() {
   for (int i = 0; i < 20; i++) {
     uint8_t digest[SHA_DIGEST_SIZE];
     char resp[0x20];
-    __spi_comm("\x00\x00\x00\x00\x40\xD0\x00\x00\x00\x00\x20\x00", 0xC, recvData, 0x40);
-    memcpy(resp, recvData+1, 0x20);
+
+    // the OTP read doubles as the probe for the v2 framing
+    int len = __spi_comm_v2(0, "\x40\xD0\x00\x00\x00\x00\x20\x00", NULL, 0, resp, 0x20);
+    if (len == 0x20) {
+      spi_version = SPI_VERSION_2;
+    } else {
+      __spi_comm("\x00\x00\x00\x00\x40\xD0\x00\x00\x00\x00\x20\x00", 0xC, recvData, 0x40);
+      memcpy(resp, recvData+1, 0x20);
+    }
 
     SHA_hash(resp, 0x1C, digest);
     if (memcmp(digest, resp+0x1C, 4) == 0) {
@@ -307,6 +886,9 @@ void ICACHE_FLASH_ATTR web_init();
 void ICACHE_FLASH_ATTR elm327_init();
 
 void ICACHE_FLASH_ATTR user_init() {
+  // microsecond timers for the UDP flush deadline
+  system_timer_reinit();
+
   // init gpio subsystem
   gpio_init();
 
@@ -335,6 +917,11 @@ void ICACHE_FLASH_ATTR user_init() {
   gpio_output_set(0, 0, (1 << 5), 0);
   gpio_output_set((1 << 5), 0, 0, 0);
 
+  // handshake and data ready from the ST, an input with a pull up
+  PIN_FUNC_SELECT(PERIPHS_IO_MUX_GPIO4_U, FUNC_GPIO4);
+  PIN_PULLUP_EN(PERIPHS_IO_MUX_GPIO4_U);
+  gpio_output_set(0, 0, 0, (1 << 4));
+
   // uart init
   uart_init(BIT_RATE_115200, BIT_RATE_115200);
 
@@ -359,6 +946,13 @@ void ICACHE_FLASH_ATTR user_init() {
     os_delay_us(50000);
   }
 
+  // poll CAN on data ready
+  system_os_task(can_task, CAN_PRIO, can_queue, 1);
+  ETS_GPIO_INTR_DISABLE();
+  ETS_GPIO_INTR_ATTACH(can_data_ready_intr, NULL);
+  gpio_pin_intr_state_set(GPIO_ID_PIN(4), GPIO_PIN_INTR_NEGEDGE);
+  ETS_GPIO_INTR_ENABLE();
+
   // jump to OS
   system_os_task(loop, LOOP_PRIO, my_queue, QUEUE_SIZE);
   system_os_post(LOOP_PRIO, 0, 0);
@@ -84,6 +84,86 @@ int ICACHE_FLASH_ATTR usb_cmd(int ep, int len, int request,
 
   return recv[0];
 }
+
+// SPI v2, for flashers that take more than 0x10 bytes at once
+int spi_comm_v2(uint8_t endpoint, const char *dat, int len, char *resp, int max_resp);
+int spi_control_v2(const char *setup, char *resp, int max_resp);
+
+// what the flasher's 0xb0 echo says it can do, see board/spi_flasher.h
+#define FLASHER_PIPELINED 1
+#define FLASHER_CRC 2
+#define FLASHER_DIFF 8
+#define ST_FLASH_V2_CHUNK 0x400
+// the flasher's FLASH_DIFF_ values
+#define ST_DIFF_BLOCK 0x400
+#define ST_DIFF_BLOCKS 48
+#define ST_DIFF_CRCS 13
+
+// zlib's CRC-32, a nibble at a time like the flasher's, of dat and then 0xff
+// up to pad_to, as the rest of a block reads once it's programmed
+uint32_t ICACHE_FLASH_ATTR st_crc32_pad(const uint8_t *dat, int len, int pad_to) {
+  static const uint32_t table[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+  };
+  uint32_t crc = 0xFFFFFFFF;
+  for (int i = 0; i < max(len, pad_to); i++) {
+    crc ^= (i < len) ? dat[i] : 0xff;
+    crc = (crc >> 4) ^ table[crc & 0xF];
+    crc = (crc >> 4) ^ table[crc & 0xF];
+  }
+  return ~crc;
+}
+
+uint32_t ICACHE_FLASH_ATTR st_crc32(const uint8_t *dat, int len) {
+  return st_crc32_pad(dat, len, len);
+}
+
+// a v2 control request, IN, with the 0xc byte flasher header back. 0 unless
+// the flasher says it did it.
+int ICACHE_FLASH_ATTR st_flasher_cmd(uint8_t request, uint16_t value, uint16_t index, char *resp, int len) {
+  char setup[8] = {0xc0, request, value & 0xff, value >> 8, index & 0xff, index >> 8, len & 0xff, len >> 8};
+  int ret = spi_control_v2(setup, resp, len);
+  return (ret >= 0xc && (uint8_t)resp[1] == 0xff) ? ret : 0;
+}
+
+// Reads the CRC-32s of the ST's blocks and sends only those that differ, the
+// flasher erases only the sectors they're in. 0 if it couldn't, a full flash
+// puts everything right again.
+int ICACHE_FLASH_ATTR st_flash_diff() {
+  static const char pad[0x10] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+                                 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+  uint32_t resp[0x40/4];
+  uint32_t ack[0xc/4];
+  int blocks = (real_content_length + ST_DIFF_BLOCK - 1) / ST_DIFF_BLOCK;
+  int changed = 0;
+
+  for (int pass = 0; pass < 2; pass++) {
+    for (int b = 0; b < blocks; b += ST_DIFF_CRCS) {
+      int n = min(ST_DIFF_CRCS, blocks - b);
+      if (st_flasher_cmd(0xb4, b, n, (char *)resp, 0xc + (n * 4)) != 0xc + (n * 4)) return 0;
+      for (int i = 0; i < n; i++) {
+        int off = (b + i) * ST_DIFF_BLOCK;
+        int len = min(ST_DIFF_BLOCK, real_content_length - off);
+        if (resp[3 + i] == st_crc32_pad((uint8_t *)&st_firmware[off], len, ST_DIFF_BLOCK)) continue;
+        // the second pass only checks
+        if (pass == 1) return 0;
+        if (!st_flasher_cmd(0xb5, b + i, 0, (char *)ack, 0xc)) return 0;
+        spi_comm_v2(2, &st_firmware[off], len, NULL, 0);
+        for (int p = len; p < ST_DIFF_BLOCK; p += sizeof(pad)) {
+          spi_comm_v2(2, pad, sizeof(pad), NULL, 0);
+        }
+        changed++;
+        system_soft_wdt_feed();
+      }
+    }
+    if (pass == 0) {
+      os_printf("st_flash: %d of %d blocks changed\n", changed, blocks);
+      if (!st_flasher_cmd(0xb6, 0, 0, (char *)ack, 0xc)) return 0;
+    }
+  }
+  return 1;
+}
  
 
 void ICACHE_FLASH_ATTR st_flash() {
@@ -103,22 +183,47 @@ void ICACHE_FLASH_ATTR st_flash() {
     os_printf("st_flash: unlock flash\n");
     usb_cmd(0, 0, 0xb1, 0, 0, NULL);
 
-    // erase sector 1
-    os_printf("st_flash: erase sector 1\n");
-    usb_cmd(0, 0, 0xb2, 1, 0, NULL);
+    // a flasher that answers the echo in v2 with what it can do takes
+    // ST_FLASH_V2_CHUNK at a time, the rest 0x10
+    uint32_t caps[0x10/4] = {0};
+    int v2 = spi_control_v2("\xc0\xb0\x00\x00\x00\x00\x10\x00", (char *)caps, 0x10) == 0x10 &&
+             (caps[3] & FLASHER_PIPELINED);
+
+    // only the blocks that changed, if the flasher can
+    int diffed = v2 && (caps[3] & FLASHER_DIFF) && (real_content_length <= ST_DIFF_BLOCKS * ST_DIFF_BLOCK) &&
+                 st_flash_diff();
+    if (!diffed) {
+      // erase sector 1
+      os_printf("st_flash: erase sector 1\n");
+      usb_cmd(0, 0, 0xb2, 1, 0, NULL);
+
+      if (real_content_length >= 16384) {
+        // erase sector 2
+        os_printf("st_flash: erase sector 2\n");
+        usb_cmd(0, 0, 0xb2, 2, 0, NULL);
+      }
 
-    if (real_content_length >= 16384) {
-      // erase sector 2
-      os_printf("st_flash: erase sector 2\n");
-      usb_cmd(0, 0, 0xb2, 2, 0, NULL);
+      // real content length will always be 0x10 aligned
+      os_printf("st_flash: flashing\n");
+      int step = v2 ? ST_FLASH_V2_CHUNK : 0x10;
+      for (int i = 0; i < real_content_length; i += step) {
+        int rl = min(step, real_content_length-i);
+        if (v2) {
+          spi_comm_v2(2, &st_firmware[i], rl, NULL, 0);
+        } else {
+          usb_cmd(2, rl, 0, 0, 0, &st_firmware[i]);
+        }
+        system_soft_wdt_feed();
+      }
     }
 
-    // real content length will always be 0x10 aligned
-    os_printf("st_flash: flashing\n");
-    for (int i = 0; i < real_content_length; i += 0x10) {
-      int rl = min(0x10, real_content_length-i);
-      usb_cmd(2, rl, 0, 0, 0, &st_firmware[i]);
-      system_soft_wdt_feed();
+    // 0xb3 only covers what was programmed in order, a diff checked its blocks
+    if (v2 && !diffed && (caps[3] & FLASHER_CRC)) {
+      uint32_t crc[0x10/4] = {0};
+      spi_control_v2("\xc0\xb3\x00\x00\x00\x00\x10\x00", (char *)crc, 0x10);
+      if (crc[3] != st_crc32((uint8_t *)st_firmware, real_content_length)) {
+        os_printf("st_flash: CRC mismatch, %08x on the ST\n", crc[3]);
+      }
     }
 
     // reboot into normal mode
@@ -177,6 +282,285 @@ void ICACHE_FLASH_ATTR st_set_boot_mode(int boot_mode) {
   gpio_output_set(0, 0, 0, (1 << 4));
 }
 
+// ***************************** WebSocket CAN *****************************
+// GET /ws upgrades to a WebSocket that streams the CAN polled for the UDP
+// pipe. Each binary message is a ws_can_header and count 0x10 byte records
+// in the USB layout. Text messages set the client's ID filter:
+//   "filter 1a0:7f0 18daf110:1fffffff" keeps frames matching any id:mask,
+//   "filter" alone passes everything.
+// Clients without a filter all get the same encoded message. A client still
+// sending the last one skips batches, and dropped counts what it missed.
+
+#define WS_MAX_CLIENTS 4
+#define WS_MAX_FILTERS 8
+#define WS_MAX_RECS 0x40
+#define WS_FLUSH_MS 10
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+typedef struct __attribute__((packed)) {
+  uint16_t count;   // records after the header
+  uint16_t dropped; // batches skipped since the last message, saturating
+  uint32_t t;       // ESP microseconds when the batch was closed
+} ws_can_header;
+
+typedef struct {
+  struct espconn *conn;
+  int busy; // espconn has not sent the last message yet
+  uint16_t dropped;
+  int filter_cnt;
+  uint32_t filter_id[WS_MAX_FILTERS];
+  uint32_t filter_mask[WS_MAX_FILTERS];
+} ws_client;
+
+ws_client ws_clients[WS_MAX_CLIENTS];
+volatile int ws_subscribers = 0;
+void can_data_ready_check();
+
+// 4 byte frame header, then the message
+#define WS_FRAME_LEN (4 + sizeof(ws_can_header) + WS_MAX_RECS*0x10)
+uint8_t ws_batch[WS_FRAME_LEN];
+uint8_t ws_filtered[WS_FRAME_LEN];
+int ws_batch_cnt = 0;
+LOCAL os_timer_t ws_flush_timer;
+
+static const char base64_table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static void ICACHE_FLASH_ATTR base64_encode(const uint8_t *dat, int len, char *out) {
+  for (int i = 0; i < len; i += 3) {
+    uint32_t v = dat[i] << 16;
+    if (i + 1 < len) v |= dat[i + 1] << 8;
+    if (i + 2 < len) v |= dat[i + 2];
+    *out++ = base64_table[(v >> 18) & 0x3F];
+    *out++ = base64_table[(v >> 12) & 0x3F];
+    *out++ = (i + 1 < len) ? base64_table[(v >> 6) & 0x3F] : '=';
+    *out++ = (i + 2 < len) ? base64_table[v & 0x3F] : '=';
+  }
+  *out = '\0';
+}
+
+static ws_client * ICACHE_FLASH_ATTR ws_find(struct espconn *conn) {
+  for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+    if (ws_clients[i].conn == conn) return &ws_clients[i];
+  }
+  return NULL;
+}
+
+static uint32_t ICACHE_FLASH_ATTR ws_rec_addr(const uint8_t *rec) {
+  uint32_t f1 = rec[0] | (rec[1] << 8) | (rec[2] << 16) | (rec[3] << 24);
+  return (f1 & 4) ? (f1 >> 3) : (f1 >> 21);
+}
+
+static int ICACHE_FLASH_ATTR ws_passes(ws_client *c, const uint8_t *rec) {
+  if (c->filter_cnt == 0) return 1;
+  uint32_t addr = ws_rec_addr(rec);
+  for (int i = 0; i < c->filter_cnt; i++) {
+    if ((addr & c->filter_mask[i]) == (c->filter_id[i] & c->filter_mask[i])) return 1;
+  }
+  return 0;
+}
+
+// fills in the frame and message headers in front of count records
+static int ICACHE_FLASH_ATTR ws_frame(uint8_t *frame, int count, uint16_t dropped) {
+  int len = sizeof(ws_can_header) + count*0x10;
+  ws_can_header *hdr = (ws_can_header *)(frame + 4);
+  frame[0] = 0x82; // FIN, binary
+  frame[1] = 126;  // 16 bit length, big endian
+  frame[2] = len >> 8;
+  frame[3] = len & 0xFF;
+  hdr->count = count;
+  hdr->dropped = dropped;
+  hdr->t = system_get_time();
+  return 4 + len;
+}
+
+static void ICACHE_FLASH_ATTR ws_send(ws_client *c, uint8_t *frame, int len) {
+  // espconn copies the data, so the batch can be reused right away
+  if (espconn_send(c->conn, frame, len) == 0) {
+    c->busy = 1;
+    c->dropped = 0;
+  } else if (c->dropped < 0xFFFF) {
+    c->dropped++;
+  }
+}
+
+static void ICACHE_FLASH_ATTR ws_flush(void *arg) {
+  os_timer_disarm(&ws_flush_timer);
+  if (ws_batch_cnt == 0) return;
+
+  uint8_t *recs = ws_batch + 4 + sizeof(ws_can_header);
+  int shared_len = 0;
+  for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+    ws_client *c = &ws_clients[i];
+    if (c->conn == NULL) continue;
+    if (c->busy) {
+      if (c->dropped < 0xFFFF) c->dropped++;
+      continue;
+    }
+
+    if (c->filter_cnt == 0 && c->dropped == 0) {
+      // encoded once for every unfiltered client
+      if (shared_len == 0) shared_len = ws_frame(ws_batch, ws_batch_cnt, 0);
+      ws_send(c, ws_batch, shared_len);
+    } else {
+      uint8_t *out = ws_filtered + 4 + sizeof(ws_can_header);
+      int count = 0;
+      for (int j = 0; j < ws_batch_cnt; j++) {
+        if (ws_passes(c, recs + j*0x10)) memcpy(out + (count++)*0x10, recs + j*0x10, 0x10);
+      }
+      if (count > 0 || c->dropped > 0) ws_send(c, ws_filtered, ws_frame(ws_filtered, count, c->dropped));
+    }
+  }
+  ws_batch_cnt = 0;
+}
+
+// there is a client that can take the next batch
+int ICACHE_FLASH_ATTR ws_ready() {
+  for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+    if (ws_clients[i].conn != NULL && !ws_clients[i].busy) return 1;
+  }
+  return 0;
+}
+
+void ICACHE_FLASH_ATTR ws_add_rec(const uint8_t *rec) {
+  if (ws_batch_cnt == 0) {
+    os_timer_disarm(&ws_flush_timer);
+    os_timer_setfn(&ws_flush_timer, (os_timer_func_t *)ws_flush, NULL);
+    os_timer_arm(&ws_flush_timer, WS_FLUSH_MS, 0);
+  }
+  memcpy(ws_batch + 4 + sizeof(ws_can_header) + ws_batch_cnt*0x10, rec, 0x10);
+  if (++ws_batch_cnt == WS_MAX_RECS) ws_flush(NULL);
+}
+
+static void ICACHE_FLASH_ATTR ws_remove(struct espconn *conn) {
+  ws_client *c = ws_find(conn);
+  if (c != NULL) {
+    c->conn = NULL;
+    ws_subscribers--;
+  }
+}
+
+static void ICACHE_FLASH_ATTR ws_sent_cb(void *arg) {
+  ws_client *c = ws_find((struct espconn *)arg);
+  if (c != NULL) {
+    c->busy = 0;
+    // the ST may be holding CAN back for us
+    can_data_ready_check();
+  }
+}
+
+static void ICACHE_FLASH_ATTR ws_discon_cb(void *arg) {
+  ws_remove((struct espconn *)arg);
+}
+
+static uint32_t ICACHE_FLASH_ATTR parse_hex(char **p, char *end) {
+  uint32_t v = 0;
+  for (; *p < end; (*p)++) {
+    char ch = **p;
+    if (ch >= '0' && ch <= '9') v = (v << 4) | (ch - '0');
+    else if (ch >= 'a' && ch <= 'f') v = (v << 4) | (ch - 'a' + 10);
+    else if (ch >= 'A' && ch <= 'F') v = (v << 4) | (ch - 'A' + 10);
+    else break;
+  }
+  return v;
+}
+
+static void ICACHE_FLASH_ATTR ws_set_filter(ws_client *c, char *p, char *end) {
+  if (end - p < 6 || memcmp(p, "filter", 6) != 0) return;
+  p += 6;
+  c->filter_cnt = 0;
+  while (p < end && c->filter_cnt < WS_MAX_FILTERS) {
+    while (p < end && *p == ' ') p++;
+    if (p == end) break;
+    uint32_t id = parse_hex(&p, end);
+    uint32_t mask = 0x1FFFFFFF;
+    if (p < end && *p == ':') {
+      p++;
+      mask = parse_hex(&p, end);
+    }
+    c->filter_id[c->filter_cnt] = id;
+    c->filter_mask[c->filter_cnt] = mask;
+    c->filter_cnt++;
+    while (p < end && *p != ' ') p++;
+  }
+}
+
+// client messages are masked and small, one TCP segment holds whole frames
+static void ICACHE_FLASH_ATTR ws_rx_cb(void *arg, char *data, uint16_t len) {
+  struct espconn *conn = (struct espconn *)arg;
+  ws_client *c = ws_find(conn);
+  char *p = data, *end = data + len;
+  if (c == NULL) return;
+
+  while (end - p >= 6) {
+    uint8_t opcode = p[0] & 0x0F;
+    uint32_t plen = p[1] & 0x7F;
+    int hlen = 2;
+    if (plen == 126) {
+      if (end - p < 8) return;
+      plen = ((uint8_t)p[2] << 8) | (uint8_t)p[3];
+      hlen = 4;
+    } else if (plen == 127) {
+      // nothing that big for us
+      return;
+    }
+    if (!(p[1] & 0x80) || end - p < hlen + 4 + plen) return;
+
+    char *mask = p + hlen;
+    char *payload = mask + 4;
+    for (uint32_t i = 0; i < plen; i++) payload[i] ^= mask[i & 3];
+
+    if (opcode == 0x1 || opcode == 0x2) {
+      ws_set_filter(c, payload, payload + plen);
+    } else if (opcode == 0x8) {
+      espconn_send(conn, "\x88\x00", 2);
+      ws_remove(conn);
+      espconn_disconnect(conn);
+      return;
+    } else if (opcode == 0x9 && plen <= 125) {
+      // pong with the same payload, it's already unmasked in place
+      payload[-2] = 0x8A;
+      payload[-1] = plen;
+      espconn_send(conn, payload - 2, plen + 2);
+    }
+    p = payload + plen;
+  }
+}
+
+static void ICACHE_FLASH_ATTR ws_upgrade(struct espconn *conn, char *data) {
+  char *key = strstr(data, "Sec-WebSocket-Key: ");
+  char *key_end = (key != NULL) ? strstr(key, "\r\n") : NULL;
+  ws_client *c = ws_find(NULL);
+  if (key_end == NULL || key_end - key > 19 + 32 || c == NULL) {
+    espconn_send_string(conn, "HTTP/1.1 503 Service Unavailable\r\n\r\n");
+    espconn_disconnect(conn);
+    return;
+  }
+
+  // accept is base64(SHA-1(key + GUID))
+  char keyguid[32 + sizeof(WS_GUID)];
+  uint8_t digest[SHA_DIGEST_SIZE];
+  char accept[32];
+  key += 19;
+  memcpy(keyguid, key, key_end - key);
+  memcpy(keyguid + (key_end - key), WS_GUID, sizeof(WS_GUID) - 1);
+  SHA_hash(keyguid, (key_end - key) + sizeof(WS_GUID) - 1, digest);
+  base64_encode(digest, SHA_DIGEST_SIZE, accept);
+
+  os_sprintf(resp, "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+    "Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+  espconn_send_string(conn, resp);
+
+  memset(c, 0, sizeof(ws_client));
+  c->conn = conn;
+  // busy until the handshake is out
+  c->busy = 1;
+  ws_subscribers++;
+  espconn_regist_recvcb(conn, ws_rx_cb);
+  espconn_regist_sentcb(conn, ws_sent_cb);
+  espconn_regist_disconcb(conn, ws_discon_cb);
+  espconn_regist_reconcb(conn, (espconn_reconnect_callback)ws_discon_cb);
+}
+
 static void ICACHE_FLASH_ATTR web_rx_cb(void *arg, char *data, uint16_t len) {
   int i;
   struct espconn *conn = (struct espconn *)arg;
@@ -185,7 +569,9 @@ static void ICACHE_FLASH_ATTR web_rx_cb(void *arg, char *data, uint16_t len) {
     os_printf("%s %d\n", data, len);
 
     // index
-    if (memcmp(data, "GET / ", 6) == 0) {
+    if (memcmp(data, "GET /ws ", 8) == 0) {
+      ws_upgrade(conn, data);
+    } else if (memcmp(data, "GET / ", 6) == 0) {
       memset(resp, 0, MAX_RESP);
 
       strcpy(resp, pageheader);
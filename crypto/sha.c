@@ -25,30 +25,53 @@
 ** ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
-// Optimized for minimal code size.
+// Word at a time, rounds unrolled five deep so the variables rotate in the
+// macro arguments instead of moving, and the schedule kept in 16 words.
+// Whole blocks are hashed straight from the caller's data.
 
 void *memcpy(void *str1, const void *str2, unsigned int n);
 
 #include "sha.h"
 
+// the caller's bytes, read as words
+typedef uint32_t __attribute__((may_alias)) sha_word;
+
 #define rol(bits, value) (((value) << (bits)) | ((value) >> (32 - (bits))))
 
-static void SHA1_Transform(SHA_CTX* ctx) {
-    uint32_t W[80];
+// W[t] for t >= 16 overwrites W[t - 16], which is the last use of it
+#define W_NEXT(t) (W[(t) & 15] = rol(1, W[((t) + 13) & 15] ^ W[((t) + 8) & 15] ^ \
+                                       W[((t) + 2) & 15] ^ W[(t) & 15]))
+#define W_AT(t) ((t) < 16 ? W[t] : W_NEXT(t))
+
+#define F1(b, c, d) ((d) ^ ((b) & ((c) ^ (d))))
+#define F2(b, c, d) ((b) ^ (c) ^ (d))
+#define F3(b, c, d) (((b) & (c)) | ((d) & ((b) | (c))))
+
+#define ROUND(a, b, c, d, e, f, k, t) \
+    e += rol(5, a) + f(b, c, d) + (k) + W_AT(t); \
+    b = rol(30, b);
+
+#define ROUNDS5(f, k, t) \
+    ROUND(A, B, C, D, E, f, k, (t)) \
+    ROUND(E, A, B, C, D, f, k, (t) + 1) \
+    ROUND(D, E, A, B, C, f, k, (t) + 2) \
+    ROUND(C, D, E, A, B, f, k, (t) + 3) \
+    ROUND(B, C, D, E, A, f, k, (t) + 4)
+
+static void SHA1_Transform(SHA_CTX* ctx, const uint8_t* p) {
+    uint32_t W[16];
     uint32_t A, B, C, D, E;
-    uint8_t* p = ctx->buf;
     int t;
 
-    for(t = 0; t < 16; ++t) {
-        uint32_t tmp =  *p++ << 24;
-        tmp |= *p++ << 16;
-        tmp |= *p++ << 8;
-        tmp |= *p++;
-        W[t] = tmp;
-    }
-
-    for(; t < 80; t++) {
-        W[t] = rol(1,W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16]);
+    if (((unsigned long)p & 3) == 0) {
+        const sha_word* w = (const sha_word*)p;
+        for (t = 0; t < 16; ++t) {
+            W[t] = __builtin_bswap32(w[t]);
+        }
+    } else {
+        for (t = 0; t < 16; ++t, p += 4) {
+            W[t] = ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+        }
     }
 
     A = ctx->state[0];
@@ -57,24 +80,10 @@ static void SHA1_Transform(SHA_CTX* ctx) {
     D = ctx->state[3];
     E = ctx->state[4];
 
-    for(t = 0; t < 80; t++) {
-        uint32_t tmp = rol(5,A) + E + W[t];
-
-        if (t < 20)
-            tmp += (D^(B&(C^D))) + 0x5A827999;
-        else if ( t < 40)
-            tmp += (B^C^D) + 0x6ED9EBA1;
-        else if ( t < 60)
-            tmp += ((B&C)|(D&(B|C))) + 0x8F1BBCDC;
-        else
-            tmp += (B^C^D) + 0xCA62C1D6;
-
-        E = D;
-        D = C;
-        C = rol(30,B);
-        B = A;
-        A = tmp;
-    }
+    for (t = 0; t < 20; t += 5) { ROUNDS5(F1, 0x5A827999, t) }
+    for (; t < 40; t += 5) { ROUNDS5(F2, 0x6ED9EBA1, t) }
+    for (; t < 60; t += 5) { ROUNDS5(F3, 0x8F1BBCDC, t) }
+    for (; t < 80; t += 5) { ROUNDS5(F2, 0xCA62C1D6, t) }
 
     ctx->state[0] += A;
     ctx->state[1] += B;
@@ -108,10 +117,20 @@ void SHA_update(SHA_CTX* ctx, const void* data, int len) {
 
     ctx->count += len;
 
-    while (len--) {
-        ctx->buf[i++] = *p++;
+    while (len > 0) {
+        if (i == 0 && len >= 64) {
+            SHA1_Transform(ctx, p);
+            p += 64;
+            len -= 64;
+            continue;
+        }
+        int n = (64 - i < len) ? 64 - i : len;
+        memcpy(ctx->buf + i, p, n);
+        i += n;
+        p += n;
+        len -= n;
         if (i == 64) {
-            SHA1_Transform(ctx);
+            SHA1_Transform(ctx, ctx->buf);
             i = 0;
         }
     }
@@ -0,0 +1,276 @@
+//Throughput and latency of the USB CAN path, on the libusb panda::Panda.
+//
+//  can_bench loopback [-p serial] [-b buses] [-t seconds] [-s kbps] [-w window] [-r fps]
+//  can_bench cross -p tx_serial -q rx_serial [-b buses] [-t seconds] [-s kbps] [-w window] [-r fps]
+//
+//loopback puts the panda's CAN controllers in loopback, so each frame sent
+//comes back as its TX echo and as a received frame. cross sends from one
+//panda and receives on the other, their buses wired together. Each bus keeps
+//up to -w frames sent and not yet echoed, so without -r it sends as fast as
+//the bus takes them. -r sends at a fixed rate per bus instead, up to the
+//window. Buses are a bit mask. The results go to stdout as JSON.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+#include "panda.h"
+
+using namespace panda;
+
+#define POP_LEN 4096
+#define BUSES 3
+//Frames carry their sequence number and this, other traffic is ignored
+#define BENCH_TAG 0x48434E42U //"BNCH"
+#define BENCH_ADDR 0x100 //Plus the bus
+//Send times are kept for this many frames back
+#define SENT_RING (1 << 20)
+//After sending stops, for the last echoes and frames to come in
+#define DRAIN_MS 250
+//A window with no echo for this long is given up on, its frames count as lost
+#define ECHO_TIMEOUT_US 100000
+
+static std::atomic<bool> kill_flag(false);
+
+static void on_signal(int) {
+	kill_flag = true;
+}
+
+static void usage() {
+	fprintf(stderr,
+		"usage: can_bench loopback [-p serial] [-b buses] [-t seconds] [-s kbps] [-w window] [-r fps]\n"
+		"       can_bench cross -p tx_serial -q rx_serial [-b buses] [-t seconds] [-s kbps] [-w window] [-r fps]\n");
+	exit(2);
+}
+
+typedef struct _bus_run {
+	uint32_t seq = 0; //Next to send
+	uint32_t acked = 0; //After the last echoed, echoes come in order
+	uint64_t acked_us = 0;
+	uint64_t echoed = 0;
+	uint64_t received = 0;
+	std::vector<uint64_t> sent_us = std::vector<uint64_t>(SENT_RING);
+	std::vector<uint32_t> echo_us;
+	std::vector<uint32_t> rx_us;
+	PANDA_CAN_STATS tx0, tx1, rx0, rx1;
+} bus_run;
+
+static uint64_t us_since(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point t) {
+	return std::chrono::duration_cast<std::chrono::microseconds>(t - start).count();
+}
+
+static void print_percentiles(const char *name, std::vector<uint32_t>& v) {
+	if (v.empty()) {
+		printf("\"%s\": null", name);
+		return;
+	}
+	std::sort(v.begin(), v.end());
+	auto at = [&](double q) { return v[std::min(v.size() - 1, (size_t)(q * v.size()))]; };
+	printf("\"%s\": {\"count\": %zu, \"p50\": %u, \"p90\": %u, \"p99\": %u, \"p999\": %u, \"max\": %u}",
+		name, v.size(), at(0.5), at(0.9), at(0.99), at(0.999), v.back());
+}
+
+static std::string json_str(const std::string& s) {
+	std::string out = "\"";
+	for (char c : s) {
+		if (c == '"' || c == '\\') out += '\\';
+		if ((unsigned char)c >= 0x20) out += c;
+	}
+	return out + "\"";
+}
+
+static bool setup(Panda& p, uint8_t buses, int kbps, bool loopback) {
+	//Both ends ACK, so neither can be silent
+	bool ok = p.set_safety_mode(SAFETY_ALLOUTPUT) && p.set_can_loopback(loopback) && p.set_can_tx_in_order(true);
+	for (int bus = 0; bus < BUSES; bus++)
+		if ((buses & (1 << bus)) && kbps > 0) ok = p.set_can_speed_kbps((PANDA_CAN_PORT)bus, kbps) && ok;
+	p.set_can_rx_format(PANDA_CAN_FORMAT_COMPACT);
+	p.can_clear(PANDA_CAN_RX);
+	return ok;
+}
+
+//Echoes come from the sending panda, received frames from either.
+static void take(bus_run runs[BUSES], uint8_t buses, std::chrono::steady_clock::time_point start,
+	const PANDA_CAN_MSG *msgs, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		const PANDA_CAN_MSG& m = msgs[i];
+		uint32_t seq, tag;
+		if (m.bus >= BUSES || !(buses & (1 << m.bus)) || m.addr_29b || m.addr != (uint32_t)(BENCH_ADDR + m.bus) || m.len != 8) continue;
+		memcpy(&seq, m.dat, 4);
+		memcpy(&tag, m.dat + 4, 4);
+		if (tag != BENCH_TAG) continue;
+
+		bus_run& r = runs[m.bus];
+		uint32_t lat = (uint32_t)(us_since(start, m.recv_time_point) - r.sent_us[seq % SENT_RING]);
+		if (m.is_receipt) {
+			r.echoed++;
+			r.echo_us.push_back(lat);
+			//Late after a timeout, acked doesn't go back
+			if ((int32_t)(seq + 1 - r.acked) > 0) r.acked = seq + 1;
+			r.acked_us = us_since(start, m.recv_time_point);
+		} else {
+			r.received++;
+			r.rx_us.push_back(lat);
+		}
+	}
+}
+
+static int bench(const std::string& mode, const std::string& tx_serial, const std::string& rx_serial,
+	uint8_t buses, double seconds, int kbps, uint32_t window, double fps) {
+	bool cross = mode == "cross";
+	auto tx = Panda::openPanda(tx_serial);
+	if (!tx) {
+		fprintf(stderr, "no panda\n");
+		return 1;
+	}
+	std::unique_ptr<Panda> rx_panda;
+	if (cross) {
+		rx_panda = Panda::openPanda(rx_serial);
+		if (!rx_panda || rx_panda->get_usb_sn() == tx->get_usb_sn()) {
+			fprintf(stderr, "no second panda\n");
+			return 1;
+		}
+	}
+	Panda& rxp = cross ? *rx_panda : *tx;
+	if (!setup(*tx, buses, kbps, !cross) || (cross && !setup(rxp, buses, kbps, false))) {
+		fprintf(stderr, "panda setup failed\n");
+		return 1;
+	}
+
+	static bus_run runs[BUSES];
+	for (int bus = 0; bus < BUSES; bus++) {
+		if (!(buses & (1 << bus))) continue;
+		tx->get_can_stats((PANDA_CAN_PORT)bus, runs[bus].tx0);
+		rxp.get_can_stats((PANDA_CAN_PORT)bus, runs[bus].rx0);
+	}
+	unsigned long long tx_dropped0 = tx->can_rx_dropped(), rx_dropped0 = rxp.can_rx_dropped();
+
+	std::thread tx_rx([&] { tx->can_rx_q_push(kill_flag); });
+	std::thread rx_rx;
+	if (cross) rx_rx = std::thread([&] { rxp.can_rx_q_push(kill_flag); });
+
+	static PANDA_CAN_MSG msgs[POP_LEN];
+	std::vector<PANDA_CAN_MSG> batch;
+	auto start = std::chrono::steady_clock::now();
+	auto stop = start + std::chrono::microseconds((uint64_t)(seconds * 1e6));
+	auto drained = stop + std::chrono::milliseconds(DRAIN_MS);
+	while (!kill_flag) {
+		auto now = std::chrono::steady_clock::now();
+		if (now >= drained) break;
+
+		if (now < stop) {
+			batch.clear();
+			uint64_t now_us = us_since(start, now);
+			for (int bus = 0; bus < BUSES; bus++) {
+				if (!(buses & (1 << bus))) continue;
+				bus_run& r = runs[bus];
+				if (r.seq != r.acked && now_us - r.acked_us > ECHO_TIMEOUT_US) {
+					r.acked = r.seq;
+					r.acked_us = now_us;
+				}
+				uint32_t room = window - std::min(window, r.seq - r.acked);
+				if (fps > 0) room = std::min(room, (uint32_t)std::max(0.0, fps * now_us / 1e6 - r.seq));
+				for (uint32_t i = 0; i < room; i++) {
+					PANDA_CAN_MSG m = {};
+					uint32_t seq = r.seq + i, tag = BENCH_TAG;
+					m.addr = BENCH_ADDR + bus;
+					m.len = 8;
+					m.bus = (PANDA_CAN_PORT)bus;
+					memcpy(m.dat, &seq, 4);
+					memcpy(m.dat + 4, &tag, 4);
+					r.sent_us[seq % SENT_RING] = now_us;
+					batch.push_back(m);
+				}
+			}
+			//Nothing is queued if they don't all fit, they go again next time
+			if (!batch.empty() && tx->can_send_async_many(batch) != 0)
+				for (auto& m : batch) runs[m.bus].seq++;
+		}
+
+		size_t n = tx->can_rx_q_pop_into(msgs, POP_LEN, &kill_flag, cross ? 0 : 1);
+		take(runs, buses, start, msgs, n);
+		if (cross) {
+			size_t m = rxp.can_rx_q_pop_into(msgs, POP_LEN, &kill_flag, n == 0 ? 1 : 0);
+			take(runs, buses, start, msgs, m);
+		}
+	}
+	double elapsed = std::min(seconds, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+
+	for (int bus = 0; bus < BUSES; bus++) {
+		if (!(buses & (1 << bus))) continue;
+		tx->get_can_stats((PANDA_CAN_PORT)bus, runs[bus].tx1);
+		rxp.get_can_stats((PANDA_CAN_PORT)bus, runs[bus].rx1);
+	}
+	unsigned long long host_dropped = tx->can_rx_dropped() - tx_dropped0 + (cross ? rxp.can_rx_dropped() - rx_dropped0 : 0);
+	kill_flag = true;
+	tx_rx.join();
+	if (cross) rx_rx.join();
+	tx->set_safety_mode(SAFETY_NOOUTPUT);
+	if (cross) rxp.set_safety_mode(SAFETY_NOOUTPUT);
+
+	printf("{\"mode\": %s, \"tx_serial\": %s, \"tx_version\": %s", json_str(mode).c_str(),
+		json_str(tx->get_usb_sn()).c_str(), json_str(tx->get_version()).c_str());
+	if (cross)
+		printf(", \"rx_serial\": %s, \"rx_version\": %s", json_str(rxp.get_usb_sn()).c_str(), json_str(rxp.get_version()).c_str());
+	printf(", \"seconds\": %.3f, \"speed_kbps\": %d, \"window\": %u, \"target_fps\": %.0f, \"host_rx_dropped\": %llu, \"buses\": [",
+		elapsed, kbps, window, fps, host_dropped);
+	bool first = true;
+	for (int bus = 0; bus < BUSES; bus++) {
+		if (!(buses & (1 << bus))) continue;
+		bus_run& r = runs[bus];
+		uint32_t dev_rx = r.rx1.rx_cnt - r.rx0.rx_cnt, dev_rx_drop = r.rx1.rx_drop_cnt - r.rx0.rx_drop_cnt;
+		printf("%s\n  {\"bus\": %d, \"sent\": %u, \"echoed\": %llu, \"received\": %llu, \"echo_fps\": %.1f, \"rx_fps\": %.1f, ",
+			first ? "" : ",", bus, r.seq, (unsigned long long)r.echoed, (unsigned long long)r.received,
+			r.echoed / elapsed, r.received / elapsed);
+		printf("\"device_rx\": %u, \"device_rx_drop\": %u, \"rx_drop_rate\": %.6f, \"device_tx_drop\": %u, \"device_err\": %u, ",
+			dev_rx, dev_rx_drop, (dev_rx + dev_rx_drop) ? (double)dev_rx_drop / (dev_rx + dev_rx_drop) : 0.0,
+			r.tx1.tx_drop_cnt - r.tx0.tx_drop_cnt, r.tx1.err_cnt - r.tx0.err_cnt);
+		print_percentiles("tx_echo_us", r.echo_us);
+		printf(", ");
+		print_percentiles("tx_rx_us", r.rx_us);
+		printf("}");
+		first = false;
+	}
+	printf("\n]}\n");
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2) usage();
+	std::string mode = argv[1];
+	if (mode != "loopback" && mode != "cross") usage();
+
+	std::string tx_serial, rx_serial;
+	uint8_t buses = 1;
+	double seconds = 10, fps = 0;
+	int kbps = 500;
+	uint32_t window = 64;
+	int opt;
+	optind = 2;
+	while ((opt = getopt(argc, argv, "p:q:b:t:s:w:r:")) != -1) {
+		switch (opt) {
+			case 'p': tx_serial = optarg; break;
+			case 'q': rx_serial = optarg; break;
+			case 'b': buses = (uint8_t)strtoul(optarg, NULL, 0); break;
+			case 't': seconds = atof(optarg); break;
+			case 's': kbps = atoi(optarg); break;
+			case 'w': window = (uint32_t)strtoul(optarg, NULL, 0); break;
+			case 'r': fps = atof(optarg); break;
+			default: usage();
+		}
+	}
+	if (mode == "cross" && (tx_serial.empty() || rx_serial.empty())) usage();
+	if ((buses & ((1 << BUSES) - 1)) == 0 || seconds <= 0 || window == 0 || window >= SENT_RING) usage();
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	return bench(mode, tx_serial, rx_serial, buses & ((1 << BUSES) - 1), seconds, kbps, window, fps);
+}
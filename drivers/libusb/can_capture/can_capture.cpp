@@ -0,0 +1,372 @@
+//Captures CAN from a panda to chunked logs, see canlog.h, and replays them.
+//
+//  can_capture record [-p serial] [-o prefix] [-r MB] [-R seconds] [-t seconds]
+//  can_capture info log...
+//  can_capture dump [-i ids] [-b buses] [-s from] [-e to] log...
+//  can_capture export [-o prefix] [-i ids] [-b buses] [-s from] [-e to] log...
+//  can_capture index log...
+//  can_capture replay [-p serial] [-m send|firmware] [-S safety] [-i ids] [-b buses] [-s from] [-e to] log...
+//
+//record writes until ^C or -t seconds, starting a new file every -r MB or -R
+//seconds of capture without stopping it. The transfers stay queued on the USB
+//thread while files are switched, on a ring that holds seconds of full load.
+//Times for -s and -e are seconds from the capture's first frame, ids are
+//comma separated and buses a bit mask. replay sends the frames with their
+//original spacing: with send, paced by the host through can_send_many, with
+//firmware, by the panda's TIM2 from its replay ring, streamed as it plays.
+//export writes the frames as a file a column, prefix.time and so on, see
+//canlog_columns. index writes the .idx of logs cut short, which have none.
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+#include "panda.h"
+#include "canlog.h"
+
+using namespace panda;
+
+#define POP_LEN 4096
+//Frames the panda's replay ring holds before it plays, and per load after
+#define REPLAY_PREFILL 0x3F
+#define REPLAY_BATCH 0x30
+//Frames sent by the host that are due within this go out in one transfer
+#define SEND_BATCH_US 1000
+
+static std::atomic<bool> kill_flag(false);
+
+static void on_signal(int) {
+	kill_flag = true;
+}
+
+static void usage() {
+	fprintf(stderr,
+		"usage: can_capture record [-p serial] [-o prefix] [-r MB] [-R seconds] [-t seconds]\n"
+		"       can_capture info log...\n"
+		"       can_capture dump [-i ids] [-b buses] [-s from] [-e to] log...\n"
+		"       can_capture export [-o prefix] [-i ids] [-b buses] [-s from] [-e to] log...\n"
+		"       can_capture index log...\n"
+		"       can_capture replay [-p serial] [-m send|firmware] [-S safety] [-i ids] [-b buses] [-s from] [-e to] log...\n");
+	exit(2);
+}
+
+static canlog_frame to_frame(const PANDA_CAN_MSG& msg) {
+	canlog_frame f;
+	memset(&f, 0, sizeof(f));
+	f.time = msg.recv_time;
+	f.addr = msg.addr;
+	f.bus = msg.bus;
+	f.len = msg.len;
+	f.flags = (msg.addr_29b ? CANLOG_EXTENDED : 0) | (msg.is_receipt ? CANLOG_RECEIPT : 0);
+	memcpy(f.dat, msg.dat, sizeof(f.dat));
+	return f;
+}
+
+static PANDA_CAN_MSG from_frame(const canlog_frame& f) {
+	PANDA_CAN_MSG msg = {};
+	msg.addr = f.addr;
+	msg.addr_29b = (f.flags & CANLOG_EXTENDED) != 0;
+	msg.recv_time = f.time;
+	msg.len = f.len > 8 ? 8 : f.len;
+	msg.bus = (f.bus <= PANDA_CAN3) ? (PANDA_CAN_PORT)f.bus : PANDA_CAN_UNK;
+	memcpy(msg.dat, f.dat, sizeof(msg.dat));
+	return msg;
+}
+
+static int record(const std::string& serial, const std::string& prefix, uint64_t rotate_bytes, uint64_t rotate_us, double seconds) {
+	auto p = Panda::openPanda(serial);
+	if (!p) {
+		fprintf(stderr, "no panda\n");
+		return 1;
+	}
+	//More frames to a packet, old firmware keeps classic timestamped records
+	if (!p->set_can_rx_format(PANDA_CAN_FORMAT_COMPACT))
+		fprintf(stderr, "firmware has no compact records, capturing classic ones\n");
+	p->can_clear(PANDA_CAN_RX);
+
+	CanLogWriter log(prefix, rotate_bytes, rotate_us, p->get_usb_sn());
+	std::thread rx([&] { p->can_rx_q_push(kill_flag); });
+
+	static PANDA_CAN_MSG msgs[POP_LEN];
+	auto start = std::chrono::steady_clock::now();
+	auto last_report = start;
+	uint64_t last_frames = 0;
+	int ret = 0;
+	while (!kill_flag) {
+		size_t n = p->can_rx_q_pop_into(msgs, POP_LEN, &kill_flag, 100);
+		for (size_t i = 0; i < n; i++) {
+			if (!log.write(to_frame(msgs[i]))) {
+				fprintf(stderr, "%s\n", log.error().c_str());
+				kill_flag = true;
+				ret = 1;
+				break;
+			}
+		}
+
+		auto now = std::chrono::steady_clock::now();
+		double elapsed = std::chrono::duration<double>(now - start).count();
+		if (now - last_report >= std::chrono::seconds(1)) {
+			double dt = std::chrono::duration<double>(now - last_report).count();
+			fprintf(stderr, "%s: %llu frames, %.0f/s, %llu dropped\n", log.path().c_str(),
+				(unsigned long long)log.frames(), (log.frames() - last_frames) / dt, p->can_rx_dropped());
+			last_report = now;
+			last_frames = log.frames();
+		}
+		if (seconds > 0 && elapsed >= seconds) kill_flag = true;
+	}
+
+	rx.join();
+	//What was decoded before the transfers were cancelled
+	size_t n;
+	while ((n = p->can_rx_q_pop_into(msgs, POP_LEN)) > 0 && ret == 0)
+		for (size_t i = 0; i < n; i++)
+			log.write(to_frame(msgs[i]));
+	log.close();
+	fprintf(stderr, "%llu frames in %u files, %llu dropped\n", (unsigned long long)log.frames(), log.files(),
+		p->can_rx_dropped());
+	return ret;
+}
+
+static bool open_logs(const std::vector<std::string>& paths, std::vector<CanLogReader>& logs) {
+	logs = std::vector<CanLogReader>(paths.size());
+	for (size_t i = 0; i < paths.size(); i++) {
+		if (!logs[i].open(paths[i])) {
+			fprintf(stderr, "%s\n", logs[i].error().c_str());
+			return false;
+		}
+	}
+	return true;
+}
+
+static int info(const std::vector<std::string>& paths) {
+	std::vector<CanLogReader> logs;
+	if (!open_logs(paths, logs)) return 1;
+	for (size_t i = 0; i < logs.size(); i++) {
+		const canlog_header& h = logs[i].header();
+		printf("%s: panda %.32s, file %u, capture started %.6f\n", paths[i].c_str(), h.serial, h.file_index,
+			h.host_time_us / 1e6);
+		if (logs[i].indexed())
+			printf("  indexed, %zu ids\n", logs[i].index_ids());
+		else
+			printf("  no index\n");
+		for (size_t c = 0; c < logs[i].chunks(); c++) {
+			const canlog_chunk *ch = logs[i].chunk(c);
+			uint32_t cnt = logs[i].chunk_frames(c);
+			if (ch == nullptr || cnt == 0) continue;
+			int ids = 0;
+			for (size_t b = 0; b < sizeof(ch->ids); b++) ids += __builtin_popcount(ch->ids[b]);
+			printf("  chunk %zu: %u frames, %.6f to %.6f s, buses 0x%x, %d id bits\n", c, cnt,
+				(ch->time_min - h.device_time0) / 1e6, (ch->time_max - h.device_time0) / 1e6, ch->buses, ids);
+		}
+	}
+	return 0;
+}
+
+static int dump(const std::vector<std::string>& paths, canlog_query q, double from, double to) {
+	std::vector<CanLogReader> logs;
+	if (!open_logs(paths, logs) || logs.empty()) return 1;
+	uint64_t t0 = logs[0].header().device_time0;
+	q.from = t0 + (uint64_t)(from * 1e6);
+	q.to = (to > 0) ? t0 + (uint64_t)(to * 1e6) : UINT64_MAX;
+	for (auto& log : logs) {
+		log.for_each(q, [&](const canlog_frame& f) {
+			printf("%.6f %d %s%x%s ", (f.time - t0) / 1e6, f.bus, (f.flags & CANLOG_EXTENDED) ? "x" : "",
+				f.addr, (f.flags & CANLOG_RECEIPT) ? " tx" : "");
+			for (int i = 0; i < f.len && i < 8; i++) printf("%02x", f.dat[i]);
+			printf("\n");
+		});
+	}
+	return 0;
+}
+
+static bool write_column(const std::string& path, const void *dat, size_t len) {
+	FILE *f = fopen(path.c_str(), "wb");
+	bool ok = f != nullptr && fwrite(dat, 1, len, f) == len;
+	if (f != nullptr) ok = (fclose(f) == 0) && ok;
+	if (!ok) fprintf(stderr, "%s: %s\n", path.c_str(), strerror(errno));
+	return ok;
+}
+
+static int export_columns(const std::vector<std::string>& paths, const std::string& prefix, canlog_query q, double from, double to) {
+	std::vector<CanLogReader> logs;
+	if (!open_logs(paths, logs) || logs.empty()) return 1;
+	uint64_t t0 = logs[0].header().device_time0;
+	q.from = t0 + (uint64_t)(from * 1e6);
+	q.to = (to > 0) ? t0 + (uint64_t)(to * 1e6) : UINT64_MAX;
+	canlog_columns cols;
+	for (auto& log : logs) log.query(q, cols);
+	size_t n = cols.size();
+	bool ok = write_column(prefix + ".time", cols.time.data(), n * sizeof(uint64_t)) &&
+		write_column(prefix + ".addr", cols.addr.data(), n * sizeof(uint32_t)) &&
+		write_column(prefix + ".bus", cols.bus.data(), n) &&
+		write_column(prefix + ".len", cols.len.data(), n) &&
+		write_column(prefix + ".flags", cols.flags.data(), n) &&
+		write_column(prefix + ".dat", cols.dat.data(), n * 8);
+	if (ok) printf("%zu frames\n", n);
+	return ok ? 0 : 1;
+}
+
+static int write_indexes(const std::vector<std::string>& paths) {
+	std::vector<CanLogReader> logs;
+	if (!open_logs(paths, logs)) return 1;
+	int ret = 0;
+	for (size_t i = 0; i < logs.size(); i++) {
+		if (logs[i].indexed()) continue;
+		if (logs[i].write_index()) {
+			printf("%s: %zu ids\n", paths[i].c_str(), logs[i].index_ids());
+		} else {
+			fprintf(stderr, "%s\n", logs[i].error().c_str());
+			ret = 1;
+		}
+	}
+	return ret;
+}
+
+//Frames due by the steady clock from the first one, SEND_BATCH_US at a time
+static bool replay_send(Panda& p, const std::vector<CanLogReader>& logs, const canlog_query& q) {
+	std::vector<PANDA_CAN_MSG> batch;
+	auto start = std::chrono::steady_clock::now();
+	uint64_t first = 0, batch_time = 0;
+	bool started = false, ok = true;
+	auto flush = [&] {
+		if (batch.empty()) return;
+		std::this_thread::sleep_until(start + std::chrono::microseconds(batch_time - first));
+		ok = p.can_send_many(batch) && ok;
+		batch.clear();
+	};
+	for (auto& log : logs) {
+		log.for_each(q, [&](const canlog_frame& f) {
+			if (kill_flag) return;
+			if (!started) {
+				started = true;
+				first = f.time;
+				start = std::chrono::steady_clock::now();
+			}
+			//Out of order frames go with the batch they came in
+			uint64_t t = (f.time > first) ? f.time : first;
+			if (!batch.empty() && t >= batch_time + SEND_BATCH_US) flush();
+			if (batch.empty()) batch_time = t;
+			batch.push_back(from_frame(f));
+		});
+	}
+	flush();
+	return ok;
+}
+
+static bool replay_firmware(Panda& p, const std::vector<CanLogReader>& logs, const canlog_query& q) {
+	PANDA_CAN_REPLAY_STATUS st;
+	if (!p.can_replay_status(st, PANDA_CAN_REPLAY_LOAD)) return false;
+
+	std::vector<PANDA_CAN_MSG> batch;
+	unsigned long long prev = 0;
+	bool first = true, playing = false, ok = true;
+	auto load = [&] {
+		if (batch.empty()) return;
+		ok = p.can_replay_load(batch.data(), batch.size(), prev) && ok;
+		batch.clear();
+		if (!playing) {
+			playing = true;
+			ok = p.can_replay_status(st, PANDA_CAN_REPLAY_PLAY) && ok;
+		}
+	};
+	for (auto& log : logs) {
+		log.for_each(q, [&](const canlog_frame& f) {
+			if (kill_flag || !ok) return;
+			if (first) {
+				first = false;
+				prev = f.time;
+			}
+			batch.push_back(from_frame(f));
+			if (batch.size() == (playing ? REPLAY_BATCH : REPLAY_PREFILL)) load();
+		});
+	}
+	load();
+
+	//Loading returns once the last frame is on the panda, wait for it to go out
+	while (ok && !kill_flag && p.can_replay_status(st) && st.state == PANDA_CAN_REPLAY_PLAYING && st.queued > 0)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	ok = p.can_replay_status(st, PANDA_CAN_REPLAY_STOP) && ok;
+	fprintf(stderr, "%u sent, %u dropped, at most %u us late\n", st.sent, st.dropped, st.late_max_us);
+	return ok;
+}
+
+static int replay(const std::string& serial, const std::string& mode, int safety, const std::vector<std::string>& paths,
+	canlog_query q, double from, double to) {
+	std::vector<CanLogReader> logs;
+	if (!open_logs(paths, logs) || logs.empty()) return 1;
+	uint64_t t0 = logs[0].header().device_time0;
+	q.from = t0 + (uint64_t)(from * 1e6);
+	q.to = (to > 0) ? t0 + (uint64_t)(to * 1e6) : UINT64_MAX;
+
+	auto p = Panda::openPanda(serial);
+	if (!p) {
+		fprintf(stderr, "no panda\n");
+		return 1;
+	}
+	if (safety >= 0) p->set_safety_mode((PANDA_SAFETY_MODE)safety);
+
+	bool ok = (mode == "firmware") ? replay_firmware(*p, logs, q) : replay_send(*p, logs, q);
+	if (!ok) fprintf(stderr, "replay failed\n");
+	return ok ? 0 : 1;
+}
+
+static std::vector<uint32_t> parse_ids(const char *s) {
+	std::vector<uint32_t> ids;
+	while (*s) {
+		char *end;
+		ids.push_back(strtoul(s, &end, 0));
+		if (end == s) usage();
+		s = (*end == ',') ? end + 1 : end;
+	}
+	return ids;
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2) usage();
+	std::string cmd = argv[1];
+	std::string serial, prefix = "can", mode = "send";
+	uint64_t rotate_bytes = 0, rotate_us = 0;
+	double seconds = 0, from = 0, to = 0;
+	int safety = -1;
+	canlog_query q;
+
+	optind = 2;
+	int opt;
+	while ((opt = getopt(argc, argv, "p:o:r:R:t:i:b:s:e:m:S:")) != -1) {
+		switch (opt) {
+			case 'p': serial = optarg; break;
+			case 'o': prefix = optarg; break;
+			case 'r': rotate_bytes = strtoull(optarg, NULL, 0) << 20; break;
+			case 'R': rotate_us = (uint64_t)(atof(optarg) * 1e6); break;
+			case 't': seconds = atof(optarg); break;
+			case 'i': q.ids = parse_ids(optarg); break;
+			case 'b': q.buses = (uint8_t)strtoul(optarg, NULL, 0); break;
+			case 's': from = atof(optarg); break;
+			case 'e': to = atof(optarg); break;
+			case 'm': mode = optarg; break;
+			case 'S': safety = (int)strtol(optarg, NULL, 0); break;
+			default: usage();
+		}
+	}
+	std::vector<std::string> paths(argv + optind, argv + argc);
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	if (cmd == "record") return record(serial, prefix, rotate_bytes, rotate_us, seconds);
+	if (paths.empty()) usage();
+	if (cmd == "info") return info(paths);
+	if (cmd == "dump") return dump(paths, q, from, to);
+	if (cmd == "export") return export_columns(paths, prefix, q, from, to);
+	if (cmd == "index") return write_indexes(paths);
+	if (cmd == "replay" && (mode == "send" || mode == "firmware")) return replay(serial, mode, safety, paths, q, from, to);
+	usage();
+}
@@ -0,0 +1,438 @@
+#include "canlog.h"
+
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+CanLogWriter::CanLogWriter(const std::string& prefix, uint64_t rotate_bytes, uint64_t rotate_us, const std::string& serial) :
+	prefix(prefix), serial(serial), rotate_bytes(rotate_bytes), rotate_us(rotate_us) {
+}
+
+CanLogWriter::~CanLogWriter() {
+	this->close();
+}
+
+bool CanLogWriter::open_file() {
+	char name[32];
+	snprintf(name, sizeof(name), "-%04u.pclog", this->file_index);
+	this->file_path = this->prefix + name;
+
+	this->fd = ::open(this->file_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (this->fd < 0) {
+		this->err = this->file_path + ": " + strerror(errno);
+		return false;
+	}
+
+	canlog_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = CANLOG_MAGIC;
+	hdr.version = CANLOG_VERSION;
+	hdr.chunk_len = CANLOG_CHUNK_LEN;
+	hdr.file_index = this->file_index;
+	hdr.host_time_us = this->host_time_us;
+	hdr.device_time0 = this->device_time0;
+	strncpy(hdr.serial, this->serial.c_str(), sizeof(hdr.serial) - 1);
+	if (ftruncate(this->fd, CANLOG_HEADER_LEN) != 0 || pwrite(this->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+		this->err = this->file_path + ": " + strerror(errno);
+		this->close_file();
+		return false;
+	}
+
+	//One left from an earlier capture would be for another file
+	unlink((this->file_path + ".idx").c_str());
+	this->index.clear();
+	this->chunk_cnt = 0;
+	return this->add_chunk();
+}
+
+//Grows the file by a chunk and maps it in place of the full one.
+bool CanLogWriter::add_chunk() {
+	off_t off = CANLOG_HEADER_LEN + (off_t)this->chunk_cnt * CANLOG_CHUNK_LEN;
+	if (this->chunk != nullptr) {
+		munmap(this->chunk, CANLOG_CHUNK_LEN);
+		this->chunk = nullptr;
+	}
+	if (ftruncate(this->fd, off + CANLOG_CHUNK_LEN) != 0) {
+		this->err = this->file_path + ": " + strerror(errno);
+		return false;
+	}
+	void *m = mmap(nullptr, CANLOG_CHUNK_LEN, PROT_READ | PROT_WRITE, MAP_SHARED, this->fd, off);
+	if (m == MAP_FAILED) {
+		this->err = this->file_path + ": " + strerror(errno);
+		return false;
+	}
+
+	this->chunk = (canlog_chunk *)m;
+	this->chunk->time_min = UINT64_MAX;
+	this->chunk->time_max = 0;
+	this->chunk->magic = CANLOG_CHUNK_MAGIC;
+	this->chunk_cnt++;
+	return true;
+}
+
+void CanLogWriter::close_file() {
+	if (this->fd < 0) return;
+	if (this->chunk != nullptr) {
+		//Drop the unused end of the last chunk
+		off_t end = CANLOG_HEADER_LEN + (off_t)(this->chunk_cnt - 1) * CANLOG_CHUNK_LEN +
+			CANLOG_CHUNK_HEADER_LEN + (off_t)this->chunk->count * sizeof(canlog_frame);
+		munmap(this->chunk, CANLOG_CHUNK_LEN);
+		this->chunk = nullptr;
+		if (ftruncate(this->fd, end) != 0)
+			this->err = this->file_path + ": " + strerror(errno);
+		else
+			this->index.save(this->file_path + ".idx", this->chunk_cnt, this->err);
+	}
+	::close(this->fd);
+	this->fd = -1;
+}
+
+void CanLogWriter::close() {
+	this->close_file();
+}
+
+bool CanLogWriter::write(const canlog_frame& frame) {
+	if (!this->started) {
+		this->started = true;
+		this->device_time0 = frame.time;
+		this->host_time_us = std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+	}
+
+	bool full = this->chunk != nullptr && this->chunk->count == CANLOG_FRAMES_PER_CHUNK;
+	bool rotate = this->fd >= 0 && (
+		(this->rotate_us != 0 && frame.time >= this->file_time0 + this->rotate_us) ||
+		(full && this->rotate_bytes != 0 &&
+			CANLOG_HEADER_LEN + (uint64_t)(this->chunk_cnt + 1) * CANLOG_CHUNK_LEN > this->rotate_bytes));
+	if (rotate) {
+		this->close_file();
+		this->file_index++;
+	}
+	if (this->fd < 0) {
+		if (!this->open_file()) return false;
+		this->file_time0 = frame.time;
+	} else if (full && !this->add_chunk()) {
+		return false;
+	}
+
+	canlog_chunk *c = this->chunk;
+	canlog_frame *frames = (canlog_frame *)((unsigned char *)c + CANLOG_CHUNK_HEADER_LEN);
+	frames[c->count] = frame;
+	c->time_min = std::min(c->time_min, frame.time);
+	c->time_max = std::max(c->time_max, frame.time);
+	if (frame.bus < 8) c->buses |= 1 << frame.bus;
+	unsigned int bit = canlog_id_bit(frame.addr, frame.flags & CANLOG_EXTENDED);
+	c->ids[bit / 8] |= 1 << (bit % 8);
+	//A reader of the live file sees the frame before the count that covers it
+	std::atomic_thread_fence(std::memory_order_release);
+	this->index.add(this->chunk_cnt - 1, c->count, frame);
+	c->count++;
+	this->frame_cnt++;
+	return true;
+}
+
+void CanLogIndexer::clear() {
+	this->ids.clear();
+	this->blocks.clear();
+	this->frames = 0;
+}
+
+void CanLogIndexer::add(size_t chunk, uint32_t n, const canlog_frame& f) {
+	size_t b = chunk * CANLOG_INDEX_BLOCKS_PER_CHUNK + n / CANLOG_INDEX_BLOCK;
+	if (b >= this->blocks.size()) this->blocks.resize(b + 1, canlog_index_block{ UINT64_MAX, 0 });
+	canlog_index_block& block = this->blocks[b];
+	block.time_min = std::min(block.time_min, f.time);
+	block.time_max = std::max(block.time_max, f.time);
+
+	uint8_t flags = f.flags & CANLOG_EXTENDED;
+	uint64_t key = f.addr | ((uint64_t)flags << 32) | ((uint64_t)f.bus << 40);
+	auto it = this->ids.find(key);
+	if (it == this->ids.end()) {
+		Id id;
+		memset(&id.entry, 0, sizeof(id.entry));
+		id.entry.addr = f.addr;
+		id.entry.bus = f.bus;
+		id.entry.flags = flags;
+		id.entry.time_min = UINT64_MAX;
+		it = this->ids.emplace(key, id).first;
+	}
+	Id& id = it->second;
+	if (id.refs.empty() || id.refs.back().chunk != chunk) id.refs.push_back(canlog_index_ref{ (uint32_t)chunk, 0 });
+	id.refs.back().frames++;
+	id.entry.frames++;
+	id.entry.time_min = std::min(id.entry.time_min, f.time);
+	id.entry.time_max = std::max(id.entry.time_max, f.time);
+	this->frames++;
+}
+
+bool CanLogIndexer::save(const std::string& path, size_t chunks, std::string& err) const {
+	std::vector<const Id *> sorted;
+	sorted.reserve(this->ids.size());
+	for (const auto& it : this->ids) sorted.push_back(&it.second);
+	std::sort(sorted.begin(), sorted.end(), [](const Id *a, const Id *b) {
+		if (a->entry.bus != b->entry.bus) return a->entry.bus < b->entry.bus;
+		if (a->entry.addr != b->entry.addr) return a->entry.addr < b->entry.addr;
+		return a->entry.flags < b->entry.flags;
+	});
+
+	canlog_index_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = CANLOG_INDEX_MAGIC;
+	hdr.version = CANLOG_INDEX_VERSION;
+	hdr.chunks = (uint32_t)chunks;
+	hdr.block_frames = CANLOG_INDEX_BLOCK;
+	hdr.frames = this->frames;
+	hdr.ids = (uint32_t)sorted.size();
+	std::vector<canlog_index_id> entries;
+	std::vector<canlog_index_ref> refs;
+	entries.reserve(sorted.size());
+	for (const Id *id : sorted) {
+		entries.push_back(id->entry);
+		entries.back().first_ref = (uint32_t)refs.size();
+		entries.back().refs = (uint32_t)id->refs.size();
+		refs.insert(refs.end(), id->refs.begin(), id->refs.end());
+	}
+	hdr.refs = (uint32_t)refs.size();
+	std::vector<canlog_index_block> blocks(this->blocks);
+	blocks.resize(chunks * CANLOG_INDEX_BLOCKS_PER_CHUNK, canlog_index_block{ UINT64_MAX, 0 });
+
+	//Written beside and renamed, so a reader never finds half of one
+	std::string tmp = path + ".tmp";
+	FILE *f = fopen(tmp.c_str(), "wb");
+	if (f == nullptr) {
+		err = tmp + ": " + strerror(errno);
+		return false;
+	}
+	bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+		fwrite(entries.data(), sizeof(canlog_index_id), entries.size(), f) == entries.size() &&
+		fwrite(refs.data(), sizeof(canlog_index_ref), refs.size(), f) == refs.size() &&
+		fwrite(blocks.data(), sizeof(canlog_index_block), blocks.size(), f) == blocks.size();
+	ok = (fclose(f) == 0) && ok;
+	if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+		err = path + ": " + strerror(errno);
+		unlink(tmp.c_str());
+		return false;
+	}
+	return true;
+}
+
+CanLogReader::~CanLogReader() {
+	this->close();
+}
+
+bool CanLogReader::open(const std::string& path) {
+	this->close();
+	this->fd = ::open(path.c_str(), O_RDONLY);
+	struct stat st;
+	if (this->fd < 0 || fstat(this->fd, &st) != 0) {
+		this->err = path + ": " + strerror(errno);
+		this->close();
+		return false;
+	}
+	if (st.st_size < CANLOG_HEADER_LEN) {
+		this->err = path + ": not a CAN log";
+		this->close();
+		return false;
+	}
+
+	this->map_len = st.st_size;
+	void *m = mmap(nullptr, this->map_len, PROT_READ, MAP_SHARED, this->fd, 0);
+	if (m == MAP_FAILED) {
+		this->err = path + ": " + strerror(errno);
+		this->map_len = 0;
+		this->close();
+		return false;
+	}
+	this->map = (const unsigned char *)m;
+	madvise(m, this->map_len, MADV_SEQUENTIAL);
+
+	this->hdr = (const canlog_header *)this->map;
+	if (this->hdr->magic != CANLOG_MAGIC || this->hdr->version != CANLOG_VERSION || this->hdr->chunk_len != CANLOG_CHUNK_LEN) {
+		this->err = path + ": not a CAN log of version " + std::to_string(CANLOG_VERSION);
+		this->close();
+		return false;
+	}
+	this->chunk_cnt = (this->map_len - CANLOG_HEADER_LEN + CANLOG_CHUNK_LEN - 1) / CANLOG_CHUNK_LEN;
+	this->path = path;
+	//Its queries go where the index sends them instead of through the file
+	if (this->load_index()) madvise(m, this->map_len, MADV_RANDOM);
+	return true;
+}
+
+bool CanLogReader::load_index() {
+	this->index_ok = false;
+	this->idx_ids.clear();
+	this->idx_refs.clear();
+	this->idx_blocks.clear();
+	FILE *f = fopen((this->path + ".idx").c_str(), "rb");
+	if (f == nullptr) return false;
+
+	canlog_index_header hdr;
+	bool ok = fread(&hdr, sizeof(hdr), 1, f) == 1 && hdr.magic == CANLOG_INDEX_MAGIC &&
+		hdr.version == CANLOG_INDEX_VERSION && hdr.block_frames == CANLOG_INDEX_BLOCK &&
+		hdr.chunks == this->chunk_cnt && hdr.frames <= (uint64_t)hdr.chunks * CANLOG_FRAMES_PER_CHUNK;
+	//Every chunk but the last is full, and the last has the frames the index
+	//has left. The file ends at its last frame, or at the end of its last
+	//chunk for one cut short and indexed after.
+	uint64_t last = hdr.frames - (uint64_t)(hdr.chunks - 1) * CANLOG_FRAMES_PER_CHUNK;
+	size_t last_off = CANLOG_HEADER_LEN + (size_t)(hdr.chunks - 1) * CANLOG_CHUNK_LEN;
+	ok = ok && hdr.chunks > 0 && hdr.frames > (uint64_t)(hdr.chunks - 1) * CANLOG_FRAMES_PER_CHUNK &&
+		(this->map_len == last_off + CANLOG_CHUNK_HEADER_LEN + last * sizeof(canlog_frame) ||
+			this->map_len == last_off + CANLOG_CHUNK_LEN) &&
+		this->chunk(hdr.chunks - 1) != nullptr && this->chunk(hdr.chunks - 1)->count == last;
+	if (ok) {
+		this->idx_ids.resize(hdr.ids);
+		this->idx_refs.resize(hdr.refs);
+		this->idx_blocks.resize((size_t)hdr.chunks * CANLOG_INDEX_BLOCKS_PER_CHUNK);
+		ok = fread(this->idx_ids.data(), sizeof(canlog_index_id), hdr.ids, f) == hdr.ids &&
+			fread(this->idx_refs.data(), sizeof(canlog_index_ref), hdr.refs, f) == hdr.refs &&
+			fread(this->idx_blocks.data(), sizeof(canlog_index_block), this->idx_blocks.size(), f) == this->idx_blocks.size();
+		for (size_t i = 0; ok && i < this->idx_ids.size(); i++) {
+			const canlog_index_id& id = this->idx_ids[i];
+			ok = (uint64_t)id.first_ref + id.refs <= hdr.refs;
+			for (uint32_t r = 0; ok && r < id.refs; r++)
+				ok = this->idx_refs[id.first_ref + r].chunk < hdr.chunks;
+		}
+	}
+	fclose(f);
+	if (!ok) {
+		this->idx_ids.clear();
+		this->idx_refs.clear();
+		this->idx_blocks.clear();
+		return false;
+	}
+	this->idx_frames = hdr.frames;
+	this->index_ok = true;
+	return true;
+}
+
+bool CanLogReader::write_index() {
+	if (this->map == nullptr) return false;
+	CanLogIndexer index;
+	for (size_t i = 0; i < this->chunk_cnt; i++) {
+		const canlog_frame *f = this->frames(i);
+		for (uint32_t n = 0, cnt = this->chunk_frames(i); n < cnt; n++) index.add(i, n, f[n]);
+	}
+	if (!index.save(this->path + ".idx", this->chunk_cnt, this->err)) return false;
+	if (!this->load_index()) {
+		//A chunk short of full before the last, the file was changed under it
+		this->err = this->path + ": can't be indexed, a chunk before the last isn't full";
+		unlink((this->path + ".idx").c_str());
+		return false;
+	}
+	return true;
+}
+
+uint32_t CanLogReader::index_chunk_frames(size_t i) const {
+	if (i + 1 < this->chunk_cnt) return CANLOG_FRAMES_PER_CHUNK;
+	return (uint32_t)(this->idx_frames - (uint64_t)i * CANLOG_FRAMES_PER_CHUNK);
+}
+
+std::vector<canlog_span> CanLogReader::plan(const canlog_query& q) const {
+	std::vector<canlog_span> spans;
+	if (!this->index_ok) {
+		for (size_t i = 0; i < this->chunk_cnt; i++)
+			if (this->chunk_matches(i, q)) spans.push_back(canlog_span{ i, 0, this->chunk_frames(i) });
+		return spans;
+	}
+
+	std::vector<bool> want(this->chunk_cnt, q.ids.empty() && q.buses == 0xFF);
+	if (!(q.ids.empty() && q.buses == 0xFF)) {
+		for (const canlog_index_id& id : this->idx_ids) {
+			if (id.bus >= 8 || !(q.buses & (1 << id.bus))) continue;
+			if (id.time_max < q.from || id.time_min >= q.to) continue;
+			if (!q.ids.empty() && std::find(q.ids.begin(), q.ids.end(), id.addr) == q.ids.end()) continue;
+			for (uint32_t r = 0; r < id.refs; r++) want[this->idx_refs[id.first_ref + r].chunk] = true;
+		}
+	}
+	for (size_t i = 0; i < this->chunk_cnt; i++) {
+		if (!want[i]) continue;
+		uint32_t cnt = this->index_chunk_frames(i);
+		for (uint32_t b = 0; b * CANLOG_INDEX_BLOCK < cnt; b++) {
+			const canlog_index_block& block = this->idx_blocks[i * CANLOG_INDEX_BLOCKS_PER_CHUNK + b];
+			if (block.time_max < q.from || block.time_min >= q.to) continue;
+			uint32_t first = b * CANLOG_INDEX_BLOCK, end = std::min<uint32_t>(first + CANLOG_INDEX_BLOCK, cnt);
+			if (!spans.empty() && spans.back().chunk == i && spans.back().end == first)
+				spans.back().end = end;
+			else
+				spans.push_back(canlog_span{ i, first, end });
+		}
+	}
+	return spans;
+}
+
+size_t CanLogReader::query(const canlog_query& q, canlog_columns& out) const {
+	//The ids' counts are what a query without times gets
+	if (this->index_ok && !q.ids.empty()) {
+		size_t n = 0;
+		for (const canlog_index_id& id : this->idx_ids)
+			if (id.bus < 8 && (q.buses & (1 << id.bus)) && std::find(q.ids.begin(), q.ids.end(), id.addr) != q.ids.end())
+				n += id.frames;
+		out.reserve(out.size() + n);
+	}
+	size_t before = out.size();
+	this->for_each(q, [&out](const canlog_frame& f) { out.push_back(f); });
+	return out.size() - before;
+}
+
+void CanLogReader::close() {
+	if (this->map != nullptr) munmap((void *)this->map, this->map_len);
+	if (this->fd >= 0) ::close(this->fd);
+	this->map = nullptr;
+	this->map_len = 0;
+	this->hdr = nullptr;
+	this->chunk_cnt = 0;
+	this->fd = -1;
+	this->index_ok = false;
+	this->idx_ids.clear();
+	this->idx_refs.clear();
+	this->idx_blocks.clear();
+}
+
+const canlog_chunk *CanLogReader::chunk(size_t i) const {
+	size_t off = CANLOG_HEADER_LEN + i * CANLOG_CHUNK_LEN;
+	if (i >= this->chunk_cnt || off + CANLOG_CHUNK_HEADER_LEN > this->map_len) return nullptr;
+	const canlog_chunk *c = (const canlog_chunk *)(this->map + off);
+	return (c->magic == CANLOG_CHUNK_MAGIC) ? c : nullptr;
+}
+
+uint32_t CanLogReader::chunk_frames(size_t i) const {
+	const canlog_chunk *c = this->chunk(i);
+	if (c == nullptr) return 0;
+	//A file cut short has fewer frames than the count says
+	size_t fit = (this->map_len - (CANLOG_HEADER_LEN + i * CANLOG_CHUNK_LEN) - CANLOG_CHUNK_HEADER_LEN) / sizeof(canlog_frame);
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return (uint32_t)std::min<size_t>(std::min<size_t>(c->count, fit), CANLOG_FRAMES_PER_CHUNK);
+}
+
+const canlog_frame *CanLogReader::frames(size_t i) const {
+	return (const canlog_frame *)(this->map + CANLOG_HEADER_LEN + i * CANLOG_CHUNK_LEN + CANLOG_CHUNK_HEADER_LEN);
+}
+
+bool CanLogReader::chunk_matches(size_t i, const canlog_query& q) const {
+	const canlog_chunk *c = this->chunk(i);
+	if (c == nullptr || this->chunk_frames(i) == 0) return false;
+	if (c->time_max < q.from || c->time_min >= q.to) return false;
+	if ((c->buses & q.buses) == 0) return false;
+	if (q.ids.empty()) return true;
+	for (uint32_t id : q.ids) {
+		//Small ids can be either kind
+		unsigned int bits[2] = { canlog_id_bit(id, false), canlog_id_bit(id, true) };
+		for (unsigned int bit : bits)
+			if (c->ids[bit / 8] & (1 << (bit % 8))) return true;
+	}
+	return false;
+}
+
+bool CanLogReader::frame_matches(const canlog_frame& f, const canlog_query& q) {
+	if (f.time < q.from || f.time >= q.to) return false;
+	if (f.bus >= 8 || !(q.buses & (1 << f.bus))) return false;
+	return q.ids.empty() || std::find(q.ids.begin(), q.ids.end(), f.addr) != q.ids.end();
+}
@@ -0,0 +1,285 @@
+#pragma once
+
+//Chunked CAN logs, written by can_capture through a shared memory map.
+//
+//A file is a CANLOG_HEADER_LEN header, then chunks of CANLOG_CHUNK_LEN bytes,
+//each a chunk header and then its frames in the order they came. The chunk
+//headers are the index: the span of device times and a bitmap of the ids and
+//buses in the chunk, so a reader skips the chunks a query can't match without
+//touching their pages. A chunk's count goes up after each frame is written,
+//so a file cut short by a crash reads up to its last frame.
+//
+//A closed file gets a finer index beside it, log.pclog.idx. It lists the
+//chunks each bus and id has frames in, so a query for a few ids maps only
+//theirs without reading the other chunk headers, and the span of times of
+//every CANLOG_INDEX_BLOCK frames of each chunk, so a time range maps only the
+//blocks in it. A file cut short has none, and is read by its chunk headers
+//until `can_capture index` writes it one.
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+
+#define CANLOG_MAGIC 0x474C4350U //"PCLG"
+#define CANLOG_CHUNK_MAGIC 0x4B4E4843U //"CHNK"
+#define CANLOG_VERSION 1
+#define CANLOG_HEADER_LEN 4096 //A page, so chunks map aligned
+#define CANLOG_CHUNK_LEN (1 << 20)
+#define CANLOG_CHUNK_HEADER_LEN 512
+//11 bit ids each have a bit, 29 bit ones are hashed into the same bits.
+#define CANLOG_ID_BITS 2048
+#define CANLOG_FRAMES_PER_CHUNK ((CANLOG_CHUNK_LEN - CANLOG_CHUNK_HEADER_LEN) / sizeof(canlog_frame))
+
+#define CANLOG_EXTENDED 1 //29 bit id
+#define CANLOG_RECEIPT 2 //Sent by the panda that captured it
+
+#define CANLOG_INDEX_MAGIC 0x494C4350U //"PCLI"
+#define CANLOG_INDEX_VERSION 1
+#define CANLOG_INDEX_BLOCK 2048 //Frames, 48KB
+#define CANLOG_INDEX_BLOCKS_PER_CHUNK ((CANLOG_FRAMES_PER_CHUNK + CANLOG_INDEX_BLOCK - 1) / CANLOG_INDEX_BLOCK)
+
+#pragma pack(push, 1)
+typedef struct _canlog_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t reserved;
+	uint32_t chunk_len;
+	uint32_t file_index; //Counts the files of one capture, from 0
+	uint64_t host_time_us; //Unix time the capture started
+	uint64_t device_time0; //Device time of the capture's first frame
+	char serial[32];
+} canlog_header;
+
+typedef struct _canlog_chunk {
+	uint32_t magic;
+	uint32_t count;
+	uint64_t time_min; //Device time in us. Frames of different buses can be a little out of order.
+	uint64_t time_max;
+	uint8_t buses; //Bit per bus
+	uint8_t reserved[7];
+	uint8_t ids[CANLOG_ID_BITS / 8];
+} canlog_chunk;
+
+typedef struct _canlog_frame {
+	uint64_t time; //Device time in us, unwrapped
+	uint32_t addr;
+	uint8_t bus;
+	uint8_t len;
+	uint8_t flags;
+	uint8_t reserved;
+	uint8_t dat[8];
+} canlog_frame;
+
+//The index is this header, its ids sorted by bus and id, the refs of the ids
+//in their order, then CANLOG_INDEX_BLOCKS_PER_CHUNK blocks for each chunk.
+typedef struct _canlog_index_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t reserved;
+	uint32_t chunks; //Of the file it was written for
+	uint32_t block_frames;
+	uint64_t frames;
+	uint32_t ids;
+	uint32_t refs;
+} canlog_index_header;
+
+typedef struct _canlog_index_id {
+	uint32_t addr;
+	uint8_t bus;
+	uint8_t flags; //CANLOG_EXTENDED
+	uint16_t reserved;
+	uint32_t frames;
+	uint32_t first_ref; //Its chunks, in order
+	uint32_t refs;
+	uint32_t reserved2;
+	uint64_t time_min;
+	uint64_t time_max;
+} canlog_index_id;
+
+typedef struct _canlog_index_ref {
+	uint32_t chunk;
+	uint32_t frames; //Of the id, in the chunk
+} canlog_index_ref;
+
+typedef struct _canlog_index_block {
+	uint64_t time_min; //UINT64_MAX and 0 for a block without frames
+	uint64_t time_max;
+} canlog_index_block;
+#pragma pack(pop)
+
+static_assert(sizeof(canlog_header) <= CANLOG_HEADER_LEN, "canlog header too big");
+static_assert(sizeof(canlog_chunk) <= CANLOG_CHUNK_HEADER_LEN, "canlog chunk header too big");
+
+inline unsigned int canlog_id_bit(uint32_t addr, bool extended) {
+	return extended ? ((addr ^ (addr >> 11) ^ (addr >> 22)) % CANLOG_ID_BITS) : (addr % CANLOG_ID_BITS);
+}
+
+//Frames a reader hands out. Empty ids and a buses of 0xFF take everything.
+typedef struct _canlog_query {
+	uint64_t from = 0; //Device times, to is exclusive
+	uint64_t to = UINT64_MAX;
+	std::vector<uint32_t> ids;
+	uint8_t buses = 0xFF;
+} canlog_query;
+
+//Frames as a column a field, in native byte order, for numpy.frombuffer and
+//the signal decoder's loops
+typedef struct _canlog_columns {
+	std::vector<uint64_t> time;
+	std::vector<uint32_t> addr;
+	std::vector<uint8_t> bus;
+	std::vector<uint8_t> len;
+	std::vector<uint8_t> flags;
+	std::vector<uint8_t> dat; //8 bytes a frame
+
+	size_t size() const { return this->time.size(); }
+
+	void reserve(size_t n) {
+		this->time.reserve(n);
+		this->addr.reserve(n);
+		this->bus.reserve(n);
+		this->len.reserve(n);
+		this->flags.reserve(n);
+		this->dat.reserve(n * 8);
+	}
+
+	void push_back(const canlog_frame& f) {
+		this->time.push_back(f.time);
+		this->addr.push_back(f.addr);
+		this->bus.push_back(f.bus);
+		this->len.push_back(f.len);
+		this->flags.push_back(f.flags);
+		this->dat.insert(this->dat.end(), f.dat, f.dat + 8);
+	}
+} canlog_columns;
+
+//Frames of a chunk a query reads, first to end
+typedef struct _canlog_span {
+	size_t chunk;
+	uint32_t first;
+	uint32_t end;
+} canlog_span;
+
+//Builds a file's index as its frames are written, or from a file without one
+class CanLogIndexer {
+public:
+	void clear();
+	//The frame at n of the chunk
+	void add(size_t chunk, uint32_t n, const canlog_frame& f);
+	bool save(const std::string& path, size_t chunks, std::string& err) const;
+
+private:
+	struct Id {
+		canlog_index_id entry;
+		std::vector<canlog_index_ref> refs;
+	};
+	std::unordered_map<uint64_t, Id> ids;
+	std::vector<canlog_index_block> blocks;
+	uint64_t frames = 0;
+};
+
+class CanLogWriter {
+public:
+	//Files are prefix-0000.pclog, prefix-0001.pclog and on. A new one is started
+	//once a file reaches rotate_bytes, or spans rotate_us of device time, 0 for never.
+	CanLogWriter(const std::string& prefix, uint64_t rotate_bytes, uint64_t rotate_us, const std::string& serial);
+	CanLogWriter(const CanLogWriter&) = delete;
+	CanLogWriter& operator=(const CanLogWriter&) = delete;
+	~CanLogWriter();
+
+	bool write(const canlog_frame& frame);
+	//Truncates the file to its last frame, the writer can't be used after.
+	void close();
+
+	std::string path() const { return this->file_path; }
+	uint64_t frames() const { return this->frame_cnt; }
+	uint32_t files() const { return this->started ? this->file_index + 1 : 0; }
+	std::string error() const { return this->err; }
+
+private:
+	bool open_file();
+	void close_file();
+	bool add_chunk();
+
+	std::string prefix;
+	std::string serial;
+	uint64_t rotate_bytes;
+	uint64_t rotate_us;
+
+	std::string file_path;
+	std::string err;
+	int fd = -1;
+	uint32_t file_index = 0;
+	uint64_t host_time_us = 0;
+	uint64_t device_time0 = 0;
+	bool started = false;
+	uint64_t file_time0 = 0; //First frame of this file
+	size_t chunk_cnt = 0; //In this file
+	canlog_chunk *chunk = nullptr; //The mapped chunk frames go in
+	uint64_t frame_cnt = 0;
+	CanLogIndexer index; //Of this file, saved when it's closed
+};
+
+class CanLogReader {
+public:
+	CanLogReader() = default;
+	CanLogReader(const CanLogReader&) = delete;
+	CanLogReader& operator=(const CanLogReader&) = delete;
+	~CanLogReader();
+	bool open(const std::string& path);
+	void close();
+
+	const canlog_header& header() const { return *this->hdr; }
+	size_t chunks() const { return this->chunk_cnt; }
+	//nullptr for a chunk that was never started
+	const canlog_chunk *chunk(size_t i) const;
+	//Frames in the chunk that made it to the file
+	uint32_t chunk_frames(size_t i) const;
+	const canlog_frame *frames(size_t i) const;
+	//Whether the chunk can hold frames the query wants, from its header alone
+	bool chunk_matches(size_t i, const canlog_query& q) const;
+	static bool frame_matches(const canlog_frame& f, const canlog_query& q);
+	std::string error() const { return this->err; }
+
+	//Whether the file's index was there and is for the file as it is
+	bool indexed() const { return this->index_ok; }
+	size_t index_ids() const { return this->idx_ids.size(); }
+	//Writes the index of a file that has none, a capture cut short
+	bool write_index();
+
+	//The frames that can be ones the query wants, in file order. With the
+	//index, only the chunks of the ids and the blocks of the times wanted.
+	std::vector<canlog_span> plan(const canlog_query& q) const;
+
+	//Calls fn on every frame the query wants, in file order
+	template <class F> void for_each(const canlog_query& q, F fn) const {
+		for (const canlog_span& s : this->plan(q)) {
+			const canlog_frame *f = this->frames(s.chunk);
+			for (uint32_t n = s.first; n < s.end; n++)
+				if (frame_matches(f[n], q)) fn(f[n]);
+		}
+	}
+
+	//Appends the frames the query wants to out, returns how many
+	size_t query(const canlog_query& q, canlog_columns& out) const;
+
+private:
+	bool load_index();
+	//Frames of the chunk by the index, without its header
+	uint32_t index_chunk_frames(size_t i) const;
+
+	std::string path;
+	std::string err;
+	int fd = -1;
+	const unsigned char *map = nullptr;
+	size_t map_len = 0;
+	const canlog_header *hdr = nullptr;
+	size_t chunk_cnt = 0;
+	bool index_ok = false;
+	uint64_t idx_frames = 0;
+	std::vector<canlog_index_id> idx_ids;
+	std::vector<canlog_index_ref> idx_refs;
+	std::vector<canlog_index_block> idx_blocks;
+};
@@ -0,0 +1,1018 @@
+// panda.cpp : libusb backend of panda::Panda.
+//
+#include <string.h>
+#include <stdio.h>
+#include <algorithm>
+
+#include "panda.h"
+
+#define PANDA_VENDOR_ID 0xbbaa
+#define PANDA_PRODUCT_ID 0xddcc
+
+#define REQUEST_IN 0xC0
+#define REQUEST_OUT 0x40
+
+#define CAN_TRANSMIT 1
+#define CAN_EXTENDED 4
+#define CAN_FILTER_EXACT 0xFFFFFFFE
+
+using namespace panda;
+
+//Opens the pandas one at a time. With want set, the first one with that serial
+//(or any, if want is empty) is returned open, the others are closed again.
+static libusb_device_handle *scan_pandas(libusb_context *ctx, const std::string *want,
+	std::vector<std::string> *found, std::string *sn_out) {
+	libusb_device **devs;
+	libusb_device_handle *ret = NULL;
+	ssize_t cnt = libusb_get_device_list(ctx, &devs);
+	if (cnt < 0) return NULL;
+
+	for (ssize_t i = 0; i < cnt && !ret; i++) {
+		libusb_device_descriptor desc;
+		if (libusb_get_device_descriptor(devs[i], &desc) != 0) continue;
+		if (desc.idVendor != PANDA_VENDOR_ID || desc.idProduct != PANDA_PRODUCT_ID) continue;
+
+		libusb_device_handle *h;
+		if (libusb_open(devs[i], &h) != 0) continue;
+
+		unsigned char buff[0x100];
+		int len = libusb_get_string_descriptor_ascii(h, desc.iSerialNumber, buff, sizeof(buff));
+		std::string sn = (len > 0) ? std::string((char*)buff, len) : std::string();
+		if (found) found->push_back(sn);
+
+		if (want && (want->empty() || *want == sn)) {
+			if (sn_out) *sn_out = sn;
+			ret = h;
+		} else {
+			libusb_close(h);
+		}
+	}
+
+	libusb_free_device_list(devs, 1);
+	return ret;
+}
+
+Panda::Panda(libusb_context *ctx, libusb_device_handle *usbh, std::string sn_) :
+	ctx(ctx), usbh(usbh), sn(sn_), usb_stop(false), can_rx_ring(CAN_RX_RING_LEN),
+	can_rx_head(0), can_rx_tail(0), can_rx_drops(0), can_rx_waiting(false),
+	can_dispatching(false), can_dispatch_kill(false), can_dispatch_id(std::thread::id()) {
+	for (auto& xfer : this->can_rx_xfers)
+		xfer = libusb_alloc_transfer(0);
+	this->can_tx_xfer = libusb_alloc_transfer(0);
+	this->usb_thread = std::thread(&Panda::usb_event_thread, this);
+
+	this->set_can_loopback(false);
+	this->set_can_timestamps(true);
+	this->set_alt_setting(0);
+}
+
+Panda::~Panda() {
+	this->can_dispatch_stop();
+	//Cancelled transfers still complete through the event thread, so it runs until they have.
+	{
+		std::unique_lock<std::mutex> lock(this->can_tx_lock);
+		this->can_tx_stop = true;
+		if (this->can_tx_inflight)
+			libusb_cancel_transfer(this->can_tx_xfer);
+		this->can_tx_completed.wait(lock, [this] { return !this->can_tx_inflight; });
+	}
+	this->can_rx_q_abort();
+
+	this->usb_stop = true;
+	this->usb_thread.join();
+
+	for (auto xfer : this->can_rx_xfers)
+		libusb_free_transfer(xfer);
+	libusb_free_transfer(this->can_tx_xfer);
+	libusb_release_interface(this->usbh, 0);
+	libusb_close(this->usbh);
+	libusb_exit(this->ctx);
+}
+
+std::vector<std::string> Panda::listAvailablePandas() {
+	std::vector<std::string> ret;
+	libusb_context *ctx;
+	if (libusb_init(&ctx) != 0) return ret;
+	scan_pandas(ctx, NULL, &ret, NULL);
+	libusb_exit(ctx);
+	return ret;
+}
+
+//Each panda has its own libusb context and event thread.
+std::unique_ptr<Panda> Panda::openPanda(std::string sn)
+{
+	libusb_context *ctx;
+	if (libusb_init(&ctx) != 0) return nullptr;
+
+	std::string found_sn;
+	libusb_device_handle *h = scan_pandas(ctx, &sn, NULL, &found_sn);
+	if (h == NULL) {
+		libusb_exit(ctx);
+		return nullptr;
+	}
+
+	//The panda kernel module may have the interface.
+	libusb_set_auto_detach_kernel_driver(h, 1);
+	int err = libusb_claim_interface(h, 0);
+	if (err != 0) {
+		printf("    Error claiming the panda interface: %s\n", libusb_error_name(err));
+		libusb_close(h);
+		libusb_exit(ctx);
+		return nullptr;
+	}
+
+	return std::unique_ptr<Panda>(new Panda(ctx, h, found_sn));
+}
+
+std::string Panda::get_usb_sn() {
+	return std::string(this->sn);
+}
+
+int Panda::control_transfer(
+	uint8_t			bmRequestType,
+	uint8_t  		bRequest,
+	uint16_t  		wValue,
+	uint16_t  		wIndex,
+	void *			data,
+	uint16_t		wLength,
+	unsigned int  	timeout
+) {
+	int ret = libusb_control_transfer(this->usbh, bmRequestType, bRequest, wValue, wIndex,
+		(unsigned char*)data, wLength, timeout);
+	return (ret < 0) ? -1 : ret;
+}
+
+bool Panda::bulk_write(uint8_t endpoint, const void * buff, int length, int *transferred, unsigned int timeout) {
+	if (!buff || !length || !transferred) return false;
+
+	int err = libusb_bulk_transfer(this->usbh, endpoint, (unsigned char*)buff, length, transferred, timeout);
+	if (err != 0) {
+		printf("    Got error during bulk xfer: %s\n", libusb_error_name(err));
+		return false;
+	}
+	return true;
+}
+
+bool Panda::bulk_read(uint8_t endpoint, void * buff, int buff_size, int *transferred, unsigned int timeout) {
+	if (!buff || !buff_size || !transferred) return false;
+
+	int err = libusb_bulk_transfer(this->usbh, endpoint, (unsigned char*)buff, buff_size, transferred, timeout);
+	if (err != 0 && err != LIBUSB_ERROR_TIMEOUT) {
+		printf("    Got error during bulk xfer: %s\n", libusb_error_name(err));
+		return false;
+	}
+	return true;
+}
+
+//libusb resets the endpoints with the alt setting, which leaves none of the
+//stale messages panda_shared has to flush out on WinUSB. Clearing the panda's
+//queue still starts the stream at the first new frame.
+bool Panda::set_alt_setting(uint8_t alt_setting) {
+	int err = libusb_set_interface_alt_setting(this->usbh, 0, alt_setting);
+	if (err != 0) {
+		printf("    Error setting usb altsetting: %s\n", libusb_error_name(err));
+		return false;
+	}
+	return this->can_clear(PANDA_CAN_RX);
+}
+
+uint8_t Panda::get_current_alt_setting() {
+	uint8_t alt_setting = 0;
+	//GET_INTERFACE, libusb doesn't keep the current setting.
+	if (this->control_transfer(LIBUSB_ENDPOINT_IN | LIBUSB_RECIPIENT_INTERFACE, LIBUSB_REQUEST_GET_INTERFACE,
+		0, 0, &alt_setting, 1, 0) != 1)
+		return 0;
+	return alt_setting;
+}
+
+//Raw IO is a WinUSB pipe policy. libusb transfers already go to the device as queued.
+bool Panda::set_raw_io(bool val) {
+	(void)val;
+	return true;
+}
+
+PANDA_HEALTH Panda::get_health(bool reset)
+{
+	PANDA_HEALTH health;
+	memset(&health, 0, sizeof(health));
+	if (this->control_transfer(REQUEST_IN, 0xd2, reset ? 1 : 0, 0, &health, sizeof(health), 0) == -1)
+		printf("    Got unexpected error while reading panda health\n");
+	return health;
+}
+
+bool Panda::get_can_stats(PANDA_CAN_PORT bus, PANDA_CAN_STATS& stats) {
+	if (bus == PANDA_CAN_UNK) return false;
+	memset(&stats, 0, sizeof(stats));
+	return this->control_transfer(REQUEST_IN, 0xc0, bus, 0, &stats, sizeof(stats), 0) == sizeof(stats);
+}
+
+bool Panda::get_time(uint32_t& time) {
+	memset(&time, 0, sizeof(time));
+	return this->control_transfer(REQUEST_IN, 0xfe, 0, 0, &time, sizeof(time), 0) == sizeof(time);
+}
+
+bool Panda::enter_bootloader() {
+	return this->control_transfer(REQUEST_OUT, 0xd1, 0, 0, NULL, 0, 0) != -1;
+}
+
+std::string Panda::get_version() {
+	char buff[0x41];
+	memset(buff, 0, sizeof(buff));
+
+	int xferCount = this->control_transfer(REQUEST_IN, 0xd6, 0, 0, buff, 0x40, 0);
+	if (xferCount == -1) return std::string();
+	return std::string(buff);
+}
+
+std::string Panda::get_serial() {
+	char buff[0x21];
+	memset(buff, 0, sizeof(buff));
+
+	int xferCount = this->control_transfer(REQUEST_IN, 0xd0, 0, 0, buff, 0x20, 0);
+	if (xferCount == -1) return std::string();
+	return std::string(buff);
+}
+
+//Secret appears to by raw bytes, not a string. TODO: Change returned type.
+std::string Panda::get_secret() {
+	char buff[0x11];
+	memset(buff, 0, sizeof(buff));
+
+	int xferCount = this->control_transfer(REQUEST_IN, 0xd0, 1, 0, buff, 0x10, 0);
+	if (xferCount == -1) return std::string();
+	return std::string(buff);
+}
+
+bool Panda::set_usb_power(bool on) {
+	return this->control_transfer(REQUEST_OUT, 0xe6, (int)on, 0, NULL, 0, 0) != -1;
+}
+
+bool Panda::set_esp_power(bool on) {
+	return this->control_transfer(REQUEST_OUT, 0xd9, (int)on, 0, NULL, 0, 0) != -1;
+}
+
+bool Panda::esp_reset(uint16_t bootmode) {
+	return this->control_transfer(REQUEST_OUT, 0xda, bootmode, 0, NULL, 0, 0) != -1;
+}
+
+bool Panda::set_safety_mode(PANDA_SAFETY_MODE mode) {
+	return this->control_transfer(REQUEST_OUT, 0xdc, mode, 0, NULL, 0, 0) != -1;
+}
+
+bool Panda::set_can_forwarding(PANDA_CAN_PORT from_bus, PANDA_CAN_PORT to_bus) {
+	if (from_bus == PANDA_CAN_UNK) return false;
+	return this->control_transfer(REQUEST_OUT, 0xdd, from_bus, to_bus, NULL, 0, 0) != -1;
+}
+
+bool Panda::set_gmlan(PANDA_GMLAN_HOST_PORT bus) {
+	return this->control_transfer(REQUEST_OUT, 0xdb, 1, (bus == PANDA_GMLAN_CLEAR) ? 0 : bus, NULL, 0, 0) != -1;
+}
+
+bool Panda::set_can_loopback(bool enable) {
+	this->loopback = enable;
+	return this->control_transfer(REQUEST_OUT, 0xe5, enable, 0, NULL, 0, 0) != -1;
+}
+
+//By default the panda sends queued messages by identifier priority.
+bool Panda::set_can_tx_in_order(bool enable) {
+	return this->control_transfer(REQUEST_OUT, 0xe7, enable, 0, NULL, 0, 0) != -1;
+}
+
+//Frames not matching any filter are dropped by the panda hardware. The ids
+//needed by the safety mode are always received. No filters receives all.
+bool Panda::set_can_filters(PANDA_CAN_PORT bus, const std::vector<PANDA_CAN_FILTER>& filters) {
+	if (bus == PANDA_CAN_UNK) return false;
+	if (this->control_transfer(REQUEST_OUT, 0xdf, bus, 0, NULL, 0, 0) == -1) return false;
+
+	for (auto& filter : filters) {
+		uint32_t rir, rmask;
+		if (filter.addr_29b) {
+			rir = (filter.addr << 3) | CAN_EXTENDED;
+			rmask = (filter.mask == 0x1FFFFFFF) ? CAN_FILTER_EXACT : ((filter.mask << 3) | CAN_EXTENDED);
+		} else {
+			rir = (filter.addr & 0x7FF) << 21;
+			rmask = (filter.mask == 0x7FF) ? CAN_FILTER_EXACT : (((filter.mask & 0x7FF) << 21) | CAN_EXTENDED);
+		}
+		if (this->control_transfer(REQUEST_OUT, 0xe8, rir & 0xFFFF, rir >> 16, NULL, 0, 0) == -1) return false;
+		if (this->control_transfer(REQUEST_OUT, 0xe9, rmask & 0xFFFF, rmask >> 16, NULL, 0, 0) == -1) return false;
+		if (this->control_transfer(REQUEST_OUT, 0xdf, bus, 1, NULL, 0, 0) == -1) return false;
+	}
+
+	return this->control_transfer(REQUEST_OUT, 0xdf, bus, 2, NULL, 0, 0) != -1;
+}
+
+//Received CAN messages carry the 32 bit microsecond timer of the panda.
+bool Panda::set_can_timestamps(bool enable) {
+	return this->control_transfer(REQUEST_OUT, 0xea, enable, 0, NULL, 0, 0) != -1;
+}
+
+//0xc4 answers with the rx and tx formats the panda took, tx stays classic here.
+bool Panda::set_can_rx_format(PANDA_CAN_FORMAT format) {
+	uint8_t took[2] = {};
+	int len = this->control_transfer(REQUEST_IN, 0xc4, format, PANDA_CAN_FORMAT_CLASSIC, took, sizeof(took), 0);
+	this->can_rx_format = (len == sizeof(took)) ? (PANDA_CAN_FORMAT)took[0] : PANDA_CAN_FORMAT_CLASSIC;
+	return this->can_rx_format == format;
+}
+
+//The panda sends the message every period_ms until the slot is cleared.
+//The safety mode still checks every message it sends.
+bool Panda::set_can_periodic(uint8_t slot, uint32_t addr, bool addr_29b, const uint8_t *dat, uint8_t len, PANDA_CAN_PORT bus, uint16_t period_ms) {
+	if (bus == PANDA_CAN_UNK || slot >= PANDA_CAN_PERIODIC_SLOTS || len > 8 || period_ms == 0) return false;
+
+	uint32_t words[4] = {};
+	words[0] = addr_29b ? ((addr << 3) | CAN_EXTENDED) : ((addr & 0x7FF) << 21);
+	words[1] = len;
+	memcpy(&words[2], dat, len);
+
+	for (int i = 0; i < 8; i++) {
+		uint16_t half = (uint16_t)(words[i / 2] >> ((i % 2) * 16));
+		if (this->control_transfer(REQUEST_OUT, 0xeb, i, half, NULL, 0, 0) == -1) return false;
+	}
+	return this->control_transfer(REQUEST_OUT, 0xec, slot | (bus << 8), period_ms, NULL, 0, 0) != -1;
+}
+
+bool Panda::clear_can_periodic(uint16_t slot) {
+	return this->control_transfer(REQUEST_OUT, 0xed, slot, 0, NULL, 0, 0) != -1;
+}
+
+//Can not use the full range of 16 bit speed.
+//cbps means centa bits per second (tento of kbps)
+bool Panda::set_can_speed_cbps(PANDA_CAN_PORT bus, uint16_t speed) {
+	if (bus == PANDA_CAN_UNK) return false;
+	return this->control_transfer(REQUEST_OUT, 0xde, bus, speed, NULL, 0, 0) != -1;
+}
+
+//Can not use the full range of 16 bit speed.
+bool Panda::set_can_speed_kbps(PANDA_CAN_PORT bus, uint16_t speed) {
+	return set_can_speed_cbps(bus, speed * 10);
+}
+
+//Can not use full 32 bit range of rate
+bool Panda::set_uart_baud(PANDA_SERIAL_PORT uart, uint32_t rate) {
+	return this->control_transfer(REQUEST_OUT, 0xe4, uart, rate / 300, NULL, 0, 0) != -1;
+}
+
+bool Panda::set_uart_parity(PANDA_SERIAL_PORT uart, PANDA_SERIAL_PORT_PARITY parity) {
+	return this->control_transfer(REQUEST_OUT, 0xe2, uart, parity, NULL, 0, 0) != -1;
+}
+
+bool Panda::can_send_many(const std::vector<PANDA_CAN_MSG>& can_msgs) {
+	std::vector<PANDA_CAN_MSG_INTERNAL> formatted_msgs;
+	formatted_msgs.reserve(can_msgs.size());
+
+	for (auto& msg : can_msgs) {
+		if (msg.bus == PANDA_CAN_UNK) continue;
+		if (msg.len > 8) continue;
+		PANDA_CAN_MSG_INTERNAL tmpmsg;
+		pack_can_msg(tmpmsg, msg.addr, msg.addr_29b, msg.dat, msg.len, msg.bus);
+		formatted_msgs.push_back(tmpmsg);
+	}
+
+	if (formatted_msgs.size() == 0) return false;
+
+	int retcount;
+	return this->bulk_write(3, formatted_msgs.data(),
+		(int)(sizeof(PANDA_CAN_MSG_INTERNAL)*formatted_msgs.size()), &retcount, 0);
+}
+
+bool Panda::can_send(uint32_t addr, bool addr_29b, const uint8_t *dat, uint8_t len, PANDA_CAN_PORT bus) {
+	if (bus == PANDA_CAN_UNK) return false;
+	if (len > 8) return false;
+	PANDA_CAN_MSG_INTERNAL msg;
+	pack_can_msg(msg, addr, addr_29b, dat, len, bus);
+
+	int retcount;
+	return this->bulk_write(3, &msg, sizeof(msg), &retcount, 0);
+}
+
+void Panda::pack_can_msg(PANDA_CAN_MSG_INTERNAL& out, uint32_t addr, bool addr_29b, const uint8_t *dat, uint8_t len, PANDA_CAN_PORT bus) {
+	memset(&out, 0, sizeof(out));
+	out.rir = (addr_29b) ?
+		((addr << 3) | CAN_TRANSMIT | CAN_EXTENDED) :
+		(((addr & 0x7FF) << 21) | CAN_TRANSMIT);
+	out.f2 = len | (bus << 4);
+	memcpy(out.dat, dat, len);
+}
+
+unsigned long long Panda::can_send_async(uint32_t addr, bool addr_29b, const uint8_t *dat, uint8_t len, PANDA_CAN_PORT bus) {
+	if (bus == PANDA_CAN_UNK) return 0;
+	if (len > 8) return 0;
+
+	std::lock_guard<std::mutex> lock(this->can_tx_lock);
+	if (this->can_tx_stop || this->can_tx_queued - this->can_tx_taken >= CAN_TX_QUEUE_LEN) return 0;
+	unsigned long long seq = ++this->can_tx_queued;
+	pack_can_msg(this->can_tx_q[seq % CAN_TX_QUEUE_LEN], addr, addr_29b, dat, len, bus);
+	if (!this->can_tx_inflight) this->can_tx_submit();
+	return seq;
+}
+
+unsigned long long Panda::can_send_async_many(const std::vector<PANDA_CAN_MSG>& can_msgs) {
+	if (can_msgs.size() == 0) return 0;
+	for (auto& msg : can_msgs)
+		if (msg.bus == PANDA_CAN_UNK || msg.len > 8) return 0;
+
+	std::lock_guard<std::mutex> lock(this->can_tx_lock);
+	if (this->can_tx_stop || this->can_tx_queued - this->can_tx_taken + can_msgs.size() > CAN_TX_QUEUE_LEN) return 0;
+	unsigned long long seq = 0;
+	for (auto& msg : can_msgs) {
+		seq = ++this->can_tx_queued;
+		pack_can_msg(this->can_tx_q[seq % CAN_TX_QUEUE_LEN], msg.addr, msg.addr_29b, msg.dat, msg.len, msg.bus);
+	}
+	if (!this->can_tx_inflight) this->can_tx_submit();
+	return seq;
+}
+
+//Only one transfer is in flight. Everything queued while it is goes out
+//together in the next one, submitted from its completion. Called with
+//can_tx_lock held and no transfer in flight.
+void Panda::can_tx_submit() {
+	while (this->can_tx_queued > this->can_tx_taken) {
+		int count = (int)std::min<unsigned long long>(this->can_tx_queued - this->can_tx_taken, CAN_TX_COALESCE_MAX);
+		for (int i = 0; i < count; i++)
+			this->can_tx_buff[i] = this->can_tx_q[(this->can_tx_taken + 1 + i) % CAN_TX_QUEUE_LEN];
+		this->can_tx_taken += count;
+
+		libusb_fill_bulk_transfer(this->can_tx_xfer, this->usbh, 3, (unsigned char*)this->can_tx_buff,
+			count * sizeof(PANDA_CAN_MSG_INTERNAL), _can_tx_callback, this, 0);
+		int err = libusb_submit_transfer(this->can_tx_xfer);
+		if (err == 0) {
+			this->can_tx_inflight = true;
+			return;
+		}
+
+		printf("    Got error submitting async bulk xfer: %s\n", libusb_error_name(err));
+		this->can_tx_failed += count;
+		this->can_tx_done += count;
+		this->can_tx_completed.notify_all();
+	}
+}
+
+void Panda::can_tx_complete(libusb_transfer *transfer) {
+	std::lock_guard<std::mutex> lock(this->can_tx_lock);
+	unsigned long long count = transfer->length / sizeof(PANDA_CAN_MSG_INTERNAL);
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		if (transfer->status != LIBUSB_TRANSFER_CANCELLED)
+			printf("    Got error during async bulk xfer: %d\n", transfer->status);
+		this->can_tx_failed += count;
+	}
+	this->can_tx_done += count;
+	this->can_tx_inflight = false;
+	this->can_tx_completed.notify_all();
+
+	if (!this->can_tx_stop) this->can_tx_submit();
+}
+
+bool Panda::can_tx_wait(unsigned long long seq, unsigned int timeoutms) {
+	std::unique_lock<std::mutex> lock(this->can_tx_lock);
+	auto done = [this, seq] { return this->can_tx_done >= seq; };
+	if (timeoutms == PANDA_INFINITE) {
+		this->can_tx_completed.wait(lock, done);
+		return true;
+	}
+	return this->can_tx_completed.wait_for(lock, std::chrono::milliseconds(timeoutms), done);
+}
+
+unsigned long long Panda::can_tx_errors() {
+	std::lock_guard<std::mutex> lock(this->can_tx_lock);
+	return this->can_tx_failed;
+}
+
+void Panda::usb_event_thread() {
+	//The timeout bounds how long the destructor waits for this thread.
+	struct timeval tv = { 0, 100000 };
+	while (!this->usb_stop)
+		libusb_handle_events_timeout_completed(this->ctx, &tv, NULL);
+}
+
+//The panda latches its 32 bit microsecond timer when the frame is received
+//or echoed. The buses' queues are merged, so a time can be a little before
+//the newest one seen, from before the wrap if that was just now. Otherwise a
+//smaller time means the timer wrapped (about every 71 minutes).
+unsigned long long Panda::unwrap_device_time(uint32_t ts) {
+	uint32_t back = this->last_device_time - ts;
+	if (this->device_time_seen && back != 0 && back < CAN_TIME_LATE_MAX) {
+		bool before_wrap = ts > this->last_device_time && this->device_time_base > 0;
+		return this->device_time_base + ts - (before_wrap ? 0x100000000ULL : 0);
+	}
+	if (ts < this->last_device_time)
+		this->device_time_base += 0x100000000ULL;
+	this->last_device_time = ts;
+	this->device_time_seen = true;
+	return this->device_time_base + ts;
+}
+
+void Panda::parse_can_recv(const PANDA_CAN_MSG_TS_INTERNAL *in_msg_ts_raw, PANDA_CAN_MSG& in_msg,
+	std::chrono::time_point<std::chrono::steady_clock> recv_time_point) {
+	const PANDA_CAN_MSG_INTERNAL *in_msg_raw = &in_msg_ts_raw->msg;
+
+	in_msg.addr_29b = (bool)(in_msg_raw->rir & CAN_EXTENDED);
+	in_msg.addr = (in_msg.addr_29b) ? (in_msg_raw->rir >> 3) : (in_msg_raw->rir >> 21);
+	in_msg.recv_time = this->unwrap_device_time(in_msg_ts_raw->timestamp);
+	in_msg.recv_time_point = recv_time_point;
+	in_msg.len = in_msg_raw->f2 & 0xF;
+	memcpy(in_msg.dat, in_msg_raw->dat, 8);
+
+	in_msg.is_receipt = ((in_msg_raw->f2 >> 4) & 0x80) == 0x80;
+	//TXRQ is never set on a received frame, the panda marks completions with it.
+	in_msg.is_completion = (in_msg_raw->rir & 1) != 0;
+	in_msg.tx_token = in_msg.is_completion ? (in_msg_raw->dat[0] | ((in_msg_raw->dat[1] & 3) << 8)) : 0;
+	in_msg.tx_failed = in_msg.is_completion && (in_msg_raw->dat[1] & 0x80) != 0;
+	in_msg.tx_arb_lost = in_msg.is_completion && (in_msg_raw->dat[1] & 0x40) != 0;
+	switch ((in_msg_raw->f2 >> 4) & 0x7F) {
+	case PANDA_CAN1:
+		in_msg.bus = PANDA_CAN1;
+		break;
+	case PANDA_CAN2:
+		in_msg.bus = PANDA_CAN2;
+		break;
+	case PANDA_CAN3:
+		in_msg.bus = PANDA_CAN3;
+		break;
+	default:
+		in_msg.bus = PANDA_CAN_UNK;
+	}
+}
+
+//A compact record is a byte of len (bits 0-3), bus (4-5), sent by the panda
+//(6) and 29 bit id (7), the id in 2 or 4 bytes, the time as an int16 from the
+//packet's first record or 0x8000 and the 32 bit time, then the data. A len of
+//0xF pads out the packet. Returns 0 at the padding or a record cut short.
+//A len of 0xD is a completion, the 2 byte token in place of the id and no data.
+unsigned long Panda::can_compact_rec_len(const unsigned char *rec, unsigned long len) {
+	if (len < 1 || (rec[0] & 0xF) == 0xF) return 0;
+	bool done = (rec[0] & 0xF) == PANDA_CAN_COMPACT_DONE;
+	unsigned long dlc = done ? 0 : ((rec[0] & 0xF) > 8 ? 8 : (rec[0] & 0xF));
+	unsigned long idl = ((rec[0] & 0x80) && !done) ? 4 : 2;
+	if (len < 1 + idl + 2) return 0;
+	bool wide = rec[1 + idl] == 0x00 && rec[2 + idl] == 0x80;
+	unsigned long rec_len = 1 + idl + (wide ? 6 : 2) + dlc;
+	return (rec_len <= len) ? rec_len : 0;
+}
+
+size_t Panda::can_compact_pkt_count(const unsigned char *pkt, unsigned long len) {
+	size_t count = 0;
+	for (unsigned long pos = 0, rec_len; (rec_len = can_compact_rec_len(pkt + pos, len - pos)) != 0; pos += rec_len)
+		++count;
+	return count;
+}
+
+//rec has been checked by can_compact_rec_len. The packet's first record sets ts_base.
+void Panda::parse_can_recv_compact(const unsigned char *rec, uint32_t& ts_base, bool first, PANDA_CAN_MSG& in_msg,
+	std::chrono::time_point<std::chrono::steady_clock> recv_time_point) {
+	unsigned long pos = 1;
+	in_msg.is_completion = (rec[0] & 0xF) == PANDA_CAN_COMPACT_DONE;
+	in_msg.tx_token = 0;
+	in_msg.addr_29b = (rec[0] & 0x80) != 0 && !in_msg.is_completion;
+	in_msg.addr = 0;
+	memcpy(in_msg.is_completion ? (void *)&in_msg.tx_token : (void *)&in_msg.addr, rec + pos, in_msg.addr_29b ? 4 : 2);
+	pos += in_msg.addr_29b ? 4 : 2;
+	in_msg.tx_failed = (in_msg.tx_token & 0x8000) != 0;
+	in_msg.tx_arb_lost = (in_msg.tx_token & 0x4000) != 0;
+	in_msg.tx_token &= 0x3FF;
+
+	int16_t rel;
+	memcpy(&rel, rec + pos, sizeof(rel));
+	pos += sizeof(rel);
+	uint32_t ts;
+	if ((uint16_t)rel == 0x8000) {
+		memcpy(&ts, rec + pos, sizeof(ts));
+		pos += sizeof(ts);
+	} else {
+		ts = ts_base + (int32_t)rel;
+	}
+	if (first) ts_base = ts;
+	in_msg.recv_time = this->unwrap_device_time(ts);
+	in_msg.recv_time_point = recv_time_point;
+
+	in_msg.len = in_msg.is_completion ? 0 : ((rec[0] & 0xF) > 8 ? 8 : (rec[0] & 0xF));
+	memset(in_msg.dat, 0, sizeof(in_msg.dat));
+	memcpy(in_msg.dat, rec + pos, in_msg.len);
+
+	in_msg.is_receipt = (rec[0] & 0x40) != 0;
+	in_msg.bus = ((rec[0] >> 4) & 3) <= PANDA_CAN3 ? (PANDA_CAN_PORT)((rec[0] >> 4) & 3) : PANDA_CAN_UNK;
+}
+
+void Panda::set_can_rx_pipeline_depth(unsigned int depth) {
+	std::lock_guard<std::mutex> lock(this->can_rx_lock);
+	this->can_rx_pipeline_depth = std::max(1U, std::min(depth, (unsigned int)CAN_RX_PIPELINE_MAX));
+}
+
+bool Panda::can_rx_q_push(const std::atomic<bool>& kill, unsigned int timeoutms) {
+	auto wait = std::chrono::milliseconds((timeoutms == PANDA_INFINITE) ? 100 : timeoutms);
+	{
+		std::unique_lock<std::mutex> lock(this->can_rx_lock);
+		this->can_rx_running = true;
+		while (!kill && !this->can_rx_gone && this->can_rx_running) {
+			// Completions resubmit their own transfer, this only tops the
+			// pipeline up to depth, at the start and when depth grows.
+			for (int i = 0; i < CAN_RX_PIPELINE_MAX && this->can_rx_outstanding < this->can_rx_pipeline_depth; i++) {
+				if (this->can_rx_busy[i]) continue;
+				libusb_fill_bulk_transfer(this->can_rx_xfers[i], this->usbh, 0x81, this->can_rx_bufs[i],
+					sizeof(this->can_rx_bufs[i]), _can_rx_callback, this, 0);
+				int err = libusb_submit_transfer(this->can_rx_xfers[i]);
+				if (err != 0) {
+					if (err == LIBUSB_ERROR_NO_DEVICE) this->can_rx_gone = true;
+					break;
+				}
+				this->can_rx_busy[i] = true;
+				this->can_rx_outstanding++;
+			}
+			this->can_rx_changed.wait_for(lock, wait);
+		}
+	}
+
+	this->can_rx_q_abort();
+	return false;
+}
+
+//Cancel every queued transfer and wait them out before the buffers are reused.
+void Panda::can_rx_q_abort() {
+	std::unique_lock<std::mutex> lock(this->can_rx_lock);
+	this->can_rx_running = false;
+	for (int i = 0; i < CAN_RX_PIPELINE_MAX; i++)
+		if (this->can_rx_busy[i])
+			libusb_cancel_transfer(this->can_rx_xfers[i]);
+	this->can_rx_changed.wait(lock, [this] { return this->can_rx_outstanding == 0; });
+}
+
+//Runs on the USB event thread, the only writer of the rx ring.
+void Panda::can_rx_complete(libusb_transfer *transfer) {
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		auto now = std::chrono::steady_clock::now();
+		size_t head = this->can_rx_head.load(std::memory_order_relaxed);
+		size_t tail = this->can_rx_tail.load(std::memory_order_acquire);
+		bool compact = this->can_rx_format == PANDA_CAN_FORMAT_COMPACT;
+		bool dispatching = this->can_dispatching;
+		std::unique_lock<std::mutex> sub_lock(this->can_sub_lock, std::defer_lock);
+		if (dispatching) sub_lock.lock();
+		for (int pkt = 0; pkt < transfer->actual_length; pkt += 0x40) {
+			unsigned long pkt_len = std::min(transfer->actual_length - pkt, 0x40);
+			const unsigned char *pkt_buff = transfer->buffer + pkt;
+			uint32_t ts_base = 0;
+			unsigned long pos = 0;
+			while (true) {
+				unsigned long rec_len = compact ? can_compact_rec_len(pkt_buff + pos, pkt_len - pos) :
+					((pos + sizeof(PANDA_CAN_MSG_TS_INTERNAL) <= pkt_len) ? sizeof(PANDA_CAN_MSG_TS_INTERNAL) : 0);
+				if (rec_len == 0) break;
+				uint64_t subs = 0;
+				if (dispatching) {
+					//Frames nobody wants only move the time along.
+					can_rec_key key;
+					can_rec_key_read(pkt_buff + pos, compact, ts_base, pos == 0, key);
+					subs = this->can_sub_match(key);
+					if (subs == 0) {
+						this->unwrap_device_time(key.ts);
+						pos += rec_len;
+						continue;
+					}
+				}
+				//A dropped record is still decoded, the ones after it can need its time.
+				PANDA_CAN_MSG dropped;
+				bool full = head - tail == CAN_RX_RING_LEN && head - (tail = this->can_rx_tail.load(std::memory_order_acquire)) == CAN_RX_RING_LEN;
+				PANDA_CAN_MSG& slot = full ? dropped : this->can_rx_ring[head & (CAN_RX_RING_LEN - 1)];
+				if (compact)
+					parse_can_recv_compact(pkt_buff + pos, ts_base, pos == 0, slot, now);
+				else
+					parse_can_recv((const PANDA_CAN_MSG_TS_INTERNAL *)(pkt_buff + pos), slot, now);
+				if (full) {
+					this->can_rx_drops++;
+				} else {
+					if (dispatching) this->can_rx_ring_subs[head & (CAN_RX_RING_LEN - 1)] = subs;
+					++head;
+				}
+				pos += rec_len;
+			}
+		}
+		if (dispatching) sub_lock.unlock();
+		//Pairs with the reader setting can_rx_waiting before it checks the head.
+		this->can_rx_head.store(head);
+		if (this->can_rx_waiting) {
+			std::lock_guard<std::mutex> lock(this->can_rx_wait_lock);
+			this->can_rx_filled.notify_all();
+		}
+	} else if (transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+		printf("Got rx transfer error %d\n", transfer->status);
+	}
+
+	std::lock_guard<std::mutex> lock(this->can_rx_lock);
+	size_t slot = (transfer->buffer - this->can_rx_bufs[0]) / sizeof(this->can_rx_bufs[0]);
+	if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) this->can_rx_gone = true;
+	if (this->can_rx_running && !this->can_rx_gone && transfer->status != LIBUSB_TRANSFER_CANCELLED &&
+		this->can_rx_outstanding <= this->can_rx_pipeline_depth) {
+		int err = libusb_submit_transfer(transfer);
+		if (err == 0) return;
+		if (err == LIBUSB_ERROR_NO_DEVICE) this->can_rx_gone = true;
+	}
+	this->can_rx_busy[slot] = false;
+	this->can_rx_outstanding--;
+	this->can_rx_changed.notify_all();
+}
+
+void Panda::can_rx_q_pop(PANDA_CAN_MSG msg_out[], int &count) {
+	count = (int)this->can_rx_q_pop_into(msg_out, CAN_RX_MSG_LEN, NULL, 1);
+}
+
+//Returns the head once it is past tail, or tail after timeoutms or once kill is set.
+size_t Panda::can_rx_wait(size_t tail, unsigned int timeoutms, const std::atomic<bool>* kill) {
+	size_t head = this->can_rx_head.load(std::memory_order_acquire);
+	if (head != tail || timeoutms == 0) return head;
+
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutms);
+	std::unique_lock<std::mutex> lock(this->can_rx_wait_lock);
+	this->can_rx_waiting = true;
+	while ((head = this->can_rx_head.load()) == tail && !(kill && *kill)) {
+		//kill can't wake the wait, so it is checked every 50ms.
+		auto wait = std::chrono::milliseconds(50);
+		if (timeoutms != PANDA_INFINITE) {
+			auto now = std::chrono::steady_clock::now();
+			if (now >= deadline) break;
+			wait = std::min(wait, std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now) + std::chrono::milliseconds(1));
+		}
+		this->can_rx_filled.wait_for(lock, wait);
+	}
+	this->can_rx_waiting = false;
+	return head;
+}
+
+size_t Panda::can_rx_q_pop_into(PANDA_CAN_MSG* out, size_t cap, const std::atomic<bool>* kill, unsigned int timeoutms) {
+	size_t tail = this->can_rx_tail.load(std::memory_order_relaxed);
+	size_t head = this->can_rx_wait(tail, timeoutms, kill);
+	if (head == tail) return 0;
+
+	size_t count = std::min(cap, head - tail);
+	for (size_t i = 0; i < count; i++)
+		out[i] = this->can_rx_ring[(tail + i) & (CAN_RX_RING_LEN - 1)];
+	this->can_rx_tail.store(tail + count, std::memory_order_release);
+	return count;
+}
+
+unsigned long long Panda::can_rx_dropped() {
+	return this->can_rx_drops;
+}
+
+std::vector<PANDA_CAN_MSG> Panda::can_recv() {
+	PANDA_CAN_MSG msgs[PANDA_CAN_COMPACT_MSGS_PER_PACKET];
+	size_t count = this->can_recv_into(msgs, (this->can_rx_format == PANDA_CAN_FORMAT_COMPACT) ?
+		PANDA_CAN_COMPACT_MSGS_PER_PACKET : PANDA_CAN_MSGS_PER_PACKET);
+	return std::vector<PANDA_CAN_MSG>(msgs, msgs + count);
+}
+
+size_t Panda::can_recv_into(PANDA_CAN_MSG* out, size_t cap) {
+	int retcount;
+	unsigned long consumed;
+	size_t per_packet = (this->can_rx_format == PANDA_CAN_FORMAT_COMPACT) ?
+		PANDA_CAN_COMPACT_MSGS_PER_PACKET : PANDA_CAN_MSGS_PER_PACKET;
+	int len = (int)std::min(cap / per_packet * 0x40, sizeof(this->can_recv_buff));
+	if (len == 0) return 0;
+
+	if (this->bulk_read(0x81, this->can_recv_buff, len, &retcount, 0) == false)
+		return 0;
+
+	return parse_can_recv_buff(this->can_recv_buff, retcount, out, cap, &consumed);
+}
+
+//Each 0x40 byte USB packet holds up to 3 timestamped messages, or up to 12
+//compact records. Full packets are padded so the transfer does not end early
+//on a short packet. Stops before a packet that would not fit in msg_out.
+size_t Panda::parse_can_recv_buff(const unsigned char *buff, unsigned long len, PANDA_CAN_MSG msg_out[],
+	size_t cap, unsigned long *consumed) {
+	auto now = std::chrono::steady_clock::now();
+	size_t count = 0;
+	unsigned long pkt = 0;
+	for (; pkt < len; pkt += 0x40) {
+		unsigned long pkt_len = std::min(len - pkt, 0x40UL);
+		if (this->can_rx_format == PANDA_CAN_FORMAT_COMPACT) {
+			if (count + can_compact_pkt_count(buff + pkt, pkt_len) > cap) break;
+			uint32_t ts_base = 0;
+			for (unsigned long pos = 0, rec_len; (rec_len = can_compact_rec_len(buff + pkt + pos, pkt_len - pos)) != 0; pos += rec_len) {
+				parse_can_recv_compact(buff + pkt + pos, ts_base, pos == 0, msg_out[count], now);
+				++count;
+			}
+			continue;
+		}
+		size_t pkt_count = pkt_len / sizeof(PANDA_CAN_MSG_TS_INTERNAL);
+		if (count + pkt_count > cap) break;
+		for (size_t i = 0; i < pkt_count; i++) {
+			parse_can_recv((const PANDA_CAN_MSG_TS_INTERNAL *)(buff + pkt + i * sizeof(PANDA_CAN_MSG_TS_INTERNAL)), msg_out[count], now);
+			++count;
+		}
+	}
+	*consumed = std::min(pkt, len);
+	return count;
+}
+
+//The compact time is worked out as in parse_can_recv_compact.
+void Panda::can_rec_key_read(const unsigned char *rec, bool compact, uint32_t& ts_base, bool first, can_rec_key& key) {
+	if (!compact) {
+		const PANDA_CAN_MSG_TS_INTERNAL *raw = (const PANDA_CAN_MSG_TS_INTERNAL *)rec;
+		key.addr_29b = (raw->msg.rir & CAN_EXTENDED) != 0;
+		key.addr = key.addr_29b ? (raw->msg.rir >> 3) : (raw->msg.rir >> 21);
+		key.ts = raw->timestamp;
+		uint8_t bus = (raw->msg.f2 >> 4) & 0x7F;
+		key.bus = (bus <= PANDA_CAN3) ? (PANDA_CAN_PORT)bus : PANDA_CAN_UNK;
+		key.receipt = ((raw->msg.f2 >> 4) & 0x80) != 0;
+		return;
+	}
+
+	unsigned long idl = (rec[0] & 0x80) ? 4 : 2;
+	key.addr_29b = (rec[0] & 0x80) != 0;
+	key.addr = 0;
+	memcpy(&key.addr, rec + 1, idl);
+	int16_t rel;
+	memcpy(&rel, rec + 1 + idl, sizeof(rel));
+	if ((uint16_t)rel == 0x8000)
+		memcpy(&key.ts, rec + 3 + idl, sizeof(key.ts));
+	else
+		key.ts = ts_base + (int32_t)rel;
+	if (first) ts_base = key.ts;
+	key.bus = (PANDA_CAN_PORT)((rec[0] >> 4) & 3);
+	key.receipt = (rec[0] & 0x40) != 0;
+}
+
+bool Panda::can_sub_wants(const can_subscriber& sub, uint32_t addr, bool addr_29b, PANDA_CAN_PORT bus, bool receipt) {
+	return (sub.bus == PANDA_CAN_UNK || sub.bus == bus) && sub.filter.addr_29b == addr_29b &&
+		((addr ^ sub.filter.addr) & sub.filter.mask) == 0 && (sub.receipts || !receipt);
+}
+
+//Called with can_sub_lock held.
+uint64_t Panda::can_sub_match(const can_rec_key& key) {
+	uint64_t subs = key.addr_29b ? 0 : this->can_sub_exact[std::min((int)key.bus, 3)][key.addr & 0x7FF];
+	for (uint64_t masked = this->can_sub_masked; masked != 0; masked &= masked - 1) {
+		int i = __builtin_ctzll(masked);
+		if (can_sub_wants(this->can_subs[i], key.addr, key.addr_29b, key.bus, key.receipt))
+			subs |= 1ULL << i;
+	}
+	return key.receipt ? (subs & this->can_sub_receipts) : subs;
+}
+
+//Filters on a whole 11 bit id go in the table, the rest are checked one by one.
+void Panda::can_sub_index(int sub, bool on) {
+	const can_subscriber& s = this->can_subs[sub];
+	uint64_t bit = 1ULL << sub;
+	auto set = [on, bit](uint64_t& subs) { subs = on ? (subs | bit) : (subs & ~bit); };
+	if (s.filter.addr_29b || (s.filter.mask & 0x7FF) != 0x7FF) {
+		set(this->can_sub_masked);
+	} else {
+		for (int bus = 0; bus < 4; bus++)
+			if (s.bus == PANDA_CAN_UNK || s.bus == bus)
+				set(this->can_sub_exact[bus][s.filter.addr & 0x7FF]);
+	}
+	if (s.receipts) set(this->can_sub_receipts);
+}
+
+bool Panda::on_dispatch_thread() {
+	return std::this_thread::get_id() == this->can_dispatch_id.load();
+}
+
+int Panda::can_subscribe(PANDA_CAN_PORT bus, const PANDA_CAN_FILTER& filter, PANDA_CAN_CALLBACK cb, bool receipts) {
+	if (!cb) return -1;
+	std::unique_lock<std::mutex> dispatch_lock(this->can_dispatch_lock, std::defer_lock);
+	if (!this->on_dispatch_thread()) dispatch_lock.lock();
+	std::lock_guard<std::mutex> lock(this->can_sub_lock);
+	for (int i = 0; i < PANDA_CAN_SUBSCRIBERS_MAX; i++) {
+		can_subscriber& s = this->can_subs[i];
+		if (s.used || s.dying) continue;
+		s.bus = bus;
+		s.filter = filter;
+		s.receipts = receipts;
+		s.cb = std::move(cb);
+		s.used = true;
+		this->can_sub_index(i, true);
+		return i;
+	}
+	return -1;
+}
+
+bool Panda::can_unsubscribe(int sub) {
+	if (sub < 0 || sub >= PANDA_CAN_SUBSCRIBERS_MAX) return false;
+	bool from_callback = this->on_dispatch_thread();
+	std::unique_lock<std::mutex> dispatch_lock(this->can_dispatch_lock, std::defer_lock);
+	if (!from_callback) dispatch_lock.lock();
+	std::lock_guard<std::mutex> lock(this->can_sub_lock);
+	can_subscriber& s = this->can_subs[sub];
+	if (!s.used) return false;
+	this->can_sub_index(sub, false);
+	s.used = false;
+	//The callback unsubscribing can be this one, so it lives out the batch.
+	if (from_callback)
+		s.dying = true;
+	else
+		s.cb = nullptr;
+	return true;
+}
+
+//The ring's only reader while dispatching. Frames stay in their slots while
+//the callbacks run, the tail moves past them after.
+void Panda::can_dispatch_thread() {
+	this->can_dispatch_id = std::this_thread::get_id();
+	size_t tail = this->can_rx_tail.load(std::memory_order_relaxed);
+	while (!this->can_dispatch_kill) {
+		size_t head = this->can_rx_wait(tail, PANDA_INFINITE, &this->can_dispatch_kill);
+		if (head == tail) continue;
+
+		std::lock_guard<std::mutex> lock(this->can_dispatch_lock);
+		for (; tail != head; tail++) {
+			const PANDA_CAN_MSG& msg = this->can_rx_ring[tail & (CAN_RX_RING_LEN - 1)];
+			//A slot may have been freed and taken again since the frame was matched.
+			for (uint64_t subs = this->can_rx_ring_subs[tail & (CAN_RX_RING_LEN - 1)]; subs != 0; subs &= subs - 1) {
+				can_subscriber& s = this->can_subs[__builtin_ctzll(subs)];
+				if (s.used && can_sub_wants(s, msg.addr, msg.addr_29b, msg.bus, msg.is_receipt))
+					s.cb(msg);
+			}
+		}
+		this->can_rx_tail.store(tail, std::memory_order_release);
+
+		for (auto& s : this->can_subs) {
+			if (!s.dying) continue;
+			s.cb = nullptr;
+			s.dying = false;
+		}
+	}
+}
+
+bool Panda::can_dispatch_start() {
+	if (this->can_dispatch.joinable()) return false;
+	this->can_rx_ring_subs.assign(CAN_RX_RING_LEN, 0);
+	this->can_dispatch_kill = false;
+	this->can_dispatching = true;
+	this->can_dispatch_rx = std::thread([this] { this->can_rx_q_push(this->can_dispatch_kill); });
+	this->can_dispatch = std::thread(&Panda::can_dispatch_thread, this);
+	return true;
+}
+
+void Panda::can_dispatch_stop() {
+	if (!this->can_dispatch.joinable()) return;
+	this->can_dispatch_kill = true;
+	this->can_dispatch_rx.join();
+	this->can_dispatch.join();
+	this->can_dispatch_id = std::thread::id();
+	this->can_dispatching = false;
+}
+
+bool Panda::can_replay_status(PANDA_CAN_REPLAY_STATUS& status, PANDA_CAN_REPLAY_OP op) {
+	memset(&status, 0, sizeof(status));
+	return this->control_transfer(REQUEST_IN, 0xfd, op, 0, &status, sizeof(status), 0) == sizeof(status);
+}
+
+//Replay records are timestamped ones with the us since the record before,
+//3 to a packet. Full packets are padded so a record never spans two.
+bool Panda::can_replay_load(const PANDA_CAN_MSG* msgs, size_t count, unsigned long long& prev_time) {
+	const size_t per_packet = PANDA_CAN_MSGS_PER_PACKET;
+	std::vector<unsigned char> buff;
+	buff.reserve((count / per_packet + 1) * 0x40);
+
+	size_t in_packet = 0;
+	for (size_t i = 0; i < count; i++) {
+		const PANDA_CAN_MSG& msg = msgs[i];
+		if (msg.bus == PANDA_CAN_UNK || msg.len > 8) continue;
+		PANDA_CAN_MSG_TS_INTERNAL rec;
+		pack_can_msg(rec.msg, msg.addr, msg.addr_29b, msg.dat, msg.len, msg.bus);
+		//Out of order frames go right after the one before.
+		unsigned long long gap = (msg.recv_time > prev_time) ? msg.recv_time - prev_time : 0;
+		rec.timestamp = (gap > 0xFFFFFFFFULL) ? 0xFFFFFFFFU : (uint32_t)gap;
+		prev_time = (msg.recv_time > prev_time) ? msg.recv_time : prev_time;
+
+		const unsigned char *p = (const unsigned char *)&rec;
+		buff.insert(buff.end(), p, p + sizeof(rec));
+		if (++in_packet == per_packet) {
+			buff.resize(buff.size() + 0x40 - per_packet * sizeof(rec), 0);
+			in_packet = 0;
+		}
+	}
+	if (buff.empty()) return true;
+
+	int retcount;
+	return this->bulk_write(3, buff.data(), (int)buff.size(), &retcount, 0);
+}
+
+bool Panda::can_clear(PANDA_CAN_PORT_CLEAR bus) {
+	/*Clears all messages from the specified internal CAN ringbuffer as though it were drained.
+	bus(int) : can bus number to clear a tx queue, or 0xFFFF to clear the global can rx queue.*/
+	return this->control_transfer(REQUEST_OUT, 0xf1, bus, 0, NULL, 0, 0) != -1;
+}
+
+std::string Panda::serial_read(PANDA_SERIAL_PORT port_number) {
+	std::string result;
+	char buff[0x40];
+	while (true) {
+		int retlen = this->control_transfer(REQUEST_IN, 0xe0, port_number, 0, &buff, 0x40, 0);
+		if (retlen <= 0)
+			break;
+		result += std::string(buff, retlen);
+		if (retlen < 0x40) break;
+	}
+	return result;
+}
+
+int Panda::serial_write(PANDA_SERIAL_PORT port_number, const void* buff, uint16_t len) {
+	std::string dat;
+	dat += port_number;
+	dat += std::string((char*)buff, len);
+	int retcount;
+	if (this->bulk_write(2, dat.c_str(), len+1, &retcount, 0) == false) return -1;
+	return retcount;
+}
+
+bool Panda::serial_clear(PANDA_SERIAL_PORT port_number) {
+	return this->control_transfer(REQUEST_OUT, 0xf2, port_number, 0, NULL, 0, 0) != -1;
+}
@@ -0,0 +1,459 @@
+#pragma once
+
+// panda::Panda on libusb, for hosts without WinUSB. The API follows
+// drivers/windows/panda_shared/panda.h, with portable types in place of the
+// Windows ones: timeouts are unsigned int milliseconds (PANDA_INFINITE waits
+// forever) and the kill events are std::atomic<bool> flags.
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <chrono>
+#include <stdint.h>
+
+#include <libusb.h>
+
+#define PANDA_INFINITE 0xFFFFFFFFU
+
+#define LIN_MSG_MAX_LEN 10
+//The panda streams multi packet transfers, so each read can drain many
+//messages. Reads end early on a short packet.
+#define CAN_RX_MSG_LEN 4096
+//Bulk IN transfers kept queued on EP1, so the pipe never idles between completions.
+#define CAN_RX_PIPELINE_DEFAULT 16
+#define CAN_RX_PIPELINE_MAX 32
+//Decoded messages waiting for can_rx_q_pop_into. Power of two.
+#define CAN_RX_RING_LEN 65536
+//Frames waiting for the async writer, and the most it puts in one USB transfer.
+#define CAN_TX_QUEUE_LEN 4096
+#define CAN_TX_COALESCE_MAX 256
+//Timestamped messages in each 0x40 byte USB packet
+#define PANDA_CAN_MSGS_PER_PACKET 3
+//The most compact records in a packet, see set_can_rx_format
+#define PANDA_CAN_COMPACT_MSGS_PER_PACKET 12
+//The len of a compact record that is a TX completion, see set_can_echo
+#define PANDA_CAN_COMPACT_DONE 0xD
+//How far before the newest a timestamp can be and still not be taken as a wrap, in us
+#define CAN_TIME_LATE_MAX 0x10000000U
+
+//Slots for messages the panda sends by itself, see set_can_periodic.
+#define PANDA_CAN_PERIODIC_SLOTS 16
+#define PANDA_CAN_PERIODIC_ALL 0xFFFF
+
+//Most callbacks subscribed at once, see can_subscribe.
+#define PANDA_CAN_SUBSCRIBERS_MAX 64
+
+namespace panda {
+	typedef enum _PANDA_SAFETY_MODE : uint16_t {
+		SAFETY_NOOUTPUT = 0,
+		SAFETY_HONDA = 1,
+		SAFETY_ALLOUTPUT = 0x1337,
+	} PANDA_SAFETY_MODE;
+
+	typedef enum _PANDA_SERIAL_PORT : uint8_t {
+		SERIAL_DEBUG = 0,
+		SERIAL_ESP = 1,
+		SERIAL_LIN1 = 2,
+		SERIAL_LIN2 = 3,
+	} PANDA_SERIAL_PORT;
+
+	typedef enum _PANDA_SERIAL_PORT_PARITY : uint8_t {
+		PANDA_PARITY_OFF = 0,
+		PANDA_PARITY_EVEN = 1,
+		PANDA_PARITY_ODD = 2,
+	} PANDA_SERIAL_PORT_PARITY;
+
+	typedef enum _PANDA_CAN_PORT : uint8_t {
+		PANDA_CAN1 = 0,
+		PANDA_CAN2 = 1,
+		PANDA_CAN3 = 2,
+		PANDA_CAN_UNK = 0xFF,
+	} PANDA_CAN_PORT;
+
+	typedef enum _PANDA_CAN_PORT_CLEAR : uint16_t {
+		PANDA_CAN1_TX = 0,
+		PANDA_CAN2_TX = 1,
+		PANDA_CAN3_TX = 2,
+		PANDA_CAN_RX = 0xFFFF,
+	} PANDA_CAN_PORT_CLEAR;
+
+	typedef enum _PANDA_CAN_FORMAT : uint8_t {
+		PANDA_CAN_FORMAT_CLASSIC = 0, //Fixed 0x14 byte records
+		PANDA_CAN_FORMAT_COMPACT = 1, //Variable length records, with only the data bytes the frame has
+	} PANDA_CAN_FORMAT;
+
+	//Firmware replay, see board/drivers/can_replay.h
+	typedef enum _PANDA_CAN_REPLAY_OP : uint16_t {
+		PANDA_CAN_REPLAY_READ = 0,
+		PANDA_CAN_REPLAY_LOAD = 1, //Frames on EP3 go into the replay ring
+		PANDA_CAN_REPLAY_PLAY = 2,
+		PANDA_CAN_REPLAY_STOP = 3,
+	} PANDA_CAN_REPLAY_OP;
+
+	typedef enum _PANDA_CAN_REPLAY_STATE : uint32_t {
+		PANDA_CAN_REPLAY_OFF = 0,
+		PANDA_CAN_REPLAY_LOADING = 1,
+		PANDA_CAN_REPLAY_PLAYING = 2,
+	} PANDA_CAN_REPLAY_STATE;
+
+	typedef enum _PANDA_GMLAN_HOST_PORT : uint8_t {
+		PANDA_GMLAN_CLEAR = 0,
+		PANDA_GMLAN_CAN2 = 1,
+		PANDA_GMLAN_CAN3 = 2,
+	} PANDA_GMLAN_HOST_PORT;
+
+	#pragma pack(push, 1)
+	typedef struct _PANDA_HEALTH {
+		uint32_t voltage;
+		uint32_t current;
+		uint8_t started;
+		uint8_t controls_allowed;
+		uint8_t gas_interceptor_detected;
+		uint8_t started_signal_detected;
+		uint8_t started_alt;
+		//Zero from firmware older than the extended packet.
+		uint8_t version;
+		uint64_t uptime_us;
+		uint16_t rx_q_depth; //All RX queues
+		uint16_t rx_q_hwm; //The fullest RX queue's
+		uint16_t tx_q_depth[4];
+		uint16_t tx_q_hwm[4];
+		uint32_t rx_drop_cnt; //Summed over the buses
+		uint32_t tx_drop_cnt;
+		uint32_t usb_pause_cnt; //EP2 or EP3 held off by full rings
+		uint32_t usb_nak_cnt; //OUT tokens NAKed on EP3
+		//Since the last get_health(true), in us, saturating at 0xFFFF.
+		uint16_t main_loop_lag_max;
+		uint16_t irq_latency_max;
+		uint16_t idle; //Per mille of the same window
+	} PANDA_HEALTH, *PPANDA_HEALTH;
+
+	typedef struct _PANDA_CAN_STATS {
+		uint32_t rx_cnt;
+		uint32_t tx_cnt;
+		uint32_t txd_cnt; //Sent and echoed
+		uint32_t rx_drop_cnt;
+		uint32_t tx_drop_cnt;
+		uint32_t err_cnt;
+		uint32_t rx_q_hwm; //Of this bus's RX queue
+		uint32_t tx_q_hwm;
+		uint16_t load; //Per mille since the last read
+		uint8_t tec;
+		uint8_t rec;
+		uint8_t lec;
+		uint8_t bus_off;
+	} PANDA_CAN_STATS, *PPANDA_CAN_STATS;
+
+	typedef struct _PANDA_CAN_REPLAY_STATUS {
+		uint32_t state; //PANDA_CAN_REPLAY_STATE
+		uint32_t queued; //On the panda, not sent yet
+		uint32_t sent;
+		uint32_t late_max_us; //Most a frame went after its time
+		uint32_t dropped;
+	} PANDA_CAN_REPLAY_STATUS;
+	#pragma pack(pop)
+
+	typedef struct _PANDA_CAN_MSG {
+		uint32_t addr;
+		unsigned long long recv_time; //In microseconds, latched by the panda when the frame was received or sent
+		std::chrono::time_point<std::chrono::steady_clock> recv_time_point;
+		uint8_t dat[8];
+		uint8_t len;
+		PANDA_CAN_PORT bus;
+		bool is_receipt;
+		bool addr_29b;
+		bool is_completion; //No addr or data, tx_token is the frame that was sent
+		uint16_t tx_token;
+		bool tx_failed; //Of a completion, the one-shot frame wasn't sent
+		bool tx_arb_lost; //And lost arbitration
+	} PANDA_CAN_MSG;
+
+	//A frame is received if (addr & mask) == (filter addr & mask).
+	typedef struct _PANDA_CAN_FILTER {
+		uint32_t addr;
+		uint32_t mask;
+		bool addr_29b;
+	} PANDA_CAN_FILTER;
+
+	typedef std::function<void(const PANDA_CAN_MSG&)> PANDA_CAN_CALLBACK;
+
+	//Copied from https://stackoverflow.com/a/31488113
+	class Timer
+	{
+		using clock = std::chrono::steady_clock;
+		using time_point_type = std::chrono::time_point < clock, std::chrono::microseconds >;
+	public:
+		Timer() {
+			start = std::chrono::time_point_cast<std::chrono::microseconds>(clock::now());
+		}
+
+		// gets the time elapsed from construction.
+		unsigned long long /*microseconds*/ getTimePassedUS() {
+			auto end = std::chrono::time_point_cast<std::chrono::microseconds>(clock::now());
+			return (end - start).count();
+		}
+
+		// gets the time elapsed from construction.
+		unsigned long long /*milliseconds*/ getTimePassedMS() {
+			auto end = std::chrono::time_point_cast<std::chrono::milliseconds>(clock::now());
+			auto startms = std::chrono::time_point_cast<std::chrono::milliseconds>(start);
+			return (end - startms).count();
+		}
+	private:
+		time_point_type start;
+	};
+
+	class PandaGroup;
+
+	class Panda {
+		friend class PandaGroup;
+	public:
+		static std::vector<std::string> listAvailablePandas();
+		static std::unique_ptr<Panda> openPanda(std::string sn);
+
+		~Panda();
+
+		std::string get_usb_sn();
+		bool set_alt_setting(uint8_t alt_setting);
+		uint8_t get_current_alt_setting();
+		bool set_raw_io(bool val);
+
+		//reset starts a new window for the maxes and idle, plain reads leave it running.
+		PANDA_HEALTH get_health(bool reset = false);
+		bool get_can_stats(PANDA_CAN_PORT bus, PANDA_CAN_STATS& stats);
+		//The panda's 32 bit microsecond timer, the time base of CAN timestamps.
+		bool get_time(uint32_t& time);
+		bool enter_bootloader();
+		std::string get_version();
+		std::string get_serial();
+		std::string get_secret();
+
+		bool set_usb_power(bool on);
+		bool set_esp_power(bool on);
+		bool esp_reset(uint16_t bootmode = 0);
+		bool set_safety_mode(PANDA_SAFETY_MODE mode = SAFETY_NOOUTPUT);
+		bool set_can_forwarding(PANDA_CAN_PORT from_bus, PANDA_CAN_PORT to_bus);
+		bool set_gmlan(PANDA_GMLAN_HOST_PORT bus = PANDA_GMLAN_CAN3);
+		bool set_can_loopback(bool enable);
+		bool set_can_tx_in_order(bool enable);
+		bool set_can_filters(PANDA_CAN_PORT bus, const std::vector<PANDA_CAN_FILTER>& filters);
+		bool set_can_timestamps(bool enable);
+		//The record format of received CAN messages. Compact records always carry the
+		//timestamp. Returns false and keeps the classic format if the panda doesn't know it.
+		bool set_can_rx_format(PANDA_CAN_FORMAT format);
+		bool set_can_periodic(uint8_t slot, uint32_t addr, bool addr_29b, const uint8_t *dat, uint8_t len, PANDA_CAN_PORT bus, uint16_t period_ms);
+		bool clear_can_periodic(uint16_t slot);
+		bool set_can_speed_cbps(PANDA_CAN_PORT bus, uint16_t speed);
+		bool set_can_speed_kbps(PANDA_CAN_PORT bus, uint16_t speed);
+		bool set_uart_baud(PANDA_SERIAL_PORT uart, uint32_t rate);
+		bool set_uart_parity(PANDA_SERIAL_PORT uart, PANDA_SERIAL_PORT_PARITY parity);
+
+		bool can_send_many(const std::vector<PANDA_CAN_MSG>& can_msgs);
+		bool can_send(uint32_t addr, bool addr_29b, const uint8_t *dat, uint8_t len, PANDA_CAN_PORT bus);
+		//Queues the frame for the next bulk OUT transfer. Everything queued while one is
+		//in flight goes out together in the next. Returns the frame's sequence number
+		//for can_tx_wait, or 0 if the queue is full.
+		unsigned long long can_send_async(uint32_t addr, bool addr_29b, const uint8_t *dat, uint8_t len, PANDA_CAN_PORT bus);
+		//Queues all the frames together, so they go out in the same transfer up to CAN_TX_COALESCE_MAX.
+		//Returns the last frame's sequence number, or 0 if they don't all fit. Nothing is queued then.
+		unsigned long long can_send_async_many(const std::vector<PANDA_CAN_MSG>& can_msgs);
+		//Waits until the transfer holding frame seq has completed.
+		bool can_tx_wait(unsigned long long seq, unsigned int timeoutms = PANDA_INFINITE);
+		//Frames from async transfers that failed.
+		unsigned long long can_tx_errors();
+		std::vector<PANDA_CAN_MSG> can_recv();
+		//Same as can_recv, but decodes into a buffer owned by the caller without allocating.
+		//cap is rounded down to whole USB packets of PANDA_CAN_MSGS_PER_PACKET messages,
+		//or PANDA_CAN_COMPACT_MSGS_PER_PACKET with compact records.
+		size_t can_recv_into(PANDA_CAN_MSG* out, size_t cap);
+		//Keeps the bulk IN transfers queued until kill is set or the panda goes away,
+		//then cancels them and returns FALSE. Completed transfers are decoded into the
+		//rx ring by the USB event thread, kill is checked at least every timeoutms.
+		bool can_rx_q_push(const std::atomic<bool>& kill, unsigned int timeoutms = 100);
+		//Number of transfers can_rx_q_push keeps queued, 1 to CAN_RX_PIPELINE_MAX.
+		//Takes effect as transfers complete.
+		void set_can_rx_pipeline_depth(unsigned int depth);
+		void can_rx_q_pop(PANDA_CAN_MSG msg_out[], int &count);
+		//Copies at most cap messages out of the rx ring. Waits up to timeoutms for
+		//one to arrive, or until kill is set.
+		size_t can_rx_q_pop_into(PANDA_CAN_MSG* out, size_t cap, const std::atomic<bool>* kill = nullptr, unsigned int timeoutms = 0);
+		//Messages lost because the rx ring was full.
+		unsigned long long can_rx_dropped();
+		bool can_clear(PANDA_CAN_PORT_CLEAR bus);
+		//Calls cb with each frame on bus, or on any bus for PANDA_CAN_UNK, that matches
+		//filter, and with the frames the panda sent too if receipts. Callbacks run on
+		//the dispatch thread one at a time, in the order the frames came, and get the
+		//frame in the rx ring, not a copy. Returns the subscription, or -1 once
+		//PANDA_CAN_SUBSCRIBERS_MAX are taken.
+		int can_subscribe(PANDA_CAN_PORT bus, const PANDA_CAN_FILTER& filter, PANDA_CAN_CALLBACK cb, bool receipts = false);
+		//Once it returns the callback isn't running and won't be called again. A
+		//callback can unsubscribe, itself included.
+		bool can_unsubscribe(int sub);
+		//Reads the panda and calls the subscribers, from two threads of its own, until
+		//can_dispatch_stop. Frames no subscriber wants are dropped before they are
+		//decoded. The rx ring is the dispatch thread's meanwhile, so can_rx_q_push
+		//and can_rx_q_pop_into must not be used. Returns false if already started.
+		bool can_dispatch_start();
+		//Not from a callback.
+		void can_dispatch_stop();
+		//Does op, then reads the replay status. USB only.
+		bool can_replay_status(PANDA_CAN_REPLAY_STATUS& status, PANDA_CAN_REPLAY_OP op = PANDA_CAN_REPLAY_READ);
+		//While loading or playing, queues the frames to go at their recv_time, the
+		//first recv_time - prev_time after the one loaded before. prev_time is
+		//left at the last one's. Blocks while the panda's ring is full.
+		bool can_replay_load(const PANDA_CAN_MSG* msgs, size_t count, unsigned long long& prev_time);
+
+		std::string serial_read(PANDA_SERIAL_PORT port_number);
+		int serial_write(PANDA_SERIAL_PORT port_number, const void* buff, uint16_t len);
+		bool serial_clear(PANDA_SERIAL_PORT port_number);
+	private:
+		Panda(libusb_context *ctx, libusb_device_handle *usbh, std::string sn_);
+
+		int control_transfer(
+			uint8_t bmRequestType,
+			uint8_t bRequest,
+			uint16_t wValue,
+			uint16_t wIndex,
+			void * data,
+			uint16_t wLength,
+			unsigned int timeout
+		);
+
+		bool bulk_write(uint8_t endpoint, const void * buff, int length, int *transferred, unsigned int timeout);
+		bool bulk_read(uint8_t endpoint, void * buff, int buff_size, int *transferred, unsigned int timeout);
+
+		#pragma pack(push, 1)
+		typedef struct _PANDA_CAN_MSG_INTERNAL {
+			uint32_t rir;
+			uint32_t f2;
+			uint8_t dat[8];
+		} PANDA_CAN_MSG_INTERNAL;
+
+		//Sent instead when timestamps are enabled, 3 to a 0x40 byte packet.
+		typedef struct _PANDA_CAN_MSG_TS_INTERNAL {
+			PANDA_CAN_MSG_INTERNAL msg;
+			uint32_t timestamp;
+		} PANDA_CAN_MSG_TS_INTERNAL;
+		#pragma pack(pop)
+
+		static void pack_can_msg(PANDA_CAN_MSG_INTERNAL& out, uint32_t addr, bool addr_29b, const uint8_t *dat, uint8_t len, PANDA_CAN_PORT bus);
+
+		void usb_event_thread();
+		static void LIBUSB_CALL _can_rx_callback(libusb_transfer *transfer) {
+			((Panda*)transfer->user_data)->can_rx_complete(transfer);
+		}
+		void can_rx_complete(libusb_transfer *transfer);
+		void can_rx_q_abort();
+		static void LIBUSB_CALL _can_tx_callback(libusb_transfer *transfer) {
+			((Panda*)transfer->user_data)->can_tx_complete(transfer);
+		}
+		void can_tx_complete(libusb_transfer *transfer);
+		void can_tx_submit();
+
+		void parse_can_recv(const PANDA_CAN_MSG_TS_INTERNAL *in_msg_raw, PANDA_CAN_MSG& in_msg,
+			std::chrono::time_point<std::chrono::steady_clock> recv_time_point);
+		size_t parse_can_recv_buff(const unsigned char *buff, unsigned long len, PANDA_CAN_MSG msg_out[],
+			size_t cap, unsigned long *consumed);
+		static unsigned long can_compact_rec_len(const unsigned char *rec, unsigned long len);
+		static size_t can_compact_pkt_count(const unsigned char *pkt, unsigned long len);
+		void parse_can_recv_compact(const unsigned char *rec, uint32_t& ts_base, bool first, PANDA_CAN_MSG& in_msg,
+			std::chrono::time_point<std::chrono::steady_clock> recv_time_point);
+		unsigned long long unwrap_device_time(uint32_t ts);
+		size_t can_rx_wait(size_t tail, unsigned int timeoutms, const std::atomic<bool>* kill);
+
+		//What matching a frame to the subscribers needs, read from its record without decoding the rest.
+		typedef struct _can_rec_key {
+			uint32_t addr;
+			uint32_t ts;
+			PANDA_CAN_PORT bus;
+			bool addr_29b;
+			bool receipt;
+		} can_rec_key;
+
+		typedef struct _can_subscriber {
+			PANDA_CAN_PORT bus;
+			PANDA_CAN_FILTER filter;
+			bool receipts = false;
+			bool used = false;
+			bool dying = false; //Unsubscribed by a callback, the slot is freed after the batch
+			PANDA_CAN_CALLBACK cb;
+		} can_subscriber;
+
+		static void can_rec_key_read(const unsigned char *rec, bool compact, uint32_t& ts_base, bool first, can_rec_key& key);
+		static bool can_sub_wants(const can_subscriber& sub, uint32_t addr, bool addr_29b, PANDA_CAN_PORT bus, bool receipt);
+		uint64_t can_sub_match(const can_rec_key& key);
+		void can_sub_index(int sub, bool on);
+		void can_dispatch_thread();
+		bool on_dispatch_thread();
+
+		libusb_context *ctx;
+		libusb_device_handle *usbh;
+		std::string sn;
+		bool loopback = false;
+
+		std::thread usb_thread; //Runs libusb_handle_events, every callback comes from it
+		std::atomic<bool> usb_stop;
+
+		uint32_t last_device_time = 0;
+		bool device_time_seen = false;
+		unsigned long long device_time_base = 0; //Extends the 32 bit panda timestamp
+		PANDA_CAN_FORMAT can_rx_format = PANDA_CAN_FORMAT_CLASSIC;
+		unsigned char can_recv_buff[sizeof(PANDA_CAN_MSG_INTERNAL) * CAN_RX_MSG_LEN];
+
+		//Filled by the USB event thread, drained by can_rx_q_pop_into. One producer
+		//and one consumer, so the indexes are all the synchronization it needs.
+		std::vector<PANDA_CAN_MSG> can_rx_ring;
+		std::atomic<size_t> can_rx_head; //Next slot written
+		std::atomic<size_t> can_rx_tail; //Next slot read
+		std::atomic<unsigned long long> can_rx_drops;
+		std::atomic<bool> can_rx_waiting; //A reader sleeps on can_rx_filled
+		std::mutex can_rx_wait_lock;
+		std::condition_variable can_rx_filled;
+
+		//Transfer bookkeeping, guarded by can_rx_lock.
+		libusb_transfer *can_rx_xfers[CAN_RX_PIPELINE_MAX] = {};
+		unsigned char can_rx_bufs[CAN_RX_PIPELINE_MAX][sizeof(PANDA_CAN_MSG_INTERNAL) * CAN_RX_MSG_LEN];
+		bool can_rx_busy[CAN_RX_PIPELINE_MAX] = {};
+		unsigned int can_rx_outstanding = 0;
+		unsigned int can_rx_pipeline_depth = CAN_RX_PIPELINE_DEFAULT;
+		bool can_rx_running = false;
+		bool can_rx_gone = false; //The panda was unplugged
+		std::mutex can_rx_lock;
+		std::condition_variable can_rx_changed;
+
+		//Subscriptions. can_sub_lock guards the slots and match tables and is taken
+		//by the USB event thread once a transfer. can_dispatch_lock is held while
+		//callbacks run, a thread changing the slots takes it first.
+		can_subscriber can_subs[PANDA_CAN_SUBSCRIBERS_MAX];
+		uint64_t can_sub_exact[4][2048] = {}; //Subscribers of each 11 bit id, by bus, the last row for the other buses
+		uint64_t can_sub_masked = 0; //The rest, checked one by one
+		uint64_t can_sub_receipts = 0;
+		std::mutex can_sub_lock;
+		std::mutex can_dispatch_lock;
+		std::vector<uint64_t> can_rx_ring_subs; //Subscribers matched to each rx ring slot
+		std::atomic<bool> can_dispatching;
+		std::atomic<bool> can_dispatch_kill;
+		std::thread can_dispatch_rx; //Runs can_rx_q_push
+		std::thread can_dispatch;
+		std::atomic<std::thread::id> can_dispatch_id; //Set by the thread itself, for on_dispatch_thread
+
+		//Sequence numbers, frame n lives in can_tx_q[n % CAN_TX_QUEUE_LEN] until taken.
+		PANDA_CAN_MSG_INTERNAL can_tx_q[CAN_TX_QUEUE_LEN];
+		PANDA_CAN_MSG_INTERNAL can_tx_buff[CAN_TX_COALESCE_MAX];
+		libusb_transfer *can_tx_xfer = nullptr;
+		unsigned long long can_tx_queued = 0; //Last queued frame
+		unsigned long long can_tx_taken = 0; //Last frame copied into can_tx_buff
+		unsigned long long can_tx_done = 0; //Last frame whose transfer completed
+		unsigned long long can_tx_failed = 0;
+		bool can_tx_inflight = false;
+		bool can_tx_stop = false;
+		std::mutex can_tx_lock;
+		std::condition_variable can_tx_completed;
+	};
+
+}
@@ -0,0 +1,177 @@
+// panda_group.cpp : several pandas as one, on the libusb panda::Panda.
+//
+#include <algorithm>
+#include <climits>
+
+#include "panda_group.h"
+
+using namespace panda;
+
+std::unique_ptr<PandaGroup> PandaGroup::openPandas(const std::vector<std::string>& sns) {
+	std::vector<std::string> want = sns;
+	if (want.empty()) {
+		want = Panda::listAvailablePandas();
+		std::sort(want.begin(), want.end());
+	}
+	//Logical buses are a uint8_t.
+	if (want.empty() || want.size() * PANDA_GROUP_BUSES_PER_PANDA > 0xFF) return nullptr;
+
+	std::vector<std::unique_ptr<Panda>> pandas;
+	for (auto& sn : want) {
+		auto p = Panda::openPanda(sn);
+		if (!p) return nullptr;
+		pandas.push_back(std::move(p));
+	}
+	return std::unique_ptr<PandaGroup>(new PandaGroup(std::move(pandas)));
+}
+
+PandaGroup::PandaGroup(std::vector<std::unique_ptr<Panda>> pandas) : kill(false) {
+	this->members.resize(pandas.size());
+	for (size_t i = 0; i < pandas.size(); i++)
+		this->members[i].p = std::move(pandas[i]);
+	this->sync_clocks();
+	for (auto& m : this->members) {
+		Panda *p = m.p.get();
+		m.rx = std::thread([this, p] { p->can_rx_q_push(this->kill); });
+	}
+}
+
+PandaGroup::~PandaGroup() {
+	this->kill = true;
+	for (auto& m : this->members)
+		m.rx.join();
+}
+
+size_t PandaGroup::size() {
+	return this->members.size();
+}
+
+Panda& PandaGroup::panda(size_t i) {
+	return *this->members[i].p;
+}
+
+bool PandaGroup::alive(size_t i) {
+	Panda& p = *this->members[i].p;
+	std::lock_guard<std::mutex> lock(p.can_rx_lock);
+	return !p.can_rx_gone;
+}
+
+void PandaGroup::set_merge_delay_us(unsigned long long us) {
+	this->merge_delay_us = us;
+}
+
+unsigned long long PandaGroup::now_us() {
+	return this->clock.getTimePassedUS();
+}
+
+bool PandaGroup::sync_clock(member& m) {
+	unsigned long long best_rtt = ULLONG_MAX, host = 0;
+	uint32_t dev = 0;
+	for (int i = 0; i < 4; i++) {
+		uint32_t t;
+		unsigned long long t0 = this->now_us();
+		if (!m.p->get_time(t)) continue;
+		unsigned long long rtt = this->now_us() - t0;
+		if (rtt < best_rtt) {
+			best_rtt = rtt;
+			host = t0 + rtt / 2;
+			dev = t;
+		}
+	}
+	if (best_rtt == ULLONG_MAX) return false;
+
+	//Only part of each later error is taken, so the merge order doesn't jitter
+	//with the round trips, while drift is still followed.
+	if (m.synced) {
+		unsigned long long predicted = this->group_time(m, dev);
+		host = predicted + ((long long)host - (long long)predicted) / 4;
+	}
+	m.sync_dev = dev;
+	m.sync_host = host;
+	m.synced = true;
+	return true;
+}
+
+bool PandaGroup::sync_clocks() {
+	bool ok = true;
+	for (auto& m : this->members)
+		ok = this->sync_clock(m) && ok;
+	this->last_sync = this->now_us();
+	return ok;
+}
+
+//ts is within half the 32 bit wrap of the last sync.
+unsigned long long PandaGroup::group_time(const member& m, uint32_t ts) {
+	long long t = (long long)m.sync_host + (int32_t)(ts - m.sync_dev);
+	return (t < 0) ? 0 : t;
+}
+
+void PandaGroup::poll() {
+	for (size_t i = 0; i < this->members.size(); i++) {
+		member& m = this->members[i];
+		size_t n;
+		while ((n = m.p->can_rx_q_pop_into(this->rx_buff, sizeof(this->rx_buff) / sizeof(this->rx_buff[0]))) != 0) {
+			unsigned long long now = this->now_us();
+			for (size_t k = 0; k < n; k++) {
+				PANDA_GROUP_CAN_MSG g;
+				g.msg = this->rx_buff[k];
+				g.panda = (uint8_t)i;
+				g.bus = (g.msg.bus <= PANDA_CAN3) ? (uint8_t)(i * PANDA_GROUP_BUSES_PER_PANDA + g.msg.bus) : 0xFF;
+				//Nothing was received after now, whatever the clock estimate says.
+				g.group_time = m.synced ? std::min(this->group_time(m, (uint32_t)g.msg.recv_time), now) : now;
+				//The buses of one panda can be a little out of order, see Panda::unwrap_device_time.
+				auto pos = m.pending.end();
+				while (pos != m.pending.begin() && (pos - 1)->group_time > g.group_time)
+					--pos;
+				m.pending.insert(pos, g);
+			}
+		}
+	}
+}
+
+size_t PandaGroup::can_recv(PANDA_GROUP_CAN_MSG* out, size_t cap, unsigned int timeoutms) {
+	unsigned long long deadline = this->now_us() + (unsigned long long)timeoutms * 1000;
+	while (true) {
+		if (this->now_us() - this->last_sync >= PANDA_GROUP_SYNC_US)
+			this->sync_clocks();
+		this->poll();
+
+		unsigned long long now = this->now_us();
+		size_t count = 0;
+		while (count < cap) {
+			member *first = nullptr;
+			for (auto& m : this->members)
+				if (!m.pending.empty() && (first == nullptr || m.pending.front().group_time < first->pending.front().group_time))
+					first = &m;
+			if (first == nullptr || first->pending.front().group_time + this->merge_delay_us > now) break;
+			out[count++] = first->pending.front();
+			first->pending.pop_front();
+		}
+		if (count != 0 || timeoutms == 0 || (timeoutms != PANDA_INFINITE && now >= deadline))
+			return count;
+		//The pandas' event threads don't wake this one, the merge delay is far longer.
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+unsigned long long PandaGroup::can_send(uint32_t addr, bool addr_29b, const uint8_t *dat, uint8_t len, unsigned int bus) {
+	size_t i = bus / PANDA_GROUP_BUSES_PER_PANDA;
+	if (i >= this->members.size()) return 0;
+	return this->members[i].p->can_send_async(addr, addr_29b, dat, len, (PANDA_CAN_PORT)(bus % PANDA_GROUP_BUSES_PER_PANDA));
+}
+
+bool PandaGroup::can_send_many(const std::vector<PANDA_GROUP_CAN_MSG>& msgs) {
+	std::vector<std::vector<PANDA_CAN_MSG>> per_panda(this->members.size());
+	for (auto& g : msgs) {
+		size_t i = g.bus / PANDA_GROUP_BUSES_PER_PANDA;
+		if (i >= this->members.size()) return false;
+		per_panda[i].push_back(g.msg);
+		per_panda[i].back().bus = (PANDA_CAN_PORT)(g.bus % PANDA_GROUP_BUSES_PER_PANDA);
+	}
+
+	bool ok = true;
+	for (size_t i = 0; i < per_panda.size(); i++)
+		if (!per_panda[i].empty() && this->members[i].p->can_send_async_many(per_panda[i]) == 0)
+			ok = false;
+	return ok;
+}
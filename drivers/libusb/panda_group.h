@@ -0,0 +1,77 @@
+#pragma once
+
+// Several pandas read and written as one, see drivers/windows/panda_shared/panda_group.h.
+// Each panda's transfers complete on its own libusb event thread, the group
+// keeps their pipelines queued and merges what they decode.
+
+#include <deque>
+
+#include "panda.h"
+
+//Logical buses of a group, numbered across its pandas in the order they were opened.
+#define PANDA_GROUP_BUSES_PER_PANDA 3
+//How long frames are held so later ones from slower pandas can go in front of them.
+#define PANDA_GROUP_MERGE_DELAY_US 5000
+//How often the pandas' clocks are measured again.
+#define PANDA_GROUP_SYNC_US 1000000
+
+namespace panda {
+	typedef struct _PANDA_GROUP_CAN_MSG {
+		PANDA_CAN_MSG msg; //msg.bus is the bus on its own panda
+		unsigned long long group_time; //us on the group clock, the host's since the group was opened
+		uint8_t panda; //Index in the group
+		uint8_t bus; //Logical bus, 0xFF if the panda's is unknown
+	} PANDA_GROUP_CAN_MSG;
+
+	class PandaGroup {
+	public:
+		//Opens the pandas in the order of sns, or every panda sorted by serial if it's
+		//empty. nullptr if any of them doesn't open.
+		static std::unique_ptr<PandaGroup> openPandas(const std::vector<std::string>& sns);
+
+		~PandaGroup();
+
+		size_t size();
+		Panda& panda(size_t i);
+		//Whether the panda's transfers are still running, false once it's unplugged.
+		bool alive(size_t i);
+
+		void set_merge_delay_us(unsigned long long us);
+		//Up to cap frames of all the pandas in group_time order. A frame is held
+		//until it is the merge delay old. Waits up to timeoutms for one.
+		size_t can_recv(PANDA_GROUP_CAN_MSG* out, size_t cap, unsigned int timeoutms = 0);
+		//Queues the frame on the panda with the logical bus. Returns its sequence
+		//number on that panda, or 0 if it isn't queued.
+		unsigned long long can_send(uint32_t addr, bool addr_29b, const uint8_t *dat, uint8_t len, unsigned int bus);
+		//Queues each frame on the panda of its logical bus, msg.bus is ignored.
+		bool can_send_many(const std::vector<PANDA_GROUP_CAN_MSG>& msgs);
+
+		//Measures each panda's clock from the middle of a get_time round trip, the
+		//fastest of a few. can_recv does it every PANDA_GROUP_SYNC_US.
+		bool sync_clocks();
+		unsigned long long now_us();
+
+	private:
+		PandaGroup(std::vector<std::unique_ptr<Panda>> pandas);
+
+		typedef struct _member {
+			std::unique_ptr<Panda> p;
+			std::thread rx; //Runs can_rx_q_push
+			bool synced = false;
+			uint32_t sync_dev = 0;
+			unsigned long long sync_host = 0; //group time at sync_dev
+			std::deque<PANDA_GROUP_CAN_MSG> pending; //In group_time order
+		} member;
+
+		void poll();
+		bool sync_clock(member& m);
+		unsigned long long group_time(const member& m, uint32_t ts);
+
+		std::vector<member> members;
+		Timer clock;
+		unsigned long long merge_delay_us = PANDA_GROUP_MERGE_DELAY_US;
+		unsigned long long last_sync = 0;
+		std::atomic<bool> kill;
+		PANDA_CAN_MSG rx_buff[1024];
+	};
+}
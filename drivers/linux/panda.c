@@ -12,62 +12,234 @@
 #include <linux/can.h>
 #include <linux/can/dev.h>
 #include <linux/can/error.h>
+#include <linux/can/rx-offload.h>
+#include <linux/ctype.h>
+#include <linux/ethtool.h>
 #include <linux/init.h>             // Macros used to mark up functions e.g., __init __exit
 #include <linux/kernel.h>           // Contains types, macros, functions for the kernel
 #include <linux/module.h>           // Core header for loading LKMs into the kernel
 #include <linux/netdevice.h>
+#include <linux/tty.h>
+#include <linux/tty_driver.h>
+#include <linux/tty_flip.h>
 #include <linux/usb.h>
+#include <linux/version.h>
+#include <linux/workqueue.h>
+
+/* 5.11 renamed get_can_dlc, 5.12 gave can_put_echo_skb the frame's length
+ * and can_get_echo_skb a pointer for it back, and 5.13 gave can_free_echo_skb
+ * one too. The length put is the data length BQL is counted in here. */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 11, 0)
+#define can_cc_dlc2len(dlc) get_can_dlc(dlc)
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+#define panda_put_echo_skb(skb, dev, idx, len) can_put_echo_skb(skb, dev, idx, len)
+#define panda_get_echo_skb(dev, idx) can_get_echo_skb(dev, idx, NULL)
+#else
+#define panda_put_echo_skb(skb, dev, idx, len) can_put_echo_skb(skb, dev, idx)
+#define panda_get_echo_skb(dev, idx) can_get_echo_skb(dev, idx)
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 13, 0)
+#define panda_free_echo_skb(dev, idx) can_free_echo_skb(dev, idx, NULL)
+#else
+#define panda_free_echo_skb(dev, idx) can_free_echo_skb(dev, idx)
+#endif
 
 /* vendor and product id */
 #define PANDA_MODULE_NAME "panda"
 #define PANDA_VENDOR_ID 0XBBAA
 #define PANDA_PRODUCT_ID 0XDDCC
 
-#define PANDA_MAX_TX_URBS 20
-#define PANDA_CTX_FREE PANDA_MAX_TX_URBS
-
-#define PANDA_USB_RX_BUFF_SIZE 0x40
-#define PANDA_USB_TX_BUFF_SIZE (sizeof(struct panda_usb_can_msg))
+/* frames packed into one bulk OUT transfer, 4 to a 64 byte packet */
+#define PANDA_TX_AGG_MAX 16
+/* echo slots, as many as the firmware queues for a bus (CAN_TX_DEFAULT_LEN).
+ * With completions from the panda a frame holds its slot until it's on the
+ * bus, so fewer would stop the queue while the panda still had room. */
+#define PANDA_MAX_TX_FRAMES 0x100
+#define PANDA_CTX_FREE PANDA_MAX_TX_FRAMES
+
+/* 0xcf echo modes, CAN_ECHO_ in the firmware */
+#define PANDA_CAN_ECHO_FULL 0
+#define PANDA_CAN_ECHO_TOKEN 1
+#define PANDA_CAN_ECHO_KEEP 0xFFFF
+/* the firmware numbers ep3 frames per bus, completions carry the number */
+#define PANDA_TX_TOKEN_MASK 0x3FF
+#define PANDA_DONE_FAILED 0x8000 /* a one-shot bus didn't get it out */
+#define PANDA_DONE_ARB_LOST 0x4000
+/* a frame the panda dropped never completes, its slot is taken back after this */
+#define PANDA_TX_DONE_TIMEOUT_MS 1000
+
+/* bulk EP1 streams multi packet transfers, a short packet ends one */
+#define PANDA_USB_RX_BUFF_SIZE 0x1000
+#define PANDA_MAX_RX_URBS 16
+/* with timestamps on, three records to a packet and 4 bytes of padding */
+#define PANDA_USB_PACKET_SIZE 0x40
+/* compact records, 0xc4, set by the len bits of the header byte */
+#define PANDA_COMPACT_PAD 0xF
+#define PANDA_COMPACT_DONE 0xD
+#define PANDA_COMPACT_FLAG 0x40 /* sent by the panda */
+#define PANDA_COMPACT_EXT 0x80
+#define PANDA_COMPACT_TS_WIDE 0x8000
+/* a timestamp this far before the newest is a late frame, not a wrap */
+#define PANDA_TS_LATE_MAX 0x10000000U
+
+/* frames delivered per rx-offload poll */
+#define PANDA_NAPI_WEIGHT 32
 
 #define PANDA_NUM_CAN_INTERFACES 3
 
-#define PANDA_CAN_TRANSMIT 1
+/* the alt setting with bus 0's tx on EP1 OUT */
+#define PANDA_ALT_TX_LANES 2
+
+#define PANDA_CAN_TRANSMIT 1 /* TXRQ, on rx only completions have it */
 #define PANDA_CAN_EXTENDED 4
+/* in the bus field of frames the panda sent itself */
+#define PANDA_BUS_RET_FLAG 0x80
 
 #define PANDA_BITRATE 500000
 
 #define PANDA_DLC_MASK  0x0F
 
+/* hardware filters per bus, CAN_FILTER_MAX in the firmware */
+#define PANDA_MAX_HW_FILTERS 16
+/* RIR mask value for an exact match, the firmware puts these in ID list banks */
+#define PANDA_FILTER_EXACT 0xFFFFFFFEU
+
+/* how often the bus stats and error counters are read while the interface is up */
+#define PANDA_STATS_POLL_MS 500
+
+/* the K-line and L-line, the panda's serial rings 2 and 3, as ttys. Their rx
+ * comes on bulk EP2 IN and tx goes on EP2 OUT, a ring number then the bytes
+ * in each 64 byte packet. */
+#define PANDA_TTY_PORTS 2
+#define PANDA_TTY_FIRST_RING 2
+#define PANDA_TTY_MINORS (PANDA_TTY_PORTS * 8)
+#define PANDA_TTY_CHUNK (PANDA_USB_PACKET_SIZE - 1)
+#define PANDA_TTY_RX_URBS 2
+#define PANDA_TTY_RX_BUFF_SIZE (4 * PANDA_USB_PACKET_SIZE)
+#define PANDA_TTY_TX_URBS 4
+#define PANDA_TTY_BAUD 10400
+/* 0xe2 parity */
+#define PANDA_TTY_PARITY_NONE 0
+#define PANDA_TTY_PARITY_EVEN 1
+#define PANDA_TTY_PARITY_ODD 2
+
 struct panda_usb_ctx {
   struct panda_inf_priv *priv;
   u32 ndx;
   u8 dlc;
+  /* with tx_echo_tokens, the frame's token, and when its URB was done with it
+   * while it waits for the completion */
+  u16 token;
+  bool sent;
+  unsigned long sent_at;
 };
 
 struct panda_dev_priv;
 
+struct __packed panda_usb_can_msg {
+  u32 rir;
+  u32 bus_dat_len;
+  u8 data[8];
+};
+
+/* TIM2 microseconds, latched when the frame was received */
+struct __packed panda_usb_can_ts_msg {
+  struct panda_usb_can_msg msg;
+  u32 timestamp;
+};
+
+/* 0xc0 response, per bus. The counters run from power on and wrap. */
+struct __packed panda_usb_can_stats {
+  u32 rx_cnt;
+  u32 tx_cnt;
+  u32 txd_cnt;
+  u32 rx_drop_cnt; /* device rx queue was full */
+  u32 tx_drop_cnt; /* device tx queue was full */
+  u32 err_cnt; /* error interrupts */
+  u32 rx_q_hwm;
+  u32 tx_q_hwm;
+  u16 load; /* per mille since the last read */
+  u8 tec;
+  u8 rec;
+  u8 lec; /* last error code, as in the bxCAN ESR */
+  u8 bus_off;
+};
+
 struct panda_inf_priv {
   struct can_priv can;
-  struct panda_usb_ctx tx_context[PANDA_MAX_TX_URBS];
+  struct can_rx_offload offload;
+  struct panda_usb_ctx tx_context[PANDA_MAX_TX_FRAMES];
   struct net_device *netdev;
   struct usb_anchor tx_submitted;
   atomic_t free_ctx_cnt;
+  /* one tx URB in flight at a time, frames sent meanwhile wait in tx_pending
+   * and go out together in the next one. Guarded by tx_lock. */
+  spinlock_t tx_lock;
+  struct panda_usb_can_msg tx_pending[PANDA_TX_AGG_MAX];
+  struct panda_usb_ctx *tx_pending_ctx[PANDA_TX_AGG_MAX];
+  int tx_pending_cnt;
+  struct panda_usb_ctx *tx_inflight_ctx[PANDA_TX_AGG_MAX];
+  int tx_inflight_cnt; /* 0 when no URB is in flight */
+  u64 tx_urb_cnt;
+  u64 tx_frame_cnt;
+  /* the panda sends a completion with the token of each frame once it's on
+   * the bus, the echo skb is given back then instead of when the URB is done.
+   * A frame's tx_context slot is its token's. tx_token_resync is set when
+   * frames went missing before the panda numbered them. Guarded by tx_lock. */
+  bool tx_echo_tokens;
+  bool tx_token_resync;
+  u16 tx_token_next;
+  /* last bus stats, read by stats_work while the interface is up */
+  struct delayed_work stats_work;
+  struct panda_usb_can_stats bus_stats;
+  bool bus_stats_valid;
   u8 interface_num;
   u8 mcu_can_ifnum;
+  /* CAN_RAW_FILTER style filters set through the hw_filters attribute,
+   * 0 of them lets every frame through. Guarded by hw_filter_lock. */
+  struct mutex hw_filter_lock;
+  struct can_filter hw_filters[PANDA_MAX_HW_FILTERS];
+  int hw_filter_cnt;
+  struct panda_dev_priv *priv_dev;
+};
+
+struct panda_tty {
+  struct tty_port port;
+  /* NULL once the panda is gone. priv_dev is guarded by panda_tty_lock, udev
+   * also by tx_lock. */
   struct panda_dev_priv *priv_dev;
+  struct usb_device *udev;
+  u8 ring;
+  int minor;
+  unsigned int baud;
+  spinlock_t tx_lock;
+  int tx_urbs; /* in flight */
+  int tx_bytes;
+  struct usb_anchor tx_submitted;
 };
 
 struct panda_dev_priv {
   struct usb_device *udev;
   struct device *dev;
   struct usb_anchor rx_submitted;
+  u8 *rxbuf[PANDA_MAX_RX_URBS];
+  dma_addr_t rxbuf_dma[PANDA_MAX_RX_URBS];
+  int rxbuf_cnt;
+  bool timestamps; /* firmware sends panda_usb_can_ts_msg records */
+  bool compact; /* firmware sends compact records, with timestamps */
+  bool tx_lanes; /* alt setting 2, bus 0 is sent on EP1 OUT and the others on EP3 */
+  u64 ts_base; /* extends the 32 bit timestamps, they wrap about every 71 minutes */
+  u32 ts_last;
+  /* shared by the interfaces, rx URBs carry frames of every bus */
+  u64 rx_urb_cnt;
+  u64 rx_frame_cnt;
   struct panda_inf_priv *interfaces[PANDA_NUM_CAN_INTERFACES];
-};
-
-struct __packed panda_usb_can_msg {
-  u32 rir;
-  u32 bus_dat_len;
-  u8 data[8];
+  /* the rx of every open tty comes on the same EP2 IN URBs, running while one
+   * is open. tty_open has a bit for each open ring, as 0xf4 takes it. */
+  struct panda_tty *ttys[PANDA_TTY_PORTS];
+  int tty_open;
+  struct usb_anchor tty_rx_submitted;
 };
 
 static const struct usb_device_id panda_usb_table[] = {
@@ -77,6 +249,35 @@ static const struct usb_device_id panda_usb_table[] = {
 
 MODULE_DEVICE_TABLE(usb, panda_usb_table);
 
+/* while one URB is being processed the others keep the device's rx queue draining */
+static unsigned int rx_urbs = 8;
+module_param(rx_urbs, uint, 0444);
+MODULE_PARM_DESC(rx_urbs, "Receive URBs kept in flight (1-" __stringify(PANDA_MAX_RX_URBS) ", default 8)");
+
+/* The panda NAKs a lane while a tx queue of its buses is full, so a backed
+ * up bus only holds off the interfaces sharing its endpoint */
+static bool tx_lanes = true;
+module_param(tx_lanes, bool, 0444);
+MODULE_PARM_DESC(tx_lanes, "Send can0 on an endpoint of its own, firmware with alt setting 2 (default Y)");
+
+
+/* When the panda answers an rx URB with what it has, 0xa3. Fewer, fuller
+ * URBs for loggers, at the cost of latency. Firmware without it ignores it. */
+static unsigned int rx_flush_fill;
+module_param(rx_flush_fill, uint, 0444);
+MODULE_PARM_DESC(rx_flush_fill, "Frames the panda holds back until it has that many (0-32767, default 0, at once)");
+
+static unsigned int rx_flush_deadline_us;
+module_param(rx_flush_deadline_us, uint, 0444);
+MODULE_PARM_DESC(rx_flush_deadline_us, "Most us the panda holds a frame back (0-65535, default 0, 100ms with a fill)");
+
+static bool rx_flush_sof;
+module_param(rx_flush_sof, bool, 0444);
+MODULE_PARM_DESC(rx_flush_sof, "At most one rx URB answered a USB frame (default N)");
+
+static bool kline_tty = true;
+module_param(kline_tty, bool, 0444);
+MODULE_PARM_DESC(kline_tty, "The K-line and L-line as /dev/ttyPANDAn, firmware with 0xf4 (default Y)");
 
 // panda:       CAN1 = 0   CAN2 = 1   CAN3 = 4
 const int can_numbering[] = {0,1,4};
@@ -95,12 +296,14 @@ static inline void panda_init_ctx(struct panda_inf_priv *priv)
 {
   int i = 0;
 
-  for (i = 0; i < PANDA_MAX_TX_URBS; i++) {
+  for (i = 0; i < PANDA_MAX_TX_FRAMES; i++) {
     priv->tx_context[i].ndx = PANDA_CTX_FREE;
     priv->tx_context[i].priv = priv;
   }
 
   atomic_set(&priv->free_ctx_cnt, ARRAY_SIZE(priv->tx_context));
+  priv->tx_pending_cnt = 0;
+  priv->tx_inflight_cnt = 0;
 }
 
 static inline struct panda_usb_ctx *panda_usb_get_free_ctx(struct panda_inf_priv *priv,
@@ -109,7 +312,7 @@ static inline struct panda_usb_ctx *panda_usb_get_free_ctx(struct panda_inf_priv
   int i = 0;
   struct panda_usb_ctx *ctx = NULL;
 
-  for (i = 0; i < PANDA_MAX_TX_URBS; i++) {
+  for (i = 0; i < PANDA_MAX_TX_FRAMES; i++) {
     if (priv->tx_context[i].ndx == PANDA_CTX_FREE) {
       ctx = &priv->tx_context[i];
       ctx->ndx = i;
@@ -120,16 +323,38 @@ static inline struct panda_usb_ctx *panda_usb_get_free_ctx(struct panda_inf_priv
     }
   }
 
-  printk("CTX num %d\n", atomic_read(&priv->free_ctx_cnt));
   if (!atomic_read(&priv->free_ctx_cnt)){
     /* That was the last free ctx. Slow down tx path */
-    printk("SENDING TOO FAST\n");
     netif_stop_queue(priv->netdev);
   }
 
   return ctx;
 }
 
+/* With tx_echo_tokens the frame gets the slot of the token the panda will
+ * give it, so its completion finds it. NULL, and the queue stopped, if that
+ * slot still waits on its completion. Called with tx_lock held. */
+static inline struct panda_usb_ctx *panda_usb_get_token_ctx(struct panda_inf_priv *priv,
+							  struct can_frame *cf)
+{
+  u16 token = priv->tx_token_next;
+  struct panda_usb_ctx *ctx = &priv->tx_context[token % PANDA_MAX_TX_FRAMES];
+
+  if (priv->tx_token_resync || ctx->ndx != PANDA_CTX_FREE) {
+    netif_stop_queue(priv->netdev);
+    return NULL;
+  }
+
+  ctx->ndx = token % PANDA_MAX_TX_FRAMES;
+  ctx->dlc = cf->can_dlc;
+  ctx->token = token;
+  ctx->sent = false;
+  priv->tx_token_next = (token + 1) & PANDA_TX_TOKEN_MASK;
+
+  atomic_dec(&priv->free_ctx_cnt);
+  return ctx;
+}
+
 /* panda_usb_free_ctx and panda_usb_get_free_ctx are executed by different
  * threads. The order of execution in below function is important.
  */
@@ -148,7 +373,17 @@ static inline void panda_usb_free_ctx(struct panda_usb_ctx *ctx)
 
 static void panda_urb_unlink(struct panda_inf_priv *priv)
 {
-  usb_kill_anchored_urbs(&priv->priv_dev->rx_submitted);
+  struct panda_dev_priv *priv_dev = priv->priv_dev;
+  int i;
+
+  usb_kill_anchored_urbs(&priv_dev->rx_submitted);
+
+  /* the rx URBs are gone, so nothing uses their buffers anymore */
+  for (i = 0; i < priv_dev->rxbuf_cnt; i++)
+    usb_free_coherent(priv_dev->udev, PANDA_USB_RX_BUFF_SIZE,
+		      priv_dev->rxbuf[i], priv_dev->rxbuf_dma[i]);
+  priv_dev->rxbuf_cnt = 0;
+
   usb_kill_anchored_urbs(&priv->tx_submitted);
 }
 
@@ -159,62 +394,487 @@ static int panda_set_output_enable(struct panda_inf_priv* priv, bool enable){
 			 enable ? 0x1337 : 0, 0, NULL, 0, USB_CTRL_SET_TIMEOUT);
 }
 
-static void panda_usb_write_bulk_callback(struct urb *urb)
+static int panda_set_can_timestamps(struct panda_dev_priv *priv_dev, bool enable){
+  return usb_control_msg(priv_dev->udev,
+			 usb_sndctrlpipe(priv_dev->udev, 0),
+			 0xEA, USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+			 enable ? 1 : 0, 0, NULL, 0, USB_CTRL_SET_TIMEOUT);
+}
+
+/* 0xcf, what the panda sends back for frames it sent, and the token of the
+ * next frame. False if the firmware can't. */
+static bool panda_set_can_echo(struct panda_inf_priv *priv, u16 mode, u16 *token){
+  u8 *buf;
+  bool ok;
+  int err;
+
+  buf = kmalloc(3, GFP_KERNEL);
+  if (!buf)
+    return false;
+
+  err = usb_control_msg(priv->priv_dev->udev,
+			usb_rcvctrlpipe(priv->priv_dev->udev, 0),
+			0xCF, USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_DIR_IN,
+			priv->mcu_can_ifnum, mode, buf, 3, USB_CTRL_GET_TIMEOUT);
+  ok = err == 3 && (mode == PANDA_CAN_ECHO_KEEP || buf[0] == mode);
+  if (ok && token)
+    *token = (buf[1] | (buf[2] << 8)) & PANDA_TX_TOKEN_MASK;
+
+  kfree(buf);
+  return ok;
+}
+
+/* compact rx records and classic tx ones, false if the firmware can't */
+static bool panda_set_can_compact(struct panda_dev_priv *priv_dev){
+  u8 *buf;
+  bool compact;
+  int err;
+
+  buf = kmalloc(2, GFP_KERNEL);
+  if (!buf)
+    return false;
+
+  err = usb_control_msg(priv_dev->udev,
+			usb_rcvctrlpipe(priv_dev->udev, 0),
+			0xC4, USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_DIR_IN,
+			1, 0, buf, 2, USB_CTRL_GET_TIMEOUT);
+  compact = err == 2 && buf[0] == 1;
+
+  kfree(buf);
+  return compact;
+}
+
+#define PANDA_RX_FLUSH_SOF 0x8000
+#define PANDA_RX_FLUSH_STATUS_LEN 0x18
+
+static int panda_set_rx_flush(struct panda_dev_priv *priv_dev){
+  u16 value = min(rx_flush_fill, PANDA_RX_FLUSH_SOF - 1U) | (rx_flush_sof ? PANDA_RX_FLUSH_SOF : 0);
+  u8 *buf;
+  int err;
+
+  buf = kmalloc(PANDA_RX_FLUSH_STATUS_LEN, GFP_KERNEL);
+  if (!buf)
+    return -ENOMEM;
+
+  err = usb_control_msg(priv_dev->udev,
+			usb_rcvctrlpipe(priv_dev->udev, 0),
+			0xA3, USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_DIR_IN,
+			value, min(rx_flush_deadline_us, 0xFFFFU), buf,
+			PANDA_RX_FLUSH_STATUS_LEN, USB_CTRL_GET_TIMEOUT);
+
+  kfree(buf);
+  return err;
+}
+
+static int panda_filter_request(struct panda_inf_priv *priv, u8 request,
+				u16 value, u16 index){
+  return usb_control_msg(priv->priv_dev->udev,
+			 usb_sndctrlpipe(priv->priv_dev->udev, 0),
+			 request, USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+			 value, index, NULL, 0, USB_CTRL_SET_TIMEOUT);
+}
+
+/* socketcan filter to the RIR id and mask the firmware matches on. The IDE
+ * bit always has to match, so a filter is for either 11 or 29 bit ids. */
+static void panda_filter_to_rir(const struct can_filter *f, u32 *rir, u32 *rmask)
 {
-  struct panda_usb_ctx *ctx = urb->context;
-  struct net_device *netdev;
+  if(f->can_id & CAN_EFF_FLAG){
+    *rir = ((f->can_id & CAN_EFF_MASK) << 3) | PANDA_CAN_EXTENDED;
+    if((f->can_mask & CAN_EFF_MASK) == CAN_EFF_MASK)
+      *rmask = PANDA_FILTER_EXACT;
+    else
+      *rmask = ((f->can_mask & CAN_EFF_MASK) << 3) | PANDA_CAN_EXTENDED;
+  }else{
+    *rir = (f->can_id & CAN_SFF_MASK) << 21;
+    if((f->can_mask & CAN_SFF_MASK) == CAN_SFF_MASK)
+      *rmask = PANDA_FILTER_EXACT;
+    else
+      *rmask = ((f->can_mask & CAN_SFF_MASK) << 21) | PANDA_CAN_EXTENDED;
+  }
+}
 
-  WARN_ON(!ctx);
+/* Replace the bus's filters in the firmware with priv->hw_filters.
+ * Called with hw_filter_lock held. */
+static int panda_program_hw_filters(struct panda_inf_priv *priv)
+{
+  u16 bus = priv->mcu_can_ifnum;
+  u32 rir, rmask;
+  int err, i;
 
-  netdev = ctx->priv->netdev;
+  /* 0xdf wIndex 0: clear and accept all until the new set is applied */
+  err = panda_filter_request(priv, 0xDF, bus, 0);
+  if(err < 0 || priv->hw_filter_cnt == 0)
+    return err;
 
-  /* free up our allocated buffer */
-  usb_free_coherent(urb->dev, urb->transfer_buffer_length,
-		    urb->transfer_buffer, urb->transfer_dma);
+  for(i = 0; i < priv->hw_filter_cnt; i++){
+    panda_filter_to_rir(&priv->hw_filters[i], &rir, &rmask);
+    if((err = panda_filter_request(priv, 0xE8, rir & 0xFFFF, rir >> 16)) < 0 ||
+       (err = panda_filter_request(priv, 0xE9, rmask & 0xFFFF, rmask >> 16)) < 0 ||
+       (err = panda_filter_request(priv, 0xDF, bus, 1)) < 0)
+      return err;
+  }
+
+  return panda_filter_request(priv, 0xDF, bus, 2);
+}
+
+/* "id:mask" pairs in hex, as given to candump, separated by spaces, commas or
+ * newlines. Ids above 0x7FF or with CAN_EFF_FLAG set are 29 bit. */
+static ssize_t hw_filters_store(struct device *dev, struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+  struct panda_inf_priv *priv = netdev_priv(to_net_dev(dev));
+  struct can_filter filters[PANDA_MAX_HW_FILTERS];
+  const char *p = buf;
+  int cnt = 0, len, err;
+  u32 id, mask;
+
+  while(*p){
+    if(isspace(*p) || *p == ','){
+      p++;
+      continue;
+    }
+    if(cnt == PANDA_MAX_HW_FILTERS)
+      return -ENOSPC;
+    if(sscanf(p, "%x:%x%n", &id, &mask, &len) != 2)
+      return -EINVAL;
+    if(id > CAN_SFF_MASK)
+      id |= CAN_EFF_FLAG;
+    filters[cnt].can_id = id;
+    filters[cnt].can_mask = mask;
+    cnt++;
+    p += len;
+  }
+
+  mutex_lock(&priv->hw_filter_lock);
+  memcpy(priv->hw_filters, filters, cnt * sizeof(filters[0]));
+  priv->hw_filter_cnt = cnt;
+  err = panda_program_hw_filters(priv);
+  mutex_unlock(&priv->hw_filter_lock);
+
+  return err < 0 ? err : count;
+}
+
+static ssize_t hw_filters_show(struct device *dev, struct device_attribute *attr,
+			       char *buf)
+{
+  struct panda_inf_priv *priv = netdev_priv(to_net_dev(dev));
+  ssize_t len = 0;
+  int i;
+
+  mutex_lock(&priv->hw_filter_lock);
+  for(i = 0; i < priv->hw_filter_cnt; i++)
+    len += scnprintf(buf + len, PAGE_SIZE - len, "%08x:%08x\n",
+		     priv->hw_filters[i].can_id, priv->hw_filters[i].can_mask);
+  mutex_unlock(&priv->hw_filter_lock);
+
+  return len;
+}
+
+static DEVICE_ATTR_RW(hw_filters);
+
+static struct attribute *panda_netdev_attrs[] = {
+  &dev_attr_hw_filters.attr,
+  NULL
+};
+
+static const struct attribute_group panda_netdev_attr_group = {
+  .attrs = panda_netdev_attrs,
+};
+
+static int panda_get_bus_stats(struct panda_inf_priv *priv,
+			       struct panda_usb_can_stats *stats)
+{
+  struct panda_usb_can_stats *buf;
+  int err;
+
+  /* control transfers need a DMA capable buffer */
+  buf = kmalloc(sizeof(*buf), GFP_KERNEL);
+  if (!buf)
+    return -ENOMEM;
+
+  err = usb_control_msg(priv->priv_dev->udev,
+			usb_rcvctrlpipe(priv->priv_dev->udev, 0),
+			0xC0, USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_DIR_IN,
+			priv->mcu_can_ifnum, 0, buf, sizeof(*buf), USB_CTRL_GET_TIMEOUT);
+  if (err >= 0 && err < sizeof(*buf))
+    err = -EPROTO;
+  if (err >= 0) {
+    *stats = *buf;
+    err = 0;
+  }
 
-  if (!netif_device_present(netdev))
+  kfree(buf);
+  return err;
+}
+
+static enum can_state panda_state_from_stats(const struct panda_usb_can_stats *stats)
+{
+  u8 errs = max(stats->tec, stats->rec);
+
+  if (stats->bus_off)
+    return CAN_STATE_BUS_OFF;
+  if (errs >= 128)
+    return CAN_STATE_ERROR_PASSIVE;
+  if (errs >= 96)
+    return CAN_STATE_ERROR_WARNING;
+  return CAN_STATE_ERROR_ACTIVE;
+}
+
+/* Turns what changed since the last read into an error frame: state changes,
+ * device side overruns and, with berr-reporting on, bus errors.
+ */
+static void panda_report_bus_stats(struct panda_inf_priv *priv,
+				   const struct panda_usb_can_stats *old,
+				   const struct panda_usb_can_stats *stats)
+{
+  struct net_device *netdev = priv->netdev;
+  enum can_state state = panda_state_from_stats(stats);
+  u32 rx_drops = stats->rx_drop_cnt - old->rx_drop_cnt;
+  u32 errs = stats->err_cnt - old->err_cnt;
+  bool berr = errs && stats->lec && (priv->can.ctrlmode & CAN_CTRLMODE_BERR_REPORTING);
+  struct can_frame *cf;
+  struct sk_buff *skb;
+
+  netdev->stats.rx_over_errors += rx_drops;
+  netdev->stats.tx_aborted_errors += stats->tx_drop_cnt - old->tx_drop_cnt;
+  if (errs && stats->lec) {
+    priv->can.can_stats.bus_error += errs;
+    netdev->stats.rx_errors += errs;
+  }
+
+  if (state == priv->can.state && !rx_drops && !berr)
     return;
 
-  netdev->stats.tx_packets++;
-  netdev->stats.tx_bytes += ctx->dlc;
+  /* the counters are still taken if there is no skb for the frame */
+  skb = alloc_can_err_skb(netdev, &cf);
 
-  can_get_echo_skb(netdev, ctx->ndx);
+  if (state != priv->can.state) {
+    enum can_state tx_state = stats->tec >= stats->rec ? state : 0;
+    enum can_state rx_state = stats->rec >= stats->tec ? state : 0;
 
-  if (urb->status)
-    netdev_info(netdev, "Tx URB aborted (%d)\n", urb->status);
+    /* the bxCAN leaves bus off by itself (ABOM), so just report it */
+    if (state == CAN_STATE_BUS_OFF)
+      priv->can.can_stats.bus_off++;
+    can_change_state(netdev, skb ? cf : NULL, tx_state, rx_state);
+  }
 
-  /* Release the context */
-  panda_usb_free_ctx(ctx);
+  if (!skb)
+    return;
+
+  if (rx_drops) {
+    cf->can_id |= CAN_ERR_CRTL;
+    cf->data[1] |= CAN_ERR_CRTL_RX_OVERFLOW;
+  }
+
+  if (berr) {
+    cf->can_id |= CAN_ERR_PROT | CAN_ERR_BUSERROR;
+    switch (stats->lec) {
+    case 1: cf->data[2] |= CAN_ERR_PROT_STUFF; break;
+    case 2: cf->data[2] |= CAN_ERR_PROT_FORM; break;
+    case 3: cf->can_id |= CAN_ERR_ACK; break;
+    case 4: cf->data[2] |= CAN_ERR_PROT_BIT1; break;
+    case 5: cf->data[2] |= CAN_ERR_PROT_BIT0; break;
+    case 6: cf->data[3] = CAN_ERR_PROT_LOC_CRC_SEQ; break;
+    }
+  }
+
+#ifdef CAN_ERR_CNT
+  cf->can_id |= CAN_ERR_CNT;
+#endif
+  cf->data[6] = stats->tec;
+  cf->data[7] = stats->rec;
+
+  /* process context, older kernels want bottom halves off for netif_rx */
+  local_bh_disable();
+  netif_rx(skb);
+  local_bh_enable();
+}
+
+/* With tx_echo_tokens, takes back the slots of frames that never completed,
+ * the panda dropped them or the bus won't take them, and reads the next token
+ * again once frames went missing before the panda numbered them. The queue
+ * stays stopped until it has it. */
+static void panda_check_tx_tokens(struct panda_inf_priv *priv)
+{
+  struct net_device *netdev = priv->netdev;
+  unsigned long timeout = msecs_to_jiffies(PANDA_TX_DONE_TIMEOUT_MS);
+  unsigned long flags;
+  unsigned int cnt = 0, bytes = 0;
+  bool resync;
+  u16 token;
+  int i;
+
+  spin_lock_irqsave(&priv->tx_lock, flags);
+  if (!priv->tx_echo_tokens) {
+    spin_unlock_irqrestore(&priv->tx_lock, flags);
+    return;
+  }
+
+  for (i = 0; i < PANDA_MAX_TX_FRAMES; i++) {
+    struct panda_usb_ctx *ctx = &priv->tx_context[i];
+
+    if (ctx->ndx == PANDA_CTX_FREE || !ctx->sent ||
+        !time_after(jiffies, ctx->sent_at + timeout))
+      continue;
+    bytes += ctx->dlc;
+    cnt++;
+    panda_free_echo_skb(netdev, ctx->ndx);
+    panda_usb_free_ctx(ctx);
+  }
+  if (cnt)
+    netdev_completed_queue(netdev, cnt, bytes);
+  resync = priv->tx_token_resync;
+  spin_unlock_irqrestore(&priv->tx_lock, flags);
+
+  /* nothing is in flight while it's set, tried again next poll if this fails */
+  if (!resync || !panda_set_can_echo(priv, PANDA_CAN_ECHO_KEEP, &token))
+    return;
+
+  spin_lock_irqsave(&priv->tx_lock, flags);
+  priv->tx_token_next = token;
+  priv->tx_token_resync = false;
+  spin_unlock_irqrestore(&priv->tx_lock, flags);
+  netif_wake_queue(netdev);
+}
+
+static void panda_stats_work(struct work_struct *work)
+{
+  struct panda_inf_priv *priv = container_of(to_delayed_work(work),
+					     struct panda_inf_priv, stats_work);
+  struct panda_usb_can_stats stats;
+  int err;
+
+  panda_check_tx_tokens(priv);
+
+  err = panda_get_bus_stats(priv, &stats);
+  if (err == -ENODEV)
+    return;
+
+  if (!err) {
+    /* the first read after open is the baseline for the deltas */
+    if (priv->bus_stats_valid)
+      panda_report_bus_stats(priv, &priv->bus_stats, &stats);
+    priv->bus_stats = stats;
+    priv->bus_stats_valid = true;
+  }
+
+  schedule_delayed_work(&priv->stats_work, msecs_to_jiffies(PANDA_STATS_POLL_MS));
+}
+
+static int panda_get_berr_counter(const struct net_device *netdev,
+				  struct can_berr_counter *bec)
+{
+  const struct panda_inf_priv *priv = netdev_priv(netdev);
+
+  bec->txerr = priv->bus_stats.tec;
+  bec->rxerr = priv->bus_stats.rec;
+
+  return 0;
+}
+
+static const char panda_ethtool_stat_names[][ETH_GSTRING_LEN] = {
+  "rx_urbs", "rx_frames", "rx_frames_per_urb",
+  "tx_urbs", "tx_frames", "tx_frames_per_urb",
+  "dev_rx_frames", "dev_tx_frames", "dev_rx_dropped", "dev_tx_dropped",
+  "dev_errors", "dev_rx_queue_hwm", "dev_tx_queue_hwm", "bus_load_permille",
+  "tec", "rec",
+};
+
+static int panda_get_sset_count(struct net_device *netdev, int sset)
+{
+  if (sset == ETH_SS_STATS)
+    return ARRAY_SIZE(panda_ethtool_stat_names);
+  return -EOPNOTSUPP;
 }
 
+static void panda_get_strings(struct net_device *netdev, u32 sset, u8 *data)
+{
+  if (sset == ETH_SS_STATS)
+    memcpy(data, panda_ethtool_stat_names, sizeof(panda_ethtool_stat_names));
+}
 
-static netdev_tx_t panda_usb_xmit(struct panda_inf_priv *priv,
-				  struct panda_usb_can_msg *usb_msg,
-				  struct panda_usb_ctx *ctx)
+/* rx URB counts are for the whole device, the dev_ values are as of the last poll */
+static void panda_get_ethtool_stats(struct net_device *netdev,
+				    struct ethtool_stats *estats, u64 *data)
+{
+  struct panda_inf_priv *priv = netdev_priv(netdev);
+  struct panda_dev_priv *priv_dev = priv->priv_dev;
+  const struct panda_usb_can_stats *s = &priv->bus_stats;
+  unsigned long flags;
+  u64 tx_urbs, tx_frames;
+  int i = 0;
+
+  spin_lock_irqsave(&priv->tx_lock, flags);
+  tx_urbs = priv->tx_urb_cnt;
+  tx_frames = priv->tx_frame_cnt;
+  spin_unlock_irqrestore(&priv->tx_lock, flags);
+
+  data[i++] = priv_dev->rx_urb_cnt;
+  data[i++] = priv_dev->rx_frame_cnt;
+  data[i++] = priv_dev->rx_urb_cnt ? div64_u64(priv_dev->rx_frame_cnt, priv_dev->rx_urb_cnt) : 0;
+  data[i++] = tx_urbs;
+  data[i++] = tx_frames;
+  data[i++] = tx_urbs ? div64_u64(tx_frames, tx_urbs) : 0;
+  data[i++] = s->rx_cnt;
+  data[i++] = s->txd_cnt;
+  data[i++] = s->rx_drop_cnt;
+  data[i++] = s->tx_drop_cnt;
+  data[i++] = s->err_cnt;
+  data[i++] = s->rx_q_hwm;
+  data[i++] = s->tx_q_hwm;
+  data[i++] = s->load;
+  data[i++] = s->tec;
+  data[i++] = s->rec;
+}
+
+static const struct ethtool_ops panda_ethtool_ops = {
+  .get_sset_count = panda_get_sset_count,
+  .get_strings = panda_get_strings,
+  .get_ethtool_stats = panda_get_ethtool_stats,
+};
+
+static void panda_usb_write_bulk_callback(struct urb *urb);
+
+/* Frames were dropped before the panda numbered them, so its tokens are
+ * behind tx_token_next. Stops the queue until stats_work reads the next one.
+ * Called with tx_lock held. */
+static void panda_usb_token_resync(struct panda_inf_priv *priv)
+{
+  if (!priv->tx_echo_tokens || !netif_running(priv->netdev))
+    return;
+  priv->tx_token_resync = true;
+  netif_stop_queue(priv->netdev);
+  mod_delayed_work(system_wq, &priv->stats_work, 0);
+}
+
+/* Sends everything in tx_pending in one transfer. Called with tx_lock held and
+ * no URB in flight.
+ */
+static int panda_usb_submit_pending(struct panda_inf_priv *priv)
 {
   struct urb *urb;
   u8 *buf;
   int err;
+  size_t len = priv->tx_pending_cnt * sizeof(struct panda_usb_can_msg);
 
   /* create a URB, and a buffer for it, and copy the data to the URB */
   urb = usb_alloc_urb(0, GFP_ATOMIC);
   if (!urb)
     return -ENOMEM;
 
-  buf = usb_alloc_coherent(priv->priv_dev->udev,
-			   PANDA_USB_TX_BUFF_SIZE, GFP_ATOMIC,
+  buf = usb_alloc_coherent(priv->priv_dev->udev, len, GFP_ATOMIC,
 			   &urb->transfer_dma);
   if (!buf) {
     err = -ENOMEM;
     goto nomembuf;
   }
 
-  memcpy(buf, usb_msg, PANDA_USB_TX_BUFF_SIZE);
+  memcpy(buf, priv->tx_pending, len);
 
   usb_fill_bulk_urb(urb, priv->priv_dev->udev,
-		    usb_sndbulkpipe(priv->priv_dev->udev, 3), buf,
-		    PANDA_USB_TX_BUFF_SIZE, panda_usb_write_bulk_callback,
-		    ctx);
+		    usb_sndbulkpipe(priv->priv_dev->udev,
+				    (priv->priv_dev->tx_lanes && priv->mcu_can_ifnum == 0) ? 1 : 3), buf,
+		    len, panda_usb_write_bulk_callback, priv);
 
   urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
   usb_anchor_urb(urb, &priv->tx_submitted);
@@ -223,6 +883,13 @@ static netdev_tx_t panda_usb_xmit(struct panda_inf_priv *priv,
   if (unlikely(err))
     goto failed;
 
+  memcpy(priv->tx_inflight_ctx, priv->tx_pending_ctx,
+	 priv->tx_pending_cnt * sizeof(priv->tx_pending_ctx[0]));
+  priv->tx_inflight_cnt = priv->tx_pending_cnt;
+  priv->tx_urb_cnt++;
+  priv->tx_frame_cnt += priv->tx_pending_cnt;
+  priv->tx_pending_cnt = 0;
+
   /* Release our reference to this URB, the USB core will eventually free it entirely. */
   usb_free_urb(urb);
 
@@ -230,7 +897,7 @@ static netdev_tx_t panda_usb_xmit(struct panda_inf_priv *priv,
 
  failed:
   usb_unanchor_urb(urb);
-  usb_free_coherent(priv->priv_dev->udev, PANDA_USB_TX_BUFF_SIZE, buf, urb->transfer_dma);
+  usb_free_coherent(priv->priv_dev->udev, len, buf, urb->transfer_dma);
 
   if (err == -ENODEV)
     netif_device_detach(priv->netdev);
@@ -243,29 +910,181 @@ static netdev_tx_t panda_usb_xmit(struct panda_inf_priv *priv,
   return err;
 }
 
+/* Frees the pending frames after a failed submit. Called with tx_lock held. */
+static void panda_usb_drop_pending(struct panda_inf_priv *priv)
+{
+  struct net_device *netdev = priv->netdev;
+  unsigned int bytes = 0;
+  int i;
+
+  for (i = 0; i < priv->tx_pending_cnt; i++) {
+    struct panda_usb_ctx *ctx = priv->tx_pending_ctx[i];
+
+    bytes += ctx->dlc;
+    panda_free_echo_skb(netdev, ctx->ndx);
+    panda_usb_free_ctx(ctx);
+    netdev->stats.tx_dropped++;
+  }
+
+  netdev_completed_queue(netdev, priv->tx_pending_cnt, bytes);
+  priv->tx_pending_cnt = 0;
+  panda_usb_token_resync(priv);
+}
+
+static void panda_usb_write_bulk_callback(struct urb *urb)
+{
+  struct panda_inf_priv *priv = urb->context;
+  struct net_device *netdev;
+  unsigned long flags;
+  unsigned int bytes = 0, done = 0;
+  int i;
+
+  WARN_ON(!priv);
+
+  netdev = priv->netdev;
+
+  /* free up our allocated buffer */
+  usb_free_coherent(urb->dev, urb->transfer_buffer_length,
+		    urb->transfer_buffer, urb->transfer_dma);
+
+  if (urb->status)
+    netdev_info(netdev, "Tx URB aborted (%d)\n", urb->status);
+
+  spin_lock_irqsave(&priv->tx_lock, flags);
+
+  for (i = 0; i < priv->tx_inflight_cnt; i++) {
+    struct panda_usb_ctx *ctx = priv->tx_inflight_ctx[i];
+
+    /* done once the panda's completion for it comes, if it hasn't yet */
+    if (priv->tx_echo_tokens && ctx->ndx == PANDA_CTX_FREE)
+      continue;
+    if (priv->tx_echo_tokens && !urb->status) {
+      ctx->sent = true;
+      ctx->sent_at = jiffies;
+      continue;
+    }
+
+    bytes += ctx->dlc;
+    done++;
+    if (urb->status) {
+      panda_free_echo_skb(netdev, ctx->ndx);
+      netdev->stats.tx_dropped++;
+    } else {
+      netdev->stats.tx_packets++;
+      netdev->stats.tx_bytes += ctx->dlc;
+      panda_get_echo_skb(netdev, ctx->ndx);
+    }
+
+    /* Release the context */
+    panda_usb_free_ctx(ctx);
+  }
+
+  if (done)
+    netdev_completed_queue(netdev, done, bytes);
+  priv->tx_inflight_cnt = 0;
+  if (urb->status)
+    panda_usb_token_resync(priv);
+
+  /* whatever was sent while this URB was out goes in the next one */
+  if (priv->tx_pending_cnt) {
+    if (urb->status || !netif_device_present(netdev) || panda_usb_submit_pending(priv))
+      panda_usb_drop_pending(priv);
+  }
+
+  /* the contexts are still held, but the next transfer has room again */
+  if (priv->tx_echo_tokens && !priv->tx_token_resync)
+    netif_wake_queue(netdev);
+
+  spin_unlock_irqrestore(&priv->tx_lock, flags);
+}
+
+static ktime_t panda_usb_hwtstamp(struct panda_dev_priv *priv_dev, u32 ts)
+{
+  /* the buses' queues are merged, so a frame can be a little before the
+   * newest, from before the wrap if that was just now. Otherwise a
+   * smaller value means the timer wrapped. */
+  u64 base = priv_dev->ts_base;
+  u32 back = priv_dev->ts_last - ts;
+  if (back != 0 && back < PANDA_TS_LATE_MAX) {
+    if (ts > priv_dev->ts_last && base > 0)
+      base -= 0x100000000ULL;
+  } else {
+    if (ts < priv_dev->ts_last)
+      priv_dev->ts_base += 0x100000000ULL;
+    priv_dev->ts_last = ts;
+    base = priv_dev->ts_base;
+  }
+  return ns_to_ktime((base + ts) * NSEC_PER_USEC);
+}
+
+/* The panda's completion of the frame with token, which has CAN_DONE_ flags.
+ * Its echo skb goes back with the time it was sent on the bus. */
+static void panda_usb_process_tx_done(struct panda_inf_priv *priv, u16 token,
+				      struct panda_usb_can_ts_msg *ts_msg)
+{
+  struct net_device *netdev = priv->netdev;
+  struct panda_usb_ctx *ctx;
+  struct sk_buff *skb;
+  unsigned long flags;
+  u16 num = token & PANDA_TX_TOKEN_MASK;
+
+  spin_lock_irqsave(&priv->tx_lock, flags);
+
+  /* the slot may have been taken back, see panda_check_tx_tokens. The
+   * completion can come before the URB's, that leaves it to this. */
+  ctx = &priv->tx_context[num % PANDA_MAX_TX_FRAMES];
+  if (!priv->tx_echo_tokens || ctx->ndx == PANDA_CTX_FREE || ctx->token != num) {
+    spin_unlock_irqrestore(&priv->tx_lock, flags);
+    return;
+  }
+
+  if (token & PANDA_DONE_FAILED) {
+    panda_free_echo_skb(netdev, ctx->ndx);
+    netdev->stats.tx_errors++;
+    if (token & PANDA_DONE_ARB_LOST)
+      priv->can.can_stats.arbitration_lost++;
+  } else {
+    skb = priv->can.echo_skb[ctx->ndx];
+    if (skb && ts_msg)
+      skb_hwtstamps(skb)->hwtstamp = panda_usb_hwtstamp(priv->priv_dev, ts_msg->timestamp);
+    netdev->stats.tx_packets++;
+    netdev->stats.tx_bytes += ctx->dlc;
+    panda_get_echo_skb(netdev, ctx->ndx);
+  }
+
+  netdev_completed_queue(netdev, 1, ctx->dlc);
+  panda_usb_free_ctx(ctx);
+
+  spin_unlock_irqrestore(&priv->tx_lock, flags);
+}
+
 static void panda_usb_process_can_rx(struct panda_dev_priv *priv_dev,
-				     struct panda_usb_can_msg *msg)
+				     struct panda_usb_can_msg *msg,
+				     struct panda_usb_can_ts_msg *ts_msg)
 {
   struct can_frame *cf;
   struct sk_buff *skb;
   int bus_num;
   struct panda_inf_priv *priv_inf;
-  struct net_device_stats *stats;
 
   bus_num = (msg->bus_dat_len >> 4) & 0xf;
   priv_inf = panda_get_inf_from_bus_id(priv_dev, bus_num);
   if(!priv_inf){
-    printk("Got something on an unused interface %d\n", bus_num);
+    dev_dbg(priv_dev->dev, "Got something on an unused interface %d\n", bus_num);
     return;
   }
-  printk("Recv bus %d\n", bus_num);
-
-  stats = &priv_inf->netdev->stats;
-  //u16 sid;
 
   if (!netif_device_present(priv_inf->netdev))
     return;
 
+  /* frames the panda sent itself. The local echo is the echo skb, a full copy
+   * back would be the frame received a second time. */
+  if ((msg->bus_dat_len >> 4) & PANDA_BUS_RET_FLAG) {
+    if (msg->rir & PANDA_CAN_TRANSMIT)
+      panda_usb_process_tx_done(priv_inf, msg->data[0] | (msg->data[1] << 8), ts_msg);
+    return;
+  }
+
   skb = alloc_can_skb(priv_inf->netdev, &cf);
   if (!skb)
     return;
@@ -280,22 +1099,80 @@ static void panda_usb_process_can_rx(struct panda_dev_priv *priv_dev,
   //if (msg->dlc & MCBA_DLC_RTR_MASK)
   //  cf->can_id |= CAN_RTR_FLAG;
 
-  cf->can_dlc = get_can_dlc(msg->bus_dat_len & PANDA_DLC_MASK);
+  cf->can_dlc = can_cc_dlc2len(msg->bus_dat_len & PANDA_DLC_MASK);
 
   memcpy(cf->data, msg->data, cf->can_dlc);
 
-  stats->rx_packets++;
-  stats->rx_bytes += cf->can_dlc;
+  if (ts_msg)
+    skb_hwtstamps(skb)->hwtstamp = panda_usb_hwtstamp(priv_dev, ts_msg->timestamp);
 
-  netif_rx(skb);
+  /* delivered from the rx-offload NAPI poll, which also counts rx stats */
+  if (can_rx_offload_queue_tail(&priv_inf->offload, skb))
+    priv_inf->netdev->stats.rx_fifo_errors++;
+}
+
+/* a compact record as a panda_usb_can_ts_msg: a header byte of len (bits
+ * 0-3), bus (4-5), sent by the panda (6) and 29 bit id (7), the id in 2 or 4
+ * bytes, the time as an s16 from the packet's first record or 0x8000 and the
+ * 32 bit time, then the data. A completion has a len of 0xD and its token
+ * where the id goes, and comes out as a classic one, TXRQ and the token in
+ * the data. Returns the record's length, 0 at the padding or a record cut
+ * short. */
+static int panda_usb_parse_compact(const u8 *rec, int len, u32 *ts_base, bool first,
+				   struct panda_usb_can_ts_msg *out)
+{
+  int dlc, idl, pos;
+  bool done;
+  u16 rel;
+  u32 id = 0;
+
+  if (len < 1 || (rec[0] & PANDA_DLC_MASK) == PANDA_COMPACT_PAD)
+    return 0;
+  done = (rec[0] & PANDA_DLC_MASK) == PANDA_COMPACT_DONE;
+  dlc = done ? 0 : min(rec[0] & PANDA_DLC_MASK, 8);
+  idl = (rec[0] & PANDA_COMPACT_EXT) ? 4 : 2;
+  if (len < 1 + idl + 2)
+    return 0;
+
+  for (pos = 0; pos < idl; pos++)
+    id |= (u32)rec[1 + pos] << (8 * pos);
+  pos = 1 + idl;
+  rel = rec[pos] | (rec[pos + 1] << 8);
+  pos += 2;
+  if (rel == PANDA_COMPACT_TS_WIDE) {
+    if (len < pos + 4)
+      return 0;
+    out->timestamp = rec[pos] | (rec[pos + 1] << 8) | (rec[pos + 2] << 16) | ((u32)rec[pos + 3] << 24);
+    pos += 4;
+  } else {
+    out->timestamp = *ts_base + (s16)rel;
+  }
+  if (len < pos + dlc)
+    return 0;
+  if (first)
+    *ts_base = out->timestamp;
+
+  out->msg.rir = (rec[0] & PANDA_COMPACT_EXT) ? ((id << 3) | PANDA_CAN_EXTENDED) : (id << 21);
+  out->msg.bus_dat_len = dlc | (((rec[0] >> 4) & 3) << 4) |
+    ((rec[0] & PANDA_COMPACT_FLAG) ? (PANDA_BUS_RET_FLAG << 4) : 0);
+  memset(out->msg.data, 0, sizeof(out->msg.data));
+  memcpy(out->msg.data, rec + pos, dlc);
+  if (done) {
+    out->msg.rir = PANDA_CAN_TRANSMIT;
+    out->msg.data[0] = id & 0xFF;
+    out->msg.data[1] = id >> 8;
+  }
+  return pos + dlc;
 }
 
-static void panda_usb_read_int_callback(struct urb *urb)
+static void panda_usb_read_bulk_callback(struct urb *urb)
 {
   struct panda_dev_priv *priv_dev = urb->context;
   int retval;
   int pos = 0;
   int inf_num;
+  size_t rec_size = priv_dev->timestamps ?
+    sizeof(struct panda_usb_can_ts_msg) : sizeof(struct panda_usb_can_msg);
 
   switch (urb->status) {
   case 0: /* success */
@@ -308,28 +1185,65 @@ static void panda_usb_read_int_callback(struct urb *urb)
     goto resubmit_urb;
   }
 
-  while (pos < urb->actual_length) {
+  while (priv_dev->compact && pos < urb->actual_length) {
+    int pkt_len = min_t(int, urb->actual_length - pos, PANDA_USB_PACKET_SIZE);
+    u32 ts_base = 0;
+    int off = 0;
+    int rec_len;
+    struct panda_usb_can_ts_msg ts_msg;
+
+    while ((rec_len = panda_usb_parse_compact(urb->transfer_buffer + pos + off, pkt_len - off,
+					      &ts_base, off == 0, &ts_msg)) > 0) {
+      panda_usb_process_can_rx(priv_dev, &ts_msg.msg, &ts_msg);
+      priv_dev->rx_frame_cnt++;
+      off += rec_len;
+    }
+    pos += pkt_len;
+  }
+
+  while (!priv_dev->compact && pos < urb->actual_length) {
     struct panda_usb_can_msg *msg;
 
-    if (pos + sizeof(struct panda_usb_can_msg) > urb->actual_length) {
+    /* timestamped records don't divide the packet, skip its padding */
+    if (PANDA_USB_PACKET_SIZE - (pos % PANDA_USB_PACKET_SIZE) < rec_size) {
+      pos += PANDA_USB_PACKET_SIZE - (pos % PANDA_USB_PACKET_SIZE);
+      continue;
+    }
+
+    if (pos + rec_size > urb->actual_length) {
       dev_err(priv_dev->dev, "format error\n");
       break;
     }
 
     msg = (struct panda_usb_can_msg *)(urb->transfer_buffer + pos);
 
-    panda_usb_process_can_rx(priv_dev, msg);
+    panda_usb_process_can_rx(priv_dev, msg,
+			     priv_dev->timestamps ? (struct panda_usb_can_ts_msg *)msg : NULL);
 
-    pos += sizeof(struct panda_usb_can_msg);
+    priv_dev->rx_frame_cnt++;
+    pos += rec_size;
   }
+  priv_dev->rx_urb_cnt++;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+  /* hands the queued frames to NAPI, older kernels schedule it on queueing */
+  for(inf_num = 0; inf_num < PANDA_NUM_CAN_INTERFACES; inf_num++)
+    if(priv_dev->interfaces[inf_num])
+      can_rx_offload_irq_finish(&priv_dev->interfaces[inf_num]->offload);
+#endif
 
  resubmit_urb:
-  usb_fill_int_urb(urb, priv_dev->udev,
-		    usb_rcvintpipe(priv_dev->udev, 1),
+  usb_fill_bulk_urb(urb, priv_dev->udev,
+		    usb_rcvbulkpipe(priv_dev->udev, 1),
 		    urb->transfer_buffer, PANDA_USB_RX_BUFF_SIZE,
-		    panda_usb_read_int_callback, priv_dev, 5);
+		    panda_usb_read_bulk_callback, priv_dev);
+
+  /* completion took the URB off the anchor */
+  usb_anchor_urb(urb, &priv_dev->rx_submitted);
 
   retval = usb_submit_urb(urb, GFP_ATOMIC);
+  if (retval)
+    usb_unanchor_urb(urb);
 
   if (retval == -ENODEV){
     for(inf_num = 0; inf_num < PANDA_NUM_CAN_INTERFACES; inf_num++)
@@ -342,55 +1256,87 @@ static void panda_usb_read_int_callback(struct urb *urb)
 
 static int panda_usb_start(struct panda_dev_priv *priv_dev)
 {
-  int err;
+  int err = 0;
   struct urb *urb = NULL;
   u8 *buf;
+  dma_addr_t buf_dma;
   int inf_num;
+  unsigned int want = clamp_t(unsigned int, rx_urbs, 1, PANDA_MAX_RX_URBS);
+  int i;
 
   for(inf_num = 0; inf_num < PANDA_NUM_CAN_INTERFACES; inf_num++)
     panda_init_ctx(priv_dev->interfaces[inf_num]);
 
-  err = usb_set_interface(priv_dev->udev, 0, 1);
-  if (err) {
-    dev_err(priv_dev->dev, "Can not set alternate setting to 1, error: %i", err);
-    return err;
+  /* older firmware only has alt settings 0 and 1 */
+  priv_dev->tx_lanes = tx_lanes && !usb_set_interface(priv_dev->udev, 0, PANDA_ALT_TX_LANES);
+  if (!priv_dev->tx_lanes) {
+    err = usb_set_interface(priv_dev->udev, 0, 0);
+    if (err) {
+      dev_err(priv_dev->dev, "Can not set alternate setting to 0, error: %i", err);
+      return err;
+    }
   }
 
-  /* create a URB, and a buffer for it */
-  urb = usb_alloc_urb(0, GFP_KERNEL);
-  if (!urb) {
-    return -ENOMEM;
-  }
+  /* older firmware doesn't have compact or timestamped records, frames
+   * then come classic, or with no timestamps */
+  priv_dev->compact = panda_set_can_compact(priv_dev);
+  priv_dev->timestamps = priv_dev->compact || panda_set_can_timestamps(priv_dev, true) >= 0;
+  if (rx_flush_fill || rx_flush_deadline_us || rx_flush_sof)
+    panda_set_rx_flush(priv_dev);
+  priv_dev->ts_base = 0;
+  priv_dev->ts_last = 0;
+
+  for (i = 0; i < want; i++) {
+    /* create a URB, and a buffer for it */
+    urb = usb_alloc_urb(0, GFP_KERNEL);
+    if (!urb) {
+      err = -ENOMEM;
+      break;
+    }
 
-  buf = usb_alloc_coherent(priv_dev->udev, PANDA_USB_RX_BUFF_SIZE,
-			   GFP_KERNEL, &urb->transfer_dma);
-  if (!buf) {
-    dev_err(priv_dev->dev, "No memory left for USB buffer\n");
-    usb_free_urb(urb);
-    return -ENOMEM;
-  }
+    buf = usb_alloc_coherent(priv_dev->udev, PANDA_USB_RX_BUFF_SIZE,
+			     GFP_KERNEL, &buf_dma);
+    if (!buf) {
+      dev_err(priv_dev->dev, "No memory left for USB buffer\n");
+      usb_free_urb(urb);
+      err = -ENOMEM;
+      break;
+    }
 
-  usb_fill_int_urb(urb, priv_dev->udev,
-                   usb_rcvintpipe(priv_dev->udev, 1),
-                   buf, PANDA_USB_RX_BUFF_SIZE,
-                   panda_usb_read_int_callback, priv_dev, 5);
-  urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+    usb_fill_bulk_urb(urb, priv_dev->udev,
+                      usb_rcvbulkpipe(priv_dev->udev, 1),
+                      buf, PANDA_USB_RX_BUFF_SIZE,
+                      panda_usb_read_bulk_callback, priv_dev);
+    urb->transfer_dma = buf_dma;
+    urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
 
-  usb_anchor_urb(urb, &priv_dev->rx_submitted);
+    usb_anchor_urb(urb, &priv_dev->rx_submitted);
 
-  err = usb_submit_urb(urb, GFP_KERNEL);
-  if (err) {
-  usb_unanchor_urb(urb);
-    usb_free_coherent(priv_dev->udev, PANDA_USB_RX_BUFF_SIZE,
-		      buf, urb->transfer_dma);
+    err = usb_submit_urb(urb, GFP_KERNEL);
+    if (err) {
+      usb_unanchor_urb(urb);
+      usb_free_coherent(priv_dev->udev, PANDA_USB_RX_BUFF_SIZE,
+			buf, buf_dma);
+      usb_free_urb(urb);
+      break;
+    }
+
+    priv_dev->rxbuf[i] = buf;
+    priv_dev->rxbuf_dma[i] = buf_dma;
+    priv_dev->rxbuf_cnt = i + 1;
+
+    /* Drop reference, USB core will take care of freeing it */
     usb_free_urb(urb);
+  }
+
+  if (i == 0) {
     dev_err(priv_dev->dev, "Failed in start, while submitting urb.\n");
     return err;
   }
 
-  /* Drop reference, USB core will take care of freeing it */
-  usb_free_urb(urb);
-
+  /* fewer URBs still work, the device just has to hold frames longer */
+  if (i < want)
+    dev_warn(priv_dev->dev, "rx performance may be slow, only %d rx URBs\n", i);
 
   return 0;
 }
@@ -406,11 +1352,29 @@ static int panda_usb_open(struct net_device *netdev)
   if (err)
     return err;
 
+  /* the panda may have been reset since the filters were written */
+  mutex_lock(&priv->hw_filter_lock);
+  err = panda_program_hw_filters(priv);
+  mutex_unlock(&priv->hw_filter_lock);
+  if (err < 0)
+    netdev_warn(netdev, "couldn't set hardware filters: %d\n", err);
+
   //priv->can_speed_check = true;
   priv->can.state = CAN_STATE_ERROR_ACTIVE;
 
+  /* completions of the last time up never come now, start from nothing.
+   * Older firmware has no tokens, frames are then done with their URB. */
+  panda_init_ctx(priv);
+  priv->tx_token_resync = false;
+  priv->tx_echo_tokens = panda_set_can_echo(priv, PANDA_CAN_ECHO_TOKEN, &priv->tx_token_next);
+
+  can_rx_offload_enable(&priv->offload);
+  netdev_reset_queue(netdev);
   netif_start_queue(netdev);
 
+  priv->bus_stats_valid = false;
+  schedule_delayed_work(&priv->stats_work, 0);
+
   return 0;
 }
 
@@ -419,12 +1383,20 @@ static int panda_usb_close(struct net_device *netdev)
 {
   struct panda_inf_priv *priv = netdev_priv(netdev);
 
+  /* before the state goes to stopped, the poll would change it back */
+  cancel_delayed_work_sync(&priv->stats_work);
   priv->can.state = CAN_STATE_STOPPED;
 
   netif_stop_queue(netdev);
 
   /* Stop polling */
   panda_urb_unlink(priv);
+  can_rx_offload_disable(&priv->offload);
+
+  /* back to the copies other tools expect */
+  if (priv->tx_echo_tokens)
+    panda_set_can_echo(priv, PANDA_CAN_ECHO_FULL, NULL);
+  priv->tx_echo_tokens = false;
 
   close_candev(netdev);
 
@@ -437,9 +1409,9 @@ static netdev_tx_t panda_usb_start_xmit(struct sk_buff *skb,
   struct panda_inf_priv *priv_inf = netdev_priv(netdev);
   struct can_frame *cf = (struct can_frame *)skb->data;
   struct panda_usb_ctx *ctx = NULL;
-  struct net_device_stats *stats = &priv_inf->netdev->stats;
-  int err;
-  struct panda_usb_can_msg usb_msg = {};
+  struct panda_usb_can_msg *usb_msg;
+  unsigned long flags;
+  int err = 0;
   int bus = priv_inf->mcu_can_ifnum;
 
   if (can_dropped_invalid_skb(netdev, skb)){
@@ -447,39 +1419,59 @@ static netdev_tx_t panda_usb_start_xmit(struct sk_buff *skb,
     return NETDEV_TX_OK;
   }
 
-  ctx = panda_usb_get_free_ctx(priv_inf, cf);
+  spin_lock_irqsave(&priv_inf->tx_lock, flags);
 
-  //Warning: cargo cult. Can't tell what this is for, but it is
-  //everywhere and encouraged in the documentation.
-  can_put_echo_skb(skb, priv_inf->netdev, ctx->ndx);
+  /* completions wake the queue while the next transfer can still be full */
+  if (priv_inf->tx_pending_cnt == PANDA_TX_AGG_MAX) {
+    netif_stop_queue(netdev);
+    spin_unlock_irqrestore(&priv_inf->tx_lock, flags);
+    return NETDEV_TX_BUSY;
+  }
+
+  if (priv_inf->tx_echo_tokens)
+    ctx = panda_usb_get_token_ctx(priv_inf, cf);
+  else
+    ctx = panda_usb_get_free_ctx(priv_inf, cf);
+  if (!ctx) {
+    spin_unlock_irqrestore(&priv_inf->tx_lock, flags);
+    return NETDEV_TX_BUSY;
+  }
+
+  /* looped back to the sockets once the frame is done, with the time the
+   * panda sent it when its completion says */
+  panda_put_echo_skb(skb, priv_inf->netdev, ctx->ndx, ctx->dlc);
+
+  usb_msg = &priv_inf->tx_pending[priv_inf->tx_pending_cnt];
+  memset(usb_msg, 0, sizeof(*usb_msg));
 
   if(cf->can_id & CAN_EFF_FLAG){
-    usb_msg.rir = cpu_to_le32(((cf->can_id & 0x1FFFFFFF) << 3) |
-			      PANDA_CAN_TRANSMIT | PANDA_CAN_EXTENDED);
+    usb_msg->rir = cpu_to_le32(((cf->can_id & 0x1FFFFFFF) << 3) |
+			       PANDA_CAN_TRANSMIT | PANDA_CAN_EXTENDED);
   }else{
-    usb_msg.rir = cpu_to_le32(((cf->can_id & 0x7FF) << 21) | PANDA_CAN_TRANSMIT);
+    usb_msg->rir = cpu_to_le32(((cf->can_id & 0x7FF) << 21) | PANDA_CAN_TRANSMIT);
   }
-  usb_msg.bus_dat_len = cpu_to_le32((cf->can_dlc & 0x0F) | (bus << 4));
+  usb_msg->bus_dat_len = cpu_to_le32((cf->can_dlc & 0x0F) | (bus << 4));
 
-  memcpy(usb_msg.data, cf->data, cf->can_dlc);
+  memcpy(usb_msg->data, cf->data, cf->can_dlc);
 
   //TODO Handle Remote Frames
   //if (cf->can_id & CAN_RTR_FLAG)
   //  usb_msg.dlc |= PANDA_DLC_RTR_MASK;
 
-  netdev_err(netdev, "Received data from socket. canid: %x; len: %d\n", cf->can_id, cf->can_dlc);
-
-  err = panda_usb_xmit(priv_inf, &usb_msg, ctx);
-  if (err)
-    goto xmit_failed;
-
-  return NETDEV_TX_OK;
+  priv_inf->tx_pending_ctx[priv_inf->tx_pending_cnt++] = ctx;
+  netdev_sent_queue(netdev, cf->can_dlc);
+
+  if (!priv_inf->tx_inflight_cnt) {
+    /* bus is idle, send right away */
+    err = panda_usb_submit_pending(priv_inf);
+    if (err)
+      panda_usb_drop_pending(priv_inf);
+  } else if (priv_inf->tx_pending_cnt == PANDA_TX_AGG_MAX) {
+    /* next transfer is full, wait for the one in flight */
+    netif_stop_queue(netdev);
+  }
 
- xmit_failed:
-  can_free_echo_skb(priv_inf->netdev, ctx->ndx);
-  panda_usb_free_ctx(ctx);
-  dev_kfree_skb(skb);
-  stats->tx_dropped++;
+  spin_unlock_irqrestore(&priv_inf->tx_lock, flags);
 
   return NETDEV_TX_OK;
 }
@@ -490,6 +1482,531 @@ static const struct net_device_ops panda_netdev_ops = {
   .ndo_start_xmit = panda_usb_start_xmit,
 };
 
+static struct tty_driver *panda_tty_driver;
+/* guards panda_tty_table, the ttys' priv_dev and each panda's tty_open */
+static DEFINE_MUTEX(panda_tty_lock);
+static struct panda_tty *panda_tty_table[PANDA_TTY_MINORS];
+
+static int panda_tty_request(struct usb_device *udev, u8 request, u16 value, u16 index)
+{
+  return usb_control_msg(udev, usb_sndctrlpipe(udev, 0),
+			 request, USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+			 value, index, NULL, 0, USB_CTRL_SET_TIMEOUT);
+}
+
+static void panda_tty_read_bulk_callback(struct urb *urb)
+{
+  struct panda_dev_priv *priv_dev = urb->context;
+  bool pushed[PANDA_TTY_PORTS] = { false };
+  u8 *buf = urb->transfer_buffer;
+  int pos, i, retval;
+
+  switch (urb->status) {
+  case 0:
+    break;
+  case -ENOENT:
+  case -ECONNRESET:
+  case -ESHUTDOWN:
+    return;
+  default:
+    dev_dbg(priv_dev->dev, "tty rx URB aborted (%d)\n", urb->status);
+    goto resubmit_urb;
+  }
+
+  /* a packet of ISO-TP, or of a ring that isn't a tty, isn't anyone's here */
+  for (pos = 0; pos < urb->actual_length; pos += PANDA_USB_PACKET_SIZE) {
+    int pkt_len = min_t(int, urb->actual_length - pos, PANDA_USB_PACKET_SIZE);
+    int ring = buf[pos];
+    struct panda_tty *t;
+
+    if (pkt_len < 2 || ring < PANDA_TTY_FIRST_RING ||
+        ring >= PANDA_TTY_FIRST_RING + PANDA_TTY_PORTS ||
+        !(priv_dev->tty_open & (1 << ring)))
+      continue;
+    t = priv_dev->ttys[ring - PANDA_TTY_FIRST_RING];
+    if (!t)
+      continue;
+    tty_insert_flip_string(&t->port, buf + pos + 1, pkt_len - 1);
+    pushed[ring - PANDA_TTY_FIRST_RING] = true;
+  }
+
+  for (i = 0; i < PANDA_TTY_PORTS; i++)
+    if (pushed[i])
+      tty_flip_buffer_push(&priv_dev->ttys[i]->port);
+
+ resubmit_urb:
+  usb_anchor_urb(urb, &priv_dev->tty_rx_submitted);
+  retval = usb_submit_urb(urb, GFP_ATOMIC);
+  if (retval) {
+    usb_unanchor_urb(urb);
+    if (retval != -ENODEV)
+      dev_err(priv_dev->dev, "failed resubmitting tty rx urb: %d\n", retval);
+  }
+}
+
+/* Called with panda_tty_lock held, when the first tty opens */
+static int panda_tty_start_rx(struct panda_dev_priv *priv_dev)
+{
+  struct urb *urb;
+  u8 *buf;
+  int err = 0, i;
+
+  for (i = 0; i < PANDA_TTY_RX_URBS; i++) {
+    urb = usb_alloc_urb(0, GFP_KERNEL);
+    if (!urb)
+      return -ENOMEM;
+
+    buf = kmalloc(PANDA_TTY_RX_BUFF_SIZE, GFP_KERNEL);
+    if (!buf) {
+      usb_free_urb(urb);
+      return -ENOMEM;
+    }
+
+    /* the buffer goes with the URB, when it's killed */
+    usb_fill_bulk_urb(urb, priv_dev->udev,
+		      usb_rcvbulkpipe(priv_dev->udev, 2),
+		      buf, PANDA_TTY_RX_BUFF_SIZE,
+		      panda_tty_read_bulk_callback, priv_dev);
+    urb->transfer_flags |= URB_FREE_BUFFER;
+    usb_anchor_urb(urb, &priv_dev->tty_rx_submitted);
+
+    err = usb_submit_urb(urb, GFP_KERNEL);
+    if (err)
+      usb_unanchor_urb(urb);
+    usb_free_urb(urb);
+    if (err)
+      return err;
+  }
+
+  return 0;
+}
+
+/* 0xf4, the open rings stream their rx on EP2 IN */
+static int panda_tty_stream(struct panda_dev_priv *priv_dev)
+{
+  return panda_tty_request(priv_dev->udev, 0xF4, priv_dev->tty_open, 0);
+}
+
+/* The panda's UART to termios. Always 8 data bits and one stop bit, and a
+ * baud over 65535 in steps of 300. Called with panda_tty_lock held. */
+static void panda_tty_set_line(struct panda_tty *t, struct ktermios *termios)
+{
+  struct usb_device *udev = t->priv_dev->udev;
+  unsigned int baud = tty_termios_baud_rate(termios);
+  u16 parity = PANDA_TTY_PARITY_NONE;
+  int err;
+
+  termios->c_cflag &= ~(CSIZE | CSTOPB | CMSPAR);
+  termios->c_cflag |= CS8;
+  if (termios->c_cflag & PARENB)
+    parity = (termios->c_cflag & PARODD) ? PANDA_TTY_PARITY_ODD : PANDA_TTY_PARITY_EVEN;
+
+  /* B0 keeps the line as it was */
+  if (!baud)
+    baud = t->baud;
+  if (baud > 0xFFFF) {
+    baud = min(baud / 300, 0xFFFFU) * 300;
+    err = panda_tty_request(udev, 0xE4, t->ring, baud / 300);
+  } else {
+    err = panda_tty_request(udev, 0xE1, t->ring, baud);
+  }
+  if (err >= 0)
+    err = panda_tty_request(udev, 0xE2, t->ring, parity);
+  if (err < 0)
+    dev_warn(t->priv_dev->dev, "couldn't set ttyPANDA%d's line: %d\n", t->minor, err);
+
+  t->baud = baud;
+  tty_termios_encode_baud_rate(termios, baud, baud);
+}
+
+static int panda_tty_activate(struct tty_port *port, struct tty_struct *tty)
+{
+  struct panda_tty *t = container_of(port, struct panda_tty, port);
+  struct panda_dev_priv *priv_dev;
+  int err;
+
+  mutex_lock(&panda_tty_lock);
+  priv_dev = t->priv_dev;
+  if (!priv_dev) {
+    err = -ENODEV;
+    goto out;
+  }
+
+  /* raw bytes, not the panda's K-line messages, and nothing left from before */
+  err = panda_tty_request(priv_dev->udev, 0xF3, t->ring, 0);
+  if (err >= 0)
+    err = panda_tty_request(priv_dev->udev, 0xF2, t->ring, 0);
+  if (err < 0)
+    goto out;
+  panda_tty_set_line(t, &tty->termios);
+
+  if (!priv_dev->tty_open) {
+    err = panda_tty_start_rx(priv_dev);
+    if (err) {
+      usb_kill_anchored_urbs(&priv_dev->tty_rx_submitted);
+      goto out;
+    }
+  }
+  priv_dev->tty_open |= 1 << t->ring;
+  err = panda_tty_stream(priv_dev);
+  if (err < 0) {
+    priv_dev->tty_open &= ~(1 << t->ring);
+    if (!priv_dev->tty_open)
+      usb_kill_anchored_urbs(&priv_dev->tty_rx_submitted);
+    goto out;
+  }
+  err = 0;
+
+ out:
+  mutex_unlock(&panda_tty_lock);
+  return err;
+}
+
+static void panda_tty_shutdown(struct tty_port *port)
+{
+  struct panda_tty *t = container_of(port, struct panda_tty, port);
+  struct panda_dev_priv *priv_dev;
+
+  mutex_lock(&panda_tty_lock);
+  priv_dev = t->priv_dev;
+  if (priv_dev) {
+    priv_dev->tty_open &= ~(1 << t->ring);
+    panda_tty_stream(priv_dev);
+    if (!priv_dev->tty_open)
+      usb_kill_anchored_urbs(&priv_dev->tty_rx_submitted);
+    usb_kill_anchored_urbs(&t->tx_submitted);
+  }
+  mutex_unlock(&panda_tty_lock);
+}
+
+static void panda_tty_destruct(struct tty_port *port)
+{
+  kfree(container_of(port, struct panda_tty, port));
+}
+
+static const struct tty_port_operations panda_tty_port_ops = {
+  .activate = panda_tty_activate,
+  .shutdown = panda_tty_shutdown,
+  .destruct = panda_tty_destruct,
+};
+
+static int panda_tty_install(struct tty_driver *driver, struct tty_struct *tty)
+{
+  struct panda_tty *t;
+  int err;
+
+  mutex_lock(&panda_tty_lock);
+  t = panda_tty_table[tty->index];
+  if (t)
+    tty_port_get(&t->port);
+  mutex_unlock(&panda_tty_lock);
+  if (!t)
+    return -ENODEV;
+
+  err = tty_port_install(&t->port, driver, tty);
+  if (err) {
+    tty_port_put(&t->port);
+    return err;
+  }
+  tty->driver_data = t;
+  return 0;
+}
+
+static void panda_tty_cleanup(struct tty_struct *tty)
+{
+  struct panda_tty *t = tty->driver_data;
+
+  tty->driver_data = NULL;
+  tty_port_put(&t->port);
+}
+
+static int panda_tty_open(struct tty_struct *tty, struct file *filp)
+{
+  struct panda_tty *t = tty->driver_data;
+
+  return tty_port_open(&t->port, tty, filp);
+}
+
+static void panda_tty_close(struct tty_struct *tty, struct file *filp)
+{
+  struct panda_tty *t = tty->driver_data;
+
+  tty_port_close(&t->port, tty, filp);
+}
+
+static void panda_tty_hangup(struct tty_struct *tty)
+{
+  struct panda_tty *t = tty->driver_data;
+
+  tty_port_hangup(&t->port);
+}
+
+static void panda_tty_write_bulk_callback(struct urb *urb)
+{
+  struct panda_tty *t = urb->context;
+  unsigned long flags;
+
+  if (urb->status)
+    dev_dbg(&urb->dev->dev, "tty tx URB aborted (%d)\n", urb->status);
+
+  spin_lock_irqsave(&t->tx_lock, flags);
+  t->tx_urbs--;
+  t->tx_bytes -= urb->transfer_buffer_length - 1;
+  spin_unlock_irqrestore(&t->tx_lock, flags);
+
+  tty_port_tty_wakeup(&t->port);
+}
+
+/* A packet to a URB, as many as are free. The panda NAKs EP2 OUT while the
+ * ring's full, so a packet waits there and not in the driver. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+static ssize_t panda_tty_write(struct tty_struct *tty, const u8 *data, size_t count)
+#else
+static int panda_tty_write(struct tty_struct *tty, const unsigned char *data, int count)
+#endif
+{
+  struct panda_tty *t = tty->driver_data;
+  unsigned long flags;
+  int sent = 0, err = 0;
+
+  spin_lock_irqsave(&t->tx_lock, flags);
+  while (sent < count && t->tx_urbs < PANDA_TTY_TX_URBS) {
+    int len = min_t(int, count - sent, PANDA_TTY_CHUNK);
+    struct urb *urb;
+    u8 *buf;
+
+    if (!t->udev) {
+      err = -ENODEV;
+      break;
+    }
+
+    urb = usb_alloc_urb(0, GFP_ATOMIC);
+    if (!urb) {
+      err = -ENOMEM;
+      break;
+    }
+    buf = kmalloc(len + 1, GFP_ATOMIC);
+    if (!buf) {
+      usb_free_urb(urb);
+      err = -ENOMEM;
+      break;
+    }
+    buf[0] = t->ring;
+    memcpy(buf + 1, data + sent, len);
+
+    usb_fill_bulk_urb(urb, t->udev, usb_sndbulkpipe(t->udev, 2),
+		      buf, len + 1, panda_tty_write_bulk_callback, t);
+    urb->transfer_flags |= URB_FREE_BUFFER;
+    usb_anchor_urb(urb, &t->tx_submitted);
+
+    err = usb_submit_urb(urb, GFP_ATOMIC);
+    if (err)
+      usb_unanchor_urb(urb);
+    usb_free_urb(urb);
+    if (err)
+      break;
+
+    t->tx_urbs++;
+    t->tx_bytes += len;
+    sent += len;
+  }
+  spin_unlock_irqrestore(&t->tx_lock, flags);
+
+  return sent ? sent : err;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 14, 0)
+static unsigned int panda_tty_write_room(struct tty_struct *tty)
+#else
+static int panda_tty_write_room(struct tty_struct *tty)
+#endif
+{
+  struct panda_tty *t = tty->driver_data;
+  unsigned long flags;
+  int room;
+
+  spin_lock_irqsave(&t->tx_lock, flags);
+  room = t->udev ? (PANDA_TTY_TX_URBS - t->tx_urbs) * PANDA_TTY_CHUNK : 0;
+  spin_unlock_irqrestore(&t->tx_lock, flags);
+
+  return room;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 14, 0)
+static unsigned int panda_tty_chars_in_buffer(struct tty_struct *tty)
+#else
+static int panda_tty_chars_in_buffer(struct tty_struct *tty)
+#endif
+{
+  struct panda_tty *t = tty->driver_data;
+  unsigned long flags;
+  int bytes;
+
+  spin_lock_irqsave(&t->tx_lock, flags);
+  bytes = t->tx_bytes;
+  spin_unlock_irqrestore(&t->tx_lock, flags);
+
+  return bytes;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0)
+static void panda_tty_set_termios(struct tty_struct *tty, const struct ktermios *old)
+#else
+static void panda_tty_set_termios(struct tty_struct *tty, struct ktermios *old)
+#endif
+{
+  struct panda_tty *t = tty->driver_data;
+
+  mutex_lock(&panda_tty_lock);
+  if (t->priv_dev)
+    panda_tty_set_line(t, &tty->termios);
+  mutex_unlock(&panda_tty_lock);
+}
+
+static const struct tty_operations panda_tty_ops = {
+  .install = panda_tty_install,
+  .cleanup = panda_tty_cleanup,
+  .open = panda_tty_open,
+  .close = panda_tty_close,
+  .hangup = panda_tty_hangup,
+  .write = panda_tty_write,
+  .write_room = panda_tty_write_room,
+  .chars_in_buffer = panda_tty_chars_in_buffer,
+  .set_termios = panda_tty_set_termios,
+};
+
+/* The panda's ttys, a pair of minors per panda. A panda still works without
+ * them. */
+static void panda_tty_probe(struct panda_dev_priv *priv_dev, struct usb_interface *intf)
+{
+  struct device *dev;
+  struct panda_tty *t;
+  int base, i;
+
+  if (!panda_tty_driver)
+    return;
+
+  mutex_lock(&panda_tty_lock);
+  for (base = 0; base < PANDA_TTY_MINORS; base += PANDA_TTY_PORTS)
+    if (!panda_tty_table[base] && !panda_tty_table[base + 1])
+      break;
+  if (base == PANDA_TTY_MINORS) {
+    mutex_unlock(&panda_tty_lock);
+    dev_warn(&intf->dev, "no ttyPANDA minors left\n");
+    return;
+  }
+
+  for (i = 0; i < PANDA_TTY_PORTS; i++) {
+    t = kzalloc(sizeof(*t), GFP_KERNEL);
+    if (!t)
+      break;
+    tty_port_init(&t->port);
+    t->port.ops = &panda_tty_port_ops;
+    t->priv_dev = priv_dev;
+    t->udev = priv_dev->udev;
+    t->ring = PANDA_TTY_FIRST_RING + i;
+    t->minor = base + i;
+    t->baud = PANDA_TTY_BAUD;
+    spin_lock_init(&t->tx_lock);
+    init_usb_anchor(&t->tx_submitted);
+
+    dev = tty_port_register_device(&t->port, panda_tty_driver, t->minor, &intf->dev);
+    if (IS_ERR(dev)) {
+      dev_warn(&intf->dev, "couldn't register ttyPANDA%d: %ld\n", t->minor, PTR_ERR(dev));
+      tty_port_put(&t->port);
+      break;
+    }
+    panda_tty_table[t->minor] = t;
+    priv_dev->ttys[i] = t;
+  }
+  mutex_unlock(&panda_tty_lock);
+}
+
+/* Open ttys are hung up, and keep their panda_tty until they're closed */
+static void panda_tty_disconnect(struct panda_dev_priv *priv_dev)
+{
+  struct panda_tty *t;
+  unsigned long flags;
+  int i;
+
+  mutex_lock(&panda_tty_lock);
+  for (i = 0; i < PANDA_TTY_PORTS; i++) {
+    t = priv_dev->ttys[i];
+    if (!t)
+      continue;
+    panda_tty_table[t->minor] = NULL;
+    t->priv_dev = NULL;
+    spin_lock_irqsave(&t->tx_lock, flags);
+    t->udev = NULL;
+    spin_unlock_irqrestore(&t->tx_lock, flags);
+  }
+  priv_dev->tty_open = 0;
+  usb_kill_anchored_urbs(&priv_dev->tty_rx_submitted);
+  mutex_unlock(&panda_tty_lock);
+
+  for (i = 0; i < PANDA_TTY_PORTS; i++) {
+    t = priv_dev->ttys[i];
+    if (!t)
+      continue;
+    usb_kill_anchored_urbs(&t->tx_submitted);
+    tty_port_tty_hangup(&t->port, false);
+    tty_unregister_device(panda_tty_driver, t->minor);
+    tty_port_put(&t->port);
+    priv_dev->ttys[i] = NULL;
+  }
+}
+
+static int __init panda_tty_register(void)
+{
+  struct tty_driver *driver;
+  int err;
+
+  driver = tty_alloc_driver(PANDA_TTY_MINORS, TTY_DRIVER_REAL_RAW | TTY_DRIVER_DYNAMIC_DEV);
+  if (IS_ERR(driver))
+    return PTR_ERR(driver);
+
+  driver->driver_name = PANDA_MODULE_NAME;
+  driver->name = "ttyPANDA";
+  driver->major = 0;
+  driver->minor_start = 0;
+  driver->type = TTY_DRIVER_TYPE_SERIAL;
+  driver->subtype = SERIAL_TYPE_NORMAL;
+  /* raw, at the K-line's usual 10400 baud */
+  driver->init_termios = tty_std_termios;
+  driver->init_termios.c_iflag = 0;
+  driver->init_termios.c_oflag = 0;
+  driver->init_termios.c_lflag = 0;
+  driver->init_termios.c_cflag = CS8 | CREAD | HUPCL | CLOCAL;
+  tty_termios_encode_baud_rate(&driver->init_termios, PANDA_TTY_BAUD, PANDA_TTY_BAUD);
+  tty_set_operations(driver, &panda_tty_ops);
+
+  err = tty_register_driver(driver);
+  if (err) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+    tty_driver_kref_put(driver);
+#else
+    put_tty_driver(driver);
+#endif
+    return err;
+  }
+
+  panda_tty_driver = driver;
+  return 0;
+}
+
+static void panda_tty_unregister(void)
+{
+  if (!panda_tty_driver)
+    return;
+  tty_unregister_driver(panda_tty_driver);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+  tty_driver_kref_put(panda_tty_driver);
+#else
+  put_tty_driver(panda_tty_driver);
+#endif
+  panda_tty_driver = NULL;
+}
+
 static int panda_usb_probe(struct usb_interface *intf,
 			   const struct usb_device_id *id)
 {
@@ -511,13 +2028,15 @@ static int panda_usb_probe(struct usb_interface *intf,
 
   ////// Interface privs
   for(inf_num = 0; inf_num < PANDA_NUM_CAN_INTERFACES; inf_num++){
-    netdev = alloc_candev(sizeof(struct panda_inf_priv), PANDA_MAX_TX_URBS);
+    netdev = alloc_candev(sizeof(struct panda_inf_priv), PANDA_MAX_TX_FRAMES);
     if (!netdev) {
       dev_err(&intf->dev, "Couldn't alloc candev\n");
       goto cleanup_candev;
     }
     netdev->netdev_ops = &panda_netdev_ops;
+    netdev->ethtool_ops = &panda_ethtool_ops;
     netdev->flags |= IFF_ECHO; /* we support local echo */
+    netdev->sysfs_groups[0] = &panda_netdev_attr_group;
 
     priv_inf = netdev_priv(netdev);
     priv_inf->netdev = netdev;
@@ -526,17 +2045,31 @@ static int panda_usb_probe(struct usb_interface *intf,
     priv_inf->mcu_can_ifnum = can_numbering[inf_num];
 
     init_usb_anchor(&priv_dev->rx_submitted);
+    init_usb_anchor(&priv_dev->tty_rx_submitted);
     init_usb_anchor(&priv_inf->tx_submitted);
+    spin_lock_init(&priv_inf->tx_lock);
+    mutex_init(&priv_inf->hw_filter_lock);
+    INIT_DELAYED_WORK(&priv_inf->stats_work, panda_stats_work);
 
     /* Init CAN device */
     priv_inf->can.state = CAN_STATE_STOPPED;
     priv_inf->can.bittiming.bitrate = PANDA_BITRATE;
+    priv_inf->can.do_get_berr_counter = panda_get_berr_counter;
+    priv_inf->can.ctrlmode_supported = CAN_CTRLMODE_BERR_REPORTING;
 
     SET_NETDEV_DEV(netdev, &intf->dev);
 
+    err = can_rx_offload_add_manual(netdev, &priv_inf->offload, PANDA_NAPI_WEIGHT);
+    if (err) {
+      netdev_err(netdev, "couldn't add rx-offload: %d\n", err);
+      free_candev(priv_inf->netdev);
+      goto cleanup_candev;
+    }
+
     err = register_candev(netdev);
     if (err) {
       netdev_err(netdev, "couldn't register PANDA CAN device: %d\n", err);
+      can_rx_offload_del(&priv_inf->offload);
       free_candev(priv_inf->netdev);
       goto cleanup_candev;
     }
@@ -556,6 +2089,8 @@ static int panda_usb_probe(struct usb_interface *intf,
     goto cleanup_candev;
   }
 
+  panda_tty_probe(priv_dev, intf);
+
   dev_info(&intf->dev, "Comma.ai Panda CAN controller connected\n");
 
   return 0;
@@ -565,6 +2100,7 @@ static int panda_usb_probe(struct usb_interface *intf,
     priv_inf = priv_dev->interfaces[inf_num];
     if(priv_inf){
       unregister_candev(priv_inf->netdev);
+      can_rx_offload_del(&priv_inf->offload);
       free_candev(priv_inf->netdev);
     }else
       break;
@@ -584,11 +2120,14 @@ static void panda_usb_disconnect(struct usb_interface *intf)
 
   usb_set_intfdata(intf, NULL);
 
+  panda_tty_disconnect(priv_dev);
+
   for(inf_num = 0; inf_num < PANDA_NUM_CAN_INTERFACES; inf_num++){
     priv_inf = priv_dev->interfaces[inf_num];
     if(priv_inf){
       netdev_info(priv_inf->netdev, "device disconnected\n");
       unregister_candev(priv_inf->netdev);
+      can_rx_offload_del(&priv_inf->offload);
       free_candev(priv_inf->netdev);
     }else
       break;
@@ -605,7 +2144,30 @@ static struct usb_driver panda_usb_driver = {
   .id_table = panda_usb_table,
 };
 
-module_usb_driver(panda_usb_driver);
+static int __init panda_init(void)
+{
+  int err;
+
+  if (kline_tty) {
+    err = panda_tty_register();
+    if (err)
+      pr_warn(PANDA_MODULE_NAME ": couldn't register the ttys: %d\n", err);
+  }
+
+  err = usb_register(&panda_usb_driver);
+  if (err)
+    panda_tty_unregister();
+  return err;
+}
+
+static void __exit panda_exit(void)
+{
+  usb_deregister(&panda_usb_driver);
+  panda_tty_unregister();
+}
+
+module_init(panda_init);
+module_exit(panda_exit);
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Jessy Diamond Exum <jessy.diamondman@gmail.com>");
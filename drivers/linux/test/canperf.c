@@ -0,0 +1,401 @@
+// Throughput, drop and latency test for the panda's SocketCAN interfaces.
+//
+//   ./canperf [-i ifname] [-o ifname] [-r fps] [-t s] [-l dlc] [-a id] [-p]
+//
+// Frames are written to -i, can0 by default, for -t seconds, at -r a second
+// or as fast as the socket takes them at 0. Each has its number in its first
+// 4 data bytes. They're received on -o:
+//   the same interface   the echoes the driver loops back once the panda has
+//                        sent them, so the panda and its USB both ways
+//   another              what that interface's bus got, a second panda or
+//                        two buses of one wired together
+// The latency is from the write to the kernel's receive timestamp
+// (SO_TIMESTAMPING). With -p the interfaces are on the same panda, and the
+// time from the echo's hardware timestamp to the received frame's, both from
+// its clock, is the frame's time on the bus.
+//
+// The ethtool counters of both interfaces are read before and after, for the
+// frames per URB and what the panda dropped. The panda updates its own
+// every 500 ms, so there's a second after the frames stop before they're
+// read. Returns 1 if a frame was lost.
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include <linux/errqueue.h>
+#include <linux/ethtool.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
+#include <netinet/in.h>
+
+#define SEQ_WINDOW 0x10000
+#define LATENCY_MAX (1 << 22)
+#define DRAIN_MS 1000
+#define STAT_MAX 64
+
+const char *tx_ifname = "can0";
+const char *rx_ifname = NULL;
+int fps = 0;
+int duration_s = 10;
+int dlc = 8;
+uint32_t can_id = 0x123;
+int same_panda = 0;
+
+int tx_sock = -1, rx_sock = -1, ethtool_sock = -1;
+volatile int writing = 1;
+
+// by the frame's number, when it was written and when the panda sent it
+uint64_t written_ns[SEQ_WINDOW];
+uint64_t sent_hw_ns[SEQ_WINDOW];
+uint32_t seq_written = 0;
+long write_retries = 0;
+uint64_t write_start_ns, write_end_ns;
+
+uint32_t *latencies, *bus_latencies;
+long nlatencies = 0, nbus_latencies = 0;
+
+long received = 0, echoes = 0, out_of_order = 0, unstamped = 0;
+uint32_t seq_next = 0;
+uint64_t first_rx_ns = 0, last_rx_ns = 0;
+
+uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int open_can(const char *ifname, int own) {
+  struct ifreq ifr;
+  struct sockaddr_can addr;
+  int s = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+  if (s < 0) {
+    perror("socket");
+    return -1;
+  }
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+  if (ioctl(s, SIOCGIFINDEX, &ifr) < 0) {
+    perror(ifname);
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.can_family = AF_CAN;
+  addr.can_ifindex = ifr.ifr_ifindex;
+  if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("bind");
+    return -1;
+  }
+
+  // only the test's frames
+  struct can_filter f = {.can_id = can_id, .can_mask = CAN_SFF_MASK | CAN_EFF_FLAG | CAN_RTR_FLAG};
+  setsockopt(s, SOL_CAN_RAW, CAN_RAW_FILTER, &f, sizeof(f));
+  setsockopt(s, SOL_CAN_RAW, CAN_RAW_RECV_OWN_MSGS, &own, sizeof(own));
+  int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+              SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+  if (setsockopt(s, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0) perror("SO_TIMESTAMPING");
+  int rcvbuf = 4 << 20;
+  setsockopt(s, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  return s;
+}
+
+// ***************************** ethtool *****************************
+
+typedef struct {
+  int n;
+  char names[STAT_MAX][ETH_GSTRING_LEN];
+  uint64_t values[STAT_MAX];
+} if_stats;
+
+int read_stats(const char *ifname, if_stats *st) {
+  struct ifreq ifr;
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+
+  struct {
+    struct ethtool_sset_info hdr;
+    uint32_t len;
+  } sset = {.hdr = {.cmd = ETHTOOL_GSSET_INFO, .sset_mask = 1ULL << ETH_SS_STATS}};
+  ifr.ifr_data = (void *)&sset;
+  if (ioctl(ethtool_sock, SIOCETHTOOL, &ifr) < 0 || sset.hdr.sset_mask == 0) return 0;
+  st->n = sset.len < STAT_MAX ? sset.len : STAT_MAX;
+
+  struct ethtool_gstrings *strs = calloc(1, sizeof(*strs) + sset.len * ETH_GSTRING_LEN);
+  strs->cmd = ETHTOOL_GSTRINGS;
+  strs->string_set = ETH_SS_STATS;
+  strs->len = sset.len;
+  ifr.ifr_data = (void *)strs;
+  int ok = ioctl(ethtool_sock, SIOCETHTOOL, &ifr) >= 0;
+  for (int i = 0; ok && i < st->n; i++) {
+    memcpy(st->names[i], strs->data + i * ETH_GSTRING_LEN, ETH_GSTRING_LEN);
+    st->names[i][ETH_GSTRING_LEN - 1] = '\0';
+  }
+  free(strs);
+
+  struct ethtool_stats *vals = calloc(1, sizeof(*vals) + sset.len * sizeof(uint64_t));
+  vals->cmd = ETHTOOL_GSTATS;
+  vals->n_stats = sset.len;
+  ifr.ifr_data = (void *)vals;
+  ok = ok && ioctl(ethtool_sock, SIOCETHTOOL, &ifr) >= 0;
+  for (int i = 0; ok && i < st->n; i++) st->values[i] = vals->data[i];
+  free(vals);
+  return ok;
+}
+
+// the counter's rise, the panda's own are 32 bits and wrap
+uint64_t stat_delta(const if_stats *before, const if_stats *after, const char *name) {
+  for (int i = 0; i < after->n && i < before->n; i++) {
+    if (strcmp(after->names[i], name) != 0) continue;
+    uint64_t d = after->values[i] - before->values[i];
+    return (strncmp(name, "dev_", 4) == 0) ? (uint32_t)d : d;
+  }
+  return 0;
+}
+
+uint64_t stat_value(const if_stats *st, const char *name) {
+  for (int i = 0; i < st->n; i++) {
+    if (strcmp(st->names[i], name) == 0) return st->values[i];
+  }
+  return 0;
+}
+
+void print_stats(const char *ifname, const if_stats *before, const if_stats *after) {
+  if (after->n == 0) {
+    printf("%s: no ethtool stats, a driver without them\n", ifname);
+    return;
+  }
+  uint64_t rx_urbs = stat_delta(before, after, "rx_urbs"), rx_frames = stat_delta(before, after, "rx_frames");
+  uint64_t tx_urbs = stat_delta(before, after, "tx_urbs"), tx_frames = stat_delta(before, after, "tx_frames");
+  printf("%s: rx %llu frames in %llu URBs (%.1f a URB), tx %llu frames in %llu URBs (%.1f a URB)\n", ifname,
+         (unsigned long long)rx_frames, (unsigned long long)rx_urbs, rx_urbs ? (double)rx_frames / rx_urbs : 0.0,
+         (unsigned long long)tx_frames, (unsigned long long)tx_urbs, tx_urbs ? (double)tx_frames / tx_urbs : 0.0);
+  printf("%s: panda rx dropped %llu, tx dropped %llu, errors %llu, rx queue hwm %llu, tx queue hwm %llu, load %.1f%%\n", ifname,
+         (unsigned long long)stat_delta(before, after, "dev_rx_dropped"),
+         (unsigned long long)stat_delta(before, after, "dev_tx_dropped"),
+         (unsigned long long)stat_delta(before, after, "dev_errors"),
+         (unsigned long long)stat_value(after, "dev_rx_queue_hwm"),
+         (unsigned long long)stat_value(after, "dev_tx_queue_hwm"),
+         stat_value(after, "bus_load_permille") / 10.0);
+}
+
+// ***************************** frames *****************************
+
+void *write_thread(void *arg) {
+  (void)arg;
+  struct can_frame frame;
+  memset(&frame, 0, sizeof(frame));
+  frame.can_id = can_id;
+  frame.can_dlc = dlc;
+
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  write_start_ns = now_ns();
+  uint64_t end_ns = write_start_ns + (uint64_t)duration_s * 1000000000ULL;
+  uint64_t period_ns = fps ? 1000000000ULL / fps : 0;
+  struct pollfd pfd = {.fd = tx_sock, .events = POLLOUT};
+
+  while (now_ns() < end_ns) {
+    if (period_ns) {
+      next.tv_nsec += period_ns;
+      while (next.tv_nsec >= 1000000000L) {
+        next.tv_nsec -= 1000000000L;
+        next.tv_sec += 1;
+      }
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+    memcpy(frame.data, &seq_written, 4);
+    written_ns[seq_written % SEQ_WINDOW] = now_ns();
+    sent_hw_ns[seq_written % SEQ_WINDOW] = 0;
+    // a full device queue is ENOBUFS, wait for room
+    while (write(tx_sock, &frame, sizeof(frame)) != sizeof(frame)) {
+      if (errno != ENOBUFS && errno != EAGAIN) {
+        perror("write");
+        writing = 0;
+        return NULL;
+      }
+      write_retries += 1;
+      poll(&pfd, 1, 10);
+    }
+    seq_written += 1;
+  }
+  write_end_ns = now_ns();
+  writing = 0;
+  return NULL;
+}
+
+// a frame and its timestamps, 0 for the ones it doesn't have
+int read_frame(int s, struct can_frame *frame, uint64_t *sw_ns, uint64_t *hw_ns, int *own) {
+  char ctrl[CMSG_SPACE(sizeof(struct scm_timestamping))];
+  struct iovec iov = {.iov_base = frame, .iov_len = sizeof(*frame)};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctrl, .msg_controllen = sizeof(ctrl)};
+  if (recvmsg(s, &msg, MSG_DONTWAIT) != sizeof(*frame)) return 0;
+
+  *sw_ns = 0;
+  *hw_ns = 0;
+  // sent by this socket
+  *own = (msg.msg_flags & MSG_CONFIRM) != 0;
+  for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+    if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_TIMESTAMPING) continue;
+    struct scm_timestamping *ts = (struct scm_timestamping *)CMSG_DATA(c);
+    *sw_ns = (uint64_t)ts->ts[0].tv_sec * 1000000000ULL + ts->ts[0].tv_nsec;
+    *hw_ns = (uint64_t)ts->ts[2].tv_sec * 1000000000ULL + ts->ts[2].tv_nsec;
+  }
+  return 1;
+}
+
+void got_frame(const struct can_frame *frame, uint64_t sw_ns, uint64_t hw_ns) {
+  uint32_t seq;
+  memcpy(&seq, frame->data, 4);
+  if (seq < seq_next) out_of_order += 1;
+  seq_next = seq + 1;
+  received += 1;
+
+  uint64_t t = sw_ns;
+  if (t == 0) {
+    unstamped += 1;
+    t = now_ns();
+  }
+  if (first_rx_ns == 0) first_rx_ns = t;
+  last_rx_ns = t;
+  // older than the window's been written over
+  if (seq_written - seq > SEQ_WINDOW) return;
+  if (nlatencies < LATENCY_MAX && t >= written_ns[seq % SEQ_WINDOW]) {
+    latencies[nlatencies++] = (uint32_t)(t - written_ns[seq % SEQ_WINDOW]);
+  }
+  uint64_t sent = sent_hw_ns[seq % SEQ_WINDOW];
+  if (same_panda && hw_ns != 0 && sent != 0 && nbus_latencies < LATENCY_MAX && hw_ns >= sent) {
+    bus_latencies[nbus_latencies++] = (uint32_t)(hw_ns - sent);
+  }
+}
+
+void read_frames(void) {
+  struct pollfd pfds[2] = {{.fd = rx_sock, .events = POLLIN}, {.fd = tx_sock, .events = POLLIN}};
+  int nfds = (rx_sock == tx_sock) ? 1 : 2;
+  uint64_t drain_until = 0;
+  while (1) {
+    if (!writing && drain_until == 0) drain_until = now_ns() + DRAIN_MS * 1000000ULL;
+    if (drain_until != 0 && now_ns() >= drain_until) break;
+    if (poll(pfds, nfds, 50) <= 0) continue;
+
+    struct can_frame frame;
+    uint64_t sw_ns, hw_ns;
+    int own;
+    if (nfds == 2) {
+      // the echoes on the tx interface, for when the panda sent them
+      while (read_frame(tx_sock, &frame, &sw_ns, &hw_ns, &own)) {
+        if (!own) continue;
+        uint32_t seq;
+        memcpy(&seq, frame.data, 4);
+        sent_hw_ns[seq % SEQ_WINDOW] = hw_ns;
+        echoes += 1;
+      }
+    }
+    while (read_frame(rx_sock, &frame, &sw_ns, &hw_ns, &own)) {
+      // on the same interface only the echoes are the test's
+      if (rx_sock == tx_sock && !own) continue;
+      if (rx_sock != tx_sock && own) continue;
+      got_frame(&frame, sw_ns, hw_ns);
+    }
+  }
+}
+
+int cmp_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+void print_latency(const char *what, uint32_t *v, long n) {
+  if (n == 0) {
+    printf("%s: none\n", what);
+    return;
+  }
+  qsort(v, n, sizeof(v[0]), cmp_u32);
+  double sum = 0;
+  for (long i = 0; i < n; i++) sum += v[i];
+  printf("%s: %.1f us avg, p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f us\n", what, sum / n / 1000.0,
+         v[n / 2] / 1000.0, v[(n * 9) / 10] / 1000.0, v[(n * 99) / 100] / 1000.0, v[(n * 999) / 1000] / 1000.0,
+         v[n - 1] / 1000.0);
+}
+
+int main(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "i:o:r:t:l:a:p")) != -1) {
+    switch (opt) {
+      case 'i': tx_ifname = optarg; break;
+      case 'o': rx_ifname = optarg; break;
+      case 'r': fps = atoi(optarg); break;
+      case 't': duration_s = atoi(optarg); break;
+      case 'l': dlc = atoi(optarg); break;
+      case 'a': can_id = strtoul(optarg, NULL, 0); break;
+      case 'p': same_panda = 1; break;
+      default:
+        fprintf(stderr, "usage: %s [-i ifname] [-o ifname] [-r fps] [-t s] [-l dlc] [-a id] [-p]\n", argv[0]);
+        return 2;
+    }
+  }
+  if (rx_ifname == NULL) rx_ifname = tx_ifname;
+  int loopback = strcmp(tx_ifname, rx_ifname) == 0;
+  if (fps < 0 || duration_s <= 0 || dlc < 4 || dlc > 8 || (same_panda && loopback)) {
+    fprintf(stderr, "bad arguments\n");
+    return 2;
+  }
+  if (can_id > CAN_SFF_MASK) can_id = (can_id & CAN_EFF_MASK) | CAN_EFF_FLAG;
+
+  latencies = malloc(LATENCY_MAX * sizeof(uint32_t));
+  bus_latencies = malloc(LATENCY_MAX * sizeof(uint32_t));
+  // the tx socket gets its echoes when they're measured, or -p needs them
+  tx_sock = open_can(tx_ifname, loopback || same_panda);
+  rx_sock = loopback ? tx_sock : open_can(rx_ifname, 0);
+  // ethtool's ioctls go through any socket, CAN ones don't all pass them on
+  ethtool_sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (tx_sock < 0 || rx_sock < 0) return 1;
+
+  if_stats tx_before = {0}, tx_after = {0}, rx_before = {0}, rx_after = {0};
+  read_stats(tx_ifname, &tx_before);
+  if (!loopback) read_stats(rx_ifname, &rx_before);
+
+  if (fps) {
+    printf("%s to %s%s, %d s at %d fps, dlc %d\n", tx_ifname, rx_ifname, loopback ? " echoes" : "", duration_s, fps, dlc);
+  } else {
+    printf("%s to %s%s, %d s as fast as it goes, dlc %d\n", tx_ifname, rx_ifname, loopback ? " echoes" : "", duration_s, dlc);
+  }
+  pthread_t writer;
+  if (pthread_create(&writer, NULL, write_thread, NULL) != 0) {
+    perror("pthread_create");
+    return 1;
+  }
+  read_frames();
+  pthread_join(writer, NULL);
+
+  read_stats(tx_ifname, &tx_after);
+  if (!loopback) read_stats(rx_ifname, &rx_after);
+
+  double write_s = (write_end_ns - write_start_ns) / 1e9;
+  double rx_s = (last_rx_ns - first_rx_ns) / 1e9;
+  long lost = (long)seq_written - received;
+  printf("tx: %u frames, %.0f frames/s, %ld writes waited for room\n", seq_written, write_s > 0 ? seq_written / write_s : 0.0,
+         write_retries);
+  printf("rx: %ld frames, %.0f frames/s, lost %ld, out of order %ld, without a timestamp %ld\n", received,
+         rx_s > 0 ? received / rx_s : 0.0, lost, out_of_order, unstamped);
+  print_latency(loopback ? "write to echo" : "write to receive", latencies, nlatencies);
+  if (same_panda) {
+    printf("echoes: %ld\n", echoes);
+    print_latency("on the bus, panda clock", bus_latencies, nbus_latencies);
+  }
+  print_stats(tx_ifname, &tx_before, &tx_after);
+  if (!loopback) print_stats(rx_ifname, &rx_before, &rx_after);
+  return lost != 0;
+}
@@ -1,180 +1,337 @@
 #include "stdafx.h"
 #include "ECUsim.h"
 
+ECUsimECU::ECUsimECU(uint32_t request_id, uint32_t response_id, bool addr_29b) :
+	request_id(request_id), request_mask(addr_29b ? 0x1FFFFFFF : 0x7FF), functional_id(0), functional_mask(0),
+	response_id(response_id), addr_29b(addr_29b), ext_addr(FALSE), ext_addr_rx(0), ext_addr_tx(0),
+	fc_block_size(0), fc_st_min(0), response_delay_us(0), cf_gap_us(0) { }
+
+void ECUsimECU::add_response(const std::string& request, const std::string& response) {
+	this->responses[request] = response;
+}
+
+ECUsim::EcuState::EcuState(const ECUsimECU& cfg) : cfg(cfg), tx(NULL), tx_next(0), tx_block_left(0),
+	tx_wait_fc(FALSE), tx_gap_us(cfg.cf_gap_us), tx_gen(0), rx_len(0), rx_sn(0), rx_block_left(0) {
+	for (auto& resp : cfg.responses)
+		this->frames[resp.first] = build_frames(cfg, resp.second);
+}
+
 ECUsim::ECUsim(std::string sn, unsigned long can_baud, bool ext_addr) :
-	doloop(TRUE), verbose(TRUE), can11b_enabled(TRUE), can29b_enabled(TRUE), ext_addr(ext_addr){
+	doloop(TRUE), verbose(TRUE), ext_addr(ext_addr), traffic_dropped(0) {
 	this->panda = panda::Panda::openPanda(sn);
-	this->panda->set_can_speed_cbps(panda::PANDA_CAN1, can_baud / 100); //Don't pass in baud where baud%100 != 0
-	this->panda->set_safety_mode(panda::SAFETY_ALLOUTPUT);
-	this->panda->set_can_loopback(FALSE);
-	this->panda->can_clear(panda::PANDA_CAN_RX);
+	this->ecus.reserve(2);
+	this->ecus.emplace_back(obd_ecu(FALSE, ext_addr));
+	this->ecus.emplace_back(obd_ecu(TRUE, ext_addr));
+	this->start(can_baud);
+}
 
-	DWORD threadid;
-	this->thread_can = CreateThread(NULL, 0, _canthreadBootstrap, (LPVOID)this, 0, &threadid);
+ECUsim::ECUsim(std::string sn, unsigned long can_baud, const std::vector<ECUsimECU>& ecus,
+	const std::vector<ECUsimTraffic>& traffic) :
+	doloop(TRUE), verbose(FALSE), ext_addr(FALSE), traffic_dropped(0) {
+	this->panda = panda::Panda::openPanda(sn);
+	this->ecus.reserve(ecus.size());
+	for (auto& ecu : ecus)
+		this->ecus.emplace_back(ecu);
+	for (auto& msg : traffic)
+		this->traffic.push_back({ msg, 0 });
+	this->start(can_baud);
 }
 
 ECUsim::~ECUsim() {
 	this->stop();
 	this->join();
+	this->panda->can_rx_q_stop();
+	DeleteCriticalSection(&this->state_lock);
+}
+
+void ECUsim::start(unsigned long can_baud) {
+	this->panda->set_can_speed_cbps(panda::PANDA_CAN1, can_baud / 100); //Don't pass in baud where baud%100 != 0
+	this->panda->set_safety_mode(panda::SAFETY_ALLOUTPUT);
+	this->panda->set_can_loopback(FALSE);
+	this->panda->can_clear(panda::PANDA_CAN_RX);
+
+	InitializeCriticalSection(&this->state_lock);
+	this->tx_timer = 0;
+	this->msg_recv.resize(CAN_RX_MSG_LEN);
+	this->strand = panda::IoEngine::shared()->strand();
+
+	auto now = clock::now();
+	EnterCriticalSection(&this->state_lock);
+	for (size_t i = 0; i < this->traffic.size(); i++)
+		this->_schedule(this->ecus.size() + i, 0, now + std::chrono::microseconds(this->traffic[i].cfg.period_us));
+	LeaveCriticalSection(&this->state_lock);
+
+	this->panda->can_rx_q_start(this->strand, [this] { this->can_rx_filled(); });
 }
 
 void ECUsim::stop() {
 	this->doloop = FALSE;
 }
 
+//Once it returns nothing of the simulator runs any more.
 void ECUsim::join() {
-	WaitForSingleObject(this->thread_can, INFINITE);
+	this->strand->close();
 }
 
-DWORD WINAPI ECUsim::_canthreadBootstrap(LPVOID This) {
-	return ((ECUsim*)This)->can_recv_thread_function();
-}
+//Single frames are padded to 8 bytes, the last consecutive frame is not.
+std::vector<std::string> ECUsim::build_frames(const ECUsimECU& cfg, const std::string& payload) {
+	std::vector<std::string> frames;
+	std::string head = cfg.ext_addr ? std::string(1, (char)cfg.ext_addr_tx) : std::string();
+	size_t data_room = 7 - head.size();
+	size_t len = min(payload.size(), 0xFFF);
 
-DWORD ECUsim::can_recv_thread_function() {
-	while (this->doloop) {
-		auto msgs = this->panda->can_recv();
-		for (auto& msg : msgs) {
-			if (msg.is_receipt) continue;
-			if (msg.bus == 0 && !msg.is_receipt /*&& msg.len == 8*/ && msg.dat[0] >= 2) {
-				if (this->verbose) {
-					printf("Processing message (bus: %d; addr: %X; 29b: %d):\n    ", msg.bus, msg.addr, msg.addr_29b);
-					for (int i = 0; i < msg.len; i++) printf("%02X ", msg.dat[i]);
-					printf("\n");
-				}
-				this->_CAN_process_msg(msg);
-			} else {
-				if (this->verbose) {
-					printf("Rejecting message (bus: %d; addr: %X; 29b: %d):\n    ", msg.bus, msg.addr, msg.addr_29b);
-					for (int i = 0; i < msg.len; i++) printf("%02X ", msg.dat[i]);
-					printf("\n");
-				}
-			}
-		}
+	if (len <= data_room) {
+		std::string frame = head;
+		frame += (char)len;
+		frame += payload.substr(0, len);
+		frame.resize(8, '\0');
+		frames.push_back(frame);
+		return frames;
 	}
 
-	return 0;
+	std::string first = head;
+	first += (char)(0x10 | ((len >> 8) & 0xF));
+	first += (char)(len & 0xFF);
+	first += payload.substr(0, data_room - 1);
+	frames.push_back(first);
+
+	uint8_t sn = 1;
+	for (size_t pos = data_room - 1; pos < len; pos += data_room) {
+		std::string frame = head;
+		frame += (char)(0x20 | sn);
+		frame += payload.substr(pos, min(data_room, len - pos));
+		frames.push_back(frame);
+		sn = (sn + 1) & 0xF;
+	}
+	return frames;
 }
 
-BOOL ECUsim::_can_addr_matches(panda::PANDA_CAN_MSG& msg) {
-	if (this->can11b_enabled && !msg.addr_29b && (msg.addr == 0x7DF || (msg.addr & 0x7F8) == 0x7E0)) {
-		if (!this->ext_addr) {
-			return TRUE;
-		} else {
-			return msg.len >= 1 && msg.dat[0] == 0x13;//13 is an arbitrary address picked to test ext addresses
+void ECUsim::can_rx_filled() {
+	size_t count;
+	while ((count = this->panda->can_rx_q_pop_into(this->msg_recv.data(), this->msg_recv.size())) != 0) {
+		if (!this->doloop) continue; //Still drained, the reads must keep going until join
+		for (size_t k = 0; k < count; k++) {
+			auto& msg = this->msg_recv[k];
+			if (msg.is_receipt || msg.bus != 0) continue;
+
+			bool matched = FALSE;
+			EnterCriticalSection(&this->state_lock);
+			for (size_t i = 0; i < this->ecus.size(); i++) {
+				if (!this->_can_addr_matches(this->ecus[i].cfg, msg)) continue;
+				matched = TRUE;
+				this->_CAN_process_msg(i, msg);
+			}
+			LeaveCriticalSection(&this->state_lock);
+
+			if (this->verbose) {
+				printf("%s message (bus: %d; addr: %X; 29b: %d):\n    ", matched ? "Processing" : "Rejecting", msg.bus, msg.addr, msg.addr_29b);
+				for (int i = 0; i < msg.len; i++) printf("%02X ", msg.dat[i]);
+				printf("\n");
+			}
 		}
 	}
-	if (this->can29b_enabled && msg.addr_29b && ((msg.addr & 0x1FFF00FF) == 0x18DB00F1 || (msg.addr & 0x1FFF00FF) == 0x18da00f1)) {
-		if (!this->ext_addr) {
-			return TRUE;
-		} else {
-			return msg.len >= 1 && msg.dat[0] == 0x13;//13 is an arbitrary address picked to test ext addresses
+}
+
+//Sends whatever is due, then sets the strand's timer for the next event.
+void ECUsim::run_events() {
+	EnterCriticalSection(&this->state_lock);
+	this->tx_timer = 0;
+	while (this->doloop && !this->events.empty()) {
+		auto now = clock::now();
+		Event ev = this->events.top();
+		if (ev.due > now) {
+			if (this->tx_timer != 0) this->strand->cancel(this->tx_timer); //Set by an event that ran
+			this->tx_timer = this->strand->post_at(ev.due, [this] { this->run_events(); });
+			break;
 		}
+		this->events.pop();
+		this->_run_event(ev, now);
 	}
-	return FALSE;
+	LeaveCriticalSection(&this->state_lock);
+}
+
+BOOL ECUsim::_can_addr_matches(const ECUsimECU& cfg, panda::PANDA_CAN_MSG& msg) {
+	if (msg.addr_29b != cfg.addr_29b) return FALSE;
+	if ((msg.addr & cfg.request_mask) != (cfg.request_id & cfg.request_mask) &&
+		(cfg.functional_mask == 0 || (msg.addr & cfg.functional_mask) != (cfg.functional_id & cfg.functional_mask)))
+		return FALSE;
+	if (cfg.ext_addr)
+		return msg.len >= 1 && msg.dat[0] == cfg.ext_addr_rx;
+	return TRUE;
 }
 
-void ECUsim::_CAN_process_msg(panda::PANDA_CAN_MSG& msg) {
-	std::string outmsg;
-	uint32_t outaddr;
-	uint8_t formatted_msg_buff[8];
-	bool doreply = FALSE;
-
-	if (this->_can_addr_matches(msg)) {// && msg.len == 8) {
-		uint8_t *dat = (this->ext_addr) ? &msg.dat[1] : &msg.dat[0];
-		if ((dat[0] & 0xF0) == 0x10) {
-			printf("Got a multiframe write request\n");
-			outaddr = (msg.addr_29b) ? 0x18DAF1EF : 0x7E8;
-			this->panda->can_send(outaddr, msg.addr_29b, (const uint8_t*)"\x30\x00\x00", 3, panda::PANDA_CAN1);
+//Called with state_lock held.
+void ECUsim::_CAN_process_msg(size_t slot, panda::PANDA_CAN_MSG& msg) {
+	auto& ecu = this->ecus[slot];
+	unsigned int idx = ecu.cfg.ext_addr ? 1 : 0;
+	if (msg.len <= idx) return;
+	const uint8_t *dat = &msg.dat[idx];
+	unsigned int len = msg.len - idx;
+
+	switch (dat[0] & 0xF0) {
+	case 0x00: { /////////// Single frame request
+		unsigned int payload_len = dat[0] & 0x0F;
+		if (payload_len == 0 || payload_len > len - 1) return;
+		this->_respond(slot, std::string((const char*)&dat[1], payload_len));
+		return;
+	}
+	case 0x10: /////////// First frame of a multi frame request
+		if (msg.len < 8) return;
+		if (this->verbose) printf("Got a multiframe write request\n");
+		ecu.rx_len = ((dat[0] & 0x0F) << 8) | dat[1];
+		ecu.rx.assign((const char*)&dat[2], len - 2);
+		ecu.rx_sn = 1;
+		ecu.rx_block_left = ecu.cfg.fc_block_size;
+		this->_send_flow_control(ecu);
+		return;
+	case 0x20: /////////// Consecutive frame of a multi frame request
+		if (ecu.rx_len == 0) return;
+		if ((dat[0] & 0x0F) != ecu.rx_sn) {
+			ecu.rx_len = 0; //Lost a frame, drop the request.
 			return;
 		}
-
-		/////////// Check if Flow Control Msg
-		if ((dat[0] & 0xF0) == 0x30 && msg.len >= 3 && this->can_multipart_data.size() > 0) {
-			if (this->verbose) printf("More data requested\n");
-			uint8_t block_size = dat[1], sep_time_min = dat[2];
-			outaddr = (msg.addr == 0x7DF || msg.addr == 0x7E0) ? 0x7E8 : 0x18DAF1EF; //ext addr 5th byte is just always 0x13 for simplicity
-
-			unsigned int msgnum = 1;
-			while (this->can_multipart_data.size()) {
-				unsigned int datalen = this->ext_addr ?
-					min(6, this->can_multipart_data.size()): //EXT ADDR VALUE
-					min(7, this->can_multipart_data.size()); //NORMAL ADDR VALUE
-
-				unsigned int idx = 0;
-				if (this->ext_addr)
-					formatted_msg_buff[idx++] = 0x13; //EXT ADDR
-				formatted_msg_buff[idx++] = 0x20 | msgnum;
-				for (int i = 0; i < datalen; i++) {
-					formatted_msg_buff[i + idx] = this->can_multipart_data.front();
-					this->can_multipart_data.pop();
-				}
-				for (int i = datalen + idx; i < sizeof(formatted_msg_buff); i++)
-					formatted_msg_buff[i] = 0;
-
-				if (this->verbose) {
-					printf("Multipart reply to %X.\n    ", outaddr);
-					for (int i = 0; i < datalen + idx; i++) printf("%02X ", formatted_msg_buff[i]);
-					printf("\n");
-				}
-
-				this->panda->can_send(outaddr, msg.addr_29b, formatted_msg_buff, datalen + idx, panda::PANDA_CAN1);
-				msgnum = (msgnum + 1) % 0x10;
-				Sleep(10);
-			}
+		ecu.rx.append((const char*)&dat[1], min(len - 1, ecu.rx_len - ecu.rx.size()));
+		ecu.rx_sn = (ecu.rx_sn + 1) & 0xF;
+		if (ecu.rx.size() >= ecu.rx_len) {
+			ecu.rx_len = 0;
+			this->_respond(slot, ecu.rx);
+		} else if (ecu.rx_block_left && --ecu.rx_block_left == 0) {
+			ecu.rx_block_left = ecu.cfg.fc_block_size;
+			this->_send_flow_control(ecu);
+		}
+		return;
+	case 0x30: { /////////// Flow control for the response being sent
+		if (ecu.tx == NULL || !ecu.tx_wait_fc || len < 3) return;
+		switch (dat[0] & 0x0F) {
+		case 0: //Clear to send
+			break;
+		case 1: //Wait
+			return;
+		default: //Overflow, give up on the response
+			ecu.tx = NULL;
 			return;
 		}
+		if (this->verbose) printf("More data requested\n");
 
-		/////////// Normal message in
-		outmsg = this->process_obd_msg(dat[1], dat[2], doreply);
-		if (doreply) {
-			outaddr = (msg.addr_29b) ? 0x18DAF1EF : 0x7E8;
-
-			if (outmsg.size() <= (this->ext_addr ? 4 : 5)) {
-				unsigned int idx = 0;
-				if(this->ext_addr)
-					formatted_msg_buff[idx++] = 0x13; //EXT ADDR
-				formatted_msg_buff[idx++] = outmsg.size() + 2;
-				formatted_msg_buff[idx++] = 0x40 | dat[1];
-				formatted_msg_buff[idx++] = dat[2]; //PID
-				memcpy_s(&formatted_msg_buff[idx], sizeof(formatted_msg_buff) - idx, outmsg.c_str(), outmsg.size());
-				for (int i = idx + outmsg.size(); i < 8; i++)
-					formatted_msg_buff[i] = 0;
-
-				if (this->verbose) {
-					printf("Replying to %X.\n    ", outaddr);
-					for (int i = 0; i < 8; i++) printf("%02X ", formatted_msg_buff[i]);
-					printf("\n");
-				}
-
-				this->panda->can_send(outaddr, msg.addr_29b, formatted_msg_buff, 8, panda::PANDA_CAN1); //outmsg.size() + 3
-			} else {
-				uint8_t first_msg_len = this->ext_addr ?
-					min(2, outmsg.size() % 7) : //EXT ADDR VALUES
-					min(3, outmsg.size() % 7);  //NORMAL ADDR VALUES
-				uint8_t payload_len = outmsg.size() + 3;
-
-				unsigned int idx = 0;
-				if (this->ext_addr)
-					formatted_msg_buff[idx++] = 0x13; //EXT ADDR
-				formatted_msg_buff[idx++] = 0x10 | ((payload_len >> 8) & 0xF);
-				formatted_msg_buff[idx++] = payload_len & 0xFF;
-				formatted_msg_buff[idx++] = 0x40 | dat[1];
-				formatted_msg_buff[idx++] = dat[2]; //PID
-				formatted_msg_buff[idx++] = 1;
-				memcpy_s(&formatted_msg_buff[idx], sizeof(formatted_msg_buff) - idx, outmsg.c_str(), first_msg_len);
-
-				if (this->verbose) {
-					printf("Replying FIRST FRAME to %X.\n    ", outaddr);
-					for (int i = 0; i < 8; i++) printf("%02X ", formatted_msg_buff[i]);
-					printf("\n");
-				}
-
-				this->panda->can_send(outaddr, msg.addr_29b, formatted_msg_buff, 8, panda::PANDA_CAN1);
-				for (int i = first_msg_len; i < outmsg.size(); i++)
-					this->can_multipart_data.push(outmsg[i]);
-			}
+		uint8_t st_min = dat[2];
+		unsigned long st_min_us = (st_min <= 0x7F) ? st_min * 1000 : (st_min >= 0xF1 && st_min <= 0xF9) ? (st_min - 0xF0) * 100 : 127000;
+		ecu.tx_wait_fc = FALSE;
+		ecu.tx_block_left = dat[1];
+		ecu.tx_gap_us = max(ecu.cfg.cf_gap_us, st_min_us);
+		this->_schedule(slot, ecu.tx_gen, clock::now() + std::chrono::microseconds(ecu.tx_gap_us));
+		return;
+	}
+	}
+}
+
+//Starts sending the precomputed response after the ECU's delay. Called with state_lock held.
+void ECUsim::_respond(size_t slot, const std::string& request) {
+	auto& ecu = this->ecus[slot];
+	auto resp = ecu.frames.find(request);
+	if (resp == ecu.frames.end() && request.size() > 2)
+		resp = ecu.frames.find(request.substr(0, 2));
+	if (resp == ecu.frames.end()) return;
+
+	ecu.tx = &resp->second;
+	ecu.tx_next = 0;
+	ecu.tx_wait_fc = FALSE;
+	ecu.tx_gen++;
+	this->_schedule(slot, ecu.tx_gen, clock::now() + std::chrono::microseconds(ecu.cfg.response_delay_us));
+}
+
+void ECUsim::_send_flow_control(EcuState& ecu) {
+	std::string fc = ecu.cfg.ext_addr ? std::string(1, (char)ecu.cfg.ext_addr_tx) : std::string();
+	fc += (char)0x30;
+	fc += (char)ecu.cfg.fc_block_size;
+	fc += (char)ecu.cfg.fc_st_min;
+	this->_send(ecu.cfg.response_id, ecu.cfg.addr_29b, fc);
+}
+
+//Called with state_lock held.
+void ECUsim::_run_event(const Event& ev, clock::time_point now) {
+	if (ev.slot >= this->ecus.size()) {
+		auto& msg = this->traffic[ev.slot - this->ecus.size()];
+		std::string dat = msg.cfg.dat;
+		if (msg.cfg.counter && dat.size() > 0)
+			dat.back() = (char)msg.count++;
+
+		if (this->panda->can_send_async(msg.cfg.addr, msg.cfg.addr_29b, (const uint8_t*)dat.data(), (uint8_t)min(dat.size(), 8), panda::PANDA_CAN1) == 0)
+			this->traffic_dropped++;
+
+		//Keep the phase, skipping periods that were missed entirely.
+		auto period = std::chrono::microseconds(max(msg.cfg.period_us, 1));
+		auto due = ev.due + period;
+		while (due <= now) {
+			due += period;
+			this->traffic_dropped++;
+		}
+		this->_schedule(ev.slot, 0, due);
+		return;
+	}
+
+	auto& ecu = this->ecus[ev.slot];
+	if (ev.gen != ecu.tx_gen || ecu.tx == NULL || ecu.tx_wait_fc) return;
+
+	auto& frame = (*ecu.tx)[ecu.tx_next++];
+	if (this->verbose) {
+		printf("Replying to %X.\n    ", ecu.cfg.response_id);
+		for (auto c : frame) printf("%02X ", (uint8_t)c);
+		printf("\n");
+	}
+	this->_send(ecu.cfg.response_id, ecu.cfg.addr_29b, frame);
+
+	if (ecu.tx_next == ecu.tx->size()) {
+		ecu.tx = NULL;
+	} else if (ecu.tx_next == 1 || (ecu.tx_block_left && --ecu.tx_block_left == 0)) {
+		ecu.tx_wait_fc = TRUE; //After the first frame and after each block.
+	} else {
+		this->_schedule(ev.slot, ev.gen, now + std::chrono::microseconds(ecu.tx_gap_us));
+	}
+}
+
+//Called with state_lock held.
+void ECUsim::_schedule(size_t slot, unsigned int gen, clock::time_point due) {
+	bool sooner = this->events.empty() || due < this->events.top().due;
+	this->events.push({ due, slot, gen });
+	if (!sooner || !this->doloop) return;
+	if (this->tx_timer != 0) this->strand->cancel(this->tx_timer);
+	this->tx_timer = this->strand->post_at(due, [this] { this->run_events(); });
+}
+
+//Responses wait for room in the panda's TX queue instead of being dropped.
+void ECUsim::_send(uint32_t addr, bool addr_29b, const std::string& dat) {
+	while (this->panda->can_send_async(addr, addr_29b, (const uint8_t*)dat.data(), (uint8_t)dat.size(), panda::PANDA_CAN1) == 0 && this->doloop)
+		Sleep(1);
+}
+
+//Legacy engine ECU: OBD requests on the standard physical and functional addresses.
+ECUsimECU ECUsim::obd_ecu(bool addr_29b, bool ext_addr) {
+	ECUsimECU ecu(addr_29b ? 0x18DA00F1 : 0x7E0, addr_29b ? 0x18DAF1EF : 0x7E8, addr_29b);
+	ecu.request_mask = addr_29b ? 0x1FFF00FF : 0x7F8;
+	ecu.functional_id = addr_29b ? 0x18DB00F1 : 0x7DF;
+	ecu.functional_mask = addr_29b ? 0x1FFF00FF : 0x7FF;
+	ecu.ext_addr = ext_addr;
+	ecu.ext_addr_rx = ecu.ext_addr_tx = 0x13; //13 is an arbitrary address picked to test ext addresses
+	ecu.cf_gap_us = 10000;
+
+	const UCHAR modes[] = { 0x01, 0x09, 0x3E };
+	for (auto mode : modes) {
+		for (unsigned int pid = 0; pid <= 0xFF; pid++) {
+			bool doreply;
+			std::string data = process_obd_msg(mode, pid, doreply);
+			if (!doreply) continue;
+
+			std::string req, resp;
+			req += (char)mode;
+			req += (char)pid;
+			resp += (char)(0x40 | mode);
+			resp += (char)pid;
+			if (data.size() > (ext_addr ? 4u : 5u))
+				resp += '\x01'; //Multi frame replies carry the number of data items
+			ecu.add_response(req, resp + data);
 		}
 	}
+	return ecu;
 }
 
 std::string ECUsim::process_obd_msg(UCHAR mode, UCHAR pid, bool& return_data) {
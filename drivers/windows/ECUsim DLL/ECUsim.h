@@ -2,7 +2,11 @@
 
 #include <string>
 #include "panda_shared/panda.h"
+#include "panda_shared/io_engine.h"
+#include <map>
 #include <queue>
+#include <vector>
+#include <chrono>
 
 // The following ifdef block is the standard way of creating macros which make exporting
 // from a DLL simpler. All files within this DLL are compiled with the ECUSIMDLL_EXPORTS
@@ -16,35 +20,125 @@
 #define ECUSIMDLL_API __declspec(dllimport)
 #endif
 
+// One simulated ECU. Requests are taken on request_id, or on functional_id if
+// functional_mask is set, comparing the bits set in the mask. Responses are looked
+// up by the whole request payload, then by its first two bytes (service and PID).
+struct ECUSIMDLL_API ECUsimECU {
+	ECUsimECU(uint32_t request_id, uint32_t response_id, bool addr_29b);
+
+	void add_response(const std::string& request, const std::string& response);
+
+	uint32_t request_id;
+	uint32_t request_mask;
+	uint32_t functional_id;
+	uint32_t functional_mask;
+	uint32_t response_id;
+	bool addr_29b;
+	bool ext_addr;
+	uint8_t ext_addr_rx; //First byte of requests when ext_addr is set
+	uint8_t ext_addr_tx; //First byte of responses when ext_addr is set
+	uint8_t fc_block_size; //Flow control sent back for multi frame requests
+	uint8_t fc_st_min;
+	unsigned long response_delay_us; //From the request to the first response frame
+	unsigned long cf_gap_us; //Least time between consecutive frames, the tester's STmin wins if longer
+	std::map<std::string, std::string> responses;
+};
+
+// A frame sent every period_us regardless of the diagnostic traffic. If counter
+// is set the last data byte counts up with every send.
+struct ECUSIMDLL_API ECUsimTraffic {
+	uint32_t addr;
+	bool addr_29b;
+	std::string dat;
+	unsigned long period_us;
+	bool counter;
+};
+
 // This class is exported from the ECUsim DLL.dll
 class ECUSIMDLL_API ECUsim {
 public:
+	//Simulates the engine ECU answering OBD requests on 0x7E0/0x7DF and 0x18DAxxF1/0x18DBxxF1.
 	ECUsim(std::string sn, unsigned long can_baud, bool ext_addr = FALSE);
 	ECUsim(panda::Panda && p, unsigned long can_baud, bool ext_addr = FALSE);
+	//Simulates the given ECUs with the bus traffic next to them. Verbose output starts off.
+	ECUsim(std::string sn, unsigned long can_baud, const std::vector<ECUsimECU>& ecus,
+		const std::vector<ECUsimTraffic>& traffic = std::vector<ECUsimTraffic>());
 	~ECUsim();
 
 	void stop();
 	void join();
 
+	//The OBD responses of the default ECU.
+	static ECUsimECU obd_ecu(bool addr_29b, bool ext_addr);
+
 	// Flag determines if verbose output is enabled
 	volatile bool verbose;
 	BOOL ext_addr;
+	//Background frames not sent because the panda's TX queue was full or the period was missed.
+	volatile unsigned long long traffic_dropped;
 private:
-	std::unique_ptr<panda::Panda> panda;
+	using clock = std::chrono::steady_clock;
+
+	struct EcuState {
+		EcuState(const ECUsimECU& cfg);
 
-	static DWORD WINAPI _canthreadBootstrap(LPVOID This);
-	DWORD can_recv_thread_function();
+		ECUsimECU cfg;
+		std::map<std::string, std::vector<std::string>> frames; //cfg.responses split into frames up front
 
-	BOOL _can_addr_matches(panda::PANDA_CAN_MSG & msg);
+		const std::vector<std::string>* tx; //Response being sent, NULL if none
+		size_t tx_next;
+		unsigned int tx_block_left; //Frames until the tester's next flow control, 0 for no limit
+		bool tx_wait_fc;
+		unsigned long tx_gap_us;
+		unsigned int tx_gen; //Bumped when tx changes so events for the old response are dropped
 
-	void _CAN_process_msg(panda::PANDA_CAN_MSG & msg);
+		std::string rx; //Multi frame request being received
+		size_t rx_len; //0 if none
+		uint8_t rx_sn;
+		unsigned int rx_block_left;
+	};
 
-	std::string process_obd_msg(UCHAR mode, UCHAR pid, bool& return_data);
+	struct TrafficState {
+		ECUsimTraffic cfg;
+		uint8_t count;
+	};
+
+	//slot indexes ecus, then traffic past the end of ecus.
+	struct Event {
+		clock::time_point due;
+		size_t slot;
+		unsigned int gen;
+		bool operator>(const Event& other) const { return this->due > other.due; }
+	};
+
+	void start(unsigned long can_baud);
+	static std::vector<std::string> build_frames(const ECUsimECU& cfg, const std::string& payload);
+
+	//On the strand.
+	void can_rx_filled();
+	void run_events();
+
+	BOOL _can_addr_matches(const ECUsimECU& cfg, panda::PANDA_CAN_MSG & msg);
+
+	void _CAN_process_msg(size_t slot, panda::PANDA_CAN_MSG & msg);
+	void _respond(size_t slot, const std::string& request);
+	void _send_flow_control(EcuState& ecu);
+	void _run_event(const Event& ev, clock::time_point now);
+	void _schedule(size_t slot, unsigned int gen, clock::time_point due);
+	void _send(uint32_t addr, bool addr_29b, const std::string& dat);
+
+	static std::string process_obd_msg(UCHAR mode, UCHAR pid, bool& return_data);
+
+	std::unique_ptr<panda::Panda> panda;
 
-	HANDLE thread_can;
+	//Receiving and the events run on it, from the shared IoEngine instead of threads of their own.
+	std::shared_ptr<panda::IoStrand> strand;
+	std::vector<panda::PANDA_CAN_MSG> msg_recv;
+	panda::IoTimerHandle tx_timer; //Set for events.top(), 0 if none
 	volatile bool doloop;
-	std::queue<uint8_t> can_multipart_data;
 
-	BOOL can11b_enabled;
-	BOOL can29b_enabled;
+	CRITICAL_SECTION state_lock;
+	std::vector<EcuState> ecus;
+	std::vector<TrafficState> traffic;
+	std::priority_queue<Event, std::vector<Event>, std::greater<Event>> events;
 };
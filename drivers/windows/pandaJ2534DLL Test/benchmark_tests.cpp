@@ -0,0 +1,173 @@
+#include "stdafx.h"
+#include "Loader4.h"
+#include "pandaJ2534DLL/J2534_v0404.h"
+#include "panda_shared/panda.h"
+#include "Timer.h"
+#include "ECUsim DLL\ECUsim.h"
+#include "TestHelpers.h"
+#include <algorithm>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+//Benchmarks against ECUsim on a second panda sharing the bus. They only fail if a
+//request gets no answer. Each one writes a line starting with BENCHMARK followed
+//by a JSON object, so results can be collected from the test log across builds.
+namespace pandaJ2534DLLBenchmark
+{
+	//Microseconds of the given percentile, samples get sorted.
+	static double percentile(std::vector<double>& samples, double pct) {
+		if (samples.size() == 0) return 0;
+		std::sort(samples.begin(), samples.end());
+		size_t idx = (size_t)(pct / 100.0 * (samples.size() - 1) + 0.5);
+		return samples[idx];
+	}
+
+	static void report_latency(const char* name, std::vector<double>& samples_us) {
+		std::ostringstream out;
+		out << "BENCHMARK {\"name\":\"" << name << "\",\"n\":" << samples_us.size()
+			<< ",\"p50_us\":" << percentile(samples_us, 50)
+			<< ",\"p99_us\":" << percentile(samples_us, 99)
+			<< ",\"p999_us\":" << percentile(samples_us, 99.9)
+			<< ",\"max_us\":" << (samples_us.size() ? samples_us.back() : 0) << "}" << std::endl;
+		Logger::WriteMessage(out.str().c_str());
+	}
+
+	static double us_since(std::chrono::steady_clock::time_point start) {
+		return (double)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	TEST_CLASS(J2534Benchmarks)
+	{
+	public:
+
+		TEST_METHOD_INITIALIZE(init) {
+			LoadJ2534Dll("pandaJ2534_0404_32.dll");
+		}
+
+		TEST_METHOD_CLEANUP(deinit) {
+			if (didopen) {
+				PassThruClose(devid);
+				didopen = FALSE;
+			}
+			UnloadJ2534Dll();
+		}
+
+		//OBD mode 1 PID 0, answered with one frame.
+		TEST_METHOD(Benchmark_ISO15765_SingleFrameLatency)
+		{
+			ECUsim sim("", 500000);
+			auto chanid = open_iso15765();
+			report_latency("iso15765_sf_latency", request_loop(chanid, "\x18\xda\xef\xf1""\x01\x00", 6, 1000));
+		}
+
+		//OBD mode 9 PID 2 (VIN), answered with a first frame and two consecutive frames.
+		TEST_METHOD(Benchmark_ISO15765_MultiFrameLatency)
+		{
+			ECUsim sim("", 500000);
+			auto chanid = open_iso15765();
+			report_latency("iso15765_mf_latency", request_loop(chanid, "\x18\xda\xef\xf1""\x09\x02", 6, 500));
+		}
+
+		//Raw frames written in blocks with loopback on, until all the echoes are read back.
+		TEST_METHOD(Benchmark_CAN_Throughput)
+		{
+			const unsigned long block = 100, blocks = 50;
+			unsigned long chanid;
+			Assert::AreEqual<long>(STATUS_NOERROR, open_dev(""), _T("Failed to open device."), LINE_INFO());
+			Assert::AreEqual<long>(STATUS_NOERROR, PassThruConnect(devid, CAN, 0, 500000, &chanid), _T("Failed to open channel."), LINE_INFO());
+			write_ioctl(chanid, LOOPBACK, TRUE, LINE_INFO());
+
+			std::vector<PASSTHRU_MSG> tx(block);
+			for (unsigned long i = 0; i < block; i++) {
+				tx[i] = { CAN, 0, 0, 0, 12, 12 };
+				memcpy(tx[i].Data, "\x0\x0\x3\xAB""\x0\x1\x2\x3\x4\x5\x6\x7", 12);
+				tx[i].Data[11] = (unsigned char)i;
+			}
+
+			std::vector<PASSTHRU_MSG> rx(block);
+			unsigned long received = 0;
+			auto start = std::chrono::steady_clock::now();
+			for (unsigned long b = 0; b < blocks; b++) {
+				unsigned long count = block;
+				Assert::AreEqual<long>(STATUS_NOERROR, PassThruWriteMsgs(chanid, tx.data(), &count, 0), _T("Failed to write messages."), LINE_INFO());
+			}
+			while (received < block * blocks && us_since(start) < 30000000) {
+				unsigned long count = block;
+				if (PassThruReadMsgs(chanid, rx.data(), &count, 100) == STATUS_NOERROR || count > 0)
+					received += count;
+			}
+			double elapsed_us = us_since(start);
+			Assert::AreEqual<unsigned long>(block * blocks, received, _T("Did not get every echo back."), LINE_INFO());
+
+			std::ostringstream out;
+			out << "BENCHMARK {\"name\":\"can_throughput\",\"n\":" << received
+				<< ",\"frames_per_s\":" << (received / (elapsed_us / 1000000.0)) << "}" << std::endl;
+			Logger::WriteMessage(out.str().c_str());
+		}
+
+		//Host scheduled periodic message (loopback keeps it off the panda's own timer),
+		//timed by the panda's receive timestamps on the other adapter.
+		TEST_METHOD(Benchmark_CAN_PeriodicJitter)
+		{
+			const unsigned long period_ms = 10, count = 500;
+			unsigned long chanid;
+			Assert::AreEqual<long>(STATUS_NOERROR, open_dev(""), _T("Failed to open device."), LINE_INFO());
+			Assert::AreEqual<long>(STATUS_NOERROR, PassThruConnect(devid, CAN, 0, 500000, &chanid), _T("Failed to open channel."), LINE_INFO());
+			write_ioctl(chanid, LOOPBACK, TRUE, LINE_INFO());
+			auto p = getPanda(500);
+
+			auto msgid = J2534_start_periodic_msg_checked(chanid, CAN, 0, 6, 0, "\x0\x0\x3\xAB""HI", period_ms, LINE_INFO());
+			auto msg_recv = panda_recv_loop_loose(p, count, period_ms * (count + 20));
+			Assert::AreEqual<long>(STATUS_NOERROR, PassThruStopPeriodicMsg(chanid, msgid), _T("Failed to stop periodic message."), LINE_INFO());
+
+			std::vector<double> jitter_us;
+			for (size_t i = 1; i < msg_recv.size(); i++)
+				jitter_us.push_back(abs((double)(msg_recv[i].recv_time - msg_recv[i - 1].recv_time) - period_ms * 1000.0));
+			report_latency("can_periodic_jitter", jitter_us);
+		}
+
+	private:
+		bool didopen = FALSE;
+		unsigned long devid;
+
+		unsigned long open_dev(const char* name) {
+			unsigned int res = PassThruOpen((void*)name, &devid);
+			if (res == STATUS_NOERROR) didopen = TRUE;
+			return res;
+		}
+
+		unsigned long open_iso15765() {
+			unsigned long chanid;
+			//ECUsim has the first panda, this takes the next free one.
+			Assert::AreEqual<long>(STATUS_NOERROR, open_dev(""), _T("Failed to open device."), LINE_INFO());
+			Assert::AreEqual<long>(STATUS_NOERROR, PassThruConnect(devid, ISO15765, CAN_29BIT_ID, 500000, &chanid), _T("Failed to open channel."), LINE_INFO());
+			write_ioctl(chanid, LOOPBACK, FALSE, LINE_INFO());
+			J2534_set_flowctrl_filter(chanid, CAN_29BIT_ID, 4, "\xff\xff\xff\xff", "\x18\xda\xf1\xef", "\x18\xda\xef\xf1", LINE_INFO());
+			return chanid;
+		}
+
+		//Time from PassThruWriteMsgs to the reassembled response coming out of PassThruReadMsgs.
+		std::vector<double> request_loop(unsigned long chanid, const char* request, unsigned long len, unsigned int iterations) {
+			std::vector<double> samples;
+			PASSTHRU_MSG rx[4];
+			for (unsigned int i = 0; i < iterations; i++) {
+				auto start = std::chrono::steady_clock::now();
+				J2534_send_msg_checked(chanid, ISO15765, 0, CAN_29BIT_ID, 0, len, 0, request, LINE_INFO());
+
+				bool answered = FALSE;
+				while (!answered && us_since(start) < 1000000) {
+					unsigned long count = 4;
+					if (PassThruReadMsgs(chanid, rx, &count, 50) != STATUS_NOERROR && count == 0) continue;
+					for (unsigned long m = 0; m < count; m++) {
+						//Skip the TX indication and first frame notice, wait for the response itself.
+						if (rx[m].RxStatus & (TX_MSG_TYPE | START_OF_MESSAGE)) continue;
+						answered = TRUE;
+					}
+				}
+				Assert::IsTrue(answered, _T("ECUsim did not answer."), LINE_INFO());
+				samples.push_back(us_since(start));
+			}
+			return samples;
+		}
+	};
+}
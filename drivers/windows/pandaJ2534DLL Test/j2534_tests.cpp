@@ -64,6 +64,16 @@ namespace pandaJ2534DLLTest
 				Assert::AreNotEqual(panda_sn, pandas_available[0]);
 		}
 
+		TEST_METHOD(J2534_Device_OpenDevice__J2534_2_SN)
+		{
+			auto pandas_available = panda::Panda::listAvailablePandas();
+			Assert::IsTrue(pandas_available.size() > 0, _T("No pandas detected."));
+
+			std::string name = "J2534-2:" + pandas_available[0];
+			Assert::AreEqual<long>(STATUS_NOERROR, open_dev(name.c_str()), _T("Failed to open device."), LINE_INFO());
+			Assert::AreEqual<long>(ERR_DEVICE_IN_USE, open_dev(pandas_available[0].c_str()), _T("Opened a device twice."), LINE_INFO());
+		}
+
 		TEST_METHOD(J2534_Device_CloseDevice)
 		{
 			Assert::AreEqual<long>(STATUS_NOERROR, open_dev(""), _T("Failed to open device."), LINE_INFO());
@@ -180,6 +190,28 @@ namespace pandaJ2534DLLTest
 			check_panda_can_msg(msg_recv[1], 0, 0x3AB, TRUE, FALSE, "YO", LINE_INFO());
 		}
 
+		//CAN_CH2 is the panda's CAN2, both at once with CAN1.
+		TEST_METHOD(J2534_CAN_Ch2_TxRx)
+		{
+			auto chanid = J2534_open_and_connect("", CAN, 0, 500000, LINE_INFO());
+			unsigned long chanid2;
+			Assert::AreEqual<long>(STATUS_NOERROR, PassThruConnect(devid, CAN_CH2, 0, 500000, &chanid2), _T("Failed to open CAN_CH2."), LINE_INFO());
+			J2534_set_PASS_filter(chanid2, CAN_CH2, 0, 4, "\x0\x0\x0\x0", "\x0\x0\x0\x0", LINE_INFO());
+			auto p = getPanda(500);
+
+			J2534_send_msg_checked(chanid2, CAN_CH2, 0, 0, 0, 6, 6, "\x0\x0\x3\xAB""HI", LINE_INFO());
+			J2534_send_msg_checked(chanid, CAN, 0, 0, 0, 6, 6, "\x0\x0\x3\xAB""YO", LINE_INFO());
+
+			auto msg_recv = panda_recv_loop(p, 2);
+			bool first_ch2 = msg_recv[0].bus == panda::PANDA_CAN2;
+			check_panda_can_msg(msg_recv[first_ch2 ? 0 : 1], 1, 0x3AB, FALSE, FALSE, "HI", LINE_INFO());
+			check_panda_can_msg(msg_recv[first_ch2 ? 1 : 0], 0, 0x3AB, FALSE, FALSE, "YO", LINE_INFO());
+
+			p->can_send(0x1FA, FALSE, (const uint8_t*)"ABCDE", 5, panda::PANDA_CAN2);
+			auto j2534_msg_recv = j2534_recv_loop(chanid2, 1);
+			check_J2534_can_msg(j2534_msg_recv[0], CAN_CH2, 0, 0, 5 + 4, 0, "\x0\x0\x1\xFA""ABCDE", LINE_INFO());
+		}
+
 		TEST_METHOD(J2534_CAN_TxEcho)
 		{
 			auto chanid = J2534_open_and_connect("", CAN, 0, 500000, LINE_INFO());
@@ -204,6 +236,35 @@ namespace pandaJ2534DLLTest
 			check_J2534_can_msg(j2534_msg_recv[0], CAN, TX_MSG_TYPE, 0, 3 + 4, 0, "\x0\x0\x3\xAB""SUP", LINE_INFO());
 		}
 
+		TEST_METHOD(J2534_CAN_TxMany)
+		{
+			auto chanid = J2534_open_and_connect("", CAN, 0, 500000, LINE_INFO());
+			auto p = getPanda(500);
+			write_ioctl(chanid, LOOPBACK, TRUE, LINE_INFO());
+
+			PASSTHRU_MSG msgs[3] = {
+				{ CAN, 0, 0, 0, 6, 6 },
+				{ CAN, 0, 0, 0, 7, 7 },
+				{ CAN, 0, 0, 0, 6, 6 },
+			};
+			memcpy(msgs[0].Data, "\x0\x0\x3\xAB""HI", 6);
+			memcpy(msgs[1].Data, "\x0\x0\x1\x23""SUP", 7);
+			memcpy(msgs[2].Data, "\x0\x0\x3\xAB""YO", 6);
+			unsigned long msgcount = 3;
+			Assert::AreEqual<long>(STATUS_NOERROR, PassThruWriteMsgs(chanid, msgs, &msgcount, 0), _T("Failed to write messages."), LINE_INFO());
+			Assert::AreEqual<unsigned long>(3, msgcount, _T("Wrong number of messages written."), LINE_INFO());
+
+			auto msg_recv = panda_recv_loop(p, 3);
+			check_panda_can_msg(msg_recv[0], 0, 0x3AB, FALSE, FALSE, "HI", LINE_INFO());
+			check_panda_can_msg(msg_recv[1], 0, 0x123, FALSE, FALSE, "SUP", LINE_INFO());
+			check_panda_can_msg(msg_recv[2], 0, 0x3AB, FALSE, FALSE, "YO", LINE_INFO());
+
+			auto j2534_msg_recv = j2534_recv_loop(chanid, 3);
+			check_J2534_can_msg(j2534_msg_recv[0], CAN, TX_MSG_TYPE, 0, 6, 0, "\x0\x0\x3\xAB""HI", LINE_INFO());
+			check_J2534_can_msg(j2534_msg_recv[1], CAN, TX_MSG_TYPE, 0, 7, 0, "\x0\x0\x1\x23""SUP", LINE_INFO());
+			check_J2534_can_msg(j2534_msg_recv[2], CAN, TX_MSG_TYPE, 0, 6, 0, "\x0\x0\x3\xAB""YO", LINE_INFO());
+		}
+
 		TEST_METHOD(J2534_CAN_RxAndPassAllFilters)
 		{
 			auto chanid = J2534_open_and_connect("", CAN, 0, 500000, LINE_INFO());
@@ -716,6 +777,29 @@ namespace pandaJ2534DLLTest
 			check_J2534_can_msg(j2534_msg_recv[0], ISO15765, CAN_29BIT_ID | TX_INDICATION, 0, 4, 0, "\x18\xda\xef\xf1", LINE_INFO());
 		}
 
+		//Check multi frame tx passes with filter. 29 bit. Good Filter. NoPadding. STD address. Multi Frame. Loopback.
+		TEST_METHOD(J2534_ISO15765_SuccessTx_29b_Filter_NoPad_STD_FFCF_LOOPBACK)
+		{
+			auto chanid = J2534_open_and_connect("", ISO15765, CAN_29BIT_ID, 500000, LINE_INFO());
+			J2534_set_flowctrl_filter(chanid, CAN_29BIT_ID, 4, "\xff\xff\xff\xff", "\x18\xda\xf1\xef", "\x18\xda\xef\xf1", LINE_INFO());
+			write_ioctl(chanid, LOOPBACK, TRUE, LINE_INFO());
+			auto p = getPanda(500);
+
+			J2534_send_msg_checked(chanid, ISO15765, 0, CAN_29BIT_ID, 0, 4 + 0x13, 0, "\x18\xda\xef\xf1""nineteen bytes here", LINE_INFO());
+
+			auto panda_msg_recv = panda_recv_loop(p, 1);
+			check_panda_can_msg(panda_msg_recv[0], 0, 0x18DAEFF1, TRUE, FALSE, "\x10\x13""ninete", LINE_INFO());
+
+			panda_msg_recv = checked_panda_send(p, 0x18DAF1EF, TRUE, "\x30\x0\x0", 3, 2, LINE_INFO());
+			check_panda_can_msg(panda_msg_recv[0], 0, 0x18DAEFF1, TRUE, FALSE, "\x21""en byte", LINE_INFO());
+			check_panda_can_msg(panda_msg_recv[1], 0, 0x18DAEFF1, TRUE, FALSE, "\x22""s here", LINE_INFO());
+
+			//The looped back message is the whole one, after its indication.
+			auto j2534_msg_recv = j2534_recv_loop(chanid, 2);
+			check_J2534_can_msg(j2534_msg_recv[0], ISO15765, CAN_29BIT_ID | TX_INDICATION, 0, 4, 0, "\x18\xda\xef\xf1", LINE_INFO());
+			check_J2534_can_msg(j2534_msg_recv[1], ISO15765, CAN_29BIT_ID | TX_MSG_TYPE, 0, 4 + 0x13, 0, "\x18\xda\xef\xf1""nineteen bytes here", LINE_INFO());
+		}
+
 		//Check rx passes with filter. 11 bit. Good Filter. NoPadding. STD address. Single Frame.
 		TEST_METHOD(J2534_ISO15765_SuccessRx_11b_Filter_NoPad_STD_SF)
 		{
@@ -3,6 +3,7 @@
 #include "TestHelpers.h"
 
 #include <tchar.h>
+#include <algorithm>
 
 using namespace Microsoft::VisualStudio::CppUnitTestFramework;
 using namespace panda;
@@ -73,6 +74,34 @@ namespace pandaTestNative
 			}
 
 		}
+
+		TEST_METHOD(Panda_DevDiscover_ClosedDeviceListedAgain)
+		{
+			auto pandas_available = Panda::listAvailablePandas();
+			Assert::IsTrue(pandas_available.size() > 0, _T("No pandas were found."));
+
+			auto p1 = Panda::openPanda(pandas_available[0]);
+			Assert::IsFalse(p1 == nullptr, _T("Could not open panda."));
+			p1 = nullptr;
+
+			auto pandas_available2 = Panda::listAvailablePandas();
+			Assert::IsTrue(std::find(pandas_available2.begin(), pandas_available2.end(), pandas_available[0]) != pandas_available2.end(),
+				_T("Closed panda is missing from the list of available pandas."));
+		}
+
+		TEST_METHOD(Panda_DevDiscover_OpenPandas)
+		{
+			auto pandas_available = Panda::listAvailablePandas();
+			Assert::IsTrue(pandas_available.size() > 0, _T("No pandas were found."));
+
+			auto opened = Panda::openPandas(pandas_available);
+			Assert::IsTrue(pandas_available.size() == opened.size(), _T("Wrong number of pandas."));
+			for (size_t i = 0; i < opened.size(); i++) {
+				Assert::IsFalse(opened[i] == nullptr, _T("Could not open panda."));
+				Assert::IsTrue(opened[i]->get_usb_sn() == pandas_available[i], _T("Pandas out of order."));
+			}
+			Assert::IsTrue(Panda::listAvailablePandas().empty(), _T("Opened pandas appear in list of available pandas."));
+		}
 	};
 
 	TEST_CLASS(CANOperations)
@@ -113,6 +142,44 @@ namespace pandaTestNative
 			}
 		}
 
+		TEST_METHOD(Panda_CAN_RecvInto)
+		{
+			auto p0 = getPanda(500, TRUE);
+
+			for (int i = 0; i < 5; i++)
+				p0->can_send(0xAA + i, FALSE, (const uint8_t*)"\x0\x1\x2\x3\x4\x5\x6\x7", 8, panda::PANDA_CAN1);
+			Sleep(10);
+
+			PANDA_CAN_MSG msgs[PANDA_CAN_MSGS_PER_PACKET * 4];
+			Assert::AreEqual<size_t>(0, p0->can_recv_into(msgs, PANDA_CAN_MSGS_PER_PACKET - 1), _T("Read into a buffer smaller than a packet."), LINE_INFO());
+
+			size_t count = p0->can_recv_into(msgs, _countof(msgs));
+			Assert::AreEqual<size_t>(10, count, _T("Received the wrong number of CAN messages."), LINE_INFO());
+			for (size_t i = 0; i < count; i++) {
+				Assert::IsTrue(msgs[i].addr >= 0xAA && msgs[i].addr < 0xAA + 5, _T("Wrong addr."));
+				Assert::IsTrue(msgs[i].bus == PANDA_CAN1, _T("Wrong bus."));
+				Assert::IsTrue(msgs[i].len == 8, _T("Wrong len."));
+			}
+		}
+
+		TEST_METHOD(Panda_CAN_SendAsync)
+		{
+			auto p0 = getPanda(500, TRUE);
+
+			unsigned long long seq = 0;
+			for (int i = 0; i < 3; i++) {
+				seq = p0->can_send_async(0xAA, FALSE, (const uint8_t*)"\x0\x1\x2\x3\x4\x5\x6\x7", 8, panda::PANDA_CAN1);
+				Assert::IsTrue(seq != 0, _T("Async queue was full."));
+			}
+			Assert::IsTrue(p0->can_tx_wait(seq, 100), _T("Async send did not complete."));
+			Assert::AreEqual<unsigned long long>(0, p0->can_tx_errors(), _T("Async send failed."), LINE_INFO());
+			Sleep(10);
+
+			//A receipt and an echo for each.
+			PANDA_CAN_MSG msgs[PANDA_CAN_MSGS_PER_PACKET * 4];
+			Assert::AreEqual<size_t>(6, p0->can_recv_into(msgs, _countof(msgs)), _T("Received the wrong number of CAN messages."), LINE_INFO());
+		}
+
 		TEST_METHOD(Panda_CAN_ChangeBaud)
 		{
 			auto p0 = getPanda(250);
@@ -156,6 +223,33 @@ namespace pandaTestNative
 		}
 	};
 
+	TEST_CLASS(DeviceState)
+	{
+	public:
+
+		TEST_METHOD(Panda_Health_Cached)
+		{
+			auto p0 = getPanda(500);
+			p0->set_health_max_age(1000);
+			Assert::AreNotEqual(0u, p0->get_health_cached().voltage);
+
+			//The first read and the timer's are the only ones
+			p0->reset_perf_stats();
+			for (int i = 0; i < 10000; i++)
+				Assert::AreNotEqual(0u, p0->get_health_cached().voltage);
+			Assert::IsTrue(p0->get_perf_stats().hist[PERF_CONTROL_IN].count <= 2);
+
+			//A read the timer started before can still complete
+			p0->set_health_max_age(0);
+			Sleep(100);
+			p0->reset_perf_stats();
+			p0->get_health_cached();
+			Sleep(1000);
+			Assert::AreEqual(0ull, (unsigned long long)p0->get_perf_stats().hist[PERF_CONTROL_IN].count,
+				_T("The timer kept reading."));
+		}
+	};
+
 	TEST_CLASS(SerialOperations)
 	{
 	public:
@@ -183,5 +277,35 @@ namespace pandaTestNative
 				}
 			}
 		}
+
+		TEST_METHOD(Panda_LIN_WriteAsync)
+		{
+			auto p0 = getPanda(500);
+			p0->serial_clear(SERIAL_LIN1);
+
+			//Longer than a transfer, and a second write queued behind it
+			std::string lindata;
+			for (size_t j = 0; j < 300; j++)
+				lindata += (const char)(rand() % 256);
+
+			HANDLE done = CreateEvent(NULL, TRUE, FALSE, NULL);
+			std::atomic<int> sent[2] = { -2, -2 };
+			Assert::IsTrue(p0->serial_write_async(SERIAL_LIN1, lindata.c_str(), 200, [&](int len) { sent[0] = len; }));
+			std::atomic<int> first_seen{ -2 };
+			Assert::IsTrue(p0->serial_write_async(SERIAL_LIN1, lindata.c_str() + 200, 100, [&](int len) {
+				first_seen = sent[0].load();
+				sent[1] = len;
+				SetEvent(done);
+			}));
+			Assert::AreEqual((DWORD)WAIT_OBJECT_0, WaitForSingleObject(done, 1000));
+			CloseHandle(done);
+			Assert::AreEqual(200, first_seen.load(), _T("Writes completed out of order."));
+			Assert::AreEqual(100, sent[1].load());
+
+			//K-line runs at 10400 baud
+			Sleep(500);
+			auto retdata = p0->serial_read(SERIAL_LIN1);
+			Assert::AreEqual(retdata, lindata);
+		}
 	};
 }
\ No newline at end of file
@@ -5,6 +5,9 @@
 
 class J2534Connection;
 
+//Identifies an Action in the device task queue so it can be canceled before it runs.
+typedef unsigned long long TaskHandle;
+
 /**
 An Action represents a unit of work that can be scheduled for execution at a later time.
 Actions are not guaranteed to be run at their specified time, but a best effort is made.
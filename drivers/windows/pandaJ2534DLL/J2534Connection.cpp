@@ -7,7 +7,19 @@ J2534Connection::J2534Connection(
 	unsigned long ProtocolID,
 	unsigned long Flags,
 	unsigned long BaudRate
-) : panda_dev(panda_dev), ProtocolID(ProtocolID), Flags(Flags), BaudRate(BaudRate), port(0) { }
+) : panda_dev(panda_dev), ProtocolID(ProtocolID), Flags(Flags), BaudRate(BaudRate), port(protocolPort(ProtocolID)),
+	messageRxBuff(PANDA_RX_QUEUE_LEN_DEFAULT, J2534Frame(ProtocolID)), rxBudget(panda_dev->rxBudget), rxBytes(0),
+	rxQueueLen(PANDA_RX_QUEUE_LEN_DEFAULT), rxOverflowPolicy(PANDA_RX_DROP_OLDEST), rxDropped(0), rxOverflowed(FALSE) {
+	this->periodicDeviceSlots.fill(-1);
+	this->messageRxBuff_nonempty = CreateEvent(NULL, TRUE, FALSE, NULL);
+}
+
+J2534Connection::~J2534Connection() {
+	//The panda keeps sending its periodic messages until told otherwise.
+	this->clearPeriodicMsgs();
+	this->rxBudget->give(this->rxBytes);
+	CloseHandle(this->messageRxBuff_nonempty);
+}
 
 unsigned long J2534Connection::validateTxMsg(PASSTHRU_MSG* msg) {
 	if (msg->DataSize < this->getMinMsgLen() || msg->DataSize > this->getMaxMsgLen())
@@ -22,62 +34,97 @@ long J2534Connection::PassThruReadMsgs(PASSTHRU_MSG *pMsg, unsigned long *pNumMs
 
 	unsigned long msgnum = 0;
 	while (msgnum < *pNumMsgs) {
-		if (Timeout > 0 && t.getTimePassed() >= Timeout) {
+		auto time_passed = t.getTimePassed();
+		if (Timeout > 0 && time_passed >= Timeout) {
 			err_code = ERR_TIMEOUT;
 			break;
 		}
 
 		//Synchronized won't work where we have to break out of a loop
 		messageRxBuff_mutex.lock();
-		if (this->messageRxBuff.empty()) {
+		unsigned long popped = this->popRxQueue(&pMsg[msgnum], *pNumMsgs - msgnum);
+		if (popped == 0) {
 			messageRxBuff_mutex.unlock();
 			if (Timeout == 0)
 				break;
-			Sleep(2);
+			//The event is only reset with the queue empty, under the lock, so a push can't be missed.
+			WaitForSingleObject(this->messageRxBuff_nonempty, (DWORD)(Timeout - time_passed));
 			continue;
 		}
 
-		auto msg_in = this->messageRxBuff.front();
-		this->messageRxBuff.pop();
+		msgnum += popped;
+		if (this->rxQueueEmpty())
+			ResetEvent(this->messageRxBuff_nonempty);
 		messageRxBuff_mutex.unlock();
+	}
 
+	if (msgnum == 0)
+		err_code = ERR_BUFFER_EMPTY;
+	//Whatever was read is still returned with it.
+	synchronized(messageRxBuff_mutex) {
+		if (this->rxOverflowed) {
+			this->rxOverflowed = FALSE;
+			err_code = ERR_BUFFER_OVERFLOW;
+		}
+	}
+	*pNumMsgs = msgnum;
+	return err_code;
+}
+
+//Drain as much as fits while holding the lock once. Only the used part of each
+//PASSTHRU_MSG is written, the copy per frame is a handful of bytes.
+unsigned long J2534Connection::popRxQueue(PASSTHRU_MSG *pMsg, unsigned long count) {
+	unsigned long msgnum = 0;
+	while (msgnum < count && !this->messageRxBuff.empty()) {
+		auto& msg_in = this->messageRxBuff.front();
 		PASSTHRU_MSG *msg_out = &pMsg[msgnum++];
 		msg_out->ProtocolID = this->ProtocolID;
 		msg_out->DataSize = msg_in.Data.size();
-		memcpy(msg_out->Data, msg_in.Data.c_str(), msg_in.Data.size());
-		msg_out->Timestamp = msg_in.Timestamp;
+		memcpy(msg_out->Data, msg_in.Data.data(), msg_in.Data.size());
+		msg_out->Timestamp = (unsigned long)msg_in.Timestamp;
 		msg_out->RxStatus = msg_in.RxStatus;
 		msg_out->ExtraDataIndex = msg_in.ExtraDataIndex;
 		msg_out->TxFlags = 0;
-		if (msgnum == *pNumMsgs) break;
+		PANDA_TRACE(panda::TRACE_RX_DEQUEUE, msg_in.id(), (uint16_t)msg_in.Data.size());
+		this->popRx(this->messageRxBuff);
 	}
+	return msgnum;
+}
 
-	if (msgnum == 0)
-		err_code = ERR_BUFFER_EMPTY;
-	*pNumMsgs = msgnum;
-	return err_code;
+bool J2534Connection::rxQueueEmpty() {
+	return this->messageRxBuff.empty();
+}
+
+void J2534Connection::resizeRxQueue(size_t len) {
+	this->resizeRx(this->messageRxBuff, len);
 }
 
 long J2534Connection::PassThruWriteMsgs(PASSTHRU_MSG *pMsg, unsigned long *pNumMsgs, unsigned long Timeout) {
 	//There doesn't seem to be much reason to implement the timeout here.
-	for (int msgnum = 0; msgnum < *pNumMsgs; msgnum++) {
-		PASSTHRU_MSG* msg = &pMsg[msgnum];
+	//Everything up to the first invalid message is sent.
+	long err_code = STATUS_NOERROR;
+	unsigned long valid = 0;
+	for (; valid < *pNumMsgs; valid++) {
+		PASSTHRU_MSG* msg = &pMsg[valid];
 		if (msg->ProtocolID != this->ProtocolID) {
-			*pNumMsgs = msgnum;
-			return ERR_MSG_PROTOCOL_ID;
+			err_code = ERR_MSG_PROTOCOL_ID;
+			break;
 		}
 
-		auto retcode = this->validateTxMsg(msg);
-		if (retcode != STATUS_NOERROR) {
-			*pNumMsgs = msgnum;
-			return retcode;
-		}
+		err_code = this->validateTxMsg(msg);
+		if (err_code != STATUS_NOERROR) break;
+	}
 
-		auto msgtx = this->parseMessageTx(*pMsg);
+	for (unsigned long msgnum = 0; msgnum < valid;) {
+		unsigned long count = min(valid - msgnum, this->getMaxTxBatch());
+		auto msgtx = (count > 1) ? this->parseMessageTxBatch(&pMsg[msgnum], count) : this->parseMessageTx(pMsg[msgnum]);
 		if (msgtx != nullptr) //Nullptr is supported for unimplemented connection types.
-			this->schedultMsgTx(std::dynamic_pointer_cast<Action>(msgtx));
+			this->schedultMsgTx(msgtx);
+		msgnum += count;
 	}
-	return STATUS_NOERROR;
+
+	*pNumMsgs = valid;
+	return err_code;
 }
 
 //The docs say that a device has to support 10 periodic messages, though more is ok.
@@ -88,15 +135,18 @@ long J2534Connection::PassThruStartPeriodicMsg(PASSTHRU_MSG *pMsg, unsigned long
 	if (TimeInterval < 5 || TimeInterval > 65535) return ERR_INVALID_TIME_INTERVAL;
 
 	for (int i = 0; i < this->periodicMessages.size(); i++) {
-		if (periodicMessages[i] != nullptr) continue;
+		if (periodicMessages[i] != nullptr || periodicDeviceSlots[i] != -1) continue;
 
 		*pMsgID = i;
+		periodicDeviceSlots[i] = this->startDevicePeriodicMsg(*pMsg, TimeInterval);
+		if (periodicDeviceSlots[i] != -1) return STATUS_NOERROR;
+
 		auto msgtx = this->parseMessageTx(*pMsg);
 		if (msgtx != nullptr) {
 			periodicMessages[i] = std::make_shared<MessagePeriodic>(std::chrono::microseconds(TimeInterval*1000), msgtx);
 			periodicMessages[i]->scheduleImmediate();
 			if (auto panda_dev = this->getPandaDev()) {
-				panda_dev->insertActionIntoTaskList(periodicMessages[i]);
+				periodicMessages[i]->task_handle = panda_dev->insertActionIntoTaskList(periodicMessages[i]);
 			}
 		}
 		return STATUS_NOERROR;
@@ -105,13 +155,28 @@ long J2534Connection::PassThruStartPeriodicMsg(PASSTHRU_MSG *pMsg, unsigned long
 }
 
 long J2534Connection::PassThruStopPeriodicMsg(unsigned long MsgID) {
-	if (MsgID >= this->periodicMessages.size() || this->periodicMessages[MsgID] == nullptr)
+	if (MsgID >= this->periodicMessages.size()) return ERR_INVALID_MSG_ID;
+	if (this->periodicDeviceSlots[MsgID] != -1) {
+		if (auto panda_dev = this->getPandaDev())
+			panda_dev->freePeriodicSlot(this->periodicDeviceSlots[MsgID]);
+		this->periodicDeviceSlots[MsgID] = -1;
+		return STATUS_NOERROR;
+	}
+	if (this->periodicMessages[MsgID] == nullptr)
 		return ERR_INVALID_MSG_ID;
 	this->periodicMessages[MsgID]->cancel();
 	this->periodicMessages[MsgID] = nullptr;
 	return STATUS_NOERROR;
 }
 
+long J2534Connection::getPeriodicStats(unsigned long MsgID, PANDA_PERIODIC_STATS* pStats) {
+	if (MsgID >= this->periodicMessages.size()) return ERR_INVALID_MSG_ID;
+	if (this->periodicDeviceSlots[MsgID] != -1) return ERR_NOT_SUPPORTED;
+	if (this->periodicMessages[MsgID] == nullptr) return ERR_INVALID_MSG_ID;
+	*pStats = this->periodicMessages[MsgID]->getStats();
+	return STATUS_NOERROR;
+}
+
 long J2534Connection::PassThruStartMsgFilter(unsigned long FilterType, PASSTHRU_MSG *pMaskMsg, PASSTHRU_MSG *pPatternMsg,
 	PASSTHRU_MSG *pFlowControlMsg, unsigned long *pFilterID) {
 	for (int i = 0; i < this->filters.size(); i++) {
@@ -127,6 +192,7 @@ long J2534Connection::PassThruStartMsgFilter(unsigned long FilterType, PASSTHRU_
 				}
 				*pFilterID = i;
 				filters[i] = newfilter;
+				this->filtersChanged();
 				return STATUS_NOERROR;
 			} catch (int e) {
 				return e;
@@ -140,6 +206,7 @@ long J2534Connection::PassThruStopMsgFilter(unsigned long FilterID) {
 	if (FilterID >= this->filters.size() || this->filters[FilterID] == nullptr)
 		return ERR_INVALID_FILTER_ID;
 	this->filters[FilterID] = nullptr;
+	this->filtersChanged();
 	return STATUS_NOERROR;
 }
 
@@ -147,13 +214,21 @@ long J2534Connection::PassThruIoctl(unsigned long IoctlID, void *pInput, void *p
 	return STATUS_NOERROR;
 }
 
+unsigned long J2534Connection::protocolPort(unsigned long ProtocolID) {
+	if (ProtocolID >= CAN_CH1 && ProtocolID < CAN_CH1 + PANDA_CAN_CHANNELS)
+		return ProtocolID - CAN_CH1;
+	if (ProtocolID >= ISO15765_CH1 && ProtocolID < ISO15765_CH1 + PANDA_CAN_CHANNELS)
+		return ProtocolID - ISO15765_CH1;
+	return 0;
+}
+
 long J2534Connection::init5b(SBYTE_ARRAY* pInput, SBYTE_ARRAY* pOutput) { return ERR_FAILED; }
 long J2534Connection::initFast(PASSTHRU_MSG* pInput, PASSTHRU_MSG* pOutput) { return ERR_FAILED; }
 long J2534Connection::clearTXBuff() {
 	if (auto panda_ps = this->panda_dev.lock()) {
 		synchronized(staged_writes_lock) {
-			this->txbuff = {};
-			panda_ps->panda->can_clear(panda::PANDA_CAN1_TX);
+			for (auto& lane : this->txbuff) lane = {};
+			panda_ps->panda->can_clear((panda::PANDA_CAN_PORT_CLEAR)this->port);
 		}
 	}
 	return STATUS_NOERROR;
@@ -161,7 +236,9 @@ long J2534Connection::clearTXBuff() {
 long J2534Connection::clearRXBuff() {
 	if (auto panda_ps = this->panda_dev.lock()) {
 		synchronized(messageRxBuff_mutex) {
-			this->messageRxBuff = {};
+			this->clearRx(this->messageRxBuff);
+			this->rxOverflowed = FALSE;
+			ResetEvent(this->messageRxBuff_nonempty);
 			panda_ps->panda->can_clear(panda::PANDA_CAN_RX);
 		}
 	}
@@ -169,6 +246,11 @@ long J2534Connection::clearRXBuff() {
 }
 long J2534Connection::clearPeriodicMsgs() {
 	for (int i = 0; i < this->periodicMessages.size(); i++) {
+		if (periodicDeviceSlots[i] != -1) {
+			if (auto panda_dev = this->getPandaDev())
+				panda_dev->freePeriodicSlot(periodicDeviceSlots[i]);
+			periodicDeviceSlots[i] = -1;
+		}
 		if (periodicMessages[i] == nullptr) continue;
 		this->periodicMessages[i]->cancel();
 		this->periodicMessages[i] = nullptr;
@@ -178,42 +260,70 @@ long J2534Connection::clearPeriodicMsgs() {
 }
 long J2534Connection::clearMsgFilters() {
 	for (auto& filter : this->filters) filter = nullptr;
+	this->filtersChanged();
 	return STATUS_NOERROR;
 }
 
+void J2534Connection::filtersChanged() {
+	if (auto panda_dev = this->getPandaDev())
+		panda_dev->rebuildDispatchIndex();
+}
+
 void J2534Connection::setBaud(unsigned long baud) {
 	this->BaudRate = baud;
 }
 
-void J2534Connection::schedultMsgTx(std::shared_ptr<Action> msgout) {
+void J2534Connection::schedultMsgTx(std::shared_ptr<MessageTx> msgout) {
 	if (auto panda_ps = this->panda_dev.lock()) {
 		synchronized(staged_writes_lock) {
-			this->txbuff.push(msgout);
-			panda_ps->registerConnectionTx(shared_from_this());
+			this->txbuff[msgout->txLane].push(msgout);
+			panda_ps->registerConnectionTx(shared_from_this(), msgout->txLane);
 		}
 	}
 }
 
-void J2534Connection::rescheduleExistingTxMsgs() {
+void J2534Connection::rescheduleExistingTxMsgs(unsigned int lane) {
 	if (auto panda_ps = this->panda_dev.lock()) {
 		synchronized(staged_writes_lock) {
-			panda_ps->unstallConnectionTx(shared_from_this());
+			panda_ps->unstallConnectionTx(shared_from_this(), lane);
 		}
 	}
 }
 
-//Works well as long as the protocol doesn't support flow control.
-void J2534Connection::processMessage(const J2534Frame& msg) {
-	FILTER_RESULT filter_res = FILTER_RESULT_NEUTRAL;
-
+void J2534Connection::getDispatchIds(std::vector<uint32_t>& ids, bool& wildcard) {
+	wildcard = FALSE;
 	for (auto filter : this->filters) {
 		if (filter == nullptr) continue;
-		FILTER_RESULT current_check_res = filter->check(msg);
-		if (current_check_res == FILTER_RESULT_BLOCK) return;
+		uint32_t id;
+		if (filter->get_exact_id(id))
+			ids.push_back(id);
+		else if (!filter->is_block())
+			wildcard = TRUE;
+	}
+}
+
+void J2534Connection::processCanMessage(const panda::PANDA_CAN_MSG& msg) {
+	J2534CanFrame raw(msg);
+	if (!this->filtersPass((const char*)raw.Data, raw.DataSize)) return;
+	PANDA_TRACE(panda::TRACE_FILTER_MATCH, msg.addr, 0);
+	addMsgToRxQueue(J2534Frame(msg));
+}
+
+bool J2534Connection::filtersPass(const char* data, size_t size) {
+	FILTER_RESULT filter_res = FILTER_RESULT_NEUTRAL;
+	for (auto& filter : this->filters) {
+		if (filter == nullptr) continue;
+		FILTER_RESULT current_check_res = filter->check(data, size);
+		if (current_check_res == FILTER_RESULT_BLOCK) return FALSE;
 		if (current_check_res == FILTER_RESULT_PASS) filter_res = FILTER_RESULT_PASS;
 	}
+	return filter_res == FILTER_RESULT_PASS;
+}
 
-	if (filter_res == FILTER_RESULT_PASS) {
+//Works well as long as the protocol doesn't support flow control.
+void J2534Connection::processMessage(const J2534Frame& msg) {
+	if (this->filtersPass(msg.Data.data(), msg.Data.size())) {
+		PANDA_TRACE(panda::TRACE_FILTER_MATCH, msg.id(), 0);
 		addMsgToRxQueue(msg);
 	}
 }
@@ -228,6 +338,31 @@ void J2534Connection::processIOCTLSetConfig(unsigned long Parameter, unsigned lo
 		break;
 	case ISO15765_WFT_MAX:
 		break;
+	case PANDA_RX_QUEUE_LEN:
+		if (Value == 0 || Value > PANDA_RX_QUEUE_LEN_MAX) throw ERR_INVALID_IOCTL_VALUE;
+		synchronized(messageRxBuff_mutex) {
+			this->rxQueueLen = Value;
+			this->resizeRxQueue(Value);
+		}
+		return;
+	case PANDA_RX_OVERFLOW:
+		if (Value != PANDA_RX_DROP_OLDEST && Value != PANDA_RX_DROP_NEWEST) throw ERR_INVALID_IOCTL_VALUE;
+		synchronized(messageRxBuff_mutex) {
+			this->rxOverflowPolicy = Value;
+		}
+		return;
+	case PANDA_RX_BUDGET:
+		if (Value == 0) throw ERR_INVALID_IOCTL_VALUE;
+		//What is already held past a lower limit is read or dropped as frames come.
+		this->rxBudget->limit = Value;
+		return;
+	case PANDA_RX_DROPPED:
+		throw ERR_NOT_SUPPORTED;
+	case PANDA_VBATT_MAX_AGE:
+		if (auto panda_ps = this->panda_dev.lock()) {
+			panda_ps->panda->set_health_max_age(Value);
+		}
+		return;
 	case NODE_ADDRESS:		// J1850PWM Related (Not supported by panda). HDS requires these to 'work'.
 	case NETWORK_LINE:
 	case P1_MIN:			// A bunch of stuff relating to ISO9141 and ISO14230 that the panda
@@ -275,6 +410,19 @@ unsigned long J2534Connection::processIOCTLGetConfig(unsigned long Parameter) {
 		return 80;
 	case SYNC_JUMP_WIDTH:
 		return 15;
+	case PANDA_RX_QUEUE_LEN:
+		return this->rxQueueLen;
+	case PANDA_RX_OVERFLOW:
+		return this->rxOverflowPolicy;
+	case PANDA_RX_BUDGET:
+		return (unsigned long)this->rxBudget->limit.load();
+	case PANDA_RX_DROPPED:
+		return this->rxDropped;
+	case PANDA_VBATT_MAX_AGE:
+		if (auto panda_ps = this->panda_dev.lock()) {
+			return panda_ps->panda->get_health_max_age();
+		}
+		return PANDA_HEALTH_MAX_AGE_MS;
 	default:
 		// HDS rarely reads off values through ioctl GET_CONFIG, but it often
 		// just wants the call to pass without erroring, so just don't do anything.
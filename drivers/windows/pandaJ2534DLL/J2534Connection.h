@@ -5,6 +5,7 @@
 #include "J2534Frame.h"
 #include "PandaJ2534Device.h"
 #include "J2534MessageFilter.h"
+#include "RxQueue.h"
 #include "MessagePeriodic.h"
 
 class J2534Frame;
@@ -12,6 +13,36 @@ class Action;
 class PandaJ2534Device;
 class J2534MessageFilter;
 
+//Vendor IOCTLs, J2534 leaves ids from 0x10000 up to the device maker.
+#define PANDA_GET_PERIODIC_STATS				0x00010000	// pInput = unsigned long MsgID, pOutput = PANDA_PERIODIC_STATS
+#define PANDA_TRACE_ENABLE						0x00010001	// pInput = unsigned long, nonzero starts a new trace, pOutput = NULL
+#define PANDA_TRACE_READ						0x00010002	// pInput = NULL, pOutput = SBYTE_ARRAY filled with panda::PANDA_TRACE_EVENT, NumOfBytes is updated
+#define PANDA_GET_TIME							0x00010003	// pInput = NULL, pOutput = PANDA_TIME
+#define PANDA_GET_FLOW_CONTROL_STATS			0x00010004	// pInput = NULL, pOutput = PANDA_FLOW_CONTROL_STATS, ISO15765 channels only
+#define PANDA_SET_THREAD_SCHEDULE				0x00010005	// pInput = PANDA_THREAD_SCHEDULE, pOutput = NULL, for every device of the process
+#define PANDA_GET_THREAD_STATS					0x00010006	// pInput = NULL or unsigned long, nonzero resets the wakeups, pOutput = PANDA_THREAD_STATS
+
+//Vendor SET_CONFIG/GET_CONFIG parameters, from the same range.
+#define PANDA_RX_QUEUE_LEN						0x00010000	// 1-PANDA_RX_QUEUE_LEN_MAX frames the channel holds for PassThruReadMsgs [PANDA_RX_QUEUE_LEN_DEFAULT]
+#define PANDA_RX_OVERFLOW						0x00010001	// 0 (PANDA_RX_DROP_OLDEST), 1 (PANDA_RX_DROP_NEWEST) [0]
+#define PANDA_RX_BUDGET							0x00010002	// Bytes all channels of the device hold, set from any of them [PANDA_RX_BUDGET_DEFAULT]
+#define PANDA_RX_DROPPED						0x00010003	// GET_CONFIG only, frames dropped since the channel was connected
+#define PANDA_VBATT_MAX_AGE						0x00010004	// ms READ_VBATT's voltage can be old, 0 reads it each call, set from any channel of the device [PANDA_HEALTH_MAX_AGE_MS]
+
+//Output of the PANDA_GET_FLOW_CONTROL_STATS IOCTL. The latency of a flow control is
+//from its first frame reaching the channel to the panda taking the reply off USB.
+typedef struct {
+	unsigned long Count;
+	unsigned long FailCount; //Replies the panda didn't take, not in the latencies
+	unsigned long LastUs;
+	unsigned long MaxUs;
+	unsigned long long TotalUs;
+} PANDA_FLOW_CONTROL_STATS;
+
+//The J2534-2 channels CAN_CH1 and ISO15765_CH1 on are the panda's buses, CAN_CH2 is
+//CAN2. Plain CAN and ISO15765 are CAN1.
+#define PANDA_CAN_CHANNELS 3
+
 #define check_bmask(num, mask)(((num) & mask) == mask)
 
 /**
@@ -29,7 +60,7 @@ public:
 		unsigned long Flags,
 		unsigned long BaudRate
 	);
-	virtual ~J2534Connection() {};
+	virtual ~J2534Connection();
 
 	//J2534 API functions
 
@@ -37,6 +68,10 @@ public:
 	long PassThruWriteMsgs(PASSTHRU_MSG *pMsg, unsigned long *pNumMsgs, unsigned long Timeout);
 	virtual long PassThruStartPeriodicMsg(PASSTHRU_MSG *pMsg, unsigned long *pMsgID, unsigned long TimeInterval);
 	virtual long PassThruStopPeriodicMsg(unsigned long MsgID);
+	//Timing of a periodic message sent by the host. Ones the panda sends itself have none.
+	long getPeriodicStats(unsigned long MsgID, PANDA_PERIODIC_STATS* pStats);
+	//How quickly the flow controls of received multi frame messages went out.
+	virtual long getFlowControlStats(PANDA_FLOW_CONTROL_STATS* pStats) { return ERR_NOT_SUPPORTED; };
 
 	virtual long PassThruStartMsgFilter(unsigned long FilterType, PASSTHRU_MSG *pMaskMsg, PASSTHRU_MSG *pPatternMsg,
 		PASSTHRU_MSG *pFlowControlMsg, unsigned long *pFilterID);
@@ -48,16 +83,25 @@ public:
 
 	virtual unsigned long  validateTxMsg(PASSTHRU_MSG* msg);
 	virtual std::shared_ptr<MessageTx> parseMessageTx(PASSTHRU_MSG& msg) { return nullptr; };
+	//Up to getMaxTxBatch() already validated messages sent as one.
+	virtual std::shared_ptr<MessageTx> parseMessageTxBatch(PASSTHRU_MSG* msgs, unsigned long count) { return nullptr; };
+
+	//Hand a periodic message to the panda instead of sending it from the host.
+	//Returns the panda slot, or -1 if the message has to be sent by a MessagePeriodic.
+	virtual int startDevicePeriodicMsg(PASSTHRU_MSG& msg, unsigned long TimeInterval) { return -1; };
 
 	//IOCTL functions
 
 	long init5b(SBYTE_ARRAY* pInput, SBYTE_ARRAY* pOutput);
 	long initFast(PASSTHRU_MSG* pInput, PASSTHRU_MSG* pOutput);
 	long clearTXBuff();
-	long clearRXBuff();
+	virtual long clearRXBuff();
 	long clearPeriodicMsgs();
 	long clearMsgFilters();
 
+	//After filters has changed, on the caller's thread.
+	virtual void filtersChanged();
+
 	virtual void setBaud(unsigned long baud);
 
 	unsigned long getBaud() {
@@ -72,11 +116,23 @@ public:
 		return FALSE;
 	}
 
+	virtual bool isProtoIso15765() {
+		return FALSE;
+	}
+
 	//Port is used in a protocol specific way to differentiate tranceivers.
 	unsigned long getPort() {
 		return this->port;
 	}
 
+	//The bus of a CAN protocol, the port.
+	panda::PANDA_CAN_PORT getCanBus() {
+		return (panda::PANDA_CAN_PORT)this->port;
+	}
+
+	//The port of a protocol, the bus of a CAN_CH or ISO15765_CH channel, 0 for the rest.
+	static unsigned long protocolPort(unsigned long ProtocolID);
+
 	virtual void processIOCTLSetConfig(unsigned long Parameter, unsigned long Value);
 
 	virtual unsigned long processIOCTLGetConfig(unsigned long Parameter);
@@ -85,6 +141,15 @@ public:
 	//Loopback messages are processed separately.
 	virtual void processMessage(const J2534Frame& msg);
 
+	//Called by the device for each received frame the dispatch index sends here.
+	//The default runs the filters on the raw bytes, and only a frame they pass
+	//is wrapped in a J2534Frame for the RX queue.
+	virtual void processCanMessage(const panda::PANDA_CAN_MSG& msg);
+
+	//CAN ids processMessage can accept, for the device dispatch index. wildcard is
+	//set if a filter doesn't pin the id, and the connection needs every frame.
+	void getDispatchIds(std::vector<uint32_t>& ids, bool& wildcard);
+
 	//Limitations on message size. Override in every subclass.
 
 	virtual unsigned long getMinMsgLen() {
@@ -99,11 +164,16 @@ public:
 		return 12;
 	}
 
+	//Messages PassThruWriteMsgs can hand to parseMessageTxBatch at once. 1 turns batching off.
+	virtual unsigned long getMaxTxBatch() {
+		return 1;
+	}
+
 	//Add an Action to the Task Queue for future processing.
 	//The task should be set its expire time before being submitted.
-	void schedultMsgTx(std::shared_ptr<Action> msgout);
+	void schedultMsgTx(std::shared_ptr<MessageTx> msgout);
 
-	void rescheduleExistingTxMsgs();
+	void rescheduleExistingTxMsgs(unsigned int lane);
 
 	std::shared_ptr<PandaJ2534Device> getPandaDev() {
 		if (auto panda_dev_sp = this->panda_dev.lock())
@@ -112,15 +182,72 @@ public:
 	}
 
 	//Add a message to the queue read by PassThruReadMsgs().
-	void addMsgToRxQueue(const J2534Frame& frame) {
+	virtual void addMsgToRxQueue(const J2534Frame& frame) {
+		PANDA_TRACE(panda::TRACE_RX_ENQUEUE, frame.id(), (uint16_t)frame.Data.size());
 		synchronized(messageRxBuff_mutex) {
-			messageRxBuff.push(frame);
+			this->pushRx(this->messageRxBuff, frame);
 		}
 	}
 
 	bool loopback = FALSE;
 
 protected:
+	//Move up to count messages from the RX queue into pMsg. Called with messageRxBuff_mutex held.
+	virtual unsigned long popRxQueue(PASSTHRU_MSG *pMsg, unsigned long count);
+	virtual bool rxQueueEmpty();
+	//TRUE if a pass filter matches and no block filter does.
+	bool filtersPass(const char* data, size_t size);
+	//Frees or drops what the RX queue holds past len, then sets its capacity. Called with messageRxBuff_mutex held.
+	virtual void resizeRxQueue(size_t len);
+
+	//Queue a received frame, dropping by rxOverflowPolicy when the ring or the
+	//device's budget is full. Called with messageRxBuff_mutex held.
+	template<typename T>
+	void pushRx(RxRing<T>& ring, const T& frame) {
+		size_t bytes = rxFrameBytes(frame);
+		bool room = !ring.full() || (this->rxOverflowPolicy == PANDA_RX_DROP_OLDEST && this->dropRx(ring));
+		while (room && !this->rxBudget->take(bytes))
+			room = this->rxOverflowPolicy == PANDA_RX_DROP_OLDEST && this->dropRx(ring);
+		if (!room) {
+			this->rxDropped++;
+			this->rxOverflowed = TRUE;
+			return;
+		}
+		ring.push_back(frame);
+		this->rxBytes += bytes;
+		SetEvent(messageRxBuff_nonempty);
+	}
+
+	//The oldest frame, when it was read or dropped.
+	template<typename T>
+	void popRx(RxRing<T>& ring) {
+		size_t bytes = rxFrameBytes(ring.front());
+		this->rxBudget->give(bytes);
+		this->rxBytes -= bytes;
+		ring.pop_front();
+	}
+
+	template<typename T>
+	bool dropRx(RxRing<T>& ring) {
+		if (ring.empty()) return FALSE;
+		this->popRx(ring);
+		this->rxDropped++;
+		this->rxOverflowed = TRUE;
+		return TRUE;
+	}
+
+	template<typename T>
+	void clearRx(RxRing<T>& ring) {
+		while (!ring.empty()) this->popRx(ring);
+		ring.clear();
+	}
+
+	template<typename T>
+	void resizeRx(RxRing<T>& ring, size_t len) {
+		while (ring.size() > len) this->dropRx(ring);
+		ring.resize(len);
+	}
+
 	unsigned long ProtocolID;
 	unsigned long Flags;
 	unsigned long BaudRate;
@@ -129,12 +256,23 @@ protected:
 	std::weak_ptr<PandaJ2534Device> panda_dev;
 
 	Mutex messageRxBuff_mutex;
-	std::queue<J2534Frame> messageRxBuff;
+	RxRing<J2534Frame> messageRxBuff;
+	HANDLE messageRxBuff_nonempty; //Manual reset, set while messageRxBuff has messages
+	//The rest of the RX state is guarded by messageRxBuff_mutex too.
+	std::shared_ptr<RxBudget> rxBudget; //The device's, it outlives a closed device
+	size_t rxBytes; //What this channel holds of the budget
+	unsigned long rxQueueLen;
+	unsigned long rxOverflowPolicy;
+	unsigned long rxDropped;
+	BOOL rxOverflowed; //Since the last PassThruReadMsgs, which reports ERR_BUFFER_OVERFLOW
 
 	std::array<std::shared_ptr<J2534MessageFilter>, 10> filters;
-	std::queue<std::shared_ptr<Action>> txbuff;
+	//One TX queue per filter, plus one for messages that don't use a filter.
+	//Only the front of each queue is in progress.
+	std::array<std::queue<std::shared_ptr<Action>>, 11> txbuff;
 
 	std::array<std::shared_ptr<MessagePeriodic>, 10> periodicMessages;
+	std::array<int, 10> periodicDeviceSlots; //-1 if not sent by the panda
 
 private:
 	Mutex staged_writes_lock;
@@ -8,13 +8,13 @@ J2534Connection_CAN::J2534Connection_CAN(
 		unsigned long ProtocolID,
 		unsigned long Flags,
 		unsigned long BaudRate
-	) : J2534Connection(panda_dev, ProtocolID, Flags, BaudRate) {
-	this->port = 0;
+	) : J2534Connection(panda_dev, ProtocolID, Flags, BaudRate), rawRxBuff(PANDA_RX_QUEUE_LEN_DEFAULT, J2534CanFrame()) {
+	this->messageRxBuff.resize(0); //Frames go to rawRxBuff instead
 
 	if (BaudRate % 100 || BaudRate < 10000 || BaudRate > 5000000)
 		throw ERR_INVALID_BAUDRATE;
 
-	panda_dev->panda->set_can_speed_cbps(panda::PANDA_CAN1, BaudRate/100);
+	panda_dev->panda->set_can_speed_cbps(this->getCanBus(), BaudRate/100);
 };
 
 unsigned long J2534Connection_CAN::validateTxMsg(PASSTHRU_MSG* msg) {
@@ -28,14 +28,99 @@ std::shared_ptr<MessageTx> J2534Connection_CAN::parseMessageTx(PASSTHRU_MSG& msg
 	return std::dynamic_pointer_cast<MessageTx>(std::make_shared<MessageTx_CAN>(shared_from_this(), msg));
 }
 
+std::shared_ptr<MessageTx> J2534Connection_CAN::parseMessageTxBatch(PASSTHRU_MSG* msgs, unsigned long count) {
+	return std::dynamic_pointer_cast<MessageTx>(std::make_shared<MessageTx_CANBatch>(shared_from_this(), msgs, count));
+}
+
+//The panda times periodic messages itself, so they don't depend on the host's scheduling.
+//Looped back messages still need the host, the panda doesn't report its own sends as received.
+int J2534Connection_CAN::startDevicePeriodicMsg(PASSTHRU_MSG& msg, unsigned long TimeInterval) {
+	if (this->loopback) return -1;
+	auto panda_dev = this->getPandaDev();
+	if (panda_dev == nullptr) return -1;
+
+	int slot = panda_dev->allocPeriodicSlot();
+	if (slot == -1) return -1;
+
+	uint32_t addr = ((uint8_t)msg.Data[0]) << 24 | ((uint8_t)msg.Data[1]) << 16 |
+		((uint8_t)msg.Data[2]) << 8 | ((uint8_t)msg.Data[3]);
+	if (!panda_dev->panda->set_can_periodic(slot, addr, check_bmask(msg.TxFlags, CAN_29BIT_ID),
+		(const uint8_t*)&msg.Data[4], (uint8_t)(msg.DataSize - 4), this->getCanBus(), (uint16_t)TimeInterval)) {
+		panda_dev->freePeriodicSlot(slot);
+		return -1;
+	}
+	return slot;
+}
+
 void J2534Connection_CAN::setBaud(unsigned long BaudRate) {
 	if (auto panda_dev = this->getPandaDev()) {
 		if (BaudRate % 100 || BaudRate < 10000 || BaudRate > 5000000)
 			throw ERR_NOT_SUPPORTED;
 
-		panda_dev->panda->set_can_speed_cbps(panda::PANDA_CAN1, (uint16_t)(BaudRate / 100));
+		panda_dev->panda->set_can_speed_cbps(this->getCanBus(), (uint16_t)(BaudRate / 100));
 		return J2534Connection::setBaud(BaudRate);
 	} else {
 		throw ERR_DEVICE_NOT_CONNECTED;
 	}
 }
+
+void J2534Connection_CAN::processCanMessage(const panda::PANDA_CAN_MSG& msg) {
+	J2534CanFrame frame(msg);
+	if (this->filtersPass((const char*)frame.Data, frame.DataSize)) {
+		PANDA_TRACE(panda::TRACE_FILTER_MATCH, msg.addr, 0);
+		this->pushRawRx(frame);
+	}
+}
+
+//Loopback echoes, so they stay in order with the received frames.
+void J2534Connection_CAN::addMsgToRxQueue(const J2534Frame& frame) {
+	J2534CanFrame raw;
+	raw.DataSize = (uint8_t)min(frame.Data.size(), sizeof(raw.Data));
+	memcpy(raw.Data, frame.Data.data(), raw.DataSize);
+	raw.Flags = (check_bmask(frame.RxStatus, CAN_29BIT_ID) ? J2534CanFrame::FLAG_29BIT : 0) |
+		(check_bmask(frame.RxStatus, TX_MSG_TYPE) ? J2534CanFrame::FLAG_TX_ECHO : 0);
+	raw.Timestamp = frame.Timestamp;
+	this->pushRawRx(raw);
+}
+
+long J2534Connection_CAN::clearRXBuff() {
+	synchronized(messageRxBuff_mutex) {
+		this->clearRx(this->rawRxBuff);
+		return J2534Connection::clearRXBuff();
+	}
+	return STATUS_NOERROR;
+}
+
+void J2534Connection_CAN::pushRawRx(const J2534CanFrame& frame) {
+	PANDA_TRACE(panda::TRACE_RX_ENQUEUE, frame.id(), frame.DataSize);
+	synchronized(messageRxBuff_mutex) {
+		this->pushRx(this->rawRxBuff, frame);
+	}
+}
+
+//The PASSTHRU_MSG is only built here, straight from the ring.
+unsigned long J2534Connection_CAN::popRxQueue(PASSTHRU_MSG *pMsg, unsigned long count) {
+	unsigned long msgnum = 0;
+	while (msgnum < count && !this->rawRxBuff.empty()) {
+		auto& msg_in = this->rawRxBuff.front();
+		PASSTHRU_MSG *msg_out = &pMsg[msgnum++];
+		msg_out->ProtocolID = this->ProtocolID;
+		msg_out->RxStatus = msg_in.RxStatus();
+		msg_out->TxFlags = 0;
+		msg_out->Timestamp = (unsigned long)msg_in.Timestamp;
+		msg_out->DataSize = msg_in.DataSize;
+		msg_out->ExtraDataIndex = msg_in.DataSize;
+		memcpy(msg_out->Data, msg_in.Data, msg_in.DataSize);
+		PANDA_TRACE(panda::TRACE_RX_DEQUEUE, msg_in.id(), msg_in.DataSize);
+		this->popRx(this->rawRxBuff);
+	}
+	return msgnum;
+}
+
+bool J2534Connection_CAN::rxQueueEmpty() {
+	return this->rawRxBuff.empty();
+}
+
+void J2534Connection_CAN::resizeRxQueue(size_t len) {
+	this->resizeRx(this->rawRxBuff, len);
+}
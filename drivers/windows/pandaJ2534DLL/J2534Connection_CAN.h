@@ -18,8 +18,19 @@ public:
 
 	virtual std::shared_ptr<MessageTx> parseMessageTx(PASSTHRU_MSG& pMsg);
 
+	virtual std::shared_ptr<MessageTx> parseMessageTxBatch(PASSTHRU_MSG* msgs, unsigned long count);
+
+	virtual int startDevicePeriodicMsg(PASSTHRU_MSG& msg, unsigned long TimeInterval);
+
 	virtual void setBaud(unsigned long baud);
 
+	//Received frames skip J2534Frame, they are filtered and queued as J2534CanFrame.
+	virtual void processCanMessage(const panda::PANDA_CAN_MSG& msg);
+
+	virtual void addMsgToRxQueue(const J2534Frame& frame);
+
+	virtual long clearRXBuff();
+
 	virtual unsigned long getMinMsgLen() {
 		return 4;
 	}
@@ -32,6 +43,11 @@ public:
 		return 12;
 	}
 
+	//As many as the panda writer puts in one transfer.
+	virtual unsigned long getMaxTxBatch() {
+		return CAN_TX_COALESCE_MAX;
+	}
+
 	virtual bool isProtoCan() {
 		return TRUE;
 	}
@@ -40,4 +56,14 @@ public:
 		return (this->Flags & CAN_29BIT_ID) == CAN_29BIT_ID;
 	}
 
+protected:
+	virtual unsigned long popRxQueue(PASSTHRU_MSG *pMsg, unsigned long count);
+	virtual bool rxQueueEmpty();
+	virtual void resizeRxQueue(size_t len);
+
+private:
+	void pushRawRx(const J2534CanFrame& frame);
+
+	//Received frames in arrival order, guarded by messageRxBuff_mutex. Takes the place of messageRxBuff.
+	RxRing<J2534CanFrame> rawRxBuff;
 };
\ No newline at end of file
@@ -2,6 +2,7 @@
 #include "J2534Connection_ISO15765.h"
 #include "Timer.h"
 #include "constants_ISO15765.h"
+#include "panda_shared/isotp.h"
 #include <chrono>
 
 J2534Connection_ISO15765::J2534Connection_ISO15765(
@@ -10,12 +11,10 @@ J2534Connection_ISO15765::J2534Connection_ISO15765(
 	unsigned long Flags,
 	unsigned long BaudRate
 ) : J2534Connection(panda_dev, ProtocolID, Flags, BaudRate), wftMax(0) {
-	this->port = 0;
-
 	if (BaudRate % 100 || BaudRate < 10000 || BaudRate > 5000000)
 		throw ERR_INVALID_BAUDRATE;
 
-	panda_dev->panda->set_can_speed_cbps(panda::PANDA_CAN1, (uint16_t)(BaudRate / 100));
+	panda_dev->panda->set_can_speed_cbps(this->getCanBus(), (uint16_t)(BaudRate / 100));
 }
 
 unsigned long J2534Connection_ISO15765::validateTxMsg(PASSTHRU_MSG* msg) {
@@ -24,19 +23,22 @@ unsigned long J2534Connection_ISO15765::validateTxMsg(PASSTHRU_MSG* msg) {
 		(val_is_29bit(msg->TxFlags) != this->_is_29bit() && !check_bmask(this->Flags, CAN_ID_BOTH))))
 		return ERR_INVALID_MSG;
 
-	int fid = get_matching_out_fc_filter_id(std::string((const char*)msg->Data, msg->DataSize), msg->TxFlags, 0xFFFFFFFF);
+	int fid = get_matching_out_fc_filter_id((const char*)msg->Data, msg->DataSize, msg->TxFlags);
 	if (msg->DataSize > getMaxMsgSingleFrameLen() && fid == -1) return ERR_NO_FLOW_CONTROL; //11 bytes (4 for CANid, 7 payload) is max length of input frame.
 
 	return STATUS_NOERROR;
 }
 
 std::shared_ptr<MessageTx> J2534Connection_ISO15765::parseMessageTx(PASSTHRU_MSG& msg) {
-	int fid = get_matching_out_fc_filter_id(std::string((const char*)msg.Data, msg.DataSize), msg.TxFlags, 0xFFFFFFFF);
+	int fid = get_matching_out_fc_filter_id((const char*)msg.Data, msg.DataSize, msg.TxFlags);
 	if (msg.DataSize > getMaxMsgSingleFrameLen() && fid == -1) 1;
 
-	return std::dynamic_pointer_cast<MessageTx>(
+	auto msgtx = std::dynamic_pointer_cast<MessageTx>(
 		std::make_shared<MessageTx_ISO15765>(shared_from_this(), msg, (fid == -1) ? nullptr : this->filters[fid])
 		);
+	//Each flow control filter is a separate conversation with its own flow control state.
+	msgtx->txLane = (fid == -1) ? (unsigned int)this->filters.size() : fid;
+	return msgtx;
 }
 
 //https://happilyembedded.wordpress.com/2016/02/15/can-multiple-frame-transmission/
@@ -45,34 +47,45 @@ void J2534Connection_ISO15765::processMessage(const J2534Frame& msg) {
 
 	int fid = get_matching_in_fc_filter_id(msg, this->Flags);
 	if (fid == -1) return;
+	this->processFrame(msg, fid);
+}
+
+void J2534Connection_ISO15765::processCanMessage(const panda::PANDA_CAN_MSG& msg) {
+	J2534CanFrame raw(msg);
+	int fid = get_matching_in_fc_filter_id((const char*)raw.Data, raw.DataSize, raw.RxStatus(), this->Flags);
+	if (fid == -1) return;
+	this->processFrame(J2534Frame(msg), fid);
+}
+
+void J2534Connection_ISO15765::processFrame(const J2534Frame& msg, int fid) {
+	PANDA_TRACE(panda::TRACE_FILTER_MATCH, msg.id(), (uint16_t)fid);
 
 	auto filter = this->filters[fid];
 	bool is_ext_addr = check_bmask(filter->flags, ISO15765_ADDR_TYPE);
 	uint8_t addrlen = is_ext_addr ? 5 : 4;
+	if (msg.Data.size() < addrlen + 1) return;
+	uint64_t rx_key = rxConversationKey(msg, is_ext_addr);
 
 	switch (msg_get_type(msg, addrlen)) {
 	case FRAME_FLOWCTRL:
 		{
-			if (this->txbuff.size() == 0)
+			//Flow control goes to the conversation using the same filter.
+			auto& lane = this->txbuff[fid];
+			if (lane.size() == 0)
 				return;
 			if (msg.Data.size() < addrlen + 3) return;
 			uint8_t flow_status = msg.Data[addrlen] & 0x0F;
 			uint8_t block_size = msg.Data[addrlen + 1];
 			uint8_t st_min = msg.Data[addrlen + 2];
 
-			auto txConvo = std::static_pointer_cast<MessageTx_ISO15765>(this->txbuff.front());
+			auto txConvo = std::static_pointer_cast<MessageTx_ISO15765>(lane.front());
 			switch (flow_status) {
 			case FLOWCTRL_CONTINUE: {
-				if (st_min > 0xF9) break;
-				if (st_min >= 0xf1 && st_min <= 0xf9) {
-					txConvo->flowControlContinue(block_size, std::chrono::microseconds((st_min & 0x0F) * 100));
-				} else if(st_min <= 0x7f) {
-					txConvo->flowControlContinue(block_size, std::chrono::microseconds(st_min * 1000));
-				} else {
-					break;
-				}
+				unsigned long separation_us;
+				if (!panda::isotp::st_min_us(st_min, separation_us)) break;
+				txConvo->flowControlContinue(block_size, std::chrono::microseconds(separation_us));
 				txConvo->scheduleImmediate();
-				this->rescheduleExistingTxMsgs();
+				this->rescheduleExistingTxMsgs(fid);
 				break;
 			}
 			case FLOWCTRL_WAIT:
@@ -86,7 +99,7 @@ void J2534Connection_ISO15765::processMessage(const J2534Frame& msg) {
 		}
 	case FRAME_SINGLE:
 		{
-			this->rxConversations[fid] = nullptr; //Reset any current transaction.
+			this->rxConversations.remove(rx_key); //Reset any current transaction.
 
 			if (is_ext_addr) {
 				if ((msg.Data[5] & 0x0F) > 6) return;
@@ -94,7 +107,7 @@ void J2534Connection_ISO15765::processMessage(const J2534Frame& msg) {
 				if ((msg.Data[4] & 0x0F) > 7) return;
 			}
 
-			J2534Frame outframe(ISO15765, msg.RxStatus, 0, msg.Timestamp);
+			J2534Frame outframe(this->ProtocolID, msg.RxStatus, 0, msg.Timestamp);
 			if (msg.Data.size() != 8 && check_bmask(this->Flags, ISO15765_FRAME_PAD))
 				outframe.RxStatus |= ISO15765_PADDING_ERROR;
 			if (is_ext_addr)
@@ -111,59 +124,67 @@ void J2534Connection_ISO15765::processMessage(const J2534Frame& msg) {
 				//A frame was received that could have held more data.
 				//No examples of this protocol show that happening, so
 				//it will be assumed that it is grounds to reset rx.
-				this->rxConversations[fid] = nullptr;
+				this->rxConversations.remove(rx_key);
 				return;
 			}
 
-			J2534Frame outframe(ISO15765, msg.RxStatus | START_OF_MESSAGE, 0, msg.Timestamp);
+			Timer fc_timer;
+			J2534Frame outframe(this->ProtocolID, msg.RxStatus | START_OF_MESSAGE, 0, msg.Timestamp);
 			if (is_ext_addr)
 				outframe.RxStatus |= ISO15765_ADDR_TYPE;
 			outframe.Data = msg.Data.substr(0, addrlen);
 
+			auto convo = this->rxConversations.start(rx_key);
+			if (convo == nullptr) return; //Too many senders at once, no flow control so the sender gives up.
+
 			addMsgToRxQueue(outframe);
 
-			this->rxConversations[fid] = std::make_shared<MessageRx>(
-				((msg.Data[addrlen] & 0x0F) << 8) | msg.Data[addrlen + 1],
+			convo->reset(
+				((msg.Data[addrlen] & 0x0F) << 8) | (uint8_t)msg.Data[addrlen + 1],
 				msg.Data.substr(addrlen + 2, 12 - (addrlen + 2)),
 				msg.RxStatus, filter);
 
-			//TODO maybe the flow control should also be scheduled in the TX list.
-			//Doing it this way because the filter can be 5 bytes in ext address mode.
-			std::string flowfilter = filter->get_flowctrl();
-			uint32_t flow_addr = (((uint8_t)flowfilter[0]) << 24) | ((uint8_t)(flowfilter[1]) << 16) | ((uint8_t)(flowfilter[2]) << 8) | ((uint8_t)flowfilter[3]);
-
-			std::string flowstrlresp;
-			if (flowfilter.size() > 4)
-				flowstrlresp += flowfilter[4];
-			flowstrlresp += std::string("\x30\x00\x00", 3);
-			if (check_bmask(filter->flags, ISO15765_FRAME_PAD)) {
-				flowstrlresp += std::string(8 - flowstrlresp.size(), '\x00');
-			}
+			//Sent from here rather than the TX list, the sender's N_Bs timer is running. It skips
+			//the writer thread's queue and is urgent, so a bus the panda sends by priority
+			//sends it ahead of what's queued. The filter can be 5 bytes in ext address mode.
+			uint32_t flow_addr;
+			int flow_ext_addr;
+			if (!filter->get_flowctrl_id(flow_addr, flow_ext_addr)) return;
+
+			uint8_t flowstrlresp[8] = {};
+			uint8_t flowlen = 0;
+			if (flow_ext_addr != -1)
+				flowstrlresp[flowlen++] = (uint8_t)flow_ext_addr;
+			flowstrlresp[flowlen] = 0x30;
+			flowlen += 3;
+			if (check_bmask(filter->flags, ISO15765_FRAME_PAD))
+				flowlen = 8;
 
 			if (auto panda_dev_sp = this->panda_dev.lock()) {
-				panda_dev_sp->panda->can_send(flow_addr, val_is_29bit(msg.RxStatus), (const uint8_t *)flowstrlresp.c_str(), (uint8_t)flowstrlresp.size(), panda::PANDA_CAN1);
+				bool sent = panda_dev_sp->panda->can_send_urgent(flow_addr, val_is_29bit(msg.RxStatus), flowstrlresp, flowlen, this->getCanBus());
+				this->recordFlowControl(sent, fc_timer.getTimePassedUs());
 			}
 			break;
 		}
 	case FRAME_CONSEC:
 		{
-			auto& convo = this->rxConversations[fid];
+			auto convo = this->rxConversations.find(rx_key);
 			if (convo == nullptr) return;
 
 			if (!convo->rx_add_frame(msg.Data[addrlen], (is_ext_addr ? 6 : 7), msg.Data.substr(addrlen + 1))) {
 				//Delete this conversation.
-				convo = nullptr;
+				this->rxConversations.remove(rx_key);
 				return;
 			}
 
-			std::string final_msg;
-			if (convo->flush_result(final_msg)) {
-				convo = nullptr;
-				J2534Frame outframe(ISO15765, msg.RxStatus, 0, msg.Timestamp);
+			if (convo->is_ready()) {
+				J2534Frame outframe(this->ProtocolID, msg.RxStatus, 0, msg.Timestamp);
 				if (is_ext_addr)
 					outframe.RxStatus |= ISO15765_ADDR_TYPE;
-				outframe.Data = msg.Data.substr(0, addrlen) + final_msg;
+				outframe.Data = msg.Data.substr(0, addrlen);
+				convo->flush_result(outframe.Data);
 				outframe.ExtraDataIndex = outframe.Data.size();
+				this->rxConversations.remove(rx_key);
 
 				addMsgToRxQueue(outframe);
 			}
@@ -172,12 +193,40 @@ void J2534Connection_ISO15765::processMessage(const J2534Frame& msg) {
 	}
 }
 
+uint64_t J2534Connection_ISO15765::rxConversationKey(const J2534Frame& msg, bool is_ext_addr) {
+	uint64_t key = ((uint64_t)(uint8_t)msg.Data[0] << 24) | ((uint8_t)msg.Data[1] << 16) |
+		((uint8_t)msg.Data[2] << 8) | (uint8_t)msg.Data[3];
+	key = (key << 1) | (check_bmask(msg.RxStatus, CAN_29BIT_ID) ? 1 : 0);
+	return (key << 9) | (is_ext_addr ? (0x100 | (uint8_t)msg.Data[4]) : 0);
+}
+
+void J2534Connection_ISO15765::recordFlowControl(bool sent, unsigned long long latency_us) {
+	synchronized(fcStats_mutex) {
+		if (sent) {
+			this->fcStats.Count++;
+			this->fcStats.LastUs = (unsigned long)latency_us;
+			if (latency_us > this->fcStats.MaxUs)
+				this->fcStats.MaxUs = (unsigned long)latency_us;
+			this->fcStats.TotalUs += latency_us;
+		} else {
+			this->fcStats.FailCount++;
+		}
+	}
+}
+
+long J2534Connection_ISO15765::getFlowControlStats(PANDA_FLOW_CONTROL_STATS* pStats) {
+	synchronized(fcStats_mutex) {
+		*pStats = this->fcStats;
+	}
+	return STATUS_NOERROR;
+}
+
 void J2534Connection_ISO15765::setBaud(unsigned long BaudRate) {
 	if (auto panda_dev = this->getPandaDev()) {
 		if (BaudRate % 100 || BaudRate < 10000 || BaudRate > 5000000)
 			throw ERR_NOT_SUPPORTED;
 
-		panda_dev->panda->set_can_speed_cbps(panda::PANDA_CAN1, (uint16_t)(BaudRate / 100));
+		panda_dev->panda->set_can_speed_cbps(this->getCanBus(), (uint16_t)(BaudRate / 100));
 		return J2534Connection::setBaud(BaudRate);
 	} else {
 		throw ERR_DEVICE_NOT_CONNECTED;
@@ -191,27 +240,79 @@ long J2534Connection_ISO15765::PassThruStartMsgFilter(unsigned long FilterType,
 	return J2534Connection::PassThruStartMsgFilter(FilterType, pMaskMsg, pPatternMsg, pFlowControlMsg, pFilterID);
 }
 
-int J2534Connection_ISO15765::get_matching_out_fc_filter_id(const std::string& msgdata, unsigned long flags, unsigned long flagmask) {
-	for (unsigned int i = 0; i < this->filters.size(); i++) {
-		if (this->filters[i] == nullptr) continue;
-		auto filter = this->filters[i]->get_flowctrl();
-		if (filter == msgdata.substr(0, filter.size()) &&
-			(this->filters[i]->flags & flagmask) == (flags & flagmask))
-			return i;
+uint64_t J2534Connection_ISO15765::fcKey(uint32_t id, bool is_29bit, int ext_addr) {
+	uint64_t key = ((uint64_t)id << 1) | (is_29bit ? 1 : 0);
+	return (key << 9) | ((ext_addr != -1) ? (0x100 | (uint8_t)ext_addr) : 0);
+}
+
+void J2534Connection_ISO15765::filtersChanged() {
+	auto index = std::make_shared<FcIndex>();
+	for (int i = 0; i < (int)this->filters.size(); i++) {
+		auto filter = this->filters[i];
+		if (filter == nullptr) continue;
+		uint32_t id;
+		int ext_addr;
+		if (filter->get_flowctrl_id(id, ext_addr))
+			index->out[fcKey(id, check_bmask(filter->flags, CAN_29BIT_ID), ext_addr)].push_back(i);
+		if (filter->get_exact_id(id))
+			index->in[id].push_back(i);
+		else
+			index->in_any.push_back(i);
 	}
-	return -1;
+	synchronized_exclusive(fcIndex_mutex) {
+		this->fcIndex = index;
+	}
+	J2534Connection::filtersChanged();
 }
 
-int J2534Connection_ISO15765::get_matching_in_fc_filter_id(const J2534Frame& msg, unsigned long flagmask) {
-	for (unsigned int i = 0; i < this->filters.size(); i++) {
-		if (this->filters[i] == nullptr) continue;
-		if (this->filters[i]->check(msg) == FILTER_RESULT_MATCH &&
-			(this->filters[i]->flags & flagmask) == (msg.RxStatus & flagmask))
-			return i;
+std::shared_ptr<const J2534Connection_ISO15765::FcIndex> J2534Connection_ISO15765::getFcIndex() {
+	synchronized_shared(fcIndex_mutex) {
+		return this->fcIndex;
+	}
+	return nullptr;
+}
+
+//A flow control message is 4 bytes of id, and the extended address with ISO15765_ADDR_TYPE,
+//and its flags have to match all of the message's.
+int J2534Connection_ISO15765::get_matching_out_fc_filter_id(const char* data, size_t size, unsigned long flags) {
+	bool is_ext_addr = check_bmask(flags, ISO15765_ADDR_TYPE);
+	if (size < (is_ext_addr ? 5u : 4u)) return -1;
+	uint32_t id = ((uint8_t)data[0]) << 24 | ((uint8_t)data[1]) << 16 | ((uint8_t)data[2]) << 8 | ((uint8_t)data[3]);
+
+	auto index = this->getFcIndex();
+	auto found = index->out.find(fcKey(id, val_is_29bit(flags), is_ext_addr ? (uint8_t)data[4] : -1));
+	if (found == index->out.end()) return -1;
+	for (int i : found->second) {
+		auto filter = this->filters[i];
+		if (filter != nullptr && filter->flags == flags) return i;
 	}
 	return -1;
 }
 
+int J2534Connection_ISO15765::get_matching_in_fc_filter_id(const char* data, size_t size, unsigned long rx_status, unsigned long flagmask) {
+	auto index = this->getFcIndex();
+	int best = -1;
+	auto first_match = [&](const std::vector<int>& ids) {
+		for (int i : ids) {
+			if (best != -1 && i >= best) return;
+			auto filter = this->filters[i];
+			if (filter == nullptr) continue;
+			if (filter->check(data, size) == FILTER_RESULT_MATCH &&
+				(filter->flags & flagmask) == (rx_status & flagmask)) {
+				best = i;
+				return;
+			}
+		}
+	};
+	if (size >= 4) {
+		uint32_t id = ((uint8_t)data[0]) << 24 | ((uint8_t)data[1]) << 16 | ((uint8_t)data[2]) << 8 | ((uint8_t)data[3]);
+		auto found = index->in.find(id);
+		if (found != index->in.end()) first_match(found->second);
+	}
+	first_match(index->in_any);
+	return best;
+}
+
 void J2534Connection_ISO15765::processIOCTLSetConfig(unsigned long Parameter, unsigned long Value) {
 	switch (Parameter) {
 	case ISO15765_WFT_MAX:
@@ -1,5 +1,6 @@
 #pragma once
 #include <string>
+#include <unordered_map>
 #include "J2534Connection.h"
 #include "J2534Connection_CAN.h"
 #include "MessageTx_ISO15765.h"
@@ -23,9 +24,13 @@ public:
 
 	virtual long PassThruStartMsgFilter(unsigned long FilterType, PASSTHRU_MSG * pMaskMsg, PASSTHRU_MSG * pPatternMsg, PASSTHRU_MSG * pFlowControlMsg, unsigned long * pFilterID);
 
-	int get_matching_out_fc_filter_id(const std::string & msgdata, unsigned long flags, unsigned long flagmask);
+	//The filter whose flow control message starts data and has exactly flags, -1 for none.
+	int get_matching_out_fc_filter_id(const char* data, size_t size, unsigned long flags);
 
-	int get_matching_in_fc_filter_id(const J2534Frame& msg, unsigned long flagmask);
+	int get_matching_in_fc_filter_id(const J2534Frame& msg, unsigned long flagmask) {
+		return get_matching_in_fc_filter_id(msg.Data.data(), msg.Data.size(), msg.RxStatus, flagmask);
+	}
+	int get_matching_in_fc_filter_id(const char* data, size_t size, unsigned long rx_status, unsigned long flagmask);
 
 	virtual unsigned long validateTxMsg(PASSTHRU_MSG* msg);
 
@@ -33,6 +38,14 @@ public:
 
 	virtual void processMessage(const J2534Frame& msg);
 
+	//Matched against the flow control filters on the raw bytes, a J2534Frame is
+	//only built for a frame of one of the conversations.
+	virtual void processCanMessage(const panda::PANDA_CAN_MSG& msg);
+
+	virtual void filtersChanged();
+
+	virtual long getFlowControlStats(PANDA_FLOW_CONTROL_STATS* pStats);
+
 	virtual void setBaud(unsigned long baud);
 
 	virtual void processIOCTLSetConfig(unsigned long Parameter, unsigned long Value);
@@ -59,7 +72,36 @@ public:
 		return TRUE;
 	}
 
+	virtual bool isProtoIso15765() {
+		return TRUE;
+	}
+
 private:
-	std::array<std::shared_ptr<MessageRx>, 10> rxConversations;
+	//msg has already matched filter fid.
+	void processFrame(const J2534Frame& msg, int fid);
+
+	//Sender's CAN id, and the extended address if the filter uses one.
+	static uint64_t rxConversationKey(const J2534Frame& msg, bool is_ext_addr);
+	MessageRxTable rxConversations;
 	unsigned int wftMax;
+
+	void recordFlowControl(bool sent, unsigned long long latency_us);
+	PANDA_FLOW_CONTROL_STATS fcStats = {};
+	Mutex fcStats_mutex;
+
+	//Same layout as rxConversationKey, ext_addr -1 for none.
+	static uint64_t fcKey(uint32_t id, bool is_29bit, int ext_addr);
+
+	//The flow control filters by id, so matching a message is a lookup instead of
+	//a pass over every filter and a copy of its flow control message. Filter ids
+	//are in order in each list, the lowest that matches wins as before.
+	struct FcIndex {
+		std::unordered_map<uint64_t, std::vector<int>> out; //fcKey of the flow control message
+		std::unordered_map<uint32_t, std::vector<int>> in; //Pattern id, where the mask pins all of it
+		std::vector<int> in_any; //Masks that don't
+	};
+	//Replaced, never modified, so the reader only holds a shared lock to copy the pointer.
+	std::shared_ptr<const FcIndex> fcIndex = std::make_shared<FcIndex>();
+	SharedMutex fcIndex_mutex;
+	std::shared_ptr<const FcIndex> getFcIndex();
 };
@@ -1,22 +1,155 @@
 #pragma once
+#include <memory>
+#include <string>
 #include "J2534_v0404.h"
 #include "panda_shared/panda.h"
 
+/*Payload of a J2534Frame. A CAN frame (4 byte id and 8 data bytes) is stored
+inline, only longer payloads like reassembled ISO15765 messages use the heap.
+Copies share the heap bytes instead of copying them, so a message being sent,
+its loopback frame and the RX queue hold one buffer, and the bytes are only
+copied again into the PASSTHRU_MSG of PassThruReadMsgs. Shared bytes are never
+changed, appending to them copies them first.
+Has the parts of the std::string interface the frames need.*/
+class J2534FrameData {
+public:
+	static const size_t INLINE_LEN = 12;
+	static const size_t npos = (size_t)-1;
+
+	J2534FrameData() : len(0) { };
+
+	J2534FrameData(const char* dat, size_t size) : len(0) {
+		append(dat, size);
+	};
+
+	J2534FrameData(const std::string& str) : len(0) {
+		append(str.data(), str.size());
+	};
+
+	void assign(const char* dat, size_t size) {
+		this->len = 0;
+		this->overflow.reset();
+		append(dat, size);
+	}
+
+	//The bytes are inline while len <= INLINE_LEN, and in overflow after. Bytes
+	//no other payload has are appended to in place.
+	void append(const char* dat, size_t size) {
+		if (this->len + size <= INLINE_LEN) {
+			memcpy(this->small + this->len, dat, size);
+		} else {
+			if (this->len <= INLINE_LEN) {
+				auto bytes = std::make_shared<std::string>();
+				bytes->reserve(this->len + size);
+				bytes->assign(this->small, this->len);
+				this->overflow = std::move(bytes);
+			} else if (this->overflow.use_count() > 1) {
+				auto bytes = std::make_shared<std::string>();
+				bytes->reserve(this->len + size);
+				bytes->assign(*this->overflow);
+				this->overflow = std::move(bytes);
+			}
+			this->overflow->append(dat, size);
+		}
+		this->len += size;
+	}
+
+	J2534FrameData& operator+=(char c) {
+		append(&c, 1);
+		return *this;
+	}
+
+	J2534FrameData operator+(const J2534FrameData& b) const {
+		J2534FrameData res(*this);
+		res.append(b.data(), b.size());
+		return res;
+	}
+
+	J2534FrameData operator+(const std::string& b) const {
+		J2534FrameData res(*this);
+		res.append(b.data(), b.size());
+		return res;
+	}
+
+	bool operator==(const J2534FrameData& b) const {
+		return this->len == b.len && memcmp(this->data(), b.data(), this->len) == 0;
+	}
+
+	char operator[](size_t i) const {
+		return data()[i];
+	}
+
+	size_t size() const {
+		return this->len;
+	}
+
+	const char* data() const {
+		return (this->len > INLINE_LEN) ? this->overflow->data() : this->small;
+	}
+
+	//Clamped like std::string::substr, but stays inline for frame sized results.
+	J2534FrameData substr(size_t pos, size_t n = npos) const {
+		if (pos > this->len) pos = this->len;
+		return J2534FrameData(data() + pos, min(n, this->len - pos));
+	}
+
+	std::string str() const {
+		return std::string(data(), this->len);
+	}
+
+private:
+	char small[INLINE_LEN];
+	size_t len;
+	std::shared_ptr<std::string> overflow;
+};
+
+/*A raw CAN frame laid out as the Data of its PASSTHRU_MSG, for CAN channels that
+queue received frames without building a J2534Frame. Fixed size and trivially
+copyable, so a queue of them is a flat array.*/
+struct J2534CanFrame {
+	static const uint8_t FLAG_29BIT = 0x01;
+	static const uint8_t FLAG_TX_ECHO = 0x02;
+
+	J2534CanFrame() = default;
+
+	J2534CanFrame(const panda::PANDA_CAN_MSG& msg_in) {
+		Data[0] = (uint8_t)(msg_in.addr >> 24);
+		Data[1] = (uint8_t)((msg_in.addr >> 16) & 0xFF);
+		Data[2] = (uint8_t)((msg_in.addr >> 8) & 0xFF);
+		Data[3] = (uint8_t)(msg_in.addr & 0xFF);
+		memcpy(Data + 4, msg_in.dat, 8);
+		DataSize = msg_in.len + 4;
+		Flags = (msg_in.addr_29b ? FLAG_29BIT : 0) | (msg_in.is_receipt ? FLAG_TX_ECHO : 0);
+		Timestamp = msg_in.recv_time;
+	}
+
+	uint32_t id() const {
+		return Data[0] << 24 | Data[1] << 16 | Data[2] << 8 | Data[3];
+	}
+
+	unsigned long RxStatus() const {
+		return ((Flags & FLAG_29BIT) ? CAN_29BIT_ID : 0) | ((Flags & FLAG_TX_ECHO) ? TX_MSG_TYPE : 0);
+	}
+
+	uint64_t Timestamp; //Full width, PASSTHRU_MSG gets the low 32 bits
+	uint8_t Data[12]; //4 byte id, big endian, then up to 8 data bytes
+	uint8_t DataSize;
+	uint8_t Flags;
+};
+
 /*A move convenient container for J2534 Messages than the static buffer provided by default.*/
 class J2534Frame {
 public:
-	J2534Frame(unsigned long ProtocolID, unsigned long RxStatus=0, unsigned long TxFlags=0, unsigned long Timestamp=0) :
-		ProtocolID(ProtocolID), RxStatus(RxStatus), TxFlags(TxFlags), Timestamp(Timestamp), ExtraDataIndex(0), Data("") { };
+	J2534Frame(unsigned long ProtocolID, unsigned long RxStatus=0, unsigned long TxFlags=0, unsigned long long Timestamp=0) :
+		ProtocolID(ProtocolID), RxStatus(RxStatus), TxFlags(TxFlags), Timestamp(Timestamp), ExtraDataIndex(0) { };
 
 	J2534Frame(const panda::PANDA_CAN_MSG& msg_in) {
 		ProtocolID = CAN;
 		ExtraDataIndex = msg_in.len + 4;
-		Data.reserve(msg_in.len + 4);
-		Data += msg_in.addr >> 24;
-		Data += (msg_in.addr >> 16) & 0xFF;
-		Data += (msg_in.addr >> 8) & 0xFF;
-		Data += msg_in.addr & 0xFF;
-		Data += std::string((char*)&msg_in.dat, msg_in.len);
+		const char addr[4] = { (char)(msg_in.addr >> 24), (char)((msg_in.addr >> 16) & 0xFF),
+			(char)((msg_in.addr >> 8) & 0xFF), (char)(msg_in.addr & 0xFF) };
+		Data.append(addr, sizeof(addr));
+		Data.append((const char*)msg_in.dat, msg_in.len);
 		Timestamp = msg_in.recv_time;
 		RxStatus = (msg_in.addr_29b ? CAN_29BIT_ID : 0) |
 			(msg_in.is_receipt ? TX_MSG_TYPE : 0);
@@ -28,7 +161,7 @@ public:
 		this->TxFlags = msg.TxFlags;
 		this->Timestamp = msg.Timestamp;
 		this->ExtraDataIndex = msg.ExtraDataIndex;
-		this->Data = std::string((const char*)msg.Data, msg.DataSize);
+		this->Data.assign((const char*)msg.Data, msg.DataSize);
 	}
 
 	J2534Frame() {
@@ -39,10 +172,18 @@ public:
 		this->ExtraDataIndex = 0;
 	}
 
+	//The CAN id at the start of the data, 0 if there are fewer than 4 bytes.
+	uint32_t id() const {
+		if (Data.size() < 4) return 0;
+		return ((uint8_t)Data[0]) << 24 | ((uint8_t)Data[1]) << 16 | ((uint8_t)Data[2]) << 8 | ((uint8_t)Data[3]);
+	}
+
 	unsigned long	ProtocolID;
 	unsigned long	RxStatus;
 	unsigned long	TxFlags;
-	unsigned long	Timestamp;
+	//The panda's microseconds at full width, PASSTHRU_MSG gets the low 32 bits.
+	//Frames from a PASSTHRU_MSG only have those.
+	unsigned long long	Timestamp;
 	unsigned long	ExtraDataIndex;
-	std::string		Data;
+	J2534FrameData	Data;
 };
\ No newline at end of file
@@ -20,7 +20,7 @@ J2534MessageFilter::J2534MessageFilter(
 			throw ERR_INVALID_MSG;
 		break;
 	case FLOW_CONTROL_FILTER:
-		if (conn->getProtocol() != ISO15765) throw ERR_MSG_PROTOCOL_ID; //CHECK
+		if (!conn->isProtoIso15765()) throw ERR_MSG_PROTOCOL_ID; //CHECK
 		if (pFlowControlMsg == NULL || pMaskMsg == NULL || pPatternMsg == NULL)
 			throw ERR_NULL_PARAMETER;
 		break;
@@ -63,6 +63,21 @@ J2534MessageFilter::J2534MessageFilter(
 			throw ERR_INVALID_MSG;
 		this->flags = pFlowControlMsg->TxFlags;
 	}
+
+	this->compile();
+}
+
+void J2534MessageFilter::compile() {
+	uint8_t mask[FILTER_COMPILED_LEN] = {}, pattern[FILTER_COMPILED_LEN] = {};
+	size_t len = min(this->maskMsg.size(), FILTER_COMPILED_LEN);
+	memcpy(mask, this->maskMsg.data(), len);
+	memcpy(pattern, this->patternMsg.data(), len);
+	for (int i = 0; i < FILTER_COMPILED_LEN / 8; i++) {
+		memcpy(&this->maskWords[i], mask + i * 8, 8);
+		memcpy(&this->patternWords[i], pattern + i * 8, 8);
+		//Pattern bits outside the mask could never match.
+		this->patternWords[i] &= this->maskWords[i];
+	}
 }
 
 bool J2534MessageFilter::operator ==(const J2534MessageFilter &b) const {
@@ -74,17 +89,27 @@ bool J2534MessageFilter::operator ==(const J2534MessageFilter &b) const {
 	return TRUE;
 }
 
-FILTER_RESULT J2534MessageFilter::check(const J2534Frame& msg) {
+FILTER_RESULT J2534MessageFilter::check(const char* data, size_t size) {
 	bool matches = TRUE;
-	if (msg.Data.size() < this->maskMsg.size()) {
+	if (size < this->maskMsg.size()) {
 		matches = FALSE;
 	} else {
-		for (int i = 0; i < this->maskMsg.size(); i++) {
-			if (this->patternMsg[i] != (msg.Data[i] & this->maskMsg[i])) {
+		//Bytes past the mask are zero in maskWords, so whatever msg has there doesn't matter.
+		uint8_t dat[FILTER_COMPILED_LEN] = {};
+		memcpy(dat, data, min(size, FILTER_COMPILED_LEN));
+		for (int i = 0; i < FILTER_COMPILED_LEN / 8; i++) {
+			uint64_t word;
+			memcpy(&word, dat + i * 8, 8);
+			if ((word & this->maskWords[i]) != this->patternWords[i]) {
 				matches = FALSE;
 				break;
 			}
 		}
+		//Masks longer than the compiled words fall back to the bytes.
+		for (size_t i = FILTER_COMPILED_LEN; matches && i < this->maskMsg.size(); i++) {
+			if (this->patternMsg[i] != (data[i] & this->maskMsg[i]))
+				matches = FALSE;
+		}
 	}
 
 	switch (this->filtertype) {
@@ -99,6 +124,18 @@ FILTER_RESULT J2534MessageFilter::check(const J2534Frame& msg) {
 	}
 }
 
-std::string J2534MessageFilter::get_flowctrl() {
-	return std::string(this->flowCtrlMsg);
+bool J2534MessageFilter::get_exact_id(uint32_t& id) {
+	if (this->filtertype == BLOCK_FILTER || this->maskMsg.size() < 4) return FALSE;
+	if (this->maskMsg.substr(0, 4) != std::string(4, '\xFF')) return FALSE;
+	id = ((uint8_t)this->patternMsg[0]) << 24 | ((uint8_t)this->patternMsg[1]) << 16 |
+		((uint8_t)this->patternMsg[2]) << 8 | ((uint8_t)this->patternMsg[3]);
+	return TRUE;
+}
+
+bool J2534MessageFilter::get_flowctrl_id(uint32_t& id, int& ext_addr) {
+	if (this->flowCtrlMsg.size() < 4) return FALSE;
+	id = ((uint8_t)this->flowCtrlMsg[0]) << 24 | ((uint8_t)this->flowCtrlMsg[1]) << 16 |
+		((uint8_t)this->flowCtrlMsg[2]) << 8 | ((uint8_t)this->flowCtrlMsg[3]);
+	ext_addr = (this->flowCtrlMsg.size() > 4) ? (uint8_t)this->flowCtrlMsg[4] : -1;
+	return TRUE;
 }
@@ -34,8 +34,23 @@ public:
 
 	bool J2534MessageFilter::operator ==(const J2534MessageFilter &b) const;
 
-	FILTER_RESULT check(const J2534Frame& msg);
-	std::string get_flowctrl();
+	FILTER_RESULT check(const J2534Frame& msg) {
+		return check(msg.Data.data(), msg.Data.size());
+	}
+	FILTER_RESULT check(const char* data, size_t size);
+	const std::string& get_flowctrl() {
+		return this->flowCtrlMsg;
+	}
+	//The 4 byte id of the flow control message, and its extended address or -1.
+	//FALSE if the filter has none.
+	bool get_flowctrl_id(uint32_t& id, int& ext_addr);
+
+	//TRUE if only frames with this 4 byte id can match. Used to index connections by id.
+	bool get_exact_id(uint32_t& id);
+
+	bool is_block() {
+		return this->filtertype == BLOCK_FILTER;
+	}
 
 	unsigned long flags;
 	J2534Connection *const conn;
@@ -44,4 +59,11 @@ private:
 	std::string maskMsg;
 	std::string patternMsg;
 	std::string flowCtrlMsg;
+
+	//The first FILTER_COMPILED_LEN bytes of mask and pattern, zero padded,
+	//so check() compares two words instead of looping over the bytes.
+	#define FILTER_COMPILED_LEN 16
+	void compile();
+	uint64_t maskWords[FILTER_COMPILED_LEN / 8];
+	uint64_t patternWords[FILTER_COMPILED_LEN / 8];
 };
\ No newline at end of file
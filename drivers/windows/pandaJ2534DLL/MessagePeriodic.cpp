@@ -5,7 +5,7 @@
 MessagePeriodic::MessagePeriodic(
 	std::chrono::microseconds delay,
 	std::shared_ptr<MessageTx> msg
-) : Action(msg->connection, delay), msg(msg), runyet(FALSE), active(TRUE) { };
+) : Action(msg->connection, delay), msg(msg), runyet(FALSE), active(TRUE), task_handle(0), stats() { };
 
 void MessagePeriodic::execute() {
 	if (!this->active) return;
@@ -19,12 +19,55 @@ void MessagePeriodic::execute() {
 		msg->execute();
 	}
 
+	auto now = std::chrono::steady_clock::now();
+	auto late = now - this->expire;
+	unsigned long skipped = 0;
+	this->scheduleDelay();
+	if (this->expire <= now) {
+		//After a stall, skip the deadlines that already passed instead of trying to catch
+		//up with a burst. The next one stays on the original phase.
+		skipped = (unsigned long)((now - this->expire) / this->delay) + 1;
+		this->expire += this->delay * skipped;
+	}
+	this->recordSend(late, skipped);
+
+	if (auto conn_sp = this->connection.lock()) {
+		if (auto panda_dev_sp = conn_sp->getPandaDev()) {
+			this->task_handle = panda_dev_sp->insertActionIntoTaskList(shared_from_this());
+		}
+	}
+}
+
+void MessagePeriodic::recordSend(std::chrono::steady_clock::duration late, unsigned long skipped) {
+	static const long long bucket_bounds[] = PERIODIC_JITTER_BUCKETS;
+	long long late_us = std::chrono::duration_cast<std::chrono::microseconds>(late).count();
+
+	int bucket = 0;
+	while (bucket < PERIODIC_JITTER_BUCKET_COUNT - 1 && late_us >= bucket_bounds[bucket])
+		bucket++;
+
+	synchronized(stats_mutex) {
+		this->stats.SendCount++;
+		this->stats.SkipCount += skipped;
+		if (late_us > this->stats.MaxLateUs)
+			this->stats.MaxLateUs = (unsigned long)late_us;
+		this->stats.LateHistogram[bucket]++;
+	}
+}
+
+PANDA_PERIODIC_STATS MessagePeriodic::getStats() {
+	PANDA_PERIODIC_STATS res;
+	synchronized(stats_mutex) {
+		res = this->stats;
+	}
+	return res;
+}
+
+void MessagePeriodic::cancel() {
+	this->active = FALSE;
 	if (auto conn_sp = this->connection.lock()) {
 		if (auto panda_dev_sp = conn_sp->getPandaDev()) {
-			//Scheduling must be relative to now incase there was a long stall that
-			//would case it to be super far behind and try to catch up forever.
-			this->scheduleImmediateDelay();
-			panda_dev_sp->insertActionIntoTaskList(shared_from_this());
+			panda_dev_sp->cancelAction(this->task_handle);
 		}
 	}
 }
@@ -1,14 +1,29 @@
 #pragma once
 #include "Action.h"
 #include "MessageTx.h"
+#include "synchronize.h"
 
 class J2534Connection;
 
+//Upper bounds in microseconds of the lateness histogram buckets, the last one has no bound.
+#define PERIODIC_JITTER_BUCKETS { 100, 250, 500, 1000, 2500, 5000, 10000 }
+#define PERIODIC_JITTER_BUCKET_COUNT 8
+
+//Output of the PANDA_GET_PERIODIC_STATS IOCTL.
+typedef struct {
+	unsigned long SendCount;
+	unsigned long SkipCount; //Deadlines dropped after falling a whole period behind
+	unsigned long MaxLateUs;
+	unsigned long LateHistogram[PERIODIC_JITTER_BUCKET_COUNT]; //How late each send was, see PERIODIC_JITTER_BUCKETS
+} PANDA_PERIODIC_STATS;
+
 /* A message that is resent on a given period. Created with calls to PassThruStartPeriodicMessage.
 
 Instead of making each J2534 protocol implementation have to implement periodic message
 functionality, this class takes a message to be sent, and passes along the execute call
 to the message, then reschedules itself.
+Deadlines are a whole number of periods after the first send, so a late run doesn't
+push the later ones back.
 */
 class MessagePeriodic : public Action, public std::enable_shared_from_this<Action>
 {
@@ -20,14 +35,22 @@ public:
 
 	virtual void execute();
 
-	void cancel() {
-		this->active = FALSE;
-	}
+	void cancel();
+
+	//Handle of the next scheduled run.
+	TaskHandle task_handle;
+
+	PANDA_PERIODIC_STATS getStats();
 
 protected:
 	std::shared_ptr<MessageTx> msg;
 
 private:
+	void recordSend(std::chrono::steady_clock::duration late, unsigned long skipped);
+
 	BOOL runyet;
 	BOOL active;
+
+	PANDA_PERIODIC_STATS stats;
+	Mutex stats_mutex;
 };
@@ -1,49 +1,64 @@
 #pragma once
+#include <array>
+#include <vector>
+#include "J2534Frame.h"
 
+//Largest ISO15765 message, the first frame length is 12 bits.
+#define ISO15765_RX_MAX_LEN 4095
+
+/*Reassembly buffer for one incoming ISO15765 message. The buffer is the
+largest possible message, so slots are reused instead of reallocated.*/
 class MessageRx
 {
 public:
-	MessageRx(
+	MessageRx() : expected_size(0), len(0), flags(0), next_part(0) { };
+
+	void reset(
 		unsigned long size,
-		std::string piece,
+		const J2534FrameData& piece,
 		unsigned long rxFlags,
 		std::shared_ptr<J2534MessageFilter> filter
-	) : expected_size(size & 0xFFF), flags(rxFlags) {
-		msg.reserve(expected_size);
-		msg = piece;
-		next_part = 1;
+	) {
+		this->expected_size = size & 0xFFF;
+		this->flags = rxFlags;
+		this->filter = filter;
+		this->len = min(piece.size(), this->expected_size);
+		memcpy(this->msg, piece.data(), this->len);
+		this->next_part = 1;
 	};
 
-	bool rx_add_frame(uint8_t pci_byte, unsigned int max_packet_size, const std::string piece) {
+	bool rx_add_frame(uint8_t pci_byte, unsigned int max_packet_size, const J2534FrameData& piece) {
 		if ((pci_byte & 0x0F) != this->next_part) {
 			//TODO: Maybe this should instantly fail the transaction.
 			return TRUE;
 		}
 
 		this->next_part = (this->next_part + 1) % 0x10;
-		unsigned int payload_len = min(expected_size - msg.size(), max_packet_size);
+		unsigned int payload_len = min(expected_size - len, max_packet_size);
 		if (piece.size() < payload_len) {
 			//A frame was received that could have held more data.
 			//No examples of this protocol show that happening, so
 			//it will be assumed that it is grounds to reset rx.
 			return FALSE;
 		}
-		msg += piece.substr(0, payload_len);
+		memcpy(this->msg + this->len, piece.data(), payload_len);
+		this->len += payload_len;
 
 		return TRUE;
 	}
 
 	unsigned int bytes_remaining() {
-		return this->expected_size - this->msg.size();
+		return this->expected_size - this->len;
 	}
 
 	bool is_ready() {
-		return this->msg.size() == this->expected_size;
+		return this->len == this->expected_size;
 	}
 
-	bool flush_result(std::string& final_msg) {
-		if (this->msg.size() == this->expected_size) {
-			final_msg = this->msg;
+	//Appends the finished message to final_msg.
+	bool flush_result(J2534FrameData& final_msg) {
+		if (this->len == this->expected_size) {
+			final_msg.append(this->msg, this->len);
 			return TRUE;
 		}
 		return FALSE;
@@ -56,6 +71,90 @@ public:
 	std::weak_ptr<J2534MessageFilter> filter;
 	unsigned long flags;
 	unsigned long expected_size;
-	std::string msg;
+	unsigned long len;
+	char msg[ISO15765_RX_MAX_LEN];
 	unsigned char next_part;
 };
+
+#define ISO15765_RX_SLOTS 32
+#define ISO15765_RX_TABLE_SIZE 64 //Power of two, twice the slots keeps probes short
+
+/*Messages being reassembled, keyed by the sender's CAN id (and extended
+address). Lets every ECU answering a functional request reassemble at the same
+time. Open addressing with linear probing over a fixed table, no allocation
+after construction.*/
+class MessageRxTable
+{
+public:
+	MessageRxTable() {
+		clear();
+	}
+
+	MessageRx* find(uint64_t key) {
+		int pos = probe(key);
+		return (pos == -1) ? nullptr : &this->slots[this->table[pos].slot];
+	}
+
+	//Starts over the message for key. Returns nullptr if every slot is in use.
+	MessageRx* start(uint64_t key) {
+		if (auto existing = find(key)) return existing;
+		if (this->free_slots.size() == 0) return nullptr;
+
+		unsigned int pos = hash(key);
+		while (this->table[pos].slot != -1)
+			pos = (pos + 1) & (ISO15765_RX_TABLE_SIZE - 1);
+		this->table[pos].key = key;
+		this->table[pos].slot = this->free_slots.back();
+		this->free_slots.pop_back();
+		return &this->slots[this->table[pos].slot];
+	}
+
+	void remove(uint64_t key) {
+		int pos = probe(key);
+		if (pos == -1) return;
+		this->free_slots.push_back(this->table[pos].slot);
+		this->table[pos].slot = -1;
+
+		//Shift later entries of the probe run back so lookups don't stop at the hole.
+		unsigned int hole = pos;
+		unsigned int next = (hole + 1) & (ISO15765_RX_TABLE_SIZE - 1);
+		while (this->table[next].slot != -1) {
+			unsigned int home = hash(this->table[next].key);
+			if (((next - home) & (ISO15765_RX_TABLE_SIZE - 1)) >= ((next - hole) & (ISO15765_RX_TABLE_SIZE - 1))) {
+				this->table[hole] = this->table[next];
+				this->table[next].slot = -1;
+				hole = next;
+			}
+			next = (next + 1) & (ISO15765_RX_TABLE_SIZE - 1);
+		}
+	}
+
+	void clear() {
+		for (auto& entry : this->table) entry.slot = -1;
+		this->free_slots.clear();
+		for (int i = ISO15765_RX_SLOTS - 1; i >= 0; i--)
+			this->free_slots.push_back(i);
+	}
+
+private:
+	unsigned int hash(uint64_t key) {
+		return (unsigned int)((key * 0x9E3779B97F4A7C15ULL) >> 58); //Top 6 bits for 64 entries
+	}
+
+	int probe(uint64_t key) {
+		unsigned int pos = hash(key);
+		while (this->table[pos].slot != -1) {
+			if (this->table[pos].key == key) return pos;
+			pos = (pos + 1) & (ISO15765_RX_TABLE_SIZE - 1);
+		}
+		return -1;
+	}
+
+	struct Entry {
+		uint64_t key;
+		int slot; //-1 if empty
+	};
+	std::array<Entry, ISO15765_RX_TABLE_SIZE> table;
+	std::array<MessageRx, ISO15765_RX_SLOTS> slots;
+	std::vector<int> free_slots;
+};
@@ -12,7 +12,7 @@ public:
 		PASSTHRU_MSG& to_send
 	) : Action(connection_in), fullmsg(to_send) { };
 
-	virtual BOOL checkTxReceipt(J2534Frame frame) = 0;
+	virtual BOOL checkTxReceipt(const J2534Frame& frame) = 0;
 
 	virtual BOOL isFinished() = 0;
 
@@ -20,6 +20,14 @@ public:
 
 	virtual void reset() = 0;
 
+	//Which of the connection's TX queues this message waits in. Messages in
+	//different lanes are sent independently of each other.
+	unsigned int txLane = 0;
+
+	//A transfer with one of its frames failed. It counts as finished without
+	//the rest of its echoes, until reset.
+	BOOL txFailed = FALSE;
+
 protected:
 	J2534Frame fullmsg;
 };
\ No newline at end of file
@@ -13,20 +13,19 @@ void MessageTx_CAN::execute() {
 
 	if (auto conn_sp = std::static_pointer_cast<J2534Connection_CAN>(this->connection.lock())) {
 		if (auto panda_dev_sp = conn_sp->getPandaDev()) {
-			auto payload = fullmsg.Data.substr(4);
-			if (panda_dev_sp->panda->can_send(addr, check_bmask(this->fullmsg.TxFlags, CAN_29BIT_ID),
-				(const uint8_t*)payload.c_str(), (uint8_t)payload.size(), panda::PANDA_CAN1) == FALSE) {
+			auto seq = panda_dev_sp->panda->can_send_async(addr, check_bmask(this->fullmsg.TxFlags, CAN_29BIT_ID),
+				(const uint8_t*)fullmsg.Data.data() + 4, (uint8_t)(fullmsg.Data.size() - 4), conn_sp->getCanBus());
+			if (seq == 0)
 				return;
-			}
 			this->txInFlight = TRUE;
 			this->sentyet = TRUE;
-			panda_dev_sp->txMsgsAwaitingEcho.push(shared_from_this());
+			panda_dev_sp->awaitEcho(shared_from_this(), conn_sp->getPort(), addr, seq);
 		}
 	}
 }
 
 //Returns TRUE if receipt is consumed by the msg, FALSE otherwise.
-BOOL MessageTx_CAN::checkTxReceipt(J2534Frame frame) {
+BOOL MessageTx_CAN::checkTxReceipt(const J2534Frame& frame) {
 	if (txReady()) return FALSE;
 	if (frame.Data == fullmsg.Data && ((this->fullmsg.TxFlags & CAN_29BIT_ID) == (frame.RxStatus & CAN_29BIT_ID))) {
 		txInFlight = FALSE;
@@ -41,4 +40,64 @@ BOOL MessageTx_CAN::checkTxReceipt(J2534Frame frame) {
 void MessageTx_CAN::reset() {
 	sentyet = FALSE;
 	txInFlight = FALSE;
+	txFailed = FALSE;
+}
+
+MessageTx_CANBatch::MessageTx_CANBatch(
+	std::shared_ptr<J2534Connection> connection_in,
+	PASSTHRU_MSG* to_send,
+	unsigned long count
+) : MessageTx(connection_in, to_send[0]), sentyet(FALSE), framesEchoed(0) {
+	for (unsigned long i = 0; i < count; i++)
+		this->frames.emplace_back(to_send[i]);
+	this->echoed.assign(count, FALSE);
+};
+
+void MessageTx_CANBatch::execute() {
+	if (auto conn_sp = std::static_pointer_cast<J2534Connection_CAN>(this->connection.lock())) {
+		if (auto panda_dev_sp = conn_sp->getPandaDev()) {
+			std::vector<panda::PANDA_CAN_MSG> can_msgs(this->frames.size());
+			for (size_t i = 0; i < this->frames.size(); i++) {
+				auto& frame = this->frames[i];
+				auto& msg = can_msgs[i];
+				msg.addr = ((uint8_t)frame.Data[0]) << 24 | ((uint8_t)frame.Data[1]) << 16 |
+					((uint8_t)frame.Data[2]) << 8 | ((uint8_t)frame.Data[3]);
+				msg.addr_29b = check_bmask(frame.TxFlags, CAN_29BIT_ID);
+				msg.len = (uint8_t)(frame.Data.size() - 4);
+				memcpy(msg.dat, frame.Data.data() + 4, msg.len);
+				msg.bus = conn_sp->getCanBus();
+			}
+			auto last = panda_dev_sp->panda->can_send_async_many(can_msgs);
+			if (last == 0)
+				return;
+
+			this->sentyet = TRUE;
+			for (size_t i = 0; i < can_msgs.size(); i++)
+				panda_dev_sp->awaitEcho(shared_from_this(), conn_sp->getPort(), can_msgs[i].addr, last - can_msgs.size() + 1 + i);
+		}
+	}
+}
+
+//Echoes for different ids can come back in any order, so any frame not yet echoed can match.
+BOOL MessageTx_CANBatch::checkTxReceipt(const J2534Frame& frame) {
+	if (txReady()) return FALSE;
+	for (size_t i = 0; i < this->frames.size(); i++) {
+		if (this->echoed[i]) continue;
+		if (frame.Data == this->frames[i].Data && ((this->frames[i].TxFlags & CAN_29BIT_ID) == (frame.RxStatus & CAN_29BIT_ID))) {
+			this->echoed[i] = TRUE;
+			this->framesEchoed++;
+			if (auto conn_sp = std::static_pointer_cast<J2534Connection_CAN>(this->connection.lock()))
+				if (conn_sp->loopback)
+					conn_sp->addMsgToRxQueue(frame);
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+void MessageTx_CANBatch::reset() {
+	sentyet = FALSE;
+	framesEchoed = 0;
+	txFailed = FALSE;
+	this->echoed.assign(this->frames.size(), FALSE);
 }
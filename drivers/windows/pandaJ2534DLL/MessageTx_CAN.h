@@ -1,5 +1,6 @@
 #pragma once
 #include <memory>
+#include <vector>
 #include "MessageTx.h"
 
 class J2534Connection;
@@ -15,10 +16,10 @@ public:
 	virtual void execute();
 
 	//Returns TRUE if receipt is consumed by the msg, FALSE otherwise.
-	virtual BOOL checkTxReceipt(J2534Frame frame);
+	virtual BOOL checkTxReceipt(const J2534Frame& frame);
 
 	virtual BOOL isFinished() {
-		return !txInFlight && sentyet;
+		return (!txInFlight && sentyet) || txFailed;
 	};
 
 	virtual BOOL txReady() {
@@ -31,3 +32,38 @@ private:
 	BOOL sentyet;
 	BOOL txInFlight;
 };
+
+/**
+Several raw CAN frames from one PassThruWriteMsgs call, queued to the panda
+together so they share a USB transfer. Each frame still waits for its own echo.
+*/
+class MessageTx_CANBatch : public MessageTx
+{
+public:
+	MessageTx_CANBatch(
+		std::shared_ptr<J2534Connection> connection_in,
+		PASSTHRU_MSG* to_send,
+		unsigned long count
+	);
+
+	virtual void execute();
+
+	//Returns TRUE if receipt is consumed by the msg, FALSE otherwise.
+	virtual BOOL checkTxReceipt(const J2534Frame& frame);
+
+	virtual BOOL isFinished() {
+		return (sentyet && framesEchoed == frames.size()) || txFailed;
+	};
+
+	virtual BOOL txReady() {
+		return !sentyet;
+	};
+
+	virtual void reset();
+
+private:
+	BOOL sentyet;
+	std::vector<J2534Frame> frames;
+	std::vector<bool> echoed;
+	size_t framesEchoed;
+};
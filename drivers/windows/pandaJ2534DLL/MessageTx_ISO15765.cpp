@@ -1,6 +1,7 @@
 #include "stdafx.h"
 #include "MessageTx_ISO15765.h"
 #include "constants_ISO15765.h"
+#include "panda_shared/isotp.h"
 
 //in microseconsa
 #define TIMEOUT_FC 250000 //Flow Control
@@ -10,97 +11,92 @@ MessageTx_ISO15765::MessageTx_ISO15765(
 	std::shared_ptr<J2534Connection> connection_in,
 	PASSTHRU_MSG& to_send,
 	std::shared_ptr<J2534MessageFilter> filter
-) : MessageTxTimeoutable(connection_in, to_send), filter(filter), frames_sent(0),
-consumed_count(0), txInFlight(FALSE), sendAll(FALSE), block_size(0), numWaitFrames(0), didtimeout(FALSE), issuspended(FALSE){
+) : MessageTxTimeoutable(connection_in, to_send), filter(filter), frames_sent(0), frames_echoed(0),
+consumed_count(0), sendAll(FALSE), selfScheduled(FALSE), block_size(0), numWaitFrames(0), didtimeout(FALSE), issuspended(FALSE){
 
 	CANid = ((uint8_t)fullmsg.Data[0]) << 24 | ((uint8_t)fullmsg.Data[1]) << 16 |
 		((uint8_t)fullmsg.Data[2]) << 8 | ((uint8_t)fullmsg.Data[3]);
 
-	payload = fullmsg.Data.substr(addressLength());
-
-	if (check_bmask(fullmsg.TxFlags, ISO15765_ADDR_TYPE))
-		data_prefix = fullmsg.Data[4];
-
-	if (payload.size() <= (7 - data_prefix.size())) {
-		isMultipart = FALSE;
-		auto framepayload = data_prefix + std::string(1, (char)payload.size()) + payload;
-		if (check_bmask(this->fullmsg.TxFlags, ISO15765_FRAME_PAD))
-			framepayload += std::string(8 - framepayload.size(), '\x00');
-		framePayloads.push_back(framepayload);
-	} else {
-		isMultipart = TRUE;
-		unsigned long first_payload_len = 6 - data_prefix.size(); // 5 or 6
-		std::string framepayload = data_prefix +
-			(char)(0x10 | ((payload.size() >> 8) & 0xF)) +
-			(char)(payload.size() & 0xFF) +
-			payload.substr(0, first_payload_len);
-		framePayloads.push_back(framepayload);
-
-		unsigned int pktnum = 1;
-		uint8_t CFDatSize = 7 - data_prefix.size();
-		while (TRUE) {
-			framepayload = data_prefix + (char)(0x20 | (pktnum % 0x10)) +
-				payload.substr(first_payload_len + (CFDatSize * (pktnum-1)), CFDatSize);
-
-			if (check_bmask(this->fullmsg.TxFlags, ISO15765_FRAME_PAD))
-				framepayload += std::string(8 - framepayload.size(), '\x00');
-			framePayloads.push_back(framepayload);
-			if (first_payload_len + (CFDatSize * pktnum) >= payload.size()) break;
-			pktnum++;
-		}
-
-	}
+	extAddr = check_bmask(fullmsg.TxFlags, ISO15765_ADDR_TYPE) ? (uint8_t)fullmsg.Data[4] : -1;
+	frameCount = panda::isotp::frame_count(extAddr, fullmsg.Data.size() - addressLength());
+	isMultipart = frameCount > 1;
 };
 
 unsigned int MessageTx_ISO15765::addressLength() {
 	return check_bmask(fullmsg.TxFlags, ISO15765_ADDR_TYPE) ? 5 : 4;
 }
 
+uint8_t MessageTx_ISO15765::frame(size_t index, uint8_t out[8]) {
+	return panda::isotp::frame_at(extAddr, (const uint8_t*)fullmsg.Data.data() + addressLength(),
+		fullmsg.Data.size() - addressLength(), check_bmask(this->fullmsg.TxFlags, ISO15765_FRAME_PAD), index, out);
+}
+
 void MessageTx_ISO15765::execute() {
-	if (didtimeout || issuspended) return;
-	if (this->frames_sent >= this->framePayloads.size()) return;
-	if (block_size == 0 && !sendAll && this->frames_sent > 0) return;
-	if (block_size > 0 && !sendAll) block_size--;
+	this->selfScheduled = FALSE;
+	if (didtimeout || issuspended || txFailed) return;
 
 	if (auto conn_sp = this->connection.lock()) {
 		if (auto panda_dev_sp = conn_sp->getPandaDev()) {
-			auto& outFramePayload = this->framePayloads[this->frames_sent];
-			if (panda_dev_sp->panda->can_send(this->CANid, check_bmask(this->fullmsg.TxFlags, CAN_29BIT_ID),
-				(const uint8_t*)outFramePayload.c_str(), (uint8_t)outFramePayload.size(), panda::PANDA_CAN1) == FALSE) {
-				return;
+			//The first frame goes alone, consecutive frames go as far as the
+			//block size and the pipeline allow.
+			while (this->frames_sent < this->frameCount) {
+				if (block_size == 0 && !sendAll && this->frames_sent > 0) return;
+				if (this->frames_sent - this->frames_echoed >= ISO15765_CF_PIPELINE_MAX) return; //Resumed by an echo
+
+				uint8_t out[8];
+				uint8_t len = this->frame(this->frames_sent, out);
+				auto seq = panda_dev_sp->panda->can_send_async(this->CANid, check_bmask(this->fullmsg.TxFlags, CAN_29BIT_ID),
+					out, len, conn_sp->getCanBus());
+				if (seq == 0)
+					return;
+
+				if (block_size > 0 && !sendAll) block_size--;
+				this->frames_sent++;
+				panda_dev_sp->awaitEcho(shared_from_this(), conn_sp->getPort(), this->CANid, seq);
+
+				if (this->frames_sent == 1) return; //Wait for flow control
+				if (this->delay.count() > 0 && this->frames_sent < this->frameCount && txReady()) {
+					//Pace the next frame by STmin instead of waiting for this one's echo.
+					this->selfScheduled = TRUE;
+					this->scheduleImmediateDelay();
+					panda_dev_sp->insertActionIntoTaskList(shared_from_this());
+					return;
+				}
 			}
-
-			this->txInFlight = TRUE;
-			this->frames_sent++;
-			panda_dev_sp->txMsgsAwaitingEcho.push(shared_from_this());
 		}
 	}
 }
 
 //Returns TRUE if receipt is consumed by the msg, FALSE otherwise.
-BOOL MessageTx_ISO15765::checkTxReceipt(J2534Frame frame) {
-	if (!txInFlight) return FALSE;
+BOOL MessageTx_ISO15765::checkTxReceipt(const J2534Frame& frame) {
+	if (!txInFlight()) return FALSE;
 	if (frame.Data.size() >= addressLength() + 1 && (frame.Data[addressLength()] & 0xF0) == FRAME_FLOWCTRL) return FALSE;
 
-	if (frame.Data == fullmsg.Data.substr(0, 4) + framePayloads[frames_sent - 1] &&
+	//Echoes come back in the order the frames were sent, so the next one is
+	//checked against the frame made again from its index.
+	uint8_t expected[8];
+	uint8_t len = this->frame(frames_echoed, expected);
+	if (frame.Data.size() == 4 + (size_t)len && memcmp(frame.Data.data(), fullmsg.Data.data(), 4) == 0 &&
+		memcmp(frame.Data.data() + 4, expected, len) == 0 &&
 		((this->fullmsg.TxFlags & CAN_29BIT_ID) == (frame.RxStatus & CAN_29BIT_ID))) { //Check receipt is expected
-		txInFlight = FALSE; //Received the expected receipt. Allow another msg to be sent.
+		frames_echoed++; //Received the expected receipt.
 
-		if (this->recvCount == 0 && this->framePayloads.size() > 1)
+		if (this->recvCount == 0 && this->frameCount > 1)
 			scheduleTimeout(TIMEOUT_FC);
 
-		if (frames_sent == framePayloads.size()) { //Check message done
+		if (frames_echoed == frameCount) { //Check message done
 			if (auto conn_sp = std::static_pointer_cast<J2534Connection_ISO15765>(this->connection.lock())) {
 				unsigned long flags = (filter == nullptr) ? fullmsg.TxFlags : this->filter->flags;
 
-				J2534Frame outframe(ISO15765);
+				J2534Frame outframe(conn_sp->getProtocol());
 				outframe.Timestamp = frame.Timestamp;
 				outframe.RxStatus = TX_MSG_TYPE | TX_INDICATION | (flags & (ISO15765_ADDR_TYPE | CAN_29BIT_ID));
 				outframe.Data = frame.Data.substr(0, addressLength());
 				conn_sp->addMsgToRxQueue(outframe);
 
+				//Shares fullmsg's bytes, a long message isn't copied to be looped back.
 				if (conn_sp->loopback) {
-					J2534Frame outframe(ISO15765);
+					J2534Frame outframe(conn_sp->getProtocol());
 					outframe.Timestamp = frame.Timestamp;
 					outframe.RxStatus = TX_MSG_TYPE | (flags & (ISO15765_ADDR_TYPE | CAN_29BIT_ID));
 					outframe.Data = this->fullmsg.Data;
@@ -115,7 +111,7 @@ BOOL MessageTx_ISO15765::checkTxReceipt(J2534Frame frame) {
 			//already been received (differentiating from first frame), the
 			//message is not finished, and there is more than one frame in
 			//the message.
-			if (block_size == 0 && recvCount != 0 && !sendAll && !this->isFinished() && this->framePayloads.size() > 1)
+			if (block_size == 0 && recvCount != 0 && !sendAll && !this->txInFlight() && !this->isFinished() && this->frameCount > 1)
 				scheduleTimeout(TIMEOUT_CF);
 		}
 		return TRUE;
@@ -124,21 +120,26 @@ BOOL MessageTx_ISO15765::checkTxReceipt(J2534Frame frame) {
 }
 
 BOOL MessageTx_ISO15765::isFinished() {
-	return this->frames_sent == this->framePayloads.size() && !txInFlight;
+	return (this->frames_sent == this->frameCount && !txInFlight()) || txFailed;
 }
 
+//Also tells the echo handler whether to queue execute() again, so not while
+//it is already queued or there is nothing left to send.
 BOOL MessageTx_ISO15765::txReady() {
+	if (this->selfScheduled || this->frames_sent >= this->frameCount) return FALSE;
 	return block_size > 0 || sendAll || this->frames_sent == 0;
 }
 
 void MessageTx_ISO15765::reset() {
 	frames_sent = 0;
+	frames_echoed = 0;
 	consumed_count = 0;
 	block_size = 0;
-	txInFlight = FALSE;
 	sendAll = FALSE;
+	selfScheduled = FALSE;
 	numWaitFrames = 0;
 	didtimeout = FALSE;
+	txFailed = FALSE;
 }
 
 void MessageTx_ISO15765::onTimeout() {
@@ -4,9 +4,14 @@
 
 class J2534Connection_ISO15765;
 
+//Consecutive frames sent ahead of their echoes. 1 waits for every echo.
+#define ISO15765_CF_PIPELINE_MAX 32
+
 /**
 A specialized message type that can handle J2534 single and multi
 frame (with flow control) writes.
+Once flow control allows it, consecutive frames are sent without waiting
+for each echo, paced by STmin, and the echoes are matched as they arrive.
 */
 class MessageTx_ISO15765 : public MessageTxTimeoutable
 {
@@ -19,9 +24,12 @@ public:
 
 	unsigned int addressLength();
 
+	//Frame index of the message into out, returns its length.
+	uint8_t frame(size_t index, uint8_t out[8]);
+
 	virtual void execute();
 
-	virtual BOOL checkTxReceipt(J2534Frame frame);
+	virtual BOOL checkTxReceipt(const J2534Frame& frame);
 
 	virtual BOOL isFinished();
 
@@ -31,6 +39,10 @@ public:
 
 	virtual void onTimeout();
 
+	BOOL txInFlight() {
+		return frames_echoed < frames_sent;
+	}
+
 	//Functions for ISO15765 flow control
 
 	void MessageTx_ISO15765::flowControlContinue(uint8_t block_size, std::chrono::microseconds separation_time);
@@ -39,15 +51,15 @@ public:
 
 	std::shared_ptr<J2534MessageFilter> filter;
 	unsigned long frames_sent;
+	unsigned long frames_echoed;
 	unsigned long consumed_count;
 	uint8_t block_size;
 	unsigned long CANid;
-	std::string data_prefix;
-	std::string payload;
+	int extAddr; //-1 without ISO15765_ADDR_TYPE
 	BOOL isMultipart;
-	std::vector<std::string> framePayloads;
-	BOOL txInFlight;
+	size_t frameCount; //Frames are made from fullmsg as they are sent, see frame()
 	BOOL sendAll;
+	BOOL selfScheduled; //execute() queued itself to honor STmin
 	unsigned int numWaitFrames;
 	BOOL didtimeout;
 	BOOL issuspended;
@@ -4,113 +4,191 @@
 
 PandaJ2534Device::PandaJ2534Device(std::unique_ptr<panda::Panda> new_panda) : txInProgress(FALSE) {
 	this->panda = std::move(new_panda);
-
-	this->panda->set_esp_power(FALSE);
-	this->panda->set_safety_mode(panda::SAFETY_ALLOUTPUT);
-	this->panda->set_can_loopback(FALSE);
-	this->panda->set_alt_setting(0);
-
-	this->thread_kill_event = CreateEvent(NULL, TRUE, FALSE, NULL);
-
-	DWORD canListenThreadID;
-	this->can_recv_handle = CreateThread(NULL, 0, _can_recv_threadBootstrap, (LPVOID)this, 0, &canListenThreadID);
-
-	DWORD canProcessThreadID;
-	this->can_process_handle = CreateThread(NULL, 0, _can_process_threadBootstrap, (LPVOID)this, 0, &canProcessThreadID);
-
-	DWORD flowControlSendThreadID;
-	this->flow_control_wakeup_event = CreateEvent(NULL, TRUE, FALSE, NULL);
-	this->flow_control_thread_handle = CreateThread(NULL, 0, _msg_tx_threadBootstrap, (LPVOID)this, 0, &flowControlSendThreadID);
+	this->rxBudget = std::make_shared<RxBudget>();
+	this->periodicSlotsInUse.fill(FALSE);
+
+	//ESP off, loopback off, TX echoes are matched in send order. The Panda
+	//constructor already left it on alt setting 0.
+	this->panda->apply_config(panda::SAFETY_ALLOUTPUT, panda::PANDA_CONFIG_TX_IN_ORDER | panda::PANDA_CONFIG_TIMESTAMPS |
+		panda::PANDA_CONFIG_CLEAR_PERIODIC | panda::PANDA_CONFIG_CLEAR_RX);
+	//Channels stay open across a brown-out or a cable wiggle.
+	this->panda->set_auto_reconnect(TRUE);
+
+	this->msg_recv.resize(CAN_RX_MSG_LEN);
+	this->strand = panda::IoEngine::shared()->strand();
+	this->applyRegistrySchedule();
+	this->panda->can_rx_q_start(this->strand, [this] { this->can_rx_filled(); });
+	auto strand = this->strand;
+	this->panda->set_can_tx_failed_callback([this, strand](unsigned long long first, unsigned long long last) {
+		strand->post([this, first, last] { this->can_tx_failed(first, last); });
+	});
 };
 
 PandaJ2534Device::~PandaJ2534Device() {
-	SetEvent(this->thread_kill_event);
-	DWORD res = WaitForSingleObject(this->can_recv_handle, INFINITE);
-	CloseHandle(this->can_recv_handle);
+	//Nothing runs on the strand after this, so the reads can be canceled.
+	this->panda->set_can_tx_failed_callback(nullptr);
+	this->strand->close();
+	this->panda->can_rx_q_stop();
 
-	res = WaitForSingleObject(this->can_process_handle, INFINITE);
-	CloseHandle(this->can_process_handle);
+	this->panda->clear_can_periodic(PANDA_CAN_PERIODIC_ALL);
+}
 
-	res = WaitForSingleObject(this->flow_control_thread_handle, INFINITE);
-	CloseHandle(this->flow_control_thread_handle);
+//The values are optional, with none the threads stay as Windows made them.
+void PandaJ2534Device::applyRegistrySchedule() {
+	const char *key = "SOFTWARE\\PassThruSupport.04.04\\comma.ai - panda";
+	PANDA_THREAD_SCHEDULE schedule = { THREAD_PRIORITY_NORMAL, 0, 0 };
+	bool any = FALSE;
+	DWORD value, size = sizeof(value);
+	if (RegGetValueA(HKEY_LOCAL_MACHINE, key, "ThreadPriority", RRF_RT_REG_DWORD, NULL, &value, &size) == ERROR_SUCCESS) {
+		schedule.Priority = (long)value;
+		any = TRUE;
+	}
+	size = sizeof(value);
+	if (RegGetValueA(HKEY_LOCAL_MACHINE, key, "ThreadMMCSS", RRF_RT_REG_DWORD, NULL, &value, &size) == ERROR_SUCCESS) {
+		schedule.MMCSS = value;
+		any = TRUE;
+	}
+	size = sizeof(value);
+	if (RegGetValueA(HKEY_LOCAL_MACHINE, key, "ThreadAffinity", RRF_RT_REG_DWORD, NULL, &value, &size) == ERROR_SUCCESS) {
+		schedule.Affinity = value;
+		any = TRUE;
+	}
+	if (any) this->setThreadSchedule(&schedule);
+}
+
+long PandaJ2534Device::setThreadSchedule(const PANDA_THREAD_SCHEDULE* pSchedule) {
+	panda::IoSchedule schedule;
+	schedule.priority = pSchedule->Priority;
+	schedule.mmcss = pSchedule->MMCSS != 0;
+	schedule.affinity = pSchedule->Affinity;
+	if (!panda::IoEngine::shared()->set_schedule(schedule)) return ERR_INVALID_IOCTL_VALUE;
+	return STATUS_NOERROR;
+}
 
-	CloseHandle(this->flow_control_wakeup_event);
-	CloseHandle(this->thread_kill_event);
+void PandaJ2534Device::getThreadStats(PANDA_THREAD_STATS* pStats, bool reset) {
+	auto engine = panda::IoEngine::shared();
+	panda::IoSchedule schedule = engine->get_schedule();
+	panda::IoWakeupStats wakeup = engine->get_wakeup_stats(reset);
+	pStats->Schedule.Priority = schedule.priority;
+	pStats->Schedule.MMCSS = schedule.mmcss;
+	pStats->Schedule.Affinity = (unsigned long)schedule.affinity;
+	pStats->Threads = wakeup.threads;
+	pStats->MMCSSThreads = wakeup.mmcss_threads;
+	pStats->Wakeups = wakeup.count;
+	pStats->TotalUs = wakeup.total_us;
+	pStats->LastUs = wakeup.last_us;
+	pStats->MaxUs = wakeup.max_us;
+	pStats->Over1ms = wakeup.over;
 }
 
 std::shared_ptr<PandaJ2534Device> PandaJ2534Device::openByName(std::string sn) {
-	auto p = panda::Panda::openPanda("");
+	auto p = panda::Panda::openPanda(sn);
 	if (p == nullptr)
 		return nullptr;
 	return std::unique_ptr<PandaJ2534Device>(new PandaJ2534Device(std::move(p)));
 }
 
 DWORD PandaJ2534Device::closeChannel(unsigned long ChannelID) {
-	if (this->connections.size() <= ChannelID) return ERR_INVALID_CHANNEL_ID;
-	if (this->connections[ChannelID] == nullptr) return ERR_INVALID_CHANNEL_ID;
-	this->connections[ChannelID] = nullptr;
+	std::shared_ptr<J2534Connection> closing;
+	synchronized_exclusive(connections_mutex) {
+		if (this->connections.size() <= ChannelID) return ERR_INVALID_CHANNEL_ID;
+		if (this->connections[ChannelID] == nullptr) return ERR_INVALID_CHANNEL_ID;
+		closing = std::move(this->connections[ChannelID]);
+	}
+	this->rebuildDispatchIndex();
 	return STATUS_NOERROR;
 }
 
 DWORD PandaJ2534Device::addChannel(std::shared_ptr<J2534Connection>& conn, unsigned long* channel_id) {
 	int channel_index = -1;
-	for (unsigned int i = 0; i < this->connections.size(); i++)
-		if (this->connections[i] == nullptr) {
-			channel_index = i;
-			break;
+	synchronized_exclusive(connections_mutex) {
+		for (unsigned int i = 0; i < this->connections.size(); i++)
+			if (this->connections[i] == nullptr) {
+				channel_index = i;
+				break;
+			}
+
+		if (channel_index == -1) {
+			if (this->connections.size() == 0xFFFF) //channelid max 16 bits
+				return ERR_FAILED; //Too many channels
+			this->connections.push_back(nullptr);
+			channel_index = this->connections.size() - 1;
 		}
 
-	if (channel_index == -1) {
-		if (this->connections.size() == 0xFFFF) //channelid max 16 bits
-			return ERR_FAILED; //Too many channels
-		this->connections.push_back(nullptr);
-		channel_index = this->connections.size() - 1;
+		this->connections[channel_index] = conn;
 	}
-
-	this->connections[channel_index] = conn;
+	this->rebuildDispatchIndex();
 
 	*channel_id = channel_index;
 	return STATUS_NOERROR;
 }
 
-DWORD PandaJ2534Device::can_recv_thread() {
-	this->panda->can_clear(panda::PANDA_CAN_RX);
-	this->panda->can_rx_q_push(this->thread_kill_event);
-
-	return 0;
+long PandaJ2534Device::checkChannel(unsigned long ChannelID) {
+	synchronized_shared(connections_mutex) {
+		if (this->connections.size() <= ChannelID) return ERR_INVALID_CHANNEL_ID;
+		if (this->connections[ChannelID] == nullptr) return ERR_DEVICE_NOT_CONNECTED;
+	}
+	return STATUS_NOERROR;
 }
 
-DWORD PandaJ2534Device::can_process_thread() {
-	panda::PANDA_CAN_MSG msg_recv[CAN_RX_MSG_LEN];
+std::shared_ptr<J2534Connection> PandaJ2534Device::getConnection(unsigned long ChannelID) {
+	synchronized_shared(connections_mutex) {
+		if (ChannelID < this->connections.size())
+			return this->connections[ChannelID];
+	}
+	return nullptr;
+}
 
+//On the strand, every time reads complete.
+void PandaJ2534Device::can_rx_filled() {
 	while (true) {
-		if (!WaitForSingleObject(this->thread_kill_event, 0)) {
+		size_t count = this->panda->can_rx_q_pop_into(this->msg_recv.data(), this->msg_recv.size());
+		if (count == 0) {
 			break;
 		}
 
-		int count = 0;
-		this->panda->can_rx_q_pop(msg_recv, count);
-		if (count == 0) {
-			continue;
+		std::shared_ptr<const DispatchIndex> index;
+		synchronized_shared(dispatch_index_mutex) {
+			index = this->dispatch_index;
 		}
 		
-		for (int i = 0; i < count; i++) {
-			auto msg_in = msg_recv[i];
-			J2534Frame msg_out(msg_in);
+		unsigned long long device_time = 0;
+		for (size_t i = 0; i < count; i++) {
+			auto& msg_in = this->msg_recv[i];
+
+			if (msg_in.bus == panda::PANDA_CAN_GAP) {
+				//The panda was reconnected, frames sent before won't be echoed.
+				synchronized(tx_mutex) {
+					for (auto& awaiting : txMsgsAwaitingEcho) {
+						while (awaiting.second.size() > 0) {
+							auto msgtx = awaiting.second.front().second;
+							awaiting.second.pop_front();
+							if (auto conn = msgtx->connection.lock())
+								this->removeConnectionTopAction(conn, msgtx);
+						}
+					}
+				}
+				continue;
+			}
+			device_time = max(device_time, msg_in.recv_time);
 
 			if (msg_in.is_receipt) {
-				synchronized(task_queue_mutex) {
-					if (txMsgsAwaitingEcho.size() > 0) {
-						auto msgtx = txMsgsAwaitingEcho.front();
+				PANDA_TRACE(panda::TRACE_TX_ECHO, msg_in.addr, msg_in.len);
+				synchronized(tx_mutex) {
+					auto awaiting = txMsgsAwaitingEcho.find(((uint64_t)msg_in.bus << 32) | msg_in.addr);
+					if (awaiting != txMsgsAwaitingEcho.end() && awaiting->second.size() > 0) {
+						auto& echo_queue = awaiting->second;
+						auto msgtx = echo_queue.front().second;
 						if (auto conn = msgtx->connection.lock()) {
-							if (conn->isProtoCan() && conn->getPort() == msg_in.bus) {
-								if (msgtx->checkTxReceipt(msg_out)) {
+							if (conn->isProtoCan()) {
+								//Only an echo that's awaited is made a J2534Frame.
+								if (msgtx->checkTxReceipt(J2534Frame(msg_in))) {
 									//Things to check:
 									//    Frame not for this msg: Drop frame and alert. Error?
 									//    Frame is for this msg, more tx frames required after a FC frame: Wait for FC frame to come and trigger next tx.
 									//    Frame is for this msg, more tx frames required: Schedule next tx frame.
 									//    Frame is for this msg, and is the final frame of the msg: Let conn process full msg, If another msg from this conn is available, register it.
-									txMsgsAwaitingEcho.pop(); //Remove the TX object and schedule record.
+									echo_queue.pop_front(); //Remove the TX object and schedule record.
 
 									if (msgtx->isFinished()) {
 										this->removeConnectionTopAction(conn, msgtx);
@@ -121,7 +199,7 @@ DWORD PandaJ2534Device::can_process_thread() {
 										} else {
 											//Not finished, but next frame not ready (maybe waiting for flow control).
 											//Do not schedule more messages from this connection.
-											//this->ConnTxSet.erase(conn);
+											//this->ConnTxSet.erase({ conn, msgtx->txLane });
 											//Removing this means new messages queued can kickstart the queue and overstep the current message.
 										}
 									}
@@ -129,69 +207,115 @@ DWORD PandaJ2534Device::can_process_thread() {
 							}
 						} else {
 							//Connection has died. Clear out the tx entry from device records.
-							txMsgsAwaitingEcho.pop();
-							this->ConnTxSet.erase(conn); //connection is already dead, no need to schedule future tx msgs.
+							echo_queue.pop_front(); //connection is already dead, no need to schedule future tx msgs.
 						}
 					}
 				}
-			} else {
-				for (auto& conn : this->connections)
-					if (conn != nullptr && conn->isProtoCan() && conn->getPort() == msg_in.bus)
-						conn->processMessage(msg_out);
+			} else if (index != nullptr) {
+				PANDA_TRACE(panda::TRACE_DISPATCH, msg_in.addr, msg_in.len);
+				auto by_id = index->by_id.find(((uint64_t)msg_in.bus << 32) | msg_in.addr);
+				if (by_id != index->by_id.end())
+					for (auto& conn : by_id->second)
+						conn->processCanMessage(msg_in);
+
+				auto wildcard = index->wildcard.find(msg_in.bus);
+				if (wildcard != index->wildcard.end())
+					for (auto& conn : wildcard->second)
+						conn->processCanMessage(msg_in);
 			}
 		}
+		if (device_time > this->device_time_us.load())
+			this->device_time_us.store(device_time);
 	}
+}
 
-	return 0;
+//On the strand, after the writer thread's callback.
+void PandaJ2534Device::can_tx_failed(unsigned long long first, unsigned long long last) {
+	synchronized(tx_mutex) {
+		for (auto& awaiting : txMsgsAwaitingEcho) {
+			auto& echo_queue = awaiting.second;
+			for (auto it = echo_queue.begin(); it != echo_queue.end();) {
+				if (it->first < first || it->first > last) {
+					++it;
+					continue;
+				}
+				auto msgtx = it->second;
+				it = echo_queue.erase(it);
+				msgtx->txFailed = TRUE;
+				if (auto conn = msgtx->connection.lock())
+					this->removeConnectionTopAction(conn, msgtx);
+			}
+		}
+	}
 }
 
-DWORD PandaJ2534Device::msg_tx_thread() {
-	const HANDLE subscriptions[] = { this->flow_control_wakeup_event, this->thread_kill_event };
-	DWORD sleepDuration = INFINITE;
+void PandaJ2534Device::run_tasks() {
+	//Cleared first, an Action queued from here on posts another run.
+	this->run_tasks_posted.store(FALSE);
 	while (TRUE) {
-		DWORD res = WaitForMultipleObjects(2, subscriptions, FALSE, sleepDuration);
-		if (res == WAIT_OBJECT_0 + 1) return 0;
-		if (res != WAIT_OBJECT_0 && res != WAIT_TIMEOUT) {
-			printf("Got an unexpected wait result in flow_control_write_thread. Res: %d; GetLastError: %d\n. Terminating thread.", res, GetLastError());
-			return 0;
+		std::shared_ptr<Action> task;
+		bool have_next = FALSE;
+		std::chrono::time_point<std::chrono::steady_clock> next_expire;
+		synchronized(task_queue_mutex) { //implemented with for loop. Consumes breaks.
+			while (this->task_queue.size() > 0 && this->pending_tasks.count(this->task_queue.top().handle) == 0)
+				this->task_queue.pop(); //Canceled
+
+			if (this->task_queue.size() == 0) {
+				//Nothing scheduled.
+			} else if (std::chrono::steady_clock::now() >= this->task_queue.top().expire) {
+				task = this->task_queue.top().action; //Get the scheduled tx record.
+				this->pending_tasks.erase(this->task_queue.top().handle);
+				this->task_queue.pop();
+			} else { //Ran out of things that need to be sent now.
+				next_expire = this->task_queue.top().expire;
+				have_next = TRUE;
+			}
 		}
-		ResetEvent(this->flow_control_wakeup_event);
 
-		while (TRUE) {
-			synchronized(task_queue_mutex) { //implemented with for loop. Consumes breaks.
-				if (this->task_queue.size() == 0) {
-					sleepDuration = INFINITE;
-					goto break_flow_ctrl_loop;
-				}
-				if (std::chrono::steady_clock::now() >= this->task_queue.front()->expire) {
-					auto task = this->task_queue.front(); //Get the scheduled tx record.
-					this->task_queue.pop_front();
-					task->execute();
-				} else { //Ran out of things that need to be sent now. Sleep!
-					auto time_diff = std::chrono::duration_cast<std::chrono::milliseconds>
-						(this->task_queue.front()->expire - std::chrono::steady_clock::now());
-					sleepDuration = max(1, time_diff.count());
-					goto break_flow_ctrl_loop;
-				}
-			}
+		if (task == nullptr) {
+			//A timer already set for sooner runs this again then, and sets it for
+			//what's left.
+			if (!have_next || (this->tx_timer != 0 && this->tx_timer_expire <= next_expire)) return;
+			if (this->tx_timer != 0) this->strand->cancel(this->tx_timer);
+			this->tx_timer_expire = next_expire;
+			this->tx_timer = this->strand->post_at(next_expire, [this] {
+				this->tx_timer = 0;
+				this->run_tasks();
+			});
+			return;
+		}
+
+		//Other threads can queue and cancel tasks while this one runs.
+		synchronized(tx_mutex) {
+			task->execute();
 		}
-		break_flow_ctrl_loop:
-		continue;
 	}
-	return 0;
 }
 
 //Place the Action in the task queue based on the Action's expiration time,
-//then signal the thread that processes actions.
-void PandaJ2534Device::insertActionIntoTaskList(std::shared_ptr<Action> action) {
+//then have the strand look at the queue again.
+TaskHandle PandaJ2534Device::insertActionIntoTaskList(std::shared_ptr<Action> action) {
+	TaskHandle handle;
 	synchronized(task_queue_mutex) {
-		auto iter = this->task_queue.begin();
-		for (; iter != this->task_queue.end(); iter++) {
-			if (action->expire < (*iter)->expire) break;
-		}
-		this->task_queue.insert(iter, action);
+		handle = this->next_task_handle++;
+		this->task_queue.push({ action->expire, handle, action });
+		this->pending_tasks.insert(handle);
+	}
+	if (!this->run_tasks_posted.exchange(TRUE))
+		this->strand->post([this] { this->run_tasks(); });
+	return handle;
+}
+
+void PandaJ2534Device::awaitEcho(std::shared_ptr<MessageTx> msg, unsigned long port, uint32_t addr, unsigned long long seq) {
+	synchronized(tx_mutex) {
+		this->txMsgsAwaitingEcho[((uint64_t)port << 32) | addr].push_back({ seq, msg });
+	}
+}
+
+void PandaJ2534Device::cancelAction(TaskHandle handle) {
+	synchronized(task_queue_mutex) {
+		this->pending_tasks.erase(handle);
 	}
-	SetEvent(this->flow_control_wakeup_event);
 }
 
 void PandaJ2534Device::scheduleAction(std::shared_ptr<Action> msg, BOOL startdelayed) {
@@ -202,37 +326,88 @@ void PandaJ2534Device::scheduleAction(std::shared_ptr<Action> msg, BOOL startdel
 	this->insertActionIntoTaskList(msg);
 }
 
-void PandaJ2534Device::registerConnectionTx(std::shared_ptr<J2534Connection> conn) {
+void PandaJ2534Device::registerConnectionTx(std::shared_ptr<J2534Connection> conn, unsigned int lane) {
 	synchronized(connTXSet_mutex) {
-		auto ret = this->ConnTxSet.insert(conn);
+		auto ret = this->ConnTxSet.insert({ conn, lane });
 		if (ret.second == FALSE) return; //Conn already exists.
-		this->scheduleAction(conn->txbuff.front());
+		this->scheduleAction(conn->txbuff[lane].front());
 	}
 }
 
-void PandaJ2534Device::unstallConnectionTx(std::shared_ptr<J2534Connection> conn) {
+void PandaJ2534Device::unstallConnectionTx(std::shared_ptr<J2534Connection> conn, unsigned int lane) {
 	synchronized(connTXSet_mutex) {
-		auto ret = this->ConnTxSet.insert(conn);
+		auto ret = this->ConnTxSet.insert({ conn, lane });
 		if (ret.second == TRUE) return; //Conn already exists.
-		this->insertActionIntoTaskList(conn->txbuff.front());
+		this->insertActionIntoTaskList(conn->txbuff[lane].front());
 	}
 }
 
 void PandaJ2534Device::removeConnectionTopAction(std::shared_ptr<J2534Connection> conn, std::shared_ptr<MessageTx> msg) {
-	synchronized(task_queue_mutex) {
-		if (conn->txbuff.size() == 0)
+	synchronized(tx_mutex) {
+		auto& txbuff = conn->txbuff[msg->txLane];
+		if (txbuff.size() == 0)
 			return;
-		if (conn->txbuff.front() != msg)
+		if (txbuff.front() != msg)
 			return;
-		conn->txbuff.pop(); //Remove the top TX message from the connection tx queue.
+		txbuff.pop(); //Remove the top TX message from the connection tx queue.
 
-		//Remove the connection from the active connection list if no more messages are scheduled with this connection.
-		if (conn->txbuff.size() == 0) {
-			//Update records showing the connection no longer has a tx record scheduled.
-			this->ConnTxSet.erase(conn);
+		//Remove the lane from the active list if no more messages are scheduled in it.
+		if (txbuff.size() == 0) {
+			//Update records showing the lane no longer has a tx record scheduled.
+			this->ConnTxSet.erase({ conn, msg->txLane });
 		} else {
-			//Add the next scheduled tx from this conn
-			this->scheduleAction(conn->txbuff.front());
+			//Add the next scheduled tx from this lane
+			this->scheduleAction(txbuff.front());
+		}
+	}
+}
+
+void PandaJ2534Device::rebuildDispatchIndex() {
+	synchronized(dispatch_rebuild_mutex) {
+		std::vector<std::shared_ptr<J2534Connection>> conns;
+		synchronized_shared(connections_mutex) {
+			conns = this->connections;
 		}
+
+		auto index = std::make_shared<DispatchIndex>();
+		for (auto& conn : conns) {
+			if (conn == nullptr || !conn->isProtoCan()) continue;
+
+			std::vector<uint32_t> ids;
+			bool wildcard;
+			conn->getDispatchIds(ids, wildcard);
+			if (wildcard) {
+				index->wildcard[conn->getPort()].push_back(conn);
+				continue;
+			}
+
+			std::sort(ids.begin(), ids.end());
+			ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+			for (auto id : ids)
+				index->by_id[((uint64_t)conn->getPort() << 32) | id].push_back(conn);
+		}
+
+		synchronized_exclusive(dispatch_index_mutex) {
+			this->dispatch_index = index;
+		}
+	}
+}
+
+int PandaJ2534Device::allocPeriodicSlot() {
+	synchronized(periodicSlots_mutex) {
+		for (int i = 0; i < this->periodicSlotsInUse.size(); i++) {
+			if (this->periodicSlotsInUse[i]) continue;
+			this->periodicSlotsInUse[i] = TRUE;
+			return i;
+		}
+	}
+	return -1;
+}
+
+void PandaJ2534Device::freePeriodicSlot(int slot) {
+	if (slot < 0 || slot >= this->periodicSlotsInUse.size()) return;
+	this->panda->clear_can_periodic(slot);
+	synchronized(periodicSlots_mutex) {
+		this->periodicSlotsInUse[slot] = FALSE;
 	}
 }
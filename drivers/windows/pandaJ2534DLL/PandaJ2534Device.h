@@ -1,12 +1,21 @@
 #pragma once
 #include <memory>
-#include <list>
 #include <queue>
+#include <deque>
 #include <set>
+#include <array>
+#include <vector>
+#include <functional>
+#include <unordered_set>
+#include <unordered_map>
+#include <algorithm>
 #include <chrono>
+#include <atomic>
 #include "J2534_v0404.h"
 #include "panda_shared/panda.h"
+#include "panda_shared/io_engine.h"
 #include "synchronize.h"
+#include "RxQueue.h"
 #include "Action.h"
 #include "MessageTx.h"
 #include "J2534Connection.h"
@@ -15,10 +24,45 @@ class J2534Connection;
 class Action;
 class MessageTx;
 
+//Output of the PANDA_GET_TIME IOCTL. A PASSTHRU_MSG Timestamp is the low 32 bits
+//of the panda's microseconds, which wrap every 71 minutes. Its full time is the
+//latest one at or before TimeUs with those low bits.
+typedef struct {
+	unsigned long Epoch; //The high 32 bits of TimeUs, the times Timestamp has wrapped
+	unsigned long long TimeUs; //Of the newest frame received or echoed
+} PANDA_TIME;
+
+//Input of the PANDA_SET_THREAD_SCHEDULE IOCTL, and what the registry values
+//ThreadPriority, ThreadMMCSS and ThreadAffinity under the DLL's key start
+//with. It's for the threads of the IoEngine every device shares.
+typedef struct {
+	long Priority; //A SetThreadPriority one, THREAD_PRIORITY_TIME_CRITICAL the highest
+	unsigned long MMCSS; //Nonzero to join the "Pro Audio" MMCSS task, which then sets the priority
+	unsigned long Affinity; //Processor bits, 0 for any the process has
+} PANDA_THREAD_SCHEDULE;
+
+//Output of the PANDA_GET_THREAD_STATS IOCTL. A wakeup is timed work, an
+//ISO15765 STmin or a periodic message, starting on a thread after it was due.
+typedef struct {
+	PANDA_THREAD_SCHEDULE Schedule;
+	unsigned long Threads;
+	unsigned long MMCSSThreads; //Fewer than Threads if the MMCSS service is off
+	unsigned long long Wakeups;
+	unsigned long long TotalUs;
+	unsigned long LastUs;
+	unsigned long MaxUs;
+	unsigned long Over1ms;
+} PANDA_THREAD_STATS;
+
 /**
 Class representing a physical panda adapter. Instances are created by
 PassThruOpen in the J2534 API. A Device can create one or more
 J2534Connections.
+
+The panda's reads, the decoding and dispatch of what they bring and the
+scheduled Actions all run on one strand of the process' shared IoEngine, so
+they never run at the same time as each other, and no thread is the device's
+own.
 */
 class PandaJ2534Device {
 public:
@@ -32,52 +76,118 @@ public:
 	DWORD addChannel(std::shared_ptr<J2534Connection>& conn, unsigned long* channel_id);
 
 	std::unique_ptr<panda::Panda> panda;
-	std::vector<std::shared_ptr<J2534Connection>> connections;
+
+	//STATUS_NOERROR, ERR_INVALID_CHANNEL_ID if the id was never used, or ERR_DEVICE_NOT_CONNECTED if it was closed.
+	long checkChannel(unsigned long ChannelID);
+	//nullptr if the channel isn't open. The caller's reference keeps it alive across a concurrent close.
+	std::shared_ptr<J2534Connection> getConnection(unsigned long ChannelID);
 
 	//Place the Action in the task queue based on the Action's expiration time,
-	//then signal the thread that processes actions.
-	void insertActionIntoTaskList(std::shared_ptr<Action> action);
+	//then have the strand look at the queue again.
+	TaskHandle insertActionIntoTaskList(std::shared_ptr<Action> action);
+
+	//Drop a queued Action. Does nothing if it already ran.
+	void cancelAction(TaskHandle handle);
 
 	void scheduleAction(std::shared_ptr<Action> msg, BOOL startdelayed=FALSE);
 
-	void registerConnectionTx(std::shared_ptr<J2534Connection> conn);
+	void registerConnectionTx(std::shared_ptr<J2534Connection> conn, unsigned int lane);
 
-	//Resume sending messages from the provided Connection's TX queue.
-	void unstallConnectionTx(std::shared_ptr<J2534Connection> conn);
+	//Resume sending messages from one of the provided Connection's TX queues.
+	void unstallConnectionTx(std::shared_ptr<J2534Connection> conn, unsigned int lane);
 
 	//Cleans up several queues after a message completes, is canceled, or otherwise goes away.
 	void removeConnectionTopAction(std::shared_ptr<J2534Connection> conn, std::shared_ptr<MessageTx> msg);
 
 	//Messages that have been sent on the wire will be echoed by the panda when
-	//transmission is complete. This tracks what is still waiting to hear an echo.
-	std::queue<std::shared_ptr<MessageTx>> txMsgsAwaitingEcho;
+	//transmission is complete. Call with tx_mutex held (from Action::execute)
+	//after each frame is handed to the panda, with the seq can_send_async gave it.
+	void awaitEcho(std::shared_ptr<MessageTx> msg, unsigned long port, uint32_t addr, unsigned long long seq);
+
+	//Recompute which connections want which CAN ids. Call after channels or filters change.
+	void rebuildDispatchIndex();
+
+	//The panda's periodic message slots are shared by all connections.
+	//Returns -1 if they are all in use.
+	int allocPeriodicSlot();
+	void freePeriodicSlot(int slot);
+
+	//The full width recv_time of the newest frame from the panda, 0 before the first.
+	unsigned long long getDeviceTime() const { return this->device_time_us.load(); }
+
+	//ERR_INVALID_IOCTL_VALUE, and nothing changes, if the engine won't take it.
+	long setThreadSchedule(const PANDA_THREAD_SCHEDULE* pSchedule);
+	void getThreadStats(PANDA_THREAD_STATS* pStats, bool reset);
+
+	//Shared by the channels' RX queues, see PANDA_RX_BUDGET.
+	std::shared_ptr<RxBudget> rxBudget;
 
 private:
-	HANDLE thread_kill_event;
-
-	HANDLE can_recv_handle;
-	static DWORD WINAPI _can_recv_threadBootstrap(LPVOID This) {
-		return ((PandaJ2534Device*)This)->can_recv_thread();
-	}
-	DWORD can_recv_thread();
-
-	HANDLE can_process_handle;
-	static DWORD WINAPI _can_process_threadBootstrap(LPVOID This) {
-		return ((PandaJ2534Device*)This)->can_process_thread();
-	}
-	DWORD can_process_thread();
-
-	HANDLE flow_control_wakeup_event;
-	HANDLE flow_control_thread_handle;
-	static DWORD WINAPI _msg_tx_threadBootstrap(LPVOID This) {
-		return ((PandaJ2534Device*)This)->msg_tx_thread();
-	}
-	DWORD msg_tx_thread();
-	std::list<std::shared_ptr<Action>> task_queue;
+	std::shared_ptr<panda::IoStrand> strand;
+
+	void applyRegistrySchedule();
+
+	//On the strand, decodes and dispatches everything the completed reads brought.
+	void can_rx_filled();
+	//On the strand, when an async transfer failed. Its frames won't be echoed,
+	//the messages they belong to fail now.
+	void can_tx_failed(unsigned long long first, unsigned long long last);
+	std::vector<panda::PANDA_CAN_MSG> msg_recv; //Too big for the stack
+
+	//On the strand, runs the Actions that are due, then sets the strand's timer
+	//for the next one.
+	void run_tasks();
+	std::atomic<bool> run_tasks_posted{ false }; //So a burst of inserts posts run_tasks once
+	panda::IoTimerHandle tx_timer = 0; //Strand only, 0 if none
+	std::chrono::time_point<std::chrono::steady_clock> tx_timer_expire;
+	//Min heap on expiration. Equal expirations run in the order they were queued.
+	struct ScheduledTask {
+		std::chrono::time_point<std::chrono::steady_clock> expire;
+		TaskHandle handle;
+		std::shared_ptr<Action> action;
+
+		bool operator>(const ScheduledTask& other) const {
+			if (expire != other.expire) return expire > other.expire;
+			return handle > other.handle;
+		}
+	};
+	std::priority_queue<ScheduledTask, std::vector<ScheduledTask>, std::greater<ScheduledTask>> task_queue;
+	std::unordered_set<TaskHandle> pending_tasks; //Canceled tasks are removed, and skipped when they reach the top
+	TaskHandle next_task_handle = 1;
 	Mutex task_queue_mutex;
 
+	//Actions run outside task_queue_mutex, this keeps them from racing the TX echo handling.
+	Mutex tx_mutex;
+
+	//What is still waiting to hear an echo, in send order for each (port << 32) | CAN id.
+	//Echoes keep their order per id, so a message on one bus or id can't be stuck
+	//behind one still in flight on another. Each with its frame's seq, see
+	//can_tx_failed. Guarded by tx_mutex.
+	std::unordered_map<uint64_t, std::deque<std::pair<unsigned long long, std::shared_ptr<MessageTx>>>> txMsgsAwaitingEcho;
+
 	std::queue<std::shared_ptr<J2534Connection>> ConnTxQueue;
-	std::set<std::shared_ptr<J2534Connection>> ConnTxSet;
+	std::set<std::pair<std::shared_ptr<J2534Connection>, unsigned int>> ConnTxSet; //Connection TX lanes with a message in progress
 	Mutex connTXSet_mutex;
 	BOOL txInProgress;
+
+	//Received frames go straight to the connections that have a filter for their id,
+	//so dispatch doesn't scale with connections times filters.
+	struct DispatchIndex {
+		std::unordered_map<uint64_t, std::vector<std::shared_ptr<J2534Connection>>> by_id; //(port << 32) | id
+		std::unordered_map<unsigned long, std::vector<std::shared_ptr<J2534Connection>>> wildcard; //By port
+	};
+	//Replaced, never modified, so the reader only holds a shared lock to copy the pointer.
+	std::shared_ptr<const DispatchIndex> dispatch_index;
+	SharedMutex dispatch_index_mutex;
+	Mutex dispatch_rebuild_mutex; //Keeps an older rebuild from replacing a newer one
+
+	//Set by can_rx_filled, once a batch. Atomic for the 32 bit build's readers.
+	std::atomic<unsigned long long> device_time_us{ 0 };
+
+	//Changed by addChannel and closeChannel only, everything else reads.
+	std::vector<std::shared_ptr<J2534Connection>> connections;
+	SharedMutex connections_mutex;
+
+	std::array<bool, PANDA_CAN_PERIODIC_SLOTS> periodicSlotsInUse;
+	Mutex periodicSlots_mutex;
 };
@@ -0,0 +1,96 @@
+#pragma once
+#include <atomic>
+#include <vector>
+#include "J2534Frame.h"
+
+//Frames a channel holds for PassThruReadMsgs, see PANDA_RX_QUEUE_LEN.
+#define PANDA_RX_QUEUE_LEN_DEFAULT 16384
+#define PANDA_RX_QUEUE_LEN_MAX 0x100000
+//Bytes held across all channels of a device, see PANDA_RX_BUDGET.
+#define PANDA_RX_BUDGET_DEFAULT (64 * 1024 * 1024)
+
+//What goes when a frame doesn't fit, see PANDA_RX_OVERFLOW.
+#define PANDA_RX_DROP_OLDEST 0
+#define PANDA_RX_DROP_NEWEST 1
+
+/*Bytes of received frames the channels of a device hold, against a limit they
+share. A slow reader on one channel can't take all the memory of the process.*/
+struct RxBudget {
+	std::atomic<size_t> used{ 0 };
+	std::atomic<size_t> limit{ PANDA_RX_BUDGET_DEFAULT };
+
+	//FALSE, and nothing taken, if it would go over the limit.
+	bool take(size_t bytes) {
+		if (used.fetch_add(bytes) + bytes <= limit.load()) return TRUE;
+		used.fetch_sub(bytes);
+		return FALSE;
+	}
+
+	void give(size_t bytes) {
+		used.fetch_sub(bytes);
+	}
+};
+
+//What a queued frame holds against the budget.
+inline size_t rxFrameBytes(const J2534CanFrame& frame) {
+	return sizeof(frame);
+}
+
+inline size_t rxFrameBytes(const J2534Frame& frame) {
+	return sizeof(frame) + ((frame.Data.size() > J2534FrameData::INLINE_LEN) ? frame.Data.size() : 0);
+}
+
+/*Ring of received frames with a fixed capacity, all allocated up front so a
+busy channel never allocates to queue a frame. Not locked, the connection
+guards it with messageRxBuff_mutex.*/
+template<typename T>
+class RxRing {
+public:
+	//blank is what free slots hold, frames that reach the heap give it back when popped.
+	RxRing(size_t capacity, const T& blank) : buf(capacity, blank), blank(blank), head(0), count(0) { }
+
+	size_t size() const { return this->count; }
+	size_t capacity() const { return this->buf.size(); }
+	bool empty() const { return this->count == 0; }
+	bool full() const { return this->count == this->buf.size(); }
+
+	T& front() { return this->buf[this->head]; }
+
+	//Only when not full.
+	void push_back(const T& frame) {
+		this->buf[this->wrap(this->head + this->count)] = frame;
+		this->count++;
+	}
+
+	void pop_front() {
+		this->buf[this->head] = this->blank;
+		this->head = this->wrap(this->head + 1);
+		this->count--;
+	}
+
+	void clear() {
+		while (!this->empty()) this->pop_front();
+		this->head = 0;
+	}
+
+	//Keeps the newest frames that fit, the caller accounts for the rest first.
+	void resize(size_t capacity) {
+		std::vector<T> resized(capacity, this->blank);
+		size_t keep = min(this->count, capacity);
+		for (size_t i = 0; i < keep; i++)
+			resized[i] = this->buf[this->wrap(this->head + this->count - keep + i)];
+		this->buf.swap(resized);
+		this->head = 0;
+		this->count = keep;
+	}
+
+private:
+	size_t wrap(size_t i) const {
+		return (i >= this->buf.size()) ? (i - this->buf.size()) : i;
+	}
+
+	std::vector<T> buf;
+	T blank;
+	size_t head;
+	size_t count;
+};
@@ -4,13 +4,17 @@
 
 Timer::Timer()
 {
-	start = std::chrono::time_point_cast<std::chrono::milliseconds>(clock::now());
+	start = std::chrono::time_point_cast<std::chrono::microseconds>(clock::now());
 }
 
 // gets the time elapsed from construction.
 unsigned long long /*milliseconds*/ Timer::getTimePassed(){
+	return getTimePassedUs() / 1000;
+}
+
+unsigned long long /*microseconds*/ Timer::getTimePassedUs(){
 	// get the new time
-	auto end = std::chrono::time_point_cast<std::chrono::milliseconds>(clock::now());
+	auto end = std::chrono::time_point_cast<std::chrono::microseconds>(clock::now());
 
 	// return the difference of the times
 	return (end - start).count();
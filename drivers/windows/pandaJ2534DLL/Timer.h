@@ -2,17 +2,20 @@
 #include <chrono>
 
 //Copied from https://stackoverflow.com/a/31488113
+//steady_clock is QueryPerformanceCounter on MSVC, so microseconds are meaningful.
 
 class Timer
 {
 	using clock = std::chrono::steady_clock;
-	using time_point_type = std::chrono::time_point < clock, std::chrono::milliseconds >;
+	using time_point_type = std::chrono::time_point < clock, std::chrono::microseconds >;
 public:
 	Timer();
 
 	// gets the time elapsed from construction.
 	unsigned long long /*milliseconds*/ getTimePassed();
 
+	unsigned long long /*microseconds*/ getTimePassedUs();
+
 private:
 	time_point_type start;
 };
\ No newline at end of file
@@ -15,7 +15,13 @@
 // A quick way to avoid the name mangling that __stdcall liked to do
 #define EXPORT comment(linker, "/EXPORT:" __FUNCTION__ "=" __FUNCDNAME__)
 
-std::vector<std::shared_ptr<PandaJ2534Device>> pandas;
+//Device ids are 16 bit to fit the channel next to them, but a test station
+//won't get close to this. Fixed size so it never moves under other threads.
+#define PANDA_J2534_MAX_DEVICES 64
+std::array<std::shared_ptr<PandaJ2534Device>, PANDA_J2534_MAX_DEVICES> pandas;
+//Held while adding or removing devices. Each device has its own strand, so
+//calls for different devices don't otherwise touch each other.
+Mutex pandas_mutex;
 
 int J25334LastError = 0;
 
@@ -74,56 +80,63 @@ long check_valid_ChannelID(unsigned long ChannelID) {
 	if (pandas.size() <= dev_id || pandas[dev_id] == nullptr)
 		return ret_code(ERR_INVALID_CHANNEL_ID);
 
-	if (pandas[dev_id]->connections.size() <= con_id) return ret_code(ERR_INVALID_CHANNEL_ID);
-	if (pandas[dev_id]->connections[con_id] == nullptr) return ret_code(ERR_DEVICE_NOT_CONNECTED);
-
-	return ret_code(STATUS_NOERROR);
+	return ret_code(pandas[dev_id]->checkChannel(con_id));
 }
 
 //Do not call without checking if the device/channel id exists first.
 #define get_device(DeviceID) (pandas[EXTRACT_DID(DeviceID)])
-#define get_channel(ChannelID) (get_device(ChannelID)->connections[EXTRACT_CID(ChannelID)])
+#define get_channel(ChannelID) (get_device(ChannelID)->getConnection(EXTRACT_CID(ChannelID)))
+
+//pName is NULL or empty for any panda, or the serial number of a specific one.
+//Either can have the "J2534-2:" prefix, and surrounding spaces are ignored.
+std::string parse_device_name(void *pName) {
+	std::string name = (pName == NULL) ? "" : std::string((char*)pName);
+	const std::string prefix = "J2534-2:";
+	if (name.compare(0, prefix.size(), prefix) == 0)
+		name = name.substr(prefix.size());
+	size_t start = name.find_first_not_of(" \t");
+	if (start == std::string::npos) return "";
+	return name.substr(start, name.find_last_not_of(" \t") - start + 1);
+}
 
 PANDAJ2534DLL_API long PTAPI    PassThruOpen(void *pName, unsigned long *pDeviceID) {
 	#pragma EXPORT
 	if (pDeviceID == NULL) return ret_code(ERR_NULL_PARAMETER);
-	std::string sn = (pName == NULL) ? "" : std::string((char*)pName);
-	if (sn == "J2534-2:")
-		sn = "";
-
-	auto new_panda = PandaJ2534Device::openByName(sn);
-	if (new_panda == nullptr) {
-		if(sn == "" && pandas.size() == 1)
-			return ret_code(ERR_DEVICE_IN_USE);
-		for (auto& pn : pandas) {
-			if (pn->panda->get_usb_sn() == sn)
-				return ret_code(ERR_DEVICE_IN_USE);
-		}
-		return ret_code(ERR_DEVICE_NOT_CONNECTED);
-	}
+	std::string sn = parse_device_name(pName);
+
+	synchronized(pandas_mutex) {
+		int panda_index = -1;
+		for (unsigned int i = 0; i < pandas.size(); i++)
+			if (pandas[i] == nullptr) {
+				panda_index = i;
+				break;
+			}
+		if (panda_index == -1)
+			return ret_code(ERR_FAILED); //Too many pandas. Off the endangered species list.
 
-	int panda_index = -1;
-	for (unsigned int i = 0; i < pandas.size(); i++)
-		if (pandas[i] == nullptr) {
-			panda_index = i;
-			pandas[panda_index] = std::move(new_panda);
-			break;
+		//A panda that is already open isn't offered again, so "" picks one that is free.
+		auto new_panda = PandaJ2534Device::openByName(sn);
+		if (new_panda == nullptr) {
+			for (auto& pn : pandas) {
+				if (pn != nullptr && (sn == "" || pn->panda->get_usb_sn() == sn))
+					return ret_code(ERR_DEVICE_IN_USE);
+			}
+			return ret_code(ERR_DEVICE_NOT_CONNECTED);
 		}
 
-	if (panda_index == -1) {
-		if(pandas.size() == 0xFFFF) //device id will be 16 bit to fit channel next to it.
-			return ret_code(ERR_FAILED); //Too many pandas. Off the endangered species list.
-		pandas.push_back(std::move(new_panda));
-		panda_index = pandas.size()-1;
+		pandas[panda_index] = std::move(new_panda);
+		*pDeviceID = panda_index + 1; // TIS doesn't like it when ID == 0
 	}
-
-	*pDeviceID = panda_index + 1; // TIS doesn't like it when ID == 0
 	return ret_code(STATUS_NOERROR);
 }
 PANDAJ2534DLL_API long PTAPI	PassThruClose(unsigned long DeviceID) {
 	#pragma EXPORT
-	if (check_valid_DeviceID(DeviceID) != STATUS_NOERROR) return J25334LastError;
-	get_device(DeviceID) = nullptr;
+	std::shared_ptr<PandaJ2534Device> closing;
+	synchronized(pandas_mutex) {
+		if (check_valid_DeviceID(DeviceID) != STATUS_NOERROR) return J25334LastError;
+		closing = std::move(get_device(DeviceID));
+	}
+	closing = nullptr; //Waits out the device's strand, let other devices open and close meanwhile.
 	return ret_code(STATUS_NOERROR);
 }
 PANDAJ2534DLL_API long PTAPI	PassThruConnect(unsigned long DeviceID, unsigned long ProtocolID,
@@ -152,11 +165,17 @@ PANDAJ2534DLL_API long PTAPI	PassThruConnect(unsigned long DeviceID, unsigned lo
 			break;
 		case CAN:
 		case CAN_PS:
+		case CAN_CH1:
+		case CAN_CH2:
+		case CAN_CH1 + 2:
 		//case SW_CAN_PS:
 			conn = std::make_shared<J2534Connection_CAN>(panda, ProtocolID, Flags, BaudRate);
 			break;
 		case ISO15765:
 		case ISO15765_PS:
+		case ISO15765_CH1:
+		case ISO15765_CH2:
+		case ISO15765_CH1 + 2:
 			conn = std::make_shared<J2534Connection_ISO15765>(panda, ProtocolID, Flags, BaudRate);
 			break;
 		//case SW_ISO15765_PS: // SW = Single Wire. GMLAN is a SW CAN protocol
@@ -394,7 +413,8 @@ PANDAJ2534DLL_API long PTAPI	PassThruIoctl(unsigned long ChannelID, unsigned lon
 		break;
 	}
 	case READ_VBATT:
-		panda::PANDA_HEALTH health = dev_entry->panda->get_health();
+		//Tools poll it many times a second, see PANDA_VBATT_MAX_AGE.
+		panda::PANDA_HEALTH health = dev_entry->panda->get_health_cached();
 		*(unsigned long*)pOutput = health.voltage;
 		break;
 	case FIVE_BAUD_INIT:
@@ -422,6 +442,39 @@ PANDAJ2534DLL_API long PTAPI	PassThruIoctl(unsigned long ChannelID, unsigned lon
 	case READ_PROG_VOLTAGE:
 		*(unsigned long*)pOutput = 0;
 		break;
+	case PANDA_TRACE_ENABLE:
+		if (!pInput) return ret_code(ERR_NULL_PARAMETER);
+		panda::Trace::get().enable(*(unsigned long*)pInput != 0);
+		break;
+	case PANDA_TRACE_READ:
+	{
+		SBYTE_ARRAY *out = (SBYTE_ARRAY*)pOutput;
+		if (!out || !out->BytePtr) return ret_code(ERR_NULL_PARAMETER);
+		size_t count = panda::Trace::get().dump((panda::PANDA_TRACE_EVENT*)out->BytePtr, out->NumOfBytes / sizeof(panda::PANDA_TRACE_EVENT));
+		out->NumOfBytes = (unsigned long)(count * sizeof(panda::PANDA_TRACE_EVENT));
+		break;
+	}
+	case PANDA_GET_PERIODIC_STATS:
+		if (!pInput || !pOutput) return ret_code(ERR_NULL_PARAMETER);
+		return ret_code(get_channel(ChannelID)->getPeriodicStats(*(unsigned long*)pInput, (PANDA_PERIODIC_STATS*)pOutput));
+	case PANDA_GET_FLOW_CONTROL_STATS:
+		if (!pOutput) return ret_code(ERR_NULL_PARAMETER);
+		return ret_code(get_channel(ChannelID)->getFlowControlStats((PANDA_FLOW_CONTROL_STATS*)pOutput));
+	case PANDA_SET_THREAD_SCHEDULE:
+		if (!pInput) return ret_code(ERR_NULL_PARAMETER);
+		return ret_code(dev_entry->setThreadSchedule((PANDA_THREAD_SCHEDULE*)pInput));
+	case PANDA_GET_THREAD_STATS:
+		if (!pOutput) return ret_code(ERR_NULL_PARAMETER);
+		dev_entry->getThreadStats((PANDA_THREAD_STATS*)pOutput, pInput != NULL && *(unsigned long*)pInput != 0);
+		break;
+	case PANDA_GET_TIME:
+	{
+		if (!pOutput) return ret_code(ERR_NULL_PARAMETER);
+		PANDA_TIME *out = (PANDA_TIME*)pOutput;
+		out->TimeUs = dev_entry->getDeviceTime();
+		out->Epoch = (unsigned long)(out->TimeUs >> 32);
+		break;
+	}
 	default:
 		printf("Got unknown IIOCTL %X\n", IoctlID);
 	}
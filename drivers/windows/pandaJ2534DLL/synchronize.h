@@ -54,3 +54,59 @@ private:
 //A useful shorthand for locking and unlocking a mutex over a scope.
 //CAUTION, implemented with a for loop, so break/continue are consumed.
 #define synchronized(M) for(Lock M##_lock = M; M##_lock; M##_lock.setUnlock())
+
+//Slim reader/writer lock for data that is read far more than it is written.
+//Unlike Mutex it is NOT recursive, don't take it again on the same thread.
+class SharedMutex {
+public:
+	SharedMutex() {
+		InitializeSRWLock(&srwLock);
+	}
+
+	void lock() {
+		AcquireSRWLockExclusive(&srwLock);
+	}
+
+	void unlock() {
+		ReleaseSRWLockExclusive(&srwLock);
+	}
+
+	void lock_shared() {
+		AcquireSRWLockShared(&srwLock);
+	}
+
+	void unlock_shared() {
+		ReleaseSRWLockShared(&srwLock);
+	}
+
+private:
+	SRWLOCK srwLock;
+};
+
+class SharedLock {
+public:
+	SharedLock(SharedMutex &m, bool exclusive) : mutex(m), exclusive(exclusive), locked(TRUE) {
+		if (exclusive) m.lock(); else m.lock_shared();
+	}
+
+	~SharedLock() {
+		if (exclusive) mutex.unlock(); else mutex.unlock_shared();
+	}
+
+	operator bool() const {
+		return locked;
+	}
+
+	void setUnlock() {
+		locked = FALSE;
+	}
+
+private:
+	SharedMutex& mutex;
+	bool exclusive;
+	bool locked;
+};
+
+//Same as synchronized, for readers and writers of a SharedMutex.
+#define synchronized_shared(M) for(SharedLock M##_lock(M, FALSE); M##_lock; M##_lock.setUnlock())
+#define synchronized_exclusive(M) for(SharedLock M##_lock(M, TRUE); M##_lock; M##_lock.setUnlock())
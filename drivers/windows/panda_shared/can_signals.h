@@ -0,0 +1,222 @@
+#pragma once
+
+// DBC signals decoded from whole receive buffers into columns. The message
+// table, usually generated from a DBC file, gives each message's id and each
+// signal's layout, factor and offset as template arguments, so every
+// extractor is a constant shift and mask. Plain C++11 with no Windows or USB
+// dependencies, and any frame type with the fields of PANDA_CAN_MSG will do,
+// so it sits behind can_recv_into or can_rx_q_pop_into of either driver.
+//
+//	typedef dbc::Message<0x156, false,
+//		dbc::Signal<7, 16, dbc::MOTOROLA, true, std::ratio<-1, 10>>, //STEER_ANGLE
+//		dbc::Signal<23, 16, dbc::MOTOROLA, true>> STEERING_SENSORS;  //STEER_ANGLE_RATE
+//	dbc::Decoder<STEERING_SENSORS, ...> dec;
+//	dec.decode(buff, p->can_recv_into(buff, cap));
+//	auto& t = dec.table<STEERING_SENSORS>(); //t.col(0)[k] was received at t.recv_time[k]
+//
+// decode goes over the buffer twice. The first pass sorts the frames by
+// message and keeps their data as 64 bit words. The second runs each signal
+// over all its message's words in one loop without branches, which the
+// compiler vectorizes, and appends to the signal's column.
+
+#include <array>
+#include <algorithm>
+#include <ratio>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+
+namespace panda {
+namespace dbc {
+	typedef enum _SIGNAL_ORDER {
+		MOTOROLA = 0, //@0 in a DBC, big endian
+		INTEL = 1, //@1, little endian
+	} SIGNAL_ORDER;
+
+	//The data bytes as a little endian word. Bytes past len read as 0.
+	inline uint64_t load_word(const uint8_t dat[8], uint8_t len) {
+		uint64_t w = 0;
+		for (int i = 0; i < 8; i++)
+			w |= (uint64_t)dat[i] << (8 * i);
+		return (len >= 8) ? w : w & ((1ULL << (8 * len)) - 1);
+	}
+
+	inline uint64_t swap_word(uint64_t w) {
+		w = ((w & 0x00FF00FF00FF00FFULL) << 8) | ((w >> 8) & 0x00FF00FF00FF00FFULL);
+		w = ((w & 0x0000FFFF0000FFFFULL) << 16) | ((w >> 16) & 0x0000FFFF0000FFFFULL);
+		return (w << 32) | (w >> 32);
+	}
+
+	//START is the DBC start bit, numbered from bit 0 of byte 0 up to bit 7 of
+	//byte 7. It is the least significant bit for INTEL, and the most significant
+	//for MOTOROLA. The value is raw * FACTOR + OFFSET.
+	template <unsigned START, unsigned SIZE, SIGNAL_ORDER ORDER, bool SIGNED = false,
+		class FACTOR = std::ratio<1>, class OFFSET = std::ratio<0>>
+	struct Signal {
+		//Of the most significant bit, in the little endian word for INTEL and the
+		//big endian one for MOTOROLA.
+		static const unsigned msb = (ORDER == INTEL) ? START + SIZE - 1 : (7 - START / 8) * 8 + START % 8;
+
+		static_assert(SIZE >= 1 && SIZE <= 64, "signals are 1 to 64 bits");
+		static_assert(START < 64 && msb < 64 && msb + 1 >= SIZE, "signal runs past the 8 data bytes");
+
+		//Shifted up to the top bit and back down, so SIGNED ones are sign extended.
+		static inline int64_t raw(uint64_t word) {
+			return SIGNED ? (int64_t)(word << (63 - msb)) >> (64 - SIZE)
+				: (int64_t)((word << (63 - msb)) >> (64 - SIZE));
+		}
+
+		//word is the little endian one either way. Signals that fit 32 bits are
+		//converted from 32 bits, which has vector instructions before AVX-512.
+		static inline double value(uint64_t word) {
+			int64_t r = raw(ORDER == INTEL ? word : swap_word(word));
+			return (SIZE < 32 || (SIZE == 32 && SIGNED) ? (double)(int32_t)r : (double)r) * ((double)FACTOR::num / FACTOR::den)
+				+ ((double)OFFSET::num / OFFSET::den);
+		}
+	};
+
+	//An id is in a table once.
+	template <uint32_t ADDR, bool ADDR_29B, class... SIGNALS>
+	struct Message {
+		static_assert(ADDR_29B ? ADDR < 0x20000000 : ADDR < 0x800, "id out of range");
+		static const uint32_t addr = ADDR;
+		static const bool addr_29b = ADDR_29B;
+		static const size_t signals = sizeof...(SIGNALS);
+		typedef std::tuple<SIGNALS...> signal_types;
+	};
+
+	template <class T, class... LIST> struct index_of;
+	template <class T, class... REST> struct index_of<T, T, REST...> : std::integral_constant<size_t, 0> { };
+	template <class T, class U, class... REST> struct index_of<T, U, REST...>
+		: std::integral_constant<size_t, 1 + index_of<T, REST...>::value> { };
+
+	//The frames of one message, sorted out of a receive buffer.
+	typedef struct _STAGED {
+		std::vector<uint64_t> words;
+		std::vector<unsigned long long> recv_time;
+		std::vector<uint8_t> bus;
+	} STAGED;
+
+	//A message's frames, a row each, in the order they were received.
+	template <class MSG>
+	class Table {
+	public:
+		std::vector<unsigned long long> recv_time;
+		std::vector<uint8_t> bus;
+		std::array<std::vector<double>, MSG::signals> cols;
+
+		size_t size() const { return this->recv_time.size(); }
+		std::vector<double>& col(size_t i) { return this->cols[i]; }
+		//By the signal's type, which must be there only once.
+		template <class S> std::vector<double>& col() { return this->cols[col_index<S>(typename MSG::signal_types())]; }
+
+		//Keeps the memory, so a table cleared between batches settles without allocating.
+		void clear() {
+			this->recv_time.clear();
+			this->bus.clear();
+			for (auto& c : this->cols) c.clear();
+		}
+
+		void append(const STAGED& s) {
+			size_t n = s.words.size(), base = this->size();
+			this->recv_time.insert(this->recv_time.end(), s.recv_time.begin(), s.recv_time.end());
+			this->bus.insert(this->bus.end(), s.bus.begin(), s.bus.end());
+			this->append_col<0>(s.words.data(), n, base);
+		}
+
+	private:
+		template <class S, class... SIGNALS> static size_t col_index(std::tuple<SIGNALS...>) { return index_of<S, SIGNALS...>::value; }
+
+		template <size_t I> typename std::enable_if<(I < MSG::signals)>::type append_col(const uint64_t *w, size_t n, size_t base) {
+			typedef typename std::tuple_element<I, typename MSG::signal_types>::type S;
+			auto& c = this->cols[I];
+			c.resize(base + n);
+			double *out = c.data() + base;
+			for (size_t k = 0; k < n; k++)
+				out[k] = S::value(w[k]);
+			this->append_col<I + 1>(w, n, base);
+		}
+		template <size_t I> typename std::enable_if<(I == MSG::signals)>::type append_col(const uint64_t *, size_t, size_t) { }
+	};
+
+	template <class... MSGS>
+	class Decoder {
+	public:
+		//Frames the panda sent are decoded too if receipts.
+		Decoder(bool receipts = false) : receipts(receipts) {
+			static_assert(sizeof...(MSGS) < NONE, "too many messages");
+			std::fill(this->std_index, this->std_index + 0x800, NONE);
+			this->add_ids<0>();
+		}
+
+		template <class MSG> Table<MSG>& table() { return std::get<index_of<MSG, MSGS...>::value>(this->tables); }
+
+		//Appends the frames of the table's messages to their tables. Other ids,
+		//and messages that aren't frames, like PANDA_CAN_GAP, are skipped. Returns
+		//the frames decoded.
+		template <class CAN_MSG> size_t decode(const CAN_MSG *msgs, size_t count) {
+			for (auto& s : this->staged) {
+				s.words.clear();
+				s.recv_time.clear();
+				s.bus.clear();
+			}
+
+			size_t decoded = 0;
+			for (size_t k = 0; k < count; k++) {
+				const CAN_MSG& m = msgs[k];
+				if ((uint8_t)m.bus > 2 || (m.is_receipt && !this->receipts)) continue;
+				uint16_t i = this->lookup(m.addr, m.addr_29b);
+				if (i == NONE) continue;
+				STAGED& s = this->staged[i];
+				s.words.push_back(load_word(m.dat, m.len));
+				s.recv_time.push_back(m.recv_time);
+				s.bus.push_back((uint8_t)m.bus);
+				decoded++;
+			}
+
+			if (decoded != 0) this->append_tables<0>();
+			return decoded;
+		}
+
+		void clear() { this->clear_tables<0>(); }
+
+	private:
+		enum { NONE = 0xFFFF };
+
+		uint16_t lookup(uint32_t addr, bool addr_29b) const {
+			if (!addr_29b) return (addr < 0x800) ? this->std_index[addr] : (uint16_t)NONE;
+			auto it = this->ext_index.find(addr);
+			return (it == this->ext_index.end()) ? (uint16_t)NONE : it->second;
+		}
+
+		template <size_t I> typename std::enable_if<(I < sizeof...(MSGS))>::type add_ids() {
+			typedef typename std::tuple_element<I, std::tuple<MSGS...>>::type MSG;
+			if (MSG::addr_29b) this->ext_index[MSG::addr] = I;
+			else this->std_index[MSG::addr] = I;
+			this->add_ids<I + 1>();
+		}
+		template <size_t I> typename std::enable_if<(I == sizeof...(MSGS))>::type add_ids() { }
+
+		template <size_t I> typename std::enable_if<(I < sizeof...(MSGS))>::type append_tables() {
+			if (!this->staged[I].words.empty()) std::get<I>(this->tables).append(this->staged[I]);
+			this->append_tables<I + 1>();
+		}
+		template <size_t I> typename std::enable_if<(I == sizeof...(MSGS))>::type append_tables() { }
+
+		template <size_t I> typename std::enable_if<(I < sizeof...(MSGS))>::type clear_tables() {
+			std::get<I>(this->tables).clear();
+			this->clear_tables<I + 1>();
+		}
+		template <size_t I> typename std::enable_if<(I == sizeof...(MSGS))>::type clear_tables() { }
+
+		bool receipts;
+		std::tuple<Table<MSGS>...> tables;
+		STAGED staged[sizeof...(MSGS)];
+		uint16_t std_index[0x800];
+		std::unordered_map<uint32_t, uint16_t> ext_index;
+	};
+}
+}
@@ -2,8 +2,10 @@
 
 #include <SetupAPI.h>
 #include <Devpkey.h>
+#include <cfgmgr32.h>
 
 #include <unordered_map>
+#include <unordered_set>
 #include <string>
 
 #include <winusb.h>
@@ -31,7 +33,69 @@ tstring GetLastErrorAsString(){
 	return message;
 }
 
-std::unordered_map<std::string, tstring> panda::detect_pandas() {
+//Serials by device path, only kept while the PnP notifications are on.
+static SRWLOCK device_lock = SRWLOCK_INIT;
+static std::unordered_map<tstring, std::string> device_sns;
+static std::unordered_set<tstring> device_claimed;
+static LONG device_generation = 0; //Bumped by every arrival and removal
+static bool device_notified = FALSE;
+static INIT_ONCE device_notify_once = INIT_ONCE_STATIC_INIT;
+
+static DWORD CALLBACK device_changed(HCMNOTIFICATION notify, PVOID context, CM_NOTIFY_ACTION action,
+	PCM_NOTIFY_EVENT_DATA data, DWORD size) {
+	UNREFERENCED_PARAMETER(notify);
+	UNREFERENCED_PARAMETER(context);
+	UNREFERENCED_PARAMETER(data);
+	UNREFERENCED_PARAMETER(size);
+	if (action == CM_NOTIFY_ACTION_DEVICEINTERFACEARRIVAL || action == CM_NOTIFY_ACTION_DEVICEINTERFACEREMOVAL) {
+		AcquireSRWLockExclusive(&device_lock);
+		//Another panda can come back on the path of one that left.
+		if (action == CM_NOTIFY_ACTION_DEVICEINTERFACEREMOVAL) device_sns.clear();
+		device_generation++;
+		ReleaseSRWLockExclusive(&device_lock);
+	}
+	return ERROR_SUCCESS;
+}
+
+typedef CONFIGRET(WINAPI *cm_register_notification_fn)(PCM_NOTIFY_FILTER, PVOID, PCM_NOTIFY_CALLBACK, PHCMNOTIFICATION);
+
+//CM_Register_Notification is Windows 8 on, without it nothing is cached. The
+//registration lasts the process, so the module is pinned while the callback can run.
+static BOOL CALLBACK device_notify_start(PINIT_ONCE once, PVOID param, PVOID *context) {
+	UNREFERENCED_PARAMETER(once);
+	UNREFERENCED_PARAMETER(param);
+	UNREFERENCED_PARAMETER(context);
+	HMODULE cfgmgr = LoadLibrary(_T("cfgmgr32.dll"));
+	if (cfgmgr == NULL) return TRUE;
+	auto cm_register = (cm_register_notification_fn)GetProcAddress(cfgmgr, "CM_Register_Notification");
+	HMODULE self;
+	if (cm_register == NULL || !GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_PIN,
+		(LPCTSTR)device_changed, &self)) return TRUE;
+
+	CM_NOTIFY_FILTER filter;
+	ZeroMemory(&filter, sizeof(filter));
+	filter.cbSize = sizeof(filter);
+	filter.FilterType = CM_NOTIFY_FILTER_TYPE_DEVICEINTERFACE;
+	filter.u.DeviceInterface.ClassGuid = GUID_DEVINTERFACE_panda;
+	HCMNOTIFICATION notify;
+	if (cm_register(&filter, NULL, device_changed, &notify) == CR_SUCCESS) {
+		AcquireSRWLockExclusive(&device_lock);
+		device_notified = TRUE;
+		ReleaseSRWLockExclusive(&device_lock);
+	}
+	return TRUE;
+}
+
+void panda::device_claim(const tstring& path, bool claim) {
+	AcquireSRWLockExclusive(&device_lock);
+	if (claim)
+		device_claimed.insert(path);
+	else
+		device_claimed.erase(path);
+	ReleaseSRWLockExclusive(&device_lock);
+}
+
+std::unordered_map<std::string, tstring> panda::detect_pandas(bool claimed) {
 	HDEVINFO                        deviceInfo;
 	HRESULT                         hr;
 	SP_DEVINFO_DATA					deviceInfoData;
@@ -40,6 +104,11 @@ std::unordered_map<std::string, tstring> panda::detect_pandas() {
 
 	std::unordered_map<std::string, tstring> map_sn_to_devpath;
 
+	InitOnceExecuteOnce(&device_notify_once, device_notify_start, NULL, NULL);
+	AcquireSRWLockShared(&device_lock);
+	LONG generation = device_generation;
+	ReleaseSRWLockShared(&device_lock);
+
 	deviceInfo = SetupDiGetClassDevs(&GUID_DEVINTERFACE_panda,
 		NULL, NULL, DIGCF_PRESENT | DIGCF_DEVICEINTERFACE); //DIGCF_ALLCLASSES
 
@@ -86,6 +155,21 @@ std::unordered_map<std::string, tstring> panda::detect_pandas() {
 			continue;
 		}
 
+		tstring devpath(detailData->DevicePath);
+		bool known = FALSE;
+		AcquireSRWLockShared(&device_lock);
+		bool skip = !claimed && device_claimed.count(devpath) != 0;
+		auto cached = device_sns.find(devpath);
+		if (!skip && device_notified && cached != device_sns.end()) {
+			map_sn_to_devpath[cached->second] = devpath;
+			known = TRUE;
+		}
+		ReleaseSRWLockShared(&device_lock);
+		if (skip || known) {
+			LocalFree(detailData);
+			continue;
+		}
+
 		//_tprintf(_T("    Path: '%s'\n"), detailData->DevicePath);
 		HANDLE deviceHandle = CreateFile(detailData->DevicePath,
 			GENERIC_WRITE | GENERIC_READ, FILE_SHARE_WRITE | FILE_SHARE_READ,
@@ -154,7 +238,11 @@ std::unordered_map<std::string, tstring> panda::detect_pandas() {
 		std::string serialnum(w_to_m_buff, mbuff_len-1);
 		printf("    Device found: seriallen: %d; serial: %s\n", lengthReceived, serialnum.c_str());
 
-		map_sn_to_devpath[serialnum] = tstring(detailData->DevicePath);
+		map_sn_to_devpath[serialnum] = devpath;
+		AcquireSRWLockExclusive(&device_lock);
+		//Not if a panda came or went while it was read, it may not be this one's.
+		if (device_notified && device_generation == generation) device_sns[devpath] = serialnum;
+		ReleaseSRWLockExclusive(&device_lock);
 
 		LocalFree(psnDesc);
 		WinUsb_Free(winusbHandle);
@@ -27,6 +27,11 @@ DEFINE_GUID(GUID_DEVINTERFACE_panda,
 tstring GetLastErrorAsString();
 
 namespace panda {
-	std::unordered_map<std::string, tstring> __declspec(dllexport) detect_pandas();
+	//Serial numbers to device paths. The serials of paths seen before are kept
+	//until a panda is plugged in or out, so only new devices are opened to read
+	//theirs. Those open in this process are left out unless claimed is set.
+	std::unordered_map<std::string, tstring> __declspec(dllexport) detect_pandas(bool claimed = FALSE);
+	//Panda marks its path while it has it open.
+	void device_claim(const tstring& path, bool claim);
 }
 #endif
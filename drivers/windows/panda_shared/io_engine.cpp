@@ -0,0 +1,408 @@
+// io_engine.cpp : shared workers on one I/O completion port.
+//
+#include "stdafx.h"
+
+#include <avrt.h>
+
+#include "io_engine.h"
+
+#pragma comment(lib, "avrt.lib")
+
+using namespace panda;
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
+//Packets on the port: an OVERLAPPED with the key of the strand attached to its
+//handle, a NULL one with a strand's key to run it, a NULL one with key 0 to
+//stop a worker, or reschedule with key 0 to wake one for set_schedule.
+static OVERLAPPED reschedule;
+
+std::shared_ptr<IoEngine> IoEngine::shared() {
+	static std::mutex lock;
+	static std::weak_ptr<IoEngine> engine;
+	std::lock_guard<std::mutex> guard(lock);
+	auto p = engine.lock();
+	if (!p) {
+		p = std::shared_ptr<IoEngine>(new IoEngine());
+		engine = p;
+	}
+	return p;
+}
+
+IoEngine::IoEngine() {
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	DWORD n = min(max(info.dwNumberOfProcessors, 1), IO_ENGINE_WORKERS_MAX);
+	this->port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, n);
+
+	this->timer_wakeup_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+	//High resolution timers need Windows 10 1803, older versions get the regular tick.
+	this->timer = CreateWaitableTimerEx(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+	if (this->timer == NULL)
+		this->timer = CreateWaitableTimer(NULL, FALSE, NULL);
+
+	for (DWORD i = 0; i < n; i++) {
+		DWORD id;
+		this->worker_handles.push_back(CreateThread(NULL, 0, _worker_threadBootstrap, (LPVOID)this, 0, &id));
+		this->worker_ids.push_back(id);
+	}
+	DWORD id;
+	this->timer_handle = CreateThread(NULL, 0, _timer_threadBootstrap, (LPVOID)this, 0, &id);
+}
+
+IoEngine::~IoEngine() {
+	{
+		std::lock_guard<std::mutex> guard(this->timers_lock);
+		this->timers_stop = TRUE;
+	}
+	SetEvent(this->timer_wakeup_event);
+	WaitForSingleObject(this->timer_handle, INFINITE);
+	CloseHandle(this->timer_handle);
+
+	for (size_t i = 0; i < this->worker_handles.size(); i++)
+		PostQueuedCompletionStatus(this->port, 0, 0, NULL);
+	for (auto h : this->worker_handles) {
+		WaitForSingleObject(h, INFINITE);
+		CloseHandle(h);
+	}
+
+	CloseHandle(this->timer);
+	CloseHandle(this->timer_wakeup_event);
+	CloseHandle(this->port);
+}
+
+std::shared_ptr<IoStrand> IoEngine::strand() {
+	std::lock_guard<std::mutex> guard(this->strands_lock);
+	ULONG_PTR key = this->next_key++;
+	auto s = std::shared_ptr<IoStrand>(new IoStrand(shared_from_this(), key));
+	this->strands[key] = s.get();
+	return s;
+}
+
+size_t IoEngine::workers() {
+	return this->worker_handles.size();
+}
+
+IoStrand *IoEngine::acquire(ULONG_PTR key) {
+	std::lock_guard<std::mutex> guard(this->strands_lock);
+	auto found = this->strands.find(key);
+	if (found == this->strands.end()) return nullptr;
+	found->second->acquired++;
+	return found->second;
+}
+
+void IoEngine::release(IoStrand *strand) {
+	std::lock_guard<std::mutex> guard(this->strands_lock);
+	if (--strand->acquired == 0)
+		this->strands_released.notify_all();
+}
+
+bool IoEngine::set_schedule(const IoSchedule& schedule) {
+	switch (schedule.priority) {
+	case THREAD_PRIORITY_IDLE: case THREAD_PRIORITY_LOWEST: case THREAD_PRIORITY_BELOW_NORMAL:
+	case THREAD_PRIORITY_NORMAL: case THREAD_PRIORITY_ABOVE_NORMAL: case THREAD_PRIORITY_HIGHEST:
+	case THREAD_PRIORITY_TIME_CRITICAL:
+		break;
+	default:
+		return FALSE;
+	}
+	DWORD_PTR process, system;
+	if (!GetProcessAffinityMask(GetCurrentProcess(), &process, &system)) return FALSE;
+	if ((schedule.affinity & ~process) != 0) return FALSE;
+
+	{
+		std::lock_guard<std::mutex> guard(this->schedule_lock);
+		this->schedule = schedule;
+		this->schedule_gen++;
+	}
+	for (size_t i = 0; i < this->worker_handles.size(); i++)
+		PostQueuedCompletionStatus(this->port, 0, 0, &reschedule);
+	SetEvent(this->timer_wakeup_event);
+	return TRUE;
+}
+
+IoSchedule IoEngine::get_schedule() {
+	std::lock_guard<std::mutex> guard(this->schedule_lock);
+	return this->schedule;
+}
+
+IoWakeupStats IoEngine::get_wakeup_stats(bool reset) {
+	std::lock_guard<std::mutex> guard(this->wakeup_lock);
+	IoWakeupStats stats = this->wakeup;
+	stats.threads = (unsigned long)this->worker_handles.size() + 1;
+	stats.mmcss_threads = this->mmcss_threads.load();
+	if (reset) this->wakeup = {};
+	return stats;
+}
+
+//MMCSS sets the priority itself, the thread's own is only for the others. A
+//task MMCSS won't take, its service being off, leaves the thread on its own.
+void IoEngine::schedule_here(unsigned int& applied, HANDLE& mmcss) {
+	unsigned int gen = this->schedule_gen.load();
+	if (gen == applied) return;
+	applied = gen;
+	IoSchedule schedule = this->get_schedule();
+
+	if (!schedule.mmcss)
+		this->unschedule_here(mmcss);
+	else if (mmcss == NULL) {
+		DWORD task = 0;
+		mmcss = AvSetMmThreadCharacteristicsW(IO_ENGINE_MMCSS_TASK, &task);
+		if (mmcss != NULL) this->mmcss_threads++;
+	}
+	if (mmcss != NULL) {
+		AVRT_PRIORITY p = AVRT_PRIORITY_NORMAL;
+		if (schedule.priority >= THREAD_PRIORITY_HIGHEST) p = AVRT_PRIORITY_CRITICAL;
+		else if (schedule.priority > THREAD_PRIORITY_NORMAL) p = AVRT_PRIORITY_HIGH;
+		else if (schedule.priority < THREAD_PRIORITY_NORMAL) p = AVRT_PRIORITY_LOW;
+		AvSetMmThreadPriority(mmcss, p);
+	} else {
+		SetThreadPriority(GetCurrentThread(), schedule.priority);
+	}
+
+	DWORD_PTR process, system;
+	if (GetProcessAffinityMask(GetCurrentProcess(), &process, &system))
+		SetThreadAffinityMask(GetCurrentThread(), schedule.affinity ? schedule.affinity : process);
+}
+
+void IoEngine::unschedule_here(HANDLE& mmcss) {
+	if (mmcss == NULL) return;
+	AvRevertMmThreadCharacteristics(mmcss);
+	mmcss = NULL;
+	this->mmcss_threads--;
+}
+
+void IoEngine::wakeup_record(clock::duration late) {
+	auto us = std::chrono::duration_cast<std::chrono::microseconds>(late).count();
+	unsigned long l = (unsigned long)max(us, 0);
+	std::lock_guard<std::mutex> guard(this->wakeup_lock);
+	this->wakeup.count++;
+	this->wakeup.total_us += l;
+	this->wakeup.last_us = l;
+	this->wakeup.max_us = max(this->wakeup.max_us, l);
+	if (l > IO_ENGINE_WAKEUP_LATE_US) this->wakeup.over++;
+}
+
+DWORD IoEngine::worker_thread() {
+	OVERLAPPED_ENTRY entries[64];
+	unsigned int applied = 0;
+	HANDLE mmcss = NULL;
+	while (1) {
+		this->schedule_here(applied, mmcss);
+		ULONG count = 0;
+		if (!GetQueuedCompletionStatusEx(this->port, entries, ARRAYSIZE(entries), &count, INFINITE, FALSE))
+			continue;
+		for (ULONG k = 0; k < count; k++) {
+			if (entries[k].lpCompletionKey == 0 && entries[k].lpOverlapped == &reschedule) {
+				this->schedule_here(applied, mmcss);
+				continue;
+			}
+			if (entries[k].lpCompletionKey == 0 && entries[k].lpOverlapped == NULL) {
+				//Whatever else came with the stop is the other workers' to take.
+				for (ULONG rest = k + 1; rest < count; rest++)
+					PostQueuedCompletionStatus(this->port, entries[rest].dwNumberOfBytesTransferred,
+						entries[rest].lpCompletionKey, entries[rest].lpOverlapped);
+				this->unschedule_here(mmcss);
+				return 0;
+			}
+
+			IoStrand *s = this->acquire(entries[k].lpCompletionKey);
+			if (s == nullptr) continue; //Completions of a strand that's gone
+			if (entries[k].lpOverlapped != NULL)
+				s->completed(entries[k].lpOverlapped);
+			else
+				s->run();
+			this->release(s);
+		}
+	}
+}
+
+void IoEngine::timer_add(clock::time_point due, ULONG_PTR key, IoTimerHandle handle) {
+	bool sooner;
+	{
+		std::lock_guard<std::mutex> guard(this->timers_lock);
+		sooner = this->timers.empty() || due < this->timers.top().due;
+		this->timers.push({ due, key, handle });
+	}
+	if (sooner) SetEvent(this->timer_wakeup_event);
+}
+
+//Hands the timers that are due to their strands, then sleeps on the waitable
+//timer until IO_ENGINE_SPIN_US before the next one and spins out the rest.
+DWORD IoEngine::timer_thread() {
+	const HANDLE handles[] = { this->timer_wakeup_event, this->timer };
+	std::vector<Due> fired;
+	unsigned int applied = 0;
+	HANDLE mmcss = NULL;
+	while (1) {
+		this->schedule_here(applied, mmcss);
+		bool have_next = FALSE;
+		clock::time_point next;
+		{
+			std::lock_guard<std::mutex> guard(this->timers_lock);
+			if (this->timers_stop) {
+				this->unschedule_here(mmcss);
+				return 0;
+			}
+			auto now = clock::now();
+			while (!this->timers.empty() && this->timers.top().due <= now) {
+				fired.push_back(this->timers.top());
+				this->timers.pop();
+			}
+			if (!this->timers.empty()) {
+				next = this->timers.top().due;
+				have_next = TRUE;
+			}
+		}
+
+		if (!fired.empty()) {
+			for (auto& due : fired) {
+				IoStrand *s = this->acquire(due.key);
+				if (s == nullptr) continue;
+				s->fire(due.handle, due.due);
+				this->release(s);
+			}
+			fired.clear();
+			continue;
+		}
+
+		if (!have_next) {
+			WaitForSingleObject(this->timer_wakeup_event, INFINITE);
+			continue;
+		}
+
+		auto remaining = next - clock::now();
+		if (remaining <= std::chrono::microseconds(IO_ENGINE_SPIN_US)) {
+			//A sooner timer sets the event, and is let in ahead of this one.
+			while (clock::now() < next)
+				if (WaitForSingleObject(this->timer_wakeup_event, 0) == WAIT_OBJECT_0) break;
+			continue;
+		}
+
+		//Relative due time in 100ns units. Wake early and spin the rest.
+		LARGE_INTEGER due;
+		auto sleep_us = std::chrono::duration_cast<std::chrono::microseconds>(remaining).count() - IO_ENGINE_SPIN_US;
+		due.QuadPart = -(LONGLONG)(sleep_us * 10);
+		SetWaitableTimer(this->timer, &due, 0, NULL, NULL, FALSE);
+		WaitForMultipleObjects(2, handles, FALSE, INFINITE);
+	}
+}
+
+IoStrand::IoStrand(std::shared_ptr<IoEngine> engine, ULONG_PTR key) : engine(engine), key(key) { }
+
+IoStrand::~IoStrand() {
+	this->close();
+	std::unique_lock<std::mutex> guard(this->engine->strands_lock);
+	this->engine->strands.erase(this->key);
+	this->engine->strands_released.wait(guard, [this] { return this->acquired == 0; });
+}
+
+void IoStrand::enqueue(std::function<void()> fn) {
+	{
+		std::lock_guard<std::mutex> guard(this->lock);
+		if (this->closed) return;
+		this->queue.push_back(std::move(fn));
+		if (this->scheduled) return;
+		this->scheduled = TRUE;
+	}
+	PostQueuedCompletionStatus(this->engine->port, 0, this->key, NULL);
+}
+
+void IoStrand::post(std::function<void()> fn) {
+	this->enqueue(std::move(fn));
+}
+
+IoTimerHandle IoStrand::post_at(clock::time_point due, std::function<void()> fn) {
+	IoTimerHandle handle;
+	{
+		std::lock_guard<std::mutex> guard(this->lock);
+		if (this->closed) return 0;
+		handle = this->next_timer++;
+		this->timers[handle] = std::move(fn);
+	}
+	this->engine->timer_add(due, this->key, handle);
+	return handle;
+}
+
+void IoStrand::cancel(IoTimerHandle handle) {
+	std::function<void()> dropped;
+	std::lock_guard<std::mutex> guard(this->lock);
+	auto found = this->timers.find(handle);
+	if (found == this->timers.end()) return;
+	dropped = std::move(found->second);
+	this->timers.erase(found);
+}
+
+//Timed work records how late it starts on the worker.
+void IoStrand::fire(IoTimerHandle handle, clock::time_point due) {
+	std::function<void()> fn;
+	{
+		std::lock_guard<std::mutex> guard(this->lock);
+		auto found = this->timers.find(handle);
+		if (found == this->timers.end()) return; //Canceled
+		fn = std::move(found->second);
+		this->timers.erase(found);
+	}
+	IoEngine *engine = this->engine.get();
+	this->enqueue([engine, due, fn] {
+		engine->wakeup_record(clock::now() - due);
+		fn();
+	});
+}
+
+bool IoStrand::attach(HANDLE h, std::function<void(OVERLAPPED*)> done) {
+	{
+		std::lock_guard<std::mutex> guard(this->lock);
+		this->done = std::move(done);
+	}
+	if (CreateIoCompletionPort(h, this->engine->port, this->key, 0) == NULL) return FALSE;
+	return SetFileCompletionNotificationModes(h, FILE_SKIP_COMPLETION_PORT_ON_SUCCESS) != FALSE;
+}
+
+void IoStrand::completed(OVERLAPPED *overlapped) {
+	this->enqueue([this, overlapped] {
+		if (this->done) this->done(overlapped);
+	});
+}
+
+//On a worker. A strand with more than IO_STRAND_BATCH items queued goes to the
+//back of the port, so one busy device doesn't hold a worker from the others.
+void IoStrand::run() {
+	this->runner.store(GetCurrentThreadId());
+	for (int i = 0; i < IO_STRAND_BATCH; i++) {
+		std::function<void()> fn;
+		{
+			std::lock_guard<std::mutex> guard(this->lock);
+			if (this->closed || this->queue.empty()) {
+				this->runner.store(0);
+				this->scheduled = FALSE;
+				this->idle.notify_all();
+				return;
+			}
+			fn = std::move(this->queue.front());
+			this->queue.pop_front();
+		}
+		fn();
+	}
+	this->runner.store(0);
+	PostQueuedCompletionStatus(this->engine->port, 0, this->key, NULL);
+}
+
+void IoStrand::close() {
+	std::deque<std::function<void()>> queue;
+	std::unordered_map<IoTimerHandle, std::function<void()>> timers;
+	std::unique_lock<std::mutex> guard(this->lock);
+	this->closed = TRUE;
+	queue.swap(this->queue);
+	timers.swap(this->timers);
+	//From the strand the item running now is the last, there's nothing to wait for.
+	if (!this->running_here())
+		this->idle.wait(guard, [this] { return !this->scheduled; });
+	guard.unlock();
+}
+
+bool IoStrand::running_here() {
+	return this->runner.load() == GetCurrentThreadId();
+}
@@ -0,0 +1,182 @@
+#pragma once
+
+// A small pool of worker threads on one I/O completion port, shared by every
+// device of the process. Work is put on a strand, and a strand runs one item
+// at a time in the order they were queued, on whichever worker is free, so a
+// device's handlers never race each other without a thread of its own. USB
+// completions of a handle attached to a strand, timed work and plain posts
+// all come through the same port. Threads stay at the workers plus one timer
+// thread however many devices are open, and set_schedule is how they're
+// scheduled for all of them.
+
+#include <deque>
+#include <queue>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+
+#include "panda.h"
+
+//Workers are the hardware threads up to this many.
+#define IO_ENGINE_WORKERS_MAX 4
+//Waitable timers can fire a bit late, the timer thread wakes this much early
+//and spins the rest. Lets ISO 15765 honor STmin values of 100-900us.
+#define IO_ENGINE_SPIN_US 300
+//Items a worker runs from a strand before giving the others a turn.
+#define IO_STRAND_BATCH 64
+//The MMCSS task of the threads with IoSchedule's mmcss, which has them run at
+//the priorities audio does while the process is in the foreground or not.
+#define IO_ENGINE_MMCSS_TASK L"Pro Audio"
+//Wakeups later than this are counted in IoWakeupStats' over.
+#define IO_ENGINE_WAKEUP_LATE_US 1000
+
+namespace panda {
+	class IoStrand;
+
+	//0 is never a timer.
+	typedef unsigned long long IoTimerHandle;
+
+	//How every thread of the engine is scheduled, see IoEngine::set_schedule.
+	typedef struct _IoSchedule {
+		int priority = THREAD_PRIORITY_NORMAL; //-2 to 2, or THREAD_PRIORITY_IDLE or TIME_CRITICAL
+		bool mmcss = FALSE; //As IO_ENGINE_MMCSS_TASK, priority is then MMCSS's
+		DWORD_PTR affinity = 0; //Processors the threads may run on, 0 for the process'
+	} IoSchedule;
+
+	//Timed work starting on a worker, from when it was due. How late the
+	//threads wake on a loaded machine, the timer's own lateness included.
+	typedef struct _IoWakeupStats {
+		unsigned long long count;
+		unsigned long long total_us;
+		unsigned long last_us;
+		unsigned long max_us;
+		unsigned long over; //Later than IO_ENGINE_WAKEUP_LATE_US
+		unsigned long threads;
+		unsigned long mmcss_threads; //That MMCSS took
+	} IoWakeupStats;
+
+	class PANDA_API IoEngine : public std::enable_shared_from_this<IoEngine> {
+		friend class IoStrand;
+	public:
+		using clock = std::chrono::steady_clock;
+
+		//The engine of the process, started by the first caller and stopped
+		//once the last strand of it is gone.
+		static std::shared_ptr<IoEngine> shared();
+
+		~IoEngine();
+
+		std::shared_ptr<IoStrand> strand();
+		size_t workers();
+
+		//Every thread takes it on itself the next time it wakes, which this has
+		//them do. FALSE, and nothing changes, for a priority SetThreadPriority
+		//doesn't know or processors the process can't run on.
+		bool set_schedule(const IoSchedule& schedule);
+		IoSchedule get_schedule();
+		//Since the engine started or the last reset.
+		IoWakeupStats get_wakeup_stats(bool reset = FALSE);
+
+	private:
+		IoEngine();
+
+		static DWORD WINAPI _worker_threadBootstrap(LPVOID This) {
+			return ((IoEngine*)This)->worker_thread();
+		}
+		DWORD worker_thread();
+		static DWORD WINAPI _timer_threadBootstrap(LPVOID This) {
+			return ((IoEngine*)This)->timer_thread();
+		}
+		DWORD timer_thread();
+
+		//Keeps the strand from going away until release, nullptr if it's gone.
+		IoStrand *acquire(ULONG_PTR key);
+		void release(IoStrand *strand);
+		void timer_add(clock::time_point due, ULONG_PTR key, IoTimerHandle handle);
+		//On each thread of the engine, applied is the generation it has and
+		//mmcss its MMCSS handle, NULL if it has none.
+		void schedule_here(unsigned int& applied, HANDLE& mmcss);
+		void unschedule_here(HANDLE& mmcss);
+		void wakeup_record(clock::duration late);
+
+		HANDLE port;
+		std::vector<HANDLE> worker_handles;
+		std::vector<DWORD> worker_ids;
+
+		//Strands by their completion key. A strand removes itself when it goes away,
+		//after the threads that acquired it are done with it, so the last reference
+		//to it or the engine is never dropped on one of the engine's threads.
+		std::mutex strands_lock;
+		std::condition_variable strands_released;
+		std::unordered_map<ULONG_PTR, IoStrand*> strands;
+		ULONG_PTR next_key = 1;
+
+		//Min heap on due, canceled timers are skipped when they reach the top.
+		struct Due {
+			clock::time_point due;
+			ULONG_PTR key;
+			IoTimerHandle handle;
+			bool operator>(const Due& other) const { return due > other.due; }
+		};
+		std::mutex timers_lock;
+		std::priority_queue<Due, std::vector<Due>, std::greater<Due>> timers;
+		bool timers_stop = FALSE;
+		HANDLE timer_wakeup_event;
+		HANDLE timer; //High resolution waitable timer where the OS has it
+		HANDLE timer_handle;
+
+		std::mutex schedule_lock;
+		IoSchedule schedule;
+		std::atomic<unsigned int> schedule_gen{ 0 }; //Bumped by each set_schedule
+		std::atomic<unsigned long> mmcss_threads{ 0 };
+
+		std::mutex wakeup_lock;
+		IoWakeupStats wakeup = {};
+	};
+
+	class PANDA_API IoStrand {
+		friend class IoEngine;
+	public:
+		using clock = IoEngine::clock;
+
+		~IoStrand();
+
+		//Runs fn on the strand after what is queued before it.
+		void post(std::function<void()> fn);
+		//Runs fn on the strand once due has passed.
+		IoTimerHandle post_at(clock::time_point due, std::function<void()> fn);
+		//Drops a timer. Does nothing if it already ran, or is running.
+		void cancel(IoTimerHandle handle);
+		//Overlapped operations on h complete on the port, and done runs on the strand
+		//with each one's OVERLAPPED. Operations that finish at once are not sent to
+		//the port, the caller handles them where it issued them.
+		bool attach(HANDLE h, std::function<void(OVERLAPPED*)> done);
+		//Once it returns nothing of the strand is running and nothing more will
+		//run, queued work is dropped. Not from the strand itself.
+		void close();
+		//Whether the caller is running on this strand.
+		bool running_here();
+
+	private:
+		IoStrand(std::shared_ptr<IoEngine> engine, ULONG_PTR key);
+
+		void enqueue(std::function<void()> fn);
+		void completed(OVERLAPPED *overlapped);
+		void fire(IoTimerHandle handle, clock::time_point due);
+		void run();
+
+		std::shared_ptr<IoEngine> engine;
+		ULONG_PTR key;
+
+		std::mutex lock;
+		std::condition_variable idle;
+		std::deque<std::function<void()>> queue;
+		std::unordered_map<IoTimerHandle, std::function<void()>> timers;
+		IoTimerHandle next_timer = 1;
+		std::function<void(OVERLAPPED*)> done;
+		bool scheduled = FALSE; //A worker has it or will, until the queue is empty
+		bool closed = FALSE;
+		unsigned int acquired = 0; //Guarded by the engine's strands_lock
+		std::atomic<DWORD> runner{ 0 }; //The worker's thread id while it runs
+	};
+}
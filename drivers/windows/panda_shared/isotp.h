@@ -0,0 +1,260 @@
+#pragma once
+
+// ISO-TP (ISO 15765-2) segmentation and flow control on classic CAN. Plain
+// C++11 with no Windows or USB dependencies, so the J2534 ISO15765 code and
+// the python extension (python/isotpmodule.cpp) share it. Frames carry only
+// the data bytes, the CAN id is up to the Link.
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <stdint.h>
+#include <string.h>
+
+namespace panda {
+namespace isotp {
+	const uint8_t PCI_SINGLE = 0x00;
+	const uint8_t PCI_FIRST = 0x10;
+	const uint8_t PCI_CONSEC = 0x20;
+	const uint8_t PCI_FLOWCTRL = 0x30;
+
+	const uint8_t FLOW_CONTINUE = 0;
+	const uint8_t FLOW_WAIT = 1;
+	const uint8_t FLOW_ABORT = 2;
+
+	//The first frame length is 12 bits.
+	const size_t MAX_LEN = 4095;
+
+	typedef enum _RESULT {
+		OK = 0,
+		TIMEOUT, //N_Bs or N_Cr ran out
+		ABORTED, //The receiver answered with an overflow
+		WAIT_LIMIT, //More wait flow controls than max_wait_frames
+		BAD_SEQUENCE, //A consecutive frame came out of order
+		TOO_LONG,
+		LINK_ERROR, //The link failed to send or receive
+	} RESULT;
+
+	inline const char* result_str(RESULT res) {
+		switch (res) {
+		case OK: return "ok";
+		case TIMEOUT: return "timed out";
+		case ABORTED: return "aborted by the receiver";
+		case WAIT_LIMIT: return "too many wait frames";
+		case BAD_SEQUENCE: return "consecutive frame out of sequence";
+		case TOO_LONG: return "message too long";
+		case LINK_ERROR: return "link error";
+		}
+		return "unknown";
+	}
+
+	//Frames to and from one peer. recv returns whatever arrived from the peer
+	//since the last call without blocking for long, the engine does the timing.
+	class Link {
+	public:
+		virtual ~Link() { }
+		virtual bool send(const std::string& frame) = 0;
+		virtual bool recv(std::vector<std::string>& frames) = 0;
+
+		//Sleeps under 1ms spin, the OS timer is too coarse for STmin 0xF1-0xF9.
+		virtual void sleep_us(unsigned long us) {
+			auto until = std::chrono::steady_clock::now() + std::chrono::microseconds(us);
+			if (us >= 1000) std::this_thread::sleep_for(std::chrono::microseconds(us));
+			while (std::chrono::steady_clock::now() < until);
+		}
+	};
+
+	struct Options {
+		int tx_ext_addr = -1; //First byte of every frame sent, -1 for normal addressing
+		int rx_ext_addr = -1; //First byte of every frame received
+		bool pad = true; //Pad short frames to 8 bytes
+		uint8_t block_size = 0; //Sent in our flow control, 0 for no limit
+		uint8_t st_min = 0; //Sent in our flow control
+		unsigned int timeout_ms = 1000; //N_Bs and N_Cr
+		unsigned int first_timeout_ms = 0; //recv's wait for the first frame, 0 waits forever
+		unsigned int max_wait_frames = 10; //N_WFTmax
+	};
+
+	//STmin in microseconds. Returns false for the reserved values.
+	inline bool st_min_us(uint8_t st_min, unsigned long& us) {
+		if (st_min <= 0x7F) {
+			us = st_min * 1000UL;
+			return true;
+		}
+		if (st_min >= 0xF1 && st_min <= 0xF9) {
+			us = (st_min & 0x0F) * 100UL;
+			return true;
+		}
+		return false;
+	}
+
+	//The frames segment makes of a len byte payload, with ext_addr -1 for none.
+	inline size_t frame_count(int ext_addr, size_t len) {
+		size_t prefix_len = (ext_addr >= 0) ? 1 : 0;
+		if (len <= 7 - prefix_len) return 1;
+		size_t cf_len = 7 - prefix_len;
+		return 1 + (len - (6 - prefix_len) + cf_len - 1) / cf_len;
+	}
+
+	//Frame index of the message into out, worked out from the payload and the
+	//index alone so a sender needs no copy of each frame. Returns its length.
+	//First frames are always full, so only single and the last consecutive frames are padded.
+	inline uint8_t frame_at(int ext_addr, const uint8_t* payload, size_t len, bool pad, size_t index, uint8_t out[8]) {
+		uint8_t n = 0;
+		if (ext_addr >= 0) out[n++] = (uint8_t)ext_addr;
+		size_t prefix_len = n;
+		size_t pos = 0, take = len;
+		if (len <= 7 - prefix_len) {
+			out[n++] = (uint8_t)len;
+		} else if (index == 0) {
+			out[n++] = PCI_FIRST | ((len >> 8) & 0xF);
+			out[n++] = len & 0xFF;
+			take = 6 - prefix_len;
+		} else {
+			size_t cf_len = 7 - prefix_len;
+			pos = (6 - prefix_len) + (index - 1) * cf_len;
+			out[n++] = PCI_CONSEC | (index % 0x10);
+			take = (len - pos < cf_len) ? (len - pos) : cf_len;
+		}
+		memcpy(out + n, payload + pos, take);
+		n += (uint8_t)take;
+		if (pad && n < 8) {
+			memset(out + n, 0, 8 - n);
+			n = 8;
+		}
+		return n;
+	}
+
+	//The frames of one message. prefix is the extended address, empty if none.
+	inline std::vector<std::string> segment(const std::string& prefix, const std::string& payload, bool pad) {
+		int ext_addr = prefix.empty() ? -1 : (uint8_t)prefix[0];
+		std::vector<std::string> frames;
+		for (size_t i = 0; i < frame_count(ext_addr, payload.size()); i++) {
+			uint8_t frame[8];
+			uint8_t n = frame_at(ext_addr, (const uint8_t*)payload.data(), payload.size(), pad, i, frame);
+			frames.push_back(std::string((const char*)frame, n));
+		}
+		return frames;
+	}
+
+	namespace detail {
+		using clock = std::chrono::steady_clock;
+
+		//Next frame with the expected extended address, the PCI byte at its offset.
+		//Frames that aren't for us are dropped. A timeout_ms of 0 waits forever.
+		inline RESULT next_frame(Link& link, const Options& opt, std::vector<std::string>& pending,
+			unsigned int timeout_ms, std::string& frame) {
+			auto deadline = clock::now() + std::chrono::milliseconds(timeout_ms);
+			size_t off = (opt.rx_ext_addr >= 0) ? 1 : 0;
+			while (true) {
+				while (pending.size() > 0) {
+					frame = pending.front();
+					pending.erase(pending.begin());
+					if (frame.size() <= off) continue;
+					if (off && (uint8_t)frame[0] != opt.rx_ext_addr) continue;
+					return OK;
+				}
+				if (timeout_ms != 0 && clock::now() >= deadline) return TIMEOUT;
+				if (!link.recv(pending)) return LINK_ERROR;
+			}
+		}
+	}
+
+	//Sends payload, following the receiver's flow control: its block size, its
+	//STmin between consecutive frames, and wait frames up to max_wait_frames.
+	inline RESULT send(Link& link, const std::string& payload, const Options& opt = Options()) {
+		if (payload.size() > MAX_LEN) return TOO_LONG;
+		std::string prefix = (opt.tx_ext_addr >= 0) ? std::string(1, (char)opt.tx_ext_addr) : std::string();
+		auto frames = segment(prefix, payload, opt.pad);
+		if (!link.send(frames[0])) return LINK_ERROR;
+
+		size_t off = (opt.rx_ext_addr >= 0) ? 1 : 0;
+		std::vector<std::string> pending;
+		size_t next = 1;
+		while (next < frames.size()) {
+			//Wait for a flow control to continue.
+			unsigned int waits = 0;
+			uint8_t block_size = 0;
+			unsigned long gap_us = 0;
+			while (true) {
+				std::string fc;
+				RESULT res = detail::next_frame(link, opt, pending, opt.timeout_ms, fc);
+				if (res != OK) return res;
+				if (fc.size() < off + 3 || ((uint8_t)fc[off] & 0xF0) != PCI_FLOWCTRL) continue;
+
+				uint8_t status = fc[off] & 0x0F;
+				if (status == FLOW_CONTINUE) {
+					block_size = fc[off + 1];
+					//Reserved values mean the longest STmin.
+					if (!st_min_us(fc[off + 2], gap_us)) gap_us = 0x7F * 1000UL;
+					break;
+				} else if (status == FLOW_WAIT) {
+					if (++waits > opt.max_wait_frames) return WAIT_LIMIT;
+				} else {
+					return ABORTED;
+				}
+			}
+
+			//A block, or the rest of the message if the block size is 0.
+			for (unsigned int sent = 0; next < frames.size() && (block_size == 0 || sent < block_size); sent++) {
+				if (sent > 0 && gap_us > 0) link.sleep_us(gap_us);
+				if (!link.send(frames[next++])) return LINK_ERROR;
+			}
+		}
+		return OK;
+	}
+
+	//Receives one message into payload, sending flow control with the block
+	//size and STmin of opt.
+	inline RESULT recv(Link& link, std::string& payload, const Options& opt = Options()) {
+		std::string prefix = (opt.tx_ext_addr >= 0) ? std::string(1, (char)opt.tx_ext_addr) : std::string();
+		size_t off = (opt.rx_ext_addr >= 0) ? 1 : 0;
+		std::vector<std::string> pending;
+		std::string fc = prefix + (char)(PCI_FLOWCTRL | FLOW_CONTINUE) + (char)opt.block_size + (char)opt.st_min;
+		if (opt.pad) fc.resize(8, '\x00');
+
+		std::string frame;
+		size_t len;
+		while (true) {
+			RESULT res = detail::next_frame(link, opt, pending, opt.first_timeout_ms, frame);
+			if (res != OK) return res;
+			uint8_t pci = frame[off];
+
+			if ((pci & 0xF0) == PCI_SINGLE) {
+				len = pci & 0x0F;
+				if (len == 0 || frame.size() < off + 1 + len) continue;
+				payload = frame.substr(off + 1, len);
+				return OK;
+			}
+			if ((pci & 0xF0) == PCI_FIRST && frame.size() >= off + 2) {
+				len = ((pci & 0x0F) << 8) | (uint8_t)frame[off + 1];
+				payload = frame.substr(off + 2);
+				break;
+			}
+		}
+		if (payload.size() > len) payload.resize(len);
+
+		uint8_t sn = 1;
+		unsigned int block_left = opt.block_size;
+		if (!link.send(fc)) return LINK_ERROR;
+		while (payload.size() < len) {
+			RESULT res = detail::next_frame(link, opt, pending, opt.timeout_ms, frame);
+			if (res != OK) return res;
+			if (((uint8_t)frame[off] & 0xF0) != PCI_CONSEC) continue;
+			if (((uint8_t)frame[off] & 0x0F) != sn) return BAD_SEQUENCE;
+
+			size_t take = len - payload.size();
+			if (take > frame.size() - off - 1) take = frame.size() - off - 1;
+			payload += frame.substr(off + 1, take);
+			sn = (sn + 1) & 0x0F;
+
+			if (opt.block_size > 0 && --block_left == 0 && payload.size() < len) {
+				if (!link.send(fc)) return LINK_ERROR;
+				block_left = opt.block_size;
+			}
+		}
+		return OK;
+	}
+}
+}
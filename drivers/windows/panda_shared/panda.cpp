@@ -2,14 +2,19 @@
 //
 #include "stdafx.h"
 
+#include <emmintrin.h>
+
 #include "device.h"
 #include "panda.h"
+#include "io_engine.h"
 
 #define REQUEST_IN 0xC0
 #define REQUEST_OUT 0x40
 
 #define CAN_TRANSMIT 1
 #define CAN_EXTENDED 4
+#define CAN_TX_URGENT (1 << 15)
+#define CAN_FILTER_EXACT 0xFFFFFFFE
 
 using namespace panda;
 
@@ -20,14 +25,101 @@ Panda::Panda(
 	std::string sn_
 ) : usbh(WinusbHandle), devh(DeviceHandle), devPath(devPath_), sn(sn_) {
 	printf("CREATED A PANDA %s\n", this->sn.c_str());
+	device_claim(this->devPath, TRUE);
+	//One thread on each side of can_rx_q, so auto reset is enough.
+	this->can_rx_q_filled = CreateEvent(NULL, FALSE, FALSE, NULL);
+	this->can_rx_q_drained = CreateEvent(NULL, FALSE, FALSE, NULL);
+	this->serial_rx.complete = CreateEvent(NULL, TRUE, FALSE, NULL);
+	this->serial_rx.queued = FALSE;
+	InitializeCriticalSection(&this->can_tx_lock);
+	InitializeCriticalSection(&this->can_sub_lock);
+	this->can_dispatch_kill = CreateEvent(NULL, TRUE, FALSE, NULL);
+	InitializeConditionVariable(&this->can_tx_pending);
+	InitializeConditionVariable(&this->can_tx_completed);
+	InitializeCriticalSection(&this->control_async_lock);
+	InitializeConditionVariable(&this->control_async_idle);
+	InitializeSRWLock(&this->health_lock);
+	ZeroMemory(&this->health_cache, sizeof(this->health_cache));
+	this->health_timer = CreateThreadpoolTimer(health_timer_fired, this, NULL);
+	InitializeCriticalSection(&this->serial_tx_lock);
+	InitializeConditionVariable(&this->serial_tx_idle);
+	for (auto& x : this->serial_tx_xfers) {
+		x.panda = this;
+		x.busy = FALSE;
+		x.event = CreateEvent(NULL, TRUE, FALSE, NULL);
+		x.wait = CreateThreadpoolWait(serial_tx_completed, &x, NULL);
+	}
 	this->set_can_loopback(FALSE);
+	this->set_can_timestamps(TRUE);
 	this->set_raw_io(TRUE);
 	this->set_alt_setting(0);
+	this->can_rx_pipe_setup();
 }
 
 Panda::~Panda() {
+	this->can_rx_q_stop();
+	//A refresh the timer started is waited on with the other async transfers.
+	if (this->health_timer) {
+		SetThreadpoolTimer(this->health_timer, NULL, 0, 0);
+		WaitForThreadpoolTimerCallbacks(this->health_timer, TRUE);
+		CloseThreadpoolTimer(this->health_timer);
+	}
+	EnterCriticalSection(&this->control_async_lock);
+	while (this->control_async_out != 0)
+		SleepConditionVariableCS(&this->control_async_idle, &this->control_async_lock, INFINITE);
+	LeaveCriticalSection(&this->control_async_lock);
+	DeleteCriticalSection(&this->control_async_lock);
+	this->can_dispatch_stop();
+	CloseHandle(this->can_dispatch_kill);
+	DeleteCriticalSection(&this->can_sub_lock);
+
+	if (this->can_tx_thread_handle) {
+		EnterCriticalSection(&this->can_tx_lock);
+		this->can_tx_stop = TRUE;
+		WakeAllConditionVariable(&this->can_tx_pending);
+		LeaveCriticalSection(&this->can_tx_lock);
+		WaitForSingleObject(this->can_tx_thread_handle, INFINITE);
+		CloseHandle(this->can_tx_thread_handle);
+	}
+	DeleteCriticalSection(&this->can_tx_lock);
+
+	//Writes not started yet fail, those in flight are aborted.
+	EnterCriticalSection(&this->serial_tx_lock);
+	this->serial_tx_stop = TRUE;
+	this->serial_tx_pump();
+	bool serial_tx_busy = this->serial_tx_busy != 0;
+	this->serial_tx_finish();
+	if (serial_tx_busy) WinUsb_AbortPipe(this->usbh, 0x02);
+	EnterCriticalSection(&this->serial_tx_lock);
+	while (this->serial_tx_count != 0 || this->serial_tx_busy != 0 || this->serial_tx_calling)
+		SleepConditionVariableCS(&this->serial_tx_idle, &this->serial_tx_lock, INFINITE);
+	LeaveCriticalSection(&this->serial_tx_lock);
+	for (auto& x : this->serial_tx_xfers) {
+		if (x.wait) {
+			WaitForThreadpoolWaitCallbacks(x.wait, FALSE);
+			CloseThreadpoolWait(x.wait);
+		}
+		if (x.event) CloseHandle(x.event);
+	}
+	DeleteCriticalSection(&this->serial_tx_lock);
+
+	if (this->serial_rx.queued) {
+		WinUsb_AbortPipe(this->usbh, 0x82);
+		GetOverlappedResult(this->usbh, &this->serial_rx.overlapped, &this->serial_rx.count, TRUE);
+	}
+
+	this->can_rx_q_abort();
 	WinUsb_Free(this->usbh);
 	CloseHandle(this->devh);
+	for (auto& dead : this->dead_handles) {
+		WinUsb_Free(dead.first);
+		CloseHandle(dead.second);
+	}
+	this->can_rx_q_free();
+	CloseHandle(this->can_rx_q_filled);
+	CloseHandle(this->can_rx_q_drained);
+	CloseHandle(this->serial_rx.complete);
+	device_claim(this->devPath, FALSE);
 	printf("Cleanup Panda %s\n", this->sn.c_str());
 }
 
@@ -49,33 +141,120 @@ std::unique_ptr<Panda> Panda::openPanda(std::string sn)
 	if (map_sn_to_devpath.empty()) return nullptr;
 	if (map_sn_to_devpath.find(sn) == map_sn_to_devpath.end() && sn != "") return nullptr;
 
-	tstring devpath;
+	//A known panda another process has open is still listed, "" takes the next.
+	HANDLE deviceHandle;
+	WINUSB_INTERFACE_HANDLE winusbHandle;
 	if (sn.empty()) {
-		sn = map_sn_to_devpath.begin()->first;
-		devpath = map_sn_to_devpath.begin()->second;
-	} else {
-		devpath = map_sn_to_devpath[sn];
+		for (auto& kv : map_sn_to_devpath) {
+			if (open_handles(kv.second, deviceHandle, winusbHandle))
+				return std::unique_ptr<Panda>(new Panda(winusbHandle, deviceHandle, kv.second, kv.first));
+		}
+		return nullptr;
 	}
 
-	HANDLE deviceHandle = CreateFile(devpath.c_str(),
+	if (!open_handles(map_sn_to_devpath[sn], deviceHandle, winusbHandle)) return nullptr;
+
+	return std::unique_ptr<Panda>(new Panda(winusbHandle, deviceHandle, map_sn_to_devpath[sn], sn));
+}
+
+std::vector<std::unique_ptr<Panda>> Panda::openPandas(const std::vector<std::string>& sns) {
+	//One enumeration for all of them, then the opens with their control
+	//requests and alt setting pad each on its own thread.
+	detect_pandas();
+	std::vector<std::future<std::unique_ptr<Panda>>> opening;
+	for (auto& sn : sns)
+		opening.push_back(std::async(std::launch::async, openPanda, sn));
+
+	std::vector<std::unique_ptr<Panda>> ret;
+	for (auto& f : opening)
+		ret.push_back(f.get());
+	return ret;
+}
+
+bool Panda::open_handles(const tstring& devpath, HANDLE& devh, WINUSB_INTERFACE_HANDLE& usbh) {
+	devh = CreateFile(devpath.c_str(),
 		GENERIC_WRITE | GENERIC_READ, FILE_SHARE_WRITE | FILE_SHARE_READ,
 		NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
 
-	if (INVALID_HANDLE_VALUE == deviceHandle) {
+	if (INVALID_HANDLE_VALUE == devh) {
 		_tprintf(_T("    Error opening Device Handle %d.\n"),// Msg: '%s'\n"),
 			GetLastError());// , GetLastErrorAsString().c_str());
-		return nullptr;
+		return FALSE;
 	}
 
-	WINUSB_INTERFACE_HANDLE winusbHandle;
-	if (WinUsb_Initialize(deviceHandle, &winusbHandle) == FALSE) {
+	if (WinUsb_Initialize(devh, &usbh) == FALSE) {
 		_tprintf(_T("    Error initializing WinUSB %d.\n"),// Msg: '%s'\n"),
 			GetLastError());// , GetLastErrorAsString().c_str());
-		CloseHandle(deviceHandle);
-		return nullptr;
+		CloseHandle(devh);
+		return FALSE;
 	}
+	return TRUE;
+}
 
-	return std::unique_ptr<Panda>(new Panda(winusbHandle, deviceHandle, map_sn_to_devpath[sn], sn));
+void Panda::set_auto_reconnect(bool enable) {
+	this->auto_reconnect = enable;
+}
+
+bool Panda::reconnect(HANDLE kill_event, DWORD timeoutms) {
+	Timer waited;
+	while (1) {
+		//Its own path is still claimed, it can come back on it.
+		auto map_sn_to_devpath = detect_pandas(TRUE);
+		auto found = map_sn_to_devpath.find(this->sn);
+		HANDLE deviceHandle;
+		WINUSB_INTERFACE_HANDLE winusbHandle;
+		if (found != map_sn_to_devpath.end() && open_handles(found->second, deviceHandle, winusbHandle)) {
+			this->dead_handles.push_back({ this->usbh, this->devh });
+			this->usbh = winusbHandle;
+			this->devh = deviceHandle;
+			device_claim(this->devPath, FALSE);
+			this->devPath = found->second;
+			device_claim(this->devPath, TRUE);
+			this->serial_rx.queued = FALSE;
+			this->restore_settings();
+			return TRUE;
+		}
+
+		if (timeoutms != INFINITE && waited.getTimePassedMS() >= timeoutms) return FALSE;
+		if (kill_event == NULL)
+			Sleep(PANDA_RECONNECT_POLL_MS);
+		else if (WaitForSingleObject(kill_event, PANDA_RECONNECT_POLL_MS) == WAIT_OBJECT_0)
+			return FALSE;
+	}
+}
+
+//A panda that rebooted is back to its defaults, one that only lost USB isn't.
+//Either way everything is set again.
+void Panda::restore_settings() {
+	this->set_raw_io(this->raw_io);
+	//Alt setting 0 is the default once the panda enumerates again.
+	if (this->alt_setting != 0) this->set_alt_setting(this->alt_setting);
+	this->can_rx_pipe_setup();
+
+	//The reader decodes with can_rx_format, so it isn't changed here.
+	if (this->can_rx_format != PANDA_CAN_FORMAT_CLASSIC) {
+		uint8_t took[2] = {};
+		if (this->control_transfer(REQUEST_IN, 0xc4, this->can_rx_format, PANDA_CAN_FORMAT_CLASSIC, took, sizeof(took), 0) != sizeof(took) ||
+			took[0] != this->can_rx_format)
+			printf("Panda %s did not take its rx format again\n", this->sn.c_str());
+	}
+	if (this->can_rx_flush_fill != 0 || this->can_rx_flush_deadline_us != 0)
+		this->set_can_rx_flush(this->can_rx_flush_fill & ~PANDA_RX_FLUSH_SOF, this->can_rx_flush_deadline_us,
+			(this->can_rx_flush_fill & PANDA_RX_FLUSH_SOF) != 0);
+	this->set_can_loopback(this->loopback);
+	this->set_can_timestamps(this->timestamps);
+	if (this->tx_in_order_set) this->set_can_tx_in_order(this->tx_in_order);
+	for (int bus = PANDA_CAN1; bus <= PANDA_CAN3; bus++) {
+		if (this->can_speed_cbps[bus] != 0)
+			this->set_can_speed_cbps((PANDA_CAN_PORT)bus, this->can_speed_cbps[bus]);
+		if (this->can_filters_set[bus]) {
+			//set_can_filters records them again, so from a copy
+			std::vector<PANDA_CAN_FILTER> filters = this->can_filters[bus];
+			this->set_can_filters((PANDA_CAN_PORT)bus, filters);
+		}
+	}
+	//Last, so the panda only starts sending once it is set up
+	if (this->safety_mode_set) this->set_safety_mode(this->safety_mode);
 }
 
 std::string Panda::get_usb_sn() {
@@ -107,17 +286,101 @@ int Panda::control_transfer(
 	//ULONG timeout = 10; // ms
 	//WinUsb_SetPipePolicy(interfaceHandle, pipeID, PIPE_TRANSFER_TIMEOUT, sizeof(ULONG), &timeout);
 
-	if (WinUsb_ControlTransfer(this->usbh, SetupPacket, (PUCHAR)data, wLength, &cbSent, 0) == FALSE) {
+	unsigned long long start = this->perf_clock.getTimePassedUS();
+	BOOL ok = WinUsb_ControlTransfer(this->usbh, SetupPacket, (PUCHAR)data, wLength, &cbSent, 0);
+	this->perf[(bmRequestType & 0x80) ? PERF_CONTROL_IN : PERF_CONTROL_OUT].record(this->perf_clock.getTimePassedUS() - start);
+	if (ok == FALSE) {
 		return -1;
 	}
 
 	return cbSent;
 }
 
+//The event has its low bit set, so the completion isn't also posted to the
+//port can_rx_q_start may have attached the handle to. A thread pool wait on
+//the event runs what's done with it.
+bool Panda::control_transfer_async(
+	uint8_t			bmRequestType,
+	uint8_t			bRequest,
+	uint16_t		wValue,
+	uint16_t		wIndex,
+	const void *	data,
+	uint16_t		wLength,
+	PANDA_CONTROL_CALLBACK done
+) {
+	CONTROL_ASYNC *op = new CONTROL_ASYNC();
+	op->panda = this;
+	op->usbh = this->usbh;
+	op->in = (bmRequestType & 0x80) != 0;
+	op->data.resize(wLength);
+	if (!op->in && wLength && data) memcpy(op->data.data(), data, wLength);
+	op->done = std::move(done);
+	op->event = CreateEvent(NULL, TRUE, FALSE, NULL);
+	PTP_WAIT wait = (op->event == NULL) ? NULL : CreateThreadpoolWait(control_async_completed, op, NULL);
+	if (wait == NULL) {
+		if (op->event) CloseHandle(op->event);
+		delete op;
+		return FALSE;
+	}
+	ZeroMemory(&op->overlapped, sizeof(op->overlapped));
+	op->overlapped.hEvent = (HANDLE)((ULONG_PTR)op->event | 1);
+
+	WINUSB_SETUP_PACKET SetupPacket;
+	ZeroMemory(&SetupPacket, sizeof(WINUSB_SETUP_PACKET));
+	SetupPacket.RequestType = bmRequestType;
+	SetupPacket.Request = bRequest;
+	SetupPacket.Value = wValue;
+	SetupPacket.Index = wIndex;
+	SetupPacket.Length = wLength;
+
+	EnterCriticalSection(&this->control_async_lock);
+	this->control_async_out++;
+	LeaveCriticalSection(&this->control_async_lock);
+
+	op->start_us = this->perf_clock.getTimePassedUS();
+	//Done at once it still goes through the wait, done never runs in here.
+	if (WinUsb_ControlTransfer(op->usbh, SetupPacket, op->data.data(), wLength, NULL, &op->overlapped) == FALSE &&
+		GetLastError() != ERROR_IO_PENDING) {
+		CloseThreadpoolWait(wait);
+		CloseHandle(op->event);
+		delete op;
+		EnterCriticalSection(&this->control_async_lock);
+		if (--this->control_async_out == 0) WakeAllConditionVariable(&this->control_async_idle);
+		LeaveCriticalSection(&this->control_async_lock);
+		return FALSE;
+	}
+	SetThreadpoolWait(wait, op->event, NULL);
+	return TRUE;
+}
+
+VOID CALLBACK Panda::control_async_completed(PTP_CALLBACK_INSTANCE instance, PVOID context,
+	PTP_WAIT wait, TP_WAIT_RESULT result) {
+	UNREFERENCED_PARAMETER(instance);
+	UNREFERENCED_PARAMETER(result);
+	CONTROL_ASYNC *op = (CONTROL_ASYNC*)context;
+	Panda *p = op->panda;
+	//From the callback, the wait is freed once it returns.
+	CloseThreadpoolWait(wait);
+
+	DWORD transferred = 0;
+	BOOL ok = WinUsb_GetOverlappedResult(op->usbh, &op->overlapped, &transferred, FALSE);
+	p->perf[op->in ? PERF_CONTROL_IN : PERF_CONTROL_OUT].record(p->perf_clock.getTimePassedUS() - op->start_us);
+	if (op->done) op->done(ok ? (int)transferred : -1, op->data.data());
+	CloseHandle(op->event);
+	delete op;
+
+	EnterCriticalSection(&p->control_async_lock);
+	if (--p->control_async_out == 0) WakeAllConditionVariable(&p->control_async_idle);
+	LeaveCriticalSection(&p->control_async_lock);
+}
+
 int Panda::bulk_write(UCHAR endpoint, const void * buff, ULONG length, PULONG transferred, ULONG timeout) {
 	if (this->usbh == INVALID_HANDLE_VALUE || !buff || !length || !transferred) return FALSE;
 
-	if (WinUsb_WritePipe(this->usbh, endpoint, (PUCHAR)buff, length, transferred, NULL) == FALSE) {
+	unsigned long long start = this->perf_clock.getTimePassedUS();
+	BOOL ok = WinUsb_WritePipe(this->usbh, endpoint, (PUCHAR)buff, length, transferred, NULL);
+	this->perf[(endpoint == 2) ? PERF_BULK_OUT_EP2 : PERF_BULK_OUT_EP3].record(this->perf_clock.getTimePassedUS() - start);
+	if (ok == FALSE) {
 		_tprintf(_T("    Got error during bulk xfer: %d. Msg: '%s'\n"),
 			GetLastError(), GetLastErrorAsString().c_str());
 		return FALSE;
@@ -128,7 +391,10 @@ int Panda::bulk_write(UCHAR endpoint, const void * buff, ULONG length, PULONG tr
 int Panda::bulk_read(UCHAR endpoint, void * buff, ULONG buff_size, PULONG transferred, ULONG timeout) {
 	if (this->usbh == INVALID_HANDLE_VALUE || !buff || !buff_size || !transferred) return FALSE;
 
-	if (WinUsb_ReadPipe(this->usbh, endpoint, (PUCHAR)buff, buff_size, transferred, NULL) == FALSE) {
+	unsigned long long start = this->perf_clock.getTimePassedUS();
+	BOOL ok = WinUsb_ReadPipe(this->usbh, endpoint, (PUCHAR)buff, buff_size, transferred, NULL);
+	this->perf[PERF_BULK_IN_EP1].record(this->perf_clock.getTimePassedUS() - start);
+	if (ok == FALSE) {
 		_tprintf(_T("    Got error during bulk xfer: %d. Msg: '%s'\n"),
 			GetLastError(), GetLastErrorAsString().c_str());
 		return FALSE;
@@ -137,6 +403,7 @@ int Panda::bulk_read(UCHAR endpoint, void * buff, ULONG buff_size, PULONG transf
 }
 
 bool Panda::set_alt_setting(UCHAR alt_setting) {
+	this->alt_setting = alt_setting;
 	if (WinUsb_AbortPipe(this->usbh, 0x81) == FALSE) {
 		_tprintf(_T("    Error abobrting pipe before setting altsetting. continue. %d, Msg: '%s'\n"),
 			GetLastError(), GetLastErrorAsString().c_str());
@@ -181,6 +448,14 @@ bool Panda::set_alt_setting(UCHAR alt_setting) {
 	return TRUE;
 }
 
+bool Panda::set_can_tx_lanes(bool enable) {
+	return this->set_alt_setting(enable ? PANDA_ALT_CAN_LANES : 0);
+}
+
+UCHAR Panda::can_tx_pipe(PANDA_CAN_PORT bus) {
+	return (this->alt_setting == PANDA_ALT_CAN_LANES && bus == PANDA_CAN1) ? 1 : 3;
+}
+
 UCHAR Panda::get_current_alt_setting() {
 	UCHAR alt_setting;
 	if (WinUsb_GetCurrentAlternateSetting(this->usbh, &alt_setting) == FALSE) {
@@ -193,6 +468,7 @@ UCHAR Panda::get_current_alt_setting() {
 }
 
 bool Panda::set_raw_io(bool val) {
+	this->raw_io = val;
 	UCHAR raw_io = val;
 	if (!WinUsb_SetPipePolicy(this->usbh, 0x81, RAW_IO, sizeof(raw_io), &raw_io)) {
 		_tprintf(_T("    Error setting usb raw I/O pipe policy %d, Msg: '%s'\n"),
@@ -203,7 +479,7 @@ bool Panda::set_raw_io(bool val) {
 	return TRUE;
 }
 
-PANDA_HEALTH Panda::get_health()
+PANDA_HEALTH Panda::get_health(bool reset)
 {
 	WINUSB_SETUP_PACKET SetupPacket;
 	ZeroMemory(&SetupPacket, sizeof(WINUSB_SETUP_PACKET));
@@ -212,21 +488,174 @@ PANDA_HEALTH Panda::get_health()
 	//Create the setup packet
 	SetupPacket.RequestType = REQUEST_IN;
 	SetupPacket.Request = 0xD2;
-	SetupPacket.Value = 0;
+	SetupPacket.Value = reset ? 1 : 0;
 	SetupPacket.Index = 0;
 	SetupPacket.Length = sizeof(UCHAR);
 
 	//uint8_t health[13];
 	PANDA_HEALTH health;
+	//Older firmware sends less than the whole struct
+	ZeroMemory(&health, sizeof(health));
 
 	if (WinUsb_ControlTransfer(this->usbh, SetupPacket, (PUCHAR)&health, sizeof(health), &cbSent, 0) == FALSE) {
 		_tprintf(_T("    Got unexpected error while reading panda health (2nd time) %d. Msg: '%s'\n"),
 				GetLastError(), GetLastErrorAsString().c_str());
+	} else {
+		this->health_store(health);
 	}
 
 	return health;
 }
 
+std::future<PANDA_HEALTH> Panda::get_health_async() {
+	auto promise = std::make_shared<std::promise<PANDA_HEALTH>>();
+	std::future<PANDA_HEALTH> health = promise->get_future();
+	auto done = [this, promise](int len, const uint8_t *data) {
+		//Older firmware sends less than the whole struct, zero on failure as get_health.
+		PANDA_HEALTH h;
+		ZeroMemory(&h, sizeof(h));
+		if (len > 0) {
+			memcpy(&h, data, min((size_t)len, sizeof(h)));
+			this->health_store(h);
+		}
+		promise->set_value(h);
+	};
+	if (!this->control_transfer_async(REQUEST_IN, 0xD2, 0, 0, NULL, sizeof(PANDA_HEALTH), done)) {
+		PANDA_HEALTH h;
+		ZeroMemory(&h, sizeof(h));
+		promise->set_value(h);
+	}
+	return health;
+}
+
+PANDA_HEALTH Panda::get_health_cached() {
+	unsigned long long now = this->perf_clock.getTimePassedUS();
+	AcquireSRWLockExclusive(&this->health_lock);
+	this->health_asked_us = now;
+	bool fresh = this->health_valid && this->health_max_age_ms != 0 &&
+		now - this->health_at_us <= this->health_max_age_ms * 1000ULL;
+	PANDA_HEALTH health = this->health_cache;
+	if (!this->health_timer_on && this->health_max_age_ms != 0) this->health_timer_set(TRUE);
+	ReleaseSRWLockExclusive(&this->health_lock);
+
+	if (fresh) return health;
+	return this->get_health();
+}
+
+void Panda::set_health_max_age(DWORD max_age_ms) {
+	AcquireSRWLockExclusive(&this->health_lock);
+	this->health_max_age_ms = max_age_ms;
+	if (this->health_timer_on) this->health_timer_set(max_age_ms != 0);
+	ReleaseSRWLockExclusive(&this->health_lock);
+}
+
+DWORD Panda::get_health_max_age() {
+	AcquireSRWLockShared(&this->health_lock);
+	DWORD max_age_ms = this->health_max_age_ms;
+	ReleaseSRWLockShared(&this->health_lock);
+	return max_age_ms;
+}
+
+void Panda::health_store(const PANDA_HEALTH& health) {
+	unsigned long long now = this->perf_clock.getTimePassedUS();
+	AcquireSRWLockExclusive(&this->health_lock);
+	this->health_cache = health;
+	this->health_at_us = now;
+	this->health_valid = TRUE;
+	ReleaseSRWLockExclusive(&this->health_lock);
+}
+
+void Panda::health_timer_set(bool on) {
+	this->health_timer_on = on && this->health_timer != NULL;
+	if (this->health_timer == NULL) return;
+	if (!on) {
+		SetThreadpoolTimer(this->health_timer, NULL, 0, 0);
+		return;
+	}
+	//Relative, in 100ns units, the first at once.
+	ULARGE_INTEGER due;
+	due.QuadPart = (ULONGLONG)-1LL;
+	FILETIME ft;
+	ft.dwLowDateTime = due.LowPart;
+	ft.dwHighDateTime = due.HighPart;
+	DWORD period = max(this->health_max_age_ms / 2, 1);
+	SetThreadpoolTimer(this->health_timer, &ft, period, 0);
+}
+
+VOID CALLBACK Panda::health_timer_fired(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_TIMER timer) {
+	UNREFERENCED_PARAMETER(instance);
+	UNREFERENCED_PARAMETER(timer);
+	Panda *p = (Panda*)context;
+	unsigned long long now = p->perf_clock.getTimePassedUS();
+	AcquireSRWLockExclusive(&p->health_lock);
+	if (!p->health_timer_on) {
+		ReleaseSRWLockExclusive(&p->health_lock);
+		return;
+	}
+	if (now - p->health_asked_us > PANDA_HEALTH_IDLE_MS * 1000ULL) {
+		p->health_timer_set(FALSE);
+		ReleaseSRWLockExclusive(&p->health_lock);
+		return;
+	}
+	ReleaseSRWLockExclusive(&p->health_lock);
+
+	//A read still out from the last tick is left to finish.
+	if (p->health_refreshing.exchange(TRUE)) return;
+	auto done = [p](int len, const uint8_t *data) {
+		if (len > 0) {
+			PANDA_HEALTH h;
+			ZeroMemory(&h, sizeof(h));
+			memcpy(&h, data, min((size_t)len, sizeof(h)));
+			p->health_store(h);
+		}
+		p->health_refreshing = FALSE;
+	};
+	if (!p->control_transfer_async(REQUEST_IN, 0xD2, 0, 0, NULL, sizeof(PANDA_HEALTH), done))
+		p->health_refreshing = FALSE;
+}
+
+bool Panda::get_deferred_status(PANDA_DEFERRED_STATUS& status) {
+	ZeroMemory(&status, sizeof(status));
+	return this->control_transfer(REQUEST_IN, 0xce, 0, 0, &status, sizeof(status), 0) >= (int)offsetof(PANDA_DEFERRED_STATUS, can_inits);
+}
+
+bool Panda::wait_deferred(DWORD timeoutms) {
+	PANDA_DEFERRED_STATUS status;
+	if (!this->get_deferred_status(status)) return TRUE;
+	uint32_t queued = status.queued;
+	unsigned long long end = this->perf_clock.getTimePassedUS() + (unsigned long long)timeoutms * 1000;
+	while (1) {
+		if (!this->get_deferred_status(status)) return FALSE;
+		//Wraps at 32 bits
+		if ((int32_t)(status.done - queued) >= 0) return TRUE;
+		if (this->perf_clock.getTimePassedUS() > end) return FALSE;
+		Sleep(1);
+	}
+}
+
+bool Panda::get_can_stats(PANDA_CAN_PORT bus, PANDA_CAN_STATS& stats) {
+	if (bus == PANDA_CAN_UNK) return FALSE;
+	ZeroMemory(&stats, sizeof(stats));
+	return this->control_transfer(REQUEST_IN, 0xc0, bus, 0, &stats, sizeof(stats), 0) >= (int)offsetof(PANDA_CAN_STATS, rx_suppressed_cnt);
+}
+
+bool Panda::get_time(uint32_t& time) {
+	ZeroMemory(&time, sizeof(time));
+	return this->control_transfer(REQUEST_IN, 0xfe, 0, 0, &time, sizeof(time), 0) == sizeof(time);
+}
+
+PANDA_PERF_STATS Panda::get_perf_stats() {
+	PANDA_PERF_STATS stats;
+	for (int i = 0; i < PANDA_PERF_POINTS; i++)
+		this->perf[i].read(stats.hist[i]);
+	return stats;
+}
+
+void Panda::reset_perf_stats() {
+	for (auto& h : this->perf)
+		h.reset();
+}
+
 bool Panda::enter_bootloader() {
 	return this->control_transfer(REQUEST_OUT, 0xd1, 0, 0, NULL, 0, 0) != -1;
 }
@@ -278,6 +707,8 @@ bool Panda::esp_reset(uint16_t bootmode = 0) {
 }
 
 bool Panda::set_safety_mode(PANDA_SAFETY_MODE mode = SAFETY_NOOUTPUT) {
+	this->safety_mode_set = TRUE;
+	this->safety_mode = mode;
 	return this->control_transfer(REQUEST_OUT, 0xdc, mode, 0, NULL, 0, 0) != -1;
 }
 
@@ -295,10 +726,139 @@ bool Panda::set_can_loopback(bool enable) {
 	return this->control_transfer(REQUEST_OUT, 0xe5, enable, 0, NULL, 0, 0) != -1;
 }
 
+//By default the panda sends queued messages by identifier priority.
+bool Panda::set_can_tx_in_order(bool enable) {
+	this->tx_in_order_set = TRUE;
+	this->tx_in_order = enable;
+	return this->control_transfer(REQUEST_OUT, 0xe7, enable, 0, NULL, 0, 0) != -1;
+}
+
+//Frames not matching any filter are dropped by the panda hardware. The ids
+//needed by the safety mode are always received. No filters receives all.
+bool Panda::set_can_filters(PANDA_CAN_PORT bus, const std::vector<PANDA_CAN_FILTER>& filters) {
+	if (bus == PANDA_CAN_UNK) return FALSE;
+	if (bus <= PANDA_CAN3) {
+		this->can_filters_set[bus] = TRUE;
+		this->can_filters[bus] = filters;
+	}
+	if (this->control_transfer(REQUEST_OUT, 0xdf, bus, 0, NULL, 0, 0) == -1) return FALSE;
+
+	for (auto& filter : filters) {
+		uint32_t rir, rmask;
+		if (filter.addr_29b) {
+			rir = (filter.addr << 3) | CAN_EXTENDED;
+			rmask = (filter.mask == 0x1FFFFFFF) ? CAN_FILTER_EXACT : ((filter.mask << 3) | CAN_EXTENDED);
+		} else {
+			rir = (filter.addr & 0x7FF) << 21;
+			rmask = (filter.mask == 0x7FF) ? CAN_FILTER_EXACT : (((filter.mask & 0x7FF) << 21) | CAN_EXTENDED);
+		}
+		if (this->control_transfer(REQUEST_OUT, 0xe8, rir & 0xFFFF, rir >> 16, NULL, 0, 0) == -1) return FALSE;
+		if (this->control_transfer(REQUEST_OUT, 0xe9, rmask & 0xFFFF, rmask >> 16, NULL, 0, 0) == -1) return FALSE;
+		if (this->control_transfer(REQUEST_OUT, 0xdf, bus, 1, NULL, 0, 0) == -1) return FALSE;
+	}
+
+	return this->control_transfer(REQUEST_OUT, 0xdf, bus, 2, NULL, 0, 0) != -1;
+}
+
+//Received CAN messages carry the 32 bit microsecond timer of the panda.
+bool Panda::set_can_timestamps(bool enable) {
+	this->timestamps = enable;
+	return this->control_transfer(REQUEST_OUT, 0xea, enable, 0, NULL, 0, 0) != -1;
+}
+
+//0xd7 answers with what it took, four bytes. Older firmware answers with none.
+bool Panda::apply_config(PANDA_SAFETY_MODE mode, uint16_t config) {
+	this->safety_mode_set = TRUE;
+	this->safety_mode = mode;
+	this->loopback = (config & PANDA_CONFIG_LOOPBACK) != 0;
+	this->tx_in_order_set = TRUE;
+	this->tx_in_order = (config & PANDA_CONFIG_TX_IN_ORDER) != 0;
+	this->timestamps = (config & PANDA_CONFIG_TIMESTAMPS) != 0;
+
+	uint16_t took[2] = {};
+	if (this->control_transfer(REQUEST_IN, 0xd7, mode, config, took, sizeof(took), 0) == sizeof(took))
+		return took[0] == config && took[1] == mode;
+
+	bool ok = this->set_esp_power((config & PANDA_CONFIG_ESP_POWER) != 0);
+	ok &= this->set_safety_mode(mode);
+	ok &= this->set_can_loopback(this->loopback);
+	ok &= this->set_can_tx_in_order(this->tx_in_order);
+	ok &= this->set_can_timestamps(this->timestamps);
+	if (config & PANDA_CONFIG_CLEAR_PERIODIC) ok &= this->clear_can_periodic(PANDA_CAN_PERIODIC_ALL);
+	if (config & PANDA_CONFIG_CLEAR_RX) ok &= this->can_clear(PANDA_CAN_RX);
+	return ok;
+}
+
+//0xc4 answers with the rx and tx formats the panda took, tx stays classic here.
+bool Panda::set_can_rx_format(PANDA_CAN_FORMAT format) {
+	uint8_t took[2] = {};
+	int len = this->control_transfer(REQUEST_IN, 0xc4, format, PANDA_CAN_FORMAT_CLASSIC, took, sizeof(took), 0);
+	this->can_rx_format = (len == sizeof(took)) ? (PANDA_CAN_FORMAT)took[0] : PANDA_CAN_FORMAT_CLASSIC;
+	return this->can_rx_format == format;
+}
+
+//0xa3 answers with the policy it took, older firmware with nothing.
+bool Panda::set_can_rx_flush(uint16_t fill, uint16_t deadline_us, bool sof) {
+	if (fill & PANDA_RX_FLUSH_SOF) return FALSE;
+	uint16_t value = fill | (sof ? PANDA_RX_FLUSH_SOF : 0);
+	PANDA_RX_FLUSH_STATUS status = {};
+	int len = this->control_transfer(REQUEST_IN, 0xa3, value, deadline_us, &status, sizeof(status), 0);
+	if (len != sizeof(status) || status.fill != value || status.deadline_us != deadline_us) return FALSE;
+	this->can_rx_flush_fill = value;
+	this->can_rx_flush_deadline_us = deadline_us;
+	return TRUE;
+}
+
+bool Panda::get_can_rx_flush_status(PANDA_RX_FLUSH_STATUS& status) {
+	ZeroMemory(&status, sizeof(status));
+	return this->control_transfer(REQUEST_IN, 0xa3, 0xFFFF, 0, &status, sizeof(status), 0) == sizeof(status);
+}
+
+//0xcf answers with the mode the bus took and its next token.
+bool Panda::set_can_echo(PANDA_CAN_PORT bus, PANDA_CAN_ECHO mode, uint16_t *next_token) {
+	if (bus == PANDA_CAN_UNK) return FALSE;
+	uint8_t took[3] = {};
+	if (this->control_transfer(REQUEST_IN, 0xcf, bus, mode, took, sizeof(took), 0) != sizeof(took)) return FALSE;
+	if (next_token) *next_token = took[1] | (took[2] << 8);
+	return took[0] == mode;
+}
+
+bool Panda::set_can_one_shot(PANDA_CAN_PORT bus, bool enable) {
+	if (bus == PANDA_CAN_UNK) return FALSE;
+	return this->control_transfer(REQUEST_OUT, 0xd4, bus, enable, NULL, 0, 0) != -1;
+}
+
+bool Panda::set_can_tx_priority(PANDA_CAN_PORT bus, bool enable) {
+	if (bus == PANDA_CAN_UNK) return FALSE;
+	return this->control_transfer(REQUEST_OUT, 0xc3, bus, enable, NULL, 0, 0) != -1;
+}
+
+//The panda sends the message every period_ms until the slot is cleared.
+//The safety mode still checks every message it sends.
+bool Panda::set_can_periodic(uint8_t slot, uint32_t addr, bool addr_29b, const uint8_t *dat, uint8_t len, PANDA_CAN_PORT bus, uint16_t period_ms) {
+	if (bus == PANDA_CAN_UNK || slot >= PANDA_CAN_PERIODIC_SLOTS || len > 8 || period_ms == 0) return FALSE;
+
+	uint32_t words[4] = {};
+	words[0] = addr_29b ? ((addr << 3) | CAN_EXTENDED) : ((addr & 0x7FF) << 21);
+	words[1] = len;
+	memcpy(&words[2], dat, len);
+
+	for (int i = 0; i < 8; i++) {
+		uint16_t half = (uint16_t)(words[i / 2] >> ((i % 2) * 16));
+		if (this->control_transfer(REQUEST_OUT, 0xeb, i, half, NULL, 0, 0) == -1) return FALSE;
+	}
+	return this->control_transfer(REQUEST_OUT, 0xec, slot | (bus << 8), period_ms, NULL, 0, 0) != -1;
+}
+
+bool Panda::clear_can_periodic(uint16_t slot) {
+	return this->control_transfer(REQUEST_OUT, 0xed, slot, 0, NULL, 0, 0) != -1;
+}
+
 //Can not use the full range of 16 bit speed.
 //cbps means centa bits per second (tento of kbps)
 bool Panda::set_can_speed_cbps(PANDA_CAN_PORT bus, uint16_t speed) {
 	if (bus == PANDA_CAN_UNK) return FALSE;
+	if (bus <= PANDA_CAN3) this->can_speed_cbps[bus] = speed;
 	return this->control_transfer(REQUEST_OUT, 0xde, bus, speed, NULL, 0, 0) != -1;
 }
 
@@ -317,24 +877,25 @@ bool Panda::set_uart_parity(PANDA_SERIAL_PORT uart, PANDA_SERIAL_PORT_PARITY par
 }
 
 bool Panda::can_send_many(const std::vector<PANDA_CAN_MSG>& can_msgs) {
-	std::vector<PANDA_CAN_MSG_INTERNAL> formatted_msgs;
+	//Bus 0's own pipe in alt setting 2
+	std::vector<PANDA_CAN_MSG_INTERNAL> formatted_msgs, lane_msgs;
 	formatted_msgs.reserve(can_msgs.size());
 
-	for (auto msg : can_msgs) {
+	for (auto& msg : can_msgs) {
 		if (msg.bus == PANDA_CAN_UNK) continue;
 		if (msg.len > 8) continue;
-		PANDA_CAN_MSG_INTERNAL tmpmsg = {};
-		tmpmsg.rir = (msg.addr_29b) ?
-			((msg.addr << 3) | CAN_TRANSMIT | CAN_EXTENDED) :
-			(((msg.addr & 0x7FF) << 21) | CAN_TRANSMIT);
-		tmpmsg.f2 = msg.len | (msg.bus << 4);
-		memcpy(tmpmsg.dat, msg.dat, msg.len);
-		formatted_msgs.push_back(tmpmsg);
+		PANDA_CAN_MSG_INTERNAL tmpmsg;
+		pack_can_msg(tmpmsg, msg.addr, msg.addr_29b, msg.dat, msg.len, msg.bus);
+		((this->can_tx_pipe(msg.bus) == 1) ? lane_msgs : formatted_msgs).push_back(tmpmsg);
 	}
 
-	if (formatted_msgs.size() == 0) return FALSE;
+	if (formatted_msgs.size() == 0 && lane_msgs.size() == 0) return FALSE;
 
 	unsigned int retcount;
+	if (lane_msgs.size() > 0 && !this->bulk_write(1, lane_msgs.data(),
+		sizeof(PANDA_CAN_MSG_INTERNAL)*lane_msgs.size(), (PULONG)&retcount, 0))
+		return FALSE;
+	if (formatted_msgs.size() == 0) return TRUE;
 	return this->bulk_write(3, formatted_msgs.data(),
 		sizeof(PANDA_CAN_MSG_INTERNAL)*formatted_msgs.size(), (PULONG)&retcount, 0);
 }
@@ -342,29 +903,194 @@ bool Panda::can_send_many(const std::vector<PANDA_CAN_MSG>& can_msgs) {
 bool Panda::can_send(uint32_t addr, bool addr_29b, const uint8_t *dat, uint8_t len, PANDA_CAN_PORT bus) {
 	if (bus == PANDA_CAN_UNK) return FALSE;
 	if (len > 8) return FALSE;
-	PANDA_CAN_MSG msg;
-	msg.addr_29b = addr_29b;
-	msg.addr = addr;
-	msg.len = len;
-	memcpy(msg.dat, dat, msg.len);
-	msg.bus = bus;
-	return this->can_send_many(std::vector<PANDA_CAN_MSG>{msg});
+	PANDA_CAN_MSG_INTERNAL msg;
+	pack_can_msg(msg, addr, addr_29b, dat, len, bus);
+
+	unsigned int retcount;
+	return this->bulk_write(this->can_tx_pipe(bus), &msg, sizeof(msg), (PULONG)&retcount, 0);
+}
+
+bool Panda::can_send_urgent(uint32_t addr, bool addr_29b, const uint8_t *dat, uint8_t len, PANDA_CAN_PORT bus) {
+	if (bus == PANDA_CAN_UNK) return FALSE;
+	if (len > 8) return FALSE;
+	PANDA_CAN_MSG_INTERNAL msg;
+	pack_can_msg(msg, addr, addr_29b, dat, len, bus);
+	msg.f2 |= CAN_TX_URGENT;
+
+	unsigned int retcount;
+	return this->bulk_write(this->can_tx_pipe(bus), &msg, sizeof(msg), (PULONG)&retcount, 0);
+}
+
+void Panda::pack_can_msg(PANDA_CAN_MSG_INTERNAL& out, uint32_t addr, bool addr_29b, const uint8_t *dat, uint8_t len, PANDA_CAN_PORT bus) {
+	ZeroMemory(&out, sizeof(out));
+	out.rir = (addr_29b) ?
+		((addr << 3) | CAN_TRANSMIT | CAN_EXTENDED) :
+		(((addr & 0x7FF) << 21) | CAN_TRANSMIT);
+	out.f2 = len | (bus << 4);
+	memcpy(out.dat, dat, len);
 }
 
-PANDA_CAN_MSG Panda::parse_can_recv(PANDA_CAN_MSG_INTERNAL *in_msg_raw) {
-	PANDA_CAN_MSG in_msg;
+unsigned long long Panda::can_send_async(uint32_t addr, bool addr_29b, const uint8_t *dat, uint8_t len, PANDA_CAN_PORT bus) {
+	if (bus == PANDA_CAN_UNK) return 0;
+	if (len > 8) return 0;
+
+	unsigned long long seq = 0;
+	EnterCriticalSection(&this->can_tx_lock);
+	if (this->can_tx_thread_handle == NULL) {
+		DWORD canTxThreadID;
+		this->can_tx_thread_handle = CreateThread(NULL, 0, _can_tx_threadBootstrap, (LPVOID)this, 0, &canTxThreadID);
+	}
+	if (this->can_tx_queued - this->can_tx_taken < CAN_TX_QUEUE_LEN) {
+		seq = ++this->can_tx_queued;
+		pack_can_msg(this->can_tx_q[seq % CAN_TX_QUEUE_LEN], addr, addr_29b, dat, len, bus);
+		PANDA_TRACE(TRACE_TX_SUBMIT, addr, len);
+		WakeConditionVariable(&this->can_tx_pending);
+	}
+	LeaveCriticalSection(&this->can_tx_lock);
+	return seq;
+}
+
+unsigned long long Panda::can_send_async_many(const std::vector<PANDA_CAN_MSG>& can_msgs) {
+	if (can_msgs.size() == 0) return 0;
+	for (auto& msg : can_msgs)
+		if (msg.bus == PANDA_CAN_UNK || msg.len > 8) return 0;
+
+	unsigned long long seq = 0;
+	EnterCriticalSection(&this->can_tx_lock);
+	if (this->can_tx_thread_handle == NULL) {
+		DWORD canTxThreadID;
+		this->can_tx_thread_handle = CreateThread(NULL, 0, _can_tx_threadBootstrap, (LPVOID)this, 0, &canTxThreadID);
+	}
+	if (this->can_tx_queued - this->can_tx_taken + can_msgs.size() <= CAN_TX_QUEUE_LEN) {
+		for (auto& msg : can_msgs) {
+			seq = ++this->can_tx_queued;
+			pack_can_msg(this->can_tx_q[seq % CAN_TX_QUEUE_LEN], msg.addr, msg.addr_29b, msg.dat, msg.len, msg.bus);
+			PANDA_TRACE(TRACE_TX_SUBMIT, msg.addr, msg.len);
+		}
+		WakeConditionVariable(&this->can_tx_pending);
+	}
+	LeaveCriticalSection(&this->can_tx_lock);
+	return seq;
+}
+
+bool Panda::can_tx_wait(unsigned long long seq, DWORD timeoutms) {
+	bool done;
+	EnterCriticalSection(&this->can_tx_lock);
+	while (!(done = (this->can_tx_done >= seq))) {
+		if (!SleepConditionVariableCS(&this->can_tx_completed, &this->can_tx_lock, timeoutms))
+			break; //timed out
+	}
+	LeaveCriticalSection(&this->can_tx_lock);
+	return done;
+}
+
+unsigned long long Panda::can_tx_errors() {
+	EnterCriticalSection(&this->can_tx_lock);
+	auto failed = this->can_tx_failed;
+	LeaveCriticalSection(&this->can_tx_lock);
+	return failed;
+}
+
+void Panda::set_can_tx_failed_callback(PANDA_CAN_TX_FAILED_CALLBACK cb) {
+	EnterCriticalSection(&this->can_tx_lock);
+	this->can_tx_failed_cb = cb;
+	LeaveCriticalSection(&this->can_tx_lock);
+}
+
+//Only one transfer is in flight. Everything queued while it is
+//goes out together in the next one.
+DWORD Panda::can_tx_thread() {
+	OVERLAPPED overlapped;
+	HANDLE complete = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	while (TRUE) {
+		EnterCriticalSection(&this->can_tx_lock);
+		while (this->can_tx_taken == this->can_tx_queued && !this->can_tx_stop)
+			SleepConditionVariableCS(&this->can_tx_pending, &this->can_tx_lock, INFINITE);
+		if (this->can_tx_stop) {
+			LeaveCriticalSection(&this->can_tx_lock);
+			break;
+		}
+
+		ULONG count = (ULONG)min(this->can_tx_queued - this->can_tx_taken, CAN_TX_COALESCE_MAX);
+		unsigned long long first = this->can_tx_taken + 1;
+		for (ULONG i = 0; i < count; i++)
+			this->can_tx_buff[i] = this->can_tx_q[(this->can_tx_taken + 1 + i) % CAN_TX_QUEUE_LEN];
+		this->can_tx_taken += count;
+		LeaveCriticalSection(&this->can_tx_lock);
+
+		ZeroMemory(&overlapped, sizeof(overlapped));
+		overlapped.hEvent = complete;
+		ULONG transferred = 0;
+		unsigned long long start = this->perf_clock.getTimePassedUS();
+		bool ok = WinUsb_WritePipe(this->usbh, 3, (PUCHAR)this->can_tx_buff, count * sizeof(PANDA_CAN_MSG_INTERNAL), &transferred, &overlapped) ||
+			(GetLastError() == ERROR_IO_PENDING && GetOverlappedResult(this->usbh, &overlapped, &transferred, TRUE));
+		this->perf[PERF_CAN_TX_WRITE].record(this->perf_clock.getTimePassedUS() - start);
+		if (!ok) {
+			_tprintf(_T("    Got error during async bulk xfer: %d. Msg: '%s'\n"),
+				GetLastError(), GetLastErrorAsString().c_str());
+		}
+
+		EnterCriticalSection(&this->can_tx_lock);
+		if (!ok) this->can_tx_failed += count;
+		this->can_tx_done += count;
+		auto failed_cb = ok ? PANDA_CAN_TX_FAILED_CALLBACK() : this->can_tx_failed_cb;
+		WakeAllConditionVariable(&this->can_tx_completed);
+		LeaveCriticalSection(&this->can_tx_lock);
+		if (failed_cb) failed_cb(first, first + count - 1);
+	}
+
+	CloseHandle(complete);
+	return 0;
+}
+
+//The panda latches its 32 bit microsecond timer when the frame is received
+//or echoed. The buses' queues are merged, so a time can be a little before
+//the newest one seen, from before the wrap if that was just now. Otherwise a
+//smaller time means the timer wrapped (about every 71 minutes).
+unsigned long long Panda::unwrap_device_time(uint32_t ts) {
+	uint32_t back = this->last_device_time - ts;
+	if (this->device_time_seen && back != 0 && back < CAN_TIME_LATE_MAX) {
+		bool before_wrap = ts > this->last_device_time && this->device_time_base > 0;
+		return this->device_time_base + ts - (before_wrap ? 0x100000000ULL : 0);
+	}
+	if (ts < this->last_device_time)
+		this->device_time_base += 0x100000000ULL;
+	this->last_device_time = ts;
+	this->device_time_seen = true;
+	return this->device_time_base + ts;
+}
+
+//The fastest frame of the windows is taken as no latency, the rest is how
+//much longer a frame took from the panda's CAN peripheral to the caller.
+void Panda::perf_dequeue(unsigned long long now_us, unsigned long long dev_us) {
+	long long offset = (long long)(now_us - dev_us);
+	if (now_us - this->perf_window_start >= PANDA_PERF_WINDOW_US) {
+		this->perf_offset_min[1] = this->perf_offset_min[0];
+		this->perf_offset_min[0] = LLONG_MAX;
+		this->perf_window_start = now_us;
+	}
+	this->perf_offset_min[0] = min(this->perf_offset_min[0], offset);
+	this->perf[PERF_CAN_RX_DEQUEUE].record(offset - min(this->perf_offset_min[0], this->perf_offset_min[1]));
+}
+
+void Panda::parse_can_recv(const PANDA_CAN_MSG_TS_INTERNAL *in_msg_ts_raw, PANDA_CAN_MSG& in_msg,
+	std::chrono::time_point<std::chrono::steady_clock> recv_time_point) {
+	const PANDA_CAN_MSG_INTERNAL *in_msg_raw = &in_msg_ts_raw->msg;
 
 	in_msg.addr_29b = (bool)(in_msg_raw->rir & CAN_EXTENDED);
 	in_msg.addr = (in_msg.addr_29b) ? (in_msg_raw->rir >> 3) : (in_msg_raw->rir >> 21);
-	in_msg.recv_time = this->runningTime.getTimePassedUS();
-	in_msg.recv_time_point = std::chrono::steady_clock::now();
-	//The timestamp from the device is (in_msg_raw->f2 >> 16),
-	//but this 16 bit value is a little hard to use. Using a
-	//timer since the initialization of this device.
+	in_msg.recv_time = this->unwrap_device_time(in_msg_ts_raw->timestamp);
+	in_msg.recv_time_point = recv_time_point;
 	in_msg.len = in_msg_raw->f2 & 0xF;
 	memcpy(in_msg.dat, in_msg_raw->dat, 8);
 
 	in_msg.is_receipt = ((in_msg_raw->f2 >> 4) & 0x80) == 0x80;
+	//TXRQ is never set on a received frame, the panda marks completions with it.
+	in_msg.is_completion = (in_msg_raw->rir & 1) != 0;
+	in_msg.tx_token = in_msg.is_completion ? (in_msg_raw->dat[0] | ((in_msg_raw->dat[1] & 3) << 8)) : 0;
+	in_msg.tx_failed = in_msg.is_completion && (in_msg_raw->dat[1] & 0x80) != 0;
+	in_msg.tx_arb_lost = in_msg.is_completion && (in_msg_raw->dat[1] & 0x40) != 0;
 	switch ((in_msg_raw->f2 >> 4) & 0x7F) {
 	case PANDA_CAN1:
 		in_msg.bus = PANDA_CAN1;
@@ -378,59 +1104,300 @@ PANDA_CAN_MSG Panda::parse_can_recv(PANDA_CAN_MSG_INTERNAL *in_msg_raw) {
 	default:
 		in_msg.bus = PANDA_CAN_UNK;
 	}
-	return in_msg;
 }
 
-bool Panda::can_rx_q_push(HANDLE kill_event, DWORD timeoutms) {
-	while (1) {
-		auto w_ptr = this->w_ptr;
-		auto n_ptr = w_ptr + 1;
-		if (n_ptr == CAN_RX_QUEUE_LEN) {
-			n_ptr = 0;
+//A compact record is a byte of len (bits 0-3), bus (4-5), sent by the panda
+//(6) and 29 bit id (7), the id in 2 or 4 bytes, the time as an int16 from the
+//packet's first record or 0x8000 and the 32 bit time, then the data. A len of
+//0xF pads out the packet. Returns 0 at the padding or a record cut short.
+//A len of 0xD is a completion, the 2 byte token in place of the id and no data.
+unsigned long Panda::can_compact_rec_len(const unsigned char *rec, unsigned long len) {
+	if (len < 1 || (rec[0] & 0xF) == 0xF) return 0;
+	bool done = (rec[0] & 0xF) == PANDA_CAN_COMPACT_DONE;
+	unsigned long dlc = done ? 0 : ((rec[0] & 0xF) > 8 ? 8 : (rec[0] & 0xF));
+	unsigned long idl = ((rec[0] & 0x80) && !done) ? 4 : 2;
+	if (len < 1 + idl + 2) return 0;
+	bool wide = rec[1 + idl] == 0x00 && rec[2 + idl] == 0x80;
+	unsigned long rec_len = 1 + idl + (wide ? 6 : 2) + dlc;
+	return (rec_len <= len) ? rec_len : 0;
+}
+
+size_t Panda::can_compact_pkt_count(const unsigned char *pkt, unsigned long len) {
+	size_t count = 0;
+	for (unsigned long pos = 0, rec_len; (rec_len = can_compact_rec_len(pkt + pos, len - pos)) != 0; pos += rec_len)
+		++count;
+	return count;
+}
+
+//rec has been checked by can_compact_rec_len. The packet's first record sets ts_base.
+void Panda::parse_can_recv_compact(const unsigned char *rec, uint32_t& ts_base, bool first, PANDA_CAN_MSG& in_msg,
+	std::chrono::time_point<std::chrono::steady_clock> recv_time_point) {
+	unsigned long pos = 1;
+	in_msg.is_completion = (rec[0] & 0xF) == PANDA_CAN_COMPACT_DONE;
+	in_msg.tx_token = 0;
+	in_msg.addr_29b = (rec[0] & 0x80) != 0 && !in_msg.is_completion;
+	in_msg.addr = 0;
+	memcpy(in_msg.is_completion ? (void *)&in_msg.tx_token : (void *)&in_msg.addr, rec + pos, in_msg.addr_29b ? 4 : 2);
+	pos += in_msg.addr_29b ? 4 : 2;
+	in_msg.tx_failed = (in_msg.tx_token & 0x8000) != 0;
+	in_msg.tx_arb_lost = (in_msg.tx_token & 0x4000) != 0;
+	in_msg.tx_token &= 0x3FF;
+
+	int16_t rel;
+	memcpy(&rel, rec + pos, sizeof(rel));
+	pos += sizeof(rel);
+	uint32_t ts;
+	if ((uint16_t)rel == 0x8000) {
+		memcpy(&ts, rec + pos, sizeof(ts));
+		pos += sizeof(ts);
+	} else {
+		ts = ts_base + (int32_t)rel;
+	}
+	if (first) ts_base = ts;
+	in_msg.recv_time = this->unwrap_device_time(ts);
+	in_msg.recv_time_point = recv_time_point;
+
+	in_msg.len = in_msg.is_completion ? 0 : ((rec[0] & 0xF) > 8 ? 8 : (rec[0] & 0xF));
+	memset(in_msg.dat, 0, sizeof(in_msg.dat));
+	memcpy(in_msg.dat, rec + pos, in_msg.len);
+
+	in_msg.is_receipt = (rec[0] & 0x40) != 0;
+	in_msg.bus = ((rec[0] >> 4) & 3) <= PANDA_CAN3 ? (PANDA_CAN_PORT)((rec[0] >> 4) & 3) : PANDA_CAN_UNK;
+}
+
+void Panda::set_can_rx_pipeline_depth(unsigned int depth) {
+	this->can_rx_auto_tune = FALSE;
+	this->can_rx_read_len = this->can_rx_read_len_max;
+	this->can_rx_pipeline_depth = max(1, min(depth, CAN_RX_PIPELINE_MAX));
+}
+
+void Panda::set_can_rx_auto_tune(bool enable) {
+	this->can_rx_auto_tune = enable;
+	this->can_rx_tune_reads = this->can_rx_tune_full = 0;
+	this->can_rx_tune_longest = 0;
+	if (!enable) this->can_rx_read_len = this->can_rx_read_len_max;
+}
+
+PANDA_USB_PROFILE Panda::get_usb_profile() {
+	PANDA_USB_PROFILE profile;
+	profile.raw_io = this->raw_io;
+	profile.auto_tune = this->can_rx_auto_tune;
+	profile.max_packet = this->usb_max_packet;
+	profile.max_transfer = this->usb_max_transfer;
+	profile.read_len = this->can_rx_read_len;
+	profile.read_len_max = this->can_rx_read_len_max;
+	profile.pipeline_depth = this->can_rx_pipeline_depth;
+	profile.ring_len = this->can_rx_q_len;
+	profile.ring_buff_len = this->can_rx_buff_len;
+	profile.ring_memory = this->can_rx_mem_got;
+	return profile;
+}
+
+bool Panda::set_can_rx_ring(unsigned long len, unsigned long buff_len, uint32_t memory) {
+	buff_len -= buff_len % 0x40;
+	if (len < CAN_RX_QUEUE_MIN || len > CAN_RX_QUEUE_MAX || buff_len == 0 || buff_len > CAN_RX_BUFF_MAX) return FALSE;
+	//The slots can't move under queued reads, or reads not popped yet.
+	if (this->can_rx_strand || this->can_dispatch_rx_thread_handle != NULL ||
+		this->issue_ptr != this->w_ptr || this->r_ptr != this->w_ptr) return FALSE;
+
+	this->can_rx_q_free();
+	this->can_rx_ring_len = len;
+	this->can_rx_buff_len = buff_len;
+	this->can_rx_ring_memory = memory;
+	this->can_rx_pipe_setup();
+	return TRUE;
+}
+
+//All the buffers are one allocation, large pages need it and it's the
+//fewest TLB entries either way. Only the slots that are read get touched.
+bool Panda::can_rx_q_alloc() {
+	SIZE_T len = (SIZE_T)this->can_rx_ring_len * this->can_rx_buff_len;
+	void *mem = NULL;
+	uint32_t got = PANDA_RX_MEMORY_DEFAULT;
+	SIZE_T large = GetLargePageMinimum();
+	if ((this->can_rx_ring_memory & PANDA_RX_MEMORY_LARGE_PAGES) && large != 0) {
+		SIZE_T rounded = (len + large - 1) / large * large;
+		mem = VirtualAlloc(NULL, rounded, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+		if (mem != NULL) {
+			len = rounded;
+			got |= PANDA_RX_MEMORY_LARGE_PAGES | PANDA_RX_MEMORY_LOCKED; //Large pages are never paged out
 		}
+	}
+	if (mem == NULL)
+		mem = VirtualAlloc(NULL, len, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (mem == NULL) {
+		printf("Panda %s could not allocate %llu bytes of rx buffers\n", this->sn.c_str(), (unsigned long long)len);
+		return FALSE;
+	}
+	if ((this->can_rx_ring_memory & PANDA_RX_MEMORY_LOCKED) && !(got & PANDA_RX_MEMORY_LOCKED) && VirtualLock(mem, len))
+		got |= PANDA_RX_MEMORY_LOCKED;
+
+	this->can_rx_mem = mem;
+	this->can_rx_mem_len = len;
+	this->can_rx_mem_got = got;
+	this->can_rx_q = new CAN_RX_PIPE_READ[this->can_rx_ring_len]();
+	this->can_rx_q_len = this->can_rx_ring_len;
+	for (unsigned long i = 0; i < this->can_rx_q_len; i++) {
+		this->can_rx_q[i].data = (unsigned char *)mem + (SIZE_T)i * this->can_rx_buff_len;
+		//Overlapped reads reuse the same event for the life of the slot.
+		this->can_rx_q[i].complete = CreateEvent(NULL, TRUE, FALSE, NULL);
+	}
+	this->w_ptr = this->issue_ptr = this->r_ptr = 0;
+	this->r_offset = 0;
+	return TRUE;
+}
 
-		// Pause if there is not a slot available in the queue
-		if (n_ptr == this->r_ptr) {
-			printf("RX queue full!\n");
-			Sleep(1);
-			continue;
+//With no reads queued.
+void Panda::can_rx_q_free() {
+	if (this->can_rx_q == nullptr) return;
+	for (unsigned long i = 0; i < this->can_rx_q_len; i++)
+		CloseHandle(this->can_rx_q[i].complete);
+	delete[] this->can_rx_q;
+	this->can_rx_q = nullptr;
+	this->can_rx_q_len = 0;
+
+	if ((this->can_rx_mem_got & PANDA_RX_MEMORY_LOCKED) && !(this->can_rx_mem_got & PANDA_RX_MEMORY_LARGE_PAGES))
+		VirtualUnlock(this->can_rx_mem, this->can_rx_mem_len);
+	VirtualFree(this->can_rx_mem, 0, MEM_RELEASE);
+	this->can_rx_mem = NULL;
+	this->can_rx_mem_got = PANDA_RX_MEMORY_DEFAULT;
+	this->w_ptr = this->issue_ptr = this->r_ptr = 0;
+	this->r_offset = 0;
+}
+
+//Works out how long the EP1 IN reads can be. With RAW_IO WinUSB fails a read
+//that isn't whole packets or is longer than MAXIMUM_TRANSFER_SIZE, instead of
+//splitting it. RAW_IO is left off if not even one packet fits.
+void Panda::can_rx_pipe_setup() {
+	USB_INTERFACE_DESCRIPTOR iface;
+	WINUSB_PIPE_INFORMATION pipe;
+	if (WinUsb_QueryInterfaceSettings(this->usbh, this->alt_setting, &iface)) {
+		for (UCHAR i = 0; i < iface.bNumEndpoints; i++) {
+			if (WinUsb_QueryPipe(this->usbh, this->alt_setting, i, &pipe) && pipe.PipeId == 0x81 && pipe.MaximumPacketSize != 0)
+				this->usb_max_packet = pipe.MaximumPacketSize;
 		}
+	}
+
+	ULONG max_transfer = 0, len = sizeof(max_transfer);
+	if (!WinUsb_GetPipePolicy(this->usbh, 0x81, MAXIMUM_TRANSFER_SIZE, &len, &max_transfer)) max_transfer = 0;
+	this->usb_max_transfer = max_transfer;
 
-		if (this->can_rx_q[n_ptr].complete) {
-			// TODO: is ResetEvent() faster?
-			CloseHandle(this->can_rx_q[n_ptr].complete);
+	unsigned long longest = this->can_rx_buff_len;
+	if (max_transfer != 0) longest = min(longest, max_transfer);
+	longest -= longest % this->usb_max_packet;
+	if (longest == 0) {
+		this->set_raw_io(FALSE);
+		longest = this->can_rx_buff_len;
+	}
+	this->can_rx_read_len_max = longest;
+	this->can_rx_read_len_min = min(longest, max(CAN_RX_READ_MIN - CAN_RX_READ_MIN % this->usb_max_packet, this->usb_max_packet));
+	this->can_rx_read_len = this->can_rx_auto_tune ? this->can_rx_read_len_min : longest;
+}
+
+//Called with each completed read. A read that comes back full had more waiting
+//on the panda, so reads get twice as long, and once they are as long as they
+//go the pipeline gets deeper. When no read goes past a quarter of its length
+//both halve again, down to where they started.
+void Panda::can_rx_tune(const CAN_RX_PIPE_READ& rx) {
+	if (!this->can_rx_auto_tune) return;
+	this->can_rx_tune_reads++;
+	if (rx.count >= rx.len) this->can_rx_tune_full++;
+	this->can_rx_tune_longest = max(this->can_rx_tune_longest, rx.count);
+	if (this->can_rx_tune_reads < CAN_RX_TUNE_READS) return;
+
+	if (this->can_rx_tune_full * 4 >= this->can_rx_tune_reads) {
+		if (this->can_rx_read_len < this->can_rx_read_len_max)
+			this->can_rx_read_len = min(this->can_rx_read_len * 2, this->can_rx_read_len_max);
+		else
+			this->can_rx_pipeline_depth = min(this->can_rx_pipeline_depth * 2, CAN_RX_PIPELINE_MAX);
+	} else if (this->can_rx_tune_longest * 4 <= this->can_rx_read_len) {
+		if (this->can_rx_pipeline_depth > CAN_RX_PIPELINE_DEFAULT)
+			this->can_rx_pipeline_depth = max(this->can_rx_pipeline_depth / 2, CAN_RX_PIPELINE_DEFAULT);
+		else if (this->can_rx_read_len > this->can_rx_read_len_min) {
+			unsigned long half = this->can_rx_read_len / 2;
+			this->can_rx_read_len = max(half - half % this->usb_max_packet, this->can_rx_read_len_min);
 		}
+	}
+	this->can_rx_tune_reads = this->can_rx_tune_full = 0;
+	this->can_rx_tune_longest = 0;
+}
 
-		// Overlapped structure required for async read.
-		this->can_rx_q[n_ptr].complete = CreateEvent(NULL, TRUE, TRUE, NULL);
-		memset(&this->can_rx_q[n_ptr].overlapped, sizeof(OVERLAPPED), 0);
-		this->can_rx_q[n_ptr].overlapped.hEvent = this->can_rx_q[n_ptr].complete;
-		this->can_rx_q[n_ptr].error = 0;
+//Cancel every queued read and wait them out before the buffers are reused.
+void Panda::can_rx_q_abort() {
+	if (this->can_rx_q == nullptr) return;
+	WinUsb_AbortPipe(this->usbh, 0x81);
+	for (auto i = this->w_ptr; i != this->issue_ptr; i = (i + 1) % this->can_rx_q_len) {
+		if (this->can_rx_q[i].error == ERROR_IO_PENDING)
+			GetOverlappedResult(this->usbh, &this->can_rx_q[i].overlapped, &this->can_rx_q[i].count, TRUE);
+	}
+	this->issue_ptr = this->w_ptr;
+}
 
-		if (!WinUsb_ReadPipe(this->usbh, 0x81, this->can_rx_q[n_ptr].data, sizeof(this->can_rx_q[n_ptr].data), &this->can_rx_q[n_ptr].count, &this->can_rx_q[n_ptr].overlapped)) {
+// Keep up to can_rx_pipeline_depth reads queued. A slot can take a
+// read as long as completing it won't run into the reader.
+void Panda::can_rx_q_issue() {
+	if (this->can_rx_q == nullptr && !this->can_rx_q_alloc()) return;
+	while (1) {
+		auto issue_ptr = this->issue_ptr;
+		auto n_ptr = issue_ptr + 1;
+		if (n_ptr == this->can_rx_q_len) {
+			n_ptr = 0;
+		}
+		auto outstanding = (issue_ptr + this->can_rx_q_len - this->w_ptr) % this->can_rx_q_len;
+		if (outstanding >= this->can_rx_pipeline_depth || n_ptr == this->r_ptr) break;
+
+		auto& rx = this->can_rx_q[issue_ptr];
+		ResetEvent(rx.complete);
+		ZeroMemory(&rx.overlapped, sizeof(OVERLAPPED));
+		rx.overlapped.hEvent = rx.complete;
+		rx.error = 0;
+		rx.gap = FALSE;
+		rx.issued_us = this->perf_clock.getTimePassedUS();
+		rx.len = this->can_rx_read_len;
+
+		if (!WinUsb_ReadPipe(this->usbh, 0x81, rx.data, rx.len, &rx.count, &rx.overlapped)) {
 			// An overlapped read will return true if done, or false with an
 			// error of ERROR_IO_PENDING if the transfer is still in process.
-			this->can_rx_q[n_ptr].error = GetLastError();
+			rx.error = GetLastError();
 		}
+		this->issue_ptr = n_ptr;
+	}
+}
 
-		// Process the pipe read call from the previous invocation of this function
-		if (this->can_rx_q[w_ptr].error == ERROR_IO_PENDING) {
-			HANDLE phSignals[2] = { this->can_rx_q[w_ptr].complete, kill_event };
+bool Panda::can_rx_q_push(HANDLE kill_event, DWORD timeoutms) {
+	while (1) {
+		this->can_rx_q_issue();
+		if (this->can_rx_q == nullptr) return FALSE;
+
+		// Pause until the reader frees a slot in the queue
+		if (this->issue_ptr == this->w_ptr) {
+			printf("RX queue full!\n");
+			HANDLE phSignals[2] = { this->can_rx_q_drained, kill_event };
+			auto dwError = WaitForMultipleObjects(kill_event ? 2 : 1, phSignals, FALSE, timeoutms);
+			if (dwError == (WAIT_OBJECT_0 + 1)) {
+				return FALSE;
+			}
+			continue;
+		}
+
+		// Process the oldest queued read
+		auto& rx = this->can_rx_q[this->w_ptr];
+		if (rx.error == ERROR_IO_PENDING) {
+			HANDLE phSignals[2] = { rx.complete, kill_event };
 			auto dwError = WaitForMultipleObjects(kill_event ? 2 : 1, phSignals, FALSE, timeoutms);
 
 			// Check if packet, timeout (nope), or break
 			if (dwError == WAIT_OBJECT_0) {
 				// Signal came from our usb object. Read the returned data.
-				if (!GetOverlappedResult(this->usbh, &this->can_rx_q[w_ptr].overlapped, &this->can_rx_q[w_ptr].count, TRUE)) {
+				if (!GetOverlappedResult(this->usbh, &rx.overlapped, &rx.count, TRUE)) {
 					// TODO: handle other error cases better.
 					dwError = GetLastError();
 					printf("Got overlap error %d\n", dwError);
-
-					continue;
+					rx.count = 0;
 				}
 			}
 			else {
-				WinUsb_AbortPipe(this->usbh, 0x81);
+				this->can_rx_q_abort();
 
 				// Return FALSE to show that the optional signal
 				// was set instead of the wait breaking from a
@@ -441,52 +1408,528 @@ bool Panda::can_rx_q_push(HANDLE kill_event, DWORD timeoutms) {
 				continue;
 			}
 		}
-		else if (this->can_rx_q[w_ptr].error != 0) { // ERROR_BAD_COMMAND happens when device is unplugged.
+		else if (rx.error != 0) { // ERROR_BAD_COMMAND happens when device is unplugged.
+			this->can_rx_q_abort();
+			if (this->auto_reconnect && this->can_rx_reconnect(kill_event)) continue;
 			return FALSE;
 		}
 
-		this->w_ptr = n_ptr;
+		this->can_rx_q_done(rx);
+	}
+
+	return TRUE;
+}
+
+//The oldest read completed, it's the reader's to pop.
+void Panda::can_rx_q_done(CAN_RX_PIPE_READ& rx) {
+	PANDA_TRACE(TRACE_USB_RX, 0, (uint16_t)rx.count);
+	this->perf[PERF_CAN_RX_READ].record(this->perf_clock.getTimePassedUS() - rx.issued_us);
+	this->can_rx_tune(rx);
+	if (this->can_rx_gap_pending) {
+		rx.gap = TRUE;
+		rx.gap_dev_time_known = this->can_rx_gap_dev_time_known;
+		rx.gap_dev_time = this->can_rx_gap_dev_time;
+		rx.gap_us = this->can_rx_gap_us;
+		this->can_rx_gap_pending = FALSE;
 	}
+	auto w_ptr = this->w_ptr + 1;
+	this->w_ptr = (w_ptr == this->can_rx_q_len ? 0 : w_ptr);
+	SetEvent(this->can_rx_q_filled);
+}
 
+bool Panda::can_rx_q_start(std::shared_ptr<IoStrand> strand, std::function<void()> filled) {
+	if (this->can_rx_strand) return FALSE;
+	this->can_rx_strand = strand;
+	this->can_rx_filled = filled;
+	if (!strand->attach(this->devh, [this](OVERLAPPED *overlapped) { this->can_rx_async_completed(overlapped); })) {
+		this->can_rx_strand = nullptr;
+		return FALSE;
+	}
+	strand->post([this] { this->can_rx_async_pump(); });
 	return TRUE;
 }
 
+void Panda::can_rx_q_stop() {
+	if (!this->can_rx_strand) return;
+	this->can_rx_q_abort();
+	this->can_rx_strand = nullptr;
+}
+
+//On the strand. Every overlapped operation on the handle completes on the
+//port, only the EP1 IN reads are taken.
+void Panda::can_rx_async_completed(OVERLAPPED *overlapped) {
+	auto rx = CONTAINING_RECORD(overlapped, CAN_RX_PIPE_READ, overlapped);
+	if ((uintptr_t)rx < (uintptr_t)this->can_rx_q || (uintptr_t)rx >= (uintptr_t)(this->can_rx_q + this->can_rx_q_len)) return;
+	if (rx->error != ERROR_IO_PENDING) return;
+
+	if (WinUsb_GetOverlappedResult(this->usbh, &rx->overlapped, &rx->count, FALSE)) {
+		rx->error = 0;
+	} else {
+		DWORD err = GetLastError();
+		if (err == ERROR_IO_INCOMPLETE) return;
+		rx->error = err;
+		rx->count = 0;
+	}
+	this->can_rx_async_pump();
+}
+
+//On the strand. Hands the completed reads to filled oldest first and queues
+//new ones in their place, until none of them finished at once.
+void Panda::can_rx_async_pump() {
+	while (1) {
+		while (this->w_ptr != this->issue_ptr && this->can_rx_q[this->w_ptr].error != ERROR_IO_PENDING) {
+			auto& rx = this->can_rx_q[this->w_ptr];
+			if (rx.error != 0) { // ERROR_BAD_COMMAND happens when device is unplugged.
+				this->can_rx_q_abort();
+				if (this->r_ptr != this->w_ptr) this->can_rx_filled();
+				if (this->auto_reconnect) {
+					printf("Panda %s dropped off USB, waiting for it\n", this->sn.c_str());
+					this->can_rx_gone_us = this->perf_clock.getTimePassedUS();
+					this->can_rx_strand->post_at(std::chrono::steady_clock::now() + std::chrono::milliseconds(PANDA_RECONNECT_POLL_MS),
+						[this] { this->can_rx_async_reconnect(); });
+				}
+				return;
+			}
+			this->can_rx_q_done(rx);
+		}
+		if (this->r_ptr != this->w_ptr) this->can_rx_filled();
+
+		this->can_rx_q_issue();
+		if (this->w_ptr == this->issue_ptr || this->can_rx_q[this->w_ptr].error == ERROR_IO_PENDING) return;
+	}
+}
+
+//On the strand, one look for the panda every PANDA_RECONNECT_POLL_MS.
+void Panda::can_rx_async_reconnect() {
+	if (!this->reconnect(NULL, 0)) {
+		this->can_rx_strand->post_at(std::chrono::steady_clock::now() + std::chrono::milliseconds(PANDA_RECONNECT_POLL_MS),
+			[this] { this->can_rx_async_reconnect(); });
+		return;
+	}
+	this->can_rx_gap_note(this->perf_clock.getTimePassedUS() - this->can_rx_gone_us);
+	this->can_rx_strand->attach(this->devh, [this](OVERLAPPED *overlapped) { this->can_rx_async_completed(overlapped); });
+	this->can_rx_async_pump();
+}
+
 void Panda::can_rx_q_pop(PANDA_CAN_MSG msg_out[], int &count) {
-	count = 0;
+	//A read is at most CAN_RX_MSG_LEN classic messages, so this drains a whole one.
+	//One of compact records can take a few.
+	count = (int)this->can_rx_q_pop_into(msg_out, CAN_RX_MSG_LEN, NULL, 1);
+}
+
+//Runs on the can_rx_q_push thread. The reads were aborted, the ones before are still to be popped.
+bool Panda::can_rx_reconnect(HANDLE kill_event) {
+	Timer gone;
+	printf("Panda %s dropped off USB, waiting for it\n", this->sn.c_str());
+	if (!this->reconnect(kill_event, INFINITE)) return FALSE;
+
+	this->can_rx_gap_note(gone.getTimePassedUS());
+	return TRUE;
+}
+
+//Marks the next completed read as the first after a reconnect.
+void Panda::can_rx_gap_note(unsigned long long gone_us) {
+	uint32_t dev_time = 0;
+	this->can_rx_gap_dev_time_known = this->get_time(dev_time);
+	this->can_rx_gap_dev_time = dev_time;
+	this->can_rx_gap_us = gone_us;
+	this->can_rx_gap_pending = TRUE;
+	printf("Panda %s is back after %llu ms\n", this->sn.c_str(), this->can_rx_gap_us / 1000);
+}
+
+//The panda may have rebooted and restarted its timer. Times go on from the
+//last frame's, plus how long the panda was gone. Called by the reader, which
+//owns the unwrap state.
+unsigned long long Panda::can_rx_gap_rebase(const CAN_RX_PIPE_READ& rx) {
+	unsigned long long resumed = this->device_time_base + this->last_device_time + rx.gap_us;
+	if (rx.gap_dev_time_known) {
+		this->device_time_base = resumed - rx.gap_dev_time;
+		this->last_device_time = rx.gap_dev_time;
+		this->device_time_seen = TRUE;
+	}
+	//The host and device times of before don't line up with the new ones.
+	this->perf_offset_min[0] = this->perf_offset_min[1] = LLONG_MAX;
+	return resumed;
+}
 
-	// No data left in queue
+size_t Panda::can_rx_q_pop_into(PANDA_CAN_MSG* out, size_t cap, HANDLE kill_event, DWORD timeoutms) {
+	// No data left in queue, wait for the next completed read. The event
+	// stays set if one completed since the check, so none are missed.
 	if (this->r_ptr == this->w_ptr) {
-		Sleep(1);
-		return;
+		if (timeoutms == 0) return 0;
+		HANDLE phSignals[2] = { this->can_rx_q_filled, kill_event };
+		if (WaitForMultipleObjects(kill_event ? 2 : 1, phSignals, FALSE, timeoutms) != WAIT_OBJECT_0)
+			return 0;
+		if (this->r_ptr == this->w_ptr) return 0;
 	}
 
 	auto r_ptr = this->r_ptr;
-	for (int i = 0; i < this->can_rx_q[r_ptr].count; i += sizeof(PANDA_CAN_MSG_INTERNAL)) {
-		auto in_msg_raw = (PANDA_CAN_MSG_INTERNAL *)(this->can_rx_q[r_ptr].data + i);
-		msg_out[count] = parse_can_recv(in_msg_raw);
-		++count;
+	auto& gap = this->can_rx_q[r_ptr];
+	if (gap.gap) {
+		if (cap == 0) return 0;
+		gap.gap = FALSE;
+		out[0].addr = 0;
+		out[0].addr_29b = FALSE;
+		out[0].len = 0;
+		memset(out[0].dat, 0, sizeof(out[0].dat));
+		out[0].bus = PANDA_CAN_GAP;
+		out[0].is_receipt = FALSE;
+		out[0].is_completion = FALSE;
+		out[0].tx_token = 0;
+		out[0].tx_failed = out[0].tx_arb_lost = FALSE;
+		out[0].recv_time = this->can_rx_gap_rebase(gap);
+		out[0].recv_time_point = std::chrono::steady_clock::now();
+		return 1;
 	}
 
-	// Advance read pointer (wrap around if needed)
-	++r_ptr;
-	this->r_ptr = (r_ptr == CAN_RX_QUEUE_LEN ? 0 : r_ptr);
+	unsigned long consumed;
+	size_t count = parse_can_recv_buff(this->can_rx_q[r_ptr].data + this->r_offset,
+		this->can_rx_q[r_ptr].count - this->r_offset, out, cap, &consumed);
+	this->r_offset += consumed;
+
+	// Advance read pointer once the read is drained (wrap around if needed)
+	if (this->r_offset >= this->can_rx_q[r_ptr].count) {
+		this->r_offset = 0;
+		++r_ptr;
+		this->r_ptr = (r_ptr == this->can_rx_q_len ? 0 : r_ptr);
+		SetEvent(this->can_rx_q_drained);
+	}
+	return count;
 }
 
 std::vector<PANDA_CAN_MSG> Panda::can_recv() {
-	std::vector<PANDA_CAN_MSG> msg_recv;
+	PANDA_CAN_MSG msgs[PANDA_CAN_COMPACT_MSGS_PER_PACKET];
+	size_t count = this->can_recv_into(msgs, (this->can_rx_format == PANDA_CAN_FORMAT_COMPACT) ?
+		PANDA_CAN_COMPACT_MSGS_PER_PACKET : PANDA_CAN_MSGS_PER_PACKET);
+	return std::vector<PANDA_CAN_MSG>(msgs, msgs + count);
+}
+
+size_t Panda::can_recv_into(PANDA_CAN_MSG* out, size_t cap) {
 	int retcount;
-	char buff[sizeof(PANDA_CAN_MSG_INTERNAL) * 4];
+	unsigned long consumed;
+	size_t per_packet = (this->can_rx_format == PANDA_CAN_FORMAT_COMPACT) ?
+		PANDA_CAN_COMPACT_MSGS_PER_PACKET : PANDA_CAN_MSGS_PER_PACKET;
+	ULONG len = (ULONG)min(cap / per_packet * 0x40, sizeof(this->can_recv_buff));
+	if (len == 0) return 0;
+
+	if (this->bulk_read(0x81, this->can_recv_buff, len, (PULONG)&retcount, 0) == FALSE)
+		return 0;
+
+	return parse_can_recv_buff(this->can_recv_buff, retcount, out, cap, &consumed);
+}
+
+//The first count classic records of buff, as parse_can_recv would decode them,
+//in one pass. The id, length and bus of four records at a time come from SSE2
+//masks instead of the branches on IDE and the bus. The device times are
+//unwrapped in order after, the unwrapping carries from frame to frame.
+void Panda::parse_can_recv_batch(const unsigned char *buff, size_t count, PANDA_CAN_MSG msg_out[],
+	std::chrono::time_point<std::chrono::steady_clock> recv_time_point) {
+	//Record i, 3 to each packet.
+	auto rec = [buff](size_t i) {
+		return (const PANDA_CAN_MSG_TS_INTERNAL *)(buff + (i / 3) * 0x40 + (i % 3) * sizeof(PANDA_CAN_MSG_TS_INTERNAL));
+	};
+	const __m128i ext_bit = _mm_set1_epi32(CAN_EXTENDED);
+	const __m128i bus_bits = _mm_set1_epi32(0x7F);
+	const __m128i bus_last = _mm_set1_epi32(PANDA_CAN3);
+	const __m128i bus_unk = _mm_set1_epi32(PANDA_CAN_UNK);
+	const __m128i len_bits = _mm_set1_epi32(0xF);
+	const __m128i receipt_bit = _mm_set1_epi32(0x80 << 4);
+
+	size_t vec = count & ~(size_t)3;
+	for (size_t i = 0; i < vec; i += 4) {
+		const PANDA_CAN_MSG_TS_INTERNAL *r[4] = { rec(i), rec(i + 1), rec(i + 2), rec(i + 3) };
+		__m128i rir = _mm_set_epi32(r[3]->msg.rir, r[2]->msg.rir, r[1]->msg.rir, r[0]->msg.rir);
+		__m128i f2 = _mm_set_epi32(r[3]->msg.f2, r[2]->msg.f2, r[1]->msg.f2, r[0]->msg.f2);
+
+		__m128i ext = _mm_cmpeq_epi32(_mm_and_si128(rir, ext_bit), ext_bit);
+		__m128i addr = _mm_or_si128(_mm_and_si128(ext, _mm_srli_epi32(rir, 3)),
+			_mm_andnot_si128(ext, _mm_srli_epi32(rir, 21)));
+		__m128i bus = _mm_and_si128(_mm_srli_epi32(f2, 4), bus_bits);
+		__m128i unk = _mm_cmpgt_epi32(bus, bus_last);
+		bus = _mm_or_si128(_mm_andnot_si128(unk, bus), _mm_and_si128(unk, bus_unk));
+		__m128i len = _mm_and_si128(f2, len_bits);
+		__m128i receipt = _mm_cmpeq_epi32(_mm_and_si128(f2, receipt_bit), receipt_bit);
+
+		alignas(16) uint32_t addrs[4], exts[4], buses[4], lens[4], receipts[4];
+		_mm_store_si128((__m128i *)addrs, addr);
+		_mm_store_si128((__m128i *)exts, ext);
+		_mm_store_si128((__m128i *)buses, bus);
+		_mm_store_si128((__m128i *)lens, len);
+		_mm_store_si128((__m128i *)receipts, receipt);
+		for (size_t j = 0; j < 4; j++) {
+			PANDA_CAN_MSG& m = msg_out[i + j];
+			m.addr = addrs[j];
+			m.addr_29b = exts[j] != 0;
+			m.bus = (PANDA_CAN_PORT)buses[j];
+			m.len = (uint8_t)lens[j];
+			m.is_receipt = receipts[j] != 0;
+			m.is_completion = (r[j]->msg.rir & 1) != 0;
+			m.tx_token = m.is_completion ? (r[j]->msg.dat[0] | ((r[j]->msg.dat[1] & 3) << 8)) : 0;
+			m.tx_failed = m.is_completion && (r[j]->msg.dat[1] & 0x80) != 0;
+			m.tx_arb_lost = m.is_completion && (r[j]->msg.dat[1] & 0x40) != 0;
+			m.recv_time_point = recv_time_point;
+			memcpy(m.dat, r[j]->msg.dat, 8);
+		}
+	}
+	for (size_t i = 0; i < vec; i++)
+		msg_out[i].recv_time = this->unwrap_device_time(rec(i)->timestamp);
+	for (size_t i = vec; i < count; i++)
+		parse_can_recv(rec(i), msg_out[i], recv_time_point);
+}
+
+//Each 0x40 byte USB packet holds up to 3 timestamped messages, or up to 12
+//compact records. Full packets are padded so the transfer does not end early
+//on a short packet. Stops before a packet that would not fit in msg_out.
+size_t Panda::parse_can_recv_buff(const unsigned char *buff, unsigned long len, PANDA_CAN_MSG msg_out[],
+	size_t cap, unsigned long *consumed) {
+	auto now = std::chrono::steady_clock::now();
+	unsigned long long now_us = this->perf_clock.getTimePassedUS();
+	size_t count = 0;
+	unsigned long pkt = 0;
+	if (this->can_rx_format == PANDA_CAN_FORMAT_COMPACT) {
+		for (; pkt < len; pkt += 0x40) {
+			unsigned long pkt_len = min(len - pkt, 0x40);
+			if (count + can_compact_pkt_count(buff + pkt, pkt_len) > cap) break;
+			uint32_t ts_base = 0;
+			for (unsigned long pos = 0, rec_len; (rec_len = can_compact_rec_len(buff + pkt + pos, pkt_len - pos)) != 0; pos += rec_len) {
+				parse_can_recv_compact(buff + pkt + pos, ts_base, pos == 0, msg_out[count], now);
+				++count;
+			}
+		}
+	} else {
+		//Only the last packet can be short, so the records are all 3 to a packet.
+		for (; pkt < len; pkt += 0x40) {
+			size_t pkt_count = min(len - pkt, 0x40) / sizeof(PANDA_CAN_MSG_TS_INTERNAL);
+			if (count + pkt_count > cap) break;
+			count += pkt_count;
+		}
+		parse_can_recv_batch(buff, count, msg_out, now);
+	}
+	*consumed = min(pkt, len);
+	//Without timestamps classic records don't have the time.
+	if (this->timestamps || this->can_rx_format == PANDA_CAN_FORMAT_COMPACT)
+		for (size_t i = 0; i < count; i++)
+			this->perf_dequeue(now_us, msg_out[i].recv_time);
+	return count;
+}
+
+//The compact time is worked out as in parse_can_recv_compact.
+void Panda::can_rec_key_read(const unsigned char *rec, bool compact, uint32_t& ts_base, bool first, can_rec_key& key) {
+	if (!compact) {
+		const PANDA_CAN_MSG_TS_INTERNAL *raw = (const PANDA_CAN_MSG_TS_INTERNAL *)rec;
+		key.addr_29b = (raw->msg.rir & CAN_EXTENDED) != 0;
+		key.addr = key.addr_29b ? (raw->msg.rir >> 3) : (raw->msg.rir >> 21);
+		key.ts = raw->timestamp;
+		uint8_t bus = (raw->msg.f2 >> 4) & 0x7F;
+		key.bus = (bus <= PANDA_CAN3) ? (PANDA_CAN_PORT)bus : PANDA_CAN_UNK;
+		key.receipt = ((raw->msg.f2 >> 4) & 0x80) != 0;
+		return;
+	}
+
+	unsigned long idl = (rec[0] & 0x80) ? 4 : 2;
+	key.addr_29b = (rec[0] & 0x80) != 0;
+	key.addr = 0;
+	memcpy(&key.addr, rec + 1, idl);
+	int16_t rel;
+	memcpy(&rel, rec + 1 + idl, sizeof(rel));
+	if ((uint16_t)rel == 0x8000)
+		memcpy(&key.ts, rec + 3 + idl, sizeof(key.ts));
+	else
+		key.ts = ts_base + (int32_t)rel;
+	if (first) ts_base = key.ts;
+	key.bus = (PANDA_CAN_PORT)((rec[0] >> 4) & 3);
+	key.receipt = (rec[0] & 0x40) != 0;
+}
+
+bool Panda::can_sub_wants(const can_subscriber& sub, uint32_t addr, bool addr_29b, PANDA_CAN_PORT bus, bool receipt) {
+	return (sub.bus == PANDA_CAN_UNK || sub.bus == bus) && sub.filter.addr_29b == addr_29b &&
+		((addr ^ sub.filter.addr) & sub.filter.mask) == 0 && (sub.receipts || !receipt);
+}
+
+//Called with can_sub_lock held.
+uint64_t Panda::can_sub_match(const can_rec_key& key) {
+	uint64_t subs = key.addr_29b ? 0 : this->can_sub_exact[min((int)key.bus, 3)][key.addr & 0x7FF];
+	uint64_t masked = this->can_sub_masked;
+	for (int i = 0; masked != 0; i++, masked >>= 1) {
+		if ((masked & 1) && can_sub_wants(this->can_subs[i], key.addr, key.addr_29b, key.bus, key.receipt))
+			subs |= 1ULL << i;
+	}
+	return key.receipt ? (subs & this->can_sub_receipts) : subs;
+}
+
+//Filters on a whole 11 bit id go in the table, the rest are checked one by one.
+void Panda::can_sub_index(int sub, bool on) {
+	const can_subscriber& s = this->can_subs[sub];
+	uint64_t bit = 1ULL << sub;
+	auto set = [on, bit](uint64_t& subs) { subs = on ? (subs | bit) : (subs & ~bit); };
+	if (s.filter.addr_29b || (s.filter.mask & 0x7FF) != 0x7FF) {
+		set(this->can_sub_masked);
+	} else {
+		for (int bus = 0; bus < 4; bus++)
+			if (s.bus == PANDA_CAN_UNK || s.bus == bus)
+				set(this->can_sub_exact[bus][s.filter.addr & 0x7FF]);
+	}
+	if (s.receipts) set(this->can_sub_receipts);
+}
+
+int Panda::can_subscribe(PANDA_CAN_PORT bus, const PANDA_CAN_FILTER& filter, PANDA_CAN_CALLBACK cb, bool receipts) {
+	if (!cb) return -1;
+	int sub = -1;
+	EnterCriticalSection(&this->can_sub_lock);
+	for (int i = 0; i < PANDA_CAN_SUBSCRIBERS_MAX; i++) {
+		can_subscriber& s = this->can_subs[i];
+		if (s.used || s.dying) continue;
+		s.bus = bus;
+		s.filter = filter;
+		s.receipts = receipts;
+		s.cb = std::move(cb);
+		s.used = TRUE;
+		this->can_sub_index(i, TRUE);
+		sub = i;
+		break;
+	}
+	LeaveCriticalSection(&this->can_sub_lock);
+	return sub;
+}
+
+bool Panda::can_unsubscribe(int sub) {
+	if (sub < 0 || sub >= PANDA_CAN_SUBSCRIBERS_MAX) return FALSE;
+	EnterCriticalSection(&this->can_sub_lock);
+	can_subscriber& s = this->can_subs[sub];
+	bool found = s.used;
+	if (found) {
+		this->can_sub_index(sub, FALSE);
+		s.used = FALSE;
+		//The callback unsubscribing can be this one, so it lives out the read.
+		if (GetCurrentThreadId() == this->can_dispatch_thread_id)
+			s.dying = TRUE;
+		else
+			s.cb = nullptr;
+	}
+	LeaveCriticalSection(&this->can_sub_lock);
+	return found;
+}
+
+//Like parse_can_recv_buff, but only frames a subscriber wants are decoded, each
+//once for all of them. The others only move the time along.
+void Panda::can_dispatch_buff(const unsigned char *buff, unsigned long len) {
+	auto now = std::chrono::steady_clock::now();
+	unsigned long long now_us = this->perf_clock.getTimePassedUS();
+	bool compact = this->can_rx_format == PANDA_CAN_FORMAT_COMPACT;
+	bool timed = compact || this->timestamps;
+	PANDA_CAN_MSG msg;
+	for (unsigned long pkt = 0; pkt < len; pkt += 0x40) {
+		unsigned long pkt_len = min(len - pkt, 0x40);
+		const unsigned char *pkt_buff = buff + pkt;
+		uint32_t ts_base = 0;
+		for (unsigned long pos = 0, rec_len; ; pos += rec_len) {
+			rec_len = compact ? can_compact_rec_len(pkt_buff + pos, pkt_len - pos) :
+				((pos + sizeof(PANDA_CAN_MSG_TS_INTERNAL) <= pkt_len) ? sizeof(PANDA_CAN_MSG_TS_INTERNAL) : 0);
+			if (rec_len == 0) break;
+			can_rec_key key;
+			can_rec_key_read(pkt_buff + pos, compact, ts_base, pos == 0, key);
+			uint64_t subs = this->can_sub_match(key);
+			if (subs == 0) {
+				this->unwrap_device_time(key.ts);
+				continue;
+			}
+			if (compact)
+				parse_can_recv_compact(pkt_buff + pos, ts_base, pos == 0, msg, now);
+			else
+				parse_can_recv((const PANDA_CAN_MSG_TS_INTERNAL *)(pkt_buff + pos), msg, now);
+			if (timed) this->perf_dequeue(now_us, msg.recv_time);
+			//A callback can unsubscribe the ones after it.
+			for (int i = 0; subs != 0; i++, subs >>= 1)
+				if ((subs & 1) && this->can_subs[i].used)
+					this->can_subs[i].cb(msg);
+		}
+	}
+}
+
+DWORD Panda::can_dispatch_thread() {
+	this->can_dispatch_thread_id = GetCurrentThreadId();
+	HANDLE phSignals[2] = { this->can_rx_q_filled, this->can_dispatch_kill };
+	while (WaitForMultipleObjects(2, phSignals, FALSE, INFINITE) == WAIT_OBJECT_0) {
+		while (this->r_ptr != this->w_ptr) {
+			auto r_ptr = this->r_ptr;
+			//Subscribers aren't told of gaps, the time still carries on.
+			if (this->can_rx_q[r_ptr].gap) {
+				this->can_rx_q[r_ptr].gap = FALSE;
+				this->can_rx_gap_rebase(this->can_rx_q[r_ptr]);
+			}
+			EnterCriticalSection(&this->can_sub_lock);
+			this->can_dispatch_buff(this->can_rx_q[r_ptr].data + this->r_offset, this->can_rx_q[r_ptr].count - this->r_offset);
+			for (auto& s : this->can_subs) {
+				if (!s.dying) continue;
+				s.cb = nullptr;
+				s.dying = FALSE;
+			}
+			LeaveCriticalSection(&this->can_sub_lock);
+
+			this->r_offset = 0;
+			++r_ptr;
+			this->r_ptr = (r_ptr == this->can_rx_q_len ? 0 : r_ptr);
+			SetEvent(this->can_rx_q_drained);
+		}
+	}
+	return 0;
+}
+
+bool Panda::can_dispatch_start() {
+	if (this->can_dispatch_thread_handle) return FALSE;
+	ResetEvent(this->can_dispatch_kill);
+	DWORD threadID;
+	this->can_dispatch_rx_thread_handle = CreateThread(NULL, 0, _can_dispatch_rx_threadBootstrap, (LPVOID)this, 0, &threadID);
+	this->can_dispatch_thread_handle = CreateThread(NULL, 0, _can_dispatch_threadBootstrap, (LPVOID)this, 0, &threadID);
+	return TRUE;
+}
+
+void Panda::can_dispatch_stop() {
+	if (!this->can_dispatch_thread_handle) return;
+	SetEvent(this->can_dispatch_kill);
+	WaitForSingleObject(this->can_dispatch_rx_thread_handle, INFINITE);
+	WaitForSingleObject(this->can_dispatch_thread_handle, INFINITE);
+	CloseHandle(this->can_dispatch_rx_thread_handle);
+	CloseHandle(this->can_dispatch_thread_handle);
+	this->can_dispatch_rx_thread_handle = NULL;
+	this->can_dispatch_thread_handle = NULL;
+	this->can_dispatch_thread_id = 0;
+}
 
-	if (this->bulk_read(0x81, buff, sizeof(buff), (PULONG)&retcount, 0) == FALSE)
-		return msg_recv;
+bool Panda::can_replay_status(PANDA_CAN_REPLAY_STATUS& status, PANDA_CAN_REPLAY_OP op) {
+	ZeroMemory(&status, sizeof(status));
+	return this->control_transfer(REQUEST_IN, 0xfd, op, 0, &status, sizeof(status), 0) == sizeof(status);
+}
 
-	for (int i = 0; i < retcount; i += sizeof(PANDA_CAN_MSG_INTERNAL)) {
-		PANDA_CAN_MSG_INTERNAL *in_msg_raw = (PANDA_CAN_MSG_INTERNAL *)(buff + i);
-		auto in_msg = parse_can_recv(in_msg_raw);
-		msg_recv.push_back(in_msg);
+//Replay records are timestamped ones with the us since the record before,
+//3 to a packet. Full packets are padded so a record never spans two.
+bool Panda::can_replay_load(const PANDA_CAN_MSG* msgs, size_t count, unsigned long long& prev_time) {
+	const size_t per_packet = PANDA_CAN_MSGS_PER_PACKET;
+	std::vector<unsigned char> buff;
+	buff.reserve((count / per_packet + 1) * 0x40);
+
+	size_t in_packet = 0;
+	for (size_t i = 0; i < count; i++) {
+		const PANDA_CAN_MSG& msg = msgs[i];
+		if (msg.bus == PANDA_CAN_UNK || msg.len > 8) continue;
+		PANDA_CAN_MSG_TS_INTERNAL rec;
+		pack_can_msg(rec.msg, msg.addr, msg.addr_29b, msg.dat, msg.len, msg.bus);
+		//Out of order frames go right after the one before.
+		unsigned long long gap = (msg.recv_time > prev_time) ? msg.recv_time - prev_time : 0;
+		rec.timestamp = (gap > 0xFFFFFFFFULL) ? 0xFFFFFFFFU : (uint32_t)gap;
+		prev_time = (msg.recv_time > prev_time) ? msg.recv_time : prev_time;
+
+		const unsigned char *p = (const unsigned char *)&rec;
+		buff.insert(buff.end(), p, p + sizeof(rec));
+		if (++in_packet == per_packet) {
+			buff.resize(buff.size() + 0x40 - per_packet * sizeof(rec), 0);
+			in_packet = 0;
+		}
 	}
+	if (buff.empty()) return TRUE;
 
-	return msg_recv;
+	unsigned int retcount;
+	return this->bulk_write(3, buff.data(), (ULONG)buff.size(), (PULONG)&retcount, 0);
 }
 
 bool Panda::can_clear(PANDA_CAN_PORT_CLEAR bus) {
@@ -509,14 +1952,184 @@ std::string Panda::serial_read(PANDA_SERIAL_PORT port_number) {
 }
 
 int Panda::serial_write(PANDA_SERIAL_PORT port_number, const void* buff, uint16_t len) {
-	std::string dat;
-	dat += port_number;
-	dat += std::string((char*)buff, len);
-	int retcount;
-	if (this->bulk_write(2, dat.c_str(), len+1, (PULONG)&retcount, 0) == FALSE) return -1;
-	return retcount;
+	struct {
+		HANDLE done;
+		int len;
+	} res = { CreateEvent(NULL, TRUE, FALSE, NULL), -1 };
+	if (res.done == NULL) return -1;
+	//Nothing of res is touched after the event is set, the wait can return at once.
+	if (this->serial_write_async(port_number, buff, len, [&res](int sent) { res.len = sent; SetEvent(res.done); }))
+		WaitForSingleObject(res.done, INFINITE);
+	CloseHandle(res.done);
+	return res.len;
+}
+
+bool Panda::serial_write_async(PANDA_SERIAL_PORT port_number, const void* buff, size_t len, PANDA_SERIAL_CALLBACK done) {
+	if (!buff || !len || len > INT_MAX) return FALSE;
+	EnterCriticalSection(&this->serial_tx_lock);
+	if (this->serial_tx_stop || this->serial_tx_count == SERIAL_TX_WRITES || this->serial_tx_xfers[0].wait == NULL) {
+		LeaveCriticalSection(&this->serial_tx_lock);
+		return FALSE;
+	}
+	auto& w = this->serial_tx_writes[(this->serial_tx_head + this->serial_tx_count) % SERIAL_TX_WRITES];
+	w.port = port_number;
+	w.data = (const uint8_t*)buff;
+	w.len = len;
+	w.taken = 0;
+	w.sent = 0;
+	w.xfers = 0;
+	w.failed = FALSE;
+	w.done = std::move(done);
+	this->serial_tx_count++;
+	//A transfer that fails to queue still completes through its wait.
+	this->serial_tx_pump();
+	LeaveCriticalSection(&this->serial_tx_lock);
+	return TRUE;
+}
+
+//Fills the free transfers from the oldest writes with bytes left, in order, so
+//EP2 gets them in the order they were queued. A short packet ends a transfer,
+//so only the last of a write can be short. Called with serial_tx_lock held.
+void Panda::serial_tx_pump() {
+	unsigned long k = 0;
+	for (auto& x : this->serial_tx_xfers) {
+		if (x.busy) continue;
+		for (; k < this->serial_tx_count; k++) {
+			auto& w = this->serial_tx_writes[(this->serial_tx_head + k) % SERIAL_TX_WRITES];
+			if (this->serial_tx_stop && w.taken < w.len) {
+				w.failed = TRUE;
+				w.taken = w.len;
+			}
+			if (w.taken < w.len) break;
+		}
+		if (k == this->serial_tx_count) return;
+
+		auto& w = this->serial_tx_writes[(this->serial_tx_head + k) % SERIAL_TX_WRITES];
+		x.len = 0;
+		x.payload = 0;
+		while (x.len < sizeof(x.data) && w.taken < w.len) {
+			size_t n = min(w.len - w.taken, (size_t)0x3F);
+			x.data[x.len] = w.port;
+			memcpy(x.data + x.len + 1, w.data + w.taken, n);
+			x.len += (unsigned long)n + 1;
+			x.payload += n;
+			w.taken += n;
+		}
+		x.write = (this->serial_tx_head + k) % SERIAL_TX_WRITES;
+		x.usbh = this->usbh;
+		x.busy = TRUE;
+		x.error = FALSE;
+		w.xfers++;
+		this->serial_tx_busy++;
+
+		ResetEvent(x.event);
+		ZeroMemory(&x.overlapped, sizeof(x.overlapped));
+		//Low bit set, so the completion isn't also posted to can_rx_q_start's port.
+		x.overlapped.hEvent = (HANDLE)((ULONG_PTR)x.event | 1);
+		x.issued_us = this->perf_clock.getTimePassedUS();
+		if (WinUsb_WritePipe(x.usbh, 0x02, x.data, x.len, NULL, &x.overlapped) == FALSE &&
+			GetLastError() != ERROR_IO_PENDING) {
+			x.error = TRUE;
+			SetEvent(x.event);
+		}
+		SetThreadpoolWait(x.wait, x.event, NULL);
+	}
+}
+
+VOID CALLBACK Panda::serial_tx_completed(PTP_CALLBACK_INSTANCE instance, PVOID context,
+	PTP_WAIT wait, TP_WAIT_RESULT result) {
+	UNREFERENCED_PARAMETER(instance);
+	UNREFERENCED_PARAMETER(wait);
+	UNREFERENCED_PARAMETER(result);
+	SERIAL_TX_XFER *x = (SERIAL_TX_XFER*)context;
+	Panda *p = x->panda;
+
+	DWORD transferred = 0;
+	BOOL ok = !x->error && WinUsb_GetOverlappedResult(x->usbh, &x->overlapped, &transferred, FALSE);
+	p->perf[PERF_BULK_OUT_EP2].record(p->perf_clock.getTimePassedUS() - x->issued_us);
+
+	EnterCriticalSection(&p->serial_tx_lock);
+	auto& w = p->serial_tx_writes[x->write];
+	if (ok && transferred == x->len) {
+		w.sent += x->payload;
+	} else if (!w.failed) {
+		//The rest of it isn't sent, the writes after go on.
+		w.failed = TRUE;
+		w.taken = w.len;
+	}
+	w.xfers--;
+	x->busy = FALSE;
+	p->serial_tx_busy--;
+	p->serial_tx_pump();
+	p->serial_tx_finish();
+}
+
+//Runs done for the writes at the head that are over, one thread at a time so
+//they are called in order. A thread that finds another at it leaves its writes
+//to that one. Called with serial_tx_lock held, returns with it released.
+void Panda::serial_tx_finish() {
+	if (this->serial_tx_calling) {
+		LeaveCriticalSection(&this->serial_tx_lock);
+		return;
+	}
+	this->serial_tx_calling = TRUE;
+	while (this->serial_tx_count != 0) {
+		auto& w = this->serial_tx_writes[this->serial_tx_head];
+		if (w.xfers != 0 || w.taken < w.len) break;
+		int len = w.failed ? -1 : (int)w.sent;
+		PANDA_SERIAL_CALLBACK done = std::move(w.done);
+		w.done = nullptr;
+		this->serial_tx_head = (this->serial_tx_head + 1) % SERIAL_TX_WRITES;
+		this->serial_tx_count--;
+		//The callback can queue more writes.
+		LeaveCriticalSection(&this->serial_tx_lock);
+		if (done) done(len);
+		EnterCriticalSection(&this->serial_tx_lock);
+	}
+	this->serial_tx_calling = FALSE;
+	if (this->serial_tx_count == 0 && this->serial_tx_busy == 0)
+		WakeAllConditionVariable(&this->serial_tx_idle);
+	LeaveCriticalSection(&this->serial_tx_lock);
 }
 
 bool Panda::serial_clear(PANDA_SERIAL_PORT port_number) {
 	return this->control_transfer(REQUEST_OUT, 0xf2, port_number, 0, NULL, 0, 0) != -1;
 }
+
+bool Panda::set_serial_stream(uint8_t port_mask) {
+	return this->control_transfer(REQUEST_OUT, 0xf4, port_mask, 0, NULL, 0, 0) != -1;
+}
+
+bool Panda::serial_rx_queue() {
+	auto& rx = this->serial_rx;
+	ResetEvent(rx.complete);
+	ZeroMemory(&rx.overlapped, sizeof(OVERLAPPED));
+	rx.overlapped.hEvent = rx.complete;
+	rx.issued_us = this->perf_clock.getTimePassedUS();
+	if (!WinUsb_ReadPipe(this->usbh, 0x82, rx.data, sizeof(rx.data), &rx.count, &rx.overlapped) &&
+		GetLastError() != ERROR_IO_PENDING) {
+		return FALSE;
+	}
+	rx.queued = TRUE;
+	return TRUE;
+}
+
+bool Panda::serial_stream_read(std::string out[4], DWORD timeoutms) {
+	auto& rx = this->serial_rx;
+	if (!rx.queued && !this->serial_rx_queue()) return FALSE;
+
+	// Nothing yet is not an error, the read stays queued for the next call
+	if (WaitForSingleObject(rx.complete, timeoutms) != WAIT_OBJECT_0) return TRUE;
+	rx.queued = FALSE;
+	this->perf[PERF_SERIAL_STREAM_READ].record(this->perf_clock.getTimePassedUS() - rx.issued_us);
+	if (!GetOverlappedResult(this->usbh, &rx.overlapped, &rx.count, FALSE)) return FALSE;
+
+	// Each packet is the port number, then data from that port
+	for (unsigned long pkt = 0; pkt < rx.count; pkt += 0x40) {
+		unsigned long pkt_len = min(rx.count - pkt, 0x40);
+		uint8_t port = rx.data[pkt];
+		if (pkt_len > 1 && port < 4)
+			out[port].append((const char *)rx.data + pkt + 1, pkt_len - 1);
+	}
+	return this->serial_rx_queue();
+}
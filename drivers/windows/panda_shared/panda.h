@@ -18,10 +18,17 @@
 #include <memory>
 #include <iostream>
 #include <chrono>
+#include <functional>
+#include <future>
+#include <atomic>
+#include <climits>
 
 #include <windows.h>
 #include <winusb.h>
 
+#include "panda_trace.h"
+#include "panda_perf.h"
+
 #if defined(UNICODE)
 #define _tcout std::wcout
 #define tstring std::wstring
@@ -31,8 +38,63 @@
 #endif
 
 #define LIN_MSG_MAX_LEN 10
-#define CAN_RX_QUEUE_LEN 10000
-#define CAN_RX_MSG_LEN 1000
+//The panda streams multi packet transfers, so each read can drain many
+//messages. Reads end early on a short packet.
+#define CAN_RX_MSG_LEN 4096
+//The ring of EP1 IN read buffers, see set_can_rx_ring. It is allocated when
+//the reads start, not by openPanda. It must have room past the pipeline for
+//the reads that are waiting to be popped.
+#define CAN_RX_QUEUE_LEN 64
+#define CAN_RX_QUEUE_MIN (CAN_RX_PIPELINE_MAX + 2)
+#define CAN_RX_QUEUE_MAX 4096
+#define CAN_RX_BUFF_LEN 0x4000
+//A read is at most CAN_RX_MSG_LEN classic messages.
+#define CAN_RX_BUFF_MAX (16 * CAN_RX_MSG_LEN)
+//WinUSB reads kept queued on EP1 IN, so the pipe never idles between completions.
+#define CAN_RX_PIPELINE_DEFAULT 16
+#define CAN_RX_PIPELINE_MAX 32
+//Auto tuning starts reads at the smallest length and looks at the traffic
+//again every CAN_RX_TUNE_READS completed reads, see set_can_rx_auto_tune.
+#define CAN_RX_READ_MIN 0x1000
+#define CAN_RX_TUNE_READS 256
+//Frames waiting for the async writer, and the most it puts in one USB transfer.
+#define CAN_TX_QUEUE_LEN 4096
+#define CAN_TX_COALESCE_MAX 256
+//Timestamped messages in each 0x40 byte USB packet
+#define PANDA_CAN_MSGS_PER_PACKET 3
+//The most compact records in a packet, see set_can_rx_format
+#define PANDA_CAN_COMPACT_MSGS_PER_PACKET 12
+//The len of a compact record that is a TX completion, see set_can_echo
+#define PANDA_CAN_COMPACT_DONE 0xD
+//How far before the newest a timestamp can be and still not be taken as a wrap, in us
+#define CAN_TIME_LATE_MAX 0x10000000U
+
+//Packets in each read of the serial stream, a port number and up to 63 bytes each.
+#define SERIAL_RX_PACKETS 16
+//EP2 OUT transfers serial_write_async keeps in flight, each of up to
+//SERIAL_TX_XFER_PACKETS packets of the same shape.
+#define SERIAL_TX_XFERS 4
+#define SERIAL_TX_XFER_PACKETS 8
+//serial_write_async calls waiting at once.
+#define SERIAL_TX_WRITES 32
+
+//Slots for messages the panda sends by itself, see set_can_periodic.
+#define PANDA_CAN_PERIODIC_SLOTS 16
+#define PANDA_CAN_PERIODIC_ALL 0xFFFF
+
+//The alt setting with bus 0's CAN tx on a pipe of its own, see set_can_tx_lanes.
+#define PANDA_ALT_CAN_LANES 2
+
+//How often reconnect looks for the panda to come back.
+#define PANDA_RECONNECT_POLL_MS 20
+
+//Most callbacks subscribed at once, see can_subscribe.
+#define PANDA_CAN_SUBSCRIBERS_MAX 64
+
+//How old the health get_health_cached returns can be, see set_health_max_age.
+#define PANDA_HEALTH_MAX_AGE_MS 500
+//The background refresh stops once get_health_cached isn't called for this long.
+#define PANDA_HEALTH_IDLE_MS 5000
 
 //template class __declspec(dllexport) std::basic_string<char>;
 
@@ -60,6 +122,7 @@ namespace panda {
 		PANDA_CAN1 = 0,
 		PANDA_CAN2 = 1,
 		PANDA_CAN3 = 2,
+		PANDA_CAN_GAP = 0xFE, //Not a frame, the panda was reconnected, see set_auto_reconnect
 		PANDA_CAN_UNK = 0xFF,
 	} PANDA_CAN_PORT;
 
@@ -70,6 +133,42 @@ namespace panda {
 		PANDA_CAN_RX = 0xFFFF,
 	} PANDA_CAN_PORT_CLEAR;
 
+	typedef enum _PANDA_CAN_FORMAT : uint8_t {
+		PANDA_CAN_FORMAT_CLASSIC = 0, //Fixed 0x14 byte records
+		PANDA_CAN_FORMAT_COMPACT = 1, //Variable length records, with only the data bytes the frame has
+	} PANDA_CAN_FORMAT;
+
+	//What a bus sends back for the frames it sent, see set_can_echo
+	typedef enum _PANDA_CAN_ECHO : uint8_t {
+		PANDA_CAN_ECHO_FULL = 0, //The whole frame, is_receipt set
+		PANDA_CAN_ECHO_TOKEN = 1, //A completion with only the frame's tx_token
+		PANDA_CAN_ECHO_NONE = 2,
+	} PANDA_CAN_ECHO;
+
+	//Firmware replay, see board/drivers/can_replay.h
+	typedef enum _PANDA_CAN_REPLAY_OP : uint16_t {
+		PANDA_CAN_REPLAY_READ = 0,
+		PANDA_CAN_REPLAY_LOAD = 1, //Frames on EP3 go into the replay ring
+		PANDA_CAN_REPLAY_PLAY = 2,
+		PANDA_CAN_REPLAY_STOP = 3,
+	} PANDA_CAN_REPLAY_OP;
+
+	typedef enum _PANDA_CAN_REPLAY_STATE : uint32_t {
+		PANDA_CAN_REPLAY_OFF = 0,
+		PANDA_CAN_REPLAY_LOADING = 1,
+		PANDA_CAN_REPLAY_PLAYING = 2,
+	} PANDA_CAN_REPLAY_STATE;
+
+	//What apply_config sets, each bit on or off
+	typedef enum _PANDA_CONFIG : uint16_t {
+		PANDA_CONFIG_ESP_POWER = 1,
+		PANDA_CONFIG_LOOPBACK = 2,
+		PANDA_CONFIG_TX_IN_ORDER = 4,
+		PANDA_CONFIG_TIMESTAMPS = 8,
+		PANDA_CONFIG_CLEAR_PERIODIC = 0x10, //Stops every periodic slot
+		PANDA_CONFIG_CLEAR_RX = 0x20, //Drops what the panda has received
+	} PANDA_CONFIG;
+
 	typedef enum _PANDA_GMLAN_HOST_PORT : uint8_t {
 		PANDA_GMLAN_CLEAR = 0,
 		PANDA_GMLAN_CAN2 = 1,
@@ -85,19 +184,135 @@ namespace panda {
 		uint8_t gas_interceptor_detected;
 		uint8_t started_signal_detected;
 		uint8_t started_alt;
+		//Zero from firmware older than the extended packet.
+		uint8_t version;
+		uint64_t uptime_us;
+		uint16_t rx_q_depth; //All RX queues
+		uint16_t rx_q_hwm; //The fullest RX queue's
+		uint16_t tx_q_depth[4];
+		uint16_t tx_q_hwm[4];
+		uint32_t rx_drop_cnt; //Summed over the buses
+		uint32_t tx_drop_cnt;
+		uint32_t usb_pause_cnt; //EP2 or EP3 held off by full rings
+		uint32_t usb_nak_cnt; //OUT tokens NAKed on EP3
+		//Since the last get_health(true), in us, saturating at 0xFFFF.
+		uint16_t main_loop_lag_max;
+		uint16_t irq_latency_max;
+		uint16_t idle; //Per mille of the same window
 	} PANDA_HEALTH, *PPANDA_HEALTH;
 
+	typedef struct _PANDA_CAN_STATS {
+		uint32_t rx_cnt;
+		uint32_t tx_cnt;
+		uint32_t txd_cnt; //Sent and echoed
+		uint32_t rx_drop_cnt;
+		uint32_t tx_drop_cnt;
+		uint32_t err_cnt;
+		uint32_t rx_q_hwm; //Of this bus's RX queue
+		uint32_t tx_q_hwm;
+		uint16_t load; //Per mille since the last read
+		uint8_t tec;
+		uint8_t rec;
+		uint8_t lec;
+		uint8_t bus_off;
+		//Zero from older firmware
+		uint32_t rx_suppressed_cnt; //Held back by the report rules
+		uint32_t tx_fail_cnt; //One-shot, tried once and not sent, see set_can_one_shot
+		uint32_t tx_arb_lost_cnt;
+		uint32_t tx_err_cnt;
+	} PANDA_CAN_STATS, *PPANDA_CAN_STATS;
+
+	typedef struct _PANDA_CAN_REPLAY_STATUS {
+		uint32_t state; //PANDA_CAN_REPLAY_STATE
+		uint32_t queued; //On the panda, not sent yet
+		uint32_t sent;
+		uint32_t late_max_us; //Most a frame went after its time
+		uint32_t dropped;
+	} PANDA_CAN_REPLAY_STATUS;
+
+	//The firmware's CAN inits and ESP resets, done by its main loop after the
+	//request was acked. See get_deferred_status.
+	typedef struct _PANDA_DEFERRED_STATUS {
+		uint32_t queued;
+		uint32_t done; //queued as of the last run that left nothing pending
+		uint32_t pending; //Bit n for CAN n, 0x100 for an ESP reset
+		uint32_t runs;
+		uint32_t max_us; //Longest a run held off USB
+		//Of the CANs, since boot. Only a CAN never set up needs a full init, the
+		//rest have just the changed one held in init mode. Zero from older firmware.
+		uint32_t can_inits;
+		uint32_t can_reconfigs;
+		uint32_t can_unchanged; //Already as configured, left running
+		uint32_t can_timeouts;
+	} PANDA_DEFERRED_STATUS;
+
+	//When the panda answers EP1 IN with what it received, see set_can_rx_flush.
+	typedef struct _PANDA_RX_FLUSH_STATUS {
+		uint16_t fill; //| PANDA_RX_FLUSH_SOF
+		uint16_t reserved;
+		uint32_t deadline_us;
+		//Since it was set
+		uint32_t transfers; //Answered with frames
+		uint32_t bytes;
+		uint32_t held; //INs answered empty while frames waited
+		uint32_t age_max_us; //Most a frame waited for its transfer
+	} PANDA_RX_FLUSH_STATUS;
+	#define PANDA_RX_FLUSH_SOF 0x8000
+
+	//How EP1 IN is read, see get_usb_profile.
+	typedef struct _PANDA_USB_PROFILE {
+		bool raw_io;
+		bool auto_tune;
+		uint16_t max_packet; //EP1 IN's
+		uint32_t max_transfer; //WinUSB's MAXIMUM_TRANSFER_SIZE of EP1 IN, 0 if it didn't say
+		uint32_t read_len; //Of each overlapped read
+		uint32_t read_len_max; //The longest read the buffers and WinUSB allow
+		uint32_t pipeline_depth;
+		uint32_t ring_len; //Read buffers, 0 until the reads start
+		uint32_t ring_buff_len; //Bytes of each
+		uint32_t ring_memory; //The PANDA_RX_MEMORY flags it got
+	} PANDA_USB_PROFILE;
+
+	//How the read buffers are allocated, see set_can_rx_ring. Each falls back
+	//to regular pages if the process can't have it.
+	typedef enum _PANDA_RX_MEMORY {
+		PANDA_RX_MEMORY_DEFAULT = 0,
+		PANDA_RX_MEMORY_LARGE_PAGES = 1, //Needs SeLockMemoryPrivilege
+		PANDA_RX_MEMORY_LOCKED = 2, //VirtualLock'd, needs the working set to fit it
+	} PANDA_RX_MEMORY;
+
 	typedef struct _PANDA_CAN_MSG {
 		uint32_t addr;
-		unsigned long long recv_time; //In microseconds since device initialization
+		unsigned long long recv_time; //In microseconds, latched by the panda when the frame was received or sent
 		std::chrono::time_point<std::chrono::steady_clock> recv_time_point;
 		uint8_t dat[8];
 		uint8_t len;
 		PANDA_CAN_PORT bus;
 		bool is_receipt;
 		bool addr_29b;
+		bool is_completion; //No addr or data, tx_token is the frame that was sent
+		uint16_t tx_token;
+		bool tx_failed; //Of a completion, the one-shot frame wasn't sent
+		bool tx_arb_lost; //And lost arbitration
 	} PANDA_CAN_MSG;
 
+	//A frame is received if (addr & mask) == (filter addr & mask).
+	typedef struct _PANDA_CAN_FILTER {
+		uint32_t addr;
+		uint32_t mask;
+		bool addr_29b;
+	} PANDA_CAN_FILTER;
+
+	typedef std::function<void(const PANDA_CAN_MSG&)> PANDA_CAN_CALLBACK;
+	//Of control_transfer_async: the bytes transferred or -1 if it failed, and
+	//what was read, good for the call.
+	typedef std::function<void(int len, const uint8_t *data)> PANDA_CONTROL_CALLBACK;
+	//Of serial_write_async: the bytes sent, or -1 if a transfer failed.
+	typedef std::function<void(int len)> PANDA_SERIAL_CALLBACK;
+	//Of set_can_tx_failed_callback: the sequence numbers, first to last, of the
+	//frames of an async transfer that failed.
+	typedef std::function<void(unsigned long long first, unsigned long long last)> PANDA_CAN_TX_FAILED_CALLBACK;
+
 	//Copied from https://stackoverflow.com/a/31488113
 	class Timer
 	{
@@ -131,19 +346,59 @@ namespace panda {
 	};
 
 	// This class is exported from the panda.dll
+	class PandaGroup;
+	class IoStrand;
+
 	class PANDA_API Panda {
+		friend class PandaGroup;
 	public:
 		static std::vector<std::string> listAvailablePandas();
 		static std::unique_ptr<Panda> openPanda(std::string sn);
+		//Opens them all at once, each open waits on its own panda. The
+		//result is in the order of sns, nullptr where one didn't open.
+		static std::vector<std::unique_ptr<Panda>> openPandas(const std::vector<std::string>& sns);
 
 		~Panda();
 
 		std::string get_usb_sn();
 		bool set_alt_setting(UCHAR alt_setting);
 		UCHAR get_current_alt_setting();
+		//Alt setting 2, the sync sends put bus 0 on pipe 1 and the other buses on pipe 3.
+		//The panda holds a pipe off while a tx queue of its buses is full instead of
+		//dropping, so a backed up bus only holds up its own pipe. Async sends stay on 3.
+		bool set_can_tx_lanes(bool enable);
 		bool Panda::set_raw_io(bool val);
 
-		PANDA_HEALTH get_health();
+		//reset starts a new window for the maxes and idle, plain reads leave it running.
+		PANDA_HEALTH get_health(bool reset = false);
+		//get_health without waiting on it, so a poller doesn't hold up CAN I/O
+		//issued from the same thread.
+		std::future<PANDA_HEALTH> get_health_async();
+		//The health of the last read, at most the max age old. While it's called a
+		//thread pool timer reads it again every half of that, so only the first call,
+		//or one after the refresh fell behind, waits on USB.
+		PANDA_HEALTH get_health_cached();
+		//0 makes get_health_cached read it each call.
+		void set_health_max_age(DWORD max_age_ms);
+		DWORD get_health_max_age();
+		//Vendor control transfer that returns once it's queued. done runs on a
+		//thread pool thread when it completes, never before this returns. OUT data
+		//is copied. FALSE, and done doesn't run, if it couldn't be queued.
+		bool control_transfer_async(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+			const void *data, uint16_t wLength, PANDA_CONTROL_CALLBACK done);
+		//Bitrate, safety mode, loopback and TX order changes and ESP resets are
+		//acked before the panda has done them. FALSE from firmware without 0xce.
+		bool get_deferred_status(PANDA_DEFERRED_STATUS& status);
+		//Waits for those requested so far to be done, TRUE at once from firmware
+		//that does them before the ack.
+		bool wait_deferred(DWORD timeoutms = 1000);
+		bool get_can_stats(PANDA_CAN_PORT bus, PANDA_CAN_STATS& stats);
+		//The panda's 32 bit microsecond timer, the time base of CAN timestamps.
+		bool get_time(uint32_t& time);
+		//Latency histograms of the USB transfers since open or reset_perf_stats,
+		//by PANDA_PERF_POINT.
+		PANDA_PERF_STATS get_perf_stats();
+		void reset_perf_stats();
 		bool enter_bootloader();
 		std::string get_version();
 		std::string get_serial();
@@ -156,6 +411,33 @@ namespace panda {
 		bool set_can_forwarding(PANDA_CAN_PORT from_bus, PANDA_CAN_PORT to_bus);
 		bool set_gmlan(PANDA_GMLAN_HOST_PORT bus);
 		bool set_can_loopback(bool enable);
+		bool set_can_tx_in_order(bool enable);
+		bool set_can_filters(PANDA_CAN_PORT bus, const std::vector<PANDA_CAN_FILTER>& filters);
+		bool set_can_timestamps(bool enable);
+		//The safety mode and the PANDA_CONFIG bits in one request, or one by one
+		//from firmware that doesn't know it.
+		bool apply_config(PANDA_SAFETY_MODE mode, uint16_t config);
+		//The record format of received CAN messages. Compact records always carry the
+		//timestamp. Returns false and keeps the classic format if the panda doesn't know it.
+		bool set_can_rx_format(PANDA_CAN_FORMAT format);
+		//When the panda answers EP1 IN with what it received. All 0 is at once, the
+		//lowest latency. fill holds frames until that many are queued, deadline_us
+		//until the oldest has waited that long, whichever is first, and sof has at
+		//most one IN a ms answered. Fewer, fuller reads for loggers. The panda goes
+		//back to at once when it enumerates again, reconnect sets it again.
+		bool set_can_rx_flush(uint16_t fill, uint16_t deadline_us, bool sof = FALSE);
+		bool get_can_rx_flush_status(PANDA_RX_FLUSH_STATUS& status);
+		//Frames sent on a bus each take its next token, 10 bits that wrap, in the
+		//order can_send gave them. next_token may be NULL.
+		bool set_can_echo(PANDA_CAN_PORT bus, PANDA_CAN_ECHO mode, uint16_t *next_token);
+		//A frame that loses arbitration or hits an error isn't sent again. One with a
+		//token comes back as a completion with tx_failed set, unless the mode is NONE.
+		bool set_can_one_shot(PANDA_CAN_PORT bus, bool enable);
+		//The panda sends what's queued on the bus by arbitration id, urgent frames first,
+		//instead of in order. Drops what's queued.
+		bool set_can_tx_priority(PANDA_CAN_PORT bus, bool enable);
+		bool set_can_periodic(uint8_t slot, uint32_t addr, bool addr_29b, const uint8_t *dat, uint8_t len, PANDA_CAN_PORT bus, uint16_t period_ms);
+		bool clear_can_periodic(uint16_t slot);
 		bool set_can_speed_cbps(PANDA_CAN_PORT bus, uint16_t speed);
 		bool set_can_speed_kbps(PANDA_CAN_PORT bus, uint16_t speed);
 		bool set_uart_baud(PANDA_SERIAL_PORT uart, uint32_t rate);
@@ -163,14 +445,105 @@ namespace panda {
 
 		bool can_send_many(const std::vector<PANDA_CAN_MSG>& can_msgs);
 		bool can_send(uint32_t addr, bool addr_29b, const uint8_t *dat, uint8_t len, PANDA_CAN_PORT bus);
+		//Same as can_send, marked urgent. A bus set_can_tx_priority has switched sends it ahead
+		//of everything it has queued, others send it in order.
+		bool can_send_urgent(uint32_t addr, bool addr_29b, const uint8_t *dat, uint8_t len, PANDA_CAN_PORT bus);
+		//Queues the frame for a writer thread that sends everything pending in one USB transfer.
+		//Returns the frame's sequence number for can_tx_wait, or 0 if the queue is full.
+		unsigned long long can_send_async(uint32_t addr, bool addr_29b, const uint8_t *dat, uint8_t len, PANDA_CAN_PORT bus);
+		//Queues all the frames together, so they go out in the same transfer up to CAN_TX_COALESCE_MAX.
+		//Returns the last frame's sequence number, or 0 if they don't all fit. Nothing is queued then.
+		unsigned long long can_send_async_many(const std::vector<PANDA_CAN_MSG>& can_msgs);
+		//Waits until the transfer holding frame seq has completed.
+		bool can_tx_wait(unsigned long long seq, DWORD timeoutms = INFINITE);
+		//Frames from async transfers that failed.
+		unsigned long long can_tx_errors();
+		//Called on the writer thread when an async transfer fails, so the sender can
+		//give up on those frames instead of waiting for echoes that won't come.
+		void set_can_tx_failed_callback(PANDA_CAN_TX_FAILED_CALLBACK cb);
 		std::vector<PANDA_CAN_MSG> can_recv();
+		//Same as can_recv, but decodes into a buffer owned by the caller without allocating.
+		//cap is rounded down to whole USB packets of PANDA_CAN_MSGS_PER_PACKET messages,
+		//or PANDA_CAN_COMPACT_MSGS_PER_PACKET with compact records.
+		size_t can_recv_into(PANDA_CAN_MSG* out, size_t cap);
 		bool can_rx_q_push(HANDLE kill_event, DWORD timeoutms = INFINITE);
+		//Reads the panda on strand, see io_engine.h, instead of with can_rx_q_push
+		//on a thread of its own. filled runs on the strand as reads complete, and
+		//must pop everything with can_rx_q_pop_into before it returns. With auto
+		//reconnect the panda is looked for on the strand every
+		//PANDA_RECONNECT_POLL_MS once it drops off. Returns false if already started.
+		bool can_rx_q_start(std::shared_ptr<IoStrand> strand, std::function<void()> filled);
+		//Cancels the reads. After the strand is closed.
+		void can_rx_q_stop();
+		//When the panda drops off USB, can_rx_q_push waits for it to come back
+		//instead of returning, reconnects, and queues a message with bus
+		//PANDA_CAN_GAP before the first frame after. Frames in between are lost.
+		//Its recv_time carries on from the last frame's, plus the time the panda
+		//was gone.
+		void set_auto_reconnect(bool enable);
+		//Waits for a panda with this one's serial to show up, opens it in place of
+		//the old handle and sets again the safety mode, CAN speeds, filters,
+		//loopback, TX order, timestamps and rx format last set. Returns FALSE on
+		//timeout or once kill_event is set.
+		bool reconnect(HANDLE kill_event = NULL, DWORD timeoutms = INFINITE);
+		//Number of reads can_rx_q_push keeps queued, 1 to CAN_RX_PIPELINE_MAX.
+		//Takes effect as reads complete. Turns auto tuning off.
+		void set_can_rx_pipeline_depth(unsigned int depth);
+		//On by default. Reads get longer while they come back full and the
+		//pipeline deeper once they are as long as they go, and both come back
+		//down when the traffic does. Off, reads are read_len_max long.
+		void set_can_rx_auto_tune(bool enable);
+		PANDA_USB_PROFILE get_usb_profile();
+		//len read buffers of buff_len bytes each, rounded down to whole packets, with
+		//memory flags of PANDA_RX_MEMORY. Taken the next time the reads start.
+		//Returns false while they are running, or with a size out of range.
+		bool set_can_rx_ring(unsigned long len, unsigned long buff_len = CAN_RX_BUFF_LEN, uint32_t memory = PANDA_RX_MEMORY_DEFAULT);
 		void can_rx_q_pop(PANDA_CAN_MSG msg_out[], int &count);
+		//Decodes at most cap messages straight from the overlapped read buffers.
+		//Whatever doesn't fit is returned by the next call. Waits up to timeoutms
+		//for a read to complete, or until kill_event is set.
+		size_t can_rx_q_pop_into(PANDA_CAN_MSG* out, size_t cap, HANDLE kill_event = NULL, DWORD timeoutms = 0);
 		bool can_clear(PANDA_CAN_PORT_CLEAR bus);
+		//Calls cb with each frame on bus, or on any bus for PANDA_CAN_UNK, that matches
+		//filter, and with the frames the panda sent too if receipts. Callbacks run on
+		//the dispatch thread one at a time, in the order the frames came, and all get
+		//the same decoded frame. Returns the subscription, or -1 once
+		//PANDA_CAN_SUBSCRIBERS_MAX are taken.
+		int can_subscribe(PANDA_CAN_PORT bus, const PANDA_CAN_FILTER& filter, PANDA_CAN_CALLBACK cb, bool receipts = false);
+		//Once it returns the callback isn't running and won't be called again. A
+		//callback can unsubscribe, itself included.
+		bool can_unsubscribe(int sub);
+		//Reads the panda and calls the subscribers, from two threads of its own, until
+		//can_dispatch_stop. Frames no subscriber wants are dropped before they are
+		//decoded. The reads are the dispatch thread's meanwhile, so can_rx_q_push
+		//and can_rx_q_pop_into must not be used. Returns false if already started.
+		bool can_dispatch_start();
+		//Not from a callback.
+		void can_dispatch_stop();
+		//Does op, then reads the replay status. USB only.
+		bool can_replay_status(PANDA_CAN_REPLAY_STATUS& status, PANDA_CAN_REPLAY_OP op = PANDA_CAN_REPLAY_READ);
+		//While loading or playing, queues the frames to go at their recv_time, the
+		//first recv_time - prev_time after the one loaded before. prev_time is
+		//left at the last one's. Blocks while the panda's ring is full.
+		bool can_replay_load(const PANDA_CAN_MSG* msgs, size_t count, unsigned long long& prev_time);
 
 		std::string serial_read(PANDA_SERIAL_PORT port_number);
+		//Waits on serial_write_async.
 		int serial_write(PANDA_SERIAL_PORT port_number, const void* buff, uint16_t len);
+		//Sends buff in transfers of packets with the port number and 63 bytes each,
+		//SERIAL_TX_XFERS of them in flight so the UART never waits on the host.
+		//buff is read in place and must stay good until done runs. Writes go out
+		//and complete in the order queued, done runs for one at a time on a thread
+		//pool thread, never before this returns. FALSE, and done doesn't run, with
+		//SERIAL_TX_WRITES waiting already.
+		bool serial_write_async(PANDA_SERIAL_PORT port_number, const void* buff, size_t len, PANDA_SERIAL_CALLBACK done);
 		bool serial_clear(PANDA_SERIAL_PORT port_number);
+		//Streams the rx of the ports on EP2 IN as it arrives, instead of waiting for serial_read.
+		//Bit n for port n, only SERIAL_ESP, SERIAL_LIN1 and SERIAL_LIN2 can stream. 0 stops it.
+		bool set_serial_stream(uint8_t port_mask);
+		//Waits up to timeoutms for streamed data and appends it to out, indexed by port.
+		//A read stays queued between calls, so the stream keeps flowing while the caller works.
+		bool serial_stream_read(std::string out[4], DWORD timeoutms = INFINITE);
 	private:
 		Panda(
 			WINUSB_INTERFACE_HANDLE WinusbHandle,
@@ -189,6 +562,25 @@ namespace panda {
 			unsigned int timeout
 		);
 
+		//One control_transfer_async in flight, freed by its completion.
+		struct CONTROL_ASYNC {
+			Panda *panda;
+			WINUSB_INTERFACE_HANDLE usbh; //Kept by dead_handles across a reconnect
+			OVERLAPPED overlapped;
+			HANDLE event;
+			bool in;
+			std::vector<uint8_t> data;
+			PANDA_CONTROL_CALLBACK done;
+			unsigned long long start_us;
+		};
+		static VOID CALLBACK control_async_completed(PTP_CALLBACK_INSTANCE instance, PVOID context,
+			PTP_WAIT wait, TP_WAIT_RESULT result);
+
+		static VOID CALLBACK health_timer_fired(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_TIMER timer);
+		void health_store(const PANDA_HEALTH& health);
+		//With health_lock held.
+		void health_timer_set(bool on);
+
 		int bulk_write(
 			UCHAR endpoint,
 			const void * buff,
@@ -212,15 +604,137 @@ namespace panda {
 			uint8_t dat[8];
 		} PANDA_CAN_MSG_INTERNAL;
 
+		//Sent instead when timestamps are enabled, 3 to a 0x40 byte packet.
+		typedef struct _PANDA_CAN_MSG_TS_INTERNAL {
+			PANDA_CAN_MSG_INTERNAL msg;
+			uint32_t timestamp;
+		} PANDA_CAN_MSG_TS_INTERNAL;
+
 		typedef struct _CAN_RX_PIPE_READ {
-			unsigned char data[sizeof(PANDA_CAN_MSG_INTERNAL) * CAN_RX_MSG_LEN];
+			unsigned char *data; //can_rx_buff_len bytes in can_rx_mem
 			unsigned long count;
 			OVERLAPPED overlapped;
 			HANDLE complete;
 			DWORD error;
+			unsigned long len; //Asked for
+			unsigned long long issued_us; //On perf_clock
+			//The first read after a reconnect, with how long the panda was gone and its timer after
+			bool gap;
+			bool gap_dev_time_known;
+			uint32_t gap_dev_time;
+			unsigned long long gap_us;
 		} CAN_RX_PIPE_READ;
 
-		PANDA_CAN_MSG parse_can_recv(PANDA_CAN_MSG_INTERNAL *in_msg_raw);
+		//A serial_write_async call, in serial_tx_writes until done has run.
+		typedef struct _SERIAL_TX_WRITE {
+			PANDA_SERIAL_PORT port;
+			const uint8_t *data;
+			size_t len;
+			size_t taken; //Copied into transfers
+			size_t sent;
+			unsigned int xfers; //In flight
+			bool failed;
+			PANDA_SERIAL_CALLBACK done;
+		} SERIAL_TX_WRITE;
+
+		//Set up with the panda and reused, nothing is allocated per write.
+		typedef struct _SERIAL_TX_XFER {
+			Panda *panda;
+			WINUSB_INTERFACE_HANDLE usbh; //Kept by dead_handles across a reconnect
+			unsigned char data[0x40 * SERIAL_TX_XFER_PACKETS];
+			unsigned long len;
+			size_t payload; //Of the write, without the port numbers
+			unsigned long write; //In serial_tx_writes
+			OVERLAPPED overlapped;
+			HANDLE event;
+			PTP_WAIT wait;
+			bool busy;
+			bool error; //Didn't queue, the wait was set off by hand
+			unsigned long long issued_us;
+		} SERIAL_TX_XFER;
+		static VOID CALLBACK serial_tx_completed(PTP_CALLBACK_INSTANCE instance, PVOID context,
+			PTP_WAIT wait, TP_WAIT_RESULT result);
+		void serial_tx_pump();
+		void serial_tx_finish();
+
+		typedef struct _SERIAL_RX_READ {
+			unsigned char data[0x40 * SERIAL_RX_PACKETS];
+			unsigned long count;
+			OVERLAPPED overlapped;
+			HANDLE complete;
+			bool queued;
+			unsigned long long issued_us;
+		} SERIAL_RX_READ;
+
+		static bool open_handles(const tstring& devpath, HANDLE& devh, WINUSB_INTERFACE_HANDLE& usbh);
+		void restore_settings();
+		bool can_rx_reconnect(HANDLE kill_event);
+		void can_rx_gap_note(unsigned long long gone_us);
+		void can_rx_q_done(CAN_RX_PIPE_READ& rx);
+		void can_rx_async_completed(OVERLAPPED *overlapped);
+		void can_rx_async_pump();
+		void can_rx_async_reconnect();
+		unsigned long long can_rx_gap_rebase(const CAN_RX_PIPE_READ& rx);
+		void can_rx_q_issue();
+		void can_rx_pipe_setup();
+		void can_rx_tune(const CAN_RX_PIPE_READ& rx);
+		void can_rx_q_abort();
+		bool can_rx_q_alloc();
+		void can_rx_q_free();
+		bool serial_rx_queue();
+
+		static void pack_can_msg(PANDA_CAN_MSG_INTERNAL& out, uint32_t addr, bool addr_29b, const uint8_t *dat, uint8_t len, PANDA_CAN_PORT bus);
+		//The pipe a sync send to the bus goes on.
+		UCHAR can_tx_pipe(PANDA_CAN_PORT bus);
+
+		static DWORD WINAPI _can_tx_threadBootstrap(LPVOID This) {
+			return ((Panda*)This)->can_tx_thread();
+		}
+		DWORD can_tx_thread();
+
+		void parse_can_recv(const PANDA_CAN_MSG_TS_INTERNAL *in_msg_raw, PANDA_CAN_MSG& in_msg,
+			std::chrono::time_point<std::chrono::steady_clock> recv_time_point);
+		void parse_can_recv_batch(const unsigned char *buff, size_t count, PANDA_CAN_MSG msg_out[],
+			std::chrono::time_point<std::chrono::steady_clock> recv_time_point);
+		size_t parse_can_recv_buff(const unsigned char *buff, unsigned long len, PANDA_CAN_MSG msg_out[],
+			size_t cap, unsigned long *consumed);
+		static unsigned long can_compact_rec_len(const unsigned char *rec, unsigned long len);
+		static size_t can_compact_pkt_count(const unsigned char *pkt, unsigned long len);
+		void parse_can_recv_compact(const unsigned char *rec, uint32_t& ts_base, bool first, PANDA_CAN_MSG& in_msg,
+			std::chrono::time_point<std::chrono::steady_clock> recv_time_point);
+		unsigned long long unwrap_device_time(uint32_t ts);
+		void perf_dequeue(unsigned long long now_us, unsigned long long dev_us);
+
+		//What matching a frame to the subscribers needs, read from its record without decoding the rest.
+		typedef struct _can_rec_key {
+			uint32_t addr;
+			uint32_t ts;
+			PANDA_CAN_PORT bus;
+			bool addr_29b;
+			bool receipt;
+		} can_rec_key;
+
+		typedef struct _can_subscriber {
+			PANDA_CAN_PORT bus;
+			PANDA_CAN_FILTER filter;
+			bool receipts = FALSE;
+			bool used = FALSE;
+			bool dying = FALSE; //Unsubscribed by a callback, the slot is freed after the read
+			PANDA_CAN_CALLBACK cb;
+		} can_subscriber;
+
+		static void can_rec_key_read(const unsigned char *rec, bool compact, uint32_t& ts_base, bool first, can_rec_key& key);
+		static bool can_sub_wants(const can_subscriber& sub, uint32_t addr, bool addr_29b, PANDA_CAN_PORT bus, bool receipt);
+		uint64_t can_sub_match(const can_rec_key& key);
+		void can_sub_index(int sub, bool on);
+		void can_dispatch_buff(const unsigned char *buff, unsigned long len);
+		static DWORD WINAPI _can_dispatch_threadBootstrap(LPVOID This) {
+			return ((Panda*)This)->can_dispatch_thread();
+		}
+		DWORD can_dispatch_thread();
+		static DWORD WINAPI _can_dispatch_rx_threadBootstrap(LPVOID This) {
+			return ((Panda*)This)->can_rx_q_push(((Panda*)This)->can_dispatch_kill);
+		}
 
 		WINUSB_INTERFACE_HANDLE usbh;
 		HANDLE devh;
@@ -228,10 +742,128 @@ namespace panda {
 		std::string sn;
 		bool loopback;
 
-		Timer runningTime;
-		CAN_RX_PIPE_READ can_rx_q[CAN_RX_QUEUE_LEN];
-		unsigned long w_ptr = 0;
+		//Set again on the new handle by reconnect
+		bool raw_io = TRUE;
+		UCHAR alt_setting = 0;
+		bool safety_mode_set = FALSE;
+		PANDA_SAFETY_MODE safety_mode = SAFETY_NOOUTPUT;
+		bool tx_in_order_set = FALSE;
+		bool tx_in_order = FALSE;
+		bool timestamps = TRUE;
+		uint16_t can_speed_cbps[3] = {}; //0 until set
+		bool can_filters_set[3] = {};
+		std::vector<PANDA_CAN_FILTER> can_filters[3];
+		//The handles of before a reconnect, another thread can still be in a call on them.
+		std::vector<std::pair<WINUSB_INTERFACE_HANDLE, HANDLE>> dead_handles;
+		bool auto_reconnect = FALSE;
+		//Copied into the next completed read
+		bool can_rx_gap_pending = FALSE;
+		bool can_rx_gap_dev_time_known = FALSE;
+		uint32_t can_rx_gap_dev_time = 0;
+		unsigned long long can_rx_gap_us = 0;
+		//Of can_rx_q_start, the reads are the strand's while it's set
+		std::shared_ptr<IoStrand> can_rx_strand;
+		std::function<void()> can_rx_filled;
+		unsigned long long can_rx_gone_us = 0; //perf_clock when it dropped off
+
+		//control_transfer_async's in flight, the destructor waits for none.
+		CRITICAL_SECTION control_async_lock;
+		CONDITION_VARIABLE control_async_idle;
+		unsigned int control_async_out = 0;
+
+		//Of get_health_cached, the timer runs from the first call until it's idle.
+		SRWLOCK health_lock;
+		PANDA_HEALTH health_cache;
+		bool health_valid = FALSE;
+		unsigned long long health_at_us = 0; //perf_clock
+		unsigned long long health_asked_us = 0;
+		DWORD health_max_age_ms = PANDA_HEALTH_MAX_AGE_MS;
+		bool health_timer_on = FALSE;
+		PTP_TIMER health_timer = NULL;
+		std::atomic<bool> health_refreshing{ false }; //A read of the timer's is in flight
+
+		uint32_t last_device_time = 0;
+		bool device_time_seen = false;
+		unsigned long long device_time_base = 0; //Extends the 32 bit panda timestamp
+		PANDA_CAN_FORMAT can_rx_format = PANDA_CAN_FORMAT_CLASSIC;
+		uint16_t can_rx_flush_fill = 0; //| PANDA_RX_FLUSH_SOF
+		uint16_t can_rx_flush_deadline_us = 0;
+		//can_rx_q_len slots, nullptr until the reads first start
+		CAN_RX_PIPE_READ *can_rx_q = nullptr;
+		unsigned long can_rx_q_len = 0;
+		void *can_rx_mem = NULL; //The buffers of all the slots, from VirtualAlloc
+		SIZE_T can_rx_mem_len = 0;
+		uint32_t can_rx_mem_got = PANDA_RX_MEMORY_DEFAULT;
+		//Of set_can_rx_ring, for the next allocation
+		unsigned long can_rx_ring_len = CAN_RX_QUEUE_LEN;
+		unsigned long can_rx_buff_len = CAN_RX_BUFF_LEN;
+		uint32_t can_rx_ring_memory = PANDA_RX_MEMORY_DEFAULT;
+		unsigned long w_ptr = 0; //Oldest outstanding read
+		unsigned long issue_ptr = 0; //Next slot to queue a read in
 		unsigned long r_ptr = 0;
+		unsigned int can_rx_pipeline_depth = CAN_RX_PIPELINE_DEFAULT;
+		//Found by can_rx_pipe_setup, RAW_IO reads must be whole packets and
+		//no longer than MAXIMUM_TRANSFER_SIZE.
+		uint16_t usb_max_packet = 0x40;
+		ULONG usb_max_transfer = 0;
+		unsigned long can_rx_read_len_max = CAN_RX_BUFF_LEN;
+		unsigned long can_rx_read_len_min = CAN_RX_READ_MIN;
+		unsigned long can_rx_read_len = CAN_RX_BUFF_LEN;
+		bool can_rx_auto_tune = TRUE;
+		//Of the reads since the last tuning
+		unsigned int can_rx_tune_reads = 0;
+		unsigned int can_rx_tune_full = 0;
+		unsigned long can_rx_tune_longest = 0;
+		HANDLE can_rx_q_filled; //Set when w_ptr moves
+		HANDLE can_rx_q_drained; //Set when r_ptr moves
+		unsigned long r_offset = 0; //Bytes of can_rx_q[r_ptr] already popped
+		unsigned char can_recv_buff[sizeof(PANDA_CAN_MSG_INTERNAL) * CAN_RX_MSG_LEN];
+
+		//Sequence numbers, frame n lives in can_tx_q[n % CAN_TX_QUEUE_LEN] until taken.
+		PANDA_CAN_MSG_INTERNAL can_tx_q[CAN_TX_QUEUE_LEN];
+		PANDA_CAN_MSG_INTERNAL can_tx_buff[CAN_TX_COALESCE_MAX];
+		unsigned long long can_tx_queued = 0; //Last queued frame
+		unsigned long long can_tx_taken = 0; //Last frame copied into can_tx_buff
+		unsigned long long can_tx_done = 0; //Last frame whose transfer completed
+		unsigned long long can_tx_failed = 0;
+		PANDA_CAN_TX_FAILED_CALLBACK can_tx_failed_cb; //Called without can_tx_lock
+		bool can_tx_stop = FALSE;
+		CRITICAL_SECTION can_tx_lock;
+		CONDITION_VARIABLE can_tx_pending;
+		CONDITION_VARIABLE can_tx_completed;
+		HANDLE can_tx_thread_handle = NULL;
+
+		//Subscriptions, matched and called on the dispatch thread. A thread changing
+		//the slots takes can_sub_lock, which the dispatch thread holds over each read.
+		can_subscriber can_subs[PANDA_CAN_SUBSCRIBERS_MAX];
+		uint64_t can_sub_exact[4][2048] = {}; //Subscribers of each 11 bit id, by bus, the last row for the other buses
+		uint64_t can_sub_masked = 0; //The rest, checked one by one
+		uint64_t can_sub_receipts = 0;
+		CRITICAL_SECTION can_sub_lock;
+		HANDLE can_dispatch_kill = NULL;
+		HANDLE can_dispatch_rx_thread_handle = NULL; //Runs can_rx_q_push
+		HANDLE can_dispatch_thread_handle = NULL;
+		std::atomic<DWORD> can_dispatch_thread_id{ 0 }; //Set by the thread itself
+
+		SERIAL_RX_READ serial_rx;
+		//serial_write_async's writes, oldest at serial_tx_head, and the transfers
+		//carrying them. Guarded by serial_tx_lock.
+		CRITICAL_SECTION serial_tx_lock;
+		CONDITION_VARIABLE serial_tx_idle;
+		SERIAL_TX_WRITE serial_tx_writes[SERIAL_TX_WRITES];
+		unsigned long serial_tx_head = 0;
+		unsigned long serial_tx_count = 0;
+		SERIAL_TX_XFER serial_tx_xfers[SERIAL_TX_XFERS];
+		unsigned int serial_tx_busy = 0; //Transfers in flight
+		bool serial_tx_calling = FALSE; //A thread is running the done callbacks
+		bool serial_tx_stop = FALSE;
+
+		Timer perf_clock;
+		PerfHistogram perf[PANDA_PERF_POINTS];
+		//host - device time of the fastest frame, in this window and the one
+		//before. Owned by the reader, like the unwrap state.
+		long long perf_offset_min[2] = { LLONG_MAX, LLONG_MAX };
+		unsigned long long perf_window_start = 0;
 	};
 
 }
@@ -0,0 +1,245 @@
+// panda_group.cpp : several pandas as one, on one I/O completion port.
+//
+#include "stdafx.h"
+
+#include <algorithm>
+#include <climits>
+
+#include "panda_group.h"
+
+using namespace panda;
+
+std::unique_ptr<PandaGroup> PandaGroup::openPandas(const std::vector<std::string>& sns) {
+	std::vector<std::string> want = sns;
+	if (want.empty()) {
+		want = Panda::listAvailablePandas();
+		std::sort(want.begin(), want.end());
+	}
+	//Logical buses are a uint8_t.
+	if (want.empty() || want.size() * PANDA_GROUP_BUSES_PER_PANDA > 0xFF) return nullptr;
+
+	std::vector<std::unique_ptr<Panda>> pandas = Panda::openPandas(want);
+	for (auto& p : pandas)
+		if (!p) return nullptr;
+	return std::unique_ptr<PandaGroup>(new PandaGroup(std::move(pandas)));
+}
+
+PandaGroup::PandaGroup(std::vector<std::unique_ptr<Panda>> pandas) {
+	this->port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+	this->members.resize(pandas.size());
+	for (size_t i = 0; i < pandas.size(); i++) {
+		this->members[i].p = std::move(pandas[i]);
+		Panda& p = *this->members[i].p;
+		//The key is the member. Reads that finish at once are handled where they
+		//were issued, so they must not come through the port as well.
+		CreateIoCompletionPort(p.devh, this->port, i, 0);
+		SetFileCompletionNotificationModes(p.devh, FILE_SKIP_COMPLETION_PORT_ON_SUCCESS);
+	}
+	this->sync_clocks();
+	for (auto& m : this->members)
+		m.p->can_rx_q_issue();
+}
+
+PandaGroup::~PandaGroup() {
+	for (auto& m : this->members)
+		if (!m.gone) m.p->can_rx_q_abort();
+	this->members.clear();
+	CloseHandle(this->port);
+}
+
+size_t PandaGroup::size() {
+	return this->members.size();
+}
+
+Panda& PandaGroup::panda(size_t i) {
+	return *this->members[i].p;
+}
+
+bool PandaGroup::alive(size_t i) {
+	return !this->members[i].gone;
+}
+
+void PandaGroup::set_merge_delay_us(unsigned long long us) {
+	this->merge_delay_us = us;
+}
+
+unsigned long long PandaGroup::now_us() {
+	return this->clock.getTimePassedUS();
+}
+
+bool PandaGroup::sync_clock(member& m) {
+	unsigned long long best_rtt = ULLONG_MAX, host = 0;
+	uint32_t dev = 0;
+	for (int i = 0; i < 4; i++) {
+		uint32_t t;
+		unsigned long long t0 = this->now_us();
+		if (!m.p->get_time(t)) continue;
+		unsigned long long rtt = this->now_us() - t0;
+		if (rtt < best_rtt) {
+			best_rtt = rtt;
+			host = t0 + rtt / 2;
+			dev = t;
+		}
+	}
+	if (best_rtt == ULLONG_MAX) return FALSE;
+
+	//Only part of each later error is taken, so the merge order doesn't jitter
+	//with the round trips, while drift is still followed.
+	if (m.synced) {
+		unsigned long long predicted = this->group_time(m, dev);
+		host = predicted + ((long long)host - (long long)predicted) / 4;
+	}
+	m.sync_dev = dev;
+	m.sync_host = host;
+	m.synced = TRUE;
+	return TRUE;
+}
+
+bool PandaGroup::sync_clocks() {
+	bool ok = TRUE;
+	for (auto& m : this->members)
+		ok = this->sync_clock(m) && ok;
+	this->last_sync = this->now_us();
+	return ok;
+}
+
+//ts is within half the 32 bit wrap of the last sync.
+unsigned long long PandaGroup::group_time(const member& m, uint32_t ts) {
+	long long t = (long long)m.sync_host + (int32_t)(ts - m.sync_dev);
+	return (t < 0) ? 0 : t;
+}
+
+//Every overlapped operation on a panda's handle completes on the port, only
+//its EP1 IN reads are taken.
+void PandaGroup::can_rx_read_done(member& m, OVERLAPPED *overlapped) {
+	Panda& p = *m.p;
+	auto rx = CONTAINING_RECORD(overlapped, Panda::CAN_RX_PIPE_READ, overlapped);
+	if ((uintptr_t)rx < (uintptr_t)p.can_rx_q || (uintptr_t)rx >= (uintptr_t)(p.can_rx_q + p.can_rx_q_len)) return;
+	if (rx->error != ERROR_IO_PENDING) return;
+
+	if (WinUsb_GetOverlappedResult(p.usbh, &rx->overlapped, &rx->count, FALSE)) {
+		rx->error = 0;
+	} else {
+		DWORD err = GetLastError();
+		if (err == ERROR_IO_INCOMPLETE) return;
+		rx->error = err;
+		rx->count = 0;
+	}
+}
+
+//Decodes the reads that are done, oldest first, and queues new ones in their place.
+void PandaGroup::can_rx_drain(size_t i) {
+	member& m = this->members[i];
+	Panda& p = *m.p;
+	if (m.gone) return;
+
+	while (p.w_ptr != p.issue_ptr) {
+		auto& rx = p.can_rx_q[p.w_ptr];
+		if (rx.error == ERROR_IO_PENDING) break;
+		if (rx.error != 0) { // ERROR_BAD_COMMAND happens when device is unplugged.
+			m.gone = TRUE;
+			p.can_rx_q_abort();
+			return;
+		}
+
+		PANDA_TRACE(TRACE_USB_RX, 0, (uint16_t)rx.count);
+		p.perf[PERF_CAN_RX_READ].record(p.perf_clock.getTimePassedUS() - rx.issued_us);
+		p.can_rx_tune(rx);
+		for (unsigned long off = 0, consumed; off < rx.count; off += consumed) {
+			size_t count = p.parse_can_recv_buff(rx.data + off, rx.count - off, this->rx_buff,
+				sizeof(this->rx_buff) / sizeof(this->rx_buff[0]), &consumed);
+			this->can_rx_add(i, count);
+			if (consumed == 0) break;
+		}
+
+		auto w_ptr = p.w_ptr + 1;
+		p.w_ptr = (w_ptr == p.can_rx_q_len ? 0 : w_ptr);
+		p.r_ptr = p.w_ptr;
+	}
+	p.can_rx_q_issue();
+}
+
+void PandaGroup::can_rx_add(size_t i, size_t count) {
+	member& m = this->members[i];
+	unsigned long long now = this->now_us();
+	for (size_t k = 0; k < count; k++) {
+		PANDA_GROUP_CAN_MSG g;
+		g.msg = this->rx_buff[k];
+		g.panda = (uint8_t)i;
+		g.bus = (g.msg.bus <= PANDA_CAN3) ? (uint8_t)(i * PANDA_GROUP_BUSES_PER_PANDA + g.msg.bus) : 0xFF;
+		//Nothing was received after now, whatever the clock estimate says.
+		g.group_time = m.synced ? min(this->group_time(m, (uint32_t)g.msg.recv_time), now) : now;
+		//The buses of one panda can be a little out of order, see Panda::unwrap_device_time.
+		auto pos = m.pending.end();
+		while (pos != m.pending.begin() && (pos - 1)->group_time > g.group_time)
+			--pos;
+		m.pending.insert(pos, g);
+	}
+}
+
+void PandaGroup::poll(DWORD timeoutms) {
+	OVERLAPPED_ENTRY entries[64];
+	ULONG count = 0;
+	if (GetQueuedCompletionStatusEx(this->port, entries, ARRAYSIZE(entries), &count, timeoutms, FALSE)) {
+		for (ULONG k = 0; k < count; k++) {
+			if (entries[k].lpCompletionKey >= this->members.size()) continue;
+			this->can_rx_read_done(this->members[entries[k].lpCompletionKey], entries[k].lpOverlapped);
+		}
+	}
+	for (size_t i = 0; i < this->members.size(); i++)
+		this->can_rx_drain(i);
+}
+
+size_t PandaGroup::can_recv(PANDA_GROUP_CAN_MSG* out, size_t cap, DWORD timeoutms) {
+	unsigned long long deadline = this->now_us() + (unsigned long long)timeoutms * 1000;
+	DWORD wait = 0;
+	while (1) {
+		if (this->now_us() - this->last_sync >= PANDA_GROUP_SYNC_US)
+			this->sync_clocks();
+		this->poll(wait);
+
+		unsigned long long now = this->now_us();
+		size_t count = 0;
+		member *first = nullptr;
+		while (count < cap) {
+			first = nullptr;
+			for (auto& m : this->members)
+				if (!m.pending.empty() && (first == nullptr || m.pending.front().group_time < first->pending.front().group_time))
+					first = &m;
+			if (first == nullptr || first->pending.front().group_time + this->merge_delay_us > now) break;
+			out[count++] = first->pending.front();
+			first->pending.pop_front();
+		}
+		if (count != 0 || timeoutms == 0 || (timeoutms != INFINITE && now >= deadline))
+			return count;
+
+		//Sleep on the port until a read completes, the oldest frame is old
+		//enough, the timeout or the next sync.
+		unsigned long long until = this->last_sync + PANDA_GROUP_SYNC_US;
+		if (first != nullptr) until = min(until, first->pending.front().group_time + this->merge_delay_us);
+		if (timeoutms != INFINITE) until = min(until, deadline);
+		wait = (until > now) ? (DWORD)((until - now + 999) / 1000) : 0;
+	}
+}
+
+unsigned long long PandaGroup::can_send(uint32_t addr, bool addr_29b, const uint8_t *dat, uint8_t len, unsigned int bus) {
+	size_t i = bus / PANDA_GROUP_BUSES_PER_PANDA;
+	if (i >= this->members.size()) return 0;
+	return this->members[i].p->can_send_async(addr, addr_29b, dat, len, (PANDA_CAN_PORT)(bus % PANDA_GROUP_BUSES_PER_PANDA));
+}
+
+bool PandaGroup::can_send_many(const std::vector<PANDA_GROUP_CAN_MSG>& msgs) {
+	std::vector<std::vector<PANDA_CAN_MSG>> per_panda(this->members.size());
+	for (auto& g : msgs) {
+		size_t i = g.bus / PANDA_GROUP_BUSES_PER_PANDA;
+		if (i >= this->members.size()) return FALSE;
+		per_panda[i].push_back(g.msg);
+		per_panda[i].back().bus = (PANDA_CAN_PORT)(g.bus % PANDA_GROUP_BUSES_PER_PANDA);
+	}
+
+	bool ok = TRUE;
+	for (size_t i = 0; i < per_panda.size(); i++)
+		if (!per_panda[i].empty() && this->members[i].p->can_send_async_many(per_panda[i]) == 0)
+			ok = FALSE;
+	return ok;
+}
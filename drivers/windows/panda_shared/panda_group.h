@@ -0,0 +1,84 @@
+#pragma once
+
+// Several pandas read and written as one. All their EP1 IN reads complete on
+// one I/O completion port, and can_recv drains it on the caller's thread, so a
+// rig of many pandas needs no thread per device. Each panda's timestamps are
+// put on a common clock by measuring it against the host's, and the frames
+// they receive come out as a single stream in that clock's order.
+
+#include <deque>
+
+#include "panda.h"
+
+//Logical buses of a group, numbered across its pandas in the order they were opened.
+#define PANDA_GROUP_BUSES_PER_PANDA 3
+//How long frames are held so later ones from slower pandas can go in front of them.
+#define PANDA_GROUP_MERGE_DELAY_US 5000
+//How often the pandas' clocks are measured again.
+#define PANDA_GROUP_SYNC_US 1000000
+
+namespace panda {
+	typedef struct _PANDA_GROUP_CAN_MSG {
+		PANDA_CAN_MSG msg; //msg.bus is the bus on its own panda
+		unsigned long long group_time; //us on the group clock, the host's since the group was opened
+		uint8_t panda; //Index in the group
+		uint8_t bus; //Logical bus, 0xFF if the panda's is unknown
+	} PANDA_GROUP_CAN_MSG;
+
+	class PANDA_API PandaGroup {
+	public:
+		//Opens the pandas in the order of sns, or every panda sorted by serial if it's
+		//empty. nullptr if any of them doesn't open.
+		static std::unique_ptr<PandaGroup> openPandas(const std::vector<std::string>& sns);
+
+		~PandaGroup();
+
+		size_t size();
+		//The group reads EP1 IN of its pandas, their can_recv and can_rx_q calls must not be used.
+		Panda& panda(size_t i);
+		//Whether the panda's reads are still running, false once it's unplugged.
+		bool alive(size_t i);
+
+		void set_merge_delay_us(unsigned long long us);
+		//Up to cap frames of all the pandas in group_time order. A frame is held
+		//until it is the merge delay old. Waits up to timeoutms for one. Reads
+		//stay queued between calls.
+		size_t can_recv(PANDA_GROUP_CAN_MSG* out, size_t cap, DWORD timeoutms = 0);
+		//Queues the frame on the panda with the logical bus. Returns its sequence
+		//number on that panda, or 0 if it isn't queued.
+		unsigned long long can_send(uint32_t addr, bool addr_29b, const uint8_t *dat, uint8_t len, unsigned int bus);
+		//Queues each frame on the panda of its logical bus, msg.bus is ignored.
+		bool can_send_many(const std::vector<PANDA_GROUP_CAN_MSG>& msgs);
+
+		//Measures each panda's clock from the middle of a get_time round trip, the
+		//fastest of a few. can_recv does it every PANDA_GROUP_SYNC_US.
+		bool sync_clocks();
+		unsigned long long now_us();
+
+	private:
+		PandaGroup(std::vector<std::unique_ptr<Panda>> pandas);
+
+		typedef struct _member {
+			std::unique_ptr<Panda> p;
+			bool gone = FALSE;
+			bool synced = FALSE;
+			uint32_t sync_dev = 0;
+			unsigned long long sync_host = 0; //group time at sync_dev
+			std::deque<PANDA_GROUP_CAN_MSG> pending; //In group_time order
+		} member;
+
+		void poll(DWORD timeoutms);
+		void can_rx_read_done(member& m, OVERLAPPED *overlapped);
+		void can_rx_drain(size_t i);
+		void can_rx_add(size_t i, size_t count);
+		bool sync_clock(member& m);
+		unsigned long long group_time(const member& m, uint32_t ts);
+
+		std::vector<member> members;
+		HANDLE port = NULL;
+		Timer clock;
+		unsigned long long merge_delay_us = PANDA_GROUP_MERGE_DELAY_US;
+		unsigned long long last_sync = 0;
+		PANDA_CAN_MSG rx_buff[1024];
+	};
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+// Latency histograms of a panda's USB transfers, always on. Buckets are log
+// linear like HdrHistogram's, 1us wide up to 32us and then 16 to each power of
+// two, so a bucket is within 1/16 of the values in it from 1us to 71 minutes.
+// Recording is a bit scan, a few shifts and relaxed atomic adds.
+
+#include <atomic>
+#include <stdint.h>
+#include <windows.h>
+
+#define PANDA_PERF_BUCKETS (32 + 27 * 16)
+//The dequeue latency is measured against the fastest frame of the last one or
+//two of these, so the drift between the panda's clock and the host's drops out.
+#define PANDA_PERF_WINDOW_US 1000000
+
+namespace panda {
+	typedef enum _PANDA_PERF_POINT : uint8_t {
+		PERF_CONTROL_IN = 0, //Control transfers reading from the panda
+		PERF_CONTROL_OUT = 1,
+		PERF_BULK_IN_EP1 = 2, //can_recv
+		PERF_BULK_OUT_EP2 = 3, //serial_write, from queued until done
+		PERF_BULK_OUT_EP3 = 4, //can_send, can_send_many and can_replay_load
+		PERF_CAN_TX_WRITE = 5, //The async writer's EP3 transfers
+		PERF_CAN_RX_READ = 6, //Overlapped EP1 reads, from queued until the reader takes them done
+		PERF_SERIAL_STREAM_READ = 7, //Overlapped EP2 reads, from queued until done
+		PERF_CAN_RX_DEQUEUE = 8, //Each frame, from its timestamp until decoded for the caller
+		PANDA_PERF_POINTS = 9,
+	} PANDA_PERF_POINT;
+
+	inline size_t perf_bucket(uint32_t us) {
+		if (us < 32) return us;
+		unsigned long msb;
+		_BitScanReverse(&msb, us);
+		return 32 + (msb - 5) * 16 + ((us >> (msb - 4)) & 15);
+	}
+
+	//The largest value that lands in bucket i.
+	inline uint32_t perf_bucket_top(size_t i) {
+		if (i < 32) return (uint32_t)i;
+		unsigned int shift = (unsigned int)(i - 32) / 16 + 1;
+		return (uint32_t)(((uint64_t)(16 + (i - 32) % 16 + 1) << shift) - 1);
+	}
+
+	typedef struct _PANDA_PERF_HIST {
+		uint64_t count;
+		uint64_t sum_us;
+		uint32_t max_us;
+		uint32_t buckets[PANDA_PERF_BUCKETS];
+
+		//The top of the bucket holding the pth fraction of the values, 0 if there are none.
+		uint32_t percentile_us(double p) const {
+			uint64_t want = (uint64_t)(p * this->count + 0.5), seen = 0;
+			if (this->count == 0) return 0;
+			for (size_t i = 0; i < PANDA_PERF_BUCKETS; i++) {
+				seen += this->buckets[i];
+				if (seen >= want && seen != 0) return min(perf_bucket_top(i), this->max_us);
+			}
+			return this->max_us;
+		}
+	} PANDA_PERF_HIST;
+
+	typedef struct _PANDA_PERF_STATS {
+		PANDA_PERF_HIST hist[PANDA_PERF_POINTS]; //By PANDA_PERF_POINT
+	} PANDA_PERF_STATS;
+
+	//Recorded from any thread. A read while others record is not a snapshot of
+	//one moment, the counts are each right.
+	class PerfHistogram {
+	public:
+		PerfHistogram() {
+			this->reset();
+		}
+
+		void record(unsigned long long us) {
+			uint32_t v = (us > UINT32_MAX) ? UINT32_MAX : (uint32_t)us;
+			this->buckets[perf_bucket(v)].fetch_add(1, std::memory_order_relaxed);
+			this->sum.fetch_add(v, std::memory_order_relaxed);
+			uint32_t prev = this->max.load(std::memory_order_relaxed);
+			while (v > prev && !this->max.compare_exchange_weak(prev, v, std::memory_order_relaxed));
+		}
+
+		void read(PANDA_PERF_HIST& out) const {
+			out.count = 0;
+			for (size_t i = 0; i < PANDA_PERF_BUCKETS; i++) {
+				out.buckets[i] = this->buckets[i].load(std::memory_order_relaxed);
+				out.count += out.buckets[i];
+			}
+			out.sum_us = this->sum.load(std::memory_order_relaxed);
+			out.max_us = this->max.load(std::memory_order_relaxed);
+		}
+
+		void reset() {
+			for (auto& b : this->buckets)
+				b.store(0, std::memory_order_relaxed);
+			this->sum.store(0, std::memory_order_relaxed);
+			this->max.store(0, std::memory_order_relaxed);
+		}
+
+	private:
+		std::atomic<uint32_t> buckets[PANDA_PERF_BUCKETS];
+		std::atomic<uint64_t> sum;
+		std::atomic<uint32_t> max;
+	};
+}
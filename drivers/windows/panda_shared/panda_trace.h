@@ -0,0 +1,96 @@
+#pragma once
+
+// In memory trace of where received and sent frames spend their time. Off by
+// default. While off a trace point is one relaxed load and a branch, and
+// defining PANDA_TRACE_OFF compiles the trace points out completely.
+// Each module (DLL or exe) that includes this has its own ring.
+
+#include <atomic>
+#include <vector>
+#include <stdint.h>
+#include <windows.h>
+
+//Events kept, the oldest are overwritten. Power of two.
+#define PANDA_TRACE_LEN 65536
+
+namespace panda {
+	typedef enum _PANDA_TRACE_POINT : uint16_t {
+		TRACE_CLOCK = 0, //ticks holds the QueryPerformanceFrequency, first record of a dump
+		TRACE_USB_RX = 1, //A USB read completed, arg is the byte count
+		TRACE_DISPATCH = 2, //A received frame was handed to the connections
+		TRACE_FILTER_MATCH = 3, //A connection's filters accepted the frame
+		TRACE_RX_ENQUEUE = 4, //A message was added to a connection's RX queue
+		TRACE_RX_DEQUEUE = 5, //PassThruReadMsgs returned the message
+		TRACE_TX_SUBMIT = 6, //A frame was queued for the USB writer
+		TRACE_TX_ECHO = 7, //The panda echoed a sent frame
+	} PANDA_TRACE_POINT;
+
+	typedef struct _PANDA_TRACE_EVENT {
+		int64_t ticks; //QueryPerformanceCounter
+		uint32_t id; //CAN id, or 0 for stages that aren't about one frame
+		uint16_t point;
+		uint16_t arg;
+	} PANDA_TRACE_EVENT;
+
+	class Trace {
+	public:
+		static Trace& get() {
+			static Trace trace;
+			return trace;
+		}
+
+		bool enabled() const {
+			return this->on.load(std::memory_order_relaxed);
+		}
+
+		//Turning tracing on starts a new trace.
+		void enable(bool enable) {
+			if (enable && this->events.size() == 0)
+				this->events.resize(PANDA_TRACE_LEN);
+			if (enable)
+				this->head.store(0);
+			this->on.store(enable);
+		}
+
+		void record(uint16_t point, uint32_t id, uint16_t arg) {
+			LARGE_INTEGER now;
+			QueryPerformanceCounter(&now);
+			auto& ev = this->events[this->head.fetch_add(1, std::memory_order_relaxed) & (PANDA_TRACE_LEN - 1)];
+			ev.ticks = now.QuadPart;
+			ev.id = id;
+			ev.point = point;
+			ev.arg = arg;
+		}
+
+		//Copies the clock record and then the newest events that fit, oldest first.
+		//Events being recorded during the copy can come out torn.
+		size_t dump(PANDA_TRACE_EVENT* out, size_t cap) {
+			if (cap == 0) return 0;
+			LARGE_INTEGER freq;
+			QueryPerformanceFrequency(&freq);
+			out[0] = { freq.QuadPart, 0, TRACE_CLOCK, 0 };
+			if (this->events.size() == 0) return 1;
+
+			uint64_t end = this->head.load();
+			uint64_t count = min(min(end, (uint64_t)PANDA_TRACE_LEN), (uint64_t)(cap - 1));
+			for (uint64_t i = 0; i < count; i++)
+				out[1 + i] = this->events[(end - count + i) & (PANDA_TRACE_LEN - 1)];
+			return (size_t)count + 1;
+		}
+
+	private:
+		Trace() : on(FALSE), head(0) { };
+
+		std::atomic<bool> on;
+		std::atomic<uint64_t> head;
+		std::vector<PANDA_TRACE_EVENT> events;
+	};
+}
+
+#ifdef PANDA_TRACE_OFF
+#define PANDA_TRACE(point, id, arg) do {} while (0)
+#else
+#define PANDA_TRACE(point, id, arg) do { \
+	if (panda::Trace::get().enabled()) panda::Trace::get().record((point), (id), (arg)); \
+} while (0)
+#endif
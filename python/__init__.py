@@ -1,6 +1,7 @@
 # python library to interface with panda
 from __future__ import print_function
 import binascii
+import ctypes
 import struct
 import hashlib
 import socket
@@ -13,6 +14,7 @@ from esptool import ESPROM, CesantaFlasher
 from flash_release import flash_release
 from update import ensure_st_up_to_date
 from serial import PandaSerial
+from clocksync import PandaClock
 from isotp import isotp_send, isotp_recv
 
 __version__ = '0.0.7'
@@ -37,23 +39,330 @@ def parse_can_buffer(dat):
       address = f1 >> 3
     else:
       address = f1 >> 21
+    bus = (f2>>4)&0xFF
     dddat = ddat[8:8+(f2&0xF)]
+    ts = f2>>16
+    if bus == Panda.EVENT_BUS and f1 & 1:
+      # an event, see set_event_stream, with the whole time
+      ts, = struct.unpack("I", ddat[12:16])
+    elif f1 & 1:
+      # TXRQ, a completion, see set_can_echo
+      bus |= Panda.CAN_TX_DONE
+      dddat = ddat[8:10]
     if DEBUG:
       print("  R %x: %s" % (address, str(dddat).encode("hex")))
-    ret.append((address, f2>>16, dddat, (f2>>4)&0xFF))
+    ret.append((address, ts, dddat, bus))
   return ret
 
+def parse_can_buffer_ts(dat):
+  # three 0x14 records to a 0x40 packet, the time is the 32 bit
+  # panda timestamp in microseconds
+  ret = []
+  for i in range(0, len(dat), 0x40):
+    pdat = dat[i:i+0x40]
+    for j in range(0, len(pdat) - 0x13, 0x14):
+      ddat = pdat[j:j+0x14]
+      (address, _, dddat, bus), = parse_can_buffer(ddat[0:0x10])
+      ts, = struct.unpack("I", ddat[0x10:0x14])
+      ret.append((address, ts, dddat, bus))
+  return ret
+
+# compact records, set with set_can_format. Each starts with a byte of len
+# (bits 0-3), bus (4-5), sent by the panda on rx or CAN_TX_URGENT on tx (6)
+# and 29 bit id (7), then the id in 2 or 4 bytes. Rx records then have the
+# time as an int16 from the packet's first record, or 0x8000 and the 32 bit
+# time, then the data. A len of 0xF pads out the 0x40 packet, and on tx 0xE
+# is a time record for the frame after it. On rx 0xD is a completion, the
+# 2 byte token then the time, without the id or data, and 0xC an event, its
+# kind in bits 4-7 and a byte of its channel (bits 4-7) and len before the time.
+COMPACT_PAD = 0xF
+COMPACT_TIME = 0xE
+COMPACT_DONE = 0xD
+COMPACT_EVENT = 0xC
+COMPACT_TS_WIDE = 0x8000
+
+def parse_can_buffer_compact(dat):
+  ret = []
+  for i in range(0, len(dat), 0x40):
+    pdat = bytearray(dat[i:i+0x40])
+    j = 0
+    ts_base = None
+    while j < len(pdat):
+      hdr = pdat[j]
+      dlc = hdr & 0xF
+      if dlc == COMPACT_PAD:
+        break
+      done = dlc == COMPACT_DONE
+      event = dlc == COMPACT_EVENT
+      if event:
+        # the kind and channel as the id of the classic record
+        address, dlc = (((hdr >> 4) & 0xF) << 4) | (pdat[j+1] >> 4), min(pdat[j+1] & 0xF, 4)
+        j += 2
+      elif done:
+        # the token stands in for the data, there's no id
+        address, token, dlc = 0, bytes(pdat[j+1:j+3]), 0
+        j += 3
+      else:
+        dlc = min(dlc, 8)
+        idl = 4 if hdr & 0x80 else 2
+        address, = struct.unpack("<I" if idl == 4 else "<H", bytes(pdat[j+1:j+1+idl]))
+        j += 1 + idl
+      rel, = struct.unpack("<H", bytes(pdat[j:j+2]))
+      j += 2
+      if rel == COMPACT_TS_WIDE:
+        ts, = struct.unpack("<I", bytes(pdat[j:j+4]))
+        j += 4
+      else:
+        ts = (ts_base + (rel - 0x10000 if rel & 0x8000 else rel)) & 0xFFFFFFFF
+      if ts_base is None:
+        ts_base = ts
+      bus = ((hdr >> 4) & 3) | (0x80 if hdr & 0x40 else 0)
+      if event:
+        ret.append((address, ts, bytes(pdat[j:j+dlc]), Panda.EVENT_BUS))
+      elif done:
+        ret.append((address, ts, token, bus | Panda.CAN_TX_DONE))
+      else:
+        ret.append((address, ts, bytes(pdat[j:j+dlc]), bus))
+      j += dlc
+  return ret
+
+def pack_can_buffer_compact(arr, send_at=False):
+  # compact tx records, whole ones to each 0x40 packet. With send_at the
+  # frames go at their ts, as with can_send_at.
+  recs = []
+  for addr, ts, dat, bus in arr:
+    assert len(dat) <= 8
+    if send_at:
+      recs.append(struct.pack("<BI", COMPACT_TIME, ts & 0xFFFFFFFF))
+    hdr = len(dat) | ((bus & 3) << 4) | (0x40 if bus & Panda.CAN_TX_URGENT else 0)
+    if addr >= 0x800:
+      recs.append(struct.pack("<BI", hdr | 0x80, addr) + dat)
+    else:
+      recs.append(struct.pack("<BH", hdr, addr) + dat)
+
+  pkts = []
+  pkt = b''
+  for i, r in enumerate(recs):
+    # a time record stays in the packet of its frame
+    need = len(r) + (len(recs[i+1]) if send_at and i % 2 == 0 else 0)
+    if len(pkt) + need > 0x40:
+      pkts.append(pkt.ljust(0x40, b'\xff'))
+      pkt = b''
+    pkt += r
+  return b''.join(pkts) + pkt
+
+def can_buffer_columns(recs):
+  # (addr, ts, dat, bus) records as columns of native byte order values, for
+  # numpy.frombuffer: addr and ts uint32, bus and len uint8, dat 8 bytes per
+  # frame
+  n = len(recs)
+  return {
+    "addr": struct.pack("%dI" % n, *[r[0] for r in recs]),
+    "bus": struct.pack("%dB" % n, *[r[3] for r in recs]),
+    "ts": struct.pack("%dI" % n, *[r[1] for r in recs]),
+    "dat": b''.join([bytes(r[2]).ljust(8, b'\x00') for r in recs]),
+    "len": struct.pack("%dB" % n, *[len(r[2]) for r in recs]),
+  }
+
+def parse_can_buffer_columns(dat, timestamps=False):
+  # the whole buffer as can_buffer_columns, ts is the time field of can_recv
+  return can_buffer_columns(parse_can_buffer_ts(dat) if timestamps else parse_can_buffer(dat))
+
+def pack_can_buffer(arr):
+  snds = []
+  transmit = 1
+  extended = 4
+  for addr, _, dat, bus in arr:
+    assert len(dat) <= 8
+    if DEBUG:
+      print("  W %x: %s" % (addr, dat.encode("hex")))
+    if addr >= 0x800:
+      rir = (addr << 3) | transmit | extended
+    else:
+      rir = (addr << 21) | transmit
+    snd = struct.pack("II", rir, len(dat) | (bus << 4)) + dat
+    snd = snd.ljust(0x10, b'\x00')
+    snds.append(snd)
+  return b''.join(snds)
+
+def _crc32_stm32_table():
+  table = []
+  for i in range(0x100):
+    c = i << 24
+    for _ in range(8):
+      c = ((c << 1) ^ 0x04C11DB7) & 0xffffffff if c & 0x80000000 else (c << 1) & 0xffffffff
+    table.append(c)
+  return table
+
+_CRC32_STM32_TABLE = _crc32_stm32_table()
+
+def crc32_stm32(dat):
+  # the ST's CRC unit, CRC-32/MPEG-2 of the little endian words msb first,
+  # what the flasher's 0xb3 gives with wIndex 1. dat is whole words.
+  crc = 0xffffffff
+  dat = bytearray(dat)
+  for i in range(0, len(dat) - 3, 4):
+    for b in (dat[i+3], dat[i+2], dat[i+1], dat[i]):
+      crc = ((crc << 8) & 0xffffffff) ^ _CRC32_STM32_TABLE[(crc >> 24) ^ b]
+  return crc
+
+def _lz4_block_decompress(dat, size):
+  # LZ4's block format, from the ESP's UDP stream
+  dat = bytearray(dat)
+  out = bytearray()
+  i = 0
+  while i < len(dat):
+    token = dat[i]
+    i += 1
+    n = token >> 4
+    if n == 15:
+      while True:
+        n += dat[i]
+        i += 1
+        if dat[i-1] != 255:
+          break
+    out += dat[i:i+n]
+    i += n
+    if i >= len(dat):
+      break
+    off = dat[i] | (dat[i+1] << 8)
+    i += 2
+    m = token & 0xF
+    if m == 15:
+      while True:
+        m += dat[i]
+        i += 1
+        if dat[i-1] != 255:
+          break
+    if off == 0 or off > len(out):
+      raise ValueError("bad LZ4 offset")
+    for _ in range(m + 4):
+      out.append(out[-off])
+  if len(out) != size:
+    raise ValueError("LZ4 block is %d bytes, not %d" % (len(out), size))
+  return out
+
+def unpack_can_buffer_lz(dat, count, back=32):
+  # the count 0x10 byte records of a UDP_FLAG_LZ datagram, see boardesp/proxy.c
+  cols = _lz4_block_decompress(dat, count*0x10)
+  out = bytearray(count*0x10)
+  for a in range(count):
+    rec = bytearray(cols[c*count + a] for c in range(0x10))
+    last = None
+    for b in range(a - 1, max(a - back, 0) - 1, -1):
+      if out[b*0x10:b*0x10+4] == rec[0:4]:
+        last = out[b*0x10:b*0x10+0x10]
+        break
+    if last is not None:
+      for c in range(4, 6):
+        rec[c] ^= last[c]
+      t = (rec[6] | (rec[7] << 8)) + (last[6] | (last[7] << 8))
+      rec[6], rec[7] = t & 0xFF, (t >> 8) & 0xFF
+      for c in range(8, 0x10):
+        rec[c] ^= last[c]
+    out[a*0x10:a*0x10+0x10] = rec
+  return bytes(out)
+
+# the compiled versions from canbuf.c, built by setup.py when there is a
+# compiler. The Python ones above are the fallback, and stay in use with
+# PANDADEBUG for the prints.
+try:
+  from panda import _canbuf
+except ImportError:
+  _canbuf = None
+
+if _canbuf is not None and not DEBUG:
+  parse_can_buffer = _canbuf.parse_can_buffer
+  parse_can_buffer_ts = _canbuf.parse_can_buffer_ts
+  parse_can_buffer_columns = _canbuf.parse_can_buffer_columns
+  pack_can_buffer = _canbuf.pack_can_buffer
+  unpack_can_buffer_lz = _canbuf.unpack_can_buffer_lz
+
+# the native CAN capture thread from capturemodule.cpp, see Panda.can_capture_start
+try:
+  from panda import _capture
+except ImportError:
+  _capture = None
+
 class PandaWifiStreaming(object):
-  def __init__(self, ip="192.168.0.10", port=1338):
+  # framed datagrams from the ESP: a header, then count CAN records. The
+  # header makes the length 4 mod 0x10, unlike the raw records of old ESPs.
+  # With lz the ESP packs the records of each datagram when that makes it
+  # smaller, ESPs that can't just send them as they are.
+  UDP_HEADER = struct.Struct("<HBBHHIII")
+  UDP_MAGIC = 0x5750
+  UDP_FRAMED_VERSION = 2
+  UDP_FLAG_END = 1
+  UDP_FLAG_LZ = 2
+  UDP_KICK_LZ = 1
+
+  def __init__(self, ip="192.168.0.10", port=1338, framed=True, lz=False):
     self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
     self.sock.setblocking(0)
     self.ip = ip
     self.port = port
+    self.framed = framed
+    self.lz = framed and lz
+    # the bytes that came and the records' in them, for the packing ratio
+    self.wire_bytes = 0
+    self.rec_bytes = 0
+    # next expected sequence number, and the (first missing seq, count) gaps
+    # since the last call to gaps()
+    self.seq = None
+    self.lost = 0
+    self._gaps = []
+    # ESP microseconds when the last datagram was sent
+    self.device_time = None
     self.kick()
 
   def kick(self):
-    # must be called at least every 5 seconds
-    self.sock.sendto("hello", (self.ip, self.port))
+    # must be called at least every 5 seconds, framed streams ask for it
+    if self.lz:
+      kick = b"hello\x02" + struct.pack("B", self.UDP_KICK_LZ)
+    else:
+      kick = b"hello\x02" if self.framed else b"hello"
+    self.sock.sendto(kick, (self.ip, self.port))
+
+  def gaps(self):
+    ret, self._gaps = self._gaps, []
+    return ret
+
+  def _parse_framed(self, dat):
+    hdr = self.UDP_HEADER.unpack(dat[0:self.UDP_HEADER.size]) if len(dat) >= self.UDP_HEADER.size else None
+    # packed datagrams are any length
+    packed = self.lz and hdr is not None and hdr[0] == self.UDP_MAGIC and hdr[2] & self.UDP_FLAG_LZ
+    if len(dat) % 0x10 != self.UDP_HEADER.size % 0x10 and not packed:
+      # an ESP without framing
+      return parse_can_buffer(dat)
+    magic, version, flags, count, _, seq, _, t_send = hdr
+    if magic != self.UDP_MAGIC or version != self.UDP_FRAMED_VERSION:
+      return []
+
+    if self.seq is not None and seq != self.seq:
+      missing = (seq - self.seq) & 0xFFFFFFFF
+      if missing >= 0x80000000:
+        # late or duplicated
+        return []
+      self.lost += missing
+      self._gaps.append((self.seq, missing))
+      if DEBUG:
+        print("  wifi lost %d datagrams at %d" % (missing, self.seq))
+    self.seq = (seq + 1) & 0xFFFFFFFF
+    self.device_time = t_send
+
+    if flags & self.UDP_FLAG_END:
+      self.kick()
+    recs = dat[self.UDP_HEADER.size:]
+    self.wire_bytes += len(recs)
+    self.rec_bytes += count*0x10
+    if flags & self.UDP_FLAG_LZ:
+      try:
+        recs = unpack_can_buffer_lz(recs, count)
+      except (ValueError, IndexError):
+        if DEBUG:
+          print("  wifi bad packed datagram %d" % seq)
+        return []
+    return parse_can_buffer(recs[0:count*0x10])
 
   def can_recv(self):
     ret = []
@@ -61,7 +370,7 @@ class PandaWifiStreaming(object):
       try:
         dat, addr = self.sock.recvfrom(0x200*0x10)
         if addr == (self.ip, self.port):
-          ret += parse_can_buffer(dat)
+          ret += self._parse_framed(dat) if self.framed else parse_can_buffer(dat)
       except socket.error as e:
         if e.errno != 35 and e.errno != 11:
           traceback.print_exc()
@@ -70,8 +379,18 @@ class PandaWifiStreaming(object):
 
 # stupid tunneling of USB over wifi and SPI
 class WifiHandle(object):
+  # CAN TX batches the ESP queues and sends on to the ST in bursts, see
+  # TCP_TX_BATCH in boardesp/proxy.c
+  TX_BATCH = 0x8003
+  TX_BATCH_ACK = 1
+  TX_BATCH_RECS = 0x50  # 0x508 bytes, about a segment
+  TX_ACK = struct.Struct("HHIII")
+
   def __init__(self, ip="192.168.0.10", port=1337):
     self.sock = socket.create_connection((ip, port))
+    self.tx_seq = 0
+    # None until probed, old ESPs answer the empty batch with nothing
+    self.tx_batch = None
 
   def __recv(self):
     ret = self.sock.recv(0x44)
@@ -96,6 +415,32 @@ class WifiHandle(object):
     self.sock.send(struct.pack("HH", endpoint, 0))
     return self.__recv()
 
+  def can_send_batch(self, dat):
+    """Sends the 0x10 byte CAN records in dat with one round trip however many
+    there are. Returns the ESP's (batches, sent, dropped) since the last ack,
+    or None if it doesn't batch, then dat has to go as bulkWrites.
+    """
+    if self.tx_batch is None:
+      self.tx_batch = self._tx_batch(b'') is not None
+    if not self.tx_batch:
+      return None
+    return self._tx_batch(dat)
+
+  def _tx_batch(self, dat):
+    step = self.TX_BATCH_RECS*0x10
+    self.tx_seq = (self.tx_seq + 1) & 0xFFFF
+    for i in range(0, max(len(dat), 1), step):
+      chunk = dat[i:i+step]
+      flags = self.TX_BATCH_ACK if i + step >= len(dat) else 0
+      self.sock.sendall(struct.pack("HHHH", self.TX_BATCH, len(chunk)//0x10, flags, self.tx_seq) + chunk)
+    ret = self.__recv()
+    if len(ret) < self.TX_ACK.size:
+      return None
+    seq, _, batches, sent, dropped = self.TX_ACK.unpack(ret[0:self.TX_ACK.size])
+    if seq != self.tx_seq:
+      raise IOError("wifi TX batch ack out of order")
+    return batches, sent, dropped
+
   def close(self):
     self.sock.close()
 
@@ -118,21 +463,60 @@ class Panda(object):
   GMLAN_CAN2 = 1
   GMLAN_CAN3 = 2
 
+  # or'd into the bus of a frame sent to a priority queue, see set_can_tx_priority
+  CAN_TX_URGENT = 0x800
+
+  # or'd into the bus of a received completion, see set_can_echo
+  CAN_TX_DONE = 0x40
+
+  # the bus of the event stream's records and their kinds, see set_event_stream
+  EVENT_BUS = 0x7F
+  EVENT_IGNITION = 1
+  EVENT_ADC = 2
+  EVENT_LIN = 3
+  CAN_ECHO_FULL = 0
+  CAN_ECHO_TOKEN = 1
+  CAN_ECHO_NONE = 2
+  # in a completion's token, see set_can_one_shot
+  CAN_DONE_FAILED = 0x8000
+  CAN_DONE_ARB_LOST = 0x4000
+
+  # what the flasher's 0xb0 echo says it can do, see board/spi_flasher.h
+  FLASHER_PIPELINED = 1
+  FLASHER_CRC = 2
+  FLASHER_CAN_BLOCK = 4
+  FLASHER_DIFF = 8
+  FLASHER_CRC_HW = 16
+  # 0xb4 has the CRCs of the app's blocks, up to FLASH_DIFF_CRCS a read
+  FLASH_DIFF_BLOCK = 0x400
+  FLASH_DIFF_BLOCKS = 48
+  FLASH_DIFF_CRCS = 13
+
   REQUEST_IN = usb1.ENDPOINT_IN | usb1.TYPE_VENDOR | usb1.RECIPIENT_DEVICE
   REQUEST_OUT = usb1.ENDPOINT_OUT | usb1.TYPE_VENDOR | usb1.RECIPIENT_DEVICE
 
   def __init__(self, serial=None, claim=True):
     self._serial = serial
     self._handle = None
+    self._can_timestamps = False
+    self._can_rx_compact = False
+    self._can_tx_compact = False
+    self._capture = None
+    # ep2 IN packets one reader got that are for the other
+    self._ep2_serial = []
+    self._ep2_isotp = []
     self.connect(claim)
 
   def close(self):
+    self.can_capture_stop()
     self._handle.close()
     self._handle = None
 
   def connect(self, claim=True, wait=False):
     if self._handle != None:
       self.close()
+    # a panda that enumerates again is back on alt setting 0
+    self._can_tx_lanes = False
 
     if self._serial == "WIFI":
       self._handle = WifiHandle()
@@ -207,25 +591,85 @@ class Panda(object):
       raise Exception("reconnect failed")
 
   @staticmethod
-  def flash_static(handle, code):
-    # confirm flasher is present
-    fr = handle.controlRead(Panda.REQUEST_IN, 0xb0, 0, 0, 0xc)
+  def _flash_block_crcs(handle, count):
+    crcs = []
+    while len(crcs) < count:
+      n = min(Panda.FLASH_DIFF_CRCS, count - len(crcs))
+      fr = handle.controlRead(Panda.REQUEST_IN, 0xb4, len(crcs), n, 0xc + 4*n)
+      if len(fr) < 0xc + 4*n:
+        raise Exception("flash: short block CRC read")
+      crcs += struct.unpack("%dI" % n, fr[0xc:0xc + 4*n])
+    return crcs
+
+  # only the blocks whose CRCs differ are sent, the flasher keeps the rest of
+  # their sectors. Sectors with none aren't erased.
+  @staticmethod
+  def _flash_diff(handle, code, step):
+    B = Panda.FLASH_DIFF_BLOCK
+    code += "\xff" * (-len(code) % B)
+    blocks = [code[i:i+B] for i in range(0, len(code), B)]
+    want = [binascii.crc32(b) & 0xffffffff for b in blocks]
+    have = Panda._flash_block_crcs(handle, len(blocks))
+    changed = [i for i in range(len(blocks)) if want[i] != have[i]]
+    print("flash: %d of %d blocks changed" % (len(changed), len(blocks)))
+
+    for i in changed:
+      fr = handle.controlRead(Panda.REQUEST_IN, 0xb5, i, 0, 0xc)
+      if bytearray(fr)[1] != 0xff:
+        raise Exception("flash: block %d refused" % i)
+      for j in range(0, B, step):
+        handle.bulkWrite(2, blocks[i][j:j+step])
+
+    fr = handle.controlRead(Panda.REQUEST_IN, 0xb6, 0, 0, 0xc)
+    if bytearray(fr)[1] != 0xff:
+      raise Exception("flash: sector didn't program")
+    print("flash: verifying")
+    if Panda._flash_block_crcs(handle, len(blocks)) != want:
+      raise Exception("flash: blocks don't match after the update")
+
+  @staticmethod
+  def flash_static(handle, code, diff=True):
+    # confirm flasher is present, older ones don't say what they can do
+    fr = handle.controlRead(Panda.REQUEST_IN, 0xb0, 0, 0, 0x10)
     assert fr[4:8] == "\xde\xad\xd0\x0d"
+    caps = struct.unpack("I", fr[0xc:0x10])[0] if len(fr) >= 0x10 else 0
 
     # unlock flash
     print("flash: unlocking")
     handle.controlWrite(Panda.REQUEST_IN, 0xb1, 0, 0, b'')
 
-    # erase sectors 1 and 2
-    print("flash: erasing")
-    handle.controlWrite(Panda.REQUEST_IN, 0xb2, 1, 0, b'')
-    handle.controlWrite(Panda.REQUEST_IN, 0xb2, 2, 0, b'')
+    # flash over EP2, whole words. Queued flashers take many packets a transfer
+    # and program one while the next comes in. Canloaders that say so take
+    # their handle's bigger ISO-TP block writes.
+    code += "\xff" * (-len(code) % 4)
+    STEP = 0x1000 if caps & Panda.FLASHER_PIPELINED else 0x10
+    if caps & Panda.FLASHER_CAN_BLOCK:
+      STEP = min(STEP, getattr(handle, "MAX_BLOCK_WRITE", STEP))
+    else:
+      STEP = min(STEP, getattr(handle, "MAX_BULK_WRITE", STEP))
 
-    # flash over EP2
-    STEP = 0x10
-    print("flash: flashing")
-    for i in range(0, len(code), STEP):
-      handle.bulkWrite(2, code[i:i+STEP])
+    # 0xb3 only covers what was programmed in order, diffs check the blocks
+    diff = diff and caps & Panda.FLASHER_DIFF and len(code) <= Panda.FLASH_DIFF_BLOCKS * Panda.FLASH_DIFF_BLOCK
+    if diff:
+      Panda._flash_diff(handle, code, STEP)
+    else:
+      # erase sectors 1 and 2
+      print("flash: erasing")
+      handle.controlWrite(Panda.REQUEST_IN, 0xb2, 1, 0, b'')
+      handle.controlWrite(Panda.REQUEST_IN, 0xb2, 2, 0, b'')
+
+      print("flash: flashing")
+      for i in range(0, len(code), STEP):
+        handle.bulkWrite(2, code[i:i+STEP])
+
+    if caps & Panda.FLASHER_CRC and not diff:
+      print("flash: verifying")
+      # the CRC unit's own is quicker for the panda, zlib's for older ones
+      hw = 1 if caps & Panda.FLASHER_CRC_HW else 0
+      fr = handle.controlRead(Panda.REQUEST_IN, 0xb3, 0, hw, 0x10)
+      crc = struct.unpack("I", fr[0xc:0x10])[0]
+      if crc != (crc32_stm32(code) if hw else binascii.crc32(code) & 0xffffffff):
+        raise Exception("flash: CRC mismatch, %08x on the panda" % crc)
 
     # reset
     print("flash: resetting")
@@ -234,7 +678,7 @@ class Panda(object):
     except Exception:
       pass
 
-  def flash(self, fn=None, code=None, reconnect=True):
+  def flash(self, fn=None, code=None, reconnect=True, diff=True):
     if not self.bootstub:
       self.reset(enter_bootstub=True)
     assert(self.bootstub)
@@ -258,7 +702,7 @@ class Panda(object):
     print("flash: version is "+self.get_version())
 
     # do flash
-    Panda.flash_static(self._handle, code)
+    Panda.flash_static(self._handle, code, diff)
 
     # reconnect
     if reconnect:
@@ -311,14 +755,152 @@ class Panda(object):
 
   # ******************* health *******************
 
-  def health(self):
-    dat = self._handle.controlRead(Panda.REQUEST_IN, 0xd2, 0, 0, 13)
-    a = struct.unpack("IIBBBBB", dat)
-    return {"voltage": a[0], "current": a[1],
-            "started": a[2], "controls_allowed": a[3],
-            "gas_interceptor_detected": a[4],
-            "started_signal_detected": a[5],
-            "started_alt": a[6]}
+  def health(self, reset=False):
+    # the lag, latency and idle are over the time since the last read with
+    # reset, which then starts a new window
+    dat = self._handle.controlRead(Panda.REQUEST_IN, 0xd2, int(reset), 0, 0x40)
+    a = struct.unpack("IIBBBBB", dat[:13])
+    ret = {"voltage": a[0], "current": a[1],
+           "started": a[2], "controls_allowed": a[3],
+           "gas_interceptor_detected": a[4],
+           "started_signal_detected": a[5],
+           "started_alt": a[6]}
+    # older firmware only sends the first 13 bytes
+    if len(dat) >= 64 and ord(dat[13:14]) >= 1:
+      a = struct.unpack("<BQHH4H4HIIIIHHH", dat[13:64])
+      ret.update({"version": a[0], "uptime": a[1] / 1e6,
+                  "rx_queue_depth": a[2], "rx_queue_hwm": a[3],
+                  "tx_queue_depth": list(a[4:8]), "tx_queue_hwm": list(a[8:12]),
+                  "rx_dropped": a[12], "tx_dropped": a[13],
+                  "usb_pauses": a[14], "usb_naks": a[15],
+                  "main_loop_lag_max": a[16], "irq_latency_max": a[17],
+                  "idle": a[18] / 1000.})
+    return ret
+
+  # board/drivers/postmortem.h, RCC->CSR's reset flags
+  RESET_FLAGS = {0x02000000: "BOR", 0x04000000: "PIN", 0x08000000: "POR", 0x10000000: "SOFTWARE",
+                 0x20000000: "IWDG", 0x40000000: "WWDG", 0x80000000: "LOW_POWER"}
+
+  def postmortem(self, current=False):
+    """What the last boot was doing when it ended, from the record it kept in
+    RAM through the reset, or this boot's so far if current. None if there
+    is none, like after a power loss. ended_by is the reset flags of this
+    boot, what ended the last, the maxes are over the whole boot."""
+    dat = self._handle.controlRead(Panda.REQUEST_IN, 0xd5, 1 if current else 0, 0, 60)
+    if len(dat) < 60:
+      return None
+    a = struct.unpack("<B3xI13I", dat)
+    if not a[0]:
+      return None
+    flags = lambda f: [n for b, n in sorted(Panda.RESET_FLAGS.items()) if f & b]
+    return {"ended_by": flags(a[1]), "boot": a[2], "started_by": flags(a[3]), "updates": a[4],
+            "uptime": (a[5] | (a[6] << 32)) / 1e6, "rx_dropped": a[7], "tx_dropped": a[8],
+            "usb_pauses": a[9], "usb_naks": a[10], "rx_queue_hwm": a[11], "tx_queue_hwm": a[12],
+            "irq_latency_max": a[13], "main_loop_lag_max": a[14]}
+
+  def can_stats(self, bus):
+    dat = self._handle.controlRead(Panda.REQUEST_IN, 0xc0, bus, 0, 54)
+    a = struct.unpack("<IIIIIIIIHBBBBI", dat[:42])
+    ret = {"rx": a[0], "tx": a[1], "txd": a[2],
+           "rx_dropped": a[3], "tx_dropped": a[4], "errors": a[5],
+           "rx_queue_hwm": a[6], "tx_queue_hwm": a[7],
+           "load": a[8] / 1000.,
+           "tec": a[9], "rec": a[10], "lec": a[11], "bus_off": a[12],
+           "rx_suppressed": a[13]}
+    # older firmware stops at rx_suppressed
+    if len(dat) >= 54:
+      a = struct.unpack("<III", dat[42:54])
+      ret.update({"tx_failed": a[0], "tx_arb_lost": a[1], "tx_errors": a[2]})
+    return ret
+
+  # ******************* trace *******************
+
+  TRACE_ERROR = 0
+  TRACE_WARN = 1
+  TRACE_INFO = 2
+  TRACE_DEBUG = 3
+
+  # board/drivers/trace.h
+  TRACE_LEVELS = ["ERROR", "WARN", "INFO", "DEBUG"]
+  TRACE_EVENTS = {1: "BOOT", 2: "CAN_PUSH_FAILED", 3: "CAN_SCE", 4: "CAN_TX_ERROR",
+                  5: "CAN_ARB_LOST", 6: "CAN_INIT_FAILED", 7: "USB_RESET",
+                  8: "USB_NO_HANDLER", 9: "UART_OVERRUN"}
+
+  def set_trace_level(self, level):
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xf6, level, 0, b'')
+
+  def trace_read(self, start=0):
+    """Reads the trace log from record index start on.
+
+    Returns a list of (idx, ts, event, level, arg0, arg1), and the index to
+    pass next time. A gap in idx is records that were overwritten before
+    they were read.
+
+    """
+    ret = []
+    while True:
+      dat = bytes(self._handle.controlRead(Panda.REQUEST_IN, 0xf5, start & 0xFFFF, start >> 16, 0x40))
+      if len(dat) == 0:
+        break
+      for i in range(0, len(dat) - 15, 16):
+        r = struct.unpack("IIBBHI", dat[i:i+16])
+        ret.append(r)
+        start = (r[0] + 1) & 0xFFFFFFFF
+    return ret, start
+
+  @staticmethod
+  def trace_format(record):
+    idx, ts, event, level, arg0, arg1 = record
+    level = Panda.TRACE_LEVELS[level] if level < len(Panda.TRACE_LEVELS) else str(level)
+    return "%8d %10.6f %-5s %-16s %04x %08x" % (idx, ts / 1e6, level,
+                                                 Panda.TRACE_EVENTS.get(event, "EVENT_%d" % event), arg0, arg1)
+
+  # ******************* profile *******************
+
+  # board/drivers/profile.h, in probe order
+  PROFILE_PROBES = ["can_rx", "process_can", "usb_irq", "safety_rx", "safety_tx", "critical", "usb_write"]
+  BENCHES = ["empty", "can_push", "can_pop", "memcpy_16", "memcpy_64", "memcpy_256", "sha_64", "sha_1024"]
+
+  def profile_stats(self, clear=False):
+    """Cycle counts of the firmware probes, None unless it was built with PROFILE.
+
+    Returns {probe: {"count", "min", "max", "avg"}} in CPU cycles.
+
+    """
+    ret = {}
+    for i, name in enumerate(Panda.PROFILE_PROBES):
+      last = i == len(Panda.PROFILE_PROBES) - 1
+      dat = bytes(self._handle.controlRead(Panda.REQUEST_IN, 0xf7, i, 1 if clear and last else 0, 20))
+      if len(dat) < 20:
+        return None
+      count, mn, mx, sum_lo, sum_hi = struct.unpack("IIIII", dat)
+      total = (sum_hi << 32) | sum_lo
+      ret[name] = {"count": count, "min": mn, "max": mx, "avg": total / float(count) if count else 0.}
+    return ret
+
+  def bench(self, runs=0):
+    """Cycle counts of the microbenchmarks, None unless it was flashed with make bench.
+
+    Returns {bench: {"count", "min", "max", "avg"}} in CPU cycles, after the
+    ones in BENCHES come "safety_rx_<n>" and "safety_tx_<n>" for the nth
+    mode of the firmware's safety_hook_registry. Subtract the min
+    of "empty" for the cost of the call alone.
+
+    """
+    ret = {}
+    i = 0
+    while True:
+      dat = bytes(self._handle.controlRead(Panda.REQUEST_IN, 0xc5, i, runs, 20))
+      if len(dat) < 20:
+        return ret if ret else None
+      if i < len(Panda.BENCHES):
+        name = Panda.BENCHES[i]
+      else:
+        name = "safety_%s_%d" % ("tx" if (i - len(Panda.BENCHES)) & 1 else "rx", (i - len(Panda.BENCHES)) // 2)
+      count, mn, mx, sum_lo, sum_hi = struct.unpack("IIIII", dat)
+      total = (sum_hi << 32) | sum_lo
+      ret[name] = {"count": count, "min": mn, "max": mx, "avg": total / float(count) if count else 0.}
+      i += 1
 
   # ******************* control *******************
 
@@ -370,10 +952,106 @@ class Panda(object):
     elif bus in [Panda.GMLAN_CAN2, Panda.GMLAN_CAN3]:
       self._handle.controlWrite(Panda.REQUEST_OUT, 0xdb, 1, bus, b'')
 
+  def get_gmlan_status(self):
+    """The CAN number on GMLAN, None for none, and the count of switches,
+    those that reused the mode's registers, and the last and most us one
+    took."""
+    dat = self._handle.controlRead(Panda.REQUEST_IN, 0xcc, 0, 0, 20)
+    can, switches, fast, last_us, max_us = struct.unpack("<B3xIIII", dat)
+    return {"can": None if can == 0xFF else can, "switches": switches, "fast": fast,
+            "last_us": last_us, "max_us": max_us}
+
+  def get_deferred_status(self):
+    """The CAN inits and ESP resets the firmware does after acking their
+    request: how many were queued, done as of the last run with nothing
+    left, the pending ones as CAN bits and 0x100 for the ESP, the runs and
+    the most us one held off USB. Then the CANs' full inits, reconfigs of
+    just the changed one, those found as configured, and init mode timeouts,
+    None from firmware without them."""
+    dat = self._handle.controlRead(Panda.REQUEST_IN, 0xce, 0, 0, 36)
+    queued, done, pending, runs, max_us = struct.unpack("<5I", dat[:20])
+    ret = {"queued": queued, "done": done, "pending": pending, "runs": runs, "max_us": max_us, "can": None}
+    if len(dat) >= 36:
+      ret["can"] = dict(zip(("inits", "reconfigs", "unchanged", "timeouts"), struct.unpack("<4I", dat[20:36])))
+    return ret
+
+  def wait_deferred(self, timeout=1.0):
+    """Waits for the deferred requests sent so far to be done, False if they
+    weren't in timeout seconds."""
+    queued = self.get_deferred_status()["queued"]
+    end = time.time() + timeout
+    while True:
+      if ((self.get_deferred_status()["done"] - queued) & 0xFFFFFFFF) < 0x80000000:
+        return True
+      if time.time() > end:
+        return False
+      time.sleep(0.001)
+
   def set_can_loopback(self, enable):
     # set can loopback mode for all buses
     self._handle.controlWrite(Panda.REQUEST_OUT, 0xe5, int(enable), 0, b'')
 
+  def set_can_tx_in_order(self, enable):
+    # send queued CAN messages in order instead of by identifier priority
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xe7, int(enable), 0, b'')
+
+  def set_can_timestamps(self, enable):
+    # can_recv returns the 32 bit panda microsecond timestamp as the time
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xea, int(enable), 0, b'')
+    self._can_timestamps = enable
+
+  def set_can_format(self, rx_compact, tx_compact):
+    """Compact CAN records on USB, see parse_can_buffer_compact. Compact rx
+    records always have the timestamp. Returns the (rx, tx) formats the
+    panda took, old firmware and wifi keep both classic.
+    """
+    dat = bytearray(self._handle.controlRead(Panda.REQUEST_IN, 0xc4, int(rx_compact), int(tx_compact), 2))
+    self._can_rx_compact, self._can_tx_compact = (bool(dat[0]), bool(dat[1])) if len(dat) == 2 else (False, False)
+    return self._can_rx_compact, self._can_tx_compact
+
+  def set_event_stream(self, ignition=False, adc=False, lin=False, adc_period_ms=10):
+    """Events from the panda on the CAN stream, read with can_recv. Each is
+    (kind << 4 | channel, ts, dat, EVENT_BUS) with the TIM2 time it happened
+    at in ts, whatever the format: EVENT_IGNITION's dat is the started level
+    on every edge, and where it was when turned on, EVENT_ADC's the 12 bit
+    sample of the ADC channel, every adc_period_ms rounded to the 10 ms tick,
+    and EVENT_LIN's a byte of the LIN ring, SERIAL_LIN1 or SERIAL_LIN2, at the
+    time it was read. USB only, all false turns it off."""
+    mask = (ignition << Panda.EVENT_IGNITION) | (adc << Panda.EVENT_ADC) | (lin << Panda.EVENT_LIN)
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xe3, mask, max(int(adc_period_ms) // 10, 1), b'')
+
+  def set_can_echo(self, bus, mode=None):
+    """What a frame sent on bus comes back as. CAN_ECHO_FULL is the copy
+    with 0x80 in the bus. With CAN_ECHO_TOKEN a frame written to ep3 comes
+    back as a completion, CAN_TX_DONE or'd into the bus and the 10 bit token
+    as 2 little endian bytes of data, a frame's token being the count of
+    frames written to the bus before it, dropped ones too. Frames the panda
+    sends itself still come back whole. CAN_ECHO_NONE has nothing come back.
+    None keeps the mode. Returns the mode and the token of the next frame.
+    """
+    dat = bytearray(self._handle.controlRead(Panda.REQUEST_IN, 0xcf, bus, 0xFFFF if mode is None else mode, 3))
+    return dat[0], struct.unpack("<H", bytes(dat[1:3]))[0]
+
+  def set_can_one_shot(self, bus, on):
+    """A frame on bus that loses arbitration or hits an error isn't sent
+    again, the next one goes instead. One written to ep3 comes back as a
+    completion, unless the echo mode is CAN_ECHO_NONE, with CAN_DONE_FAILED
+    in its token, and CAN_DONE_ARB_LOST too if that's why. can_stats counts
+    them as tx_failed.
+    """
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xd4, bus, int(on), b'')
+
+  def set_can_rx_coalesce(self, max_latency_us):
+    # under load the panda drains CAN rx on a timer, a frame waiting at most
+    # max_latency_us for it. 0 is an IRQ a frame always
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xc8, int(max_latency_us), 0, b'')
+
+  def get_can_rx_coalesce(self):
+    """Returns max_latency_us, period_us, active, entered, drains, frames,
+    overruns and late_max."""
+    dat = self._handle.controlRead(Panda.REQUEST_IN, 0xc9, 0, 0, 0x20)
+    return struct.unpack("<8I", dat)
+
   def set_can_speed_kbps(self, bus, speed):
     self._handle.controlWrite(Panda.REQUEST_OUT, 0xde, bus, int(speed*10), b'')
 
@@ -390,29 +1068,28 @@ class Panda(object):
   # ******************* can *******************
 
   def can_send_many(self, arr):
-    snds = []
-    transmit = 1
-    extended = 4
-    for addr, _, dat, bus in arr:
-      assert len(dat) <= 8
-      if DEBUG:
-        print("  W %x: %s" % (addr, dat.encode("hex")))
-      if addr >= 0x800:
-        rir = (addr << 3) | transmit | extended
-      else:
-        rir = (addr << 21) | transmit
-      snd = struct.pack("II", rir, len(dat) | (bus << 4)) + dat
-      snd = snd.ljust(0x10, b'\x00')
-      snds.append(snd)
+    if self._can_tx_lanes:
+      lane = [m for m in arr if (m[3] & 0xF) == 0]
+      rest = [m for m in arr if (m[3] & 0xF) != 0]
+      if len(lane) > 0:
+        self._can_send_ep(1, lane)
+      if len(rest) > 0:
+        self._can_send_ep(3, rest)
+    else:
+      self._can_send_ep(3, arr)
+
+  def _can_send_ep(self, ep, arr):
+    snd = pack_can_buffer_compact(arr) if self._can_tx_compact else pack_can_buffer(arr)
 
     while True:
       try:
-        #print("DAT: %s"%b''.join(snds).__repr__())
+        #print("DAT: %s"%snd.__repr__())
         if self.wifi:
-          for s in snds:
-            self._handle.bulkWrite(3, s)
+          if self._handle.can_send_batch(snd) is None:
+            for i in range(0, len(snd), 0x10):
+              self._handle.bulkWrite(ep, snd[i:i+0x10])
         else:
-          self._handle.bulkWrite(3, b''.join(snds))
+          self._handle.bulkWrite(ep, snd)
         break
       except (usb1.USBErrorIO, usb1.USBErrorOverflow):
         print("CAN: BAD SEND MANY, RETRYING")
@@ -420,7 +1097,66 @@ class Panda(object):
   def can_send(self, addr, dat, bus):
     self.can_send_many([[addr, None, dat, bus]])
 
-  def can_recv(self):
+  def get_time(self):
+    # the panda's 32 bit microsecond timer, the time of the CAN timestamps
+    dat = self._handle.controlRead(Panda.REQUEST_IN, 0xfe, 0, 0, 4)
+    return struct.unpack("I", dat)[0]
+
+  def can_send_at(self, arr):
+    """Sends the (addr, ts, dat, bus) frames when get_time() reaches ts,
+    timed by the panda. Up to 32 can wait there at once, more are dropped
+    and counted as tx_dropped. The safety mode checks them as they're sent.
+    """
+    if self._can_tx_compact:
+      self._handle.bulkWrite(3, pack_can_buffer_compact(arr, send_at=True))
+      return
+    # a record with TXRQ clear holds the time of the frame after it
+    snd = b''.join([struct.pack("IIII", 0, 0, ts & 0xFFFFFFFF, 0) + pack_can_buffer([(addr, None, dat, bus)])
+                    for addr, ts, dat, bus in arr])
+    if self.wifi:
+      for i in range(0, len(snd), 0x20):
+        self._handle.bulkWrite(3, snd[i:i+0x20])
+    else:
+      self._handle.bulkWrite(3, snd)
+
+  # control records of a transmit group, see board/drivers/can_group.h
+  CAN_GROUP = 1
+  CAN_GROUP_RELEASE = 2
+  CAN_GROUP_RELEASE_AT = 3
+
+  def can_send_group(self, arr, at=None):
+    """Sends the (addr, _, dat, bus) frames together, their CANs' mailboxes
+    filled in the same critical section once they're all on the panda, at
+    get_time() reaching at if it's not None. Only a frame with an empty
+    mailbox and nothing queued before it on its bus starts with the others.
+    The safety mode checks every frame. Up to 12 frames, one timed group can
+    wait at once and the next timed one is dropped until it has gone.
+    """
+    release = (self.CAN_GROUP_RELEASE, 0) if at is None else (self.CAN_GROUP_RELEASE_AT, at & 0xFFFFFFFF)
+    if self._can_tx_compact:
+      # records never span a packet, the control ones go in their own
+      self._handle.bulkWrite(3, struct.pack("<BI", COMPACT_TIME | (self.CAN_GROUP << 4), 0))
+      self._handle.bulkWrite(3, pack_can_buffer_compact(arr))
+      self._handle.bulkWrite(3, struct.pack("<BI", COMPACT_TIME | (release[0] << 4), release[1]))
+      return
+    # records with TXRQ clear and the kind in RDTR
+    snd = struct.pack("IIII", 0, self.CAN_GROUP, 0, 0) + pack_can_buffer(arr) + \
+          struct.pack("IIII", 0, release[0], release[1], 0)
+    if self.wifi:
+      for i in range(0, len(snd), 0x20):
+        self._handle.bulkWrite(3, snd[i:i+0x20])
+    else:
+      self._handle.bulkWrite(3, snd)
+
+  def can_group_stats(self, reset=False):
+    # skew_max_us is the most from the first CAN's mailboxes filled to the
+    # last's, late_max_us the most a timed group went after its time
+    dat = self._handle.controlRead(Panda.REQUEST_IN, 0xcd, 1 if reset else 0, 0, 24)
+    a = struct.unpack("IIIIII", dat)
+    return {"released": a[0], "frames": a[1], "dropped": a[2], "armed": a[3],
+            "skew_max_us": a[4], "late_max_us": a[5]}
+
+  def _can_read(self):
     dat = bytearray()
     while True:
       try:
@@ -428,19 +1164,360 @@ class Panda(object):
         break
       except (usb1.USBErrorIO, usb1.USBErrorOverflow):
         print("CAN: BAD RECV, RETRYING")
+    return dat
+
+  def _can_parse(self, dat):
+    if self._can_rx_compact:
+      return parse_can_buffer_compact(dat)
+    if self._can_timestamps:
+      return parse_can_buffer_ts(dat)
     return parse_can_buffer(dat)
 
+  def _can_parse_columns(self, dat):
+    if self._can_rx_compact:
+      return can_buffer_columns(parse_can_buffer_compact(dat))
+    return parse_can_buffer_columns(dat, self._can_timestamps)
+
+  def can_recv(self):
+    # while capturing, what the capture thread has read
+    if self._capture is not None:
+      ret = []
+      for dat in self._capture.drain():
+        ret += self._can_parse(dat)
+      return ret
+    return self._can_parse(self._can_read())
+
+  def can_recv_columns(self):
+    # like can_recv, as the columns of parse_can_buffer_columns
+    if self._capture is not None:
+      return self.can_recv_batch()
+    return self._can_parse_columns(self._can_read())
+
+  # *** native capture ***
+
+  # reads the ring holds, of up to CAPTURE_READ_LEN bytes each
+  CAPTURE_READS = 4096
+  CAPTURE_READ_LEN = 0x10*256
+
+  def can_capture_start(self, reads=CAPTURE_READS):
+    """Reads the CAN stream on a native thread that doesn't need the GIL,
+    into a ring of reads for can_recv_batch to take in bulk. A slow loop in
+    python then doesn't leave the panda's rx queues to overflow, only the
+    ring, see can_capture_stats. can_recv and can_recv_columns take from it
+    too while it runs.
+
+    Args:
+      reads (int): reads the ring holds, of up to CAPTURE_READ_LEN bytes.
+
+    Returns:
+      False without the _capture extension, or over wifi.
+    """
+    if self._capture is not None:
+      return True
+    if _capture is None or self.wifi:
+      return False
+    # the thread uses usb1's libusb and this handle, so it shares its claim
+    try:
+      bulk_transfer = ctypes.cast(usb1.libusb1.libusb_bulk_transfer, ctypes.c_void_p).value
+      handle = ctypes.cast(self._handle._USBDeviceHandle__handle, ctypes.c_void_p).value
+    except AttributeError:
+      return False
+    cap = _capture.Capture(bulk_transfer, handle, endpoint=0x81, read_len=self.CAPTURE_READ_LEN, slots=reads)
+    cap.start()
+    self._capture = cap
+    return True
+
+  def can_capture_stop(self):
+    # what's still in the ring is dropped
+    if self._capture is not None:
+      self._capture.stop()
+      self._capture = None
+
+  def can_capture_stats(self):
+    # (reads waiting, reads dropped while the ring was full, read errors,
+    # running), running is False once the panda is gone
+    if self._capture is None:
+      return (0, 0, 0, False)
+    return self._capture.stats()
+
+  def can_recv_batch(self, max_reads=0):
+    """Everything the capture thread read since the last call, up to
+    max_reads reads if not 0, as the packed columns of can_buffer_columns.
+    Without a capture running, one read as can_recv_columns.
+    """
+    if self._capture is None:
+      return self._can_parse_columns(self._can_read())
+    cols = [self._can_parse_columns(dat) for dat in self._capture.drain(max_reads)]
+    return {k: b''.join([c[k] for c in cols]) for k in ("addr", "bus", "ts", "dat", "len")}
+
   def can_clear(self, bus):
     """Clears all messages from the specified internal CAN ringbuffer as
     though it were drained.
 
     Args:
-      bus (int): can bus number to clear a tx queue, or 0xFFFF to clear the
-        global can rx queue.
+      bus (int): can bus number to clear a tx queue, or 0xFFFF to clear all
+        the can rx queues.
 
     """
     self._handle.controlWrite(Panda.REQUEST_OUT, 0xf1, bus, 0, b'')
 
+  def set_can_queue_len(self, bus, frames, rx=False):
+    """Re-splits the frame pool the CAN queues share, dropping everything
+    queued. Shrink queues before growing others, a split that doesn't fit is
+    refused.
+
+    Args:
+      bus (int): can bus number of the queue.
+      frames (int): how many frames the queue holds.
+      rx (bool): the bus's rx queue instead of its tx queue.
+
+    Returns:
+      The split after the change, see can_queue_layout.
+    """
+    queue = (0xFF00 | bus) if rx else bus
+    dat = self._handle.controlRead(Panda.REQUEST_IN, 0xff, queue, frames, 0x40)
+    return self._parse_can_queue_layout(dat)
+
+  def can_queue_layout(self):
+    dat = self._handle.controlRead(Panda.REQUEST_IN, 0xff, 0xFFFF, 0, 0x40)
+    return self._parse_can_queue_layout(dat)
+
+  def _parse_can_queue_layout(self, dat):
+    a = struct.unpack("%dH" % (len(dat) // 2), dat)
+    n = (len(a) - 1) // 2
+    return {"rx": list(a[:n]), "tx": list(a[n:2*n]), "free": a[-1]}
+
+  def set_can_tx_priority(self, bus, enable):
+    # send what's queued on the bus by arbitration id, with frames sent to
+    # bus | CAN_TX_URGENT ahead of everything, instead of in order. Drops
+    # what's queued.
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xc3, bus, int(enable), b'')
+
+  def set_can_tx_lanes(self, enable):
+    """Alt setting 2, where can_send_many writes bus 0's frames to EP1 OUT
+    and the other buses' to EP3. A lane's endpoint NAKs while one of its
+    buses' tx queues is full instead of the panda dropping frames, so a
+    backed up bus holds off its own lane only, and can_send_many waits on
+    it. Timed frames, transmit groups and the receive side stay as they are.
+    USB only.
+    """
+    self._handle.setInterfaceAltSetting(0, 2 if enable else 0)
+    self._can_tx_lanes = bool(enable)
+
+  def set_can_rx_weight(self, bus, weight):
+    # frames read from the bus's rx queue before the next bus gets a turn
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xc2, bus, weight, b'')
+
+  def set_can_filters(self, bus, filters):
+    """Only receive the frames on a bus that match one of the filters, in
+    hardware. The ids the safety mode needs are always received.
+
+    Args:
+      bus (int): can bus number.
+      filters (list): (addr, mask) tuples, addrs >= 0x800 are extended. An
+        empty list receives everything.
+
+    """
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xdf, bus, 0, b'')
+    for addr, mask in filters:
+      self._stage_can_filter(addr, mask)
+      self._handle.controlWrite(Panda.REQUEST_OUT, 0xdf, bus, 1, b'')
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xdf, bus, 2, b'')
+
+  def _stage_can_filter(self, addr, mask):
+    # 0xe8/0xe9 take the id and mask in the RIR layout
+    exact = 0xFFFFFFFE
+    extended = 4
+    if addr >= 0x800:
+      rir = (addr << 3) | extended
+      rmask = exact if mask == 0x1FFFFFFF else (mask << 3) | extended
+    else:
+      rir = addr << 21
+      rmask = exact if mask == 0x7FF else (mask << 21) | extended
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xe8, rir & 0xFFFF, rir >> 16, b'')
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xe9, rmask & 0xFFFF, rmask >> 16, b'')
+
+  def add_can_report_rule(self, bus, addr, mask, changed=True, interval_ms=0):
+    """Only pass on the received frames matching addr and mask when their
+    data changed since the last one passed on, and/or once interval_ms passed
+    since then. The first matching rule for a frame is the one used. The
+    safety mode and forwarding still see every frame.
+
+    Args:
+      bus (int): can bus number.
+      addr (int): addrs >= 0x800 are extended.
+      mask (int): 0x7FF or 0x1FFFFFFF for just addr.
+      changed (bool): pass on frames whose data changed.
+      interval_ms (int): 0-32767, 0 for never otherwise.
+
+    """
+    assert changed or interval_ms > 0
+    assert 0 <= interval_ms < 0x8000
+    self._stage_can_filter(addr, mask)
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xf8, bus, interval_ms | (0x8000 if changed else 0), b'')
+
+  def clear_can_report_rules(self):
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xf8, 0xFFFF, 0, b'')
+
+  def set_can_periodic(self, slot, addr, dat, bus, period_ms):
+    """Have the panda send a message every period_ms, until it is stopped
+    with clear_can_periodic. The safety mode still checks every send.
+
+    Args:
+      slot (int): 0-15, replaces the message already in the slot.
+      addr (int): addrs >= 0x800 are extended.
+      dat (bytes): up to 8 bytes.
+      bus (int): can bus number.
+      period_ms (int): 1-65535.
+
+    """
+    assert len(dat) <= 8
+    extended = 4
+    if addr >= 0x800:
+      rir = (addr << 3) | extended
+    else:
+      rir = addr << 21
+    words = struct.unpack("IIII", struct.pack("II", rir, len(dat)) + dat.ljust(8, b'\x00'))
+    for i, word in enumerate(words):
+      self._handle.controlWrite(Panda.REQUEST_OUT, 0xeb, i*2, word & 0xFFFF, b'')
+      self._handle.controlWrite(Panda.REQUEST_OUT, 0xeb, i*2 + 1, word >> 16, b'')
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xec, slot | (bus << 8), period_ms, b'')
+
+  def clear_can_periodic(self, slot=0xFFFF):
+    """Stop the periodic message in a slot, all of them by default."""
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xed, slot, 0, b'')
+
+  # ******************* census *******************
+
+  # board/drivers/can_census.h
+  def can_census_status(self, start=False, stop=False):
+    # start empties the table and counts every id received from then on
+    op = 1 if start else (2 if stop else 0)
+    dat = self._handle.controlRead(Panda.REQUEST_IN, 0xca, op, 0, 16)
+    a = struct.unpack("IIII", dat)
+    return {"on": bool(a[0]), "len": a[1], "missed": a[2], "now": a[3]}
+
+  def can_census_read(self):
+    """The ids received since can_census_status(start=True), in the order
+    they first came, as dicts of addr, bus, count, the min, avg and max
+    period in us, the last dlc, the dlcs seen, the last data and its time."""
+    ret = []
+    while True:
+      dat = bytes(self._handle.controlRead(Panda.REQUEST_IN, 0xcb, len(ret) & 0xFFFF, len(ret) >> 16, 0x40))
+      if len(dat) < 40:
+        break
+      rir, bus, dlc, dlcs, count, last_ts, min_p, max_p, sum_p, rdlr, rdhr = struct.unpack("<IBBHIIIIQII", dat[:40])
+      ret.append({"addr": (rir >> 3) if (rir & 4) else (rir >> 21), "bus": bus, "count": count,
+                  "min_period": min_p if count > 1 else None, "max_period": max_p if count > 1 else None,
+                  "avg_period": sum_p / (count - 1) if count > 1 else None,
+                  "dlc": dlc, "dlcs": [n for n in range(9) if dlcs & (1 << n)],
+                  "dat": struct.pack("<II", rdlr, rdhr)[:dlc], "ts": last_ts})
+    return ret
+
+  # ******************* capture *******************
+
+  # board/drivers/can.h
+  CAPTURE_STATES = ["OFF", "ARMED", "TRIGGERED", "DONE"]
+  CAPTURE_ON_FRAME = 1
+  CAPTURE_ON_ERROR = 2
+  CAPTURE_ON_HOST = 4
+
+  def can_capture_arm(self, post, addr=None, mask=0x7FF, dat=b'', dat_mask=None, on_error=False, bus=0xFF):
+    """Record every frame received or sent on the panda, until the trigger
+    and post frames after it. The host can always trigger it with
+    can_capture_status(trigger=True).
+
+    Args:
+      post (int): frames kept after the trigger, the rest of the 4096 are
+        the ones before.
+      addr (int): trigger on the frames matching addr and mask, None for no
+        frame trigger. addrs >= 0x800 are extended.
+      mask (int): 0x7FF or 0x1FFFFFFF for just addr.
+      dat (bytes): the trigger frame's data starts with these.
+      dat_mask (bytes): which bits of dat have to match, all by default.
+      on_error (bool): trigger on a CAN error interrupt.
+      bus (int): trigger on this bus only, 0xFF for any. Sent frames have
+        0x80 set.
+
+    """
+    assert len(dat) <= 8
+    sources = self.CAPTURE_ON_ERROR if on_error else 0
+    if addr is not None:
+      sources |= self.CAPTURE_ON_FRAME
+      self._stage_can_filter(addr, mask)
+      if dat_mask is None:
+        dat_mask = b'\xff' * len(dat)
+      words = struct.unpack("IIII", bytes(dat).ljust(8, b'\x00') + bytes(dat_mask).ljust(8, b'\x00'))
+      for i, word in enumerate(words):
+        self._handle.controlWrite(Panda.REQUEST_OUT, 0xf9, i*2, word & 0xFFFF, b'')
+        self._handle.controlWrite(Panda.REQUEST_OUT, 0xf9, i*2 + 1, word >> 16, b'')
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xfa, post, sources | (bus << 8), b'')
+
+  def can_capture_status(self, trigger=False, stop=False):
+    op = 1 if trigger else (2 if stop else 0)
+    dat = self._handle.controlRead(Panda.REQUEST_IN, 0xfb, op, 0, 16)
+    a = struct.unpack("BBHIII", dat)
+    return {"state": self.CAPTURE_STATES[a[0]], "source": a[1],
+            "len": a[3], "pre": a[4], "trigger_ts": a[5]}
+
+  def can_capture_read(self):
+    """Reads what a done or stopped capture kept, oldest first, as the
+    (addr, ts, dat, bus) of can_recv with the panda timestamp. The frames
+    before the trigger are the first can_capture_status()["pre"]."""
+    ret = []
+    while True:
+      dat = bytes(self._handle.controlRead(Panda.REQUEST_IN, 0xfc, len(ret) & 0xFFFF, len(ret) >> 16, 0x40))
+      if len(dat) == 0:
+        break
+      ret += parse_can_buffer_ts(dat)
+    return ret
+
+  # ******************* replay *******************
+
+  # board/drivers/can_replay.h
+  CAN_REPLAY_STATES = ["OFF", "LOADING", "PLAYING"]
+
+  def can_replay_status(self, op=0):
+    # op 1 starts loading, 2 plays, 3 stops, before the status is read
+    dat = self._handle.controlRead(Panda.REQUEST_IN, 0xfd, op, 0, 20)
+    a = struct.unpack("IIIII", dat)
+    return {"state": self.CAN_REPLAY_STATES[a[0]], "queued": a[1], "sent": a[2],
+            "late_max_us": a[3], "dropped": a[4]}
+
+  def can_replay(self, msgs, prefill=0x3F):
+    """Has the panda send the (addr, ts, dat, bus) frames at the times in
+    ts, in us. It returns once the last frame is on the panda, which sends it
+    at its time, can_replay_status says when it's done. The safety mode checks
+    every frame. USB only.
+
+    Args:
+      msgs (list): as from can_recv, in time order.
+      prefill (int): frames loaded before it starts playing, the panda's
+        ring holds 0x40 or more.
+
+    """
+    assert not self.wifi
+    recs = []
+    last = msgs[0][1] if len(msgs) else 0
+    for addr, ts, dat, bus in msgs:
+      recs.append(pack_can_buffer([(addr, None, dat, bus)]) + struct.pack("I", (ts - last) & 0xFFFFFFFF))
+      last = ts
+    # three to a packet, full ones padded so a record never spans two
+    pkts = [b''.join(recs[i:i+3]) for i in range(0, len(recs), 3)]
+    pkts = [pkt.ljust(0x40, b'\x00') if len(pkt) == 0x3C else pkt for pkt in pkts]
+
+    self.can_replay_status(1)
+    n = prefill // 3
+    if n > 0 and len(pkts) > 0:
+      self._handle.bulkWrite(3, b''.join(pkts[:n]))
+    self.can_replay_status(2)
+    # the panda NAKs while its ring is full
+    for pkt in pkts[n:]:
+      self._handle.bulkWrite(3, pkt)
+
+  def can_replay_stop(self):
+    return self.can_replay_status(3)
+
   # ******************* isotp *******************
 
   def isotp_send(self, addr, dat, bus, recvaddr=None, subaddr=None):
@@ -466,6 +1543,47 @@ class Panda(object):
       ret += self._handle.bulkWrite(2, struct.pack("B", port_number) + ln[i:i+0x20])
     return ret
 
+  def serial_stream(self, port_numbers):
+    """Streams the rx of the ports on bulk endpoint 2, so it flows as it
+    arrives instead of waiting to be polled. serial_read no longer sees it.
+
+    Args:
+      port_numbers (list): of SERIAL_ESP, SERIAL_LIN1 and SERIAL_LIN2, empty
+        to stop streaming.
+
+    """
+    mask = 0
+    for port_number in port_numbers:
+      mask |= 1 << port_number
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xf4, mask, 0, b'')
+
+  def _ep2_read(self, timeout):
+    """Reads ep2 IN, keeping the ISO-TP channels' packets apart from the
+    serial streams' for the other reader."""
+    try:
+      dat = self._handle.bulkRead(2, 0x40*16, timeout)
+    except usb1.USBErrorTimeout as e:
+      # full packets that came before the timeout
+      dat = getattr(e, "received", b'')
+    for i in range(0, len(dat), 0x40):
+      pkt = bytearray(dat[i:i+0x40])
+      if (pkt[0] & 0xA0) == 0xA0:
+        self._ep2_isotp.append(pkt)
+      else:
+        self._ep2_serial.append(pkt)
+
+  def serial_read_stream(self, timeout=10):
+    """Returns a dict of port number to the data it streamed, waiting up to
+    timeout ms for some."""
+    if len(self._ep2_serial) == 0:
+      self._ep2_read(timeout)
+    ret = {}
+    # each packet is the port number then its data
+    for pkt in self._ep2_serial:
+      ret[pkt[0]] = ret.get(pkt[0], b'') + bytes(pkt[1:])
+    self._ep2_serial = []
+    return ret
+
   def serial_clear(self, port_number):
     """Clears all messages (tx and rx) from the specified internal uart
     ringbuffer as though it were drained.
@@ -534,3 +1652,401 @@ class Panda(object):
     msg += self.kline_ll_recv(ord(msg[1])-2, bus=bus)
     return msg
 
+  # message mode, the panda does the timing, checksum and echo
+  KLINE_MODE_MESSAGE = 1
+  KLINE_MODE_FAST_INIT = 2
+  KLINE_MODE_NEG_CHECKSUM = 4
+
+  KLINE_STATUS_OK = 0
+  KLINE_STATUS_CHECKSUM = 1
+  KLINE_STATUS_TIMEOUT = 2
+  KLINE_STATUS_ECHO = 3
+  KLINE_STATUS_INCOMPLETE = 4
+
+  def kline_set_mode(self, bus=2, message=True, fast_init=False, neg_checksum=True):
+    """Switches a K/L line between raw serial and KWP2000 messages.
+
+    Args:
+      bus (int): 2 for the K-line, 3 for the L-line.
+      message (bool): False gives the line back to serial_read/kline_send.
+      fast_init (bool): do the 25 ms wakeup before the next message.
+      neg_checksum (bool): the checksum is the negated sum, as Honda does.
+
+    """
+    mode = 0
+    if message:
+      mode |= self.KLINE_MODE_MESSAGE
+      if fast_init:
+        mode |= self.KLINE_MODE_FAST_INIT
+      if neg_checksum:
+        mode |= self.KLINE_MODE_NEG_CHECKSUM
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xf3, bus, mode, b'')
+
+  def kline_send_msg(self, msg, bus=2):
+    """Sends one request without its checksum, needs kline_set_mode first."""
+    for i in range(0, len(msg), 0x3f):
+      flag = 0x80 | bus
+      if i + 0x3f < len(msg):
+        flag |= 0x40
+      self._handle.bulkWrite(2, struct.pack("B", flag) + msg[i:i+0x3f])
+
+  def kline_recv_msg(self, bus=2, timeout=1.0):
+    """Returns a list of (status, msg), msg without its checksum.
+
+    Waits up to timeout seconds for the first record."""
+    dat = b''
+    ret = []
+    start = time.time()
+    while True:
+      r = bytes(self._handle.controlRead(Panda.REQUEST_IN, 0xe0, bus, 0, 0x40))
+      dat += r
+      while len(dat) >= 3:
+        status, ln = struct.unpack("<BH", dat[:3])
+        if len(dat) < 3 + ln:
+          break
+        ret.append((status, dat[3:3+ln]))
+        dat = dat[3+ln:]
+      if len(r) == 0 and len(dat) == 0 and (len(ret) > 0 or time.time() - start > timeout):
+        break
+    return ret
+
+  # ******************* isotp channels *******************
+
+  # the ISO-TP engine on the panda, isotp_send/isotp_recv above are the host's
+  ISOTP_CHANNELS = 4
+
+  ISOTP_PARAM_OPEN = 0
+  ISOTP_PARAM_BUS = 1
+  ISOTP_PARAM_TX_ID_LO = 2
+  ISOTP_PARAM_TX_ID_HI = 3
+  ISOTP_PARAM_RX_ID_LO = 4
+  ISOTP_PARAM_RX_ID_HI = 5
+  ISOTP_PARAM_PAD = 6
+  ISOTP_PARAM_BS = 7
+  ISOTP_PARAM_STMIN = 8
+
+  ISOTP_STATUS_RX = 0
+  ISOTP_STATUS_TX_DONE = 1
+  ISOTP_STATUS_TX_BUSY = 2
+  ISOTP_STATUS_TX_TIMEOUT = 3
+  ISOTP_STATUS_TX_OVERFLOW = 4
+  ISOTP_STATUS_TX_BLOCKED = 5
+  ISOTP_STATUS_RX_TIMEOUT = 6
+  ISOTP_STATUS_RX_SEQUENCE = 7
+  ISOTP_STATUS_RX_OVERFLOW = 8
+
+  def _isotp_param(self, channel, param, value):
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xc6, channel | (param << 8), value, b'')
+
+  def isotp_channel_open(self, channel, bus, tx_addr, rx_addr, extended=False, padding=None, block_size=0, stmin=0):
+    """Opens an ISO-TP channel, the panda does the flow control and the
+    consecutive frames, the host only sees PDUs.
+
+    Args:
+      channel (int): 0 to ISOTP_CHANNELS-1.
+      bus (int): the CAN bus.
+      tx_addr (int): the id the panda sends on.
+      rx_addr (int): the id the peer answers on.
+      extended (bool): the ids are 29 bit.
+      padding (int): the byte frames are padded to 8 bytes with, None sends
+        them short.
+      block_size (int): of the flow control the panda sends, 0 for all.
+      stmin (int): of the flow control the panda sends, as sent.
+
+    """
+    def rir(addr):
+      return (addr << 3) | 4 if extended else addr << 21
+    self._isotp_param(channel, self.ISOTP_PARAM_OPEN, 0)
+    self._isotp_param(channel, self.ISOTP_PARAM_BUS, bus)
+    self._isotp_param(channel, self.ISOTP_PARAM_TX_ID_LO, rir(tx_addr) & 0xFFFF)
+    self._isotp_param(channel, self.ISOTP_PARAM_TX_ID_HI, rir(tx_addr) >> 16)
+    self._isotp_param(channel, self.ISOTP_PARAM_RX_ID_LO, rir(rx_addr) & 0xFFFF)
+    self._isotp_param(channel, self.ISOTP_PARAM_RX_ID_HI, rir(rx_addr) >> 16)
+    self._isotp_param(channel, self.ISOTP_PARAM_PAD, 0 if padding is None else 0x100 | padding)
+    self._isotp_param(channel, self.ISOTP_PARAM_BS, block_size)
+    self._isotp_param(channel, self.ISOTP_PARAM_STMIN, stmin)
+    self._isotp_param(channel, self.ISOTP_PARAM_OPEN, 1)
+
+  def isotp_channel_close(self, channel):
+    self._isotp_param(channel, self.ISOTP_PARAM_OPEN, 0)
+
+  def isotp_channel_send(self, channel, dat):
+    """Sends one PDU, up to 4095 bytes. Its ISOTP_STATUS_TX_DONE comes back
+    through isotp_channel_recv."""
+    i = 0
+    while True:
+      flag = 0xA0 | channel
+      if i + 0x3f < len(dat):
+        flag |= 0x40
+      self._handle.bulkWrite(2, struct.pack("B", flag) + dat[i:i+0x3f])
+      i += 0x3f
+      if i >= len(dat):
+        break
+
+  def isotp_channel_recv(self, channel, timeout=1.0):
+    """Returns a list of (status, pdu), pdu empty for all but ISOTP_STATUS_RX.
+
+    Waits up to timeout seconds for the first record."""
+    dat = b''
+    ret = []
+    start = time.time()
+    while True:
+      if len(self._ep2_isotp) == 0:
+        self._ep2_read(10)
+      keep = []
+      for pkt in self._ep2_isotp:
+        if (pkt[0] & 0x1F) == channel:
+          dat += bytes(pkt[1:])
+        else:
+          keep.append(pkt)
+      self._ep2_isotp = keep
+      while len(dat) >= 3:
+        status, ln = struct.unpack("<BH", dat[:3])
+        if len(dat) < 3 + ln:
+          break
+        ret.append((status, dat[3:3+ln]))
+        dat = dat[3+ln:]
+      if len(dat) == 0 and (len(ret) > 0 or time.time() - start > timeout):
+        break
+    return ret
+
+  def isotp_channel_status(self, channel):
+    """Returns the channel's open, tx_state, tx_pdus, rx_pdus, tx_errors,
+    rx_errors, records_lost and queued."""
+    dat = self._handle.controlRead(Panda.REQUEST_IN, 0xc7, channel, 0, 0x20)
+    return struct.unpack("<8I", dat)
+
+  # ******************* ECU emulation *******************
+
+  # board/drivers/can_responder.h
+  ECU_ENTRIES = 8
+  ECU_FRAMES = 4
+
+  ECU_PARAM_ON = 0
+  ECU_PARAM_BUS = 1
+  ECU_PARAM_ID_LO = 2
+  ECU_PARAM_ID_HI = 3
+  ECU_PARAM_LEN = 4
+  ECU_PARAM_DELAY = 5
+  ECU_PARAM_GAP = 6
+  ECU_PARAM_FRAMES = 7
+  ECU_PARAM_DATA = 8
+  ECU_PARAM_FRAME = 16
+
+  def _ecu_param(self, entry, param, value):
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xee, entry | (param << 8), value, b'')
+
+  def set_ecu_response(self, entry, bus, addr, request, response, delay_us=1000, gap_us=0, mask=None, min_len=None):
+    """Has the panda answer a request on the bus itself, from its CAN RX IRQ,
+    so the answer's timing has no USB or host in it. The request still comes
+    up like any frame.
+
+    Args:
+      entry (int): 0 to ECU_ENTRIES-1, the first one that matches answers.
+      bus (int): the CAN bus of the request and the answer.
+      addr (int): the request's id, 29 bit if it's over 0x7FF.
+      request (bytes): the data the request starts with.
+      response (list): up to ECU_FRAMES (addr, dat) frames sent in order.
+      delay_us (int): from the request to the first frame, up to 65535.
+      gap_us (int): between the frames, the STmin of a multi frame answer.
+      mask (bytes): of each byte of request that has to match, all by default.
+      min_len (int): the request's least length, len(request) by default.
+
+    """
+    def rir(a):
+      return (a << 3) | 4 if a > 0x7FF else a << 21
+    assert len(request) <= 8 and len(response) <= self.ECU_FRAMES
+    if mask is None:
+      mask = b'\xff' * len(request)
+    self._ecu_param(entry, self.ECU_PARAM_ON, 0)
+    self._ecu_param(entry, self.ECU_PARAM_BUS, bus)
+    self._ecu_param(entry, self.ECU_PARAM_ID_LO, rir(addr) & 0xFFFF)
+    self._ecu_param(entry, self.ECU_PARAM_ID_HI, rir(addr) >> 16)
+    self._ecu_param(entry, self.ECU_PARAM_LEN, len(request) if min_len is None else min_len)
+    self._ecu_param(entry, self.ECU_PARAM_DELAY, delay_us)
+    self._ecu_param(entry, self.ECU_PARAM_GAP, gap_us)
+    pattern = bytearray(request.ljust(8, b'\x00'))
+    masks = bytearray(mask.ljust(8, b'\x00'))
+    for i in range(8):
+      self._ecu_param(entry, self.ECU_PARAM_DATA + i, pattern[i] | (masks[i] << 8))
+    self._ecu_param(entry, self.ECU_PARAM_FRAMES, len(response))
+    for j, (a, dat) in enumerate(response):
+      words = struct.unpack("IIII", struct.pack("II", rir(a), len(dat)) + dat.ljust(8, b'\x00'))
+      for i, word in enumerate(words):
+        self._ecu_param(entry, self.ECU_PARAM_FRAME + j*8 + i*2, word & 0xFFFF)
+        self._ecu_param(entry, self.ECU_PARAM_FRAME + j*8 + i*2 + 1, word >> 16)
+    self._ecu_param(entry, self.ECU_PARAM_ON, 1)
+
+  def clear_ecu_response(self, entry=None):
+    """Stops an entry answering, all of them by default."""
+    for e in (range(self.ECU_ENTRIES) if entry is None else [entry]):
+      self._ecu_param(e, self.ECU_PARAM_ON, 0)
+
+  def ecu_response_status(self, entry):
+    """Returns the entry's on, requests answered, frames scheduled and frames
+    dropped because the panda's scheduled queue was full."""
+    dat = self._handle.controlRead(Panda.REQUEST_IN, 0xef, entry, 0, 0x10)
+    a = struct.unpack("<4I", dat)
+    return {"on": bool(a[0]), "requests": a[1], "scheduled": a[2], "dropped": a[3]}
+
+
+  # ******************* gateway *******************
+
+  # board/drivers/can_gateway.h
+  GATEWAY_RULES = 32
+  GATEWAY_DROP = 0xFF
+
+  GATEWAY_REWRITE_ID = 1
+  GATEWAY_REWRITE_DATA = 2
+
+  GATEWAY_PARAM_BUS = 0
+  GATEWAY_PARAM_ID_LO = 1
+  GATEWAY_PARAM_ID_HI = 2
+  GATEWAY_PARAM_TO_BUS = 3
+  GATEWAY_PARAM_FLAGS = 4
+  GATEWAY_PARAM_NEW_ID_LO = 5
+  GATEWAY_PARAM_NEW_ID_HI = 6
+  GATEWAY_PARAM_INTERVAL = 7
+  GATEWAY_PARAM_DATA = 8
+  GATEWAY_PARAM_ADD = 0x80
+  GATEWAY_PARAM_REMOVE = 0x81
+  GATEWAY_PARAM_CLEAR = 0x82
+  GATEWAY_PARAM_LOAD = 0x83
+
+  def _gateway_param(self, param, value):
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xa0, param, value, b'')
+
+  def set_can_gateway(self, rules):
+    """Replaces the panda's gateway rules, which decide from its CAN RX IRQ
+    what's forwarded of the ids they're for. Other ids are forwarded as
+    before, by set_can_forwarding or the safety mode, and every frame still
+    comes up as it was received. What a rule forwards still goes through the
+    safety mode's tx hook.
+
+    Args:
+      rules (list): up to GATEWAY_RULES dicts, the last one for a bus and
+        addr wins. Each has
+          bus (int): where the frames are received.
+          addr (int): their id, 29 bit if it's over 0x7FF.
+          to_bus (int): where they're forwarded, None drops them.
+          new_addr (int): the id they're forwarded with, theirs if None.
+          dat (bytes): data bytes forwarded instead of theirs...
+          mask (bytes): ...where each has bits, all of dat's by default.
+          interval_ms (int): forwards at most one of them an interval.
+
+    """
+    def rir(a):
+      return (a << 3) | 4 if a > 0x7FF else a << 21
+    assert len(rules) <= self.GATEWAY_RULES
+    self._gateway_param(self.GATEWAY_PARAM_CLEAR, 0)
+    for r in rules:
+      to_bus = r.get("to_bus")
+      new_addr = r.get("new_addr")
+      dat = r.get("dat", b'')
+      mask = r.get("mask", b'\xff' * len(dat))
+      flags = (self.GATEWAY_REWRITE_ID if new_addr is not None else 0) | (self.GATEWAY_REWRITE_DATA if dat else 0)
+      self._gateway_param(self.GATEWAY_PARAM_BUS, r["bus"])
+      self._gateway_param(self.GATEWAY_PARAM_ID_LO, rir(r["addr"]) & 0xFFFF)
+      self._gateway_param(self.GATEWAY_PARAM_ID_HI, rir(r["addr"]) >> 16)
+      self._gateway_param(self.GATEWAY_PARAM_TO_BUS, self.GATEWAY_DROP if to_bus is None else to_bus)
+      self._gateway_param(self.GATEWAY_PARAM_FLAGS, flags)
+      if new_addr is not None:
+        self._gateway_param(self.GATEWAY_PARAM_NEW_ID_LO, rir(new_addr) & 0xFFFF)
+        self._gateway_param(self.GATEWAY_PARAM_NEW_ID_HI, rir(new_addr) >> 16)
+      self._gateway_param(self.GATEWAY_PARAM_INTERVAL, r.get("interval_ms", 0))
+      pattern = bytearray(dat.ljust(8, b'\x00'))
+      masks = bytearray(mask.ljust(8, b'\x00'))
+      for i in range(8):
+        self._gateway_param(self.GATEWAY_PARAM_DATA + i, pattern[i] | (masks[i] << 8))
+      self._gateway_param(self.GATEWAY_PARAM_ADD, 0)
+    staged = struct.unpack("<3I", self._handle.controlRead(Panda.REQUEST_IN, 0xa1, 0xFFFF, 0, 0xc))[1]
+    assert staged == len(set((r["bus"], rir(r["addr"])) for r in rules)), "gateway rule refused"
+    self._gateway_param(self.GATEWAY_PARAM_LOAD, 0)
+
+  def clear_can_gateway(self):
+    self.set_can_gateway([])
+
+  def can_gateway_stats(self):
+    """Returns a dict for each loaded rule, by bus and id: the frames it
+    had, forwarded, dropped for its interval and refused by the safety mode
+    or a full TX queue, and the last and most us from receiving one to it
+    being handed to the TX mailbox or queue."""
+    n = struct.unpack("<3I", self._handle.controlRead(Panda.REQUEST_IN, 0xa1, 0xFFFF, 0, 0xc))[0]
+    ret = []
+    for i in range(n):
+      dat = self._handle.controlRead(Panda.REQUEST_IN, 0xa1, i, 0, 0x20)
+      a = struct.unpack("<BBHI6I", dat)
+      rir = a[3]
+      addr = rir >> 3 if rir & 4 else rir >> 21
+      ret.append({"bus": a[0], "addr": addr, "to_bus": None if a[1] == self.GATEWAY_DROP else a[1],
+                  "hits": a[4], "forwarded": a[5], "limited": a[6], "blocked": a[7],
+                  "latency_last_us": a[8], "latency_max_us": a[9]})
+    return ret
+
+  # board/drivers/can_autobaud.h
+  AUTOBAUD_RATES = 6
+  AUTOBAUD_IDLE = 0
+  AUTOBAUD_TRYING = 1
+  AUTOBAUD_FOUND = 2
+  AUTOBAUD_NONE = 3
+
+  def _can_autobaud_status(self, value=0, index=0):
+    dat = self._handle.controlRead(Panda.REQUEST_IN, 0xa2, value, index, 0x40)
+    trying, cans, dwell_ms = struct.unpack("<BBH", dat[:4])
+    ret = []
+    for i in range(cans):
+      c = dat[4 + i * (4 + 2 * self.AUTOBAUD_RATES):4 + (i + 1) * (4 + 2 * self.AUTOBAUD_RATES)]
+      bus, state, speed = struct.unpack("<BBH", c[:4])
+      ret.append({"bus": bus, "state": state, "speed": speed / 10.0 if state == self.AUTOBAUD_FOUND else None,
+                  "frames": list(bytearray(c[4:4 + self.AUTOBAUD_RATES])),
+                  "errors": list(bytearray(c[4 + self.AUTOBAUD_RATES:]))})
+    return trying, dwell_ms, ret
+
+  def can_autobaud(self, dwell_ms=0, timeout=2.):
+    """Has the panda find the bitrate of each CAN's bus, listening only, and
+    keep it. Rates are tried for dwell_ms each, or the firmware's 50 ms, and
+    a busy bus is usually done in a few ms a rate. Returns the bus numbers'
+    kbps, None for the buses that had nothing; those keep the rate they had.
+    A timeout stops it and raises."""
+    self._can_autobaud_status(1, dwell_ms)
+    end = time.time() + timeout
+    while True:
+      trying, _, cans = self._can_autobaud_status()
+      if trying == 0:
+        return {c["bus"]: c["speed"] for c in cans}
+      if time.time() > end:
+        self._can_autobaud_status(2)
+        raise Exception("autobaud: still trying after %.1f s" % timeout)
+      time.sleep(0.01)
+
+  def can_autobaud_stats(self):
+    """The last detection's state of each bus, the rate it found and the
+    frames and errors it had at each rate it tried."""
+    return self._can_autobaud_status()[2]
+
+  # board/drivers/usb_flush.h
+  FLUSH_SOF = 0x8000
+
+  def set_can_rx_flush(self, fill=0, deadline_us=0, sof=False):
+    """When the panda gives the host what it received, until the USB device
+    is reset. With all the defaults it's at each read, the lowest latency.
+    fill holds frames until that many are queued, deadline_us until the
+    oldest has waited that long, and sof has at most one read a ms answered.
+    A fill alone waits at most 100 ms. A held read comes back empty."""
+    assert 0 <= fill < self.FLUSH_SOF and 0 <= deadline_us <= 0xFFFF
+    self._handle.controlRead(Panda.REQUEST_IN, 0xa3, fill | (self.FLUSH_SOF if sof else 0), deadline_us, 0x18)
+
+  def can_rx_flush_stats(self):
+    """The policy, and since it was set the reads answered with frames,
+    their bytes, the ones held, and the most us a frame waited for its read."""
+    a = struct.unpack("<HHI4I", self._handle.controlRead(Panda.REQUEST_IN, 0xa3, 0xFFFF, 0, 0x18))
+    return {"fill": a[0] & ~self.FLUSH_SOF, "sof": (a[0] & self.FLUSH_SOF) != 0, "deadline_us": a[2],
+            "transfers": a[3], "bytes": a[4], "held": a[5], "age_max_us": a[6]}
+
+  def can_tx_defer_stats(self):
+    """CAN tx packets staged by the USB IRQ for PendSV since boot, the ones
+    that found the ring full, the times an endpoint NAKed for it, the deepest
+    and longest it got, and what's staged on ep1 and ep3 now."""
+    a = struct.unpack("<5I4B", self._handle.controlRead(Panda.REQUEST_IN, 0xa4, 0, 0, 0x18))
+    return {"packets": a[0], "overruns": a[1], "held": a[2], "depth_max": a[3], "delay_max_us": a[4],
+            "staged": [a[5], a[6]], "ring_len": a[7]}
@@ -0,0 +1,372 @@
+// Compiled versions of the CAN buffer helpers in __init__.py. They return the
+// same values as the Python ones, which stay as the fallback when this isn't built.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <stdint.h>
+#include <string.h>
+
+// bytes-like arguments
+#if PY_MAJOR_VERSION >= 3
+  #define BUF "y*"
+#else
+  #define BUF "s*"
+#endif
+
+#define CAN_REC_LEN 0x10
+#define CAN_TS_REC_LEN 0x14
+#define USB_PACKET_LEN 0x40
+
+#define CAN_TRANSMIT 1
+#define CAN_EXTENDED 4
+#define EVENT_BUS 0x7F
+#define CAN_TX_DONE 0x40
+
+static uint32_t get_u32(const uint8_t *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+  p[0] = v & 0xFF;
+  p[1] = (v >> 8) & 0xFF;
+  p[2] = (v >> 16) & 0xFF;
+  p[3] = (v >> 24) & 0xFF;
+}
+
+// the event stream's records have the whole time in RDHR, see Panda.set_event_stream
+static uint32_t rec_time(const uint8_t *rec) {
+  uint32_t f2 = get_u32(rec + 4);
+  if (((f2 >> 4) & 0xFF) == EVENT_BUS && (rec[0] & CAN_TRANSMIT)) return get_u32(rec + 12);
+  return f2 >> 16;
+}
+
+// calls rec for every record in the buffer, with timestamps three 0x14 byte
+// records to each 0x40 byte packet
+typedef int (*rec_fn)(void *ctx, const uint8_t *rec, uint32_t ts);
+
+static int for_each_record(const uint8_t *buf, Py_ssize_t len, int timestamps, rec_fn rec, void *ctx) {
+  Py_ssize_t i, j;
+  if (!timestamps) {
+    for (j = 0; j + CAN_REC_LEN <= len; j += CAN_REC_LEN) {
+      if (rec(ctx, buf + j, rec_time(buf + j)) < 0) return -1;
+    }
+    return 0;
+  }
+  for (i = 0; i < len; i += USB_PACKET_LEN) {
+    Py_ssize_t plen = (len - i < USB_PACKET_LEN) ? (len - i) : USB_PACKET_LEN;
+    for (j = 0; j + CAN_TS_REC_LEN <= plen; j += CAN_TS_REC_LEN) {
+      if (rec(ctx, buf + i + j, get_u32(buf + i + j + CAN_REC_LEN)) < 0) return -1;
+    }
+  }
+  return 0;
+}
+
+static uint32_t rec_address(const uint8_t *rec) {
+  uint32_t f1 = get_u32(rec);
+  return (f1 & CAN_EXTENDED) ? (f1 >> 3) : (f1 >> 21);
+}
+
+// TXRQ outside the event stream is a completion, see Panda.set_can_echo. Its
+// bus gets CAN_TX_DONE and its data is the 2 byte token.
+static uint32_t rec_bus(const uint8_t *rec, Py_ssize_t *dlen) {
+  uint32_t f2 = get_u32(rec + 4);
+  uint32_t bus = (f2 >> 4) & 0xFF;
+  *dlen = ((f2 & 0xF) > 8) ? 8 : (f2 & 0xF);
+  if (bus != EVENT_BUS && (rec[0] & CAN_TRANSMIT)) {
+    *dlen = 2;
+    bus |= CAN_TX_DONE;
+  }
+  return bus;
+}
+
+// *** list of (address, time, dat, bus) tuples ***
+
+typedef struct {
+  PyObject *list;
+  int bytearray; // dat slices have the type of the input, as they do in Python
+} tuple_ctx;
+
+static int append_tuple(void *vctx, const uint8_t *rec, uint32_t ts) {
+  tuple_ctx *ctx = vctx;
+  Py_ssize_t dlen;
+  uint32_t bus = rec_bus(rec, &dlen);
+  PyObject *dat, *tup;
+  int err;
+
+  dat = ctx->bytearray ? PyByteArray_FromStringAndSize((const char *)rec + 8, dlen) :
+                         PyBytes_FromStringAndSize((const char *)rec + 8, dlen);
+  if (dat == NULL) return -1;
+  tup = Py_BuildValue("(kkNk)", (unsigned long)rec_address(rec), (unsigned long)ts, dat,
+                      (unsigned long)bus);
+  if (tup == NULL) return -1;
+  err = PyList_Append(ctx->list, tup);
+  Py_DECREF(tup);
+  return err;
+}
+
+static PyObject *parse_tuples(PyObject *args, int timestamps) {
+  Py_buffer view;
+  PyObject *obj;
+  tuple_ctx ctx;
+
+  if (!PyArg_ParseTuple(args, "O", &obj)) return NULL;
+  if (PyObject_GetBuffer(obj, &view, PyBUF_SIMPLE) < 0) return NULL;
+
+  ctx.bytearray = PyByteArray_Check(obj);
+  ctx.list = PyList_New(0);
+  if (ctx.list != NULL &&
+      for_each_record(view.buf, view.len, timestamps, append_tuple, &ctx) < 0) {
+    Py_CLEAR(ctx.list);
+  }
+  PyBuffer_Release(&view);
+  return ctx.list;
+}
+
+static PyObject *canbuf_parse_can_buffer(PyObject *self, PyObject *args) {
+  return parse_tuples(args, 0);
+}
+
+static PyObject *canbuf_parse_can_buffer_ts(PyObject *self, PyObject *args) {
+  return parse_tuples(args, 1);
+}
+
+// *** columns ***
+
+typedef struct {
+  uint8_t *addr;
+  uint8_t *bus;
+  uint8_t *ts;
+  uint8_t *dat;
+  uint8_t *len;
+  Py_ssize_t n;
+} column_ctx;
+
+static int fill_columns(void *vctx, const uint8_t *rec, uint32_t ts) {
+  column_ctx *ctx = vctx;
+  Py_ssize_t dlen;
+  uint32_t bus = rec_bus(rec, &dlen);
+  Py_ssize_t n = ctx->n++;
+
+  // native byte order, like numpy.frombuffer expects. bytes data has no
+  // alignment guarantee, so the 32 bit values are copied in.
+  uint32_t addr = rec_address(rec);
+  memcpy(ctx->addr + n * 4, &addr, 4);
+  ctx->bus[n] = bus;
+  memcpy(ctx->ts + n * 4, &ts, 4);
+  memcpy(ctx->dat + n * 8, rec + 8, dlen);
+  memset(ctx->dat + n * 8 + dlen, 0, 8 - dlen);
+  ctx->len[n] = dlen;
+  return 0;
+}
+
+static PyObject *canbuf_parse_can_buffer_columns(PyObject *self, PyObject *args) {
+  Py_buffer view;
+  int timestamps = 0;
+  Py_ssize_t n;
+  PyObject *cols[5] = {NULL};
+  PyObject *ret = NULL;
+  column_ctx ctx;
+  int i;
+
+  if (!PyArg_ParseTuple(args, BUF "|i", &view, &timestamps)) return NULL;
+
+  if (timestamps) {
+    n = (view.len / USB_PACKET_LEN) * (USB_PACKET_LEN / CAN_TS_REC_LEN) +
+        (view.len % USB_PACKET_LEN) / CAN_TS_REC_LEN;
+  } else {
+    n = view.len / CAN_REC_LEN;
+  }
+
+  cols[0] = PyBytes_FromStringAndSize(NULL, n * 4);
+  cols[1] = PyBytes_FromStringAndSize(NULL, n);
+  cols[2] = PyBytes_FromStringAndSize(NULL, n * 4);
+  cols[3] = PyBytes_FromStringAndSize(NULL, n * 8);
+  cols[4] = PyBytes_FromStringAndSize(NULL, n);
+  for (i = 0; i < 5; i++) {
+    if (cols[i] == NULL) goto done;
+  }
+
+  ctx.addr = (uint8_t *)PyBytes_AS_STRING(cols[0]);
+  ctx.bus = (uint8_t *)PyBytes_AS_STRING(cols[1]);
+  ctx.ts = (uint8_t *)PyBytes_AS_STRING(cols[2]);
+  ctx.dat = (uint8_t *)PyBytes_AS_STRING(cols[3]);
+  ctx.len = (uint8_t *)PyBytes_AS_STRING(cols[4]);
+  ctx.n = 0;
+  for_each_record(view.buf, view.len, timestamps, fill_columns, &ctx);
+
+  ret = Py_BuildValue("{sOsOsOsOsO}", "addr", cols[0], "bus", cols[1], "ts", cols[2],
+                      "dat", cols[3], "len", cols[4]);
+
+done:
+  for (i = 0; i < 5; i++) {
+    Py_XDECREF(cols[i]);
+  }
+  PyBuffer_Release(&view);
+  return ret;
+}
+
+// *** packing ***
+
+static PyObject *canbuf_pack_can_buffer(PyObject *self, PyObject *args) {
+  PyObject *arr, *seq, *ret;
+  Py_ssize_t n, i;
+  uint8_t *out;
+
+  if (!PyArg_ParseTuple(args, "O", &arr)) return NULL;
+  seq = PySequence_Fast(arr, "expected a sequence of (addr, _, dat, bus)");
+  if (seq == NULL) return NULL;
+
+  n = PySequence_Fast_GET_SIZE(seq);
+  ret = PyBytes_FromStringAndSize(NULL, n * CAN_REC_LEN);
+  if (ret == NULL) goto fail;
+  out = (uint8_t *)PyBytes_AS_STRING(ret);
+  memset(out, 0, n * CAN_REC_LEN);
+
+  for (i = 0; i < n; i++) {
+    unsigned long addr, bus;
+    PyObject *unused;
+    Py_buffer dat;
+    uint8_t *rec = out + i * CAN_REC_LEN;
+
+    if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq, i), "kO" BUF "k", &addr, &unused, &dat, &bus)) goto fail;
+    if (dat.len > 8) {
+      PyBuffer_Release(&dat);
+      PyErr_SetString(PyExc_AssertionError, "CAN data is at most 8 bytes");
+      goto fail;
+    }
+    if (addr >= 0x800) {
+      put_u32(rec, (addr << 3) | CAN_TRANSMIT | CAN_EXTENDED);
+    } else {
+      put_u32(rec, (addr << 21) | CAN_TRANSMIT);
+    }
+    put_u32(rec + 4, dat.len | (bus << 4));
+    memcpy(rec + 8, dat.buf, dat.len);
+    PyBuffer_Release(&dat);
+  }
+
+  Py_DECREF(seq);
+  return ret;
+
+fail:
+  Py_XDECREF(ret);
+  Py_DECREF(seq);
+  return NULL;
+}
+
+// *** packed UDP datagrams, see boardesp/proxy.c ***
+
+#define LZ_BACK 32
+
+// LZ4's block format, the length or -1 if it's not exactly max
+static Py_ssize_t lz4_block_decompress(const uint8_t *src, Py_ssize_t len, uint8_t *dst, Py_ssize_t max) {
+  const uint8_t *ip = src, *iend = src + len;
+  uint8_t *op = dst, *oend = dst + max;
+  while (ip < iend) {
+    unsigned token = *ip++;
+    Py_ssize_t n = token >> 4;
+    if (n == 15) {
+      unsigned b;
+      do {
+        if (ip >= iend) return -1;
+        b = *ip++;
+        n += b;
+      } while (b == 255);
+    }
+    if (n > iend - ip || n > oend - op) return -1;
+    memcpy(op, ip, n);
+    op += n;
+    ip += n;
+    if (ip >= iend) break;
+
+    if (iend - ip < 2) return -1;
+    Py_ssize_t off = ip[0] | (ip[1] << 8);
+    ip += 2;
+    Py_ssize_t m = token & 0xF;
+    if (m == 15) {
+      unsigned b;
+      do {
+        if (ip >= iend) return -1;
+        b = *ip++;
+        m += b;
+      } while (b == 255);
+    }
+    m += 4;
+    if (off == 0 || off > op - dst || m > oend - op) return -1;
+    // the copy can overlap what it makes
+    for (; m > 0; m--, op++) *op = op[-off];
+  }
+  return (op == oend) ? (op - dst) : -1;
+}
+
+static PyObject *canbuf_unpack_can_buffer_lz(PyObject *self, PyObject *args) {
+  Py_buffer view;
+  Py_ssize_t count, a, b, c;
+  int back = LZ_BACK;
+  PyObject *ret;
+  uint8_t *cols, *out;
+
+  if (!PyArg_ParseTuple(args, BUF "n|i", &view, &count, &back)) return NULL;
+  if (count < 0 || count > 0x10000) {
+    PyBuffer_Release(&view);
+    PyErr_SetString(PyExc_ValueError, "bad record count");
+    return NULL;
+  }
+  cols = (uint8_t *)PyMem_Malloc(count * CAN_REC_LEN + 1);
+  ret = PyBytes_FromStringAndSize(NULL, count * CAN_REC_LEN);
+  if (cols == NULL || ret == NULL) goto fail;
+  if (lz4_block_decompress((const uint8_t *)view.buf, view.len, cols, count * CAN_REC_LEN) < 0) {
+    PyErr_SetString(PyExc_ValueError, "bad LZ4 block");
+    goto fail;
+  }
+
+  out = (uint8_t *)PyBytes_AS_STRING(ret);
+  for (a = 0; a < count; a++) {
+    uint8_t *rec = out + a * CAN_REC_LEN;
+    const uint8_t *last = NULL;
+    for (c = 0; c < CAN_REC_LEN; c++) rec[c] = cols[c * count + a];
+    for (b = a - 1; b >= 0 && b >= a - back; b--) {
+      if (memcmp(out + b * CAN_REC_LEN, rec, 4) == 0) {
+        last = out + b * CAN_REC_LEN;
+        break;
+      }
+    }
+    if (last == NULL) continue;
+    uint16_t t = (rec[6] | (rec[7] << 8)) + (last[6] | (last[7] << 8));
+    for (c = 4; c < CAN_REC_LEN; c++) rec[c] ^= last[c];
+    rec[6] = t & 0xFF;
+    rec[7] = t >> 8;
+  }
+
+  PyMem_Free(cols);
+  PyBuffer_Release(&view);
+  return ret;
+
+fail:
+  PyMem_Free(cols);
+  Py_XDECREF(ret);
+  PyBuffer_Release(&view);
+  return NULL;
+}
+
+static PyMethodDef canbuf_methods[] = {
+  {"parse_can_buffer", canbuf_parse_can_buffer, METH_VARARGS, NULL},
+  {"parse_can_buffer_ts", canbuf_parse_can_buffer_ts, METH_VARARGS, NULL},
+  {"parse_can_buffer_columns", canbuf_parse_can_buffer_columns, METH_VARARGS, NULL},
+  {"pack_can_buffer", canbuf_pack_can_buffer, METH_VARARGS, NULL},
+  {"unpack_can_buffer_lz", canbuf_unpack_can_buffer_lz, METH_VARARGS, NULL},
+  {NULL, NULL, 0, NULL}
+};
+
+#if PY_MAJOR_VERSION >= 3
+static struct PyModuleDef canbuf_module = {
+  PyModuleDef_HEAD_INIT, "_canbuf", NULL, -1, canbuf_methods
+};
+
+PyMODINIT_FUNC PyInit__canbuf(void) {
+  return PyModule_Create(&canbuf_module);
+}
+#else
+PyMODINIT_FUNC init_canbuf(void) {
+  Py_InitModule("_canbuf", canbuf_methods);
+}
+#endif
@@ -0,0 +1,185 @@
+# reads the logs of drivers/libusb/can_capture, see canlog.h for the format
+import mmap
+import os
+import struct
+
+HEADER = struct.Struct("<IHHIIQQ32s")
+CHUNK = struct.Struct("<IIQQB7x256s")
+FRAME = struct.Struct("<QIBBBx8s")
+INDEX_HEADER = struct.Struct("<IHHIIQII")
+INDEX_ID = struct.Struct("<IBBHIIIIQQ")
+INDEX_REF = struct.Struct("<II")
+INDEX_BLOCK = struct.Struct("<QQ")
+
+MAGIC = 0x474C4350
+CHUNK_MAGIC = 0x4B4E4843
+VERSION = 1
+HEADER_LEN = 4096
+CHUNK_LEN = 1 << 20
+CHUNK_HEADER_LEN = 512
+ID_BITS = 2048
+FRAMES_PER_CHUNK = (CHUNK_LEN - CHUNK_HEADER_LEN) // FRAME.size
+INDEX_MAGIC = 0x494C4350
+INDEX_VERSION = 1
+BLOCK_FRAMES = 2048
+BLOCKS_PER_CHUNK = (FRAMES_PER_CHUNK + BLOCK_FRAMES - 1) // BLOCK_FRAMES
+
+EXTENDED = 1
+RECEIPT = 2
+
+END = (1 << 64) - 1
+
+def _id_bit(addr, extended):
+  return ((addr ^ (addr >> 11) ^ (addr >> 22)) if extended else addr) % ID_BITS
+
+def header(path):
+  # (serial, file_index, host_time_us, device_time0) of a log
+  with open(path, "rb") as f:
+    magic, version, _, chunk_len, file_index, host_time_us, device_time0, serial = HEADER.unpack(f.read(HEADER.size))
+  if magic != MAGIC or version != VERSION or chunk_len != CHUNK_LEN:
+    raise IOError("%s: not a CAN log of version %d" % (path, VERSION))
+  return serial.rstrip(b'\x00'), file_index, host_time_us, device_time0
+
+def _load_index(path, size, chunks, last_count):
+  # (ids, refs, blocks, last chunk frames) if path has an index for it as it is,
+  # as CanLogReader::load_index
+  try:
+    with open(path + ".idx", "rb") as f:
+      dat = f.read()
+  except IOError:
+    return None
+  if len(dat) < INDEX_HEADER.size:
+    return None
+  magic, version, _, ichunks, block_frames, frames, nids, nrefs = INDEX_HEADER.unpack_from(dat)
+  nblocks = ichunks * BLOCKS_PER_CHUNK
+  if magic != INDEX_MAGIC or version != INDEX_VERSION or block_frames != BLOCK_FRAMES or ichunks != chunks or chunks == 0:
+    return None
+  last = frames - (chunks - 1) * FRAMES_PER_CHUNK
+  last_off = HEADER_LEN + (chunks - 1) * CHUNK_LEN
+  if not 0 < last <= FRAMES_PER_CHUNK or last != last_count or \
+     size not in (last_off + CHUNK_HEADER_LEN + last * FRAME.size, last_off + CHUNK_LEN):
+    return None
+  if len(dat) < INDEX_HEADER.size + nids * INDEX_ID.size + nrefs * INDEX_REF.size + nblocks * INDEX_BLOCK.size:
+    return None
+  off = INDEX_HEADER.size
+  ids = [INDEX_ID.unpack_from(dat, off + i * INDEX_ID.size) for i in range(nids)]
+  off += nids * INDEX_ID.size
+  refs = [INDEX_REF.unpack_from(dat, off + i * INDEX_REF.size) for i in range(nrefs)]
+  off += nrefs * INDEX_REF.size
+  blocks = [INDEX_BLOCK.unpack_from(dat, off + i * INDEX_BLOCK.size) for i in range(nblocks)]
+  if any(first_ref + n > nrefs for _, _, _, _, _, first_ref, n, _, _, _ in ids):
+    return None
+  return ids, refs, blocks, last
+
+def _spans(m, size, index, ids, buses, start, end):
+  # (chunk, first, end) of the frames that can be ones wanted, as CanLogReader::plan
+  chunks = (size - HEADER_LEN + CHUNK_LEN - 1) // CHUNK_LEN
+  spans = []
+  if index is None:
+    for i in range(chunks):
+      off = HEADER_LEN + i * CHUNK_LEN
+      if off + CHUNK_HEADER_LEN > size:
+        break
+      magic, count, tmin, tmax, cbuses, bits = CHUNK.unpack_from(m, off)
+      count = min(count, (size - off - CHUNK_HEADER_LEN) // FRAME.size, FRAMES_PER_CHUNK)
+      if magic != CHUNK_MAGIC or count == 0 or tmax < start or tmin >= end or not cbuses & buses:
+        continue
+      if ids is not None:
+        bits = bytearray(bits)
+        if not any(bits[b // 8] & (1 << (b % 8)) for a in ids for b in (_id_bit(a, False), _id_bit(a, True))):
+          continue
+      spans.append((i, 0, count))
+    return spans
+
+  idx_ids, refs, blocks, last = index
+  everything = ids is None and buses == 0xFF
+  want = [everything] * chunks
+  if not everything:
+    for addr, bus, _, _, _, first_ref, n, _, tmin, tmax in idx_ids:
+      if bus >= 8 or not buses & (1 << bus) or tmax < start or tmin >= end:
+        continue
+      if ids is not None and addr not in ids:
+        continue
+      for chunk, _ in refs[first_ref:first_ref + n]:
+        want[chunk] = True
+  for i in range(chunks):
+    if not want[i]:
+      continue
+    count = FRAMES_PER_CHUNK if i + 1 < chunks else last
+    for b in range((count + BLOCK_FRAMES - 1) // BLOCK_FRAMES):
+      tmin, tmax = blocks[i * BLOCKS_PER_CHUNK + b]
+      if tmax < start or tmin >= end:
+        continue
+      first, stop = b * BLOCK_FRAMES, min((b + 1) * BLOCK_FRAMES, count)
+      if spans and spans[-1][0] == i and spans[-1][2] == first:
+        spans[-1] = (i, spans[-1][1], stop)
+      else:
+        spans.append((i, first, stop))
+  return spans
+
+def _query_py(paths, ids, buses, start, end):
+  ids = None if ids is None else set(ids)
+  cols = dict((k, []) for k in ("time", "addr", "bus", "len", "flags", "dat"))
+  for path in paths:
+    header(path)
+    with open(path, "rb") as f:
+      size = os.fstat(f.fileno()).st_size
+      m = mmap.mmap(f.fileno(), size, access=mmap.ACCESS_READ)
+      try:
+        chunks = (size - HEADER_LEN + CHUNK_LEN - 1) // CHUNK_LEN
+        last_off = HEADER_LEN + (chunks - 1) * CHUNK_LEN
+        last_count = CHUNK.unpack_from(m, last_off)[1] if chunks and last_off + CHUNK_HEADER_LEN <= size else -1
+        index = _load_index(path, size, chunks, last_count)
+        for chunk, first, stop in _spans(m, size, index, ids, buses, start, end):
+          off = HEADER_LEN + chunk * CHUNK_LEN + CHUNK_HEADER_LEN
+          for n in range(first, stop):
+            t, addr, bus, ln, flags, dat = FRAME.unpack_from(m, off + n * FRAME.size)
+            if t < start or t >= end or bus >= 8 or not buses & (1 << bus) or (ids is not None and addr not in ids):
+              continue
+            for k, v in (("time", t), ("addr", addr), ("bus", bus), ("len", ln), ("flags", flags), ("dat", dat)):
+              cols[k].append(v)
+      finally:
+        m.close()
+  n = len(cols["time"])
+  return {
+    "time": struct.pack("%dQ" % n, *cols["time"]),
+    "addr": struct.pack("%dI" % n, *cols["addr"]),
+    "bus": struct.pack("%dB" % n, *cols["bus"]),
+    "len": struct.pack("%dB" % n, *cols["len"]),
+    "flags": struct.pack("%dB" % n, *cols["flags"]),
+    "dat": b''.join(cols["dat"]),
+  }
+
+# the reader of canlog.cpp, built by setup.py when there is a compiler
+try:
+  from panda import _canlog
+except ImportError:
+  _canlog = None
+
+def query(paths, ids=None, buses=0xFF, start=0, end=None):
+  """The frames of a capture's logs, in order, as columns.
+
+  Like can_buffer_columns, a dict of native byte order values for
+  numpy.frombuffer: time uint64 device us, addr uint32, bus, len and flags
+  (EXTENDED, RECEIPT) uint8, dat 8 bytes per frame. start and end are seconds
+  from the capture's first frame, end is exclusive. With the .idx a log gets
+  when can_capture closes it, only the chunks of the ids and the blocks of
+  the times wanted are read, without it every chunk header is checked.
+  """
+  if isinstance(paths, str):
+    paths = [paths]
+  if not paths:
+    raise ValueError("no logs")
+  t0 = header(paths[0])[3]
+  start_us = t0 + int(start * 1e6)
+  end_us = END if end is None else t0 + int(end * 1e6)
+  ids = None if ids is None else list(ids)
+  if _canlog is not None:
+    return _canlog.query(paths, ids, buses, start_us, end_us)
+  return _query_py(paths, ids, buses, start_us, end_us)
+
+def index(path):
+  """Writes the index of a log that has none, one of a capture cut short."""
+  if _canlog is None:
+    raise IOError("indexing needs the _canlog extension, or can_capture index")
+  return _canlog.index(path)
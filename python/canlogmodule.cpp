@@ -0,0 +1,132 @@
+// The reader of can_capture's logs (drivers/libusb/can_capture/canlog.h) for
+// canlog.py. query maps each log and takes the frames a query wants as
+// columns without the GIL. With a log's index only the chunks of the ids and
+// the blocks of the times wanted are read.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <string>
+#include <vector>
+#include "canlog.h"
+
+#if PY_MAJOR_VERSION >= 3
+  #define PyString_AsString PyUnicode_AsUTF8
+#endif
+
+static int add_column(PyObject *dict, const char *key, const void *dat, size_t len) {
+  PyObject *col = PyBytes_FromStringAndSize((const char *)dat, (Py_ssize_t)len);
+  if (col == NULL) return -1;
+  int r = PyDict_SetItemString(dict, key, col);
+  Py_DECREF(col);
+  return r;
+}
+
+// query(paths, ids, buses, start, end): the frames of the logs, in order, as
+// a dict of columns like can_buffer_columns'. ids is a sequence or None for
+// all, start and end are device times, end is exclusive.
+static PyObject *canlog_query_logs(PyObject *self, PyObject *args) {
+  PyObject *paths_obj, *ids_obj;
+  unsigned int buses;
+  unsigned long long start, end;
+  if (!PyArg_ParseTuple(args, "OOIKK", &paths_obj, &ids_obj, &buses, &start, &end)) return NULL;
+
+  std::vector<std::string> paths;
+  PyObject *seq = PySequence_Fast(paths_obj, "paths must be a sequence");
+  if (seq == NULL) return NULL;
+  for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+    const char *path = PyString_AsString(PySequence_Fast_GET_ITEM(seq, i));
+    if (path == NULL) {
+      Py_DECREF(seq);
+      return NULL;
+    }
+    paths.push_back(path);
+  }
+  Py_DECREF(seq);
+
+  canlog_query q;
+  q.from = start;
+  q.to = end;
+  q.buses = (uint8_t)buses;
+  if (ids_obj != Py_None) {
+    seq = PySequence_Fast(ids_obj, "ids must be a sequence");
+    if (seq == NULL) return NULL;
+    for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+      unsigned long id = PyLong_AsUnsignedLong(PySequence_Fast_GET_ITEM(seq, i));
+      if (id == (unsigned long)-1 && PyErr_Occurred()) {
+        Py_DECREF(seq);
+        return NULL;
+      }
+      q.ids.push_back((uint32_t)id);
+    }
+    Py_DECREF(seq);
+  }
+
+  canlog_columns cols;
+  std::string err;
+  Py_BEGIN_ALLOW_THREADS
+  for (const std::string& path : paths) {
+    CanLogReader log;
+    if (!log.open(path)) {
+      err = log.error();
+      break;
+    }
+    log.query(q, cols);
+  }
+  Py_END_ALLOW_THREADS
+  if (!err.empty()) {
+    PyErr_SetString(PyExc_IOError, err.c_str());
+    return NULL;
+  }
+
+  size_t n = cols.size();
+  PyObject *ret = PyDict_New();
+  if (ret == NULL) return NULL;
+  if (add_column(ret, "time", cols.time.data(), n * sizeof(uint64_t)) < 0 ||
+      add_column(ret, "addr", cols.addr.data(), n * sizeof(uint32_t)) < 0 ||
+      add_column(ret, "bus", cols.bus.data(), n) < 0 ||
+      add_column(ret, "len", cols.len.data(), n) < 0 ||
+      add_column(ret, "flags", cols.flags.data(), n) < 0 ||
+      add_column(ret, "dat", cols.dat.data(), n * 8) < 0) {
+    Py_DECREF(ret);
+    return NULL;
+  }
+  return ret;
+}
+
+// index(path): writes the index of a log that has none, an IOError if it can't
+static PyObject *canlog_index(PyObject *self, PyObject *args) {
+  const char *path;
+  if (!PyArg_ParseTuple(args, "s", &path)) return NULL;
+  bool ok;
+  std::string err;
+  Py_BEGIN_ALLOW_THREADS
+  CanLogReader log;
+  ok = log.open(path) && (log.indexed() || log.write_index());
+  if (!ok) err = log.error();
+  Py_END_ALLOW_THREADS
+  if (!ok) {
+    PyErr_SetString(PyExc_IOError, err.c_str());
+    return NULL;
+  }
+  Py_RETURN_TRUE;
+}
+
+static PyMethodDef module_methods[] = {
+  {"query", canlog_query_logs, METH_VARARGS, NULL},
+  {"index", canlog_index, METH_VARARGS, NULL},
+  {NULL, NULL, 0, NULL}
+};
+
+#if PY_MAJOR_VERSION >= 3
+static struct PyModuleDef canlog_module = {
+  PyModuleDef_HEAD_INIT, "_canlog", NULL, -1, module_methods
+};
+
+PyMODINIT_FUNC PyInit__canlog(void) {
+  return PyModule_Create(&canlog_module);
+}
+#else
+PyMODINIT_FUNC init_canlog(void) {
+  Py_InitModule("_canlog", module_methods);
+}
+#endif
@@ -0,0 +1,231 @@
+// Reads the CAN stream of a panda on a thread of its own, without the GIL, for
+// Panda.can_capture_start. The reads go into a ring of slots that the python
+// side drains in bulk, so a busy interpreter doesn't leave the panda's rx
+// queues to overflow. The transfers go through usb1's own libusb: python passes
+// the address of libusb_bulk_transfer and of the open device handle, so this
+// needs no libusb to build against and shares the handle's claim.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// libusb's, see libusb.h
+typedef int (*bulk_transfer_fn)(void *handle, unsigned char endpoint, unsigned char *data, int length,
+                                int *transferred, unsigned int timeout);
+#define LIBUSB_ERROR_NO_DEVICE -4
+#define LIBUSB_ERROR_TIMEOUT -7
+
+// how long a read waits, the most stop waits for the thread
+#define CAPTURE_TIMEOUT_MS 100
+
+// One producer, the thread, and one consumer, drain under the GIL. head and
+// tail only ever grow, each slot is written before head passes it and read
+// before tail does.
+typedef struct {
+  PyObject_HEAD
+  bulk_transfer_fn bulk_transfer;
+  void *handle;
+  unsigned char endpoint;
+  int read_len;
+  uint32_t slots;
+  std::vector<uint8_t> *buf;
+  std::vector<int> *lens;
+  std::atomic<uint64_t> head;
+  std::atomic<uint64_t> tail;
+  std::atomic<uint64_t> dropped; // reads that came while the ring was full
+  std::atomic<uint64_t> errors;
+  std::atomic<bool> stop;
+  std::atomic<bool> gone; // the panda dropped off, the thread is done
+  std::thread *thread;
+} Capture;
+
+static void capture_loop(Capture *c) {
+  std::vector<uint8_t> spill(c->read_len);
+  while (!c->stop.load()) {
+    uint64_t head = c->head.load(std::memory_order_relaxed);
+    bool full = head - c->tail.load(std::memory_order_acquire) >= c->slots;
+    // full, the panda is still read so its queues keep moving, and the read is counted
+    uint8_t *dst = full ? spill.data() : &(*c->buf)[(head % c->slots) * c->read_len];
+    int got = 0;
+    int r = c->bulk_transfer(c->handle, c->endpoint, dst, c->read_len, &got, CAPTURE_TIMEOUT_MS);
+    if (r == LIBUSB_ERROR_NO_DEVICE) {
+      c->gone = true;
+      return;
+    }
+    if (r != 0 && r != LIBUSB_ERROR_TIMEOUT) {
+      c->errors++;
+      continue;
+    }
+    if (got <= 0) continue;
+    if (full) {
+      c->dropped++;
+      continue;
+    }
+    (*c->lens)[head % c->slots] = got;
+    c->head.store(head + 1, std::memory_order_release);
+  }
+}
+
+static void capture_join(Capture *c) {
+  if (c->thread == NULL) return;
+  c->stop = true;
+  Py_BEGIN_ALLOW_THREADS
+  c->thread->join();
+  Py_END_ALLOW_THREADS
+  delete c->thread;
+  c->thread = NULL;
+}
+
+static int capture_init(Capture *c, PyObject *args, PyObject *kwargs) {
+  static const char *kwlist[] = {"bulk_transfer", "handle", "endpoint", "read_len", "slots", NULL};
+  unsigned long long bulk_transfer, handle;
+  unsigned char endpoint = 0x81;
+  int read_len = 0x1000;
+  unsigned int slots = 1024;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "KK|biI", (char **)kwlist, &bulk_transfer, &handle,
+                                   &endpoint, &read_len, &slots)) return -1;
+  if (bulk_transfer == 0 || handle == 0 || read_len <= 0 || slots == 0) {
+    PyErr_SetString(PyExc_ValueError, "capture needs libusb_bulk_transfer, a handle and a ring");
+    return -1;
+  }
+  capture_join(c);
+  c->bulk_transfer = (bulk_transfer_fn)(uintptr_t)bulk_transfer;
+  c->handle = (void *)(uintptr_t)handle;
+  c->endpoint = endpoint;
+  c->read_len = read_len;
+  c->slots = slots;
+  delete c->buf;
+  delete c->lens;
+  c->buf = new std::vector<uint8_t>((size_t)slots * read_len);
+  c->lens = new std::vector<int>(slots);
+  c->head = 0;
+  c->tail = 0;
+  c->dropped = 0;
+  c->errors = 0;
+  c->stop = false;
+  c->gone = false;
+  return 0;
+}
+
+static PyObject *capture_new(PyTypeObject *type, PyObject *args, PyObject *kwargs) {
+  Capture *c = (Capture *)type->tp_alloc(type, 0);
+  if (c == NULL) return NULL;
+  // tp_alloc zeroes, the atomics are set up in place
+  new (&c->head) std::atomic<uint64_t>(0);
+  new (&c->tail) std::atomic<uint64_t>(0);
+  new (&c->dropped) std::atomic<uint64_t>(0);
+  new (&c->errors) std::atomic<uint64_t>(0);
+  new (&c->stop) std::atomic<bool>(false);
+  new (&c->gone) std::atomic<bool>(false);
+  return (PyObject *)c;
+}
+
+static void capture_dealloc(Capture *c) {
+  capture_join(c);
+  delete c->buf;
+  delete c->lens;
+  Py_TYPE(c)->tp_free((PyObject *)c);
+}
+
+static PyObject *capture_start(Capture *c, PyObject *unused) {
+  if (c->buf == NULL) {
+    PyErr_SetString(PyExc_RuntimeError, "capture isn't set up");
+    return NULL;
+  }
+  if (c->thread != NULL) Py_RETURN_FALSE;
+  c->stop = false;
+  c->gone = false;
+  c->thread = new std::thread(capture_loop, c);
+  Py_RETURN_TRUE;
+}
+
+static PyObject *capture_stop(Capture *c, PyObject *unused) {
+  capture_join(c);
+  Py_RETURN_NONE;
+}
+
+// a list of the reads since the last call, each as it came, up to max_reads
+// of them if it's not 0
+static PyObject *capture_drain(Capture *c, PyObject *args) {
+  unsigned int max_reads = 0;
+  if (!PyArg_ParseTuple(args, "|I", &max_reads)) return NULL;
+  PyObject *ret = PyList_New(0);
+  if (ret == NULL || c->buf == NULL) return ret;
+
+  uint64_t tail = c->tail.load(std::memory_order_relaxed);
+  uint64_t head = c->head.load(std::memory_order_acquire);
+  if (max_reads != 0 && head - tail > max_reads) head = tail + max_reads;
+  for (; tail != head; tail++) {
+    uint32_t slot = tail % c->slots;
+    PyObject *dat = PyBytes_FromStringAndSize((const char *)&(*c->buf)[(size_t)slot * c->read_len],
+                                              (*c->lens)[slot]);
+    if (dat == NULL || PyList_Append(ret, dat) < 0) {
+      Py_XDECREF(dat);
+      Py_DECREF(ret);
+      c->tail.store(tail, std::memory_order_release);
+      return NULL;
+    }
+    Py_DECREF(dat);
+  }
+  c->tail.store(tail, std::memory_order_release);
+  return ret;
+}
+
+// (reads waiting, dropped, errors, running)
+static PyObject *capture_stats(Capture *c, PyObject *unused) {
+  return Py_BuildValue("(KKKO)", (unsigned long long)(c->head.load() - c->tail.load()),
+                       (unsigned long long)c->dropped.load(), (unsigned long long)c->errors.load(),
+                       (c->thread != NULL && !c->gone.load()) ? Py_True : Py_False);
+}
+
+static PyMethodDef capture_methods[] = {
+  {"start", (PyCFunction)capture_start, METH_NOARGS, NULL},
+  {"stop", (PyCFunction)capture_stop, METH_NOARGS, NULL},
+  {"drain", (PyCFunction)capture_drain, METH_VARARGS, NULL},
+  {"stats", (PyCFunction)capture_stats, METH_NOARGS, NULL},
+  {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject CaptureType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "_capture.Capture",
+};
+
+static PyMethodDef module_methods[] = {
+  {NULL, NULL, 0, NULL}
+};
+
+static int capture_ready(PyObject *m) {
+  CaptureType.tp_basicsize = sizeof(Capture);
+  CaptureType.tp_flags = Py_TPFLAGS_DEFAULT;
+  CaptureType.tp_new = capture_new;
+  CaptureType.tp_init = (initproc)capture_init;
+  CaptureType.tp_dealloc = (destructor)capture_dealloc;
+  CaptureType.tp_methods = capture_methods;
+  if (PyType_Ready(&CaptureType) < 0) return -1;
+  Py_INCREF(&CaptureType);
+  PyModule_AddObject(m, "Capture", (PyObject *)&CaptureType);
+  return 0;
+}
+
+#if PY_MAJOR_VERSION >= 3
+static struct PyModuleDef capture_module = {
+  PyModuleDef_HEAD_INIT, "_capture", NULL, -1, module_methods
+};
+
+PyMODINIT_FUNC PyInit__capture(void) {
+  PyObject *m = PyModule_Create(&capture_module);
+  if (m == NULL || capture_ready(m) < 0) return NULL;
+  return m;
+}
+#else
+PyMODINIT_FUNC init_capture(void) {
+  PyObject *m = Py_InitModule("_capture", module_methods);
+  if (m != NULL) capture_ready(m);
+}
+#endif
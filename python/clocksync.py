@@ -0,0 +1,126 @@
+# maps the panda's 32 bit microsecond timer, the time of the CAN timestamps,
+# to a host clock
+from __future__ import print_function
+import threading
+import time
+
+WRAP = 1 << 32
+
+def _median(xs):
+  xs = sorted(xs)
+  return xs[len(xs) // 2]
+
+class PandaClock(object):
+  """Estimates the offset and drift of a panda's timer from a host clock.
+
+  Every ping reads the timer with 0xfe and pairs it with the host time half
+  way through the round trip. The pings with slow round trips are dropped,
+  and then the ones far off a least squares line through the rest. The timer
+  wraps every 71 minutes, timestamps are unwrapped against the last ping, so
+  ping at least every half hour.
+
+  One PandaClock per panda, all on the same host clock, puts their logs on
+  one timeline.
+  """
+
+  def __init__(self, panda, window=64, clock=time.time):
+    self.panda = panda
+    self.window = window
+    self.clock = clock
+    self.lock = threading.Lock()
+    self.samples = []  # (device us unwrapped, host s, round trip s)
+    self.last_raw = None
+    self.epoch = 0
+    self.fit = None  # (device us, host s, host s per device us) at a point on the line
+    self.error = None
+    self._thread = None
+    self._stop = threading.Event()
+
+  def _unwrap(self, raw):
+    if self.last_raw is not None and raw < self.last_raw and self.last_raw - raw > WRAP // 2:
+      self.epoch += WRAP
+    self.last_raw = raw
+    return self.epoch + raw
+
+  def ping(self):
+    t0 = self.clock()
+    raw = self.panda.get_time()
+    t1 = self.clock()
+    with self.lock:
+      self.samples.append((self._unwrap(raw), (t0 + t1) / 2., t1 - t0))
+      self.samples = self.samples[-self.window:]
+      self._refit()
+
+  def _line(self, samples):
+    x0 = samples[0][0]
+    xs = [(s[0] - x0) for s in samples]
+    ys = [s[1] for s in samples]
+    mx = sum(xs) / float(len(xs))
+    my = sum(ys) / float(len(ys))
+    sxx = sum((x - mx) ** 2 for x in xs)
+    # one point, or all at the same time, the drift is taken to be none
+    b = sum((x - mx) * (y - my) for x, y in zip(xs, ys)) / sxx if sxx > 0 else 1e-6
+    return (x0 + mx, my, b)
+
+  def _refit(self):
+    # the quick round trips, they bound the error best
+    rtt = _median([s[2] for s in self.samples])
+    good = [s for s in self.samples if s[2] <= rtt * 1.5]
+    fit = self._line(good)
+
+    # then drop the ones far off the line
+    res = [abs(self._host(fit, s[0]) - s[1]) for s in good]
+    mad = _median(res)
+    if len(good) > 4 and mad > 0:
+      kept = [s for s, r in zip(good, res) if r <= 3 * mad]
+      if len(kept) >= 2:
+        good = kept
+        fit = self._line(good)
+
+    self.fit = fit
+    # off the line, plus the half round trip the host time could be off by
+    self.error = max(abs(self._host(fit, s[0]) - s[1]) for s in good) + min(s[2] for s in good) / 2.
+
+  @staticmethod
+  def _host(fit, us):
+    x, y, b = fit
+    return y + (us - x) * b
+
+  def to_host(self, ts):
+    """The host clock time of a 32 bit panda timestamp, from within half a
+    wrap of the last ping."""
+    with self.lock:
+      assert self.fit is not None, "ping first"
+      d = (ts - self.last_raw) & (WRAP - 1)
+      if d >= WRAP // 2:
+        d -= WRAP
+      return self._host(self.fit, self.epoch + self.last_raw + d)
+
+  def drift_ppm(self):
+    # positive when the panda's timer runs fast
+    with self.lock:
+      return (1e-6 / self.fit[2] - 1) * 1e6 if self.fit is not None else None
+
+  def start(self, interval=1.0):
+    """Keep pinging every interval seconds on a thread."""
+    if self._thread is not None:
+      return
+    self._stop.clear()
+
+    def run():
+      while not self._stop.is_set():
+        try:
+          self.ping()
+        except Exception as e:
+          print("clock sync ping failed:", e)
+        self._stop.wait(interval)
+
+    self._thread = threading.Thread(target=run)
+    self._thread.daemon = True
+    self._thread.start()
+
+  def stop(self):
+    if self._thread is not None:
+      self._stop.set()
+      self._thread.join()
+      self._thread = None
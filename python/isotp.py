@@ -1,3 +1,5 @@
+import time
+
 DEBUG = False
 
 def msg(x):
@@ -57,6 +59,25 @@ def isotp_recv_subaddr(panda, addr, bus, sendaddr, subaddr):
 
   return dat[0:tlen]
 
+# the block size and STmin in seconds of the next flow control, after any waits
+def flow_control(panda, addr, bus, subaddr):
+  while 1:
+    rr = recv(panda, 1, addr, bus)[0]
+    if subaddr is not None:
+      rr = rr[1:]
+    if ord(rr[0]) == 0x30:
+      break
+    # 0x31 is wait, anything else is an overflow or not flow control
+    assert ord(rr[0]) == 0x31, rr.encode("hex")
+  stmin = ord(rr[2])
+  if 0xf1 <= stmin <= 0xf9:
+    stmin = (stmin - 0xf0) * 1e-4
+  elif stmin <= 0x7f:
+    stmin = stmin * 1e-3
+  else:
+    stmin = 0x7f * 1e-3
+  return ord(rr[1]), stmin
+
 # **** import below this line ****
 
 def isotp_send(panda, x, addr, bus=0, recvaddr=None, subaddr=None):
@@ -85,16 +106,18 @@ def isotp_send(panda, x, addr, bus=0, recvaddr=None, subaddr=None):
         x = x[7:]
       idx += 1
 
-    # actually send
+    # actually send, a block of the receiver's block size each flow control
     panda.can_send(addr, ss, bus)
-    rr = recv(panda, 1, recvaddr, bus)[0]
-    if rr.find("\x30\x01") != -1:
-      for s in sends[:-1]:
-        panda.can_send(addr, s, 0)
-        rr = recv(panda, 1, recvaddr, bus)[0]
-      panda.can_send(addr, sends[-1], 0)
-    else:
-      panda.can_send_many([(addr, None, s, 0) for s in sends])
+    while len(sends) > 0:
+      block_size, stmin = flow_control(panda, recvaddr, bus, subaddr)
+      block = sends[0:block_size] if block_size else sends
+      sends = sends[len(block):]
+      if stmin == 0:
+        panda.can_send_many([(addr, None, s, bus) for s in block])
+      else:
+        for s in block:
+          panda.can_send(addr, s, bus)
+          time.sleep(stmin)
 
 def isotp_recv(panda, addr, bus=0, sendaddr=None, subaddr=None):
   if sendaddr is None:
@@ -133,3 +156,41 @@ def isotp_recv(panda, addr, bus=0, sendaddr=None, subaddr=None):
 
   return dat
 
+
+# **** native engine ****
+
+# panda._isotp is the ISO-TP engine of the J2534 driver. It follows the
+# receiver's flow control (block size, STmin, wait frames) and times out
+# instead of blocking forever. The Python versions above stay as the fallback.
+try:
+  from panda import _isotp
+except ImportError:
+  _isotp = None
+
+def _recv_all(panda, addr, nbus):
+  # frames for other addresses are left around for recv()
+  global kmsgs
+  kmsgs += panda.can_recv()
+  ret, nmsgs = [], []
+  for ids, ts, dat, bus in kmsgs:
+    if ids == addr and bus == nbus:
+      ret.append(str(dat))
+    else:
+      nmsgs.append((ids, ts, dat, bus))
+  kmsgs = nmsgs[-256:]
+  return ret
+
+if _isotp is not None and not DEBUG:
+  def isotp_send(panda, x, addr, bus=0, recvaddr=None, subaddr=None):
+    if recvaddr is None:
+      recvaddr = addr+8
+    ext = -1 if subaddr is None else subaddr
+    _isotp.send(lambda dat: panda.can_send(addr, dat, bus),
+                lambda: _recv_all(panda, recvaddr, bus), x, ext, ext)
+
+  def isotp_recv(panda, addr, bus=0, sendaddr=None, subaddr=None):
+    if sendaddr is None:
+      sendaddr = addr-8
+    ext = -1 if subaddr is None else subaddr
+    return _isotp.recv(lambda dat: panda.can_send(sendaddr, dat, bus),
+                       lambda: _recv_all(panda, addr, bus), ext, ext)
@@ -0,0 +1,121 @@
+// The ISO-TP engine of the J2534 driver (drivers/windows/panda_shared/isotp.h)
+// for isotp.py. Frames go through two python callables, so it works with any
+// panda connection: can_send(dat) sends one frame, can_recv() returns the list
+// of frames received from the peer since the last call.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include "isotp.h"
+
+// bytes-like arguments, and frames passed to can_send
+#if PY_MAJOR_VERSION >= 3
+  #define BUF "y*"
+  #define FRAME "y#"
+#else
+  #define BUF "s*"
+  #define FRAME "s#"
+#endif
+
+class PyLink : public panda::isotp::Link {
+public:
+  PyLink(PyObject *send_fn, PyObject *recv_fn) : send_fn(send_fn), recv_fn(recv_fn) { }
+
+  // a python exception stays set, so the module function can return it
+  bool send(const std::string& frame) override {
+    PyObject *ret = PyObject_CallFunction(send_fn, (char *)FRAME, frame.data(), (Py_ssize_t)frame.size());
+    Py_XDECREF(ret);
+    return ret != NULL;
+  }
+
+  bool recv(std::vector<std::string>& frames) override {
+    PyObject *ret = PyObject_CallObject(recv_fn, NULL);
+    if (ret == NULL) return false;
+    PyObject *seq = PySequence_Fast(ret, "can_recv must return a sequence of frames");
+    Py_DECREF(ret);
+    if (seq == NULL) return false;
+
+    bool ok = true;
+    for (Py_ssize_t i = 0; ok && i < PySequence_Fast_GET_SIZE(seq); i++) {
+      Py_buffer view;
+      if (PyObject_GetBuffer(PySequence_Fast_GET_ITEM(seq, i), &view, PyBUF_SIMPLE) < 0) {
+        ok = false;
+        break;
+      }
+      frames.push_back(std::string((const char *)view.buf, view.len));
+      PyBuffer_Release(&view);
+    }
+    Py_DECREF(seq);
+    return ok;
+  }
+
+  // STmin waits let other python threads run
+  void sleep_us(unsigned long us) override {
+    Py_BEGIN_ALLOW_THREADS
+    panda::isotp::Link::sleep_us(us);
+    Py_END_ALLOW_THREADS
+  }
+
+private:
+  PyObject *send_fn;
+  PyObject *recv_fn;
+};
+
+static bool check_result(panda::isotp::RESULT res) {
+  if (res == panda::isotp::OK) return true;
+  if (!PyErr_Occurred()) {
+    PyErr_Format(PyExc_RuntimeError, "isotp: %s", panda::isotp::result_str(res));
+  }
+  return false;
+}
+
+static PyObject *isotp_send(PyObject *self, PyObject *args, PyObject *kwargs) {
+  static const char *kwlist[] = {"can_send", "can_recv", "dat", "tx_ext", "rx_ext", "timeout_ms", NULL};
+  PyObject *send_fn, *recv_fn;
+  Py_buffer dat;
+  panda::isotp::Options opt;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO" BUF "|iiI", (char **)kwlist, &send_fn, &recv_fn, &dat,
+                                   &opt.tx_ext_addr, &opt.rx_ext_addr, &opt.timeout_ms)) return NULL;
+  std::string payload((const char *)dat.buf, dat.len);
+  PyBuffer_Release(&dat);
+
+  PyLink link(send_fn, recv_fn);
+  if (!check_result(panda::isotp::send(link, payload, opt))) return NULL;
+  Py_RETURN_NONE;
+}
+
+static PyObject *isotp_recv(PyObject *self, PyObject *args, PyObject *kwargs) {
+  static const char *kwlist[] = {"can_send", "can_recv", "tx_ext", "rx_ext", "timeout_ms", "first_timeout_ms",
+                                 "block_size", "st_min", NULL};
+  PyObject *send_fn, *recv_fn;
+  panda::isotp::Options opt;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|iiIIbb", (char **)kwlist, &send_fn, &recv_fn,
+                                   &opt.tx_ext_addr, &opt.rx_ext_addr, &opt.timeout_ms, &opt.first_timeout_ms,
+                                   &opt.block_size, &opt.st_min)) return NULL;
+
+  PyLink link(send_fn, recv_fn);
+  std::string payload;
+  if (!check_result(panda::isotp::recv(link, payload, opt))) return NULL;
+  return PyBytes_FromStringAndSize(payload.data(), payload.size());
+}
+
+static PyMethodDef isotp_methods[] = {
+  {"send", (PyCFunction)isotp_send, METH_VARARGS | METH_KEYWORDS, NULL},
+  {"recv", (PyCFunction)isotp_recv, METH_VARARGS | METH_KEYWORDS, NULL},
+  {NULL, NULL, 0, NULL}
+};
+
+#if PY_MAJOR_VERSION >= 3
+static struct PyModuleDef isotp_module = {
+  PyModuleDef_HEAD_INIT, "_isotp", NULL, -1, isotp_methods
+};
+
+PyMODINIT_FUNC PyInit__isotp(void) {
+  return PyModule_Create(&isotp_module);
+}
+#else
+PyMODINIT_FUNC init_isotp(void) {
+  Py_InitModule("_isotp", isotp_methods);
+}
+#endif
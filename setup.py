@@ -52,7 +52,19 @@ setup(
     'tqdm >= 4.14.0',
     'requests'
   ],
-  ext_modules = [],
+  # optional, panda falls back to the Python CAN buffer helpers, ISO-TP and log
+  # reader, and can't capture on a native thread, without them
+  ext_modules = [
+    Extension('panda._canbuf', sources=['python/canbuf.c'], optional=True),
+    Extension('panda._isotp', sources=['python/isotpmodule.cpp'], language='c++',
+              include_dirs=['drivers/windows/panda_shared'], extra_compile_args=['-std=c++11'],
+              depends=['drivers/windows/panda_shared/isotp.h'], optional=True),
+    Extension('panda._capture', sources=['python/capturemodule.cpp'], language='c++',
+              extra_compile_args=['-std=c++11'], extra_link_args=['-pthread'], optional=True),
+    Extension('panda._canlog', sources=['python/canlogmodule.cpp', 'drivers/libusb/can_capture/canlog.cpp'],
+              language='c++', include_dirs=['drivers/libusb/can_capture'], extra_compile_args=['-std=c++11'],
+              depends=['drivers/libusb/can_capture/canlog.h'], optional=True),
+    ],
   description="Code powering the comma.ai panda",
   long_description='See https://github.com/commaai/panda',
   classifiers=[
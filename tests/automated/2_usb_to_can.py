@@ -2,6 +2,7 @@ from __future__ import print_function
 import os
 import sys
 import time
+import struct
 from panda import Panda
 from nose.tools import timed, assert_equal, assert_less, assert_greater
 from helpers import time_many_sends, connect_wo_esp
@@ -42,6 +43,269 @@ def test_can_loopback():
     assert 0x1aa == sr[0][0] == lb[0][0]
     assert "message" == sr[0][2] == lb[0][2]
 
+def test_can_stats():
+  p = connect_wo_esp()
+  p.set_safety_mode(Panda.SAFETY_ALLOUTPUT)
+  p.set_can_loopback(True)
+  p.set_can_speed_kbps(0, 500)
+  p.can_recv()
+
+  before = p.can_stats(0)
+  for _ in range(10):
+    p.can_send(0x1aa, "message", 0)
+  time.sleep(0.05)
+  p.can_recv()
+  after = p.can_stats(0)
+
+  assert_equal(after["tx"] - before["tx"], 10)
+  assert_equal(after["txd"] - before["txd"], 10)
+  assert_equal(after["rx"] - before["rx"], 10)
+  assert_equal(after["tx_dropped"], before["tx_dropped"])
+  assert_greater(after["rx_queue_hwm"], 0)
+
+def test_health_extended():
+  p = connect_wo_esp()
+  p.health()
+  time.sleep(0.5)
+  h = p.health()
+
+  assert_greater(h["version"], 0)
+  assert_greater(h["uptime"], 0.5)
+  # the main loop sleeps between ticks, and wakes for every one
+  assert_greater(h["idle"], 0.5)
+  assert_less(h["main_loop_lag_max"], 10000)
+  assert_less(h["irq_latency_max"], 1000)
+
+def test_can_queue_layout():
+  p = connect_wo_esp()
+  layout = p.can_queue_layout()
+
+  # give the last tx queue's frames to bus 0's rx
+  tx = len(layout["tx"]) - 1
+  grown = layout["rx"][0] + layout["tx"][tx]
+  p.set_can_queue_len(tx, 0)
+  l = p.set_can_queue_len(0, grown, rx=True)
+  assert_equal(l["rx"][0], grown)
+  assert_equal(l["tx"][tx], 0)
+
+  # too big is refused
+  l = p.set_can_queue_len(0, grown + l["free"] + 1, rx=True)
+  assert_equal(l["rx"][0], grown)
+
+  p.set_can_queue_len(0, layout["rx"][0], rx=True)
+  l = p.set_can_queue_len(tx, layout["tx"][tx])
+  assert_equal(l, layout)
+
+def test_can_rx_fair():
+  p = connect_wo_esp()
+  p.set_safety_mode(Panda.SAFETY_ALLOUTPUT)
+  p.set_can_loopback(True)
+  p.set_can_speed_kbps(0, 500)
+  p.set_can_speed_kbps(1, 500)
+  p.can_recv()
+
+  # bus 1 floods its rx queue before a few frames land on bus 0
+  p.can_send_many([(0x100, 0, b"flood", 1)] * 0xF0)
+  time.sleep(0.1)
+  for _ in range(10):
+    p.can_send(0x200, b"wanted", 0)
+  time.sleep(0.1)
+
+  msgs = []
+  for _ in range(20):
+    msgs += p.can_recv()
+  wanted = [i for i, m in enumerate(msgs) if m[0] == 0x200]
+  # the rx and the echo of each, taking turns with bus 1 instead of behind it
+  assert_equal(len(wanted), 20)
+  assert_less(wanted[-1], 60)
+
+def test_can_tx_priority():
+  p = connect_wo_esp()
+  p.set_safety_mode(Panda.SAFETY_ALLOUTPUT)
+  p.set_can_loopback(True)
+  p.set_can_speed_kbps(0, 10)
+  p.set_can_tx_priority(0, True)
+  p.can_recv()
+
+  # slow bus, so it's all queued before the first few are out
+  p.can_send_many([(0x500 - i, 0, b"bulk", 0) for i in range(20)] + [(0x7ff, 0, b"now", 0 | Panda.CAN_TX_URGENT)])
+  time.sleep(2.5)
+  sent = [m[0] for m in p.can_recv() if m[3] == 0x80]
+  p.set_can_tx_priority(0, False)
+  p.set_can_speed_kbps(0, SPEED_NORMAL)
+
+  assert_equal(len(sent), 21)
+  # the urgent one right behind what was on the wire, then by id
+  assert_less(sent.index(0x7ff), 2)
+  rest = [a for a in sent[4:] if a != 0x7ff]
+  assert_equal(rest, sorted(rest))
+
+def test_can_compact():
+  p = connect_wo_esp()
+  p.set_safety_mode(Panda.SAFETY_ALLOUTPUT)
+  p.set_can_loopback(True)
+  p.set_can_speed_kbps(0, SPEED_NORMAL)
+  assert_equal(p.set_can_format(True, True), (True, True))
+  p.can_recv()
+
+  sent = [(0x100 + i, 0, b"\x01" * (i % 9), 0) for i in range(40)] + [(0x18DAF110, 0, b"extended", 1)]
+  p.can_send_many(sent)
+  time.sleep(0.1)
+  got = p.can_recv()
+  p.set_can_format(False, False)
+
+  echoes = [(m[0], m[2], m[3] & 0x7F) for m in got if m[3] & 0x80]
+  recvs = [(m[0], m[2], m[3]) for m in got if not m[3] & 0x80]
+  assert_equal(sorted(echoes), sorted([(a, d, b) for a, _, d, b in sent]))
+  assert_equal(sorted(recvs), sorted([(a, d, b) for a, _, d, b in sent]))
+  # times are in order on a bus, and close together
+  ts = [m[1] for m in got if m[3] == 0x80]
+  assert_equal(ts, sorted(ts))
+  assert_less(ts[-1] - ts[0], 100000)
+
+def test_can_periodic():
+  p = connect_wo_esp()
+  p.set_safety_mode(Panda.SAFETY_ALLOUTPUT)
+  p.set_can_loopback(True)
+  p.set_can_speed_kbps(0, 500)
+  p.can_recv()
+
+  p.set_can_periodic(0, 0x1ab, "periodic", 0, 10)
+  time.sleep(0.5)
+  p.clear_can_periodic()
+  time.sleep(0.05)
+
+  msgs = [m for m in p.can_recv() if m[0] == 0x1ab and m[3] == 0]
+  assert_greater(len(msgs), 40)
+  assert_less(len(msgs), 60)
+  assert "periodic" == msgs[0][2]
+
+  # nothing is sent once stopped
+  time.sleep(0.05)
+  assert_equal([m for m in p.can_recv() if m[0] == 0x1ab], [])
+
+def test_can_report():
+  p = connect_wo_esp()
+  p.set_safety_mode(Panda.SAFETY_ALLOUTPUT)
+  p.set_can_loopback(True)
+  p.set_can_speed_kbps(0, 500)
+  p.clear_can_report_rules()
+  p.can_recv()
+
+  # unchanged every 10 ms, let through once and then every 100 ms
+  p.add_can_report_rule(0, 0x1ab, 0x7FF, changed=True, interval_ms=100)
+  before = p.can_stats(0)
+  p.set_can_periodic(0, 0x1ab, "periodic", 0, 10)
+  time.sleep(0.5)
+  p.clear_can_periodic()
+  time.sleep(0.05)
+
+  msgs = [m for m in p.can_recv() if m[0] == 0x1ab and m[3] == 0]
+  assert_greater(len(msgs), 3)
+  assert_less(len(msgs), 8)
+  assert_greater(p.can_stats(0)["rx_suppressed"] - before["rx_suppressed"], 30)
+
+  # a change always goes through
+  p.can_send(0x1ab, "changed", 0)
+  time.sleep(0.05)
+  msgs = [m for m in p.can_recv() if m[0] == 0x1ab and m[3] == 0]
+  assert_equal(len(msgs), 1)
+  assert "changed" == msgs[0][2]
+
+  # other ids aren't held back
+  p.can_send(0x1ac, "message", 0)
+  p.can_send(0x1ac, "message", 0)
+  time.sleep(0.05)
+  assert_equal(len([m for m in p.can_recv() if m[0] == 0x1ac and m[3] == 0]), 2)
+  p.clear_can_report_rules()
+
+def test_can_capture():
+  p = connect_wo_esp()
+  if p.legacy:
+    return
+  p.set_safety_mode(Panda.SAFETY_ALLOUTPUT)
+  p.set_can_loopback(True)
+  p.set_can_speed_kbps(0, 500)
+
+  p.can_capture_arm(5, addr=0x1ad, dat=b"\x01", bus=0)
+  for _ in range(10):
+    p.can_send(0x1aa, "before", 0)
+  p.can_send(0x1ad, "\x01trig", 0)
+  for _ in range(10):
+    p.can_send(0x1aa, "after", 0)
+  time.sleep(0.05)
+  p.can_recv()
+
+  st = p.can_capture_status()
+  assert_equal(st["state"], "DONE")
+  assert_equal(st["source"], Panda.CAPTURE_ON_FRAME)
+  assert_equal(st["len"], st["pre"] + 5)
+  msgs = p.can_capture_read()
+  assert_equal(len(msgs), st["len"])
+  # the trigger frame is the last one before
+  assert_equal(msgs[st["pre"] - 1][0], 0x1ad)
+  assert_equal(msgs[st["pre"] - 1][3], 0)
+  assert all(m[2] != "before" for m in msgs[st["pre"]:])
+
+  # the host trigger works whatever was armed
+  p.can_capture_arm(0)
+  p.can_send(0x1aa, "message", 0)
+  time.sleep(0.05)
+  st = p.can_capture_status(trigger=True)
+  assert_equal(st["state"], "DONE")
+  assert_equal(st["source"], Panda.CAPTURE_ON_HOST)
+  assert_equal(st["pre"], 2)
+  p.can_capture_status(stop=True)
+
+def test_can_replay():
+  p = connect_wo_esp()
+  p.set_safety_mode(Panda.SAFETY_ALLOUTPUT)
+  p.set_can_loopback(True)
+  p.set_can_speed_kbps(0, 500)
+  p.set_can_timestamps(True)
+  p.can_recv()
+
+  # longer than the legacy ring, and uneven gaps
+  gaps = [500, 5000, 1000, 2000] * 50
+  msgs, ts = [], 0
+  for i, gap in enumerate(gaps):
+    msgs.append((0x1ae, ts, struct.pack("I", i), 0))
+    ts += gap
+  p.can_replay(msgs)
+  time.sleep(ts / 1e6 + 0.1)
+
+  st = p.can_replay_stop()
+  assert_equal(st["sent"], len(msgs))
+  assert_equal(st["dropped"], 0)
+  assert_less(st["late_max_us"], 300)
+
+  recv = [m for m in p.can_recv() if m[0] == 0x1ae and m[3] == 0]
+  p.set_can_timestamps(False)
+  assert_equal([struct.unpack("I", bytes(m[2]))[0] for m in recv], list(range(len(msgs))))
+  for i in range(1, len(recv)):
+    assert abs(((recv[i][1] - recv[i-1][1]) & 0xFFFFFFFF) - gaps[i-1]) < 300
+
+def test_can_send_at():
+  p = connect_wo_esp()
+  p.set_safety_mode(Panda.SAFETY_ALLOUTPUT)
+  p.set_can_loopback(True)
+  p.set_can_speed_kbps(0, 500)
+  p.set_can_timestamps(True)
+  p.can_recv()
+
+  # out of order, they go in time order
+  start = p.get_time() + 50000
+  offsets = [3000, 0, 1000, 2000]
+  p.can_send_at([(0x1af, start + o, struct.pack("I", o), 0) for o in offsets])
+  time.sleep(0.1)
+
+  recv = [m for m in p.can_recv() if m[0] == 0x1af and m[3] == 0]
+  p.set_can_timestamps(False)
+  assert_equal([struct.unpack("I", bytes(m[2]))[0] for m in recv], sorted(offsets))
+  for m in recv:
+    late = (m[1] - (start + struct.unpack("I", bytes(m[2]))[0])) & 0xFFFFFFFF
+    assert_less(late, 300)
+
 def test_safety_nooutput():
   p = connect_wo_esp()
 
@@ -181,6 +445,6 @@ def test_gmlan_bad_toggle():
 def test_serial_debug():
   p = connect_wo_esp()
   junk = p.serial_read(Panda.SERIAL_DEBUG)
-  p.call_control_api(0xc0)
-  assert(p.serial_read(Panda.SERIAL_DEBUG).startswith("can "))
+  p.can_clear(0xFFFF)
+  assert(p.serial_read(Panda.SERIAL_DEBUG).startswith("Clearing CAN"))
 
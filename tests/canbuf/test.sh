@@ -0,0 +1,4 @@
+#!/usr/bin/env sh
+set -e
+make
+python -m unittest discover .
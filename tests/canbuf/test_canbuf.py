@@ -0,0 +1,85 @@
+#!/usr/bin/env python
+# _canbuf against the Python CAN buffer helpers it stands in for, on the
+# records of frames, receipts, extended ids, events and completions
+import os
+import random
+import struct
+import sys
+import unittest
+
+# panda with its Python helpers, then _canbuf as the Makefile builds it
+sys.modules['panda._canbuf'] = None
+import panda
+del sys.modules['panda._canbuf']
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import _canbuf
+
+KINDS = ("normal", "extended", "event", "done")
+
+def make_rec(rnd, kind):
+  bus = rnd.randrange(3) | (0x80 if rnd.random() < 0.3 else 0)
+  dat = bytes(bytearray(rnd.randrange(0x100) for _ in range(8)))
+  if kind == "normal":
+    f1 = rnd.randrange(0x800) << 21
+  elif kind == "extended":
+    f1 = (rnd.randrange(1 << 29) << 3) | 4
+  elif kind == "event":
+    f1, bus = (rnd.randrange(1, 4) << 21) | 1, panda.Panda.EVENT_BUS
+  else:
+    f1 = (rnd.randrange(0x800) << 21) | 1
+  f2 = rnd.randrange(0x10) | (bus << 4) | (rnd.randrange(0x10000) << 16)
+  return struct.pack("<II", f1, f2) + dat
+
+def make_buf(rnd, kinds, n, timestamps):
+  if not timestamps:
+    return b''.join(make_rec(rnd, rnd.choice(kinds)) for _ in range(n))
+  # three 0x14 records to a 0x40 packet, the last one can be short
+  pkts = []
+  for _ in range(n):
+    recs = [make_rec(rnd, rnd.choice(kinds)) + struct.pack("<I", rnd.randrange(1 << 32))
+            for _ in range(rnd.randrange(1, 4))]
+    pkts.append(b''.join(recs).ljust(0x40, b'\x00'))
+  return b''.join(pkts)[:-rnd.randrange(0x40 - 0x14)]
+
+class TestCanBuf(unittest.TestCase):
+  def check(self, kinds):
+    rnd = random.Random(1)
+    for n in (0, 1, 2, 3, 50):
+      for timestamps in (False, True):
+        buf = make_buf(rnd, kinds, n, timestamps)
+        for dat in (buf, bytearray(buf)):
+          if timestamps:
+            self.assertEqual(_canbuf.parse_can_buffer_ts(dat), panda.parse_can_buffer_ts(dat))
+          else:
+            self.assertEqual(_canbuf.parse_can_buffer(dat), panda.parse_can_buffer(dat))
+          self.assertEqual(_canbuf.parse_can_buffer_columns(dat, timestamps),
+                           panda.parse_can_buffer_columns(dat, timestamps))
+
+  def test_normal(self):
+    self.check(("normal",))
+
+  def test_extended(self):
+    self.check(("extended",))
+
+  def test_event(self):
+    self.check(("event",))
+
+  def test_done(self):
+    self.check(("done",))
+
+  def test_mixed(self):
+    self.check(KINDS)
+
+  def test_done_token(self):
+    rec = struct.pack("<II", (0x123 << 21) | 1, 0x1234 << 16) + b'\x34\x12' + b'\x00' * 6
+    self.assertEqual(_canbuf.parse_can_buffer(rec), [(0x123, 0x1234, b'\x34\x12', panda.Panda.CAN_TX_DONE)])
+
+  def test_pack(self):
+    rnd = random.Random(2)
+    arr = [(rnd.choice((rnd.randrange(0x800), rnd.randrange(0x800, 1 << 29))), 0,
+            bytes(bytearray(rnd.randrange(0x100) for _ in range(rnd.randrange(9)))), rnd.randrange(3))
+           for _ in range(100)]
+    self.assertEqual(_canbuf.pack_can_buffer(arr), panda.pack_can_buffer(arr))
+
+if __name__ == "__main__":
+  unittest.main()
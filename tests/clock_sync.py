@@ -0,0 +1,27 @@
+#!/usr/bin/env python
+from __future__ import print_function
+import os
+import sys
+import time
+
+sys.path.append(os.path.join(os.path.dirname(os.path.realpath(__file__)), ".."))
+from panda import Panda, PandaClock
+
+# syncs every connected panda to this host, and prints each one's drift, the
+# error bound of the fit and how far a fresh read lands from it
+if __name__ == "__main__":
+  pandas = [Panda(s) for s in Panda.list()]
+  clocks = [PandaClock(p) for p in pandas]
+  for c in clocks:
+    c.start(float(os.getenv("INTERVAL", "0.2")))
+
+  time.sleep(5.0)
+  while True:
+    for c in clocks:
+      t0 = time.time()
+      ts = c.panda.get_time()
+      t1 = time.time()
+      print("%s drift %+8.2f ppm  error %7.1f us  read off by %+8.1f us" % (
+        c.panda._serial, c.drift_ppm(), c.error * 1e6, (c.to_host(ts) - (t0 + t1) / 2.) * 1e6))
+    print()
+    time.sleep(1.0)
@@ -7,6 +7,11 @@ import signal
 from panda import Panda
 
 class CanHandle(object):
+  # what an ISO-TP request of the canloader takes, for flash_static. Older
+  # canloaders take 0x10, ones with FLASHER_CAN_BLOCK take 0x400.
+  MAX_BULK_WRITE = 0x10
+  MAX_BLOCK_WRITE = 0x400
+
   def __init__(self, p):
     self.p = p
 
@@ -37,8 +42,8 @@ class CanHandle(object):
     return self.transact(dat)
 
   def bulkWrite(self, endpoint, data, timeout=0):
-    if len(data) > 0x10:
-      raise ValueError("Data must not be longer than 0x10")
+    if len(data) > self.MAX_BLOCK_WRITE:
+      raise ValueError("Data must not be longer than 0x%x" % self.MAX_BLOCK_WRITE)
     dat = struct.pack("HH", endpoint, len(data))+data
     return self.transact(dat)
 
@@ -54,6 +59,8 @@ if __name__ == "__main__":
 
   p = Panda()
   p.set_safety_mode(0x1337)
+  # the consecutive frames of a block all have the same id
+  p.set_can_tx_in_order(True)
 
   while 1:
     if len(p.can_recv()) == 0:
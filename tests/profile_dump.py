@@ -0,0 +1,24 @@
+#!/usr/bin/env python
+from __future__ import print_function
+import os
+import sys
+import time
+
+sys.path.append(os.path.join(os.path.dirname(os.path.realpath(__file__)), ".."))
+from panda import Panda
+
+# prints the cycle counts of a PROFILE build every second, run traffic alongside it
+if __name__ == "__main__":
+  panda = Panda(os.getenv("SERIAL"))
+  if panda.profile_stats(clear=True) is None:
+    print("firmware wasn't built with PROFILE")
+    sys.exit(1)
+
+  while True:
+    time.sleep(1.0)
+    stats = panda.profile_stats(clear=os.getenv("CUMULATIVE") is None)
+    print("%-12s %8s %8s %10s %8s" % ("probe", "count", "min", "avg", "max"))
+    for name in Panda.PROFILE_PROBES:
+      s = stats[name]
+      print("%-12s %8d %8d %10.1f %8d" % (name, s["count"], s["min"], s["avg"], s["max"]))
+    print()
@@ -30,9 +30,20 @@ typedef struct
   uint32_t CNT;
 } TIM_TypeDef;
 
-void toyota_rx_hook(CAN_FIFOMailBox_TypeDef *to_push);
-int toyota_tx_hook(CAN_FIFOMailBox_TypeDef *to_send);
-void toyota_init(int16_t param);
+typedef struct safety_state safety_state;
+safety_state *get_safety(void);
+safety_state *new_safety(void);
+int get_state_controls_allowed(safety_state *s);
+int safety_state_set_mode(safety_state *s, uint16_t mode, int16_t param);
+void safety_state_rx_hook(safety_state *s, CAN_FIFOMailBox_TypeDef *to_push);
+
+int safety_set_mode(uint16_t mode, int16_t param);
+void safety_rx_hook(CAN_FIFOMailBox_TypeDef *to_push);
+int safety_tx_hook(CAN_FIFOMailBox_TypeDef *to_send);
+
+void toyota_rx_hook(safety_state *s, CAN_FIFOMailBox_TypeDef *to_push);
+int toyota_tx_hook(safety_state *s, CAN_FIFOMailBox_TypeDef *to_send);
+void toyota_init(safety_state *s, int16_t param);
 void set_controls_allowed(int c);
 int get_controls_allowed(void);
 void init_tests_toyota(void);
@@ -45,9 +56,9 @@ int get_torque_meas_max(void);
 
 void init_tests_honda(void);
 int get_ego_speed(void);
-void honda_init(int16_t param);
-void honda_rx_hook(CAN_FIFOMailBox_TypeDef *to_push);
-int honda_tx_hook(CAN_FIFOMailBox_TypeDef *to_send);
+void honda_init(safety_state *s, int16_t param);
+void honda_rx_hook(safety_state *s, CAN_FIFOMailBox_TypeDef *to_push);
+int honda_tx_hook(safety_state *s, CAN_FIFOMailBox_TypeDef *to_send);
 int get_brake_prev(void);
 int get_gas_prev(void);
 
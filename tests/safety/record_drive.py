@@ -0,0 +1,32 @@
+#!/usr/bin/env python2
+from __future__ import print_function
+import os
+import sys
+
+sys.path.append(os.path.join(os.path.dirname(os.path.realpath(__file__)), "../.."))
+from panda import Panda
+
+# writes everything the panda receives and sends to a log safety_replay reads,
+# the raw 0x14 byte timestamped ep1 records back to back. Ctrl-C to stop.
+if __name__ == "__main__":
+  if len(sys.argv) != 2:
+    print("usage: %s out.log" % sys.argv[0])
+    sys.exit(1)
+
+  panda = Panda(os.getenv("SERIAL"))
+  panda.set_can_timestamps(True)
+  n = 0
+  with open(sys.argv[1], "wb") as f:
+    try:
+      while True:
+        dat = panda._can_read()
+        # three records to a 0x40 packet
+        for i in range(0, len(dat), 0x40):
+          pdat = bytes(dat[i:i+0x40])
+          for j in range(0, len(pdat) - 0x13, 0x14):
+            f.write(pdat[j:j+0x14])
+            n += 1
+    except KeyboardInterrupt:
+      pass
+  panda.set_can_timestamps(False)
+  print("%d frames" % n)
@@ -0,0 +1,282 @@
+// Replays recorded drives and fuzzed frame streams through the safety hooks,
+// on as many threads as asked for. Each thread has its own safety_state and
+// its own TIM2, and checks what the tx hook lets through against limits
+// worked out here from the policy's rules, not from its code.
+//
+//   ./safety_replay [-m mode] [-p param] [-t threads] [-f frames] [-s seed] [log ...]
+//
+// -m and -p are what 0xdc takes, -f is the fuzzed frames per thread. Each log
+// is replayed on a fresh instance, spread over the threads.
+//
+// A log is the 0x14 byte records ep1 sends with timestamps on, back to back:
+// RIR, RDTR, RDLR, RDHR and the time in us. Frames on a bus with 0x80 set are
+// ones the panda sent, they go through the tx hook and the rest through the
+// rx hook. record_drive.py writes them.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "safety_shim.h"
+
+__thread TIM_TypeDef timer;
+#define TIM2 (&timer)
+
+#include "safety.h"
+
+#define LOG_RECORD_LEN 0x14
+#define BUS_RET_FLAG 0x80
+#define VIOLATIONS_SHOWN 10
+
+typedef struct {
+  uint8_t *dat;
+  size_t len;
+  const char *name;
+} drive_log;
+
+typedef struct {
+  // in
+  int idx;
+  uint16_t mode;
+  int16_t param;
+  uint32_t seed;
+  long fuzz_frames;
+  drive_log *logs;
+  int logs_len;
+  int threads;
+
+  // out
+  long frames;
+  long blocked;
+  long violations;
+  char shown[VIOLATIONS_SHOWN][160];
+  int shown_len;
+} replay_job;
+
+// what the oracle remembers between frames, per instance
+typedef struct {
+  int16_t toyota_torque_last;
+} oracle_state;
+
+int16_t toyota_torque(CAN_FIFOMailBox_TypeDef *f) {
+  return (f->RDLR & 0xFF00) | ((f->RDLR >> 16) & 0xFF);
+}
+
+// NULL if the frame the tx hook allowed is fine, else what it broke
+const char *oracle_check(replay_job *job, oracle_state *o, int controls_allowed, CAN_FIFOMailBox_TypeDef *f) {
+  if (f->RIR & 4) return NULL;
+  int addr = f->RIR >> 21;
+  int bus = (f->RDTR >> 4) & 0xFF;
+
+  switch (job->mode) {
+    case SAFETY_HONDA:
+    case SAFETY_HONDA_BOSCH:
+      // brake, steer and gas all carry their command in the first 2 bytes
+      if ((addr == 0x1FA || addr == 0xE4 || addr == 0x194 || addr == 0x200) &&
+          !controls_allowed && (f->RDLR & 0xFFFF)) {
+        return "honda actuation with controls off";
+      }
+      break;
+    case SAFETY_TOYOTA:
+    case SAFETY_TOYOTA_NOLIMITS:
+      if (bus != 0) break;
+      if (addr == 0x343) {
+        int16_t accel = ((f->RDLR & 0xFF) << 8) | ((f->RDLR >> 8) & 0xFF);
+        if (!controls_allowed && accel != 0) return "toyota accel with controls off";
+        if (job->mode == SAFETY_TOYOTA && (accel > MAX_ACCEL || accel < MIN_ACCEL)) return "toyota accel over limit";
+      }
+      if (addr == 0x2E4) {
+        int16_t torque = toyota_torque(f);
+        int16_t last = o->toyota_torque_last;
+        o->toyota_torque_last = controls_allowed ? torque : 0;
+        if (!controls_allowed && torque != 0) return "toyota torque with controls off";
+        if (job->mode != SAFETY_TOYOTA) break;
+        if (torque > MAX_TORQUE || torque < -MAX_TORQUE) return "toyota torque over MAX_TORQUE";
+        // away from zero by at most MAX_RATE_UP a frame
+        if (torque > max(last, 0) + MAX_RATE_UP || torque < min(last, 0) - MAX_RATE_UP) {
+          return "toyota torque rate limit";
+        }
+      }
+      break;
+  }
+  return NULL;
+}
+
+void replay_frame(replay_job *job, safety_state *s, oracle_state *o, CAN_FIFOMailBox_TypeDef *f,
+                  uint32_t ts, const char *src, long n) {
+  timer.CNT = ts;
+  job->frames++;
+
+  int bus = (f->RDTR >> 4) & 0xFF;
+  if (!(bus & BUS_RET_FLAG)) {
+    safety_state_rx_hook(s, f);
+    return;
+  }
+
+  // sent frames are checked with the bus the host gave
+  f->RDTR &= ~(BUS_RET_FLAG << 4);
+  int controls_allowed = s->controls_allowed;
+  if (!safety_state_tx_hook(s, f)) {
+    job->blocked++;
+    // a blocked torque command sends the limits back to zero
+    if (!(f->RIR & 4) && (f->RIR >> 21) == 0x2E4) o->toyota_torque_last = 0;
+    return;
+  }
+
+  const char *err = oracle_check(job, o, controls_allowed, f);
+  if (err == NULL) return;
+  job->violations++;
+  if (job->shown_len < VIOLATIONS_SHOWN) {
+    snprintf(job->shown[job->shown_len++], sizeof(job->shown[0]),
+             "%s frame %ld: %s, RIR %08x RDTR %08x RDLR %08x RDHR %08x",
+             src, n, err, f->RIR, f->RDTR, f->RDLR, f->RDHR);
+  }
+}
+
+uint32_t xorshift(uint32_t *x) {
+  *x ^= *x << 13;
+  *x ^= *x >> 17;
+  *x ^= *x << 5;
+  return *x;
+}
+
+// mostly the ids the mode reads and checks, so the state machines get exercised
+uint32_t fuzz_id(safety_state *s, uint32_t *x) {
+  uint32_t r = xorshift(x);
+  int pick = r % 8;
+  if (pick == 0) return ((xorshift(x) & 0x1FFFFFFF) << 3) | 4;
+  if (pick <= 3 && s->hooks->rx_ids) return s->hooks->rx_ids[xorshift(x) % s->hooks->rx_ids_len] << 21;
+  if (pick <= 6 && s->hooks->tx_ids) return s->hooks->tx_ids[xorshift(x) % s->hooks->tx_ids_len] << 21;
+  return (xorshift(x) & 0x7FF) << 21;
+}
+
+void fuzz(replay_job *job) {
+  safety_state s;
+  oracle_state o = {0};
+  memset(&s, 0, sizeof(s));
+  safety_state_set_mode(&s, job->mode, job->param);
+
+  char src[32];
+  snprintf(src, sizeof(src), "fuzz seed %u", job->seed);
+  uint32_t x = job->seed ? job->seed : 1;
+  uint32_t ts = 0;
+  for (long n = 0; n < job->fuzz_frames; n++) {
+    CAN_FIFOMailBox_TypeDef f;
+    f.RIR = fuzz_id(&s, &x);
+    int bus = xorshift(&x) % 3;
+    int tx = (xorshift(&x) % 3) == 0;
+    int len = (xorshift(&x) % 4) ? 8 : (xorshift(&x) % 9);
+    f.RDTR = (((tx ? BUS_RET_FLAG : 0) | bus) << 4) | len;
+    f.RDLR = xorshift(&x);
+    f.RDHR = xorshift(&x);
+    // small torques more often, so the rate limit gets walked up to
+    if (tx && (xorshift(&x) % 2)) {
+      int16_t t = (int16_t)(xorshift(&x) % 64) - 32;
+      f.RDLR = (f.RDLR & 0xFF0000FF) | (t & 0xFF00) | ((t & 0xFF) << 16);
+    }
+    ts += xorshift(&x) % 20000;
+    replay_frame(job, &s, &o, &f, ts, src, n);
+  }
+}
+
+void replay_log(replay_job *job, drive_log *log) {
+  safety_state s;
+  oracle_state o = {0};
+  memset(&s, 0, sizeof(s));
+  safety_state_set_mode(&s, job->mode, job->param);
+
+  for (size_t i = 0; i + LOG_RECORD_LEN <= log->len; i += LOG_RECORD_LEN) {
+    CAN_FIFOMailBox_TypeDef f;
+    uint32_t ts;
+    memcpy(&f, log->dat + i, sizeof(f));
+    memcpy(&ts, log->dat + i + sizeof(f), sizeof(ts));
+    replay_frame(job, &s, &o, &f, ts, log->name, i / LOG_RECORD_LEN);
+  }
+}
+
+void *replay_thread(void *arg) {
+  replay_job *job = arg;
+  for (int i = job->idx; i < job->logs_len; i += job->threads) replay_log(job, &job->logs[i]);
+  if (job->fuzz_frames > 0) fuzz(job);
+  return NULL;
+}
+
+int read_log(const char *fn, drive_log *log) {
+  FILE *f = fopen(fn, "rb");
+  if (f == NULL) return -1;
+  fseek(f, 0, SEEK_END);
+  log->len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  log->dat = malloc(log->len);
+  log->name = fn;
+  int ok = log->dat != NULL && fread(log->dat, 1, log->len, f) == log->len;
+  fclose(f);
+  return ok ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+  uint16_t mode = SAFETY_TOYOTA;
+  int16_t param = 100;
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  long fuzz_frames = 1000000;
+  uint32_t seed = time(NULL);
+
+  int opt;
+  while ((opt = getopt(argc, argv, "m:p:t:f:s:")) != -1) {
+    switch (opt) {
+      case 'm': mode = strtol(optarg, NULL, 0); break;
+      case 'p': param = strtol(optarg, NULL, 0); break;
+      case 't': threads = atoi(optarg); break;
+      case 'f': fuzz_frames = atol(optarg); break;
+      case 's': seed = strtoul(optarg, NULL, 0); break;
+      default:
+        fprintf(stderr, "usage: %s [-m mode] [-p param] [-t threads] [-f frames] [-s seed] [log ...]\n", argv[0]);
+        return 2;
+    }
+  }
+  if (threads < 1) threads = 1;
+
+  safety_state probe;
+  if (safety_state_set_mode(&probe, mode, param) != 0) {
+    fprintf(stderr, "unknown safety mode 0x%x\n", mode);
+    return 2;
+  }
+
+  int logs_len = argc - optind;
+  drive_log *logs = calloc(logs_len ? logs_len : 1, sizeof(drive_log));
+  for (int i = 0; i < logs_len; i++) {
+    if (read_log(argv[optind + i], &logs[i]) != 0) {
+      fprintf(stderr, "can't read %s\n", argv[optind + i]);
+      return 2;
+    }
+  }
+
+  replay_job *jobs = calloc(threads, sizeof(replay_job));
+  pthread_t *tids = calloc(threads, sizeof(pthread_t));
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < threads; i++) {
+    jobs[i] = (replay_job){.idx = i, .mode = mode, .param = param, .seed = seed + i,
+                           .fuzz_frames = fuzz_frames, .logs = logs, .logs_len = logs_len, .threads = threads};
+    pthread_create(&tids[i], NULL, replay_thread, &jobs[i]);
+  }
+
+  long frames = 0, blocked = 0, violations = 0;
+  for (int i = 0; i < threads; i++) {
+    pthread_join(tids[i], NULL);
+    frames += jobs[i].frames;
+    blocked += jobs[i].blocked;
+    violations += jobs[i].violations;
+    for (int j = 0; j < jobs[i].shown_len; j++) printf("VIOLATION %s\n", jobs[i].shown[j]);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  printf("mode 0x%x, %d threads, %d logs, seed %u\n", mode, threads, logs_len, seed);
+  printf("%ld frames in %.2f s, %.0f frames/s\n", frames, secs, frames / secs);
+  printf("%ld blocked, %ld violations\n", blocked, violations);
+  return violations ? 1 : 0;
+}
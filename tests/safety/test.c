@@ -1,50 +1,33 @@
-#include <stdint.h>
-#include <stdbool.h>
-
-typedef struct
-{
-  uint32_t TIR;  /*!< CAN TX mailbox identifier register */
-  uint32_t TDTR; /*!< CAN mailbox data length control and time stamp register */
-  uint32_t TDLR; /*!< CAN mailbox data low register */
-  uint32_t TDHR; /*!< CAN mailbox data high register */
-} CAN_TxMailBox_TypeDef;
-
-typedef struct
-{
-  uint32_t RIR;  /*!< CAN receive FIFO mailbox identifier register */
-  uint32_t RDTR; /*!< CAN receive FIFO mailbox data length control and time stamp register */
-  uint32_t RDLR; /*!< CAN receive FIFO mailbox data low register */
-  uint32_t RDHR; /*!< CAN receive FIFO mailbox data high register */
-} CAN_FIFOMailBox_TypeDef;
-
-typedef struct
-{
-  uint32_t CNT;
-} TIM_TypeDef;
+#include <stdlib.h>
+
+#include "safety_shim.h"
 
 TIM_TypeDef timer;
 TIM_TypeDef *TIM2 = &timer;
 
-#define min(a,b)                                \
-  ({ __typeof__ (a) _a = (a);                   \
-    __typeof__ (b) _b = (b);                    \
-    _a < _b ? _a : _b; })
+#define static
+#include "safety.h"
 
-#define max(a,b)                                \
-  ({ __typeof__ (a) _a = (a);                   \
-    __typeof__ (b) _b = (b);                    \
-    _a > _b ? _a : _b; })
+// the firmware's instance, the python tests pass it to the policy hooks
+safety_state *get_safety(void){
+  return &safety;
+}
 
+// another instance, for checking they don't share state
+safety_state *new_safety(void){
+  return calloc(1, sizeof(safety_state));
+}
 
-#define static
-#include "safety.h"
+int get_state_controls_allowed(safety_state *s){
+  return s->controls_allowed;
+}
 
 void set_controls_allowed(int c){
-  controls_allowed = c;
+  safety.controls_allowed = c;
 }
 
 int get_controls_allowed(void){
-  return controls_allowed;
+  return safety.controls_allowed;
 }
 
 void set_timer(int t){
@@ -52,50 +35,50 @@ void set_timer(int t){
 }
 
 void set_torque_meas(int min, int max){
-  torque_meas_min = min;
-  torque_meas_max = max;
+  safety.toyota.torque_meas_min = min;
+  safety.toyota.torque_meas_max = max;
 }
 
 int get_torque_meas_min(void){
-  return torque_meas_min;
+  return safety.toyota.torque_meas_min;
 }
 
 int get_torque_meas_max(void){
-  return torque_meas_max;
+  return safety.toyota.torque_meas_max;
 }
 
 void set_rt_torque_last(int t){
-  rt_torque_last = t;
+  safety.toyota.rt_torque_last = t;
 }
 
 void set_desired_torque_last(int t){
-  desired_torque_last = t;
+  safety.toyota.desired_torque_last = t;
 }
 
 int get_ego_speed(void){
-  return ego_speed;
+  return safety.honda.ego_speed;
 }
 
 int get_brake_prev(void){
-  return brake_prev;
+  return safety.honda.brake_prev;
 }
 
 int get_gas_prev(void){
-  return gas_prev;
+  return safety.honda.gas_prev;
 }
 
 void init_tests_toyota(void){
-  torque_meas_min = 0;
-  torque_meas_max = 0;
-  desired_torque_last = 0;
-  rt_torque_last = 0;
-  ts_last = 0;
+  safety.toyota.torque_meas_min = 0;
+  safety.toyota.torque_meas_max = 0;
+  safety.toyota.desired_torque_last = 0;
+  safety.toyota.rt_torque_last = 0;
+  safety.toyota.ts_last = 0;
   set_timer(0);
 }
 
 void init_tests_honda(void){
-  ego_speed = 0;
-  gas_interceptor_detected = 0;
-  brake_prev = 0;
-  gas_prev = 0;
+  safety.honda.ego_speed = 0;
+  safety.honda.gas_interceptor_detected = 0;
+  safety.honda.brake_prev = 0;
+  safety.honda.gas_prev = 0;
 }
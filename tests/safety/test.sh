@@ -1,2 +1,9 @@
 #!/usr/bin/env sh
+set -e
 python -m unittest discover .
+
+# fuzz every mode with limits, same seed every run
+make safety_replay
+for mode in 1 4 2 3; do
+  ./safety_replay -m $mode -f 1000000 -s 1
+done
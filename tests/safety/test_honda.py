@@ -8,7 +8,8 @@ class TestHondaSafety(unittest.TestCase):
   @classmethod
   def setUp(cls):
     cls.safety = libpandasafety_py.libpandasafety
-    cls.safety.honda_init(0)
+    cls.state = cls.safety.get_safety()
+    cls.safety.honda_init(cls.state, 0)
     cls.safety.init_tests_honda()
 
   def _speed_msg(self, speed):
@@ -65,83 +66,112 @@ class TestHondaSafety(unittest.TestCase):
 
   def test_resume_button(self):
     RESUME_BTN = 4
-    self.safety.honda_rx_hook(self._button_msg(RESUME_BTN))
+    self.safety.honda_rx_hook(self.state, self._button_msg(RESUME_BTN))
     self.assertTrue(self.safety.get_controls_allowed())
 
   def test_set_button(self):
     SET_BTN = 3
-    self.safety.honda_rx_hook(self._button_msg(SET_BTN))
+    self.safety.honda_rx_hook(self.state, self._button_msg(SET_BTN))
     self.assertTrue(self.safety.get_controls_allowed())
 
   def test_cancel_button(self):
     CANCEL_BTN = 2
     self.safety.set_controls_allowed(1)
-    self.safety.honda_rx_hook(self._button_msg(CANCEL_BTN))
+    self.safety.honda_rx_hook(self.state, self._button_msg(CANCEL_BTN))
     self.assertFalse(self.safety.get_controls_allowed())
 
   def test_sample_speed(self):
     self.assertEqual(0, self.safety.get_ego_speed())
-    self.safety.honda_rx_hook(self._speed_msg(100))
+    self.safety.honda_rx_hook(self.state, self._speed_msg(100))
     self.assertEqual(100, self.safety.get_ego_speed())
 
   def test_prev_brake(self):
     self.assertFalse(self.safety.get_brake_prev())
-    self.safety.honda_rx_hook(self._brake_msg(True))
+    self.safety.honda_rx_hook(self.state, self._brake_msg(True))
     self.assertTrue(self.safety.get_brake_prev())
 
   def test_disengage_on_brake(self):
     self.safety.set_controls_allowed(1)
-    self.safety.honda_rx_hook(self._brake_msg(1))
+    self.safety.honda_rx_hook(self.state, self._brake_msg(1))
     self.assertFalse(self.safety.get_controls_allowed())
 
   def test_allow_brake_at_zero_speed(self):
     # Brake was already pressed
-    self.safety.honda_rx_hook(self._brake_msg(True))
+    self.safety.honda_rx_hook(self.state, self._brake_msg(True))
     self.safety.set_controls_allowed(1)
 
-    self.safety.honda_rx_hook(self._brake_msg(True))
+    self.safety.honda_rx_hook(self.state, self._brake_msg(True))
     self.assertTrue(self.safety.get_controls_allowed())
 
   def test_not_allow_brake_when_moving(self):
     # Brake was already pressed
-    self.safety.honda_rx_hook(self._brake_msg(True))
-    self.safety.honda_rx_hook(self._speed_msg(100))
+    self.safety.honda_rx_hook(self.state, self._brake_msg(True))
+    self.safety.honda_rx_hook(self.state, self._speed_msg(100))
     self.safety.set_controls_allowed(1)
 
-    self.safety.honda_rx_hook(self._brake_msg(True))
+    self.safety.honda_rx_hook(self.state, self._brake_msg(True))
     self.assertFalse(self.safety.get_controls_allowed())
 
   def test_prev_gas(self):
     self.assertFalse(self.safety.get_gas_prev())
-    self.safety.honda_rx_hook(self._gas_msg(True))
+    self.safety.honda_rx_hook(self.state, self._gas_msg(True))
     self.assertTrue(self.safety.get_gas_prev())
 
   def test_disengage_on_gas(self):
     self.safety.set_controls_allowed(1)
-    self.safety.honda_rx_hook(self._gas_msg(1))
+    self.safety.honda_rx_hook(self.state, self._gas_msg(1))
     self.assertFalse(self.safety.get_controls_allowed())
 
   def test_allow_engage_with_gas_pressed(self):
-    self.safety.honda_rx_hook(self._gas_msg(1))
+    self.safety.honda_rx_hook(self.state, self._gas_msg(1))
     self.safety.set_controls_allowed(1)
-    self.safety.honda_rx_hook(self._gas_msg(1))
+    self.safety.honda_rx_hook(self.state, self._gas_msg(1))
     self.assertTrue(self.safety.get_controls_allowed())
 
   def test_brake_safety_check(self):
-    self.assertTrue(self.safety.honda_tx_hook(self._send_brake_msg(0x0000)))
-    self.assertFalse(self.safety.honda_tx_hook(self._send_brake_msg(0x1000)))
+    self.assertTrue(self.safety.honda_tx_hook(self.state, self._send_brake_msg(0x0000)))
+    self.assertFalse(self.safety.honda_tx_hook(self.state, self._send_brake_msg(0x1000)))
 
     self.safety.set_controls_allowed(1)
-    self.assertTrue(self.safety.honda_tx_hook(self._send_brake_msg(0x1000)))
-    self.assertFalse(self.safety.honda_tx_hook(self._send_brake_msg(0x00F0)))
+    self.assertTrue(self.safety.honda_tx_hook(self.state, self._send_brake_msg(0x1000)))
+    self.assertFalse(self.safety.honda_tx_hook(self.state, self._send_brake_msg(0x00F0)))
 
   def test_gas_safety_check(self):
-    self.assertTrue(self.safety.honda_tx_hook(self._send_brake_msg(0x0000)))
-    self.assertFalse(self.safety.honda_tx_hook(self._send_brake_msg(0x1000)))
+    self.assertTrue(self.safety.honda_tx_hook(self.state, self._send_brake_msg(0x0000)))
+    self.assertFalse(self.safety.honda_tx_hook(self.state, self._send_brake_msg(0x1000)))
 
   def test_steer_safety_check(self):
-    self.assertTrue(self.safety.honda_tx_hook(self._send_steer_msg(0x0000)))
-    self.assertFalse(self.safety.honda_tx_hook(self._send_steer_msg(0x1000)))
+    self.assertTrue(self.safety.honda_tx_hook(self.state, self._send_steer_msg(0x0000)))
+    self.assertFalse(self.safety.honda_tx_hook(self.state, self._send_steer_msg(0x1000)))
+
+  def test_id_dispatch(self):
+    SAFETY_HONDA = 1
+    self.safety.safety_set_mode(SAFETY_HONDA, 0)
+
+    # listed ids still reach the hooks through the dispatch
+    self.safety.safety_rx_hook(self._button_msg(4))
+    self.assertTrue(self.safety.get_controls_allowed())
+    self.safety.set_controls_allowed(0)
+    self.assertFalse(self.safety.safety_tx_hook(self._send_brake_msg(0x1000)))
+
+    # frames with other ids skip them
+    other = self._button_msg(4)
+    other[0].RIR = 0x1A7 << 21
+    self.safety.safety_rx_hook(other)
+    self.assertFalse(self.safety.get_controls_allowed())
+    other = self._send_brake_msg(0x1000)
+    other[0].RIR = 0x1FB << 21
+    self.assertTrue(self.safety.safety_tx_hook(other))
+
+  def test_instances(self):
+    SAFETY_HONDA = 1
+    other = self.safety.new_safety()
+    self.safety.safety_state_set_mode(other, SAFETY_HONDA, 0)
+
+    # a button on one instance doesn't engage the other
+    self.safety.safety_state_rx_hook(other, self._button_msg(4))
+    self.assertTrue(self.safety.get_state_controls_allowed(other))
+    self.assertFalse(self.safety.get_controls_allowed())
 
 
 if __name__ == "__main__":
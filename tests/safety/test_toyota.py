@@ -26,7 +26,8 @@ class TestToyotaSafety(unittest.TestCase):
   @classmethod
   def setUp(cls):
     cls.safety = libpandasafety_py.libpandasafety
-    cls.safety.toyota_init(100)
+    cls.state = cls.safety.get_safety()
+    cls.safety.toyota_init(cls.state, 100)
     cls.safety.init_tests_toyota()
 
   def _set_prev_torque(self, t):
@@ -70,7 +71,7 @@ class TestToyotaSafety(unittest.TestCase):
     to_push[0].RIR = 0x1D2 << 21
     to_push[0].RDHR = 0xF00000
 
-    self.safety.toyota_rx_hook(to_push)
+    self.safety.toyota_rx_hook(self.state, to_push)
     self.assertTrue(self.safety.get_controls_allowed())
 
   def test_disable_control_allowed_from_cruise(self):
@@ -79,7 +80,7 @@ class TestToyotaSafety(unittest.TestCase):
     to_push[0].RDHR = 0
 
     self.safety.set_controls_allowed(1)
-    self.safety.toyota_rx_hook(to_push)
+    self.safety.toyota_rx_hook(self.state, to_push)
     self.assertFalse(self.safety.get_controls_allowed())
 
   def test_accel_actuation_limits(self):
@@ -91,7 +92,7 @@ class TestToyotaSafety(unittest.TestCase):
           send = MIN_ACCEL <= accel <= MAX_ACCEL
         else:
           send = accel == 0
-        self.assertEqual(send, self.safety.toyota_tx_hook(self._accel_msg(accel)))
+        self.assertEqual(send, self.safety.toyota_tx_hook(self.state, self._accel_msg(accel)))
 
   def test_torque_absolute_limits(self):
     for controls_allowed in [True, False]:
@@ -106,16 +107,16 @@ class TestToyotaSafety(unittest.TestCase):
           else:
             send = torque == 0
 
-          self.assertEqual(send, self.safety.toyota_tx_hook(self._torque_msg(torque)))
+          self.assertEqual(send, self.safety.toyota_tx_hook(self.state, self._torque_msg(torque)))
 
   def test_non_realtime_limit_up(self):
     self.safety.set_controls_allowed(True)
 
     self._set_prev_torque(0)
-    self.assertTrue(self.safety.toyota_tx_hook(self._torque_msg(MAX_RATE_UP)))
+    self.assertTrue(self.safety.toyota_tx_hook(self.state, self._torque_msg(MAX_RATE_UP)))
 
     self._set_prev_torque(0)
-    self.assertFalse(self.safety.toyota_tx_hook(self._torque_msg(MAX_RATE_UP + 1)))
+    self.assertFalse(self.safety.toyota_tx_hook(self.state, self._torque_msg(MAX_RATE_UP + 1)))
 
   def test_non_realtime_limit_down(self):
     self.safety.set_controls_allowed(True)
@@ -123,12 +124,12 @@ class TestToyotaSafety(unittest.TestCase):
     self.safety.set_rt_torque_last(1000)
     self.safety.set_torque_meas(500, 500)
     self.safety.set_desired_torque_last(1000)
-    self.assertTrue(self.safety.toyota_tx_hook(self._torque_msg(1000 - MAX_RATE_DOWN)))
+    self.assertTrue(self.safety.toyota_tx_hook(self.state, self._torque_msg(1000 - MAX_RATE_DOWN)))
 
     self.safety.set_rt_torque_last(1000)
     self.safety.set_torque_meas(500, 500)
     self.safety.set_desired_torque_last(1000)
-    self.assertFalse(self.safety.toyota_tx_hook(self._torque_msg(1000 - MAX_RATE_DOWN + 1)))
+    self.assertFalse(self.safety.toyota_tx_hook(self.state, self._torque_msg(1000 - MAX_RATE_DOWN + 1)))
 
   def test_exceed_torque_sensor(self):
     self.safety.set_controls_allowed(True)
@@ -137,9 +138,9 @@ class TestToyotaSafety(unittest.TestCase):
       self._set_prev_torque(0)
       for t in np.arange(0, MAX_TORQUE_ERROR + 10, 10):
         t *= sign
-        self.assertTrue(self.safety.toyota_tx_hook(self._torque_msg(t)))
+        self.assertTrue(self.safety.toyota_tx_hook(self.state, self._torque_msg(t)))
 
-      self.assertFalse(self.safety.toyota_tx_hook(self._torque_msg(sign * (MAX_TORQUE_ERROR + 10))))
+      self.assertFalse(self.safety.toyota_tx_hook(self.state, self._torque_msg(sign * (MAX_TORQUE_ERROR + 10))))
 
   def test_realtime_limit_up(self):
     self.safety.set_controls_allowed(True)
@@ -150,33 +151,33 @@ class TestToyotaSafety(unittest.TestCase):
       for t in np.arange(0, 380, 10):
         t *= sign
         self.safety.set_torque_meas(t, t)
-        self.assertTrue(self.safety.toyota_tx_hook(self._torque_msg(t)))
-      self.assertFalse(self.safety.toyota_tx_hook(self._torque_msg(sign * 380)))
+        self.assertTrue(self.safety.toyota_tx_hook(self.state, self._torque_msg(t)))
+      self.assertFalse(self.safety.toyota_tx_hook(self.state, self._torque_msg(sign * 380)))
 
       self._set_prev_torque(0)
       for t in np.arange(0, 370, 10):
         t *= sign
         self.safety.set_torque_meas(t, t)
-        self.assertTrue(self.safety.toyota_tx_hook(self._torque_msg(t)))
+        self.assertTrue(self.safety.toyota_tx_hook(self.state, self._torque_msg(t)))
 
       # Increase timer to update rt_torque_last
       self.safety.set_timer(RT_INTERVAL + 1)
-      self.assertTrue(self.safety.toyota_tx_hook(self._torque_msg(sign * 370)))
-      self.assertTrue(self.safety.toyota_tx_hook(self._torque_msg(sign * 380)))
+      self.assertTrue(self.safety.toyota_tx_hook(self.state, self._torque_msg(sign * 370)))
+      self.assertTrue(self.safety.toyota_tx_hook(self.state, self._torque_msg(sign * 380)))
 
   def test_torque_measurements(self):
-    self.safety.toyota_rx_hook(self._torque_meas_msg(50))
-    self.safety.toyota_rx_hook(self._torque_meas_msg(-50))
-    self.safety.toyota_rx_hook(self._torque_meas_msg(0))
+    self.safety.toyota_rx_hook(self.state, self._torque_meas_msg(50))
+    self.safety.toyota_rx_hook(self.state, self._torque_meas_msg(-50))
+    self.safety.toyota_rx_hook(self.state, self._torque_meas_msg(0))
 
     self.assertEqual(-51, self.safety.get_torque_meas_min())
     self.assertEqual(51, self.safety.get_torque_meas_max())
 
-    self.safety.toyota_rx_hook(self._torque_meas_msg(0))
+    self.safety.toyota_rx_hook(self.state, self._torque_meas_msg(0))
     self.assertEqual(-1, self.safety.get_torque_meas_max())
     self.assertEqual(-51, self.safety.get_torque_meas_min())
 
-    self.safety.toyota_rx_hook(self._torque_meas_msg(0))
+    self.safety.toyota_rx_hook(self.state, self._torque_meas_msg(0))
     self.assertEqual(-1, self.safety.get_torque_meas_max())
     self.assertEqual(-1, self.safety.get_torque_meas_min())
 
@@ -0,0 +1,1773 @@
+// Runs the firmware's CAN and USB paths on the simulation in sim.c, faster
+// than real time, and checks that every frame is accounted for.
+//
+//   ./can_sim [-s rx|tx|isotp|group|ecu|gateway|autobaud|flush|defer|filters] [-t ms] [-r fps] [-b packets] [-n buses] [-c us] [-i] [-g n] [-k n] [-e mode] [-o fps] [-x n] [-l] [-q] [-v]
+//
+// rx: the node on each bus sends frames at -r a second, 0 for back to back,
+// and the host reads ep1 a packet at a time, -b packets a ms. Each frame has
+// its number on the bus in RDLR, they have to come up in order, and what the
+// host got plus what the panda and its bxCAN dropped has to be what was sent.
+//
+// tx: the host sets ALLOUTPUT and writes ep3 at -r frames a second a bus,
+// 0 for as fast as -b allows, reading ep1 for the echoes at the same rate.
+// With TXFP on, or off with -q, the node has to see them in order, and them
+// plus the panda's TX drops has to be what was written, with an echo for each. -e sets the
+// echo mode of every bus: 1 has completions instead, their tokens counting up
+// in the order the frames were written, and 2 has no echoes at all.
+//
+// -l in tx has the host switch to alt 2, bus 0's frames on ep1 and the
+// others' on ep3, and slows the last bus to LANE_SLOW_CBPS so -r backs its
+// queue up. The host keeps what's due until the lane's endpoint takes it
+// again. Nothing may be dropped, bus 0's writes never held off and the slow
+// bus's have to have been, it then has LANE_DRAIN_MS to send the rest.
+//
+// -o in tx sets every bus to one-shot and has the node send frames that win
+// arbitration at -o a second. The panda's frames they beat aren't sent
+// again, and have to be counted as failed, with a failed completion for each
+// unless -e is 2, so the written ones still add up.
+//
+// isotp: an ISO-TP channel on each bus, padded and with a block size of 8.
+// The host sends a request on ep2 once the last response is back, and the
+// node, an ECU, answers it, the lengths going through isotp_lens. The node's
+// flow control has a block size of 32 and -r as its STmin byte. Every PDU has
+// to come back whole, every frame of the panda padded and its consecutive
+// frames at least STmin apart.
+//
+// group: every 1000000/-r us, 1000 a second at 0, the host writes a frame for
+// each bus, a record a packet with GROUP_PACKET_NS between them like a busy
+// USB. Every other time they're a transmit group, and each second group of
+// those is released at a TIM2 time GROUP_AHEAD_US after it's written. Each
+// grouped set of frames has to be on the buses within GROUP_SKEW_MAX_NS of
+// each other, and the timed ones no later than GROUP_LATE_MAX_US after their
+// time. The loose sets' skew is printed to compare.
+//
+// ecu: an ECU emulation entry on each bus answers 02 01 0c on 0x7df with
+// ECU_FRAMES frames on 0x7e8, ECU_DELAY_US after it and ECU_GAP_US apart.
+// The node sends it every 1000000/-r us, 200 a second at 0 and at most
+// ECU_FPS_MAX, every other time with a PID the entry doesn't match. Each
+// request has to be answered with every frame in order within
+// ECU_LATE_MAX_NS of its time, the others not at all, the host has to read
+// all of them, and the firmware's counts have to be the node's.
+//
+// gateway: the node on bus 0 sends a frame on each of five ids every
+// GW_STEP_NS, and gateway rules forward one to bus 1, one to bus 2 with its
+// id and some of its data replaced, one to bus 1 at most every
+// GW_INTERVAL_MS, and drop one that bus 0's forwarding to bus 2 would
+// otherwise send, which still has the fifth id. A rule added and removed
+// before the load has to be gone, and the first id's rule, a drop, is changed
+// to forward it halfway through with the table loaded again. Buses 1 and 2
+// have to see just what the rules say, the limited id's interval kept over
+// the load, the host every frame of bus 0, and the rules' counts have to be
+// of what the node sent since the last load.
+//
+// autobaud: the node on bus 0 sends at 1 Mbps and on bus 1 at 83.3 kbps for
+// -t ms, then the host has 0xa2 find the bitrates with a dwell of
+// AUTOBAUD_DWELL_MS. Bus 2 is quiet. Within AUTOBAUD_MAX_MS it has to be
+// done, with buses 0 and 1 found and then received at their rates, and bus
+// 2 found to have nothing.
+//
+// flush: the node on bus 0 sends at -r a second, FLUSH_FPS at 0, and the
+// host reads ep1 every FLUSH_POLL_NS with 0xa3 set to immediate, a fill of
+// FLUSH_FILL, a deadline of FLUSH_DEADLINE_US and SOF aligned in turn, -t ms
+// all four. Every frame has to come up, the immediate ones in about a frame a
+// transfer and the others in transfers as full as the policy says, never one
+// waiting longer than it allows, and SOF aligned never twice in a ms.
+//
+// defer: every DEFER_CYCLE_MS the host writes ep3 packets of frames for
+// buses 1 and 2 with PendSV held, as behind a run of USB IRQs, until the
+// endpoint NAKs, which has to be at the staging ring's length. The node on
+// bus 0 sends at -r a second, DEFER_FPS at 0, and the host reads ep1 all
+// along, PendSV is let go halfway through the cycle. Frames have to come up
+// while it's held, the endpoint has to take packets again once it's let go,
+// every frame written has to go out in order, and 0xa4 has to count every
+// packet staged and none done in the USB IRQ.
+//
+// filters: the host filters buses 0 and 2 to FILTERS_HOST_ID, then sets the
+// Honda safety mode, whose hooks need FILTERS_SAFETY_ID, and Honda Bosch,
+// which forwards bus 2. After each the node on both buses sends the safety's
+// id and FILTERS_OTHER_ID. The filter banks have to take the safety's id in
+// both modes, and everything on bus 2 once it's forwarded.
+//
+// -c has the firmware coalesce the RX IRQs under load, with -c us as the
+// bound on the wait. It then has to have coalesced with no FIFO overruns, and
+// gone back to an IRQ a frame once the buses were quiet.
+//
+// -g has CAN2 switched to GMLAN and back n times first. All but the first
+// switch have to reuse the registers of the mode, and the scenario's checks
+// then show CAN2 was set up again right.
+//
+// -k in rx changes bus 0's bitrate n times while the frames come, between
+// 500 and 250 kbps, each followed by a TX order request that changes
+// nothing. Bus 0 has to be reconfigured every time without a can_init, the
+// other CANs never touched, and rx's checks then show no bus lost a frame.
+//
+// -i has the firmware keep its per id stats. Their counts have to add up to
+// what each bus received, and in rx at -r the ids' average period has to be
+// the rate's.
+//
+// -x in rx turns the event stream's ignition on and switches the started
+// line n times while the frames come. Every edge and the level it started
+// from have to come out on ep1 with the frames, in order, as the line went.
+//
+// -t is the time simulated, after which there's 100 ms for the queues to
+// drain, a second for ISO-TP. -v prints the firmware's debug output. Returns
+// 1 if a check fails.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "sim.h"
+
+#define MS_NS 1000000ULL
+#define DRAIN_MS 100
+#define USB_PACKET_LEN 0x40
+#define RECORD_LEN 0x10
+#define BUS_RET_FLAG 0x80
+#define LATENCY_LEN 0x10000
+#define ISOTP_DRAIN_MS 1000
+
+typedef struct {
+  // in the data of the frames, the next to go and the next expected back
+  uint32_t seq_out;
+  uint32_t seq_in;
+  uint64_t budget; // frames due, in thousandths
+  long injected;
+  long delivered;
+  long echoes;
+  long completions; // echoes that were
+  long bad_tokens;  // a completion's token not after the last one
+  long failures;    // completions of frames one-shot didn't send
+  uint64_t node_budget; // for -o, like budget
+  long backlog;         // for -l, due and not written yet
+  long held;            // steps with a backlog that the lane's endpoint NAKed
+  int last_token;
+  long out_of_order;
+  // when ep3 got each frame, for its time to the end of it on the bus
+  uint64_t written_ns[LATENCY_LEN];
+  uint64_t latency_sum_ns;
+  uint64_t latency_max_ns;
+} bus_state;
+
+int verbose = 0;
+int bitrate_changes = 0;
+int echo_mode = 0;
+int contend_fps = 0;
+int ignition_switches = 0;
+int lanes = 0;
+// tx's frames by id priority, TXFP off
+int tx_by_id = 0;
+bus_state buses[SIM_CAN_MAX];
+
+// the event stream's ignition records, for -x
+#define EVENT_RECORD_BUS 0x7F
+#define EVENT_RECORD_IGNITION 1
+long ignition_events = 0;
+long ignition_bad = 0; // not the level the line was switched to, or out of order
+uint32_t ignition_last_ts = 0;
+
+void sim_reset(void) {
+  fprintf(stderr, "the firmware reset itself at %llu ns\n", (unsigned long long)sim_now_ns());
+  exit(1);
+}
+
+void print_debug(void) {
+  char c;
+  while (sim_debug_getc(&c)) {
+    if (verbose) putchar(c);
+  }
+}
+
+// the panda's stats of a bus, from 0xc0
+uint32_t fw_stat(int bus, int offset) {
+  uint8_t resp[0x40];
+  uint32_t v = 0;
+  if (sim_usb_control(0xc0, bus, 0, sizeof(resp), resp) >= offset + 4) memcpy(&v, resp + offset, 4);
+  return v;
+}
+
+#define FW_RX_CNT 0
+#define FW_RX_DROP 12
+#define FW_TX_DROP 16
+#define FW_RX_SUPPRESSED 38
+#define FW_TX_FAIL 42
+
+// the node's frames for -o, ahead of the panda's 0x200s
+#define CONTEND_ID 0x180U
+
+// one ep1 packet, returns the frames in it
+int read_packet(int nbuses) {
+  uint8_t pkt[USB_PACKET_LEN];
+  int len = sim_usb_ep1_in(pkt, sizeof(pkt));
+  for (int i = 0; i + RECORD_LEN <= len; i += RECORD_LEN) {
+    uint32_t rec[4];
+    memcpy(rec, pkt + i, sizeof(rec));
+    int bus = (rec[1] >> 4) & 0xFF;
+    if (bus == EVENT_RECORD_BUS && (rec[0] & 1)) {
+      // the level alternates from on, the first is where it started from
+      int on = (ignition_events & 1) == 0;
+      if (((rec[0] >> 25) != EVENT_RECORD_IGNITION) || ((rec[1] & 0xF) != 1) || ((int)(rec[2] & 0xFF) != on) ||
+          (ignition_events > 0 && (int32_t)(rec[3] - ignition_last_ts) <= 0)) ignition_bad += 1;
+      ignition_last_ts = rec[3];
+      ignition_events += 1;
+      continue;
+    }
+    int echo = (bus & BUS_RET_FLAG) != 0;
+    bus &= ~BUS_RET_FLAG;
+    if (bus >= nbuses) continue;
+    bus_state *b = &buses[bus];
+    if (!echo && contend_fps > 0 && (rec[0] >> 21) == CONTEND_ID + bus) continue;
+    if (echo) {
+      b->echoes += 1;
+      if (rec[0] & 1) {
+        // TXRQ, a completion, ep3's tokens are 10 bits
+        int token = rec[2] & 0x3FF;
+        int ahead = (token - b->last_token) & 0x3FF;
+        if (b->completions > 0 && (ahead == 0 || ahead >= 0x200)) b->bad_tokens += 1;
+        b->last_token = token;
+        b->completions += 1;
+        if (rec[2] & 0x8000) b->failures += 1;
+      }
+      continue;
+    }
+    if (rec[2] < b->seq_in) b->out_of_order += 1;
+    b->seq_in = rec[2] + 1;
+    b->delivered += 1;
+  }
+  return len / RECORD_LEN;
+}
+
+// the firmware's per id stats, as can_census.h has them
+typedef struct {
+  uint32_t RIR;
+  uint8_t bus;
+  uint8_t dlc;
+  uint16_t dlcs;
+  uint32_t count;
+  uint32_t last_ts;
+  uint32_t min_period;
+  uint32_t max_period;
+  uint64_t period_sum;
+  uint32_t RDLR;
+  uint32_t RDHR;
+} census_entry;
+
+// the entries add up to each bus's rx count, at fps the one id a bus has
+// comes at the rate
+int check_census(int fps, int nbuses) {
+  uint32_t st[4];
+  sim_usb_control(0xca, 0, 0, sizeof(st), (uint8_t *)st);
+  long counts[SIM_CAN_MAX] = {0};
+  int ok = (st[0] == 1) && (st[2] == 0);
+  double worst_us = 0;
+  census_entry e;
+  for (uint32_t i = 0; i < st[1]; i++) {
+    if (sim_usb_control(0xcb, i, 0, sizeof(e), (uint8_t *)&e) != sizeof(e) || e.bus >= nbuses) {
+      ok = 0;
+      continue;
+    }
+    counts[e.bus] += e.count;
+    if (fps > 0 && e.count > 1) {
+      double avg = (double)e.period_sum / (e.count - 1);
+      double off = avg - 1e6 / fps;
+      if (off < 0) off = -off;
+      if (off > worst_us) worst_us = off;
+      ok &= (e.min_period <= avg) && (avg <= e.max_period) && (e.dlcs == (1 << 8));
+    }
+  }
+  for (int bus = 0; bus < nbuses; bus++) ok &= (counts[bus] == (long)fw_stat(bus, FW_RX_CNT));
+  if (fps > 0) ok &= (worst_us < 1.0);
+  printf("census: %u ids, missed %u, avg period off by %.2f us max%s\n", st[1], st[2], worst_us, ok ? "" : "  FAIL");
+  return ok;
+}
+
+// CAN2 to GMLAN and back n times, from 0xcc
+int check_gmlan(int n) {
+  uint8_t resp[0x40];
+  for (int i = 0; i < n; i++) {
+    sim_usb_control(0xdb, 1, 1, 0, resp);
+    sim_usb_control(0xdb, 0, 0, 0, resp);
+  }
+  uint32_t st[5];
+  sim_usb_control(0xcc, 0, 0, sizeof(st), (uint8_t *)st);
+  int ok = ((st[0] & 0xFF) == 0xFF) && (st[1] == 2U * n) && (st[2] == 2U * n - 1);
+  printf("gmlan: switches %u, fast %u, %u us max%s\n", st[1], st[2], st[4], ok ? "" : "  FAIL");
+  return ok;
+}
+
+// the safety mode and TX order the scenario set up, done by the main loop
+int check_deferred(void) {
+  uint32_t st[5];
+  sim_usb_control(0xce, 0, 0, sizeof(st), (uint8_t *)st);
+  int ok = (st[0] > 0) && (st[1] == st[0]) && (st[2] == 0);
+  printf("deferred: queued %u, done %u, runs %u, %u us max%s\n", st[0], st[1], st[3], st[4], ok ? "" : "  FAIL");
+  return ok;
+}
+
+// the CAN reconfigs of 0xce since inits were done
+int check_reconfig(int n, uint32_t inits) {
+  uint32_t st[9];
+  sim_usb_control(0xce, 0, 0, sizeof(st), (uint8_t *)st);
+  int ok = (st[5] == inits) && (st[6] == (uint32_t)n) && (st[7] == (uint32_t)n * SIM_CAN_MAX) && (st[8] == 0);
+  printf("reconfig: inits %u, reconfigs %u, unchanged %u, timeouts %u, %u us max%s\n",
+         st[5] - inits, st[6], st[7], st[8], st[4], ok ? "" : "  FAIL");
+  return ok;
+}
+
+// frames the rate gives a bus for the step, all it can take at 0
+int frames_due(uint64_t *budget, int fps, uint64_t step_ns) {
+  if (fps == 0) return -1;
+  *budget += (uint64_t)fps * step_ns / 1000;
+  int n = *budget / MS_NS;
+  *budget %= MS_NS;
+  return n;
+}
+
+void run_rx(int duration_ms, int fps, int packets, int nbuses) {
+  uint8_t resp[0x40];
+  uint64_t step_ns = MS_NS / packets;
+  uint64_t end_ns = (uint64_t)(duration_ms + DRAIN_MS) * MS_NS;
+  uint64_t change_ns = (uint64_t)duration_ms * MS_NS / (bitrate_changes + 1);
+  int changes = 0;
+  uint64_t switch_ns = (uint64_t)duration_ms * MS_NS / (ignition_switches + 1);
+  int switches = 0;
+  if (ignition_switches > 0) {
+    sim_ignition(1);
+    sim_usb_control(0xe3, 1 << EVENT_RECORD_IGNITION, 0, 0, resp);
+  }
+  for (uint64_t t = step_ns; t <= end_ns; t += step_ns) {
+    if (switches < ignition_switches && t >= (switches + 1) * switch_ns) {
+      switches += 1;
+      sim_ignition(!(switches & 1));
+    }
+    if (changes < bitrate_changes && t >= (changes + 1) * change_ns) {
+      changes += 1;
+      sim_usb_control(0xde, 0, (changes & 1) ? 2500 : 5000, 0, resp);
+      sim_usb_control(0xe7, 0, 0, 0, resp);
+    }
+    if (t <= (uint64_t)duration_ms * MS_NS) {
+      for (int bus = 0; bus < nbuses; bus++) {
+        bus_state *b = &buses[bus];
+        for (int n = frames_due(&b->budget, fps, step_ns); n != 0; n--) {
+          if (!sim_can_send(bus, ((0x100U + bus) << 21), 8, b->seq_out, bus)) break;
+          b->seq_out += 1;
+        }
+      }
+    }
+    sim_run(t);
+    read_packet(nbuses);
+    print_debug();
+  }
+  while (read_packet(nbuses) > 0);
+}
+
+// the next frame of the bus, written now
+void tx_fill(int bus, uint32_t *rec) {
+  bus_state *b = &buses[bus];
+  rec[0] = ((0x200U + bus) << 21) | 1;
+  rec[1] = 8 | (bus << 4);
+  rec[2] = b->seq_out;
+  rec[3] = bus;
+  b->written_ns[b->seq_out % LATENCY_LEN] = sim_now_ns();
+  b->seq_out += 1;
+  b->injected += 1;
+}
+
+#define LANE_SLOW_CBPS 1250
+#define LANE_DRAIN_MS 1000
+
+// for -l, a packet of bus 0's backlog on ep1 and one of the others' on ep3
+// taking them in turn, unless the endpoint is NAKing
+void lanes_write(int nbuses) {
+  static int next_bus = 1;
+  for (int lane = 0; lane < 2; lane++) {
+    int first = lane, last = lane ? nbuses : 1;
+    long waiting = 0;
+    for (int bus = first; bus < last; bus++) waiting += buses[bus].backlog;
+    if (waiting == 0) continue;
+    if (!sim_usb_out_ready(lane ? 3 : 1)) {
+      for (int bus = first; bus < last; bus++) buses[bus].held += (buses[bus].backlog > 0);
+      continue;
+    }
+
+    uint32_t pkt[USB_PACKET_LEN / 4];
+    int len = 0;
+    for (int tries = 0; tries < last - first && len < USB_PACKET_LEN; ) {
+      int bus = lane ? next_bus : 0;
+      if (lane) next_bus = (next_bus + 1 < nbuses) ? next_bus + 1 : 1;
+      if (buses[bus].backlog == 0) {
+        tries++;
+        continue;
+      }
+      tx_fill(bus, &pkt[len / 4]);
+      buses[bus].backlog -= 1;
+      len += RECORD_LEN;
+      tries = 0;
+    }
+    if (lane) {
+      sim_usb_ep3_out((uint8_t *)pkt, len);
+    } else {
+      sim_usb_ep1_out((uint8_t *)pkt, len);
+    }
+  }
+}
+
+void run_tx(int duration_ms, int fps, int packets, int nbuses) {
+  uint8_t resp[0x40];
+  sim_usb_control(0xdc, 0x1337, 0, 0, resp);
+  // the frames of a bus all have the same id, without TXFP they have to be
+  // kept in order by what's loaded in which mailbox
+  sim_usb_control(0xe7, !tx_by_id, 0, 0, resp);
+  for (int bus = 0; bus < nbuses; bus++) {
+    sim_usb_control(0xcf, bus, echo_mode, sizeof(resp), resp);
+    if (contend_fps > 0) sim_usb_control(0xd4, bus, 1, 0, resp);
+  }
+  if (lanes) {
+    sim_usb_set_interface(2);
+    sim_usb_control(0xde, nbuses - 1, LANE_SLOW_CBPS, 0, resp);
+  }
+
+  uint64_t step_ns = MS_NS / packets;
+  uint64_t end_ns = (uint64_t)(duration_ms + (lanes ? LANE_DRAIN_MS : DRAIN_MS)) * MS_NS;
+  int next_bus = 0;
+  for (uint64_t t = step_ns; t <= end_ns; t += step_ns) {
+    // the frames due, in one packet taking the buses in turn
+    if (t <= (uint64_t)duration_ms * MS_NS) {
+      int due[SIM_CAN_MAX];
+      for (int bus = 0; bus < nbuses; bus++) due[bus] = frames_due(&buses[bus].budget, fps, step_ns);
+
+      uint32_t pkt[USB_PACKET_LEN / 4];
+      int len = 0;
+      for (int tries = 0; tries < nbuses && len < USB_PACKET_LEN && !lanes; ) {
+        int bus = next_bus;
+        if (due[bus] == 0) {
+          next_bus = (next_bus + 1) % nbuses;
+          tries++;
+          continue;
+        }
+        tx_fill(bus, &pkt[len / 4]);
+        if (due[bus] > 0) due[bus] -= 1;
+        len += RECORD_LEN;
+        next_bus = (next_bus + 1) % nbuses;
+        tries = 0;
+      }
+      if (len > 0) sim_usb_ep3_out((uint8_t *)pkt, len);
+      for (int bus = 0; bus < nbuses && lanes; bus++) buses[bus].backlog += due[bus];
+
+      for (int bus = 0; bus < nbuses && contend_fps > 0; bus++) {
+        for (int n = frames_due(&buses[bus].node_budget, contend_fps, step_ns); n > 0; n--) {
+          if (!sim_can_send(bus, (CONTEND_ID + bus) << 21, 8, 0, 0)) break;
+        }
+      }
+    }
+    if (lanes) lanes_write(nbuses);
+
+    sim_run(t);
+    read_packet(nbuses);
+    print_debug();
+
+    for (int bus = 0; bus < nbuses; bus++) {
+      bus_state *b = &buses[bus];
+      sim_frame f;
+      while (sim_can_recv(bus, &f)) {
+        if (f.RDLR < b->seq_in) b->out_of_order += 1;
+        b->seq_in = f.RDLR + 1;
+        b->delivered += 1;
+        uint64_t latency = f.time_ns - b->written_ns[f.RDLR % LATENCY_LEN];
+        b->latency_sum_ns += latency;
+        if (latency > b->latency_max_ns) b->latency_max_ns = latency;
+      }
+    }
+  }
+  while (read_packet(nbuses) > 0);
+}
+
+// ***************************** transmit groups *****************************
+
+#define GROUP_ID 0x300U
+#define GROUP_PACKET_NS 50000ULL
+#define GROUP_AHEAD_US 500U
+#define GROUP_SKEW_MAX_NS 1000ULL
+#define GROUP_LATE_MAX_US 5U
+#define GROUP_SETS 0x1000
+// the buses boot at 500 kbps, a frame is CAN_FRAME_BITS of them
+#define GROUP_BIT_NS 2000ULL
+#define GROUP_FRAME_NS(dlc) ((47 + (8 * (dlc))) * GROUP_BIT_NS)
+// control records with TXRQ clear, the kind in RDTR
+#define GROUP_KIND_GROUP 1
+#define GROUP_KIND_RELEASE 2
+#define GROUP_KIND_RELEASE_AT 3
+
+typedef struct {
+  int grouped;
+  int timed;
+  uint32_t due_us;
+  int seen;
+  uint64_t first_ns; // when the first and the last of the set were done on the bus
+  uint64_t last_ns;
+} group_set;
+
+group_set group_sets[GROUP_SETS];
+
+typedef struct {
+  long sets[2];         // by grouped, that came whole
+  uint64_t skew_sum_ns[2];
+  uint64_t skew_max_ns[2];
+  long incomplete;
+  long late;            // timed sets that started past GROUP_LATE_MAX_US
+  long early;
+  uint32_t late_max_us;
+} group_result;
+
+group_result group_res;
+
+void group_write(uint32_t kind, uint32_t ts, const uint32_t *frame) {
+  uint32_t rec[4] = {0, kind, ts, 0};
+  sim_usb_ep3_out((uint8_t *)(frame ? frame : rec), RECORD_LEN);
+  sim_run(sim_now_ns() + GROUP_PACKET_NS);
+}
+
+void group_collect(int nbuses) {
+  for (int bus = 0; bus < nbuses; bus++) {
+    sim_frame f;
+    while (sim_can_recv(bus, &f)) {
+      group_set *g = &group_sets[f.RDLR % GROUP_SETS];
+      if (g->seen == 0 || f.time_ns < g->first_ns) g->first_ns = f.time_ns;
+      if (g->seen == 0 || f.time_ns > g->last_ns) g->last_ns = f.time_ns;
+      g->seen += 1;
+      buses[bus].delivered += 1;
+      if (g->timed) {
+        // from the end of the frame to its start
+        uint64_t start_ns = f.time_ns - GROUP_FRAME_NS(f.RDTR & 0xF);
+        int64_t late_ns = (int64_t)start_ns - (int64_t)g->due_us * 1000;
+        if (late_ns < 0) group_res.early += 1;
+        if (late_ns > (int64_t)GROUP_LATE_MAX_US * 1000) group_res.late += 1;
+        if (late_ns > (int64_t)group_res.late_max_us * 1000) group_res.late_max_us = late_ns / 1000;
+      }
+      if (g->seen == nbuses) {
+        uint64_t skew = g->last_ns - g->first_ns;
+        group_res.sets[g->grouped] += 1;
+        group_res.skew_sum_ns[g->grouped] += skew;
+        if (skew > group_res.skew_max_ns[g->grouped]) group_res.skew_max_ns[g->grouped] = skew;
+      }
+    }
+  }
+}
+
+void run_group(int duration_ms, int fps, int nbuses) {
+  uint8_t resp[0x40];
+  sim_usb_control(0xdc, 0x1337, 0, 0, resp);
+  sim_usb_control(0xe7, 1, 0, 0, resp);
+  uint64_t period_ns = 1000000000ULL / (fps ? fps : 1000);
+  uint32_t set = 0;
+  for (uint64_t t = period_ns; t <= (uint64_t)duration_ms * MS_NS; t += period_ns) {
+    sim_run(t);
+    group_set *g = &group_sets[set % GROUP_SETS];
+    if (g->seen != 0 && g->seen != nbuses) group_res.incomplete += 1;
+    memset(g, 0, sizeof(*g));
+    g->grouped = set & 1;
+    g->timed = g->grouped && (set & 2);
+    g->due_us = (uint32_t)(sim_now_ns() / 1000) + GROUP_AHEAD_US;
+
+    if (g->grouped) group_write(GROUP_KIND_GROUP, 0, NULL);
+    for (int bus = 0; bus < nbuses; bus++) {
+      uint32_t rec[4] = {((GROUP_ID + bus) << 21) | 1, 8 | (bus << 4), set, bus};
+      group_write(0, 0, rec);
+      buses[bus].injected += 1;
+    }
+    if (g->grouped) group_write(g->timed ? GROUP_KIND_RELEASE_AT : GROUP_KIND_RELEASE, g->due_us, NULL);
+    set += 1;
+
+    group_collect(nbuses);
+    while (read_packet(nbuses) > 0);
+    print_debug();
+  }
+  sim_run(sim_now_ns() + DRAIN_MS * MS_NS);
+  group_collect(nbuses);
+  while (read_packet(nbuses) > 0);
+  for (uint32_t i = 0; i < set && i < GROUP_SETS; i++) {
+    if (group_sets[i].seen != nbuses) group_res.incomplete += 1;
+  }
+}
+
+int check_group(int nbuses) {
+  uint32_t st[6];
+  sim_usb_control(0xcd, 0, 0, sizeof(st), (uint8_t *)st);
+  group_result *r = &group_res;
+  int ok = (r->incomplete == 0) && (r->sets[1] > 0) && (r->skew_max_ns[1] <= GROUP_SKEW_MAX_NS) &&
+           (r->late == 0) && (r->early == 0) && (st[0] == (uint32_t)r->sets[1]) && (st[2] == 0) && (st[3] == 0) &&
+           (nbuses == 1 || r->skew_max_ns[0] > r->skew_max_ns[1]);
+  printf("groups: %ld released, skew %.1f us avg %.1f us max, loose %.1f us avg %.1f us max, timed %u us late max, "
+         "firmware %u released %u us skew %u us late max, incomplete %ld%s\n",
+         r->sets[1], r->sets[1] ? r->skew_sum_ns[1] / 1000.0 / r->sets[1] : 0.0, r->skew_max_ns[1] / 1000.0,
+         r->sets[0] ? r->skew_sum_ns[0] / 1000.0 / r->sets[0] : 0.0, r->skew_max_ns[0] / 1000.0, r->late_max_us,
+         st[0], st[4], st[5], r->incomplete, ok ? "" : "  FAIL");
+  return ok;
+}
+
+// ***************************** ISO-TP *****************************
+
+#define ISOTP_TX_ID 0x7E0
+#define ISOTP_RX_ID 0x7E8
+#define ISOTP_PAD_BYTE 0xAA
+#define ISOTP_PANDA_BS 8
+#define ISOTP_NODE_BS 32
+#define ISOTP_PDU_MAX 4095
+#define ISOTP_RECORD_HEADER 3
+// KLINE_MSG_FLAG | ISOTP_MSG_FLAG, and KLINE_MSG_MORE
+#define ISOTP_EP2 0xA0
+#define ISOTP_EP2_MORE 0x40
+
+// firmware's 0xc6 parameters and record statuses
+#define ISOTP_PARAM_OPEN 0
+#define ISOTP_PARAM_BUS 1
+#define ISOTP_PARAM_TX_ID_LO 2
+#define ISOTP_PARAM_TX_ID_HI 3
+#define ISOTP_PARAM_RX_ID_LO 4
+#define ISOTP_PARAM_RX_ID_HI 5
+#define ISOTP_PARAM_PAD 6
+#define ISOTP_PARAM_BS 7
+#define ISOTP_PARAM_STMIN 8
+#define ISOTP_PAD 0x100
+#define ISOTP_STATUS_RX 0
+#define ISOTP_STATUS_TX_DONE 1
+
+const int isotp_lens[] = {1, 7, 8, 62, 4095, 300, 4000};
+#define ISOTP_LENS ((int)(sizeof(isotp_lens) / sizeof(isotp_lens[0])))
+
+typedef struct {
+  // the node, the request coming in and its response going out
+  uint8_t req[ISOTP_PDU_MAX];
+  int req_len;
+  int req_pos;
+  int req_active;
+  uint8_t req_seq;
+  int req_block;
+  uint64_t last_cf_ns; // 0 after a flow control
+  int resp_len;
+  int resp_pos;
+  uint8_t resp_seq;
+
+  // the host
+  uint32_t pdu; // the exchange going on
+  int busy;
+  uint8_t records[2 * (ISOTP_PDU_MAX + ISOTP_RECORD_HEADER)];
+  int records_len;
+
+  long requests;
+  long responses;
+  long tx_done;
+  long bytes;
+  long errors;
+  long mismatches;
+  long unpadded;
+  long stmin_violations;
+} isotp_bus;
+
+isotp_bus isotp[SIM_CAN_MAX];
+uint64_t isotp_stmin_ns = 0;
+uint8_t isotp_stmin = 0;
+
+uint8_t isotp_byte(uint32_t pdu, int i, int response) {
+  return (pdu * 13) + (i * 7) + response;
+}
+
+int isotp_req_len(uint32_t pdu) {
+  return isotp_lens[pdu % ISOTP_LENS];
+}
+
+int isotp_resp_len(uint32_t pdu) {
+  return isotp_lens[(pdu + 3) % ISOTP_LENS];
+}
+
+void isotp_node_send(int bus, const uint8_t *dat, int len) {
+  uint8_t frame[8];
+  memset(frame, ISOTP_PAD_BYTE, sizeof(frame));
+  memcpy(frame, dat, len);
+  uint32_t words[2];
+  memcpy(words, frame, sizeof(words));
+  sim_can_send(bus, ISOTP_RX_ID << 21, 8, words[0], words[1]);
+}
+
+void isotp_node_fc(int bus) {
+  uint8_t fc[3] = {0x30, ISOTP_NODE_BS, isotp_stmin};
+  isotp_node_send(bus, fc, sizeof(fc));
+  isotp[bus].last_cf_ns = 0;
+}
+
+// the consecutive frames of the response, up to a block of bs
+void isotp_node_cfs(int bus, int bs) {
+  isotp_bus *s = &isotp[bus];
+  for (int i = 0; s->resp_pos < s->resp_len && (bs == 0 || i < bs); i++) {
+    uint8_t cf[8];
+    int len = s->resp_len - s->resp_pos;
+    if (len > 7) len = 7;
+    cf[0] = 0x20 | s->resp_seq;
+    for (int j = 0; j < len; j++) cf[1 + j] = isotp_byte(s->pdu, s->resp_pos + j, 1);
+    isotp_node_send(bus, cf, len + 1);
+    s->resp_pos += len;
+    s->resp_seq = (s->resp_seq + 1) & 0xF;
+  }
+}
+
+void isotp_node_request_done(int bus) {
+  isotp_bus *s = &isotp[bus];
+  s->req_active = 0;
+  int ok = s->req_len == isotp_req_len(s->pdu);
+  for (int i = 0; ok && i < s->req_len; i++) ok = s->req[i] == isotp_byte(s->pdu, i, 0);
+  if (!ok) s->mismatches += 1;
+
+  uint8_t frame[8];
+  s->resp_len = isotp_resp_len(s->pdu);
+  if (s->resp_len <= 7) {
+    frame[0] = s->resp_len;
+    for (int i = 0; i < s->resp_len; i++) frame[1 + i] = isotp_byte(s->pdu, i, 1);
+    isotp_node_send(bus, frame, s->resp_len + 1);
+    s->resp_pos = s->resp_len;
+  } else {
+    frame[0] = 0x10 | (s->resp_len >> 8);
+    frame[1] = s->resp_len & 0xFF;
+    for (int i = 0; i < 6; i++) frame[2 + i] = isotp_byte(s->pdu, i, 1);
+    isotp_node_send(bus, frame, 8);
+    s->resp_pos = 6;
+    s->resp_seq = 1;
+  }
+}
+
+// a frame the panda sent
+void isotp_node_frame(int bus, const sim_frame *f) {
+  isotp_bus *s = &isotp[bus];
+  if ((f->RIR >> 21) != ISOTP_TX_ID) return;
+  if ((f->RDTR & 0xF) != 8) s->unpadded += 1;
+  uint8_t dat[8];
+  memcpy(dat, &f->RDLR, 4);
+  memcpy(dat + 4, &f->RDHR, 4);
+
+  switch (dat[0] >> 4) {
+    case 0:
+      s->req_len = dat[0] & 0xF;
+      memcpy(s->req, dat + 1, s->req_len);
+      for (int i = 1 + s->req_len; i < 8; i++) {
+        if (dat[i] != ISOTP_PAD_BYTE) s->unpadded += 1;
+      }
+      isotp_node_request_done(bus);
+      break;
+    case 1:
+      s->req_len = ((dat[0] & 0xF) << 8) | dat[1];
+      memcpy(s->req, dat + 2, 6);
+      s->req_pos = 6;
+      s->req_active = 1;
+      s->req_seq = 1;
+      s->req_block = ISOTP_NODE_BS;
+      isotp_node_fc(bus);
+      break;
+    case 2: {
+      if (!s->req_active) break;
+      if ((dat[0] & 0xF) != s->req_seq) s->mismatches += 1;
+      if (s->last_cf_ns != 0 && f->time_ns - s->last_cf_ns < isotp_stmin_ns) s->stmin_violations += 1;
+      s->last_cf_ns = f->time_ns;
+      int len = s->req_len - s->req_pos;
+      if (len > 7) len = 7;
+      memcpy(s->req + s->req_pos, dat + 1, len);
+      s->req_pos += len;
+      s->req_seq = (s->req_seq + 1) & 0xF;
+      if (s->req_pos == s->req_len) {
+        isotp_node_request_done(bus);
+      } else if (--s->req_block == 0) {
+        s->req_block = ISOTP_NODE_BS;
+        isotp_node_fc(bus);
+      }
+      break;
+    }
+    case 3:
+      if ((dat[0] & 0xF) == 0) isotp_node_cfs(bus, dat[1]);
+      break;
+  }
+}
+
+void isotp_host_send(int bus) {
+  isotp_bus *s = &isotp[bus];
+  int len = isotp_req_len(s->pdu);
+  for (int pos = 0; pos < len; pos += USB_PACKET_LEN - 1) {
+    uint8_t pkt[USB_PACKET_LEN];
+    int n = len - pos;
+    if (n > USB_PACKET_LEN - 1) n = USB_PACKET_LEN - 1;
+    pkt[0] = ISOTP_EP2 | bus | ((pos + n < len) ? ISOTP_EP2_MORE : 0);
+    for (int i = 0; i < n; i++) pkt[1 + i] = isotp_byte(s->pdu, pos + i, 0);
+    sim_usb_ep2_out(pkt, n + 1);
+  }
+  s->busy = 1;
+  s->requests += 1;
+}
+
+void isotp_host_record(int bus, int status, const uint8_t *dat, int len) {
+  isotp_bus *s = &isotp[bus];
+  if (status == ISOTP_STATUS_TX_DONE) {
+    s->tx_done += 1;
+    return;
+  }
+  if (status == ISOTP_STATUS_RX) {
+    int ok = len == isotp_resp_len(s->pdu);
+    for (int i = 0; ok && i < len; i++) ok = dat[i] == isotp_byte(s->pdu, i, 1);
+    if (!ok) s->mismatches += 1;
+    s->responses += 1;
+    s->bytes += isotp_req_len(s->pdu) + len;
+  } else {
+    if (verbose) printf("bus %d: exchange %u got status %d\n", bus, s->pdu, status);
+    s->errors += 1;
+  }
+  s->pdu += 1;
+  s->busy = 0;
+}
+
+// the channels' records on ep2 IN
+void isotp_host_read(int nbuses) {
+  uint8_t pkt[USB_PACKET_LEN];
+  int len;
+  while ((len = sim_usb_ep2_in(pkt, sizeof(pkt))) > 0) {
+    int bus = pkt[0] & 0x1F;
+    if ((pkt[0] & 0xE0) != ISOTP_EP2 || bus >= nbuses) continue;
+    isotp_bus *s = &isotp[bus];
+    memcpy(s->records + s->records_len, pkt + 1, len - 1);
+    s->records_len += len - 1;
+    while (s->records_len >= ISOTP_RECORD_HEADER) {
+      int rec_len = s->records[1] | (s->records[2] << 8);
+      if (s->records_len < ISOTP_RECORD_HEADER + rec_len) break;
+      isotp_host_record(bus, s->records[0], s->records + ISOTP_RECORD_HEADER, rec_len);
+      s->records_len -= ISOTP_RECORD_HEADER + rec_len;
+      memmove(s->records, s->records + ISOTP_RECORD_HEADER + rec_len, s->records_len);
+    }
+  }
+}
+
+void isotp_set(int bus, int param, uint16_t value) {
+  uint8_t resp[0x40];
+  sim_usb_control(0xc6, bus | (param << 8), value, 0, resp);
+}
+
+void run_isotp(int duration_ms, int stmin, int packets, int nbuses) {
+  uint8_t resp[0x40];
+  sim_usb_control(0xdc, 0x1337, 0, 0, resp);
+  // TXFP, for the consecutive frames three mailboxes at a time
+  sim_usb_control(0xe7, 1, 0, 0, resp);
+
+  isotp_stmin = stmin;
+  if (stmin <= 0x7F) {
+    isotp_stmin_ns = stmin * MS_NS;
+  } else if (stmin >= 0xF1 && stmin <= 0xF9) {
+    isotp_stmin_ns = (stmin - 0xF0) * 100000ULL;
+  }
+  for (int bus = 0; bus < nbuses; bus++) {
+    isotp_set(bus, ISOTP_PARAM_BUS, bus);
+    isotp_set(bus, ISOTP_PARAM_TX_ID_LO, (ISOTP_TX_ID << 21) & 0xFFFF);
+    isotp_set(bus, ISOTP_PARAM_TX_ID_HI, (ISOTP_TX_ID << 21) >> 16);
+    isotp_set(bus, ISOTP_PARAM_RX_ID_LO, (ISOTP_RX_ID << 21) & 0xFFFF);
+    isotp_set(bus, ISOTP_PARAM_RX_ID_HI, (ISOTP_RX_ID << 21) >> 16);
+    isotp_set(bus, ISOTP_PARAM_PAD, ISOTP_PAD | ISOTP_PAD_BYTE);
+    isotp_set(bus, ISOTP_PARAM_BS, ISOTP_PANDA_BS);
+    isotp_set(bus, ISOTP_PARAM_STMIN, 0);
+    isotp_set(bus, ISOTP_PARAM_OPEN, 1);
+  }
+
+  uint64_t step_ns = MS_NS / packets;
+  uint64_t end_ns = (uint64_t)(duration_ms + ISOTP_DRAIN_MS) * MS_NS;
+  for (uint64_t t = step_ns; t <= end_ns; t += step_ns) {
+    int busy = 0;
+    for (int bus = 0; bus < nbuses; bus++) {
+      if (!isotp[bus].busy && t <= (uint64_t)duration_ms * MS_NS) isotp_host_send(bus);
+      busy |= isotp[bus].busy;
+    }
+    if (!busy) break;
+
+    sim_run(t);
+    isotp_host_read(nbuses);
+    read_packet(nbuses);
+    print_debug();
+
+    for (int bus = 0; bus < nbuses; bus++) {
+      sim_frame f;
+      while (sim_can_recv(bus, &f)) isotp_node_frame(bus, &f);
+    }
+  }
+  while (read_packet(nbuses) > 0);
+}
+
+// ***************************** ECU emulation *****************************
+
+#define ECU_REQ_ID 0x7DFU
+#define ECU_RESP_ID 0x7E8U
+#define ECU_DELAY_US 2000U
+#define ECU_GAP_US 300U
+#define ECU_FRAMES 2
+// a request, 02 01 0c, and one with the next PID that no entry answers
+#define ECU_REQ_DATA 0x0C0102U
+#define ECU_LATE_MAX_NS 5000
+#define ECU_EARLY_MAX_NS 2000
+// the answer is done before the next request that has one
+#define ECU_FPS_MAX 500
+
+// firmware's 0xee parameters
+#define CAN_RESPONDER_PARAM_ON 0
+#define CAN_RESPONDER_PARAM_BUS 1
+#define CAN_RESPONDER_PARAM_ID_LO 2
+#define CAN_RESPONDER_PARAM_ID_HI 3
+#define CAN_RESPONDER_PARAM_LEN 4
+#define CAN_RESPONDER_PARAM_DELAY 5
+#define CAN_RESPONDER_PARAM_GAP 6
+#define CAN_RESPONDER_PARAM_FRAMES 7
+#define CAN_RESPONDER_PARAM_DATA 8
+#define CAN_RESPONDER_PARAM_FRAME 16
+
+typedef struct {
+  long requests;   // the ones that match, the node sends as many that don't
+  long answers;    // frames
+  long unexpected; // out of turn, or for a request that doesn't match
+  long host_requests; // of both kinds, on ep1
+  uint64_t req_end_ns; // of the last matching one
+  int next_frame;
+  int64_t late_min_ns;
+  int64_t late_max_ns;
+} ecu_bus;
+
+ecu_bus ecu[SIM_CAN_MAX];
+
+void ecu_set(int bus, int param, uint16_t value) {
+  uint8_t resp[0x40];
+  sim_usb_control(0xee, bus | (param << 8), value, 0, resp);
+}
+
+void ecu_collect(int nbuses) {
+  for (int bus = 0; bus < nbuses; bus++) {
+    ecu_bus *e = &ecu[bus];
+    sim_frame f;
+    while (sim_can_recv(bus, &f)) {
+      if ((f.RIR >> 21) != ECU_RESP_ID || (int)(f.RDLR & 0xFF) != e->next_frame) {
+        e->unexpected += 1;
+        continue;
+      }
+      uint64_t start_ns = f.time_ns - GROUP_FRAME_NS(f.RDTR & 0xF);
+      int64_t late_ns = (int64_t)start_ns - (int64_t)(e->req_end_ns + (ECU_DELAY_US + e->next_frame * ECU_GAP_US) * 1000ULL);
+      if (e->answers == 0 || late_ns < e->late_min_ns) e->late_min_ns = late_ns;
+      if (e->answers == 0 || late_ns > e->late_max_ns) e->late_max_ns = late_ns;
+      e->answers += 1;
+      e->next_frame += 1;
+    }
+  }
+  uint8_t pkt[USB_PACKET_LEN];
+  int len;
+  while ((len = sim_usb_ep1_in(pkt, sizeof(pkt))) > 0) {
+    for (int i = 0; i + RECORD_LEN <= len; i += RECORD_LEN) {
+      uint32_t rec[4];
+      memcpy(rec, pkt + i, sizeof(rec));
+      int bus = (rec[1] >> 4) & 0xFF;
+      if (bus < nbuses && (rec[0] >> 21) == ECU_REQ_ID) ecu[bus].host_requests += 1;
+    }
+  }
+}
+
+void run_ecu(int duration_ms, int fps, int nbuses) {
+  uint8_t resp[0x40];
+  sim_usb_control(0xdc, 0x1337, 0, 0, resp);
+  for (int bus = 0; bus < nbuses; bus++) {
+    ecu_set(bus, CAN_RESPONDER_PARAM_BUS, bus);
+    ecu_set(bus, CAN_RESPONDER_PARAM_ID_LO, (ECU_REQ_ID << 21) & 0xFFFF);
+    ecu_set(bus, CAN_RESPONDER_PARAM_ID_HI, (ECU_REQ_ID << 21) >> 16);
+    ecu_set(bus, CAN_RESPONDER_PARAM_LEN, 3);
+    for (int i = 0; i < 3; i++) ecu_set(bus, CAN_RESPONDER_PARAM_DATA + i, ((ECU_REQ_DATA >> (8 * i)) & 0xFF) | 0xFF00);
+    ecu_set(bus, CAN_RESPONDER_PARAM_DELAY, ECU_DELAY_US);
+    ecu_set(bus, CAN_RESPONDER_PARAM_GAP, ECU_GAP_US);
+    ecu_set(bus, CAN_RESPONDER_PARAM_FRAMES, ECU_FRAMES);
+    for (int j = 0; j < ECU_FRAMES; j++) {
+      uint32_t words[4] = {ECU_RESP_ID << 21, 8, j, bus};
+      for (int h = 0; h < 8; h++) {
+        ecu_set(bus, CAN_RESPONDER_PARAM_FRAME + (j * 8) + h, (words[h >> 1] >> ((h & 1) * 16)) & 0xFFFF);
+      }
+    }
+    ecu_set(bus, CAN_RESPONDER_PARAM_ON, 1);
+  }
+
+  // each request on an idle bus, after the answer to the one before
+  uint64_t period_ns = 1000000000ULL / (fps ? fps : 200);
+  long n = 0;
+  for (uint64_t t = period_ns; t <= (uint64_t)duration_ms * MS_NS; t += period_ns) {
+    sim_run(t);
+    ecu_collect(nbuses);
+    int match = (n & 1) == 0;
+    for (int bus = 0; bus < nbuses; bus++) {
+      ecu_bus *e = &ecu[bus];
+      if (match && e->next_frame != ECU_FRAMES && e->requests > 0) e->unexpected += 1;
+      sim_can_send(bus, ECU_REQ_ID << 21, 8, ECU_REQ_DATA + (match ? 0 : 0x010000), 0);
+      if (match) {
+        e->requests += 1;
+        e->req_end_ns = sim_now_ns() + GROUP_FRAME_NS(8);
+        e->next_frame = 0;
+      }
+    }
+    n += 1;
+    print_debug();
+  }
+  sim_run(sim_now_ns() + DRAIN_MS * MS_NS);
+  ecu_collect(nbuses);
+}
+
+int check_ecu(int nbuses) {
+  int failed = 0;
+  for (int bus = 0; bus < nbuses; bus++) {
+    ecu_bus *e = &ecu[bus];
+    uint32_t st[4];
+    sim_usb_control(0xef, bus, 0, sizeof(st), (uint8_t *)st);
+    int ok = (e->requests > 0) && (e->answers == e->requests * ECU_FRAMES) && (e->unexpected == 0) &&
+             (e->host_requests == 2 * e->requests) && (e->late_min_ns >= -ECU_EARLY_MAX_NS) &&
+             (e->late_max_ns <= ECU_LATE_MAX_NS) && (st[0] == 1) && (st[1] == (uint32_t)e->requests) &&
+             (st[2] == (uint32_t)(e->requests * ECU_FRAMES)) && (st[3] == 0);
+    printf("bus %d: requests %ld, answered %ld frames, unexpected %ld, read %ld, %.1f to %.1f us off, firmware %u requests %u scheduled %u dropped%s\n",
+           bus, e->requests, e->answers, e->unexpected, e->host_requests, e->late_min_ns / 1000.0,
+           e->late_max_ns / 1000.0, st[1], st[2], st[3], ok ? "" : "  FAIL");
+    failed |= !ok;
+  }
+  return !failed;
+}
+
+// ***************************** gateway rules *****************************
+
+// the node on bus 0 sends one of each a step
+#define GW_PLAIN_ID 0x100U   // to bus 1, dropped until the table is loaded again
+#define GW_REWRITE_ID 0x101U // to bus 2 as GW_NEW_ID, byte 0 and byte 4's low nibble replaced
+#define GW_LIMITED_ID 0x102U // to bus 1, one every GW_INTERVAL_MS
+#define GW_DROP_ID 0x103U    // dropped, can_forwarding has the rest
+#define GW_OTHER_ID 0x104U   // no rule, to bus 2 by can_forwarding
+#define GW_NEW_ID 0x201U
+#define GW_INTERVAL_MS 10
+#define GW_STEP_NS (2 * MS_NS)
+// the sim takes no time in the firmware, the fast path has none
+#define GW_LATENCY_MAX_US 0
+
+// firmware's 0xa0 parameters
+#define CAN_GATEWAY_DROP 0xFF
+#define CAN_GATEWAY_REWRITE_ID 1
+#define CAN_GATEWAY_REWRITE_DATA 2
+#define CAN_GATEWAY_PARAM_BUS 0
+#define CAN_GATEWAY_PARAM_ID_LO 1
+#define CAN_GATEWAY_PARAM_ID_HI 2
+#define CAN_GATEWAY_PARAM_TO_BUS 3
+#define CAN_GATEWAY_PARAM_FLAGS 4
+#define CAN_GATEWAY_PARAM_NEW_ID_LO 5
+#define CAN_GATEWAY_PARAM_NEW_ID_HI 6
+#define CAN_GATEWAY_PARAM_INTERVAL 7
+#define CAN_GATEWAY_PARAM_DATA 8
+#define CAN_GATEWAY_PARAM_ADD 0x80
+#define CAN_GATEWAY_PARAM_REMOVE 0x81
+#define CAN_GATEWAY_PARAM_LOAD 0x83
+
+typedef struct {
+  long sent;       // by the node, of each id
+  long reloaded;   // sent after the reload, what the counts are of
+  long plain;      // what came out on bus 1 and 2
+  long rewritten;
+  long limited;
+  long other;
+  long unexpected; // an id or data that shouldn't be there
+  long short_gaps; // limited ones closer than the interval
+  uint64_t limited_last_ns;
+  long host;       // bus 0's frames on ep1
+} gateway_state;
+
+gateway_state gw;
+
+void gw_set(int param, uint16_t value) {
+  uint8_t resp[0x40];
+  sim_usb_control(0xa0, param, value, 0, resp);
+}
+
+void gw_stage(uint32_t id, int to_bus, int flags, uint32_t new_id, int interval_ms) {
+  gw_set(CAN_GATEWAY_PARAM_BUS, 0);
+  gw_set(CAN_GATEWAY_PARAM_ID_LO, (id << 21) & 0xFFFF);
+  gw_set(CAN_GATEWAY_PARAM_ID_HI, (id << 21) >> 16);
+  gw_set(CAN_GATEWAY_PARAM_TO_BUS, to_bus);
+  gw_set(CAN_GATEWAY_PARAM_FLAGS, flags);
+  gw_set(CAN_GATEWAY_PARAM_NEW_ID_LO, (new_id << 21) & 0xFFFF);
+  gw_set(CAN_GATEWAY_PARAM_NEW_ID_HI, (new_id << 21) >> 16);
+  gw_set(CAN_GATEWAY_PARAM_INTERVAL, interval_ms);
+  for (int i = 0; i < 8; i++) {
+    uint16_t v = (i == 0) ? 0xFFAA : (i == 4) ? 0x0F05 : 0;
+    gw_set(CAN_GATEWAY_PARAM_DATA + i, (flags & CAN_GATEWAY_REWRITE_DATA) ? v : 0);
+  }
+}
+
+// the frame's data, RDLR its number
+#define GW_RDHR(n) (0x12345670U ^ ((n) << 4))
+
+void gateway_collect(void) {
+  sim_frame f;
+  for (int bus = 1; bus < SIM_CAN_MAX; bus++) {
+    while (sim_can_recv(bus, &f)) {
+      uint32_t id = f.RIR >> 21;
+      uint32_t n = f.RDLR;
+      if (bus == 1 && id == GW_PLAIN_ID && f.RDHR == GW_RDHR(n)) {
+        gw.plain += 1;
+      } else if (bus == 1 && id == GW_LIMITED_ID && f.RDHR == GW_RDHR(n)) {
+        if (gw.limited > 0 && f.time_ns - gw.limited_last_ns < GW_INTERVAL_MS * MS_NS - GW_STEP_NS / 2) gw.short_gaps += 1;
+        gw.limited_last_ns = f.time_ns;
+        gw.limited += 1;
+      } else if (bus == 2 && id == GW_NEW_ID) {
+        // in order, with byte 0 and the low nibble of byte 4 replaced
+        uint32_t m = gw.rewritten;
+        if (f.RDLR != ((m & ~0xFFU) | 0xAA) || f.RDHR != ((GW_RDHR(m) & ~0xFU) | 0x05)) gw.unexpected += 1;
+        gw.rewritten += 1;
+      } else if (bus == 2 && id == GW_OTHER_ID && f.RDHR == GW_RDHR(n)) {
+        gw.other += 1;
+      } else {
+        gw.unexpected += 1;
+      }
+    }
+  }
+  uint8_t pkt[USB_PACKET_LEN];
+  int len;
+  while ((len = sim_usb_ep1_in(pkt, sizeof(pkt))) > 0) {
+    for (int i = 0; i + RECORD_LEN <= len; i += RECORD_LEN) {
+      uint32_t rec[4];
+      memcpy(rec, pkt + i, sizeof(rec));
+      if (((rec[1] >> 4) & 0xFF) == 0) gw.host += 1;
+    }
+  }
+}
+
+void run_gateway(int duration_ms) {
+  uint8_t resp[0x40];
+  sim_usb_control(0xdc, 0x1337, 0, 0, resp);
+  sim_usb_control(0xdd, 0, 2, 0, resp);
+
+  gw_stage(GW_PLAIN_ID, CAN_GATEWAY_DROP, 0, 0, 0);
+  gw_set(CAN_GATEWAY_PARAM_ADD, 0);
+  gw_stage(GW_REWRITE_ID, 2, CAN_GATEWAY_REWRITE_ID | CAN_GATEWAY_REWRITE_DATA, GW_NEW_ID, 0);
+  gw_set(CAN_GATEWAY_PARAM_ADD, 0);
+  gw_stage(GW_LIMITED_ID, 1, 0, 0, GW_INTERVAL_MS);
+  gw_set(CAN_GATEWAY_PARAM_ADD, 0);
+  gw_stage(GW_DROP_ID, CAN_GATEWAY_DROP, 0, 0, 0);
+  gw_set(CAN_GATEWAY_PARAM_ADD, 0);
+  gw_stage(GW_OTHER_ID, 1, 0, 0, 0);
+  gw_set(CAN_GATEWAY_PARAM_ADD, 0);
+  gw_set(CAN_GATEWAY_PARAM_REMOVE, 0);
+  gw_set(CAN_GATEWAY_PARAM_LOAD, 0);
+
+  int reloaded = 0;
+  for (uint64_t t = GW_STEP_NS; t <= (uint64_t)duration_ms * MS_NS; t += GW_STEP_NS) {
+    sim_run(t);
+    gateway_collect();
+    if (!reloaded && t >= (uint64_t)duration_ms * MS_NS / 2) {
+      // only the plain one's rule changes, the others keep going
+      gw_stage(GW_PLAIN_ID, 1, 0, 0, 0);
+      gw_set(CAN_GATEWAY_PARAM_ADD, 0);
+      gw_set(CAN_GATEWAY_PARAM_LOAD, 0);
+      reloaded = 1;
+    }
+    uint32_t n = gw.sent;
+    sim_can_send(0, GW_PLAIN_ID << 21, 8, n, GW_RDHR(n));
+    sim_can_send(0, GW_REWRITE_ID << 21, 8, n, GW_RDHR(n));
+    sim_can_send(0, GW_LIMITED_ID << 21, 8, n, GW_RDHR(n));
+    sim_can_send(0, GW_DROP_ID << 21, 8, n, GW_RDHR(n));
+    sim_can_send(0, GW_OTHER_ID << 21, 8, n, GW_RDHR(n));
+    gw.sent += 1;
+    if (reloaded) gw.reloaded += 1;
+    print_debug();
+  }
+  sim_run(sim_now_ns() + DRAIN_MS * MS_NS);
+  gateway_collect();
+}
+
+int check_gateway(void) {
+  uint32_t table[3];
+  sim_usb_control(0xa1, 0xFFFF, 0, sizeof(table), (uint8_t *)table);
+  int ok = (table[0] == 4) && (table[1] == 4) && (table[2] == 2);
+  printf("table: %u loaded, %u staged, %u loads%s\n", table[0], table[1], table[2], ok ? "" : "  FAIL");
+  int failed = !ok;
+
+  // in bus and id order
+  static const uint32_t ids[] = {GW_PLAIN_ID, GW_REWRITE_ID, GW_LIMITED_ID, GW_DROP_ID};
+  for (uint32_t i = 0; i < table[0] && i < 4; i++) {
+    struct __attribute__((packed)) {
+      uint8_t bus;
+      uint8_t to_bus;
+      uint16_t flags;
+      uint32_t id;
+      uint32_t hits;
+      uint32_t forwarded;
+      uint32_t limited;
+      uint32_t blocked;
+      uint32_t latency_last;
+      uint32_t latency_max;
+    } st;
+    sim_usb_control(0xa1, i, 0, sizeof(st), (uint8_t *)&st);
+    uint32_t id = st.id >> 21;
+    long forwarded = (id == GW_PLAIN_ID || id == GW_REWRITE_ID) ? gw.reloaded : 0;
+    ok = (st.bus == 0) && (id == ids[i]) && (st.hits == (uint32_t)gw.reloaded) && (st.blocked == 0) &&
+         (st.latency_max <= GW_LATENCY_MAX_US) &&
+         ((id == GW_LIMITED_ID) ? (st.forwarded + st.limited == st.hits) && (st.forwarded > 0) && (st.limited > 0) :
+                                  (st.forwarded == (uint32_t)forwarded) && (st.limited == 0));
+    printf("rule 0x%x: hits %u, forwarded %u, limited %u, blocked %u, latency %u us max%s\n",
+           id, st.hits, st.forwarded, st.limited, st.blocked, st.latency_max, ok ? "" : "  FAIL");
+    failed |= !ok;
+  }
+
+  ok = (gw.sent > 0) && (gw.plain == gw.reloaded) && (gw.reloaded > 0) && (gw.reloaded < gw.sent) &&
+       (gw.rewritten == gw.sent) && (gw.other == gw.sent) && (gw.limited > 0) && (gw.short_gaps == 0) &&
+       (gw.unexpected == 0) && (gw.host == 5 * gw.sent);
+  printf("bus 0: sent %ld of each, forwarded %ld plain, %ld rewritten, %ld limited, %ld other, unexpected %ld, short gaps %ld, read %ld%s\n",
+         gw.sent, gw.plain, gw.rewritten, gw.limited, gw.other, gw.unexpected, gw.short_gaps, gw.host, ok ? "" : "  FAIL");
+  return !(failed | !ok);
+}
+
+// ***************************** bitrate detection *****************************
+
+// the node's bitrate and frames a second on each bus, bus 2's is quiet
+#define AUTOBAUD_STEP_NS (1 * MS_NS)
+#define AUTOBAUD_DWELL_MS 50
+#define AUTOBAUD_MAX_MS 500
+#define AUTOBAUD_AFTER_MS 100
+const uint32_t autobaud_bps[SIM_CAN_MAX] = {1000000, 83333, 0};
+const int autobaud_fps[SIM_CAN_MAX] = {5000, 500, 0};
+// what 0xa2 should find, in can_speed's units
+const uint16_t autobaud_speed[SIM_CAN_MAX] = {10000, 833, 0};
+
+// firmware's states
+#define CAN_AUTOBAUD_FOUND 2
+#define CAN_AUTOBAUD_NONE 3
+#define CAN_AUTOBAUD_RATES 6
+
+typedef struct __attribute__((packed)) {
+  uint8_t trying;
+  uint8_t cans;
+  uint16_t dwell_ms;
+  struct __attribute__((packed)) {
+    uint8_t bus;
+    uint8_t state;
+    uint16_t speed;
+    uint8_t frames[CAN_AUTOBAUD_RATES];
+    uint8_t errors[CAN_AUTOBAUD_RATES];
+  } can[SIM_CAN_MAX];
+} autobaud_status;
+
+autobaud_status autobaud_st;
+uint64_t autobaud_took_ns = 0;
+uint64_t autobaud_budget[SIM_CAN_MAX];
+long autobaud_host_after[SIM_CAN_MAX];
+
+// the node's frames for the time, and what the host read of each bus
+void autobaud_step(uint64_t until_ns, long *host) {
+  for (int bus = 0; bus < SIM_CAN_MAX; bus++) {
+    int n = frames_due(&autobaud_budget[bus], autobaud_fps[bus], AUTOBAUD_STEP_NS);
+    for (int i = 0; i < n; i++) sim_can_send(bus, 0x123U << 21, 8, 0, 0);
+  }
+  sim_run(until_ns);
+  uint8_t pkt[USB_PACKET_LEN];
+  int len;
+  while ((len = sim_usb_ep1_in(pkt, sizeof(pkt))) > 0) {
+    for (int i = 0; i + RECORD_LEN <= len; i += RECORD_LEN) {
+      uint32_t rec[4];
+      memcpy(rec, pkt + i, sizeof(rec));
+      int bus = (rec[1] >> 4) & 0xFF;
+      if (host != NULL && bus < SIM_CAN_MAX) host[bus] += 1;
+    }
+  }
+}
+
+void run_autobaud(int duration_ms) {
+  for (int bus = 0; bus < SIM_CAN_MAX; bus++) sim_can_set_node_bitrate(bus, autobaud_bps[bus]);
+  // the buses busy before it starts
+  uint64_t t = sim_now_ns();
+  for (uint64_t end = t + (uint64_t)duration_ms * MS_NS; t < end; t += AUTOBAUD_STEP_NS) autobaud_step(t, NULL);
+
+  uint64_t start_ns = sim_now_ns();
+  sim_usb_control(0xa2, 1, AUTOBAUD_DWELL_MS, sizeof(autobaud_st), (uint8_t *)&autobaud_st);
+  for (; sim_now_ns() - start_ns < 2 * AUTOBAUD_MAX_MS * MS_NS; t += AUTOBAUD_STEP_NS) {
+    autobaud_step(t, NULL);
+    sim_usb_control(0xa2, 0, 0, sizeof(autobaud_st), (uint8_t *)&autobaud_st);
+    if (autobaud_st.trying == 0) break;
+    print_debug();
+  }
+  autobaud_took_ns = sim_now_ns() - start_ns;
+
+  // at the rates it found
+  for (uint64_t end = t + AUTOBAUD_AFTER_MS * MS_NS; t < end; t += AUTOBAUD_STEP_NS) autobaud_step(t, autobaud_host_after);
+}
+
+int check_autobaud(void) {
+  int failed = 0;
+  for (int bus = 0; bus < SIM_CAN_MAX; bus++) {
+    sim_can_stats s;
+    sim_can_get_stats(bus, &s);
+    int found = autobaud_speed[bus] != 0;
+    int ok = (autobaud_st.trying == 0) && (autobaud_st.cans == SIM_CAN_MAX) && (autobaud_st.can[bus].bus == bus) &&
+             (autobaud_st.can[bus].state == (found ? CAN_AUTOBAUD_FOUND : CAN_AUTOBAUD_NONE)) &&
+             (autobaud_st.can[bus].speed == autobaud_speed[bus]) &&
+             (found ? (autobaud_host_after[bus] >= autobaud_fps[bus] * AUTOBAUD_AFTER_MS / 1000 - 1) && (s.bus_errors > 0) :
+                      (autobaud_host_after[bus] == 0));
+    printf("bus %d: found %.1f kbps, frames", bus, autobaud_st.can[bus].speed / 10.0);
+    for (int r = 0; r < CAN_AUTOBAUD_RATES; r++) printf(" %u", autobaud_st.can[bus].frames[r]);
+    printf(", errors");
+    for (int r = 0; r < CAN_AUTOBAUD_RATES; r++) printf(" %u", autobaud_st.can[bus].errors[r]);
+    printf(", read %ld after%s\n", autobaud_host_after[bus], ok ? "" : "  FAIL");
+    failed |= !ok;
+  }
+  int ok = autobaud_took_ns <= AUTOBAUD_MAX_MS * MS_NS;
+  printf("autobaud: %.1f ms%s\n", autobaud_took_ns / 1e6, ok ? "" : "  FAIL");
+  return !(failed | !ok);
+}
+
+// ***************************** USB flush policy *****************************
+
+#define FLUSH_POLL_NS 100000ULL
+#define FLUSH_FPS 2000
+#define FLUSH_READ_PACKETS 8
+#define FLUSH_FILL 4
+#define FLUSH_DEADLINE_US 2000
+// the firmware's USB_FLUSH_DEADLINE_MAX_US and then some, the last frames of a fill wait for it
+#define FLUSH_DRAIN_MS 200
+// 0xa3's wValue bit
+#define FLUSH_SOF 0x8000
+#define FLUSH_MODES 4
+
+typedef struct __attribute__((packed)) {
+  uint16_t fill;
+  uint16_t reserved;
+  uint32_t deadline_us;
+  uint32_t transfers;
+  uint32_t bytes;
+  uint32_t held;
+  uint32_t age_max;
+} flush_status;
+
+const char *flush_names[FLUSH_MODES] = {"immediate", "fill", "deadline", "sof"};
+const uint16_t flush_value[FLUSH_MODES] = {0, FLUSH_FILL, 0, FLUSH_SOF};
+const uint16_t flush_index[FLUSH_MODES] = {0, 0, FLUSH_DEADLINE_US, 0};
+
+typedef struct {
+  long sent;
+  long frames;
+  long transfers;    // reads with frames
+  long same_ms;      // of those, in the same ms as the one before
+  uint64_t last_ns;
+  uint64_t latency_max_ns; // while the node was sending
+  flush_status st;
+} flush_result;
+
+flush_result flush_results[FLUSH_MODES];
+int flush_fps = FLUSH_FPS;
+
+// a read the size of FLUSH_READ_PACKETS, each frame's send time in RDLR
+void flush_read(flush_result *r, int timed) {
+  uint8_t buf[FLUSH_READ_PACKETS * USB_PACKET_LEN];
+  int len = sim_usb_ep1_in(buf, sizeof(buf));
+  if (len == 0) return;
+  uint64_t now = sim_now_ns();
+  if (r->transfers > 0 && now / MS_NS == r->last_ns / MS_NS) r->same_ms += 1;
+  r->transfers += 1;
+  r->last_ns = now;
+  for (int i = 0; i + RECORD_LEN <= len; i += RECORD_LEN) {
+    uint32_t rec[4];
+    memcpy(rec, buf + i, sizeof(rec));
+    r->frames += 1;
+    uint64_t latency = now - (uint64_t)rec[2] * 1000;
+    if (timed && latency > r->latency_max_ns) r->latency_max_ns = latency;
+  }
+}
+
+void run_flush(int duration_ms) {
+  uint64_t t = sim_now_ns();
+  for (int m = 0; m < FLUSH_MODES; m++) {
+    flush_result *r = &flush_results[m];
+    flush_status st;
+    sim_usb_control(0xa3, flush_value[m], flush_index[m], sizeof(st), (uint8_t *)&st);
+    uint64_t budget = 0;
+    for (uint64_t end = t + (uint64_t)duration_ms * MS_NS / FLUSH_MODES; t < end; t += FLUSH_POLL_NS) {
+      int n = frames_due(&budget, flush_fps, FLUSH_POLL_NS);
+      for (int i = 0; i < n; i++) {
+        if (sim_can_send(0, 0x123U << 21, 8, (uint32_t)(sim_now_ns() / 1000), 0)) r->sent += 1;
+      }
+      sim_run(t);
+      flush_read(r, 1);
+      print_debug();
+    }
+    // the rest, a fill's last frames once they've waited the most
+    for (uint64_t end = t + FLUSH_DRAIN_MS * MS_NS; t < end; t += FLUSH_POLL_NS) {
+      sim_run(t);
+      flush_read(r, 0);
+    }
+    sim_usb_control(0xa3, 0xFFFF, 0, sizeof(r->st), (uint8_t *)&r->st);
+  }
+}
+
+int check_flush(void) {
+  int failed = 0;
+  for (int m = 0; m < FLUSH_MODES; m++) {
+    flush_result *r = &flush_results[m];
+    double per = r->transfers ? (double)r->frames / r->transfers : 0;
+    double latency_ms = r->latency_max_ns / 1e6;
+    // a frame on the bus, then an IN
+    double bound_ms = (FLUSH_POLL_NS + 2 * FLUSH_POLL_NS) / 1e6;
+    int ok = (r->sent > 0) && (r->frames == r->sent) && (r->st.transfers == (uint32_t)r->transfers) &&
+             (r->st.bytes == (uint32_t)r->frames * RECORD_LEN) && (r->st.fill == flush_value[m]) &&
+             (r->st.deadline_us == flush_index[m]);
+    switch (m) {
+      case 0:
+        ok = ok && per < 1.5 && latency_ms <= bound_ms && r->st.held == 0;
+        break;
+      case 1:
+        ok = ok && per >= 0.9 * FLUSH_FILL && latency_ms <= 1000.0 * FLUSH_FILL / flush_fps + bound_ms + 1.0;
+        break;
+      case 2:
+        ok = ok && per >= 0.9 * (flush_fps * FLUSH_DEADLINE_US > 1000000 ? flush_fps * FLUSH_DEADLINE_US / 1e6 : 1) && latency_ms <= FLUSH_DEADLINE_US / 1000.0 + bound_ms + 1.0;
+        break;
+      case 3:
+        ok = ok && r->same_ms == 0 && latency_ms <= 1.0 + bound_ms;
+        break;
+    }
+    printf("flush %s: %ld frames sent, %ld read in %ld transfers, %.2f a transfer, %ld in the same ms, %.2f ms latency max, "
+           "%u held, %u us age max%s\n", flush_names[m], r->sent, r->frames, r->transfers, per, r->same_ms, latency_ms,
+           r->st.held, r->st.age_max, ok ? "" : "  FAIL");
+    failed |= !ok;
+  }
+  return !failed;
+}
+
+// ***************************** deferred tx *****************************
+
+#define DEFER_FPS 2000
+#define DEFER_CYCLE_MS 5
+#define DEFER_RING 8
+
+typedef struct __attribute__((packed)) {
+  uint32_t packets;
+  uint32_t overruns;
+  uint32_t held;
+  uint32_t depth_max;
+  uint32_t delay_max_us;
+  uint8_t staged[2];
+  uint8_t ring_len;
+  uint8_t reserved;
+} defer_status;
+
+typedef struct {
+  long bursts;
+  long packets;
+  long short_bursts; // NAKed at another length than the ring's
+  long stuck;        // still NAKing after PendSV was let go
+  long read_held;    // frames bus 0 got up while PendSV was held
+  defer_status st;
+} defer_result;
+
+defer_result defer_res;
+
+void defer_collect(void) {
+  for (int bus = 1; bus < SIM_CAN_MAX; bus++) {
+    bus_state *b = &buses[bus];
+    sim_frame f;
+    while (sim_can_recv(bus, &f)) {
+      if (f.RDLR < b->seq_in) b->out_of_order += 1;
+      b->seq_in = f.RDLR + 1;
+      b->delivered += 1;
+    }
+  }
+}
+
+// bus 0's node frames for the time, and the reads of ep1 as it goes
+void defer_rx(uint64_t until_ns, int fps, long *read) {
+  uint64_t step_ns = MS_NS / 10;
+  for (uint64_t t = sim_now_ns() + step_ns; t <= until_ns; t += step_ns) {
+    for (int n = frames_due(&buses[0].budget, fps, step_ns); n > 0; n--) {
+      if (!sim_can_send(0, 0x100U << 21, 8, buses[0].seq_out, 0)) break;
+      buses[0].seq_out += 1;
+    }
+    sim_run(t);
+    long before = buses[0].delivered;
+    while (read_packet(SIM_CAN_MAX) > 0);
+    if (read != NULL) *read += buses[0].delivered - before;
+    defer_collect();
+    print_debug();
+  }
+}
+
+void run_defer(int duration_ms, int fps) {
+  uint8_t resp[0x40];
+  sim_usb_control(0xdc, 0x1337, 0, 0, resp);
+  sim_usb_control(0xe7, 1, 0, 0, resp);
+  uint64_t t = sim_now_ns();
+  for (uint64_t end = t + (uint64_t)duration_ms * MS_NS; t < end; t += DEFER_CYCLE_MS * MS_NS) {
+    sim_pendsv_hold(1);
+    int n = 0;
+    while (sim_usb_out_ready(3) && n < 2 * DEFER_RING) {
+      uint32_t pkt[USB_PACKET_LEN / 4];
+      for (int i = 0; i < USB_PACKET_LEN / RECORD_LEN; i++) tx_fill(1 + (i & 1), &pkt[i * RECORD_LEN / 4]);
+      sim_usb_ep3_out((uint8_t *)pkt, sizeof(pkt));
+      n += 1;
+    }
+    defer_res.bursts += 1;
+    defer_res.packets += n;
+    if (n != DEFER_RING) defer_res.short_bursts += 1;
+    defer_rx(t + DEFER_CYCLE_MS * MS_NS / 2, fps, &defer_res.read_held);
+    sim_pendsv_hold(0);
+    if (!sim_usb_out_ready(3)) defer_res.stuck += 1;
+    defer_rx(t + DEFER_CYCLE_MS * MS_NS, fps, NULL);
+  }
+  defer_rx(t + DRAIN_MS * MS_NS, 0, NULL);
+  sim_usb_control(0xa4, 0, 0, sizeof(defer_res.st), (uint8_t *)&defer_res.st);
+}
+
+int check_defer(void) {
+  defer_result *r = &defer_res;
+  sim_can_stats s;
+  sim_can_get_stats(0, &s);
+  int ok = (r->bursts > 0) && (r->short_bursts == 0) && (r->stuck == 0) && (r->read_held > 0) &&
+           (buses[0].out_of_order == 0) && (buses[0].delivered == (long)s.sent) &&
+           (r->st.packets == (uint32_t)r->packets) && (r->st.overruns == 0) && (r->st.held == (uint32_t)r->bursts) &&
+           (r->st.depth_max == DEFER_RING) && (r->st.ring_len == DEFER_RING) && (r->st.staged[0] == 0) && (r->st.staged[1] == 0);
+  for (int bus = 1; bus < SIM_CAN_MAX; bus++) {
+    bus_state *b = &buses[bus];
+    ok &= (b->out_of_order == 0) && (b->delivered == b->injected) && (fw_stat(bus, FW_TX_DROP) == 0);
+  }
+  printf("defer: %ld bursts of %ld packets, %ld short, %ld stuck, bus 0 read %ld of %llu, %ld while held, "
+         "bus 1 sent %ld of %ld, bus 2 sent %ld of %ld, staged %u, held %u, overruns %u, %u deep max, %u us max%s\n",
+         r->bursts, r->bursts ? r->packets / r->bursts : 0, r->short_bursts, r->stuck, buses[0].delivered,
+         (unsigned long long)s.sent, r->read_held, buses[1].delivered, buses[1].injected, buses[2].delivered,
+         buses[2].injected, r->st.packets, r->st.held, r->st.overruns, r->st.depth_max, r->st.delay_max_us, ok ? "" : "  FAIL");
+  return ok;
+}
+
+#define FILTERS_HOST_ID 0x100U
+#define FILTERS_SAFETY_ID 0x158U // in honda_rx_ids
+#define FILTERS_OTHER_ID 0x200U
+#define SIM_SAFETY_HONDA 1
+#define SIM_SAFETY_HONDA_BOSCH 4
+
+// the frames each bus's filters dropped, in Honda and then Honda Bosch
+long filters_dropped[2][SIM_CAN_MAX];
+
+void filters_host(int bus) {
+  uint8_t resp[0x40];
+  uint32_t id = FILTERS_HOST_ID << 21;
+  sim_usb_control(0xe8, id & 0xFFFF, id >> 16, 0, resp);
+  sim_usb_control(0xe9, 0xFFFE, 0xFFFF, 0, resp);
+  sim_usb_control(0xdf, bus, 1, 0, resp);
+  sim_usb_control(0xdf, bus, 2, 0, resp);
+}
+
+void run_filters(void) {
+  static const uint16_t modes[2] = {SIM_SAFETY_HONDA, SIM_SAFETY_HONDA_BOSCH};
+  uint8_t resp[0x40];
+  filters_host(0);
+  filters_host(2);
+  for (int m = 0; m < 2; m++) {
+    sim_usb_control(0xdc, modes[m], 0, 0, resp);
+    sim_can_stats before[SIM_CAN_MAX];
+    for (int bus = 0; bus < SIM_CAN_MAX; bus += 2) {
+      sim_can_get_stats(bus, &before[bus]);
+      sim_can_send(bus, FILTERS_SAFETY_ID << 21, 8, 0, 0);
+      sim_can_send(bus, FILTERS_OTHER_ID << 21, 8, 0, 0);
+    }
+    sim_run(sim_now_ns() + 5 * MS_NS);
+    for (int bus = 0; bus < SIM_CAN_MAX; bus += 2) {
+      sim_can_stats s;
+      sim_can_get_stats(bus, &s);
+      filters_dropped[m][bus] = s.filtered - before[bus].filtered;
+    }
+    // what was taken, for the next mode's
+    uint8_t buf[0x40];
+    while (sim_usb_ep1_in(buf, sizeof(buf)) > 0) {}
+  }
+}
+
+int check_filters(void) {
+  static const char *names[2] = {"honda", "honda bosch"};
+  int failed = 0;
+  for (int m = 0; m < 2; m++) {
+    for (int bus = 0; bus < SIM_CAN_MAX; bus += 2) {
+      // only the other id, and nothing on a forwarded bus
+      long expected = (m == 1 && bus == 2) ? 0 : 1;
+      int ok = filters_dropped[m][bus] == expected;
+      printf("%s, bus %d: filtered %ld%s\n", names[m], bus, filters_dropped[m][bus], ok ? "" : "  FAIL");
+      failed |= !ok;
+    }
+  }
+  return !failed;
+}
+
+double wall_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec * 1000.0) + (ts.tv_nsec / 1e6);
+}
+
+int main(int argc, char **argv) {
+  const char *scenario = "rx";
+  int duration_ms = 1000;
+  int fps = 0;
+  int packets = 19;
+  int nbuses = SIM_CAN_MAX;
+  int coalesce_us = 0;
+  int census = 0;
+  int gmlan_switches = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:t:r:b:n:c:ig:k:e:o:x:lqv")) != -1) {
+    switch (opt) {
+      case 's': scenario = optarg; break;
+      case 't': duration_ms = atoi(optarg); break;
+      case 'r': fps = strtol(optarg, NULL, 0); break;
+      case 'b': packets = atoi(optarg); break;
+      case 'n': nbuses = atoi(optarg); break;
+      case 'c': coalesce_us = atoi(optarg); break;
+      case 'i': census = 1; break;
+      case 'g': gmlan_switches = atoi(optarg); break;
+      case 'k': bitrate_changes = atoi(optarg); break;
+      case 'e': echo_mode = atoi(optarg); break;
+      case 'o': contend_fps = atoi(optarg); break;
+      case 'x': ignition_switches = atoi(optarg); break;
+      case 'l': lanes = 1; break;
+      case 'q': tx_by_id = 1; break;
+      case 'v': verbose = 1; break;
+      default:
+        fprintf(stderr, "usage: %s [-s rx|tx|isotp|group|ecu|gateway|autobaud|flush|defer|filters] [-t ms] [-r fps] [-b packets] [-n buses] [-c us] [-i] [-g n] [-k n] [-e mode] [-o fps] [-x n] [-l] [-q] [-v]\n", argv[0]);
+        return 2;
+    }
+  }
+  int tx = strcmp(scenario, "tx") == 0;
+  int iso = strcmp(scenario, "isotp") == 0;
+  int group = strcmp(scenario, "group") == 0;
+  int ecu_sim = strcmp(scenario, "ecu") == 0;
+  int gateway = strcmp(scenario, "gateway") == 0;
+  int autobaud = strcmp(scenario, "autobaud") == 0;
+  int flush = strcmp(scenario, "flush") == 0;
+  int defer = strcmp(scenario, "defer") == 0;
+  int filters = strcmp(scenario, "filters") == 0;
+  if ((!tx && !iso && !group && !ecu_sim && !gateway && !autobaud && !flush && !defer && !filters && strcmp(scenario, "rx") != 0) || duration_ms <= 0 || fps < 0 || (iso && fps > 0xFF) || (ecu_sim && fps > ECU_FPS_MAX) ||
+      packets <= 0 || gmlan_switches < 0 || bitrate_changes < 0 || ((tx || iso || group || ecu_sim) && bitrate_changes > 0) ||
+      echo_mode < 0 || echo_mode > 2 || (!tx && echo_mode > 0) || contend_fps < 0 || (!tx && contend_fps > 0) || ignition_switches < 0 || ((tx || iso || group || ecu_sim) && ignition_switches > 0) || nbuses < 1 || nbuses > SIM_CAN_MAX ||
+      (tx_by_id && !tx) || (lanes && (!tx || fps == 0 || nbuses < 2)) || ((gateway || autobaud) && (fps > 0 || nbuses != SIM_CAN_MAX || bitrate_changes > 0 || ignition_switches > 0)) ||
+      ((flush || defer || filters) && (nbuses != SIM_CAN_MAX || bitrate_changes > 0 || ignition_switches > 0)) || coalesce_us < 0 || coalesce_us > 0xFFFF) {
+    fprintf(stderr, "bad arguments\n");
+    return 2;
+  }
+
+  if (sim_init() != 0) {
+    fprintf(stderr, "can't map the peripherals\n");
+    return 1;
+  }
+
+  uint8_t resp[0x40];
+  if (coalesce_us > 0) sim_usb_control(0xc8, coalesce_us, 0, 0, resp);
+  if (census) sim_usb_control(0xca, 1, 0, sizeof(resp), resp);
+  if (gmlan_switches > 0 && !check_gmlan(gmlan_switches)) return 1;
+  uint32_t st[9];
+  sim_usb_control(0xce, 0, 0, sizeof(st), (uint8_t *)st);
+  uint32_t inits = st[5];
+
+  double start = wall_ms();
+  if (iso) {
+    run_isotp(duration_ms, fps, packets, nbuses);
+  } else if (group) {
+    run_group(duration_ms, fps, nbuses);
+  } else if (ecu_sim) {
+    run_ecu(duration_ms, fps, nbuses);
+  } else if (gateway) {
+    run_gateway(duration_ms);
+  } else if (autobaud) {
+    run_autobaud(duration_ms);
+  } else if (flush) {
+    if (fps > 0) flush_fps = fps;
+    run_flush(duration_ms);
+  } else if (defer) {
+    run_defer(duration_ms, fps ? fps : DEFER_FPS);
+  } else if (filters) {
+    run_filters();
+  } else if (tx) {
+    run_tx(duration_ms, fps, packets, nbuses);
+  } else {
+    run_rx(duration_ms, fps, packets, nbuses);
+  }
+  double elapsed = wall_ms() - start;
+  print_debug();
+
+  int failed = 0;
+  for (int bus = 0; bus < nbuses; bus++) {
+    bus_state *b = &buses[bus];
+    sim_can_stats s;
+    sim_can_get_stats(bus, &s);
+    double load = 100.0 * s.busy_ns / sim_now_ns();
+
+    if (ecu_sim || gateway || autobaud || flush || defer || filters) {
+      continue;
+    } else if (group) {
+      int ok = (b->delivered == b->injected);
+      printf("bus %d: written %ld, sent %ld, load %.1f%%%s\n", bus, b->injected, b->delivered, load, ok ? "" : "  FAIL");
+      failed |= !ok;
+    } else if (iso) {
+      isotp_bus *s = &isotp[bus];
+      int ok = (s->responses > 0) && (s->responses == s->requests) && (s->tx_done == s->requests) &&
+               (s->errors == 0) && (s->mismatches == 0) && (s->unpadded == 0) && (s->stmin_violations == 0);
+      printf("bus %d: exchanges %ld, errors %ld, mismatches %ld, unpadded %ld, stmin violations %ld, %.1f kB/s, load %.1f%%%s\n",
+             bus, s->responses, s->errors, s->mismatches, s->unpadded, s->stmin_violations,
+             s->bytes / (sim_now_ns() / 1e6), load, ok ? "" : "  FAIL");
+      failed |= !ok;
+    } else if (tx) {
+      long dropped = fw_stat(bus, FW_TX_DROP);
+      long failed = fw_stat(bus, FW_TX_FAIL);
+      long failures = (echo_mode == 2) ? 0 : failed;
+      long echoed = (echo_mode == 2) ? 0 : b->delivered + failed;
+      long completed = ((echo_mode == 1) ? b->delivered : 0) + failures;
+      int ok = (b->out_of_order == 0) && (b->delivered + dropped + failed == b->injected) && (b->echoes == echoed) &&
+               (b->completions == completed) && (b->failures == failures) && (b->bad_tokens == 0) &&
+               (failed == (long)s.arb_lost) && (contend_fps == 0 || failed > 0) &&
+               (!lanes || ((dropped == 0) && (b->backlog == 0) && ((bus == 0) ? (b->held == 0) : (bus < nbuses - 1 || b->held > 0))));
+      printf("bus %d: written %ld, sent %ld, dropped %ld, failed %ld, held %ld, echoed %ld, completions %ld, out of order %ld, latency %.1f us avg %.1f us max, load %.1f%%%s\n",
+             bus, b->injected, b->delivered, dropped, failed, b->held, b->echoes, b->completions, b->out_of_order,
+             b->delivered ? (b->latency_sum_ns / 1000.0 / b->delivered) : 0.0, b->latency_max_ns / 1000.0,
+             load, ok ? "" : "  FAIL");
+      failed |= !ok;
+    } else {
+      long dropped = fw_stat(bus, FW_RX_DROP);
+      long suppressed = fw_stat(bus, FW_RX_SUPPRESSED);
+      long lost = dropped + suppressed + s.fifo_overruns + s.filtered;
+      int ok = (b->out_of_order == 0) && (b->delivered + lost == (long)s.sent);
+      printf("bus %d: sent %llu, read %ld, dropped %ld, suppressed %ld, fifo overruns %llu, filtered %llu, out of order %ld, load %.1f%%%s\n",
+             bus, (unsigned long long)s.sent, b->delivered, dropped, suppressed, (unsigned long long)s.fifo_overruns,
+             (unsigned long long)s.filtered, b->out_of_order, load, ok ? "" : "  FAIL");
+      failed |= !ok;
+    }
+  }
+  if (coalesce_us > 0) {
+    // the windows that see the buses quiet
+    sim_run(sim_now_ns() + 10 * MS_NS);
+    uint32_t st[8];
+    sim_usb_control(0xc9, 0, 0, sizeof(st), (uint8_t *)st);
+    long overruns = 0;
+    for (int bus = 0; bus < nbuses; bus++) {
+      sim_can_stats s;
+      sim_can_get_stats(bus, &s);
+      overruns += s.fifo_overruns;
+    }
+    int ok = (st[3] > 0) && (st[2] == 0) && (overruns == 0) && (st[6] == 0);
+    printf("coalescing: entered %u, drains %u, %.1f frames a drain, late %u us max, fifo overruns %ld%s\n",
+           st[3], st[4], st[4] ? (double)st[5] / st[4] : 0.0, st[7], overruns, ok ? "" : "  FAIL");
+    failed |= !ok;
+  }
+  if (group) failed |= !check_group(nbuses);
+  if (ecu_sim) failed |= !check_ecu(nbuses);
+  if (gateway) failed |= !check_gateway();
+  if (autobaud) failed |= !check_autobaud();
+  if (flush) failed |= !check_flush();
+  if (defer) failed |= !check_defer();
+  if (filters) failed |= !check_filters();
+  if (iso || tx || group || ecu_sim || gateway || defer) failed |= !check_deferred();
+  if (bitrate_changes > 0) failed |= !check_reconfig(bitrate_changes, inits);
+  if (ignition_switches > 0) {
+    int ok = (ignition_events == ignition_switches + 1) && (ignition_bad == 0);
+    printf("events: ignition %ld, bad %ld%s\n", ignition_events, ignition_bad, ok ? "" : "  FAIL");
+    failed |= !ok;
+  }
+  if (census) failed |= !check_census(iso || tx ? 0 : fps, nbuses);
+  printf("%s: %.0f ms simulated in %.0f ms, %.1fx real time\n", scenario, sim_now_ns() / 1e6, elapsed,
+         (sim_now_ns() / 1e6) / elapsed);
+  return failed;
+}
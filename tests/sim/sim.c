@@ -0,0 +1,700 @@
+// main.c and its drivers on simulated peripherals, see sim.h
+//
+// The firmware is built as it is for the panda, with stm32f4xx.h from here.
+// Its registers are plain memory mapped at ST's addresses, which is enough
+// for everything but the bxCAN status registers, TIM2 and the NVIC. Those
+// go through the functions below from every access.
+
+#include <sys/mman.h>
+
+#include "sim.h"
+
+// these would be libc's
+#define memset fw_memset
+#define memcpy fw_memcpy
+#define memcmp fw_memcmp
+#define puts fw_puts
+#define putc fw_putc
+#define getc fw_getc
+#define main panda_main
+
+#include "main.c"
+
+#undef main
+
+// what the startup and the linker script give the firmware
+void *g_pfnVectors;
+uint32_t enter_bootloader_mode;
+postmortem_record postmortem_ram;
+
+volatile uint32_t sim_primask = 1;
+
+// ***************************** memory *****************************
+
+typedef struct {
+  uintptr_t base;
+  size_t len;
+} sim_region;
+
+const sim_region sim_regions[] = {
+  {FLASH_BASE, 0x200000},
+  {0x1FFF0000, 0x10000}, // system memory, OTP and the unique id
+  {PERIPH_BASE, 0x80000}, // APB1, APB2 and AHB1
+  {USB_OTG_FS_PERIPH_BASE, 0x70000},
+  {0xE0000000, 0x100000}, // the Cortex-M4's own
+};
+
+#ifndef MAP_FIXED_NOREPLACE
+  #define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+// ***************************** NVIC *****************************
+
+uint32_t sim_nvic_enabled[(FPU_IRQn / 32) + 1];
+
+void NVIC_EnableIRQ(IRQn_Type IRQn) {
+  sim_nvic_enabled[IRQn >> 5] |= 1U << (IRQn & 0x1F);
+}
+
+void NVIC_DisableIRQ(IRQn_Type IRQn) {
+  sim_nvic_enabled[IRQn >> 5] &= ~(1U << (IRQn & 0x1F));
+}
+
+int sim_nvic_is_enabled(IRQn_Type IRQn) {
+  return (sim_nvic_enabled[IRQn >> 5] & (1U << (IRQn & 0x1F))) != 0;
+}
+
+void NVIC_SystemReset(void) {
+  sim_reset();
+}
+
+// ***************************** TIM2 *****************************
+
+uint64_t sim_ns = 0;
+// CC1IF to CC4IF, and what SR was last set to
+uint32_t sim_tim2_flags = 0;
+uint32_t sim_tim2_sr = 0;
+
+#define SIM_TIM2_CC_FLAGS (TIM_SR_CC1IF | TIM_SR_CC2IF | TIM_SR_CC3IF | TIM_SR_CC4IF)
+
+TIM_TypeDef *sim_tim2(void) {
+  TIM_TypeDef *t = (TIM_TypeDef *)TIM2_BASE;
+  uint32_t sr = t->SR;
+  if (sr != sim_tim2_sr) sim_tim2_flags &= sr;
+  // CCxG in EGR is a compare event made by the firmware, it goes back to 0
+  sim_tim2_flags |= t->EGR & SIM_TIM2_CC_FLAGS;
+  t->EGR = 0;
+  t->SR = sim_tim2_sr = sim_tim2_flags;
+  t->CNT = (uint32_t)(sim_ns / 1000);
+  return t;
+}
+
+// when the next enabled compare matches, the counter going on to CCRx, and
+// the CCxIF of all that match then. Matching the count it's at takes the
+// whole wrap.
+uint64_t sim_tim2_next(uint32_t *flags) {
+  TIM_TypeDef *t = sim_tim2();
+  volatile uint32_t *ccr[4] = {&t->CCR1, &t->CCR2, &t->CCR3, &t->CCR4};
+  uint64_t now_us = sim_ns / 1000;
+  uint64_t next = UINT64_MAX;
+  for (int i = 0; i < 4; i++) {
+    if ((t->DIER & (TIM_DIER_CC1IE << i)) == 0) continue;
+    uint64_t delta = (uint32_t)(*ccr[i] - (uint32_t)now_us);
+    if (delta == 0) delta = 1ULL << 32;
+    if ((now_us + delta) * 1000 < next) {
+      next = (now_us + delta) * 1000;
+      *flags = 0;
+    }
+    if ((now_us + delta) * 1000 == next) *flags |= TIM_SR_CC1IF << i;
+  }
+  return next;
+}
+
+// ***************************** bxCAN *****************************
+
+#define SIM_TX_MAILBOXES 3
+#define SIM_FIFO_LEN 3
+#define SIM_MAILBOX_FLAGS (CAN_TSR_RQCP0 | CAN_TSR_TXOK0 | CAN_TSR_ALST0 | CAN_TSR_TERR0)
+#define SIM_INTERMISSION_BITS 3
+#define SIM_NODE 3
+
+typedef struct {
+  sim_frame elems[SIM_QUEUE_LEN];
+  uint32_t r_ptr;
+  uint32_t len;
+} sim_queue;
+
+typedef struct {
+  CAN_TypeDef *regs;
+  CAN_TypeDef *filters; // CAN2's are CAN1's from CAN2SB
+  IRQn_Type tx_irq;
+  IRQn_Type rx_irq[2];
+  IRQn_Type sce_irq;
+
+  // what the status registers were last set to, anything else the firmware wrote
+  uint32_t msr;
+  uint32_t tsr;
+  uint32_t rfr[2];
+
+  // RQCP, TXOK, ALST and TERR of each mailbox at their TSR bits
+  uint32_t tsr_flags;
+  int pending[SIM_TX_MAILBOXES];
+  uint32_t requested[SIM_TX_MAILBOXES]; // order of the TXRQs, for TXFP
+  uint32_t requests;
+
+  sim_frame fifo[2][SIM_FIFO_LEN];
+  int fifo_len[2];
+  uint32_t fifo_flags[2]; // FULL and FOVR
+
+  // the bus, a frame is on it from wire_start to wire_end
+  int wire_src; // a mailbox, SIM_NODE or -1 for none
+  sim_frame wire;
+  uint64_t wire_start;
+  uint64_t wire_end;
+  uint64_t idle_at;
+
+  sim_queue node_q;
+  sim_queue sent_q;
+  sim_can_stats stats;
+  uint32_t node_bps; // 0 for the panda's
+  int sce_pending;   // errors for the SCE IRQ
+} sim_can;
+
+sim_can sim_cans[SIM_CAN_MAX];
+
+int sim_queue_push(sim_queue *q, const sim_frame *f) {
+  if (q->len == SIM_QUEUE_LEN) return 0;
+  q->elems[(q->r_ptr + q->len) % SIM_QUEUE_LEN] = *f;
+  q->len += 1;
+  return 1;
+}
+
+int sim_queue_pop(sim_queue *q, sim_frame *f) {
+  if (q->len == 0) return 0;
+  if (f != NULL) *f = q->elems[q->r_ptr];
+  q->r_ptr = (q->r_ptr + 1) % SIM_QUEUE_LEN;
+  q->len -= 1;
+  return 1;
+}
+
+// the mailbox that goes next, by TXFP the oldest request and otherwise the
+// lowest id and then the lowest number. -1 if none is pending.
+int sim_can_tx_next(sim_can *c) {
+  int best = -1;
+  for (int m = 0; m < SIM_TX_MAILBOXES; m++) {
+    if (!c->pending[m]) continue;
+    if (best == -1) {
+      best = m;
+    } else if (c->regs->MCR & CAN_MCR_TXFP) {
+      if ((int32_t)(c->requested[m] - c->requested[best]) < 0) best = m;
+    } else if (can_arb_key(c->regs->sTxMailBox[m].TIR) < can_arb_key(c->regs->sTxMailBox[best].TIR)) {
+      best = m;
+    }
+  }
+  return best;
+}
+
+void sim_can_publish(sim_can *c) {
+  CAN_TypeDef *r = c->regs;
+
+  uint32_t msr = 0;
+  if (r->MCR & CAN_MCR_INRQ) msr |= CAN_MSR_INAK;
+  else if (r->MCR & CAN_MCR_SLEEP) msr |= CAN_MSR_SLAK;
+  r->MSR_[0] = c->msr = msr;
+
+  // CODE is the lowest empty mailbox. With none it would be the last to go,
+  // which the firmware doesn't look at. LOW isn't there.
+  uint32_t tsr = c->tsr_flags;
+  int code = -1;
+  for (int m = SIM_TX_MAILBOXES - 1; m >= 0; m--) {
+    if (c->pending[m]) continue;
+    tsr |= CAN_TSR_TME0 << m;
+    code = m;
+  }
+  if (code != -1) tsr |= (uint32_t)code << CAN_TSR_CODE_Pos;
+  r->TSR_[0] = c->tsr = tsr;
+
+  for (int f = 0; f < 2; f++) {
+    if (c->fifo_len[f] > 0) {
+      r->sFIFOMailBox[f].RIR = c->fifo[f][0].RIR;
+      r->sFIFOMailBox[f].RDTR = c->fifo[f][0].RDTR;
+      r->sFIFOMailBox[f].RDLR = c->fifo[f][0].RDLR;
+      r->sFIFOMailBox[f].RDHR = c->fifo[f][0].RDHR;
+    }
+    c->rfr[f] = c->fifo_len[f] | c->fifo_flags[f];
+  }
+  r->RF0R_[0] = c->rfr[0];
+  r->RF1R_[0] = c->rfr[1];
+}
+
+// takes what the firmware wrote since the last publish
+void sim_can_update(sim_can *c) {
+  CAN_TypeDef *r = c->regs;
+
+  uint32_t tsr = r->TSR_[0];
+  if (tsr != c->tsr) {
+    for (int m = 0; m < SIM_TX_MAILBOXES; m++) {
+      int shift = 8 * m;
+      if (tsr & (CAN_TSR_RQCP0 << shift)) c->tsr_flags &= ~(SIM_MAILBOX_FLAGS << shift);
+      // one on the bus goes on to the end
+      if ((tsr & (CAN_TSR_ABRQ0 << shift)) && c->pending[m] && c->wire_src != m) {
+        c->pending[m] = 0;
+        r->sTxMailBox[m].TIR &= ~CAN_TI0R_TXRQ;
+        c->tsr_flags = (c->tsr_flags & ~(SIM_MAILBOX_FLAGS << shift)) | (CAN_TSR_RQCP0 << shift);
+      }
+    }
+  }
+
+  for (int m = 0; m < SIM_TX_MAILBOXES; m++) {
+    if (!c->pending[m] && (r->sTxMailBox[m].TIR & CAN_TI0R_TXRQ)) {
+      c->pending[m] = 1;
+      c->requested[m] = c->requests++;
+    }
+  }
+
+  uint32_t rfr[2] = {r->RF0R_[0], r->RF1R_[0]};
+  for (int f = 0; f < 2; f++) {
+    if (rfr[f] == c->rfr[f]) continue;
+    if ((rfr[f] & CAN_RF0R_RFOM0) && c->fifo_len[f] > 0) {
+      for (int i = 1; i < c->fifo_len[f]; i++) c->fifo[f][i - 1] = c->fifo[f][i];
+      c->fifo_len[f] -= 1;
+    }
+    c->fifo_flags[f] &= ~(rfr[f] & (CAN_RF0R_FULL0 | CAN_RF0R_FOVR0));
+  }
+
+  sim_can_publish(c);
+}
+
+uint32_t sim_can_sync(void) {
+  for (int i = 0; i < SIM_CAN_MAX; i++) sim_can_update(&sim_cans[i]);
+  return 0;
+}
+
+uint32_t sim_can_rx_pending(volatile uint32_t *rfr) {
+  sim_can_sync();
+  for (int i = 0; i < SIM_CAN_MAX; i++) {
+    if (rfr == &sim_cans[i].regs->RF0R_[0]) return sim_cans[i].fifo_len[0] ? CAN_RF0R_FMP0_Msk : 0;
+    if (rfr == &sim_cans[i].regs->RF1R_[0]) return sim_cans[i].fifo_len[1] ? CAN_RF0R_FMP0_Msk : 0;
+  }
+  return 0;
+}
+
+uint64_t sim_can_frame_ns(sim_can *c, const sim_frame *f) {
+  uint32_t btr = c->regs->BTR;
+  uint64_t quanta = 1 + ((btr & CAN_BTR_TS1) >> CAN_BTR_TS1_Pos) + 1 + ((btr & CAN_BTR_TS2) >> CAN_BTR_TS2_Pos) + 1;
+  uint64_t bit_ds = ((btr & CAN_BTR_BRP) + 1) * quanta * 1000000;
+  return CAN_FRAME_BITS(f->RIR, f->RDTR) * bit_ds / CAN_PCLK;
+}
+
+// the FIFO a filter bank gives the frame, -1 if none takes it. Only the
+// 32 bit scale is there, the firmware doesn't use 16.
+int sim_can_filter(sim_can *c, uint32_t rir) {
+  CAN_TypeDef *f = c->filters;
+  if (f->FMR & CAN_FMR_FINIT) return -1;
+  int can2sb = (f->FMR & CAN_FMR_CAN2SB) >> CAN_FMR_CAN2SB_Pos;
+  int first = (c == &sim_cans[1]) ? can2sb : 0;
+  int last = (c == &sim_cans[0]) ? can2sb : 28;
+  rir &= ~1U;
+
+  int masked = -1;
+  for (int b = first; b < last; b++) {
+    uint32_t bit = 1U << b;
+    if (!(f->FA1R & bit) || !(f->FS1R & bit)) continue;
+    uint32_t fr1 = f->sFilterRegister[b].FR1;
+    uint32_t fr2 = f->sFilterRegister[b].FR2;
+    if (f->FM1R & bit) {
+      // ID list banks first, then the lowest numbered mask bank
+      if (rir == (fr1 & ~1U) || rir == (fr2 & ~1U)) return (f->FFA1R & bit) ? 1 : 0;
+    } else if (masked == -1 && ((rir ^ fr1) & fr2 & ~1U) == 0) {
+      masked = b;
+    }
+  }
+  if (masked == -1) return -1;
+  return (f->FFA1R & (1U << masked)) ? 1 : 0;
+}
+
+// the node's bit time when it's set and isn't the panda's to within a
+// percent, 0 otherwise
+uint64_t sim_can_other_bit_ns(sim_can *c, uint64_t bit_ns) {
+  if (c->node_bps == 0) return 0;
+  uint64_t node_ns = 1000000000ULL / c->node_bps;
+  uint64_t diff = (node_ns > bit_ns) ? (node_ns - bit_ns) : (bit_ns - node_ns);
+  return (diff * 100 > node_ns) ? node_ns : 0;
+}
+
+// a frame from the bus, or its own in loopback
+void sim_can_rx(sim_can *c, const sim_frame *f, uint64_t bit_time) {
+  int fifo = sim_can_filter(c, f->RIR);
+  if (fifo == -1) {
+    c->stats.filtered += 1;
+    return;
+  }
+
+  sim_frame rx = *f;
+  rx.RIR &= ~1U;
+  rx.RDTR = (f->RDTR & 0xF) | ((uint32_t)(bit_time & 0xFFFF) << 16);
+  if (c->fifo_len[fifo] < SIM_FIFO_LEN) {
+    c->fifo[fifo][c->fifo_len[fifo]++] = rx;
+    if (c->fifo_len[fifo] == SIM_FIFO_LEN) c->fifo_flags[fifo] |= CAN_RF0R_FULL0;
+  } else {
+    // without RFLM the newest goes over the last
+    c->fifo_flags[fifo] |= CAN_RF0R_FOVR0;
+    c->stats.fifo_overruns += 1;
+    if (!(c->regs->MCR & CAN_MCR_RFLM)) c->fifo[fifo][SIM_FIFO_LEN - 1] = rx;
+  }
+}
+
+int sim_can_running(sim_can *c) {
+  return (c->regs->MCR & (CAN_MCR_INRQ | CAN_MCR_SLEEP)) == 0;
+}
+
+// In silent mode it can't send. In loopback it takes its own frames and
+// not the bus's, and with silent too what it sends stays inside.
+uint64_t sim_can_next_event(sim_can *c) {
+  if (c->wire_src != -1) return c->wire_end;
+  if (!sim_can_running(c)) return UINT64_MAX;
+  uint32_t btr = c->regs->BTR;
+  int can_send = !(btr & CAN_BTR_SILM) || (btr & CAN_BTR_LBKM);
+  if (c->node_q.len == 0 && !(can_send && sim_can_tx_next(c) != -1)) return UINT64_MAX;
+  return (c->idle_at > sim_ns) ? c->idle_at : sim_ns;
+}
+
+void sim_can_event(sim_can *c) {
+  CAN_TypeDef *r = c->regs;
+  uint32_t btr = r->BTR;
+  uint64_t bit_ns = sim_can_frame_ns(c, &(sim_frame){.RIR = 0, .RDTR = 0}) / CAN_FRAME_BITS(0, 0);
+
+  if (c->wire_src == -1) {
+    // arbitration, the node's frame against the best mailbox
+    int can_send = !(btr & CAN_BTR_SILM) || (btr & CAN_BTR_LBKM);
+    int m = can_send ? sim_can_tx_next(c) : -1;
+    c->wire_src = SIM_NODE;
+    if (c->node_q.len > 0) c->wire = c->node_q.elems[c->node_q.r_ptr];
+    if (m != -1 && (c->node_q.len == 0 || can_arb_key(r->sTxMailBox[m].TIR) < can_arb_key(c->wire.RIR))) {
+      c->wire_src = m;
+      c->wire.RIR = r->sTxMailBox[m].TIR;
+      c->wire.RDTR = r->sTxMailBox[m].TDTR & 0xF;
+      c->wire.RDLR = r->sTxMailBox[m].TDLR;
+      c->wire.RDHR = r->sTxMailBox[m].TDHR;
+    } else if (m != -1 && (r->MCR & CAN_MCR_NART)) {
+      // lost arbitration, with NART that was its one try
+      int shift = 8 * m;
+      c->pending[m] = 0;
+      r->sTxMailBox[m].TIR &= ~CAN_TI0R_TXRQ;
+      c->tsr_flags = (c->tsr_flags & ~(SIM_MAILBOX_FLAGS << shift)) | ((CAN_TSR_RQCP0 | CAN_TSR_ALST0) << shift);
+      c->stats.arb_lost += 1;
+      sim_can_publish(c);
+    }
+    c->wire_start = sim_ns;
+    c->wire_end = sim_ns + sim_can_frame_ns(c, &c->wire);
+    if (c->wire_src == SIM_NODE && sim_can_other_bit_ns(c, bit_ns) != 0) {
+      c->wire_end = sim_ns + (CAN_FRAME_BITS(c->wire.RIR, c->wire.RDTR) * sim_can_other_bit_ns(c, bit_ns));
+    }
+    return;
+  }
+
+  // the end of the frame on the bus
+  sim_frame f = c->wire;
+  f.RIR &= ~1U;
+  f.time_ns = sim_ns;
+  uint64_t bit_time = bit_ns ? (c->wire_start / bit_ns) : 0;
+  uint64_t node_bit_ns = sim_can_other_bit_ns(c, bit_ns);
+  if (c->wire_src == SIM_NODE && node_bit_ns != 0) {
+    // at the wrong bitrate it's a stuff error to the panda
+    sim_queue_pop(&c->node_q, NULL);
+    c->stats.sent += 1;
+    if (sim_can_running(c)) {
+      c->stats.bus_errors += 1;
+      r->ESR = (r->ESR & ~CAN_ESR_LEC) | CAN_ESR_LEC_0;
+      if ((r->IER & (CAN_IER_ERRIE | CAN_IER_LECIE)) == (CAN_IER_ERRIE | CAN_IER_LECIE)) c->sce_pending += 1;
+    }
+    bit_ns = node_bit_ns;
+  } else if (c->wire_src == SIM_NODE) {
+    sim_queue_pop(&c->node_q, NULL);
+    c->stats.sent += 1;
+    if (!(btr & CAN_BTR_LBKM)) sim_can_rx(c, &f, bit_time);
+  } else {
+    int shift = 8 * c->wire_src;
+    c->pending[c->wire_src] = 0;
+    r->sTxMailBox[c->wire_src].TIR &= ~CAN_TI0R_TXRQ;
+    c->tsr_flags = (c->tsr_flags & ~(SIM_MAILBOX_FLAGS << shift)) | ((CAN_TSR_RQCP0 | CAN_TSR_TXOK0) << shift);
+    if (!(btr & CAN_BTR_SILM)) {
+      c->stats.received += 1;
+      if (!sim_queue_push(&c->sent_q, &f)) c->stats.log_drops += 1;
+    }
+    if (btr & CAN_BTR_LBKM) sim_can_rx(c, &f, bit_time);
+  }
+  c->stats.busy_ns += c->wire_end - c->wire_start;
+  c->idle_at = c->wire_end + (SIM_INTERMISSION_BITS * bit_ns);
+  c->wire_src = -1;
+  sim_can_publish(c);
+}
+
+// ***************************** IRQs *****************************
+
+typedef void (*sim_handler)(void);
+
+int sim_pendsv_held = 0;
+
+// in the NVIC's order, which goes first among the same priority
+int sim_irq_take(void) {
+  sim_can_sync();
+  TIM_TypeDef *t = sim_tim2();
+
+  for (int i = 0; i < SIM_CAN_MAX; i++) {
+    sim_can *c = &sim_cans[i];
+    uint32_t ier = c->regs->IER;
+    const sim_handler tx[] = {CAN1_TX_IRQHandler, CAN2_TX_IRQHandler, CAN3_TX_IRQHandler};
+    const sim_handler rx0[] = {CAN1_RX0_IRQHandler, CAN2_RX0_IRQHandler, CAN3_RX0_IRQHandler};
+    const sim_handler rx1[] = {CAN1_RX1_IRQHandler, CAN2_RX1_IRQHandler, CAN3_RX1_IRQHandler};
+    const sim_handler sce[] = {CAN1_SCE_IRQHandler, CAN2_SCE_IRQHandler, CAN3_SCE_IRQHandler};
+    if ((ier & CAN_IER_TMEIE) && (c->tsr_flags & (CAN_TSR_RQCP0 | CAN_TSR_RQCP1 | CAN_TSR_RQCP2)) &&
+        sim_nvic_is_enabled(c->tx_irq)) {
+      tx[i]();
+      return 1;
+    }
+    if ((ier & CAN_IER_FMPIE0) && c->fifo_len[0] > 0 && sim_nvic_is_enabled(c->rx_irq[0])) {
+      rx0[i]();
+      return 1;
+    }
+    if ((ier & CAN_IER_FMPIE1) && c->fifo_len[1] > 0 && sim_nvic_is_enabled(c->rx_irq[1])) {
+      rx1[i]();
+      return 1;
+    }
+    // the errors since LECIE went off are gone
+    if ((ier & (CAN_IER_ERRIE | CAN_IER_LECIE)) != (CAN_IER_ERRIE | CAN_IER_LECIE)) c->sce_pending = 0;
+    if (c->sce_pending > 0 && sim_nvic_is_enabled(c->sce_irq)) {
+      c->sce_pending -= 1;
+      sce[i]();
+      return 1;
+    }
+  }
+
+  if ((sim_tim2_flags & t->DIER & SIM_TIM2_CC_FLAGS) && sim_nvic_is_enabled(TIM2_IRQn)) {
+    TIM2_IRQHandler();
+    return 1;
+  }
+
+  // the lowest priority, and pending is cleared on the way in
+  if ((SCB->ICSR & SCB_ICSR_PENDSVSET_Msk) && !sim_pendsv_held) {
+    SCB->ICSR &= ~SCB_ICSR_PENDSVSET_Msk;
+    PendSV_Handler();
+    return 1;
+  }
+  return 0;
+}
+
+// a handler that leaves its IRQ pending would go on forever
+#define SIM_IRQ_MAX 100000
+
+void sim_irqs(void) {
+  for (int n = 0; !sim_primask; n++) {
+    if (!sim_irq_take()) return;
+    if (n == SIM_IRQ_MAX) sim_reset();
+  }
+}
+
+// ***************************** API *****************************
+
+int sim_init(void) {
+  for (unsigned int i = 0; i < sizeof(sim_regions) / sizeof(sim_regions[0]); i++) {
+    void *p = mmap((void *)sim_regions[i].base, sim_regions[i].len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    if (p != (void *)sim_regions[i].base) return -1;
+  }
+
+  CAN_TypeDef *regs[SIM_CAN_MAX] = {CAN1, CAN2, CAN3};
+  const IRQn_Type irqs[SIM_CAN_MAX][4] = {
+    {CAN1_TX_IRQn, CAN1_RX0_IRQn, CAN1_RX1_IRQn, CAN1_SCE_IRQn},
+    {CAN2_TX_IRQn, CAN2_RX0_IRQn, CAN2_RX1_IRQn, CAN2_SCE_IRQn},
+    {CAN3_TX_IRQn, CAN3_RX0_IRQn, CAN3_RX1_IRQn, CAN3_SCE_IRQn},
+  };
+  for (int i = 0; i < SIM_CAN_MAX; i++) {
+    sim_can *c = &sim_cans[i];
+    c->regs = regs[i];
+    c->filters = (i == 2) ? CAN3 : CAN1;
+    c->tx_irq = irqs[i][0];
+    c->rx_irq[0] = irqs[i][1];
+    c->rx_irq[1] = irqs[i][2];
+    c->sce_irq = irqs[i][3];
+    c->wire_src = -1;
+    // reset values
+    c->regs->MCR = CAN_MCR_SLEEP | CAN_MCR_DBF;
+    c->regs->BTR = 0x01230000;
+    c->regs->FMR = 0x2A1C0E01;
+    sim_can_publish(c);
+  }
+
+  // main, after the hardware
+  safety_set_mode(SAFETY_NOOUTPUT, 0);
+  can_silent = ALL_CAN_SILENT;
+  can_periodic_init();
+  can_tx_defer_init();
+  can_init_all();
+  tick_init();
+  __enable_irq();
+  sim_irqs();
+  return 0;
+}
+
+void sim_ignition(int on) {
+  uint32_t idr = on ? (GPIOA->IDR & ~(1U << 1)) : (GPIOA->IDR | (1U << 1));
+  if (idr == GPIOA->IDR) return;
+  GPIOA->IDR = idr;
+  // both edges, PR isn't kept as it's write 1 to clear
+  if ((EXTI->IMR & (1U << 1)) && sim_nvic_is_enabled(EXTI1_IRQn)) {
+    __disable_irq();
+    EXTI1_IRQHandler();
+    __enable_irq();
+    sim_irqs();
+  }
+}
+
+// full speed USB's frames
+#define SIM_SOF_NS 1000000ULL
+
+// the OTG IRQ of a SOF, which the host's frames always have
+void sim_sof(void) {
+  if (!sim_primask) {
+    __disable_irq();
+    usb_cb_sof();
+    __enable_irq();
+  }
+}
+
+// what the main loop does when an IRQ or its tick wakes it, without the
+// housekeeping of the tick
+void sim_main_loop(void) {
+  tick_pending = 0;
+  ctrl_defer_service();
+  can_autobaud_service();
+  sim_irqs();
+}
+
+uint64_t sim_now_ns(void) {
+  return sim_ns;
+}
+
+void sim_run(uint64_t until_ns) {
+  while (1) {
+    sim_irqs();
+    if (tick_pending) sim_main_loop();
+
+    uint64_t next = UINT64_MAX;
+    sim_can *next_can = NULL;
+    for (int i = 0; i < SIM_CAN_MAX; i++) {
+      uint64_t t = sim_can_next_event(&sim_cans[i]);
+      if (t < next) {
+        next = t;
+        next_can = &sim_cans[i];
+      }
+    }
+    uint32_t flags = 0;
+    uint64_t timer = sim_tim2_next(&flags);
+    // first on a tie, after the CAN event the count would be at CCRx
+    if (timer <= next) next_can = NULL;
+    if (timer <= next) next = timer;
+    // a SOF every ms while the firmware has the IRQ on, first on a tie
+    uint64_t sof = (USBx->GINTMSK & USB_OTG_GINTMSK_SOFM) ? ((sim_ns / SIM_SOF_NS) + 1) * SIM_SOF_NS : UINT64_MAX;
+    int is_sof = sof <= next;
+    if (is_sof) next = sof;
+    if (next > until_ns) break;
+
+    sim_ns = next;
+    if (is_sof) {
+      sim_sof();
+    } else if (next_can != NULL) {
+      sim_can_event(next_can);
+    } else {
+      sim_tim2();
+      sim_tim2_flags |= flags;
+    }
+  }
+  if (until_ns > sim_ns) sim_ns = until_ns;
+  sim_irqs();
+}
+
+int sim_can_send(int can_number, uint32_t RIR, uint32_t RDTR, uint32_t RDLR, uint32_t RDHR) {
+  if (can_number < 0 || can_number >= SIM_CAN_MAX) return 0;
+  sim_frame f = {.RIR = RIR, .RDTR = RDTR, .RDLR = RDLR, .RDHR = RDHR, .time_ns = 0};
+  return sim_queue_push(&sim_cans[can_number].node_q, &f);
+}
+
+void sim_can_set_node_bitrate(int can_number, uint32_t bps) {
+  if (can_number < 0 || can_number >= SIM_CAN_MAX) return;
+  sim_cans[can_number].node_bps = bps;
+}
+
+int sim_can_recv(int can_number, sim_frame *f) {
+  if (can_number < 0 || can_number >= SIM_CAN_MAX) return 0;
+  return sim_queue_pop(&sim_cans[can_number].sent_q, f);
+}
+
+void sim_can_get_stats(int can_number, sim_can_stats *stats) {
+  if (can_number < 0 || can_number >= SIM_CAN_MAX) return;
+  *stats = sim_cans[can_number].stats;
+}
+
+int sim_usb_control(uint8_t request, uint16_t value, uint16_t index, uint16_t length, uint8_t *resp) {
+  USB_Setup_TypeDef s;
+  s.b.bmRequestType = length ? 0xC0 : 0x40;
+  s.b.bRequest = request;
+  s.b.wValue.w = value;
+  s.b.wIndex.w = index;
+  s.b.wLength.w = length;
+  int len = usb_cb_control_msg(&s, resp, 1);
+  sim_irqs();
+  // the main loop, woken by the IRQ
+  sim_main_loop();
+  return len;
+}
+
+int sim_usb_ep1_in(uint8_t *buf, int len) {
+  int ret = usb_cb_ep1_in(buf, len, 1);
+  sim_irqs();
+  return ret;
+}
+
+void sim_usb_ep2_out(const uint8_t *buf, int len) {
+  usb_cb_ep2_out((uint8_t *)buf, len, 1);
+  sim_irqs();
+}
+
+int sim_usb_ep2_in(uint8_t *buf, int len) {
+  int ret = usb_cb_ep2_in(buf, len, 1);
+  sim_irqs();
+  return ret;
+}
+
+void sim_usb_ep3_out(const uint8_t *buf, int len) {
+  usb_cb_ep3_out((uint8_t *)buf, len, 1);
+  sim_irqs();
+}
+
+void sim_usb_ep1_out(const uint8_t *buf, int len) {
+  usb_cb_ep1_out((uint8_t *)buf, len, 1);
+  sim_irqs();
+}
+
+void sim_pendsv_hold(int on) {
+  sim_pendsv_held = on;
+  sim_irqs();
+}
+
+void sim_usb_set_interface(int alt) {
+  usb_set_interface(alt);
+  sim_irqs();
+}
+
+int sim_usb_out_ready(int ep) {
+  switch (ep) {
+    case 1: return !ep1_out_paused;
+    case 2: return !ep2_paused;
+    case 3: return !ep3_paused;
+    default: return 1;
+  }
+}
+
+int sim_debug_getc(char *c) {
+  return getc(&debug_ring, c);
+}
@@ -0,0 +1,89 @@
+// The firmware built for the host, on simulated bxCANs and a simulated
+// clock. sim.c is main.c and its drivers with the peripherals in memory,
+// this is all the rest of the program sees of it.
+//
+// Time only moves in sim_run, the firmware takes none. Each CAN is on a
+// bus of its own with one other node, which sends what sim_can_send queues,
+// sees everything the panda sends and acknowledges every frame. With NART a
+// mailbox that loses arbitration to the node is done without TXOK. Frames take
+// their CAN_FRAME_BITS at the bitrate in BTR, with 3 bits between them.
+// IRQs run between bus events, while the firmware has them enabled in the
+// NVIC and isn't in a critical section, PendSV after all the others. USB
+// calls go straight to the firmware's callbacks, as the OTG IRQ would make
+// them, as does a SOF every ms while the firmware has its IRQ on. A control request the firmware
+// defers is done before sim_usb_control returns, as the main loop would
+// after the IRQ. The main loop's deferred work also runs on
+// each of its ticks, its housekeeping doesn't. The steps of an ESP reset
+// aren't done.
+#include <stdint.h>
+
+#define SIM_CAN_MAX 3
+// frames each node's queue and each sent log hold
+#define SIM_QUEUE_LEN 4096
+
+typedef struct {
+  uint32_t RIR;
+  uint32_t RDTR;
+  uint32_t RDLR;
+  uint32_t RDHR;
+  uint64_t time_ns; // when it was done on the bus, for sim_can_recv
+} sim_frame;
+
+typedef struct {
+  uint64_t sent;          // by the node
+  uint64_t received;      // by the node, from the panda
+  uint64_t fifo_overruns; // received by the bxCAN with its FIFO full, lost
+  uint64_t filtered;      // received by the bxCAN and no filter took it
+  uint64_t log_drops;     // sent by the panda with the sent log full
+  uint64_t arb_lost;      // a one-shot mailbox of the panda's, beaten by the node
+  uint64_t bus_errors;    // the node's frames at a bitrate the panda isn't at
+  uint64_t busy_ns;       // the bus was carrying a frame
+} sim_can_stats;
+
+// Maps the peripherals and starts the firmware as main does, without the
+// clocks, GPIOs, UARTs, USB, SPI and the main loop. Everything is silent with NOOUTPUT
+// after it, like a panda that just booted. Returns -1 if the addresses of
+// the peripherals aren't free in this process.
+int sim_init(void);
+
+uint64_t sim_now_ns(void);
+// Runs the buses and IRQs until the time, which is then TIM2->CNT.
+void sim_run(uint64_t until_ns);
+
+// Queues a frame for the node on the CAN, it goes when the bus is free and
+// it wins arbitration. 0 if the queue is full.
+int sim_can_send(int can_number, uint32_t RIR, uint32_t RDTR, uint32_t RDLR, uint32_t RDHR);
+// The node's bitrate from then on, 0 for whatever the panda's is. A frame of
+// the node's at another one is an error to the panda, a stuff error in LEC
+// and the SCE IRQ with LECIE, and isn't received.
+void sim_can_set_node_bitrate(int can_number, uint32_t bps);
+// The oldest frame the panda sent on the CAN, 0 if there's none.
+int sim_can_recv(int can_number, sim_frame *f);
+void sim_can_get_stats(int can_number, sim_can_stats *stats);
+
+// The USB endpoints, hardwired. For IN the length of what the firmware
+// filled, at most len.
+int sim_usb_control(uint8_t request, uint16_t value, uint16_t index, uint16_t length, uint8_t *resp);
+int sim_usb_ep1_in(uint8_t *buf, int len);
+void sim_usb_ep2_out(const uint8_t *buf, int len);
+int sim_usb_ep2_in(uint8_t *buf, int len);
+void sim_usb_ep3_out(const uint8_t *buf, int len);
+// alt 2 only
+void sim_usb_ep1_out(const uint8_t *buf, int len);
+// As SET_INTERFACE would.
+void sim_usb_set_interface(int alt);
+// 0 while the OUT endpoint is NAKing, it's held off after a packet.
+int sim_usb_out_ready(int ep);
+// PendSV, which sends the CAN tx USB staged, waits while on, as it would
+// behind a run of USB IRQs.
+void sim_pendsv_hold(int on);
+
+// Sets the started line, low on PA1 while on, and runs its EXTI on the edge
+// if it's enabled.
+void sim_ignition(int on);
+
+// What the firmware puts, taking it out of its debug ring. 0 when empty.
+int sim_debug_getc(char *c);
+
+// Called when the firmware resets itself, it doesn't return.
+void sim_reset(void) __attribute__((noreturn));
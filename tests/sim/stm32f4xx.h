@@ -0,0 +1,95 @@
+// The ST header for the host build of the firmware, found before board/inc's.
+// The peripherals stay at the addresses ST gives them, sim.c maps memory
+// there. What's swapped for the simulation's is the Cortex-M intrinsics,
+// which are ARM asm, and the bxCAN status registers, whose reads and writes
+// have side effects plain memory doesn't.
+#include <stdint.h>
+
+// cmsis_gcc.h is the ARM asm, these take its place
+#define __CMSIS_GCC_H
+
+// set by __disable_irq, sim.c only takes interrupts while it's clear
+extern volatile uint32_t sim_primask;
+
+static inline __attribute__((always_inline)) void __enable_irq(void) { sim_primask = 0; }
+static inline __attribute__((always_inline)) void __disable_irq(void) { sim_primask = 1; }
+static inline __attribute__((always_inline)) uint32_t __get_PRIMASK(void) { return sim_primask; }
+static inline __attribute__((always_inline)) void __set_PRIMASK(uint32_t primask) { sim_primask = primask; }
+static inline __attribute__((always_inline)) void __DMB(void) { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+static inline __attribute__((always_inline)) void __DSB(void) { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+static inline __attribute__((always_inline)) void __ISB(void) { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+static inline __attribute__((always_inline)) void __NOP(void) { }
+static inline __attribute__((always_inline)) void __WFI(void) { }
+static inline __attribute__((always_inline)) uint32_t __REV(uint32_t value) { return __builtin_bswap32(value); }
+static inline __attribute__((always_inline)) uint32_t __LDREXW(volatile uint32_t *addr) { return *addr; }
+static inline __attribute__((always_inline)) uint32_t __STREXW(uint32_t value, volatile uint32_t *addr) { *addr = value; return 0; }
+#define __CLZ __builtin_clz
+
+// ISER and ICER are write 1 to set and clear, sim.c keeps the enables.
+// There's no reset, sim.c stops.
+#define NVIC_EnableIRQ cmsis_NVIC_EnableIRQ
+#define NVIC_DisableIRQ cmsis_NVIC_DisableIRQ
+#define NVIC_SystemReset cmsis_NVIC_SystemReset
+// the layout is ST's, below with the status registers renamed
+#define CAN_TypeDef st_CAN_TypeDef
+
+#include "../../board/inc/stm32f4xx.h"
+
+#undef NVIC_EnableIRQ
+#undef NVIC_DisableIRQ
+#undef NVIC_SystemReset
+#undef CAN_TypeDef
+
+void NVIC_EnableIRQ(IRQn_Type IRQn);
+void NVIC_DisableIRQ(IRQn_Type IRQn);
+void NVIC_SystemReset(void) __attribute__((noreturn));
+
+// TIM2 is the clock, CNT is the simulated time. Its SR is write 0 to clear
+// and EGR makes compare events, so each use of it first takes what the
+// firmware wrote.
+TIM_TypeDef *sim_tim2(void);
+#undef TIM2
+#define TIM2 sim_tim2()
+
+typedef struct
+{
+  __IO uint32_t              MCR;
+  __IO uint32_t              MSR_[1];
+  __IO uint32_t              TSR_[1];
+  __IO uint32_t              RF0R_[1];
+  __IO uint32_t              RF1R_[1];
+  __IO uint32_t              IER;
+  __IO uint32_t              ESR;
+  __IO uint32_t              BTR;
+  uint32_t                   RESERVED0[88];
+  CAN_TxMailBox_TypeDef      sTxMailBox[3];
+  CAN_FIFOMailBox_TypeDef    sFIFOMailBox[2];
+  uint32_t                   RESERVED1[12];
+  __IO uint32_t              FMR;
+  __IO uint32_t              FM1R;
+  uint32_t                   RESERVED2;
+  __IO uint32_t              FS1R;
+  uint32_t                   RESERVED3;
+  __IO uint32_t              FFA1R;
+  uint32_t                   RESERVED4;
+  __IO uint32_t              FA1R;
+  uint32_t                   RESERVED5[8];
+  CAN_FilterRegister_TypeDef sFilterRegister[28];
+} CAN_TypeDef;
+
+_Static_assert(sizeof(CAN_TypeDef) == sizeof(st_CAN_TypeDef), "CAN_TypeDef must keep ST's layout");
+
+// Every access to these first brings the bxCAN model up to date with what
+// the firmware wrote since the last one: the write 1 to clear bits, TXRQ,
+// aborts, INRQ and releasing a FIFO mailbox. Then it's the register again.
+uint32_t sim_can_sync(void);
+#define MSR MSR_[sim_can_sync()]
+#define TSR TSR_[sim_can_sync()]
+#define RF0R RF0R_[sim_can_sync()]
+#define RF1R RF1R_[sim_can_sync()]
+
+// can_rx keeps a pointer to RF0R or RF1R, so its loop gets the FIFO synced
+// here. 0 once the FIFO is empty, whichever side of the & reads first.
+uint32_t sim_can_rx_pending(volatile uint32_t *rfr);
+#undef CAN_RF0R_FMP0
+#define CAN_RF0R_FMP0 sim_can_rx_pending(RFR)
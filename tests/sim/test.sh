@@ -0,0 +1,68 @@
+#!/usr/bin/env sh
+set -e
+make can_sim
+
+# the host keeping up, then falling behind, on every bus
+./can_sim -s rx -t 2000
+./can_sim -s rx -t 2000 -b 1
+./can_sim -s tx -t 2000 -r 2000
+./can_sim -s tx -t 2000
+
+# the same without TXFP, every frame of a bus has one id and still goes in order
+./can_sim -s tx -t 2000 -r 2000 -q
+./can_sim -s tx -t 2000 -q
+
+# TX completions with their tokens instead of echoes, then no echoes
+./can_sim -s tx -t 2000 -r 2000 -e 1
+./can_sim -s tx -t 2000 -e 2
+
+# ISO-TP both ways, back to back, then with the node asking for 300 us
+./can_sim -s isotp -t 2000
+./can_sim -s isotp -t 2000 -r 0xf3
+
+# the RX IRQs coalesced under load, with the host keeping up and falling behind
+./can_sim -s rx -t 2000 -r 4000 -c 1000
+./can_sim -s rx -t 2000 -r 4000 -b 1 -c 1000
+./can_sim -s isotp -t 2000 -c 1000
+
+# the per id stats, at a rate on every bus, then ISO-TP's
+./can_sim -s rx -t 2000 -r 2000 -i
+./can_sim -s isotp -t 2000 -i
+
+# CAN2 to GMLAN and back, then every bus has to work as before
+./can_sim -s rx -t 2000 -r 2000 -g 4
+./can_sim -s tx -t 2000 -r 2000 -g 4
+
+# bus 0's bitrate changed under load, only its CAN reconfigured
+./can_sim -s rx -t 2000 -r 2000 -k 8
+
+# one-shot TX against a node that wins arbitration, failed frames reported
+./can_sim -s tx -t 2000 -r 2000 -o 500
+./can_sim -s tx -t 2000 -r 2000 -o 500 -e 1
+
+# transmit groups, every bus's frame at once however ep3 split them, now and at a time
+./can_sim -s group -t 2000
+
+# the ignition's edges in the event stream, merged with every bus under load
+./can_sim -s rx -t 2000 -r 2000 -x 10
+
+# ECU emulation, requests answered from the RX IRQ at their time, the others ignored
+./can_sim -s ecu -t 2000 -r 300
+
+# alt 2's tx lanes, the last bus too slow for -r held off on ep3 while bus 0 on ep1 never is
+./can_sim -s tx -t 2000 -r 1500 -l
+
+# gateway rules from bus 0, forwarded, rewritten, rate limited and dropped, and loaded again under way
+./can_sim -s gateway -t 2000
+
+# bitrates found listen-only on two busy buses, 1 Mbps and 83.3 kbps, and a quiet one left as it was
+./can_sim -s autobaud -t 100
+
+# ep1 IN immediate, filled to 4 frames, held to a 2 ms deadline and SOF aligned, every frame within its bound
+./can_sim -s flush -t 2000
+
+# ep3 bursts staged while PendSV is held behind the USB IRQs, NAKed at the ring's length, RX read all along and every frame sent in order
+./can_sim -s defer -t 2000
+
+# the filter banks built again for each safety mode, its rx ids taken and its forwarded bus unfiltered
+./can_sim -s filters -t 10
@@ -0,0 +1,24 @@
+#!/usr/bin/env python
+from __future__ import print_function
+import os
+import sys
+import time
+
+sys.path.append(os.path.join(os.path.dirname(os.path.realpath(__file__)), ".."))
+from panda import Panda
+
+# prints the panda's trace log as it's written, LEVEL picks how much it keeps
+if __name__ == "__main__":
+  panda = Panda(os.getenv("SERIAL"))
+  if os.getenv("LEVEL") is not None:
+    panda.set_trace_level(int(os.getenv("LEVEL")))
+
+  start = 0
+  while True:
+    records, nxt = panda.trace_read(start)
+    for r in records:
+      if r[0] != start:
+        print("... %d records lost" % ((r[0] - start) & 0xFFFFFFFF))
+      print(Panda.trace_format(r))
+      start = (r[0] + 1) & 0xFFFFFFFF
+    time.sleep(0.1)